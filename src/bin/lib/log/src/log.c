@@ -20,6 +20,8 @@
  * IN THE SOFTWARE.
  */
 
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -28,6 +30,24 @@
 
 #include "log.h"
 
+/*
+ * In asynchronous mode, log_log() formats the message into a preallocated
+ * ring buffer entry, and a writer thread drains the ring buffer to stderr and
+ * the log file. When the ring buffer is full, messages are dropped and
+ * counted, and the writer thread reports how many were dropped. ERROR and
+ * FATAL messages are never dropped, see log_vlog.
+ */
+#define LOG_RING_SIZE 1024
+#define LOG_MESSAGE_MAXLEN 2048
+
+typedef struct log_Entry {
+  int level;
+  time_t time;
+  const char *file;
+  int line;
+  char message[LOG_MESSAGE_MAXLEN];
+} log_Entry;
+
 static struct {
   void *udata;
   log_LockFn lock;
@@ -35,7 +55,25 @@ static struct {
   int level;
   int quiet;
   int useColors;
-} L;
+  int format;
+
+  /* asynchronous mode */
+  int async;
+  int stopping;
+  pthread_t writer;
+  pthread_mutex_t mutex;         /* protects the ring buffer */
+  pthread_mutex_t writeMutex;    /* serializes writing the messages */
+  pthread_cond_t cond;
+  log_Entry *ring;
+  unsigned long head;           /* next entry to write to */
+  unsigned long tail;           /* next entry to drain */
+  unsigned long dropped;        /* total count of dropped messages */
+  unsigned long droppedReported;
+} L = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .writeMutex = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER
+};
 
 
 static const char *level_names[] = {
@@ -90,68 +128,452 @@ void log_use_colors(int enable) {
   L.useColors = enable ? 1 : 0;
 }
 
-void log_log(int level, const char *file, int line, const char *fmt, ...)
-{
-	time_t t;
-	struct tm *lt;
 
-  if (level < L.level) {
+void log_set_format(int format) {
+  L.format = format;
+}
+
+
+/*
+ * Formatting the time is expensive, and most log lines are written in the
+ * same second as the previous one, so we cache the formatted strings. The
+ * cache is only used with L.writeMutex held in asynchronous mode, and by the
+ * callers of log_log() otherwise.
+ */
+static struct {
+  time_t time;
+  char shortTime[16];           /* for stderr */
+  char longTime[32];            /* for the log file */
+  char isoTime[32];             /* for the JSON format */
+} T = { (time_t) -1, { 0 }, { 0 }, { 0 } };
+
+static void format_time(time_t t) {
+  struct tm lt;
+
+  if (t == T.time) {
     return;
   }
 
-  /* Acquire lock */
-  lock();
+  localtime_r(&t, &lt);
+
+  T.shortTime[strftime(T.shortTime, sizeof(T.shortTime), "%H:%M:%S", &lt)] = '\0';
+  T.longTime[strftime(T.longTime, sizeof(T.longTime), "%Y-%m-%d %H:%M:%S", &lt)] = '\0';
+  T.isoTime[strftime(T.isoTime, sizeof(T.isoTime), "%Y-%m-%dT%H:%M:%S%z", &lt)] = '\0';
 
-  /* Get current time */
-  t = time(NULL);
-  lt = localtime(&t);
+  T.time = t;
+}
+
+
+/*
+ * write_json_line writes a log message as a JSON object on a single line, so
+ * that log pipelines don't have to parse our text format.
+ */
+static void write_json_line(FILE *out, int level, const char *file, int line,
+                            const char *message) {
+  const char *ptr = NULL;
+
+  fprintf(out, "{\"time\":\"%s\",\"level\":\"%s\",\"file\":\"%s\","
+               "\"line\":%d,\"message\":\"",
+          T.isoTime, level_names[level], file, line);
+
+  for (ptr = message; *ptr != '\0'; ptr++) {
+    unsigned char c = (unsigned char) *ptr;
+
+    switch (c) {
+      case '"':  fputs("\\\"", out); break;
+      case '\\': fputs("\\\\", out); break;
+      case '\n': fputs("\\n", out);  break;
+      case '\t': fputs("\\t", out);  break;
+      default:
+        if (c < 0x20) {
+          fprintf(out, "\\u%04x", c);
+        } else {
+          fputc(c, out);
+        }
+        break;
+    }
+  }
+
+  fputs("\"}\n", out);
+}
+
+
+/*
+ * write_message writes an already formatted log message to stderr and to the
+ * log file.
+ */
+static void write_message(int level, time_t t, const char *file, int line,
+                          const char *message) {
+  format_time(t);
 
   /* Log to stderr */
   if (!L.quiet) {
-    va_list args;
-    char buf[16];
-	int showLineNumber = L.level <= 1;
-
-    buf[strftime(buf, sizeof(buf), "%H:%M:%S", lt)] = '\0';
-
-	if (L.useColors)
-	{
-		fprintf(stderr, "%s %s%-5s\x1b[0m ", buf, level_colors[level],
-				level_names[level]);
-
-		if (showLineNumber)
-		{
-			fprintf(stderr, "\x1b[90m%s:%d:\x1b[0m ", file, line);
-		}
-	}
-	else
-	{
-		fprintf(stderr, "%s %-5s ", buf, level_names[level]);
-
-		if (showLineNumber)
-		{
-			fprintf(stderr, "%s:%d ", file, line);
-		}
-	}
-
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fprintf(stderr, "\n");
+    int showLineNumber = L.level <= 1;
+
+    if (L.format == LOG_FORMAT_JSON) {
+      write_json_line(stderr, level, file, line, message);
+    } else if (L.useColors) {
+      fprintf(stderr, "%s %s%-5s\x1b[0m ", T.shortTime, level_colors[level],
+              level_names[level]);
+
+      if (showLineNumber) {
+        fprintf(stderr, "\x1b[90m%s:%d:\x1b[0m ", file, line);
+      }
+      fprintf(stderr, "%s\n", message);
+    } else {
+      fprintf(stderr, "%s %-5s ", T.shortTime, level_names[level]);
+
+      if (showLineNumber) {
+        fprintf(stderr, "%s:%d ", file, line);
+      }
+      fprintf(stderr, "%s\n", message);
+    }
   }
 
   /* Log to file */
   if (L.fp) {
-    va_list args;
-    char buf[32];
-    buf[strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", lt)] = '\0';
-    fprintf(L.fp, "%s %-5s %s:%d: ", buf, level_names[level], file, line);
-    va_start(args, fmt);
-    vfprintf(L.fp, fmt, args);
-    va_end(args);
-    fprintf(L.fp, "\n");
+    if (L.format == LOG_FORMAT_JSON) {
+      write_json_line(L.fp, level, file, line, message);
+    } else {
+      fprintf(L.fp, "%s %-5s %s:%d: %s\n",
+              T.longTime, level_names[level], file, line, message);
+    }
+  }
+}
+
+
+/*
+ * log_writer_main is the main function of the writer thread. It drains the
+ * ring buffer until we're asked to stop and the ring buffer is empty.
+ */
+static void *log_writer_main(void *arg) {
+  log_Entry *entry = (log_Entry *) malloc(sizeof(log_Entry));
+
+  if (entry == NULL) {
+    return NULL;
+  }
+
+  for (;;) {
+    unsigned long dropped = 0;
+    int hasEntry = 0;
+
+    pthread_mutex_lock(&L.mutex);
+
+    while (L.head == L.tail && L.dropped == L.droppedReported && !L.stopping) {
+      pthread_cond_wait(&L.cond, &L.mutex);
+    }
+
+    if (L.head != L.tail) {
+      /* copy the entry so that we write it without holding the lock */
+      memcpy(entry, &(L.ring[L.tail % LOG_RING_SIZE]), sizeof(log_Entry));
+      L.tail++;
+      hasEntry = 1;
+    } else if (L.dropped != L.droppedReported) {
+      /* messages were dropped after the ones we just wrote */
+      dropped = L.dropped - L.droppedReported;
+      L.droppedReported = L.dropped;
+    } else if (L.stopping) {
+      pthread_mutex_unlock(&L.mutex);
+      break;
+    }
+
+    pthread_mutex_unlock(&L.mutex);
+
+    pthread_mutex_lock(&L.writeMutex);
+
+    if (dropped > 0) {
+      char message[128];
+
+      snprintf(message, sizeof(message),
+               "%lu log messages were dropped because the log buffer "
+               "was full", dropped);
+
+      write_message(LOG_WARN, time(NULL), "log.c", __LINE__, message);
+    }
+
+    if (hasEntry) {
+      write_message(entry->level, entry->time, entry->file, entry->line,
+                    entry->message);
+    }
+
+    if (L.fp) {
+      fflush(L.fp);
+    }
+
+    pthread_mutex_unlock(&L.writeMutex);
+  }
+
+  free(entry);
+
+  return NULL;
+}
+
+
+/*
+ * log_stop_async stops the writer thread once it has written all the
+ * messages in the ring buffer, and switches back to synchronous logging. It is
+ * registered with atexit() so that messages logged before exit() are written.
+ */
+void log_stop_async(void) {
+  if (!L.async) {
+    return;
+  }
+
+  pthread_mutex_lock(&L.mutex);
+  L.stopping = 1;
+  pthread_cond_signal(&L.cond);
+  pthread_mutex_unlock(&L.mutex);
+
+  pthread_join(L.writer, NULL);
+
+  L.async = 0;
+  L.stopping = 0;
+}
+
+
+/*
+ * A child process that we fork doesn't have the writer thread, so it logs
+ * synchronously.
+ */
+static void log_atfork_child(void) {
+  pthread_mutex_init(&L.mutex, NULL);
+  pthread_mutex_init(&L.writeMutex, NULL);
+  pthread_cond_init(&L.cond, NULL);
+
+  L.async = 0;
+}
+
+
+/*
+ * log_set_async starts the writer thread, after which log_log() doesn't write
+ * to stderr or the log file itself anymore. Returns 0 when asynchronous
+ * logging couldn't be started, in which case we keep logging synchronously.
+ */
+int log_set_async(int enable) {
+  static int atexitRegistered = 0;
+  sigset_t allSignals;
+  sigset_t oldSignals;
+  int error = 0;
+
+  if (!enable) {
+    log_stop_async();
+    return 1;
+  }
+
+  if (L.async) {
+    return 1;
   }
 
+  if (L.ring == NULL) {
+    L.ring = (log_Entry *) calloc(LOG_RING_SIZE, sizeof(log_Entry));
+
+    if (L.ring == NULL) {
+      return 0;
+    }
+  }
+
+  if (!atexitRegistered) {
+    atexit(log_stop_async);
+    pthread_atfork(NULL, NULL, log_atfork_child);
+    atexitRegistered = 1;
+  }
+
+  /* signals are handled in the main thread, never in the writer thread */
+  sigfillset(&allSignals);
+  pthread_sigmask(SIG_BLOCK, &allSignals, &oldSignals);
+
+  error = pthread_create(&L.writer, NULL, log_writer_main, NULL);
+
+  pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+  if (error != 0) {
+    return 0;
+  }
+
+  L.async = 1;
+
+  return 1;
+}
+
+
+/*
+ * log_get_dropped_count returns how many messages were dropped since the
+ * beginning of the process because the ring buffer was full.
+ */
+unsigned long log_get_dropped_count(void) {
+  unsigned long dropped = 0;
+
+  pthread_mutex_lock(&L.mutex);
+  dropped = L.dropped;
+  pthread_mutex_unlock(&L.mutex);
+
+  return dropped;
+}
+
+
+/*
+ * log_vlog queues the message for the writer thread in asynchronous mode, and
+ * writes it otherwise. When the ring buffer is full, ERROR and FATAL messages
+ * are written right away rather than dropped, in between two messages of the
+ * writer thread: they may then show before messages that were queued earlier.
+ */
+static void log_vlog(int level, const char *file, int line,
+                     const char *fmt, va_list args) {
+  char message[LOG_MESSAGE_MAXLEN];
+
+  if (L.async) {
+    log_Entry *entry = NULL;
+
+    pthread_mutex_lock(&L.mutex);
+
+    if (L.head - L.tail < LOG_RING_SIZE) {
+      entry = &(L.ring[L.head % LOG_RING_SIZE]);
+
+      entry->level = level;
+      entry->time = time(NULL);
+      entry->file = file;
+      entry->line = line;
+
+      vsnprintf(entry->message, LOG_MESSAGE_MAXLEN, fmt, args);
+
+      L.head++;
+
+      pthread_cond_signal(&L.cond);
+      pthread_mutex_unlock(&L.mutex);
+
+      return;
+    }
+
+    if (level < LOG_ERROR) {
+      L.dropped++;
+      pthread_mutex_unlock(&L.mutex);
+      return;
+    }
+
+    pthread_mutex_unlock(&L.mutex);
+
+    vsnprintf(message, LOG_MESSAGE_MAXLEN, fmt, args);
+
+    pthread_mutex_lock(&L.writeMutex);
+    write_message(level, time(NULL), file, line, message);
+    if (L.fp) {
+      fflush(L.fp);
+    }
+    pthread_mutex_unlock(&L.writeMutex);
+
+    return;
+  }
+
+  /* Acquire lock */
+  lock();
+
+  vsnprintf(message, LOG_MESSAGE_MAXLEN, fmt, args);
+  write_message(level, time(NULL), file, line, message);
+
   /* Release lock */
   unlock();
 }
+
+
+void log_log(int level, const char *file, int line, const char *fmt, ...) {
+  va_list args;
+
+  if (level < L.level) {
+    return;
+  }
+
+  va_start(args, fmt);
+  log_vlog(level, file, line, fmt, args);
+  va_end(args);
+}
+
+
+/*
+ * Call sites that log with log_log_dedup() are tracked in a small table, one
+ * entry per call site and id, so that we know which key they logged last.
+ * It's only used from the main thread.
+ */
+#define LOG_DEDUP_SITES 64
+#define LOG_DEDUP_KEY_MAXLEN 256
+
+typedef struct log_DedupSite {
+  const char *file;
+  int line;
+  char id[LOG_DEDUP_KEY_MAXLEN];
+  char key[LOG_DEDUP_KEY_MAXLEN];
+  unsigned long repeated;
+  time_t lastLogTime;
+} log_DedupSite;
+
+static log_DedupSite dedupSites[LOG_DEDUP_SITES];
+
+
+/*
+ * log_log_dedup logs a message unless the previous message from the same call
+ * site and id was logged with the same key, in which case we only count it.
+ * The count is logged as a "repeated N times" summary before the next message
+ * with a different key, and the message is logged again anyway every
+ * LOG_DEDUP_INTERVAL seconds, so that we still know the process is alive.
+ *
+ * The id tells apart the objects that the same call site logs about, such as
+ * the nodes of pg_autoctl supervise. The key should contain what the caller
+ * wants to see every change of, and not the parts of the message that change
+ * all the time, such as an LSN.
+ */
+void log_log_dedup(int level, const char *file, int line,
+                   const char *id, const char *key,
+                   const char *fmt, ...) {
+  log_DedupSite *site = NULL;
+  time_t now = time(NULL);
+  va_list args;
+  int index = 0;
+
+  if (level < L.level) {
+    return;
+  }
+
+  for (index = 0; index < LOG_DEDUP_SITES; index++) {
+    log_DedupSite *current = &(dedupSites[index]);
+
+    if (current->file == NULL
+        || (current->file == file && current->line == line
+            && strncmp(current->id, id, LOG_DEDUP_KEY_MAXLEN - 1) == 0)) {
+      site = current;
+      break;
+    }
+  }
+
+  if (site == NULL) {
+    /* too many call sites, don't deduplicate */
+    va_start(args, fmt);
+    log_vlog(level, file, line, fmt, args);
+    va_end(args);
+    return;
+  }
+
+  if (site->file != NULL
+      && strncmp(site->key, key, LOG_DEDUP_KEY_MAXLEN - 1) == 0
+      && now - site->lastLogTime < LOG_DEDUP_INTERVAL) {
+    site->repeated++;
+    return;
+  }
+
+  if (site->repeated > 0) {
+    log_log(level, file, line,
+            "Last message for %s repeated %lu times",
+            site->id, site->repeated);
+  }
+
+  site->file = file;
+  site->line = line;
+  strncpy(site->id, id, LOG_DEDUP_KEY_MAXLEN - 1);
+  site->id[LOG_DEDUP_KEY_MAXLEN - 1] = '\0';
+  strncpy(site->key, key, LOG_DEDUP_KEY_MAXLEN - 1);
+  site->key[LOG_DEDUP_KEY_MAXLEN - 1] = '\0';
+  site->repeated = 0;
+  site->lastLogTime = now;
+
+  va_start(args, fmt);
+  log_vlog(level, file, line, fmt, args);
+  va_end(args);
+}
@@ -17,6 +17,8 @@ typedef void (*log_LockFn)(void *udata, int lock);
 
 enum { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
 
+enum { LOG_FORMAT_TEXT, LOG_FORMAT_JSON };
+
 #define log_trace(...) log_log(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
 #define log_debug(...) log_log(LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
 #define log_info(...)  log_log(LOG_INFO,  __FILE__, __LINE__, __VA_ARGS__)
@@ -24,14 +26,29 @@ enum { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
 #define log_error(...) log_log(LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
 #define log_fatal(...) log_log(LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
 
+/* identical consecutive keys from the same call site and id are counted */
+#define log_info_dedup(id, key, ...) \
+	log_log_dedup(LOG_INFO, __FILE__, __LINE__, id, key, __VA_ARGS__)
+
+/* a deduplicated message is logged again at least that often, in seconds */
+#define LOG_DEDUP_INTERVAL 600
+
 void log_set_udata(void *udata);
 void log_set_lock(log_LockFn fn);
 void log_set_fp(FILE *fp);
 void log_set_level(int level);
 void log_set_quiet(int enable);
 void log_use_colors(int enable);
+void log_set_format(int format);
+int log_set_async(int enable);
+void log_stop_async(void);
+unsigned long log_get_dropped_count(void);
 
 void log_log(int level, const char *file, int line, const char *fmt, ...)
  	__attribute__((format(printf, 4, 5)));
+void log_log_dedup(int level, const char *file, int line,
+				   const char *id, const char *key,
+				   const char *fmt, ...)
+	__attribute__((format(printf, 6, 7)));
 
 #endif
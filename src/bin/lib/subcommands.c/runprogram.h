@@ -10,13 +10,18 @@
 #undef RUN_PROGRAM_IMPLEMENTATION
 
 #include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/select.h>
 #include <sys/wait.h>
 
 #include "pqexpbuffer.h"
@@ -32,6 +37,19 @@
 
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
+/* a program killed at its deadline gets SIGTERM, then SIGKILL after that */
+#define PROGRAM_KILL_DELAY_MS	1000
+
+/* how often we check the cancel flag and the exit of the program */
+#define PROGRAM_POLL_TIME_MS	100
+#define PROGRAM_WAIT_TIME_MS	10
+
+extern char **environ;
+
+/* callback that receives the output of a program one line at a time */
+typedef void (*ProgramLineCallback)(void *context, bool isStderr,
+									const char *line);
+
 typedef struct
 {
 	char *program;
@@ -43,42 +61,138 @@ typedef struct
 
 	char *stdout;
 	char *stderr;
+
+	/*
+	 * When processLine is set, each line of output is given to it as soon as
+	 * we read it, and stdout and stderr are not accumulated (they stay NULL).
+	 * Lines longer than BUFSIZE are given in several parts.
+	 */
+	ProgramLineCallback processLine;
+	void *processLineContext;
+
+	/*
+	 * When timeoutMs is set, the program is terminated if it still runs after
+	 * that many milliseconds, and when cancel is set, it is terminated as soon
+	 * as *cancel is non-zero, typically a flag set by a signal handler. Then
+	 * returnCode is -1 and error is ETIMEDOUT or ECANCELED.
+	 *
+	 * With setsid, the whole process group is terminated, including the
+	 * processes that the program started in the background.
+	 */
+	int timeoutMs;
+	volatile sig_atomic_t *cancel;
+
+	pid_t pid;
+	uint64_t deadlineMs;
+	bool interrupted;
 } Program;
 
+/* a partial line of output of a program, see stream_from_pipes */
+typedef struct
+{
+	int fd;
+	bool isStderr;
+	char line[BUFSIZE];
+	int length;
+} ProgramLineBuffer;
+
 Program run_program(const char *program, ...);
+Program run_program_with_timeout(int timeoutMs, volatile sig_atomic_t *cancel,
+								 const char *program, ...);
 Program initialize_program(char **args, bool setsid);
 void execute_program(Program *prog);
 void free_program(Program *prog);
 int snprintf_program_command_line(Program *prog, char *buffer, int size);
+static Program initialize_program_va(const char *program, va_list args);
+static bool create_pipe(int *fds);
+static pid_t spawn_program(Program *prog, int outfd, int errfd);
+#if !defined(POSIX_SPAWN_SETSID)
+static pid_t fork_program(Program *prog, int outfd, int errfd);
+#endif
+static int wait_for_pipes(Program *prog, int nfds, fd_set *readFileDescriptorSet);
+static bool program_interrupted(Program *prog);
+static void terminate_program(Program *prog);
+static uint64_t program_now_ms(void);
+static void program_sleep_ms(int ms);
 static void read_from_pipes(Program *prog,
 							pid_t childPid, int *outpipe, int *errpipe);
 static size_t read_into_buf(int filedes, PQExpBuffer buffer);
+static void stream_from_pipes(Program *prog, int outfd, int errfd);
+static void read_lines(Program *prog, ProgramLineBuffer *buffer);
+static void flush_line(Program *prog, ProgramLineBuffer *buffer);
 
 
 /*
- * Run a program using fork() and exec(), get the stdout and stderr output from
- * the run and then return a Program struct instance with the result of running
+ * Run a program using posix_spawn(), get the stdout and stderr output from the
+ * run and then return a Program struct instance with the result of running
  * the program.
  */
 Program
 run_program(const char *program, ...)
 {
-	int nb_args = 0;
 	va_list args;
-	const char *param;
 	Program prog;
 
+	va_start(args, program);
+	prog = initialize_program_va(program, args);
+	va_end(args);
+
+	execute_program(&prog);
+
+	return prog;
+}
+
+
+/*
+ * Run a program as run_program does, terminating it when it still runs after
+ * timeoutMs milliseconds, or as soon as *cancel is set. Either timeoutMs can
+ * be zero or cancel can be NULL, to only use the other one.
+ */
+Program
+run_program_with_timeout(int timeoutMs, volatile sig_atomic_t *cancel,
+						 const char *program, ...)
+{
+	va_list args;
+	Program prog;
+
+	va_start(args, program);
+	prog = initialize_program_va(program, args);
+	va_end(args);
+
+	prog.timeoutMs = timeoutMs;
+	prog.cancel = cancel;
+
+	execute_program(&prog);
+
+	return prog;
+}
+
+
+/*
+ * initialize_program_va initializes a program structure from a program name
+ * and a NULL terminated list of arguments.
+ */
+static Program
+initialize_program_va(const char *program, va_list args)
+{
+	int nb_args = 0;
+	const char *param;
+	Program prog = { 0 };
+
 	prog.program = strdup(program);
 	prog.returnCode = -1;
 	prog.error = 0;
 	prog.setsid = false;
 	prog.stdout = NULL;
 	prog.stderr = NULL;
+	prog.processLine = NULL;
+	prog.processLineContext = NULL;
+	prog.timeoutMs = 0;
+	prog.cancel = NULL;
 
 	prog.args = (char **) malloc(ARGS_INCREMENT * sizeof(char *));
 	prog.args[nb_args++] = prog.program;
 
-	va_start(args, program);
 	while ((param = va_arg(args, const char *)) != NULL)
 	{
 		if (nb_args % ARGS_INCREMENT == 0)
@@ -96,11 +210,8 @@ run_program(const char *program, ...)
 		}
 		prog.args[nb_args++] = strdup(param);
 	}
-	va_end(args);
 	prog.args[nb_args] = NULL;
 
-	execute_program(&prog);
-
 	return prog;
 }
 
@@ -108,19 +219,23 @@ run_program(const char *program, ...)
 /*
  * Initialize a program structure that can be executed later, allowing the
  * caller to manipulate the structure for itself. Safe to change are program,
- * args and setsid structure slots.
+ * args, setsid, processLine, timeoutMs and cancel structure slots.
  */
 Program
 initialize_program(char **args, bool setsid)
 {
 	int argsIndex, nb_args = 0;
-	Program prog;
+	Program prog = { 0 };
 
 	prog.returnCode = -1;
 	prog.error = 0;
 	prog.setsid = setsid;
 	prog.stdout = NULL;
 	prog.stderr = NULL;
+	prog.processLine = NULL;
+	prog.processLineContext = NULL;
+	prog.timeoutMs = 0;
+	prog.cancel = NULL;
 
 	for(argsIndex = 0; args[argsIndex] != NULL; argsIndex++)
 	{
@@ -141,102 +256,217 @@ initialize_program(char **args, bool setsid)
 }
 
 /*
- * Run given program with its args, by doing the fork()/exec() dance, and also
- * capture the subprocess output by installing pipes. We accimulate the output
- * into an SDS data structure (Simple Dynamic Strings library).
+ * Run given program with its args, and capture the subprocess output by
+ * installing pipes. We accumulate the output into PQExpBuffer strings, or
+ * give it to prog->processLine one line at a time.
+ *
+ * We use posix_spawn() rather than fork(): on Linux it creates the child with
+ * vfork() semantics, which doesn't need to copy our page tables, so starting
+ * a program takes the same time whatever our memory footprint. The pipes are
+ * created with O_CLOEXEC so that no other program we run inherits them.
  */
 void
 execute_program(Program *prog)
 {
-	pid_t pid;
 	int outpipe[2] = {0,0};
 	int errpipe[2] = {0,0};
 
-	/* Flush stdio channels just before fork, to avoid double-output problems */
+	/* Flush stdio channels just before spawning, to avoid double-output */
 	fflush(stdout);
 	fflush(stderr);
 
 	/* create the pipe now */
-	if (pipe(outpipe) < 0)
+	if (!create_pipe(outpipe))
 	{
 		prog->returnCode = -1;
 		prog->error = errno;
 		return;
 	}
 
-	if (pipe(errpipe) < 0)
+	if (!create_pipe(errpipe))
 	{
 		prog->returnCode = -1;
 		prog->error = errno;
+
+		close(outpipe[0]);
+		close(outpipe[1]);
 		return;
 	}
 
-	pid = fork();
+	prog->interrupted = false;
+	prog->deadlineMs =
+		prog->timeoutMs > 0 ? program_now_ms() + prog->timeoutMs : 0;
+
+	prog->pid = spawn_program(prog, outpipe[1], errpipe[1]);
 
-	switch (pid)
+	if (prog->pid == -1)
 	{
-		case -1:
-		{
-			/* fork failed */
-			prog->returnCode = -1;
-			prog->error = errno;
-			return;
-		}
+		prog->returnCode = -1;
+		prog->error = errno;
 
-		case 0:
-		{
-			/* fork succeeded, in child */
-
-			/*
-			 * We redirect /dev/null into stdin rather than closing stdin,
-			 * because apparently closing it may cause undefined behavior if
-			 * any read was to happen.
-			 */
-			int stdin = open(DEV_NULL, O_RDONLY);
-
-			dup2(stdin, STDIN_FILENO);
-			dup2(outpipe[1], STDOUT_FILENO);
-			dup2(errpipe[1], STDERR_FILENO);
-
-			close(stdin);
-			close(outpipe[0]);
-			close(outpipe[1]);
-			close(errpipe[0]);
-			close(errpipe[1]);
-
-			/*
-			 * When asked to do so, before creating the child process, we call
-			 * setsid() to create our own session group and detach from the
-			 * terminal. That's useful when starting a service in the
-			 * background.
-			 */
-			if (prog->setsid)
-			{
-				if (setsid() == -1)
-				{
-					prog->returnCode = -1;
-					prog->error = errno;
-					return;
-				}
-			}
+		close(outpipe[0]);
+		close(outpipe[1]);
+		close(errpipe[0]);
+		close(errpipe[1]);
+		return;
+	}
+
+	read_from_pipes(prog, prog->pid, outpipe, errpipe);
+}
 
-			if (execv(prog->program, prog->args) == -1)
-			{
-				prog->returnCode = -1;
-				prog->error = errno;
-			}
-			return;
-		}
 
-		default:
+/*
+ * create_pipe creates a pipe which file descriptors are closed on exec(). In
+ * the child process, we dup2() the write end onto stdout or stderr, which
+ * clears the flag on the copy.
+ */
+static bool
+create_pipe(int *fds)
+{
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+	defined(__OpenBSD__)
+	return pipe2(fds, O_CLOEXEC) == 0;
+#else
+	if (pipe(fds) < 0)
+	{
+		return false;
+	}
+
+	(void) fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	(void) fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	return true;
+#endif
+}
+
+
+/*
+ * spawn_program starts the program with posix_spawn(), with stdin redirected
+ * from /dev/null and stdout and stderr to the given file descriptors. It
+ * returns the pid of the child process, or -1 with errno set.
+ */
+static pid_t
+spawn_program(Program *prog, int outfd, int errfd)
+{
+	pid_t pid = -1;
+	int error = 0;
+	short flags = 0;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attributes;
+
+#if !defined(POSIX_SPAWN_SETSID)
+
+	/* without POSIX_SPAWN_SETSID, only fork() can call setsid() for us */
+	if (prog->setsid)
+	{
+		return fork_program(prog, outfd, errfd);
+	}
+#endif
+
+	if ((error = posix_spawn_file_actions_init(&actions)) != 0)
+	{
+		errno = error;
+		return -1;
+	}
+
+	if ((error = posix_spawnattr_init(&attributes)) != 0)
+	{
+		posix_spawn_file_actions_destroy(&actions);
+		errno = error;
+		return -1;
+	}
+
+	/*
+	 * We redirect /dev/null into stdin rather than closing stdin, because
+	 * apparently closing it may cause undefined behavior if any read was to
+	 * happen.
+	 */
+	error = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+											 DEV_NULL, O_RDONLY, 0);
+
+	if (error == 0)
+	{
+		error = posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+	}
+
+	if (error == 0)
+	{
+		error = posix_spawn_file_actions_adddup2(&actions, errfd, STDERR_FILENO);
+	}
+
+#if defined(POSIX_SPAWN_SETSID)
+
+	/*
+	 * When asked to do so, the child process creates its own session group
+	 * and detaches from the terminal. That's useful when starting a service
+	 * in the background.
+	 */
+	if (prog->setsid)
+	{
+		flags |= POSIX_SPAWN_SETSID;
+	}
+#endif
+
+	if (error == 0)
+	{
+		error = posix_spawnattr_setflags(&attributes, flags);
+	}
+
+	if (error == 0)
+	{
+		error = posix_spawn(&pid, prog->program, &actions, &attributes,
+							prog->args, environ);
+	}
+
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attributes);
+
+	if (error != 0)
+	{
+		errno = error;
+		return -1;
+	}
+
+	return pid;
+}
+
+
+#if !defined(POSIX_SPAWN_SETSID)
+
+/*
+ * fork_program starts the program by doing the fork()/exec() dance, for
+ * programs that need setsid() where posix_spawn() can't do it.
+ */
+static pid_t
+fork_program(Program *prog, int outfd, int errfd)
+{
+	pid_t pid = fork();
+
+	if (pid == 0)
+	{
+		/* fork succeeded, in child */
+		int stdin = open(DEV_NULL, O_RDONLY);
+
+		dup2(stdin, STDIN_FILENO);
+		dup2(outfd, STDOUT_FILENO);
+		dup2(errfd, STDERR_FILENO);
+
+		close(stdin);
+
+		if (setsid() == -1)
 		{
-			/* fork succeeded, in parent */
-			read_from_pipes(prog, pid, outpipe, errpipe);
-			return;
+			_exit(127);
 		}
+
+		(void) execv(prog->program, prog->args);
+
+		/* same exit status as a shell when the program can't be run */
+		_exit(127);
 	}
-	return;
+
+	return pid;
 }
+#endif
 
 
 /*
@@ -292,6 +522,12 @@ read_from_pipes(Program *prog, pid_t childPid, int *outpipe, int *errpipe)
 	outbuf = createPQExpBuffer();
 	errbuf = createPQExpBuffer();
 
+	if (prog->processLine != NULL)
+	{
+		stream_from_pipes(prog, outpipe[0], errpipe[0]);
+		doneReading = true;
+	}
+
 	while (!doneReading)
 	{
 		FD_ZERO(&readFileDescriptorSet);
@@ -308,7 +544,7 @@ read_from_pipes(Program *prog, pid_t childPid, int *outpipe, int *errpipe)
 		}
 
 		countFdsReadyToRead =
-			select(nfds, &readFileDescriptorSet, NULL, NULL, NULL);
+			wait_for_pipes(prog, nfds, &readFileDescriptorSet);
 
 		if (countFdsReadyToRead == -1)
 		{
@@ -319,6 +555,12 @@ read_from_pipes(Program *prog, pid_t childPid, int *outpipe, int *errpipe)
 					/* just loop again */
 					break;
 
+				case ETIMEDOUT:
+				case ECANCELED:
+					/* the program has been terminated */
+					doneReading = true;
+					break;
+
 				case EBADF:
 				case EINVAL:
 				case ENOMEM:
@@ -382,19 +624,50 @@ read_from_pipes(Program *prog, pid_t childPid, int *outpipe, int *errpipe)
 	destroyPQExpBuffer(outbuf);
 	destroyPQExpBuffer(errbuf);
 
+	/* a terminated program has already been waited for */
+	if (prog->interrupted)
+	{
+		return;
+	}
+
 	/*
-	 * Now, wait until the child process is done.
+	 * Now, wait until the child process is done. With a deadline or a cancel
+	 * flag, we poll so that we can still terminate the program.
 	 */
-	do
+	for (;;)
 	{
-		if (waitpid(childPid, &status, WUNTRACED) == -1)
+		bool interruptible = prog->deadlineMs > 0 || prog->cancel != NULL;
+		pid_t pid = waitpid(childPid, &status,
+							WUNTRACED | (interruptible ? WNOHANG : 0));
+
+		if (pid == -1)
 		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
 			prog->returnCode = -1;
 			prog->error = errno;
 			return;
 		}
+
+		if (pid == 0)
+		{
+			if (program_interrupted(prog))
+			{
+				return;
+			}
+
+			program_sleep_ms(PROGRAM_WAIT_TIME_MS);
+			continue;
+		}
+
+		if (WIFEXITED(status) || WIFSIGNALED(status))
+		{
+			break;
+		}
 	}
-	while (!WIFEXITED(status) && !WIFSIGNALED(status));
 
 	prog->returnCode = WEXITSTATUS(status);
 
@@ -419,6 +692,275 @@ read_into_buf(int filedes, PQExpBuffer buffer)
 }
 
 
+/*
+ * stream_from_pipes reads the output of the child process until both its
+ * stdout and stderr are closed, and gives each line to prog->processLine as
+ * soon as it's complete. Only one partial line per pipe is kept in memory.
+ */
+static void
+stream_from_pipes(Program *prog, int outfd, int errfd)
+{
+	ProgramLineBuffer outbuf = { outfd, false, { 0 }, 0 };
+	ProgramLineBuffer errbuf = { errfd, true, { 0 }, 0 };
+
+	while (outbuf.fd >= 0 || errbuf.fd >= 0)
+	{
+		fd_set readFileDescriptorSet;
+		int countFdsReadyToRead;
+
+		FD_ZERO(&readFileDescriptorSet);
+
+		if (outbuf.fd >= 0)
+		{
+			FD_SET(outbuf.fd, &readFileDescriptorSet);
+		}
+
+		if (errbuf.fd >= 0)
+		{
+			FD_SET(errbuf.fd, &readFileDescriptorSet);
+		}
+
+		countFdsReadyToRead =
+			wait_for_pipes(prog, MAX(outbuf.fd, errbuf.fd) + 1,
+						   &readFileDescriptorSet);
+
+		if (countFdsReadyToRead == -1)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+			{
+				continue;
+			}
+
+			if (errno == ETIMEDOUT || errno == ECANCELED)
+			{
+				/* the program has been terminated */
+				break;
+			}
+
+			/* that's unexpected, act as if we're done reading */
+			log_error("Failed to read from command \"%s\": %s",
+					  prog->program, strerror(errno));
+			break;
+		}
+
+		if (outbuf.fd >= 0 && FD_ISSET(outbuf.fd, &readFileDescriptorSet))
+		{
+			read_lines(prog, &outbuf);
+		}
+
+		if (errbuf.fd >= 0 && FD_ISSET(errbuf.fd, &readFileDescriptorSet))
+		{
+			read_lines(prog, &errbuf);
+		}
+	}
+
+	/* the last line of output might not end with a newline */
+	flush_line(prog, &outbuf);
+	flush_line(prog, &errbuf);
+}
+
+
+/*
+ * wait_for_pipes calls select() on the given file descriptors, waiting no
+ * longer than the deadline of the program, and checking its cancel flag at
+ * least every PROGRAM_POLL_TIME_MS. When the program has to be stopped, it is
+ * terminated, and we return -1 with errno set to ETIMEDOUT or ECANCELED.
+ */
+static int
+wait_for_pipes(Program *prog, int nfds, fd_set *readFileDescriptorSet)
+{
+	struct timeval timeout = { 0 };
+	struct timeval *timeoutPtr = NULL;
+
+	if (program_interrupted(prog))
+	{
+		errno = prog->error;
+		return -1;
+	}
+
+	if (prog->deadlineMs > 0 || prog->cancel != NULL)
+	{
+		uint64_t waitMs = PROGRAM_POLL_TIME_MS;
+
+		if (prog->deadlineMs > 0)
+		{
+			uint64_t nowMs = program_now_ms();
+			uint64_t remainingMs =
+				prog->deadlineMs > nowMs ? prog->deadlineMs - nowMs : 0;
+
+			if (prog->cancel == NULL || remainingMs < waitMs)
+			{
+				waitMs = remainingMs;
+			}
+		}
+
+		timeout.tv_sec = waitMs / 1000;
+		timeout.tv_usec = (waitMs % 1000) * 1000;
+		timeoutPtr = &timeout;
+	}
+
+	return select(nfds, readFileDescriptorSet, NULL, NULL, timeoutPtr);
+}
+
+
+/*
+ * program_interrupted returns true when the program has reached its deadline
+ * or has been cancelled, after having terminated it.
+ */
+static bool
+program_interrupted(Program *prog)
+{
+	if (prog->interrupted)
+	{
+		return true;
+	}
+
+	if (prog->cancel != NULL && *(prog->cancel))
+	{
+		prog->error = ECANCELED;
+
+		log_warn("Terminating \"%s\" (pid %d), which was cancelled",
+				 prog->program, prog->pid);
+	}
+	else if (prog->deadlineMs > 0 && program_now_ms() >= prog->deadlineMs)
+	{
+		prog->error = ETIMEDOUT;
+
+		log_warn("Terminating \"%s\" (pid %d), which is still running "
+				 "after %d ms", prog->program, prog->pid, prog->timeoutMs);
+	}
+	else
+	{
+		return false;
+	}
+
+	terminate_program(prog);
+
+	return true;
+}
+
+
+/*
+ * terminate_program sends SIGTERM to the program, then SIGKILL when it still
+ * runs after PROGRAM_KILL_DELAY_MS, and waits for it.
+ */
+static void
+terminate_program(Program *prog)
+{
+	pid_t target = prog->setsid ? -(prog->pid) : prog->pid;
+	uint64_t startMs = program_now_ms();
+	int status;
+
+	prog->interrupted = true;
+	prog->returnCode = -1;
+
+	(void) kill(target, SIGTERM);
+
+	while (waitpid(prog->pid, &status, WNOHANG) == 0)
+	{
+		if (program_now_ms() - startMs >= PROGRAM_KILL_DELAY_MS)
+		{
+			(void) kill(target, SIGKILL);
+			(void) waitpid(prog->pid, &status, 0);
+			break;
+		}
+
+		program_sleep_ms(PROGRAM_WAIT_TIME_MS);
+	}
+}
+
+
+/*
+ * program_now_ms returns the time of a monotonic clock, in milliseconds.
+ */
+static uint64_t
+program_now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+static void
+program_sleep_ms(int ms)
+{
+	struct timespec delay = { ms / 1000, (ms % 1000) * 1000000L };
+
+	(void) nanosleep(&delay, NULL);
+}
+
+
+/*
+ * read_lines reads from buffer->fd, and gives each complete line it finds to
+ * prog->processLine. Progress reports of programs such as pg_basebackup end
+ * with a carriage return rather than a newline, and we split lines on both.
+ * On end of file, buffer->fd is set to -1.
+ */
+static void
+read_lines(Program *prog, ProgramLineBuffer *buffer)
+{
+	char temp_buffer[BUFSIZE];
+	ssize_t bytes = read(buffer->fd, temp_buffer, BUFSIZE);
+	ssize_t index = 0;
+
+	if (bytes == 0)
+	{
+		buffer->fd = -1;
+		return;
+	}
+
+	if (bytes < 0)
+	{
+		if (errno != EAGAIN && errno != EINTR)
+		{
+			prog->returnCode = -1;
+			prog->error = errno;
+			buffer->fd = -1;
+		}
+		return;
+	}
+
+	for (index = 0; index < bytes; index++)
+	{
+		char c = temp_buffer[index];
+
+		if (c == '\n' || c == '\r')
+		{
+			flush_line(prog, buffer);
+			continue;
+		}
+
+		buffer->line[buffer->length++] = c;
+
+		/* keep room for the terminating NUL byte */
+		if (buffer->length == BUFSIZE - 1)
+		{
+			flush_line(prog, buffer);
+		}
+	}
+}
+
+
+/*
+ * flush_line gives the current line of the buffer to prog->processLine, when
+ * it's not empty, and then empties the buffer.
+ */
+static void
+flush_line(Program *prog, ProgramLineBuffer *buffer)
+{
+	if (buffer->length > 0)
+	{
+		buffer->line[buffer->length] = '\0';
+		(*prog->processLine)(prog->processLineContext,
+							 buffer->isStderr, buffer->line);
+	}
+	buffer->length = 0;
+}
+
+
 /*
  * Writes the full command line of the given program into the given
  * pre-allocated buffer of given size, and returns how many bytes would have
@@ -0,0 +1,699 @@
+/*
+ * src/bin/pg_autoctl/bench.c
+ *   Load generator for the node_active protocol of a monitor.
+ *
+ * We register synthetic nodes in formations of their own, two nodes per
+ * group, and then have them call node_active at the given interval from a
+ * pool of non-blocking connections, all of them driven from a single poll(2)
+ * loop. Each synthetic node reports the goal state that the monitor assigned
+ * to it last, as a keeper that reaches its goal state right away would do.
+ *
+ * Meanwhile another connection counts the monitor backends that wait for a
+ * lock, such as the LockNodeGroup lock that node_active takes, so that we
+ * can report an estimate of the time spent waiting for locks.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "postgres_fe.h"
+#include "catalog/pg_type.h"
+
+#include "bench.h"
+#include "defaults.h"
+#include "log.h"
+#include "parsing.h"
+#include "signals.h"
+
+static const char *benchNodeActiveSQL =
+	"SELECT * FROM pgautofailover.node_active($1, $2, $3, $4, $5, "
+	"$6::pgautofailover.replication_state, $7, $8, $9)";
+
+static const char *benchLockWaitersSQL =
+	"SELECT count(*) FROM pg_stat_activity "
+	" WHERE wait_event_type = 'Lock' AND datname = current_database()";
+
+static BenchNode benchNodes[BENCH_MAX_NODES];
+static BenchConnection benchConnections[BENCH_MAX_CONNECTIONS];
+
+static bool bench_register_nodes(Monitor *monitor, BenchOptions *options,
+								 int *nodeCount);
+static void bench_remove_nodes(Monitor *monitor, BenchOptions *options,
+							   int nodeCount);
+static bool bench_connect(BenchOptions *options, PGconn **lockConnection);
+static void bench_disconnect(BenchOptions *options, PGconn *lockConnection);
+static bool bench_run(BenchOptions *options, int nodeCount,
+					  PGconn *lockConnection, BenchResults *results);
+static bool bench_send(BenchConnection *benchConnection, int nodeIndex);
+static bool bench_receive(BenchConnection *benchConnection,
+						  BenchResults *results);
+static void bench_receive_lock_waiters(PGconn *lockConnection,
+									   BenchResults *results,
+									   uint64_t sampleUs);
+static void bench_add_latency(BenchResults *results, uint32_t latencyUs);
+static void bench_print_results(BenchOptions *options, int nodeCount,
+								BenchResults *results);
+static int compare_latencies(const void *a, const void *b);
+static uint64_t bench_now_us(void);
+
+
+/*
+ * bench_monitor registers the synthetic nodes, drives node_active for the
+ * given duration, prints the results, and then removes the synthetic nodes
+ * again unless asked to keep them.
+ */
+bool
+bench_monitor(BenchOptions *options)
+{
+	Monitor monitor = { 0 };
+	PGconn *lockConnection = NULL;
+	BenchResults results = { 0 };
+	int nodeCount = 0;
+	bool success = true;
+
+	if (!monitor_init(&monitor, options->monitorURI))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* our other connections use the same options, such as target_session_attrs */
+	strlcpy(options->monitorURI, monitor.pgsql.connectionString, MAXCONNINFO);
+
+	if (!bench_register_nodes(&monitor, options, &nodeCount))
+	{
+		/* errors have already been logged */
+		bench_remove_nodes(&monitor, options, nodeCount);
+		return false;
+	}
+
+	(void) set_signal_handlers();
+
+	success = bench_connect(options, &lockConnection) &&
+			  bench_run(options, nodeCount, lockConnection, &results);
+
+	bench_disconnect(options, lockConnection);
+
+	if (success)
+	{
+		bench_print_results(options, nodeCount, &results);
+	}
+
+	free(results.latencies);
+
+	if (!options->keep)
+	{
+		bench_remove_nodes(&monitor, options, nodeCount);
+	}
+
+	pgsql_finish(&(monitor.pgsql));
+
+	return success;
+}
+
+
+/*
+ * bench_register_nodes creates the formations of the synthetic nodes, and
+ * registers two nodes in each of their groups. nodeCount is set to the
+ * number of nodes that have been registered, even when we fail.
+ */
+static bool
+bench_register_nodes(Monitor *monitor, BenchOptions *options, int *nodeCount)
+{
+	uint64_t startUs = bench_now_us();
+
+	*nodeCount = 0;
+
+	for (int f = 0; f < options->formations; f++)
+	{
+		char formation[NAMEDATALEN];
+
+		sprintf(formation, "bench_%d", f + 1);
+
+		if (!monitor_create_formation(monitor, formation, "pgsql",
+									  DEFAULT_DATABASE_NAME, true))
+		{
+			log_error("Failed to create formation \"%s\" for the synthetic "
+					  "nodes, see above for details", formation);
+			log_info("HINT: use `pg_autoctl drop formation` to clean-up "
+					 "a previous benchmark run");
+			return false;
+		}
+
+		for (int g = 0; g < options->groups; g++)
+		{
+			for (int n = 0; n < 2; n++)
+			{
+				BenchNode *node = &(benchNodes[*nodeCount]);
+				MonitorAssignedState assignedState = { 0 };
+
+				strlcpy(node->formation, formation, NAMEDATALEN);
+				snprintf(node->nodeName, _POSIX_HOST_NAME_MAX,
+						 "bench-%d-%d-%d", f + 1, g, n + 1);
+				node->nodePort = 5432;
+
+				if (!monitor_register_node(monitor, node->formation,
+										   node->nodeName, node->nodePort,
+										   DEFAULT_DATABASE_NAME, g,
+										   INIT_STATE, NODE_KIND_STANDALONE,
+										   &assignedState))
+				{
+					/* errors have already been logged */
+					return false;
+				}
+
+				node->nodeId = assignedState.nodeId;
+				node->groupId = assignedState.groupId;
+				node->state = assignedState.state;
+
+				++(*nodeCount);
+			}
+		}
+	}
+
+	log_info("Registered %d synthetic nodes in %d formation(s) in %.3f s",
+			 *nodeCount, options->formations,
+			 (double) (bench_now_us() - startUs) / 1e6);
+
+	return true;
+}
+
+
+/*
+ * bench_remove_nodes removes the synthetic nodes from the monitor, and then
+ * drops their formations.
+ */
+static void
+bench_remove_nodes(Monitor *monitor, BenchOptions *options, int nodeCount)
+{
+	for (int nodeIndex = 0; nodeIndex < nodeCount; nodeIndex++)
+	{
+		BenchNode *node = &(benchNodes[nodeIndex]);
+
+		/* errors are logged by monitor_remove, keep on cleaning up */
+		(void) monitor_remove(monitor, node->nodeName, node->nodePort);
+	}
+
+	for (int f = 0; f < options->formations; f++)
+	{
+		char formation[NAMEDATALEN];
+
+		sprintf(formation, "bench_%d", f + 1);
+
+		/* errors are logged by monitor_drop_formation */
+		(void) monitor_drop_formation(monitor, formation);
+	}
+
+	log_info("Removed the %d synthetic nodes", nodeCount);
+}
+
+
+/*
+ * bench_connect opens the connections that call node_active, and the one
+ * that counts the backends that wait for a lock.
+ */
+static bool
+bench_connect(BenchOptions *options, PGconn **lockConnection)
+{
+	for (int c = 0; c < options->connections; c++)
+	{
+		BenchConnection *benchConnection = &(benchConnections[c]);
+		PGconn *connection = PQconnectdb(options->monitorURI);
+
+		benchConnection->connection = connection;
+		benchConnection->nodeIndex = -1;
+
+		if (PQstatus(connection) != CONNECTION_OK)
+		{
+			log_error("Failed to connect to the monitor: %s",
+					  PQerrorMessage(connection));
+			return false;
+		}
+
+		if (PQsetnonblocking(connection, 1) != 0)
+		{
+			log_error("Failed to set the connection to the monitor "
+					  "non-blocking: %s", PQerrorMessage(connection));
+			return false;
+		}
+	}
+
+	*lockConnection = PQconnectdb(options->monitorURI);
+
+	if (PQstatus(*lockConnection) != CONNECTION_OK)
+	{
+		log_error("Failed to connect to the monitor: %s",
+				  PQerrorMessage(*lockConnection));
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * bench_disconnect closes the connections opened by bench_connect.
+ */
+static void
+bench_disconnect(BenchOptions *options, PGconn *lockConnection)
+{
+	for (int c = 0; c < options->connections; c++)
+	{
+		if (benchConnections[c].connection != NULL)
+		{
+			PQfinish(benchConnections[c].connection);
+			benchConnections[c].connection = NULL;
+		}
+	}
+
+	if (lockConnection != NULL)
+	{
+		PQfinish(lockConnection);
+	}
+}
+
+
+/*
+ * bench_run drives node_active for the duration of the benchmark. The nodes
+ * are spread evenly over the connections, and their first call over the
+ * interval, so that the monitor gets a steady load.
+ */
+static bool
+bench_run(BenchOptions *options, int nodeCount, PGconn *lockConnection,
+		  BenchResults *results)
+{
+	struct pollfd pollFds[BENCH_MAX_CONNECTIONS + 1];
+	uint64_t intervalUs = (uint64_t) options->intervalMs * 1000;
+	uint64_t startUs = bench_now_us();
+	uint64_t endUs = startUs + (uint64_t) options->durationSecs * 1000000;
+	uint64_t nextSampleUs = startUs;
+	bool sampling = false;
+	int inFlight = 0;
+
+	for (int nodeIndex = 0; nodeIndex < nodeCount; nodeIndex++)
+	{
+		benchNodes[nodeIndex].nextCallUs =
+			startUs + intervalUs * nodeIndex / nodeCount;
+	}
+
+	log_info("Calling node_active every %d ms for each of the %d nodes, "
+			 "from %d connections, for %d s",
+			 options->intervalMs, nodeCount, options->connections,
+			 options->durationSecs);
+
+	for (;;)
+	{
+		uint64_t nowUs = bench_now_us();
+		uint64_t wakeUpUs = nowUs + 1000000;
+		bool running = nowUs < endUs && !asked_to_stop && !asked_to_stop_fast;
+		int timeoutMs = 0;
+
+		if (!running && inFlight == 0)
+		{
+			break;
+		}
+
+		/* send the calls that are due on the idle connections */
+		for (int c = 0; running && c < options->connections; c++)
+		{
+			BenchConnection *benchConnection = &(benchConnections[c]);
+			int dueIndex = -1;
+
+			if (benchConnection->nodeIndex >= 0)
+			{
+				continue;
+			}
+
+			for (int nodeIndex = c; nodeIndex < nodeCount;
+				 nodeIndex += options->connections)
+			{
+				uint64_t nextCallUs = benchNodes[nodeIndex].nextCallUs;
+
+				if (nextCallUs <= nowUs &&
+					(dueIndex < 0 ||
+					 nextCallUs < benchNodes[dueIndex].nextCallUs))
+				{
+					dueIndex = nodeIndex;
+				}
+				else if (nextCallUs > nowUs && nextCallUs < wakeUpUs)
+				{
+					wakeUpUs = nextCallUs;
+				}
+			}
+
+			if (dueIndex >= 0)
+			{
+				if (!bench_send(benchConnection, dueIndex))
+				{
+					/* errors have already been logged */
+					return false;
+				}
+				++inFlight;
+			}
+		}
+
+		/* count the backends waiting for a lock, one sample at a time */
+		if (running && !sampling && nowUs >= nextSampleUs)
+		{
+			if (!PQsendQuery(lockConnection, benchLockWaitersSQL))
+			{
+				log_error("Failed to count the backends waiting for a lock: "
+						  "%s", PQerrorMessage(lockConnection));
+				return false;
+			}
+
+			sampling = true;
+			nextSampleUs = nowUs + BENCH_LOCK_SAMPLE_INTERVAL_MS * 1000;
+		}
+
+		if (running && nextSampleUs < wakeUpUs)
+		{
+			wakeUpUs = nextSampleUs;
+		}
+
+		for (int c = 0; c < options->connections; c++)
+		{
+			pollFds[c].fd = PQsocket(benchConnections[c].connection);
+			pollFds[c].events = POLLIN;
+			pollFds[c].revents = 0;
+		}
+
+		pollFds[options->connections].fd = PQsocket(lockConnection);
+		pollFds[options->connections].events = POLLIN;
+		pollFds[options->connections].revents = 0;
+
+		nowUs = bench_now_us();
+		timeoutMs = wakeUpUs > nowUs ? (int) ((wakeUpUs - nowUs) / 1000) : 0;
+
+		if (poll(pollFds, options->connections + 1, timeoutMs) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log_error("Failed to wait for the monitor: %s", strerror(errno));
+			return false;
+		}
+
+		for (int c = 0; c < options->connections; c++)
+		{
+			BenchConnection *benchConnection = &(benchConnections[c]);
+			int nodeIndex = benchConnection->nodeIndex;
+
+			if (pollFds[c].revents == 0 || nodeIndex < 0)
+			{
+				continue;
+			}
+
+			if (!bench_receive(benchConnection, results))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+
+			if (benchConnection->nodeIndex < 0)
+			{
+				--inFlight;
+				benchNodes[nodeIndex].nextCallUs += intervalUs;
+			}
+		}
+
+		if (pollFds[options->connections].revents != 0 && sampling)
+		{
+			if (!PQconsumeInput(lockConnection))
+			{
+				log_error("Lost the connection to the monitor: %s",
+						  PQerrorMessage(lockConnection));
+				return false;
+			}
+
+			if (!PQisBusy(lockConnection))
+			{
+				uint64_t sampleUs = BENCH_LOCK_SAMPLE_INTERVAL_MS * 1000;
+
+				bench_receive_lock_waiters(lockConnection, results, sampleUs);
+				sampling = false;
+			}
+		}
+	}
+
+	/* a pending sample is not counted, just drain it */
+	if (sampling)
+	{
+		PGresult *result = NULL;
+
+		while ((result = PQgetResult(lockConnection)) != NULL)
+		{
+			PQclear(result);
+		}
+	}
+
+	results->elapsedUs = bench_now_us() - startUs;
+
+	return true;
+}
+
+
+/*
+ * bench_send sends the node_active call of the given node.
+ */
+static bool
+bench_send(BenchConnection *benchConnection, int nodeIndex)
+{
+	BenchNode *node = &(benchNodes[nodeIndex]);
+	Oid paramTypes[9] = { TEXTOID, TEXTOID, INT4OID, INT4OID,
+						  INT4OID, TEXTOID, BOOLOID, LSNOID, TEXTOID };
+	const char *paramValues[9];
+	IntString nodePort = intToString(node->nodePort);
+	IntString nodeId = intToString(node->nodeId);
+	IntString groupId = intToString(node->groupId);
+
+	paramValues[0] = node->formation;
+	paramValues[1] = node->nodeName;
+	paramValues[2] = nodePort.strValue;
+	paramValues[3] = nodeId.strValue;
+	paramValues[4] = groupId.strValue;
+	paramValues[5] = NodeStateToString(node->state);
+	paramValues[6] = "true";
+	paramValues[7] = "0/0";
+	paramValues[8] = "";
+
+	if (!PQsendQueryParams(benchConnection->connection, benchNodeActiveSQL,
+						   9, paramTypes, paramValues, NULL, NULL, 0))
+	{
+		log_error("Failed to call node_active for node %s:%d: %s",
+				  node->nodeName, node->nodePort,
+				  PQerrorMessage(benchConnection->connection));
+		return false;
+	}
+
+	benchConnection->nodeIndex = nodeIndex;
+	benchConnection->sentUs = bench_now_us();
+
+	return true;
+}
+
+
+/*
+ * bench_receive reads what the monitor sent on a connection, and once the
+ * node_active call is complete, records its latency and the goal state of
+ * the node. The connection is then idle again, with nodeIndex set to -1.
+ */
+static bool
+bench_receive(BenchConnection *benchConnection, BenchResults *results)
+{
+	PGconn *connection = benchConnection->connection;
+	BenchNode *node = &(benchNodes[benchConnection->nodeIndex]);
+	PGresult *result = NULL;
+
+	if (!PQconsumeInput(connection))
+	{
+		log_error("Lost the connection to the monitor: %s",
+				  PQerrorMessage(connection));
+		return false;
+	}
+
+	while (!PQisBusy(connection))
+	{
+		result = PQgetResult(connection);
+
+		if (result == NULL)
+		{
+			uint64_t latencyUs = bench_now_us() - benchConnection->sentUs;
+
+			bench_add_latency(results, (uint32_t) latencyUs);
+			benchConnection->nodeIndex = -1;
+			++results->calls;
+
+			return true;
+		}
+
+		if (PQresultStatus(result) == PGRES_TUPLES_OK &&
+			PQntuples(result) == 1 && PQnfields(result) >= 3)
+		{
+			NodeState goalState = NodeStateFromString(PQgetvalue(result, 0, 2));
+
+			if (goalState != NO_STATE)
+			{
+				/* we reach our goal state right away */
+				node->state = goalState;
+			}
+		}
+		else
+		{
+			log_debug("node_active failed for node %s:%d: %s",
+					  node->nodeName, node->nodePort,
+					  PQresultErrorMessage(result));
+			++results->errors;
+		}
+
+		PQclear(result);
+	}
+
+	return true;
+}
+
+
+/*
+ * bench_receive_lock_waiters adds the number of backends found waiting for a
+ * lock to our results. Each of them is assumed to have waited for the whole
+ * sampling period.
+ */
+static void
+bench_receive_lock_waiters(PGconn *lockConnection, BenchResults *results,
+						   uint64_t sampleUs)
+{
+	PGresult *result = NULL;
+
+	while ((result = PQgetResult(lockConnection)) != NULL)
+	{
+		if (PQresultStatus(result) == PGRES_TUPLES_OK &&
+			PQntuples(result) == 1)
+		{
+			int waiters = 0;
+
+			if (sscanf(PQgetvalue(result, 0, 0), "%d", &waiters) == 1)
+			{
+				++results->lockSamples;
+				results->lockWaiters += waiters;
+				results->lockWaitMs += (double) waiters * sampleUs / 1000.0;
+			}
+		}
+
+		PQclear(result);
+	}
+}
+
+
+/*
+ * bench_add_latency appends a latency to our results, growing the array as
+ * needed.
+ */
+static void
+bench_add_latency(BenchResults *results, uint32_t latencyUs)
+{
+	if (results->latencyCount == results->latencyCapacity)
+	{
+		uint64_t capacity =
+			results->latencyCapacity == 0 ? 4096 : 2 * results->latencyCapacity;
+		uint32_t *latencies =
+			realloc(results->latencies, capacity * sizeof(uint32_t));
+
+		if (latencies == NULL)
+		{
+			/* keep on counting the calls, just not their latency */
+			return;
+		}
+
+		results->latencies = latencies;
+		results->latencyCapacity = capacity;
+	}
+
+	results->latencies[results->latencyCount++] = latencyUs;
+}
+
+
+/*
+ * bench_print_results prints the load profile and what we measured.
+ */
+static void
+bench_print_results(BenchOptions *options, int nodeCount,
+					BenchResults *results)
+{
+	double elapsedSecs = (double) results->elapsedUs / 1e6;
+	uint32_t *latencies = results->latencies;
+	uint64_t count = results->latencyCount;
+	double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+
+	qsort(latencies, count, sizeof(uint32_t), compare_latencies);
+
+	fprintf(stdout, "%-20s %d formation(s), %d group(s), %d node(s)\n",
+			"Nodes", options->formations,
+			options->formations * options->groups, nodeCount);
+	fprintf(stdout, "%-20s %d ms per node, %d connection(s), %.3f s\n",
+			"Load", options->intervalMs, options->connections, elapsedSecs);
+	fprintf(stdout, "%-20s %" PRIu64 " calls, %" PRIu64 " errors\n",
+			"node_active", results->calls, results->errors);
+	fprintf(stdout, "%-20s %.1f calls/s\n",
+			"Throughput", elapsedSecs > 0 ? results->calls / elapsedSecs : 0);
+
+	if (count > 0)
+	{
+		for (int i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+		{
+			uint64_t index = (uint64_t) (percentiles[i] / 100.0 * (count - 1));
+			char label[BUFSIZE];
+
+			sprintf(label, "Latency p%g", percentiles[i]);
+
+			fprintf(stdout, "%-20s %.3f ms\n",
+					label, (double) latencies[index] / 1000.0);
+		}
+
+		fprintf(stdout, "%-20s %.3f ms\n",
+				"Latency max", (double) latencies[count - 1] / 1000.0);
+	}
+
+	fprintf(stdout, "%-20s %.1f ms, %.2f backends waiting on average\n",
+			"Lock waits", results->lockWaitMs,
+			results->lockSamples > 0
+			? (double) results->lockWaiters / results->lockSamples
+			: 0.0);
+}
+
+
+/*
+ * compare_latencies is the qsort comparison function for latencies.
+ */
+static int
+compare_latencies(const void *a, const void *b)
+{
+	uint32_t left = *(const uint32_t *) a;
+	uint32_t right = *(const uint32_t *) b;
+
+	return left < right ? -1 : (left > right ? 1 : 0);
+}
+
+
+/*
+ * bench_now_us returns the current time in microseconds since the epoch.
+ */
+static uint64_t
+bench_now_us(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+}
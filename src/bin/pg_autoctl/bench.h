@@ -0,0 +1,85 @@
+/*
+ * src/bin/pg_autoctl/bench.h
+ *   Load generator for the node_active protocol of a monitor, with synthetic
+ *   nodes that behave like keepers.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libpq-fe.h"
+
+#include "monitor.h"
+#include "state.h"
+
+/* limits of the load profile of pg_autoctl do bench monitor */
+#define BENCH_MAX_NODES 10000
+#define BENCH_MAX_CONNECTIONS 256
+
+/* defaults of the load profile */
+#define BENCH_DEFAULT_FORMATIONS 1
+#define BENCH_DEFAULT_GROUPS 8
+#define BENCH_DEFAULT_CONNECTIONS 16
+#define BENCH_DEFAULT_DURATION 30
+
+/* how often we count the monitor backends that wait for a lock */
+#define BENCH_LOCK_SAMPLE_INTERVAL_MS 100
+
+typedef struct BenchOptions
+{
+	char monitorURI[MAXCONNINFO];
+	int formations;
+	int groups;                 /* per formation, with two nodes each */
+	int connections;
+	int intervalMs;             /* between two calls of a node */
+	int durationSecs;
+	bool keep;                  /* don't remove the synthetic nodes */
+} BenchOptions;
+
+/* a synthetic node, that reports the goal state it's been assigned */
+typedef struct BenchNode
+{
+	char formation[NAMEDATALEN];
+	char nodeName[_POSIX_HOST_NAME_MAX];
+	int nodePort;
+	int nodeId;
+	int groupId;
+	NodeState state;
+	uint64_t nextCallUs;
+} BenchNode;
+
+/* a connection calls node_active for its nodes, one call at a time */
+typedef struct BenchConnection
+{
+	PGconn *connection;
+	int nodeIndex;              /* of the call in flight, or -1 */
+	uint64_t sentUs;
+} BenchConnection;
+
+typedef struct BenchResults
+{
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t elapsedUs;
+
+	/* latency of each call, in microseconds */
+	uint32_t *latencies;
+	uint64_t latencyCount;
+	uint64_t latencyCapacity;
+
+	/* sum of the number of backends waiting on a lock, times the period */
+	uint64_t lockSamples;
+	uint64_t lockWaiters;
+	double lockWaitMs;
+} BenchResults;
+
+bool bench_monitor(BenchOptions *options);
+
+#endif /* BENCH_H */
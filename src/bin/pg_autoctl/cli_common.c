@@ -63,11 +63,25 @@ cli_create_node_getopts(int argc, char **argv,
 
 	/* force some non-zero default values */
 	LocalOptionConfig.groupId = -1;
+	LocalOptionConfig.prewarm_interval = -1;
+	LocalOptionConfig.catchup_acceleration = -1;
+	LocalOptionConfig.slot_wal_budget = -1;
+	LocalOptionConfig.http_port = -1;
+	LocalOptionConfig.liveness_port = -1;
+	LocalOptionConfig.liveness_interval = -1;
 	LocalOptionConfig.network_partition_timeout = -1;
+	LocalOptionConfig.network_partition_read_only = -1;
 	LocalOptionConfig.prepare_promotion_catchup = -1;
 	LocalOptionConfig.prepare_promotion_walreceiver = -1;
 	LocalOptionConfig.postgresql_restart_failure_timeout = -1;
 	LocalOptionConfig.postgresql_restart_failure_max_retries = -1;
+	LocalOptionConfig.heartbeat_interval = -1;
+	LocalOptionConfig.keepalives.idle = -1;
+	LocalOptionConfig.keepalives.interval = -1;
+	LocalOptionConfig.keepalives.count = -1;
+	LocalOptionConfig.keepalives.tcpUserTimeout = -1;
+	LocalOptionConfig.hook_timeout = -1;
+	LocalOptionConfig.hook_max_processes = -1;
 
 	optind = 0;
 
@@ -77,6 +77,7 @@ extern CommandLine drop_formation_command;
 
 /* cli_service.c */
 extern CommandLine service_run_command;
+extern CommandLine service_supervise_command;
 extern CommandLine service_stop_command;
 extern CommandLine service_reload_command;
 
@@ -84,10 +85,17 @@ extern CommandLine service_reload_command;
 extern CommandLine show_uri_command;
 extern CommandLine show_events_command;
 extern CommandLine show_state_command;
+extern CommandLine show_timings_command;
+extern CommandLine show_status_command;
 
 /* cli_systemd.c */
 extern CommandLine systemd_cat_service_file_command;
 
+/* cli_watch.c */
+extern CommandLine watch_command;
+extern CommandLine route_command;
+extern CommandLine rolling_command;
+
 
 int cli_create_node_getopts(int argc, char **argv,
 							struct option *long_options,
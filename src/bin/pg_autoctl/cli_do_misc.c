@@ -89,7 +89,7 @@ keeper_cli_enable_synchronous_replication(int argc, char **argv)
 	keeper_config_init(&config, missingPgdataOk, pgNotRunningOk);
 	local_postgres_init(&postgres, &(config.pgSetup));
 
-	if (!primary_enable_synchronous_replication(&postgres))
+	if (!primary_enable_synchronous_replication(&postgres, "*", "on"))
 	{
 		exit(EXIT_CODE_PGSQL);
 	}
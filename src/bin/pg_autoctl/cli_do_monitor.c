@@ -24,6 +24,7 @@
 
 #include "postgres_fe.h"
 
+#include "bench.h"
 #include "cli_common.h"
 #include "commandline.h"
 #include "defaults.h"
@@ -41,6 +42,10 @@ static void keeper_cli_monitor_get_coordinator(int argc, char **argv);
 static void keeper_cli_monitor_register_node(int argc, char **argv);
 static void keeper_cli_monitor_node_active(int argc, char **argv);
 static void cli_monitor_version(int argc, char **argv);
+static int cli_bench_monitor_getopts(int argc, char **argv);
+static void cli_bench_monitor(int argc, char **argv);
+
+static BenchOptions benchOptions = { 0 };
 
 
 static CommandLine monitor_get_primary_command =
@@ -118,6 +123,32 @@ CommandLine do_monitor_commands =
 					 "Query a pg_auto_failover monitor", NULL, NULL,
 					 NULL, monitor_subcommands);
 
+static CommandLine bench_monitor_command =
+	make_command("monitor",
+				 "Drive node_active from synthetic nodes, and report latencies",
+				 " [ --pgdata --monitor --formations --groups --connections "
+				 "--interval --duration --keep ]",
+				 "  --pgdata      path to data directory	 \n"	\
+				 "  --monitor     monitor Postgres URL \n" \
+				 "  --formations  number of formations to create (1) \n" \
+				 "  --groups      number of groups per formation, of 2 nodes (8) \n" \
+				 "  --connections number of concurrent connections (16) \n" \
+				 "  --interval    ms between two calls of a node (5000) \n" \
+				 "  --duration    duration of the benchmark in seconds (30) \n" \
+				 "  --keep        keep the synthetic nodes registered \n",
+				 cli_bench_monitor_getopts,
+				 cli_bench_monitor);
+
+static CommandLine *bench_subcommands[] = {
+	&bench_monitor_command,
+	NULL
+};
+
+CommandLine do_bench_commands =
+	make_command_set("bench",
+					 "Benchmark pg_auto_failover components", NULL, NULL,
+					 NULL, bench_subcommands);
+
 
 /*
  * keeper_cli_monitor_get_primary_node contacts the pg_auto_failover monitor and
@@ -455,3 +486,184 @@ cli_monitor_version(int argc, char **argv)
 
 	fprintf(stdout, "%s\n", version.installedVersion);
 }
+
+
+/*
+ * cli_bench_monitor_getopts parses the command line options for the command
+ * `pg_autoctl do bench monitor`.
+ */
+static int
+cli_bench_monitor_getopts(int argc, char **argv)
+{
+	BenchOptions options = { 0 };
+	char pgdata[MAXPGPATH] = { 0 };
+	int c, option_index = 0;
+
+	static struct option long_options[] = {
+		{ "pgdata", required_argument, NULL, 'D' },
+		{ "monitor", required_argument, NULL, 'm' },
+		{ "formations", required_argument, NULL, 'F' },
+		{ "groups", required_argument, NULL, 'G' },
+		{ "connections", required_argument, NULL, 'c' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "keep", no_argument, NULL, 'k' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	options.formations = BENCH_DEFAULT_FORMATIONS;
+	options.groups = BENCH_DEFAULT_GROUPS;
+	options.connections = BENCH_DEFAULT_CONNECTIONS;
+	options.intervalMs = PG_AUTOCTL_KEEPER_HEARTBEAT_INTERVAL;
+	options.durationSecs = BENCH_DEFAULT_DURATION;
+
+	optind = 0;
+
+	while ((c = getopt_long(argc, argv, "D:m:F:G:c:i:d:k",
+							long_options, &option_index)) != -1)
+	{
+		int *value = NULL;
+		int minValue = 1;
+
+		switch (c)
+		{
+			case 'D':
+			{
+				strlcpy(pgdata, optarg, MAXPGPATH);
+				log_trace("--pgdata %s", pgdata);
+				continue;
+			}
+
+			case 'm':
+			{
+				strlcpy(options.monitorURI, optarg, MAXCONNINFO);
+				log_trace("--monitor %s", options.monitorURI);
+				continue;
+			}
+
+			case 'k':
+			{
+				options.keep = true;
+				log_trace("--keep");
+				continue;
+			}
+
+			case 'F':
+			{
+				value = &options.formations;
+				break;
+			}
+
+			case 'G':
+			{
+				value = &options.groups;
+				break;
+			}
+
+			case 'c':
+			{
+				value = &options.connections;
+				break;
+			}
+
+			case 'i':
+			{
+				value = &options.intervalMs;
+				minValue = PG_AUTOCTL_KEEPER_HEARTBEAT_MIN_INTERVAL;
+				break;
+			}
+
+			case 'd':
+			{
+				value = &options.durationSecs;
+				break;
+			}
+
+			default:
+			{
+				log_error("Failed to parse command line, see above for details.");
+				exit(EXIT_CODE_BAD_ARGS);
+				break;
+			}
+		}
+
+		if (sscanf(optarg, "%d", value) != 1 || *value < minValue)
+		{
+			log_fatal("--%s argument must be a number of at least %d: \"%s\"",
+					  long_options[option_index].name, minValue, optarg);
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+
+		log_trace("--%s %d", long_options[option_index].name, *value);
+	}
+
+	if (options.formations * options.groups * 2 > BENCH_MAX_NODES)
+	{
+		log_fatal("pg_autoctl do bench monitor supports at most %d nodes, "
+				  "%d formations of %d groups have %d nodes",
+				  BENCH_MAX_NODES, options.formations, options.groups,
+				  options.formations * options.groups * 2);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (options.connections > BENCH_MAX_CONNECTIONS)
+	{
+		log_fatal("pg_autoctl do bench monitor supports at most %d "
+				  "connections", BENCH_MAX_CONNECTIONS);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* without --monitor, use the monitor of the local node */
+	if (IS_EMPTY_STRING_BUFFER(options.monitorURI))
+	{
+		KeeperConfig config = { 0 };
+		Monitor monitor = { 0 };
+
+		if (IS_EMPTY_STRING_BUFFER(pgdata))
+		{
+			char *env = getenv("PGDATA");
+
+			if (env == NULL)
+			{
+				log_fatal("Failed to get the monitor to benchmark either "
+						  "from --monitor, or from --pgdata or the "
+						  "environment");
+				exit(EXIT_CODE_BAD_ARGS);
+			}
+
+			strlcpy(pgdata, env, MAXPGPATH);
+		}
+
+		strlcpy(config.pgSetup.pgdata, pgdata, MAXPGPATH);
+		set_first_pgctl(&(config.pgSetup));
+
+		if (!monitor_init_from_pgsetup(&monitor, &config.pgSetup))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+
+		strlcpy(options.monitorURI, monitor.pgsql.connectionString,
+				MAXCONNINFO);
+	}
+
+	benchOptions = options;
+
+	return optind;
+}
+
+
+/*
+ * cli_bench_monitor registers synthetic nodes with the monitor, and drives
+ * node_active from them at a fixed cadence, so that we can compare how
+ * monitor changes do under the same load.
+ */
+static void
+cli_bench_monitor(int argc, char **argv)
+{
+	if (!bench_monitor(&benchOptions))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_MONITOR);
+	}
+}
@@ -205,6 +205,7 @@ CommandLine do_discover =
 
 CommandLine *do_subcommands[] = {
 	&do_monitor_commands,
+	&do_bench_commands,
 	&do_fsm_commands,
 	&do_primary_,
 	&do_standby_,
@@ -18,6 +18,7 @@ extern CommandLine do_fsm_commands;
 
 /* src/bin/pg_autoctl/cli_do_monitor.c */
 extern CommandLine do_monitor_commands;
+extern CommandLine do_bench_commands;
 
 /* src/bin/pg_autoctl/cli_do_show.c */
 extern CommandLine do_show_commands;
@@ -0,0 +1,265 @@
+/*
+ * src/bin/pg_autoctl/cli_rolling.c
+ *     Implementation of a CLI to run an operation over the groups of a
+ *     formation, a few groups at a time.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+#include <getopt.h>
+#include <inttypes.h>
+
+#include "postgres_fe.h"
+
+#include "cli_common.h"
+#include "commandline.h"
+#include "defaults.h"
+#include "keeper_config.h"
+#include "monitor.h"
+#include "rolling.h"
+
+typedef struct RollingOptions
+{
+	char pgdata[MAXPGPATH];
+	char monitorURI[MAXCONNINFO];
+	int64_t cancelOperationId;
+	RollingContext rolling;
+} RollingOptions;
+
+static RollingOptions rollingOptions = { 0 };
+
+static int cli_rolling_getopts(int argc, char **argv);
+static void cli_rolling(int argc, char **argv);
+
+CommandLine rolling_command =
+	make_command("rolling",
+				 "Run an operation over the groups of a formation",
+				 " [ --pgdata --monitor --formation --operation "
+				 "--max-parallel --command --resume --cancel ] ",
+				 "  --pgdata       path to data directory	 \n"	\
+				 "  --monitor      monitor Postgres URL \n" \
+				 "  --formation    formation to operate, defaults to \"default\" \n" \
+				 "  --operation    one of switchover, failover or maintenance \n" \
+				 "  --max-parallel number of groups in progress at a time \n" \
+				 "  --command      shell command to run on nodes in maintenance \n" \
+				 "  --resume       follow a rolling operation again \n" \
+				 "  --cancel       don't start any other group of an operation \n",
+				 cli_rolling_getopts,
+				 cli_rolling);
+
+
+/*
+ * cli_rolling_getopts parses the command line options for the command
+ * `pg_autoctl rolling`.
+ */
+static int
+cli_rolling_getopts(int argc, char **argv)
+{
+	RollingOptions options = { 0 };
+	RollingContext *rolling = &(options.rolling);
+	int c, option_index = 0;
+
+	static struct option long_options[] = {
+		{ "pgdata", required_argument, NULL, 'D' },
+		{ "monitor", required_argument, NULL, 'm' },
+		{ "formation", required_argument, NULL, 'f' },
+		{ "operation", required_argument, NULL, 'o' },
+		{ "max-parallel", required_argument, NULL, 'p' },
+		{ "command", required_argument, NULL, 'c' },
+		{ "resume", required_argument, NULL, 'r' },
+		{ "cancel", required_argument, NULL, 'C' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	strlcpy(rolling->formation, FORMATION_DEFAULT, NAMEDATALEN);
+	rolling->maxParallel = 1;
+
+	optind = 0;
+
+	while ((c = getopt_long(argc, argv, "D:m:f:o:p:c:r:C:",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'D':
+			{
+				strlcpy(options.pgdata, optarg, MAXPGPATH);
+				log_trace("--pgdata %s", options.pgdata);
+				break;
+			}
+
+			case 'm':
+			{
+				strlcpy(options.monitorURI, optarg, MAXCONNINFO);
+				log_trace("--monitor %s", options.monitorURI);
+				break;
+			}
+
+			case 'f':
+			{
+				strlcpy(rolling->formation, optarg, NAMEDATALEN);
+				log_trace("--formation %s", rolling->formation);
+				break;
+			}
+
+			case 'o':
+			{
+				if (strcmp(optarg, "switchover") != 0 &&
+					strcmp(optarg, "failover") != 0 &&
+					strcmp(optarg, "maintenance") != 0)
+				{
+					log_fatal("--operation must be one of switchover, "
+							  "failover or maintenance, not \"%s\"", optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+
+				strlcpy(rolling->operation, optarg, NAMEDATALEN);
+				log_trace("--operation %s", rolling->operation);
+				break;
+			}
+
+			case 'p':
+			{
+				if (sscanf(optarg, "%d", &rolling->maxParallel) != 1 ||
+					rolling->maxParallel < 1)
+				{
+					log_fatal("--max-parallel argument is not a valid "
+							  "number of groups: \"%s\"", optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				log_trace("--max-parallel %d", rolling->maxParallel);
+				break;
+			}
+
+			case 'c':
+			{
+				strlcpy(rolling->command, optarg, BUFSIZE);
+				log_trace("--command %s", rolling->command);
+				break;
+			}
+
+			case 'r':
+			{
+				if (sscanf(optarg, "%" SCNd64, &rolling->operationId) != 1 ||
+					rolling->operationId <= 0)
+				{
+					log_fatal("--resume argument is not a valid rolling "
+							  "operation id: \"%s\"", optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				log_trace("--resume %" PRId64, rolling->operationId);
+				break;
+			}
+
+			case 'C':
+			{
+				if (sscanf(optarg, "%" SCNd64, &options.cancelOperationId) != 1 ||
+					options.cancelOperationId <= 0)
+				{
+					log_fatal("--cancel argument is not a valid rolling "
+							  "operation id: \"%s\"", optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				log_trace("--cancel %" PRId64, options.cancelOperationId);
+				break;
+			}
+
+			default:
+			{
+				log_error("Failed to parse command line, see above for details.");
+				exit(EXIT_CODE_BAD_ARGS);
+				break;
+			}
+		}
+	}
+
+	if (options.cancelOperationId == 0 && rolling->operationId == 0 &&
+		IS_EMPTY_STRING_BUFFER(rolling->operation))
+	{
+		log_fatal("Failed to parse command line: pg_autoctl rolling needs "
+				  "either --operation, --resume or --cancel");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* a node in maintenance leaves it when its command succeeds */
+	if (strcmp(rolling->operation, "maintenance") == 0 &&
+		IS_EMPTY_STRING_BUFFER(rolling->command))
+	{
+		log_fatal("Failed to parse command line: a rolling maintenance "
+				  "needs --command");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* without --monitor, use the monitor of the local node */
+	if (IS_EMPTY_STRING_BUFFER(options.monitorURI) &&
+		IS_EMPTY_STRING_BUFFER(options.pgdata))
+	{
+		char *pgdata = getenv("PGDATA");
+
+		if (pgdata == NULL)
+		{
+			log_fatal("Failed to get the monitor to use either from "
+					  "--monitor, or from --pgdata or the environment");
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+
+		strlcpy(options.pgdata, pgdata, MAXPGPATH);
+	}
+
+	rollingOptions = options;
+
+	return optind;
+}
+
+
+/*
+ * cli_rolling runs an operation over the groups of a formation, or follows
+ * or cancels one that has been started already.
+ */
+static void
+cli_rolling(int argc, char **argv)
+{
+	RollingContext *rolling = &(rollingOptions.rolling);
+	Monitor *monitor = &(rolling->monitor);
+
+	if (IS_EMPTY_STRING_BUFFER(rollingOptions.monitorURI))
+	{
+		KeeperConfig config = { 0 };
+
+		strlcpy(config.pgSetup.pgdata, rollingOptions.pgdata, MAXPGPATH);
+		set_first_pgctl(&(config.pgSetup));
+
+		if (!monitor_init_from_pgsetup(monitor, &config.pgSetup))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+	}
+	else if (!monitor_init(monitor, rollingOptions.monitorURI))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (rollingOptions.cancelOperationId > 0)
+	{
+		if (!monitor_rolling_operation_cancel(monitor,
+											  rollingOptions.cancelOperationId))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
+
+		log_info("Cancelled rolling operation %" PRId64 ", the groups in "
+				 "progress keep converging",
+				 rollingOptions.cancelOperationId);
+		return;
+	}
+
+	if (!rolling_run(rolling))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_MONITOR);
+	}
+}
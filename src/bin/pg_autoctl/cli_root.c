@@ -11,6 +11,7 @@
 #include "cli_common.h"
 #include "cli_root.h"
 #include "commandline.h"
+#include "trace.h"
 
 /* local bindings for all the commands */
 CommandLine help =
@@ -37,6 +38,8 @@ CommandLine *show_subcommands[] = {
 	&show_uri_command,
 	&show_events_command,
 	&show_state_command,
+	&show_timings_command,
+	&show_status_command,
 	&systemd_cat_service_file_command,
 	NULL
 };
@@ -65,10 +68,14 @@ CommandLine *root_subcommands_with_debug[] = {
 	&drop_commands,
 	&config_commands,
 	&show_commands,
+	&watch_command,
+	&route_command,
+	&rolling_command,
 	&enable_commands,
 	&disable_commands,
 	&do_commands,
 	&service_run_command,
+	&service_supervise_command,
 	&service_stop_command,
 	&service_reload_command,
 	&help,
@@ -79,7 +86,7 @@ CommandLine *root_subcommands_with_debug[] = {
 CommandLine root_with_debug =
 	make_command_set("pg_autoctl",
 					 "pg_auto_failover control tools and service",
-					 "[ --debug|verbose|quiet ]", NULL,
+					 "[ --debug|verbose|quiet --trace FILE ]", NULL,
 					 root_options, root_subcommands_with_debug);
 
 
@@ -88,9 +95,13 @@ CommandLine *root_subcommands[] = {
 	&drop_commands,
 	&config_commands,
 	&show_commands,
+	&watch_command,
+	&route_command,
+	&rolling_command,
 	&enable_commands,
 	&disable_commands,
 	&service_run_command,
+	&service_supervise_command,
 	&service_stop_command,
 	&service_reload_command,
 	&help,
@@ -101,7 +112,7 @@ CommandLine *root_subcommands[] = {
 CommandLine root =
 	make_command_set("pg_autoctl",
 					 "pg_auto_failover control tools and service",
-					 "[ --verbose --quiet ]", NULL,
+					 "[ --verbose --quiet --trace FILE ]", NULL,
 					 root_options, root_subcommands);
 
 
@@ -118,6 +129,7 @@ root_options(int argc, char **argv)
 		{ "version", no_argument, NULL, 'V' },
 		{ "verbose", no_argument, NULL, 'v' },
 		{ "quiet", no_argument, NULL, 'q' },
+		{ "trace", required_argument, NULL, 'T' },
 		{ NULL, 0, NULL, 0 }
 	};
 
@@ -125,7 +137,7 @@ root_options(int argc, char **argv)
 
 	optind = 0;
 
-	while ((c = getopt_long(argc, argv, "Vvq",
+	while ((c = getopt_long(argc, argv, "VvqT:",
 							long_options, &option_index)) != -1)
 	{
 		switch (c)
@@ -163,6 +175,16 @@ root_options(int argc, char **argv)
 				break;
 			}
 
+			case 'T':
+			{
+				if (!trace_start(optarg))
+				{
+					/* errors have already been logged */
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				break;
+			}
+
 			default:
 			{
 				/* getopt_long already wrote an error message */
@@ -0,0 +1,262 @@
+/*
+ * src/bin/pg_autoctl/cli_route.c
+ *     Implementation of a CLI that routes the clients to the primary nodes as
+ *     soon as the pg_auto_failover monitors notify a change of primary.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+#include <getopt.h>
+
+#include "postgres_fe.h"
+
+#include "cli_common.h"
+#include "commandline.h"
+#include "defaults.h"
+#include "keeper_config.h"
+#include "monitor.h"
+#include "route.h"
+#include "watch.h"
+
+typedef struct RouteOptions
+{
+	char pgdata[MAXPGPATH];
+	char formation[NAMEDATALEN];
+	int groupId;
+	char *monitorURIs[WATCH_MAX_MONITORS];
+	int monitorCount;
+	RouteContext route;
+} RouteOptions;
+
+static RouteOptions routeOptions = { 0 };
+
+static int cli_route_getopts(int argc, char **argv);
+static void cli_route(int argc, char **argv);
+
+CommandLine route_command =
+	make_command("route",
+				 "Route the clients to the new primary as soon as it's notified",
+				 " [ --pgdata --monitor ... --formation --group "
+				 "--hook --pooler-config --pooler-uri --pooler-database ] ",
+				 "  --pgdata          path to data directory	 \n"	\
+				 "  --monitor         monitor Postgres URL, can be repeated \n" \
+				 "  --formation       formation to route, defaults to all \n" \
+				 "  --group           group to route, defaults to all \n" \
+				 "  --hook            shell command to run on a new primary \n" \
+				 "  --pooler-config   pgbouncer [databases] file to rewrite \n" \
+				 "  --pooler-uri      pgbouncer admin console, to RELOAD \n" \
+				 "  --pooler-database pgbouncer database name, defaults to * \n",
+				 cli_route_getopts,
+				 cli_route);
+
+
+/*
+ * cli_route_getopts parses the command line options for the command
+ * `pg_autoctl route`.
+ */
+static int
+cli_route_getopts(int argc, char **argv)
+{
+	RouteOptions options = { 0 };
+	int c, option_index = 0;
+
+	static struct option long_options[] = {
+		{ "pgdata", required_argument, NULL, 'D' },
+		{ "monitor", required_argument, NULL, 'm' },
+		{ "formation", required_argument, NULL, 'f' },
+		{ "group", required_argument, NULL, 'g' },
+		{ "hook", required_argument, NULL, 'H' },
+		{ "pooler-config", required_argument, NULL, 'c' },
+		{ "pooler-uri", required_argument, NULL, 'u' },
+		{ "pooler-database", required_argument, NULL, 'd' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	options.groupId = -1;
+	strlcpy(options.route.poolerDatabase,
+			ROUTE_DEFAULT_POOLER_DATABASE, NAMEDATALEN);
+
+	optind = 0;
+
+	while ((c = getopt_long(argc, argv, "D:m:f:g:H:c:u:d:",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'D':
+			{
+				strlcpy(options.pgdata, optarg, MAXPGPATH);
+				log_trace("--pgdata %s", options.pgdata);
+				break;
+			}
+
+			case 'm':
+			{
+				if (options.monitorCount >= WATCH_MAX_MONITORS)
+				{
+					log_fatal("Failed to parse command line: pg_autoctl route "
+							  "supports at most %d monitors",
+							  WATCH_MAX_MONITORS);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+
+				options.monitorURIs[options.monitorCount++] = optarg;
+				log_trace("--monitor %s", optarg);
+				break;
+			}
+
+			case 'f':
+			{
+				strlcpy(options.formation, optarg, NAMEDATALEN);
+				log_trace("--formation %s", options.formation);
+				break;
+			}
+
+			case 'g':
+			{
+				int scanResult = sscanf(optarg, "%d", &options.groupId);
+				if (scanResult == 0)
+				{
+					log_fatal("--group argument is not a valid group ID: \"%s\"",
+							  optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				log_trace("--group %d", options.groupId);
+				break;
+			}
+
+			case 'H':
+			{
+				strlcpy(options.route.hookCommand, optarg, BUFSIZE);
+				log_trace("--hook %s", options.route.hookCommand);
+				break;
+			}
+
+			case 'c':
+			{
+				strlcpy(options.route.poolerConfig, optarg, MAXPGPATH);
+				log_trace("--pooler-config %s", options.route.poolerConfig);
+				break;
+			}
+
+			case 'u':
+			{
+				strlcpy(options.route.poolerURI, optarg, MAXCONNINFO);
+				log_trace("--pooler-uri %s", options.route.poolerURI);
+				break;
+			}
+
+			case 'd':
+			{
+				strlcpy(options.route.poolerDatabase, optarg, NAMEDATALEN);
+				log_trace("--pooler-database %s", options.route.poolerDatabase);
+				break;
+			}
+
+			default:
+			{
+				log_error("Failed to parse command line, see above for details.");
+				exit(EXIT_CODE_BAD_ARGS);
+				break;
+			}
+		}
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(options.route.hookCommand) &&
+		IS_EMPTY_STRING_BUFFER(options.route.poolerConfig))
+	{
+		log_fatal("Failed to parse command line: pg_autoctl route needs "
+				  "either --hook or --pooler-config");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(options.route.poolerURI) &&
+		IS_EMPTY_STRING_BUFFER(options.route.poolerConfig))
+	{
+		log_fatal("Failed to parse command line: --pooler-uri is only "
+				  "used with --pooler-config");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* the pooler configuration routes to the primary of a single group */
+	if (!IS_EMPTY_STRING_BUFFER(options.route.poolerConfig))
+	{
+		if (IS_EMPTY_STRING_BUFFER(options.formation))
+		{
+			strlcpy(options.formation, FORMATION_DEFAULT, NAMEDATALEN);
+		}
+
+		if (options.groupId < 0)
+		{
+			options.groupId = 0;
+		}
+	}
+
+	/* without --monitor, use the monitor of the local node */
+	if (options.monitorCount == 0 && IS_EMPTY_STRING_BUFFER(options.pgdata))
+	{
+		char *pgdata = getenv("PGDATA");
+
+		if (pgdata == NULL)
+		{
+			log_fatal("Failed to get the monitor to follow either from "
+					  "--monitor, or from --pgdata or the environment");
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+
+		strlcpy(options.pgdata, pgdata, MAXPGPATH);
+	}
+
+	routeOptions = options;
+
+	return optind;
+}
+
+
+/*
+ * cli_route follows the primary nodes of the given monitors, and routes the
+ * clients to the new primary of a group as soon as it's notified.
+ */
+static void
+cli_route(int argc, char **argv)
+{
+	static WatchContext context = { 0 };
+	Monitor localMonitor = { 0 };
+
+	if (routeOptions.monitorCount == 0)
+	{
+		KeeperConfig config = { 0 };
+
+		strlcpy(config.pgSetup.pgdata, routeOptions.pgdata, MAXPGPATH);
+		set_first_pgctl(&(config.pgSetup));
+
+		if (!monitor_init_from_pgsetup(&localMonitor, &config.pgSetup))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+
+		routeOptions.monitorURIs[routeOptions.monitorCount++] =
+			localMonitor.pgsql.connectionString;
+	}
+
+	if (!watch_init(&context,
+					routeOptions.monitorURIs, routeOptions.monitorCount,
+					routeOptions.formation, routeOptions.groupId))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* notifications are applied as they are, without querying the monitor */
+	context.quiet = true;
+	context.primaryChanged = &route_primary_changed;
+	context.primaryChangedContext = &(routeOptions.route);
+
+	if (!watch_main_loop(&context))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_MONITOR);
+	}
+}
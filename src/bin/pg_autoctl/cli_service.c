@@ -21,6 +21,9 @@
 #include "fsm.h"
 #include "keeper_config.h"
 #include "keeper.h"
+#include "keeper_restart.h"
+#include "liveness.h"
+#include "metrics.h"
 #include "monitor.h"
 #include "monitor_config.h"
 #include "signals.h"
@@ -30,6 +33,8 @@ static int stop_signal = SIGTERM;
 static void cli_service_run(int argc, char **argv);
 static void cli_keeper_run(int argc, char **argv);
 static void cli_monitor_run(int argc, char **argv);
+static void cli_service_supervise(int argc, char **argv);
+static bool cli_service_start_async_logging(void);
 
 static int cli_getopt_pgdata_and_mode(int argc, char **argv);
 
@@ -44,6 +49,15 @@ CommandLine service_run_command =
 				 keeper_cli_getopt_pgdata,
 				 cli_service_run);
 
+CommandLine service_supervise_command =
+	make_command("supervise",
+				 "Run the keeper services of several Postgres instances "
+				 "in one process",
+				 " pgdata [ pgdata ... ]",
+				 "  pgdata        path to the data directory of a keeper \n",
+				 NULL,
+				 cli_service_supervise);
+
 CommandLine service_stop_command =
 	make_command("stop",
 				 "signal the pg_autoctl service for it to stop",
@@ -63,6 +77,23 @@ CommandLine service_reload_command =
 				 cli_service_reload);
 
 
+/*
+ * cli_service_start_async_logging makes the service log from a writer thread,
+ * so that the service loop doesn't wait on stderr or the disk when they're
+ * slow to accept our log messages.
+ */
+static bool
+cli_service_start_async_logging(void)
+{
+	if (!log_set_async(true))
+	{
+		log_warn("Failed to start the logging thread, logging synchronously");
+		return false;
+	}
+	return true;
+}
+
+
 /*
  * cli_service_run starts the local pg_auto_failover service, either the
  * monitor or the keeper, depending on the configuration file associated with
@@ -80,6 +111,8 @@ cli_service_run(int argc, char **argv)
 		exit(EXIT_CODE_BAD_CONFIG);
 	}
 
+	(void) cli_service_start_async_logging();
+
 	switch (ProbeConfigurationFileRole(config.pathnames.config))
 	{
 		case PG_AUTOCTL_ROLE_MONITOR:
@@ -130,9 +163,10 @@ cli_keeper_run(int argc, char **argv)
 		exit(EXIT_CODE_KEEPER);
 	}
 
-	keeper_config_read_file(&(keeper.config),
-							missing_pgdata_is_ok,
-							pg_is_not_running_is_ok);
+	/* discovers the Postgres setup, unless we just stopped */
+	keeper_restart_read_config(&keeper,
+							   missing_pgdata_is_ok,
+							   pg_is_not_running_is_ok);
 
 	if (!keeper_init(&keeper, &keeper.config))
 	{
@@ -146,7 +180,123 @@ cli_keeper_run(int argc, char **argv)
 		exit(EXIT_CODE_MONITOR);
 	}
 
+	/* the service runs without its metrics when we fail to serve them */
+	if (keeper.config.http_port > 0)
+	{
+		(void) metrics_start_server(keeper.config.http_listen_address,
+									keeper.config.http_port);
+	}
+
+	/* and without its liveness heartbeats, relying on the monitor alone */
+	if (keeper.config.liveness_port > 0)
+	{
+		(void) liveness_start(keeper.config.liveness_port,
+							  keeper.config.liveness_interval);
+	}
+
 	keeper_service_run(&keeper, &pid);
+
+	(void) liveness_stop();
+	(void) metrics_stop_server();
+}
+
+
+/*
+ * cli_service_supervise runs the keepers of each of the given PGDATA
+ * directories within a single pg_autoctl process, that shares a single
+ * connection to the monitor in between all the keepers.
+ */
+static void
+cli_service_supervise(int argc, char **argv)
+{
+	Keeper *keepers = NULL;
+	pid_t *pids = NULL;
+	bool missing_pgdata_is_ok = true;
+	bool pg_is_not_running_is_ok = true;
+	int index = 0;
+
+	if (argc < 1)
+	{
+		log_fatal("Please provide the PGDATA directory of at least one keeper");
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	(void) cli_service_start_async_logging();
+
+	keepers = (Keeper *) calloc(argc, sizeof(Keeper));
+	pids = (pid_t *) calloc(argc, sizeof(pid_t));
+
+	if (keepers == NULL || pids == NULL)
+	{
+		log_fatal("Failed to allocate memory for %d keepers", argc);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	for (index = 0; index < argc; index++)
+	{
+		Keeper *keeper = &(keepers[index]);
+		KeeperConfig *config = &(keeper->config);
+
+		strlcpy(config->pgSetup.pgdata, argv[index], MAXPGPATH);
+
+		if (!keeper_config_set_pathnames_from_pgdata(&(config->pathnames),
+													 config->pgSetup.pgdata))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_BAD_CONFIG);
+		}
+
+		if (ProbeConfigurationFileRole(config->pathnames.config)
+			!= PG_AUTOCTL_ROLE_KEEPER)
+		{
+			log_fatal("Expected a keeper configuration file at \"%s\"",
+					  config->pathnames.config);
+			exit(EXIT_CODE_BAD_CONFIG);
+		}
+
+		log_info("Managing PostgreSQL installation at \"%s\"",
+				 config->pgSetup.pgdata);
+
+		/* see cli_keeper_run for why we do that before reading the config */
+		if (!keeper_service_init(keeper, &(pids[index])))
+		{
+			log_fatal("Failed to initialize pg_auto_failover service, "
+					  "see above for details");
+			exit(EXIT_CODE_KEEPER);
+		}
+
+		keeper_restart_read_config(keeper,
+								   missing_pgdata_is_ok,
+								   pg_is_not_running_is_ok);
+
+		if (index > 0 &&
+			strcmp(config->monitor_pguri, keepers[0].config.monitor_pguri) != 0)
+		{
+			log_fatal("The keeper at \"%s\" uses another monitor than the "
+					  "keeper at \"%s\", and they can't be supervised together",
+					  config->pgSetup.pgdata, keepers[0].config.pgSetup.pgdata);
+			exit(EXIT_CODE_BAD_CONFIG);
+		}
+
+		if (!keeper_init(keeper, config))
+		{
+			log_fatal("Failed to initialise keeper, see above for details");
+			exit(EXIT_CODE_PGCTL);
+		}
+
+		if (!keeper_check_monitor_extension_version(keeper))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
+	}
+
+	if (!keeper_supervisor_run(keepers, pids, argc))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
 }
 
 
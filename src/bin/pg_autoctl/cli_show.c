@@ -27,8 +27,12 @@
 #include "pgsetup.h"
 #include "pgsql.h"
 #include "state.h"
+#include "status_page.h"
+#include "watch.h"
 
 static int eventCount = 10;
+static bool watchState = false;
+static char uriRole[NAMEDATALEN] = { 0 };
 
 static int cli_show_state_getopts(int argc, char **argv);
 static void cli_show_state(int argc, char **argv);
@@ -39,12 +43,16 @@ static void cli_show_uri(int argc, char **argv);
 static void cli_show_monitor_uri(int argc, char **argv);
 static void cli_show_formation_uri(int argc, char **argv);
 
+static void cli_show_timings(int argc, char **argv);
+static void cli_show_status(int argc, char **argv);
+
 CommandLine show_uri_command =
 	make_command("uri",
 				 "Show the postgres uri to use to connect to pg_auto_failover nodes",
-				 " [ --pgdata --formation ] ",
+				 " [ --pgdata --formation --role ] ",
 				 "  --pgdata      path to data directory\n"	\
-				 "  --formation   show the coordinator uri of given formation\n",
+				 "  --formation   show the coordinator uri of given formation\n" \
+				 "  --role        read-write, read-only, prefer-standby or any\n",
 				 cli_show_uri_getopts,
 				 cli_show_uri);
 
@@ -62,13 +70,30 @@ CommandLine show_events_command =
 CommandLine show_state_command =
 	make_command("state",
 				 "Prints monitor's state of nodes in a given formation and group",
-				 " [ --pgdata --formation --group ] ",
+				 " [ --pgdata --formation --group --watch ] ",
 				 "  --pgdata      path to data directory	 \n"		\
 				 "  --formation   formation to query, defaults to 'default' \n" \
-				 "  --group       group to query formation, defaults to all \n",
+				 "  --group       group to query formation, defaults to all \n" \
+				 "  --watch       keep printing the state as it changes \n",
 				 cli_show_state_getopts,
 				 cli_show_state);
 
+CommandLine show_timings_command =
+	make_command("timings",
+				 "Prints how long the last state transitions of this node took",
+				 " [ --pgdata ] ",
+				 KEEPER_CLI_PGDATA_OPTION,
+				 keeper_cli_getopt_pgdata,
+				 cli_show_timings);
+
+CommandLine show_status_command =
+	make_command("status",
+				 "Prints the status that the local pg_autoctl service publishes",
+				 " [ --pgdata ] ",
+				 KEEPER_CLI_PGDATA_OPTION,
+				 keeper_cli_getopt_pgdata,
+				 cli_show_status);
+
 
 
 /*
@@ -86,22 +111,37 @@ cli_show_state_getopts(int argc, char **argv)
 		{ "formation", required_argument, NULL, 'f' },
 		{ "group", required_argument, NULL, 'g' },
 		{ "count", required_argument, NULL, 'n' },
+		{ "watch", no_argument, NULL, 'w' },
 		{ NULL, 0, NULL, 0 }
 	};
 
 	/* set default values for our options, when we have some */
 	options.groupId = -1;
+	options.prewarm_interval = -1;
+	options.catchup_acceleration = -1;
+	options.slot_wal_budget = -1;
+	options.http_port = -1;
+	options.liveness_port = -1;
+	options.liveness_interval = -1;
 	options.network_partition_timeout = -1;
+	options.network_partition_read_only = -1;
 	options.prepare_promotion_catchup = -1;
 	options.prepare_promotion_walreceiver = -1;
 	options.postgresql_restart_failure_timeout = -1;
 	options.postgresql_restart_failure_max_retries = -1;
+	options.heartbeat_interval = -1;
+	options.keepalives.idle = -1;
+	options.keepalives.interval = -1;
+	options.keepalives.count = -1;
+	options.keepalives.tcpUserTimeout = -1;
+	options.hook_timeout = -1;
+	options.hook_max_processes = -1;
 
 	strlcpy(options.formation, "default", NAMEDATALEN);
 
 	optind = 0;
 
-	while ((c = getopt_long(argc, argv, "D:f:g:n:",
+	while ((c = getopt_long(argc, argv, "D:f:g:n:w",
 							long_options, &option_index)) != -1)
 	{
 		switch (c)
@@ -145,6 +185,13 @@ cli_show_state_getopts(int argc, char **argv)
 				log_trace("--count %d", eventCount);
 				break;
 			}
+
+			case 'w':
+			{
+				watchState = true;
+				log_trace("--watch");
+				break;
+			}
 		}
 	}
 
@@ -184,7 +231,8 @@ cli_show_events(int argc, char **argv)
 	KeeperConfig config = keeperOptions;
 	Monitor monitor = { 0 };
 
-	if (!monitor_init_from_pgsetup(&monitor, &config.pgSetup))
+	if (!monitor_init_from_pgsetup(&monitor, &config.pgSetup) ||
+		!monitor_prefer_standby(&monitor))
 	{
 		/* errors have already been logged */
 		exit(EXIT_CODE_BAD_ARGS);
@@ -204,6 +252,10 @@ cli_show_events(int argc, char **argv)
 /*
  * keeper_cli_monitor_print_state prints the current state of given formation
  * and port from the monitor's point of view.
+ *
+ * With --watch, we fetch the state once, and then LISTEN to the monitor's
+ * state changes: each notification has us fetch the state of the group of
+ * the node again, and only that group, rather than of the whole formation.
  */
 static void
 cli_show_state(int argc, char **argv)
@@ -217,6 +269,36 @@ cli_show_state(int argc, char **argv)
 		exit(EXIT_CODE_BAD_ARGS);
 	}
 
+	if (watchState)
+	{
+		static WatchContext context = { 0 };
+		char *monitorURIs[] = { monitor.pgsql.connectionString };
+
+		if (!watch_init(&context, monitorURIs, 1,
+						config.formation, config.groupId))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+
+		context.refreshGroups = true;
+
+		if (!watch_main_loop(&context))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
+
+		return;
+	}
+
+	/* LISTEN needs the primary monitor, a snapshot is fine on a standby */
+	if (!monitor_prefer_standby(&monitor))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
 	if (!monitor_print_state(&monitor, config.formation, config.groupId))
 	{
 		/* errors have already been logged */
@@ -238,20 +320,35 @@ cli_show_uri_getopts(int argc, char **argv)
 	static struct option long_options[] = {
 		{ "pgdata", required_argument, NULL, 'D' },
 		{ "formation", required_argument, NULL, 'f' },
+		{ "role", required_argument, NULL, 'r' },
 		{ NULL, 0, NULL, 0 }
 	};
 
 	/* set default values for our options, when we have some */
 	options.groupId = -1;
+	options.prewarm_interval = -1;
+	options.catchup_acceleration = -1;
+	options.slot_wal_budget = -1;
+	options.http_port = -1;
+	options.liveness_port = -1;
+	options.liveness_interval = -1;
 	options.network_partition_timeout = -1;
+	options.network_partition_read_only = -1;
 	options.prepare_promotion_catchup = -1;
 	options.prepare_promotion_walreceiver = -1;
 	options.postgresql_restart_failure_timeout = -1;
 	options.postgresql_restart_failure_max_retries = -1;
+	options.heartbeat_interval = -1;
+	options.keepalives.idle = -1;
+	options.keepalives.interval = -1;
+	options.keepalives.count = -1;
+	options.keepalives.tcpUserTimeout = -1;
+	options.hook_timeout = -1;
+	options.hook_max_processes = -1;
 
 	optind = 0;
 
-	while ((c = getopt_long(argc, argv, "D:f:m",
+	while ((c = getopt_long(argc, argv, "D:f:r:m",
 							long_options, &option_index)) != -1)
 	{
 		switch (c)
@@ -270,6 +367,13 @@ cli_show_uri_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'r':
+			{
+				strlcpy(uriRole, optarg, NAMEDATALEN);
+				log_trace("--role %s", uriRole);
+				break;
+			}
+
 			default:
 			{
 				log_error("Failed to parse command line, see above for details.");
@@ -306,7 +410,8 @@ static void
 cli_show_uri(int argc, char **argv)
 {
 	KeeperConfig config = keeperOptions;
-	if (!IS_EMPTY_STRING_BUFFER(config.formation))
+	if (!IS_EMPTY_STRING_BUFFER(config.formation) ||
+		!IS_EMPTY_STRING_BUFFER(uriRole))
 	{
 		(void) cli_show_formation_uri(argc, argv);
 	}
@@ -333,13 +438,16 @@ cli_show_formation_uri(int argc, char **argv)
 		strlcpy(config.formation, FORMATION_DEFAULT, NAMEDATALEN);
 	}
 
-	if (!monitor_init_from_pgsetup(&monitor, &config.pgSetup))
+	if (!monitor_init_from_pgsetup(&monitor, &config.pgSetup) ||
+		!monitor_prefer_standby(&monitor))
 	{
 		/* errors have already been logged */
 		exit(EXIT_CODE_BAD_ARGS);
 	}
 
-	if (!monitor_formation_uri(&monitor, config.formation, postgresUri, MAXCONNINFO) )
+	if (!monitor_formation_uri(&monitor, config.formation,
+							   IS_EMPTY_STRING_BUFFER(uriRole) ? NULL : uriRole,
+							   postgresUri, MAXCONNINFO))
 	{
 		/* errors have already been logged */
 		exit(EXIT_CODE_MONITOR);
@@ -424,3 +532,94 @@ cli_show_monitor_uri(int argc, char **argv)
 		}
 	}
 }
+
+
+/*
+ * cli_show_timings prints the timings of the last state transitions of the
+ * local node, as kept by the keeper in the KEEPER_TIMINGS_FILENAME file.
+ */
+static void
+cli_show_timings(int argc, char **argv)
+{
+	KeeperConfig config = keeperOptions;
+	char filename[MAXPGPATH] = { 0 };
+	char *contents = NULL;
+	long size = 0;
+
+	path_in_same_directory(config.pathnames.state,
+						   KEEPER_TIMINGS_FILENAME, filename);
+
+	if (!file_exists(filename))
+	{
+		log_info("No state transition has been timed yet: \"%s\" "
+				 "does not exist", filename);
+		exit(EXIT_CODE_QUIT);
+	}
+
+	if (!read_file(filename, &contents, &size))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_STATE);
+	}
+
+	fprintf(stdout, "%s", contents);
+
+	free(contents);
+}
+
+
+/*
+ * cli_show_status prints the status page that the running keeper service
+ * publishes in the KEEPER_STATUS_FILENAME file, see status_page.c. That's
+ * local only: we don't contact the monitor nor Postgres.
+ */
+static void
+cli_show_status(int argc, char **argv)
+{
+	KeeperConfig config = keeperOptions;
+	KeeperStatusPage status = { 0 };
+	char filename[MAXPGPATH] = { 0 };
+
+	path_in_same_directory(config.pathnames.pid,
+						   KEEPER_STATUS_FILENAME, filename);
+
+	if (!file_exists(filename))
+	{
+		log_error("The pg_autoctl service is not running: \"%s\" "
+				  "does not exist", filename);
+		exit(EXIT_CODE_BAD_STATE);
+	}
+
+	if (!status_page_read(filename, &status))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_STATE);
+	}
+
+	fprintf(stdout, "pg_autoctl pid:           %d\n", status.pid);
+	fprintf(stdout, "Last Update:              %s\n",
+			epoch_to_string(status.updateTime));
+	fprintf(stdout, "Loop Count:               %" PRIu64 "\n", status.loopCount);
+	fprintf(stdout, "Loop Duration:            %.3fs\n", status.loopSeconds);
+	fprintf(stdout, "Monitor Call Duration:    %.3fs\n",
+			status.nodeActiveSeconds);
+
+	fprintf(stdout, "Current Role:             %s\n",
+			NodeStateToString(status.currentRole));
+	fprintf(stdout, "Assigned Role:            %s\n",
+			NodeStateToString(status.assignedRole));
+	fprintf(stdout, "Last Monitor Contact:     %s\n",
+			epoch_to_string(status.lastMonitorContact));
+	fprintf(stdout, "Last Secondary Contact:   %s\n",
+			epoch_to_string(status.lastSecondaryContact));
+
+	fprintf(stdout, "group:                    %d\n", status.groupId);
+	fprintf(stdout, "node id:                  %d\n", status.nodeId);
+
+	fprintf(stdout, "Postgres is running:      %s\n",
+			status.pgIsRunning ? "yes" : "no");
+	fprintf(stdout, "Sync State:               %s\n", status.syncState);
+	fprintf(stdout, "Current LSN:              %s\n", status.currentLSN);
+	fprintf(stdout, "Received LSN:             %s\n", status.receivedLSN);
+	fprintf(stdout, "Replayed LSN:             %s\n", status.replayedLSN);
+}
@@ -0,0 +1,262 @@
+/*
+ * src/bin/pg_autoctl/cli_watch.c
+ *     Implementation of a CLI to watch the state of the nodes of one or
+ *     several pg_auto_failover monitors.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+#include <getopt.h>
+
+#include "postgres_fe.h"
+
+#include "cli_common.h"
+#include "commandline.h"
+#include "defaults.h"
+#include "keeper_config.h"
+#include "monitor.h"
+#include "watch.h"
+
+typedef struct WatchOptions
+{
+	char pgdata[MAXPGPATH];
+	char formation[NAMEDATALEN];
+	int groupId;
+	char *monitorURIs[WATCH_MAX_MONITORS];
+	int monitorCount;
+} WatchOptions;
+
+static WatchOptions watchOptions = { 0 };
+
+/* monitors that the given monitors delegated formations to */
+static char delegatedMonitorURIs[WATCH_MAX_MONITORS][MAXCONNINFO];
+
+static int cli_watch_getopts(int argc, char **argv);
+static void cli_watch(int argc, char **argv);
+static void cli_watch_add_delegated_monitors(void);
+
+CommandLine watch_command =
+	make_command("watch",
+				 "Watch the state of the nodes of one or several monitors",
+				 " [ --pgdata --monitor ... --formation --group ] ",
+				 "  --pgdata      path to data directory	 \n"		\
+				 "  --monitor     monitor Postgres URL, can be repeated \n" \
+				 "  --formation   formation to watch, defaults to all \n" \
+				 "  --group       group to watch, defaults to all \n",
+				 cli_watch_getopts,
+				 cli_watch);
+
+
+/*
+ * cli_watch_getopts parses the command line options for the command
+ * `pg_autoctl watch`.
+ */
+static int
+cli_watch_getopts(int argc, char **argv)
+{
+	WatchOptions options = { 0 };
+	int c, option_index = 0;
+
+	static struct option long_options[] = {
+		{ "pgdata", required_argument, NULL, 'D' },
+		{ "monitor", required_argument, NULL, 'm' },
+		{ "formation", required_argument, NULL, 'f' },
+		{ "group", required_argument, NULL, 'g' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	options.groupId = -1;
+
+	optind = 0;
+
+	while ((c = getopt_long(argc, argv, "D:m:f:g:",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'D':
+			{
+				strlcpy(options.pgdata, optarg, MAXPGPATH);
+				log_trace("--pgdata %s", options.pgdata);
+				break;
+			}
+
+			case 'm':
+			{
+				if (options.monitorCount >= WATCH_MAX_MONITORS)
+				{
+					log_fatal("Failed to parse command line: pg_autoctl watch "
+							  "supports at most %d monitors",
+							  WATCH_MAX_MONITORS);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+
+				options.monitorURIs[options.monitorCount++] = optarg;
+				log_trace("--monitor %s", optarg);
+				break;
+			}
+
+			case 'f':
+			{
+				strlcpy(options.formation, optarg, NAMEDATALEN);
+				log_trace("--formation %s", options.formation);
+				break;
+			}
+
+			case 'g':
+			{
+				int scanResult = sscanf(optarg, "%d", &options.groupId);
+				if (scanResult == 0)
+				{
+					log_fatal("--group argument is not a valid group ID: \"%s\"",
+							  optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				log_trace("--group %d", options.groupId);
+				break;
+			}
+
+			default:
+			{
+				log_error("Failed to parse command line, see above for details.");
+				exit(EXIT_CODE_BAD_ARGS);
+				break;
+			}
+		}
+	}
+
+	/* without --monitor, watch the monitor of the local node */
+	if (options.monitorCount == 0 && IS_EMPTY_STRING_BUFFER(options.pgdata))
+	{
+		char *pgdata = getenv("PGDATA");
+
+		if (pgdata == NULL)
+		{
+			log_fatal("Failed to get the monitor to watch either from "
+					  "--monitor, or from --pgdata or the environment");
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+
+		strlcpy(options.pgdata, pgdata, MAXPGPATH);
+	}
+
+	watchOptions = options;
+
+	return optind;
+}
+
+
+/*
+ * cli_watch prints the state of the nodes of the given monitors, and then
+ * prints again the nodes that they notify us about.
+ */
+static void
+cli_watch(int argc, char **argv)
+{
+	static WatchContext context = { 0 };
+	Monitor localMonitor = { 0 };
+
+	if (watchOptions.monitorCount == 0)
+	{
+		KeeperConfig config = { 0 };
+
+		strlcpy(config.pgSetup.pgdata, watchOptions.pgdata, MAXPGPATH);
+		set_first_pgctl(&(config.pgSetup));
+
+		if (!monitor_init_from_pgsetup(&localMonitor, &config.pgSetup))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+
+		watchOptions.monitorURIs[watchOptions.monitorCount++] =
+			localMonitor.pgsql.connectionString;
+	}
+
+	(void) cli_watch_add_delegated_monitors();
+
+	if (!watch_init(&context,
+					watchOptions.monitorURIs, watchOptions.monitorCount,
+					watchOptions.formation, watchOptions.groupId))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (!watch_main_loop(&context))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_MONITOR);
+	}
+}
+
+
+/*
+ * cli_watch_add_delegated_monitors adds the regional monitors that the given
+ * monitors delegated formations to, so that watching a root monitor shows
+ * the nodes of all its formations. A monitor that we can't ask is still
+ * watched, we just don't know about its regional monitors.
+ */
+static void
+cli_watch_add_delegated_monitors(void)
+{
+	int givenCount = watchOptions.monitorCount;
+	int delegatedCount = 0;
+
+	for (int givenIndex = 0; givenIndex < givenCount; givenIndex++)
+	{
+		Monitor monitor = { 0 };
+		char monitorURIs[WATCH_MAX_MONITORS][MAXCONNINFO];
+		int count = 0;
+
+		if (!monitor_init(&monitor, watchOptions.monitorURIs[givenIndex]) ||
+			!monitor_get_delegated_monitors(&monitor, monitorURIs,
+											WATCH_MAX_MONITORS, &count))
+		{
+			log_warn("Failed to get the regional monitors of monitor %d, "
+					 "see above for details", givenIndex + 1);
+			continue;
+		}
+
+		pgsql_finish(&(monitor.pgsql));
+
+		for (int index = 0; index < count; index++)
+		{
+			bool known = false;
+
+			for (int monitorIndex = 0;
+				 monitorIndex < watchOptions.monitorCount;
+				 monitorIndex++)
+			{
+				if (strcmp(watchOptions.monitorURIs[monitorIndex],
+						   monitorURIs[index]) == 0)
+				{
+					known = true;
+					break;
+				}
+			}
+
+			if (known)
+			{
+				continue;
+			}
+
+			if (watchOptions.monitorCount >= WATCH_MAX_MONITORS)
+			{
+				log_warn("Skipping regional monitor %s: pg_autoctl watch "
+						 "supports at most %d monitors",
+						 monitorURIs[index], WATCH_MAX_MONITORS);
+				continue;
+			}
+
+			strlcpy(delegatedMonitorURIs[delegatedCount], monitorURIs[index],
+					MAXCONNINFO);
+
+			watchOptions.monitorURIs[watchOptions.monitorCount++] =
+				delegatedMonitorURIs[delegatedCount++];
+
+			log_info("Watching regional monitor %s", monitorURIs[index]);
+		}
+	}
+}
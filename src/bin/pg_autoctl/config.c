@@ -23,8 +23,9 @@
 
 /*
  * build_xdg_path is an helper function that builds the full path to an XDG
- * compatible resource: either a configuration file, a runtime file, or a data
- * file.
+ * compatible resource: either a configuration file, a runtime file, a data
+ * file, or a cache file. When pgdata is NULL, the resource is shared by all
+ * the pg_autoctl nodes of the current user.
  */
 bool
 build_xdg_path(char *dst,
@@ -56,6 +57,12 @@ build_xdg_path(char *dst,
 			break;
 		}
 
+		case XDG_CACHE:
+		{
+			xdg_topdir = getenv("XDG_CACHE_HOME");
+			break;
+		}
+
 		case XDG_RUNTIME:
 		{
 			xdg_topdir = getenv("XDG_RUNTIME_DIR");
@@ -99,6 +106,12 @@ build_xdg_path(char *dst,
 				break;
 			}
 
+			case XDG_CACHE:
+			{
+				join_path_components(filename, filename, ".cache");
+				break;
+			}
+
 			default:
 
 				/* can not happen given previous switch */
@@ -109,12 +122,13 @@ build_xdg_path(char *dst,
 
 	join_path_components(filename, filename, "pg_autoctl");
 
-	if (pgdata[0] == '/')
+	/* a NULL pgdata is for a resource that doesn't depend on PGDATA */
+	if (pgdata != NULL && pgdata[0] == '/')
 	{
 		/* skip the first / to avoid having a double-slash in the name */
 		join_path_components(filename, filename, pgdata + 1);
 	}
-	else
+	else if (pgdata != NULL)
 	{
 		/*
 		 * We have a relative pathname to PGDATA, and we want an absolute
@@ -51,7 +51,11 @@ typedef struct ConfigFilePaths
  * - XDG_CONFIG resource uses XDG_CONFIG_HOME environement variable and
  *   defaults to ${HOME}/.config
  *
- * - XDG_CACHE and XDG_RUNTIME are not implemented yet.
+ * - XDG_CACHE resource uses XDG_CACHE_HOME environement variable and
+ *   defaults to ${HOME}/.cache
+ *
+ * - XDG_RUNTIME resource uses XDG_RUNTIME_DIR environement variable and
+ *   defaults to /tmp
  *
  * https://standards.freedesktop.org/basedir-spec/basedir-spec-latest.html
  */
@@ -17,12 +17,25 @@
 #define PG_AUTOCTL_VERSION "1.0.5"
 
 /* version of the extension that we requite to talk to on the monitor */
-#define PG_AUTOCTL_EXTENSION_VERSION "1.0"
+#define PG_AUTOCTL_EXTENSION_VERSION "1.1"
 
 /* environment variable to use to make DEBUG facilities available */
 #define PG_AUTOCTL_DEBUG "PG_AUTOCTL_DEBUG"
 #define PG_AUTOCTL_EXTENSION_VERSION_VAR "PG_AUTOCTL_EXTENSION_VERSION"
 
+/*
+ * Only one pg_autoctl process updates the monitor extension at a time, under
+ * this advisory lock ("pgaf"), and then notifies the keepers that wait for
+ * the new version on this channel, for up to that many seconds.
+ */
+#define PG_AUTOCTL_EXTENSION_UPDATE_LOCK "1885823334"
+#define PG_AUTOCTL_EXTENSION_UPDATE_CHANNEL "extension"
+#define PG_AUTOCTL_EXTENSION_UPDATE_TIMEOUT 300
+#define PG_AUTOCTL_EXTENSION_UPDATE_POLL_MS 5000
+
+/* environment variable to use to log in JSON lines rather than text */
+#define PG_AUTOCTL_LOG_FORMAT "PG_AUTOCTL_LOG_FORMAT"
+
 /* default values for the pg_autoctl settings */
 #define POSTGRES_PORT 5432
 #define POSTGRES_DEFAULT_LISTEN_ADDRESSES "*"
@@ -31,32 +44,96 @@
 #define DEFAULT_AUTH_METHOD "trust"
 #define REPLICATION_SLOT_NAME_DEFAULT "pgautofailover_standby"
 #define REPLICATION_PASSWORD_DEFAULT NULL
+
+/* the monitor's synchronous_standby_names() lists standbys by this name */
+#define REPLICATION_APPLICATION_NAME_PREFIX "pgautofailover_standby"
 #define FORMATION_DEFAULT "default"
 #define GROUP_ID_DEFAULT 0
 #define POSTGRES_CONNECT_TIMEOUT "5"
 #define MAXIMUM_BACKUP_RATE "100M"
+#define PREWARM_INTERVAL 0
+#define CATCHUP_ACCELERATION 0
+#define SLOT_WAL_BUDGET 0
+#define SLOT_WAL_REPORT_BYTES (16 * 1024 * 1024)
+#define ARCHIVE_LAG_REPORT_BYTES (16 * 1024 * 1024)
+#define HTTP_LISTEN_ADDRESS_DEFAULT "127.0.0.1"
+#define HTTP_PORT_DEFAULT 0
+#define LIVENESS_PORT_DEFAULT 0
+#define LIVENESS_INTERVAL_DEFAULT 250
 
 #define NETWORK_PARTITION_TIMEOUT 20
+#define NETWORK_PARTITION_READ_ONLY 0
 #define PREPARE_PROMOTION_CATCHUP_TIMEOUT 30
 #define PREPARE_PROMOTION_WALRECEIVER_TIMEOUT 5
 
+/* how often we check the replay progress while preparing a promotion */
+#define PREPARE_PROMOTION_CATCHUP_POLL_TIME_MS 10
+#define PREPARE_PROMOTION_PRIMARY_CONNECT_TIMEOUT_MS 1000
+
 #define PG_AUTOCTL_KEEPER_SLEEP_TIME 5
+
+/* a keeper restarts from what it knew when it stopped for that long */
+#define PG_AUTOCTL_KEEPER_WARM_RESTART_TIMEOUT 60
+
+/* keeper heartbeat interval in milliseconds, randomized by up to 10% */
+#define PG_AUTOCTL_KEEPER_HEARTBEAT_INTERVAL (PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000)
+#define PG_AUTOCTL_KEEPER_HEARTBEAT_MIN_INTERVAL 100
 #define PG_AUTOCTL_MONITOR_SLEEP_TIME 1
 
+/* how long we wait for a connection to the monitor, in milliseconds */
+#define PG_AUTOCTL_MONITOR_CONNECT_TIMEOUT_MS 2000
+
+/* TCP keepalives of the monitor connections, in seconds, and then in ms */
+#define PG_AUTOCTL_KEEPALIVES_IDLE 5
+#define PG_AUTOCTL_KEEPALIVES_INTERVAL 2
+#define PG_AUTOCTL_KEEPALIVES_COUNT 3
+#define PG_AUTOCTL_TCP_USER_TIMEOUT 10000
+
+/* maximum delay between attempts to reconnect a persistent connection */
+#define PG_AUTOCTL_RECONNECT_MAX_DELAY 20
+
 #define COORDINATOR_IS_READY_TIMEOUT 300
 
+/* how often we log the progress of pg_basebackup, in seconds */
+#define PG_BASEBACKUP_PROGRESS_LOG_INTERVAL 10
+
+/* pre-warming works with ranges of blocks, a few of them at each loop */
+#define PREWARM_RANGE_BLOCKS 1024
+#define PREWARM_RANGES_PER_LOOP 16
+
 #define POSTGRESQL_FAILS_TO_START_TIMEOUT 20
 #define POSTGRESQL_FAILS_TO_START_RETRIES 3
 
+/* transition hooks run in the background, in seconds and then in ms */
+#define HOOK_TIMEOUT 30
+#define HOOK_MAX_PROCESSES 4
+#define HOOK_KILL_DELAY_MS 5000
+
 /* internal default for allocating strings  */
 #define BUFSIZE 1024
 
 #define AWAIT_PROMOTION_SLEEP_TIME_MS 1000
 
+/*
+ * pg_ctl status and pg_controldata return at once, unless something's wrong
+ * with the storage: we don't let them block the keeper loop for longer.
+ */
+#define PG_CTL_STATUS_TIMEOUT_MS 10000
+
+/* how long we wait for Postgres to start or stop, in seconds, as pg_ctl */
+#define PG_CTL_WAIT_TIMEOUT 60
+
+/* how often we read postmaster.pid while waiting for Postgres to be ready */
+#define PG_SETUP_IS_READY_POLL_TIME_MS 100
+
 #define KEEPER_CONFIGURATION_FILENAME "pg_autoctl.cfg"
 #define KEEPER_STATE_FILENAME "pg_autoctl.state"
 #define KEEPER_PID_FILENAME "pg_autoctl.pid"
 #define KEEPER_INIT_FILENAME "pg_autoctl.init"
+#define KEEPER_PREWARM_FILENAME "pg_autoctl.prewarm"
+#define KEEPER_RESTART_FILENAME "pg_autoctl.restart"
+#define KEEPER_TIMINGS_FILENAME "pg_autoctl.timings"
+#define KEEPER_STATUS_FILENAME "pg_autoctl.status"
 
 #define KEEPER_SYSTEMD_SERVICE "pgautofailover"
 #define KEEPER_SYSTEMD_FILENAME "pgautofailover.service"
@@ -74,6 +151,11 @@
 /* Citus support */
 #define CITUS_EXTENSION_NAME "citus"
 
+/* deadline of the coordinator metadata update when a worker fails over */
+#define CITUS_COORDINATOR_UPDATE_TIMEOUT_MS 10000
+#define CITUS_COORDINATOR_CONNECT_TIMEOUT_MS 2000
+#define CITUS_UPDATE_NODE_LOCK_COOLDOWN_MS 5000
+
 /* Default external service provider to use to discover local IP address */
 #define DEFAULT_INTERFACE_LOOKUP_SERVICE_NAME "8.8.8.8"
 #define DEFAULT_INTERFACE_LOOKUP_SERVICE_PORT 53
@@ -7,6 +7,7 @@
  *
  */
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -78,6 +79,43 @@ directory_exists(const char *path)
 }
 
 
+/*
+ * file_has_changed returns true when the given file has been created,
+ * removed, replaced or modified since the fingerprint was taken, and then
+ * updates the fingerprint. A zeroed fingerprint is a file that doesn't exist.
+ */
+bool
+file_has_changed(const char *filename, FileFingerprint *fingerprint)
+{
+	struct stat info;
+	FileFingerprint current = { 0 };
+	bool changed = false;
+
+	if (stat(filename, &info) == 0)
+	{
+		current.exists = true;
+		current.inode = info.st_ino;
+		current.size = info.st_size;
+		current.mtime = info.st_mtime;
+	}
+	else if (errno != ENOENT && errno != ENOTDIR)
+	{
+		log_warn("Failed to stat \"%s\": %s", filename, strerror(errno));
+
+		/* we don't know, let the caller have a look at the file */
+		return true;
+	}
+
+	changed = current.exists != fingerprint->exists
+		|| current.inode != fingerprint->inode
+		|| current.size != fingerprint->size
+		|| current.mtime != fingerprint->mtime;
+
+	*fingerprint = current;
+
+	return changed;
+}
+
 /*
  * ensure_empty_dir ensures that the given path points to an empty directory with
  * the given mode. If it fails to do so, it returns false.
@@ -419,6 +457,41 @@ unlink_file(const char *filename)
 }
 
 
+/*
+ * sync_file_system flushes to disk the dirty data of the whole file system
+ * that contains the given path, with a single syncfs(2) call on Linux. That's
+ * much faster than an fsync(2) of each file of a large directory. On other
+ * systems we use sync(2).
+ */
+bool
+sync_file_system(const char *path)
+{
+#if defined(__linux__)
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+	{
+		log_error("Failed to open \"%s\": %s", path, strerror(errno));
+		return false;
+	}
+
+	if (syncfs(fd) != 0)
+	{
+		log_error("Failed to sync the file system of \"%s\": %s",
+				  path, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+#else
+	sync();
+#endif
+
+	return true;
+}
+
+
 /*
  * get_program_absolute_path returns the absolute path of the current program
  * being executed. Note: the shell is responsible to set that in interactive
@@ -11,15 +11,31 @@
 #define FILE_UTILS_H
 
 
+#include <sys/stat.h>
+
 #include "postgres_fe.h"
 
 
+/*
+ * FileFingerprint is what we remember about a file to notice that it changed
+ * on-disk without having to read it again, see file_has_changed.
+ */
+typedef struct FileFingerprint
+{
+	bool exists;
+	ino_t inode;
+	off_t size;
+	time_t mtime;
+} FileFingerprint;
+
+
 bool file_exists(const char *filename);
 bool directory_exists(const char *path);
 bool ensure_empty_dir(const char *dirname, int mode);
 bool write_file(char *data, long fileSize, const char *filePath);
 bool append_to_file(char *data, long fileSize, const char *filePath);
 bool read_file(const char *filePath, char **contents, long *fileSize);
+bool file_has_changed(const char *filename, FileFingerprint *fingerprint);
 
 void path_in_same_directory(const char *basePath,
 							const char *fileName,
@@ -28,6 +44,7 @@ void path_in_same_directory(const char *basePath,
 int search_pathlist(const char *pathlist, const char *filename, char ***result);
 void search_pathlist_destroy_result(char **result);
 bool unlink_file(const char *filename);
+bool sync_file_system(const char *path);
 bool get_program_absolute_path(char *program, int size);
 
 #endif /* FILE_UTILS_H */
@@ -20,10 +20,12 @@
 #include "keeper.h"
 #include "pgctl.h"
 #include "fsm.h"
+#include "hooks.h"
 #include "log.h"
 #include "monitor.h"
 #include "primary_standby.h"
 #include "state.h"
+#include "timings.h"
 
 
 /*
@@ -108,6 +110,10 @@
 #define COMMENT_MAINTENANCE_TO_CATCHINGUP \
 	"Restarting standby after manual maintenance is done."
 
+#define COMMENT_RELEASED_SLOT_TO_WAIT_STANDBY \
+	"The primary released the WAL it retained for us, " \
+	"initialise the standby again."
+
 #define COMMENT_BLOCKED_WRITES \
 	"Promoting a Citus Worker standby after having blocked writes " \
 	"from the coordinator."
@@ -151,16 +157,16 @@ KeeperFSMTransition KeeperFSM[] = {
 	/*
 	 * failover occurred, primary -> draining/demoted
 	 */
-	{ PRIMARY_STATE, DRAINING_STATE, COMMENT_PRIMARY_TO_DRAINING, &fsm_stop_postgres },
+	{ PRIMARY_STATE, DRAINING_STATE, COMMENT_PRIMARY_TO_DRAINING, &fsm_drain_primary },
 	{ DRAINING_STATE, DEMOTED_STATE, COMMENT_DRAINING_TO_DEMOTED, &fsm_stop_postgres },
 	{ PRIMARY_STATE, DEMOTED_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_stop_postgres },
-	{ PRIMARY_STATE, DEMOTE_TIMEOUT_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_stop_postgres },
+	{ PRIMARY_STATE, DEMOTE_TIMEOUT_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_demote_timeout },
 
 	/*
 	 * was demoted, need to be dead now.
 	 */
 	{ DRAINING_STATE, DEMOTE_TIMEOUT_STATE, COMMENT_DRAINING_TO_DEMOTE_TIMEOUT, &fsm_stop_postgres },
-	{ DEMOTE_TIMEOUT_STATE, DEMOTED_STATE, COMMENT_DEMOTE_TIMEOUT_TO_DEMOTED,  &fsm_stop_postgres},
+	{ DEMOTE_TIMEOUT_STATE, DEMOTED_STATE, COMMENT_DEMOTE_TIMEOUT_TO_DEMOTED,  &fsm_stop_after_demote_timeout},
 
 	/*
 	 * was demoted after a failure, but standby was forcibly removed
@@ -192,7 +198,7 @@ KeeperFSMTransition KeeperFSM[] = {
 	 * Situation is getting back to normal on the primary
 	 */
 	{ WAIT_PRIMARY_STATE, PRIMARY_STATE, COMMENT_WAIT_PRIMARY_TO_PRIMARY, &fsm_enable_sync_rep },
-	{ DEMOTE_TIMEOUT_STATE, PRIMARY_STATE, COMMENT_DEMOTE_TO_PRIMARY, &fsm_start_postgres },
+	{ DEMOTE_TIMEOUT_STATE, PRIMARY_STATE, COMMENT_DEMOTE_TO_PRIMARY, &fsm_resume_after_demote_timeout },
 
 	/*
 	 * The primary is now ready to accept a standby, we're the standby
@@ -220,13 +226,19 @@ KeeperFSMTransition KeeperFSM[] = {
 	/*
 	 * finish the promotion
 	 */
-	{ PREP_PROMOTION_STATE, WAIT_PRIMARY_STATE, COMMENT_BLOCKED_WRITES, &fsm_promote_standby },
+	{ PREP_PROMOTION_STATE, WAIT_PRIMARY_STATE, COMMENT_BLOCKED_WRITES, &fsm_promote_citus_worker },
 
 	/*
 	 * Just wait until primary is ready
 	 */
 	{ INIT_STATE, WAIT_STANDBY_STATE, COMMENT_INIT_TO_WAIT_STANDBY, NULL },
 
+	/*
+	 * The primary released our replication slot, see release_standby_slot
+	 */
+	{ SECONDARY_STATE, WAIT_STANDBY_STATE, COMMENT_RELEASED_SLOT_TO_WAIT_STANDBY, &fsm_stop_postgres },
+	{ CATCHINGUP_STATE, WAIT_STANDBY_STATE, COMMENT_RELEASED_SLOT_TO_WAIT_STANDBY, &fsm_stop_postgres },
+
 	/*
 	 * In case of maintenance of the standby server, we stop PostgreSQL.
 	 */
@@ -363,6 +375,16 @@ keeper_fsm_reach_assigned_state(Keeper *keeper)
 					 transition.comment ? ": " : "",
 					 transition.comment ? transition.comment : "");
 
+			(void) timings_start_transition(keeperState->current_role,
+											keeperState->assigned_role);
+
+			/* hooks run in the background, we never wait for them here */
+			(void) hooks_start(&(keeper->hooks), &(keeper->config),
+							   HOOK_PRE_TRANSITION,
+							   keeperState->current_role,
+							   keeperState->assigned_role,
+							   false);
+
 			if (transition.transitionFunction)
 			{
 				ret = (*transition.transitionFunction)(keeper);
@@ -376,10 +398,21 @@ keeper_fsm_reach_assigned_state(Keeper *keeper)
 				log_debug("No transition function, assigning new state");
 			}
 
+			(void) timings_end_transition(ret);
+
+			(void) hooks_start(&(keeper->hooks), &(keeper->config),
+							   HOOK_POST_TRANSITION,
+							   keeperState->current_role,
+							   keeperState->assigned_role,
+							   ret);
+
 			if (ret)
 			{
 				keeperState->current_role = keeperState->assigned_role;
 
+				/* the other nodes of the group may have changed too */
+				keeper->otherNodesKnown = false;
+
 				log_info("Transition complete: current state is now \"%s\"",
 						 NodeStateToString(keeperState->current_role));
 			}
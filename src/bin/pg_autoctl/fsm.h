@@ -48,6 +48,7 @@ bool fsm_init_standby(Keeper *keeper);
 bool fsm_promote_standby(Keeper *keeper);
 bool fsm_prepare_standby_for_promotion(Keeper *keeper);
 bool fsm_promote_standby_to_primary(Keeper *keeper);
+bool fsm_promote_citus_worker(Keeper *keeper);
 bool fsm_promote_standby_to_single(Keeper *keeper);
 bool fsm_stop_replication(Keeper *keeper);
 
@@ -56,6 +57,10 @@ bool fsm_disable_sync_rep(Keeper *keeper);
 
 bool fsm_start_postgres(Keeper *keeper);
 bool fsm_stop_postgres(Keeper *keeper);
+bool fsm_drain_primary(Keeper *keeper);
+bool fsm_demote_timeout(Keeper *keeper);
+bool fsm_stop_after_demote_timeout(Keeper *keeper);
+bool fsm_resume_after_demote_timeout(Keeper *keeper);
 
 bool fsm_start_maintenance_on_standby(Keeper *keeper);
 bool fsm_restart_standby(Keeper *keeper);
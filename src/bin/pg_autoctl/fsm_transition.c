@@ -36,7 +36,9 @@
 #include "primary_standby.h"
 #include "state.h"
 
-static bool prepare_replication(Keeper *keeper, bool other_node_missing_is_ok);
+static bool prepare_replication(Keeper *keeper, bool other_node_missing_is_ok,
+								bool keep_existing_slot);
+static bool update_coordinator_metadata(Keeper *keeper);
 
 
 /*
@@ -58,6 +60,7 @@ fsm_init_primary(Keeper *keeper)
 	char *password = NULL;
 	char monitorHostname[_POSIX_HOST_NAME_MAX];
 	int monitorPort = 0;
+	bool hostFound = true;
 	char *authMethod = NULL;
 
 	log_info("Initialising postgres as a primary");
@@ -102,14 +105,36 @@ fsm_init_primary(Keeper *keeper)
 	password = NULL;
 	authMethod = pg_setup_get_auth_method(&(config->pgSetup));
 
-	if (!primary_create_user_with_hba(postgres,
-									  PG_AUTOCTL_HEALTH_USERNAME, password,
-									  monitorHostname, authMethod))
+	/*
+	 * With a multi-host monitor URI, any of the monitor hosts may be the
+	 * primary monitor that runs the health checks after a failover of the
+	 * monitor, so we allow each of them in our HBA.
+	 */
+	for (int hostIndex = 0; hostFound; hostIndex++)
 	{
-		log_error("Failed to initialise postgres as primary because creating the "
-				  "database user that the pg_auto_failover monitor "
-				  "uses for health checks failed, see above for details");
-		return false;
+		if (!hostname_from_uri_at(config->monitor_pguri, hostIndex,
+								  monitorHostname, _POSIX_HOST_NAME_MAX,
+								  &monitorPort, &hostFound))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (!hostFound)
+		{
+			break;
+		}
+
+		if (!primary_create_user_with_hba(postgres,
+										  PG_AUTOCTL_HEALTH_USERNAME, password,
+										  monitorHostname, authMethod))
+		{
+			log_error("Failed to initialise postgres as primary because "
+					  "creating the database user that the pg_auto_failover "
+					  "monitor uses for health checks failed, "
+					  "see above for details");
+			return false;
+		}
 	}
 
 	if (!primary_create_replication_user(postgres, PG_AUTOCTL_REPLICA_USERNAME,
@@ -149,11 +174,13 @@ fsm_disable_replication(Keeper *keeper)
 		return false;
 	}
 
-	if (!primary_drop_replication_slot(postgres, config->replication_slot_name))
+	if (!primary_drop_stale_replication_slots(postgres,
+											  config->replication_slot_name,
+											  ""))
 	{
-		log_error("Failed to disable replication because dropping the replication "
-				  "slot \"%s\" used by the standby failed, see above for details",
-				  config->replication_slot_name);
+		log_error("Failed to disable replication because dropping the "
+				  "replication slots used by the standby nodes failed, "
+				  "see above for details");
 		return false;
 	}
 
@@ -178,11 +205,21 @@ fsm_disable_replication(Keeper *keeper)
 bool
 fsm_resume_as_primary(Keeper *keeper)
 {
+	LocalPostgresServer *postgres = &(keeper->postgres);
+
 	if (!keeper_start_postgres(keeper))
 	{
 		return false;
 	}
 
+	/* we might have been kept read-only in DEMOTE_TIMEOUT */
+	if (!pgsql_set_default_transaction_mode_read_write(&(postgres->sqlClient)))
+	{
+		log_error("Failed to set default_transaction_read_only to off "
+				  "in order to resume as a primary, see above for details");
+		return false;
+	}
+
 	if (!fsm_disable_replication(keeper))
 	{
 		log_error("Failed to disable synchronous replication in order to "
@@ -213,7 +250,7 @@ fsm_prepare_replication(Keeper *keeper)
 		return false;
 	}
 
-	return prepare_replication(keeper, other_node_missing_is_ok);
+	return prepare_replication(keeper, other_node_missing_is_ok, false);
 }
 
 
@@ -221,49 +258,23 @@ fsm_prepare_replication(Keeper *keeper)
  * prepare_replication is the work-horse for fsm_prepare_replication and used
  * in fsm_promote_standby too, where we could have to accept the fact that
  * there's no other node at the moment: we're doing a secondary ➜ single
- * transition after all.
+ * transition after all. After a promotion we keep the replication slots that
+ * we maintained as a standby, see standby_maintain_replication_slot.
+ *
+ * Each of the other nodes of the group gets its own replication slot, see
+ * keeper_prepare_replication.
  */
 static bool
-prepare_replication(Keeper *keeper, bool other_node_missing_is_ok)
+prepare_replication(Keeper *keeper, bool other_node_missing_is_ok,
+					bool keep_existing_slot)
 {
-	KeeperConfig *config = &(keeper->config);
-	Monitor *monitor = &(keeper->monitor);
-	LocalPostgresServer *postgres = &(keeper->postgres);
-	PostgresSetup *pgSetup = &(postgres->postgresSetup);
-	NodeAddress otherNode = { 0 };
-
-	if (!monitor_get_other_node(monitor, config->nodename, pgSetup->pgport,
-								&otherNode))
-	{
-		if (other_node_missing_is_ok)
-		{
-			log_debug("There's no other node for %s:%d",
-					  config->nodename, pgSetup->pgport);
-		}
-		else
-		{
-			log_error("There's no other node for %s:%d",
-					  config->nodename, pgSetup->pgport);
-		}
-		return other_node_missing_is_ok;
-	}
-
-	if (!primary_add_standby_to_hba(postgres,
-									otherNode.host,
-									config->replication_password))
-	{
-		log_error(
-			"Failed to grant access to the standby by adding relevant lines to "
-			"pg_hba.conf for the standby hostname and user, see above for "
-			"details");
-		return false;
-	}
-
-	if (!primary_create_replication_slot(postgres, config->replication_slot_name))
+	if (!keeper_prepare_replication(keeper, other_node_missing_is_ok,
+									keep_existing_slot))
 	{
 		log_error(
 			"Failed to enable replication from the primary server because "
-			"creating the replication slot failed, see above for details");
+			"preparing replication for the standby nodes failed, "
+			"see above for details");
 		return false;
 	}
 
@@ -348,6 +359,14 @@ fsm_promote_standby_to_primary(Keeper *keeper)
 	LocalPostgresServer *postgres = &(keeper->postgres);
 	PGSQL *client = &(postgres->sqlClient);
 
+	/* a Citus worker is only reached through its coordinator */
+	if (postgres->pgKind == NODE_KIND_CITUS_WORKER &&
+		!update_coordinator_metadata(keeper))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
 	if (!pgsql_set_default_transaction_mode_read_write(client))
 	{
 		log_error("Failed to set default_transaction_read_only to off "
@@ -360,14 +379,128 @@ fsm_promote_standby_to_primary(Keeper *keeper)
 
 
 /*
- * fsm_enable_sync_rep is used when a healthy standby appeared.
+ * fsm_promote_citus_worker is used when the standby of a Citus worker group
+ * is promoted after the coordinator blocked the writes to the old primary:
+ * once promoted, we point the coordinator metadata at us, so that the
+ * distributed queries are routed to the new primary without waiting for an
+ * operator to do it.
+ *
+ * A switchover in a pgsql formation, or in the coordinator group of a Citus
+ * formation, goes through the same transition, and then there's no
+ * coordinator metadata to update.
+ */
+bool
+fsm_promote_citus_worker(Keeper *keeper)
+{
+	LocalPostgresServer *postgres = &(keeper->postgres);
+
+	if (!fsm_promote_standby(keeper))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (postgres->pgKind != NODE_KIND_CITUS_WORKER)
+	{
+		return true;
+	}
+
+	return update_coordinator_metadata(keeper);
+}
+
+
+/*
+ * update_coordinator_metadata fetches the coordinator of our formation from
+ * the monitor, and updates its metadata for our worker group: the old
+ * primary is the other node of the group, and we are the new primary.
+ *
+ * The update is idempotent, so that when it fails we retry the transition
+ * at the next round of the keeper loop.
+ */
+static bool
+update_coordinator_metadata(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	NodeAddress coordinatorNode = { 0 };
+	NodeAddress oldPrimaryNode = { 0 };
+	NodeAddress newPrimaryNode = { 0 };
+
+	if (!monitor_get_coordinator(&(keeper->monitor), config->formation,
+								 &coordinatorNode))
+	{
+		log_error("Failed to update the coordinator metadata after the "
+				  "promotion of this worker, see above for details");
+		return false;
+	}
+
+	if (!monitor_get_other_node(&(keeper->monitor),
+								config->nodename, config->pgSetup.pgport,
+								&oldPrimaryNode))
+	{
+		log_error("Failed to get the old primary of this worker group from "
+				  "the monitor, see above for details");
+		return false;
+	}
+
+	strlcpy(newPrimaryNode.host, config->nodename, _POSIX_HOST_NAME_MAX);
+	newPrimaryNode.port = config->pgSetup.pgport;
+
+	if (!standby_update_coordinator_metadata(postgres,
+											 &coordinatorNode,
+											 &oldPrimaryNode,
+											 &newPrimaryNode))
+	{
+		log_error("Failed to update the metadata of coordinator %s:%d "
+				  "after the promotion of this worker, see above for details",
+				  coordinatorNode.host, coordinatorNode.port);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * fsm_enable_sync_rep is used when a healthy standby appeared. Commits then
+ * wait for the quorum of standbys that the monitor computes from the healthy
+ * standbys of the group, or for any standby when we can't get it, at the
+ * synchronous_commit level of the formation.
  */
 bool
 fsm_enable_sync_rep(Keeper *keeper)
 {
+	KeeperConfig *config = &(keeper->config);
 	LocalPostgresServer *postgres = &(keeper->postgres);
+	MonitorPeers *peers = &(keeper->monitor.peers);
+	char standbyNames[BUFSIZE] = { 0 };
+	const char *synchronousCommit = "on";
+
+	if (peers->valid && !IS_EMPTY_STRING_BUFFER(peers->synchronousCommit))
+	{
+		synchronousCommit = peers->synchronousCommit;
+	}
+
+	if (!monitor_synchronous_standby_names(&(keeper->monitor),
+										   config->formation,
+										   keeper->state.current_group,
+										   standbyNames, BUFSIZE))
+	{
+		log_warn("Failed to get the synchronous standby names from the "
+				 "monitor, waiting for any standby");
+		strlcpy(standbyNames, "*", BUFSIZE);
+	}
+
+	if (!primary_enable_synchronous_replication(postgres, standbyNames,
+												synchronousCommit))
+	{
+		/* errors have already been logged */
+		return false;
+	}
 
-	return primary_enable_synchronous_replication(postgres);
+	/* see keeper_ensure_synchronous_standby_names */
+	strlcpy(keeper->synchronousStandbyNames, standbyNames, BUFSIZE);
+
+	return true;
 }
 
 
@@ -395,6 +528,116 @@ fsm_stop_postgres(Keeper *keeper)
 }
 
 
+/*
+ * fsm_demote_timeout is used when the primary must stop taking writes until
+ * the demote timeout expired, because it is on the losing side of a network
+ * partition or because the monitor is failing over. We stop Postgres, unless
+ * timeout.network_partition_read_only is set: Postgres then keeps serving
+ * reads from a warm cache, and is only stopped once we reach DEMOTED.
+ */
+bool
+fsm_demote_timeout(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+
+	if (config->network_partition_read_only > 0 && postgres->pgIsRunning)
+	{
+		if (primary_set_read_only(postgres))
+		{
+			return true;
+		}
+
+		log_warn("Failed to switch Postgres to read-only, stopping it instead");
+	}
+
+	return fsm_stop_postgres(keeper);
+}
+
+
+/*
+ * fsm_stop_after_demote_timeout is used when the demote timeout expired. When
+ * Postgres has been kept running read-only, we set default_transaction_read_only
+ * back to off before stopping, for the same reasons as in fsm_drain_primary.
+ */
+bool
+fsm_stop_after_demote_timeout(Keeper *keeper)
+{
+	LocalPostgresServer *postgres = &(keeper->postgres);
+
+	if (postgres->pgIsRunning &&
+		!pgsql_set_default_transaction_mode_read_write(&(postgres->sqlClient)))
+	{
+		log_warn("Failed to set default_transaction_read_only back to off "
+				 "before stopping Postgres, see above for details");
+	}
+
+	return fsm_stop_postgres(keeper);
+}
+
+
+/*
+ * fsm_resume_after_demote_timeout is used when we detected a network
+ * partition, but the monitor didn't fail over: we start Postgres again, or
+ * resume writes when it has been kept running read-only.
+ */
+bool
+fsm_resume_after_demote_timeout(Keeper *keeper)
+{
+	if (!keeper_start_postgres(keeper))
+	{
+		return false;
+	}
+
+	return fsm_promote_standby_to_primary(keeper);
+}
+
+
+/*
+ * fsm_drain_primary is used when the primary is asked to drain, before the
+ * promotion of its standby. We block writes and wait until the standby has
+ * replayed all our WAL, then stop Postgres, so that in a planned switchover
+ * the standby has nothing left to replay when we report that we're done.
+ *
+ * default_transaction_read_only is set with ALTER SYSTEM, so we set it back
+ * to off before stopping: otherwise this node would still be read-only when
+ * it's promoted again later. With synchronous replication the transactions
+ * that commit in between are on the standby, which is only promoted after
+ * we're stopped, or after the demote timeout.
+ */
+bool
+fsm_drain_primary(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	PGSQL *client = &(postgres->sqlClient);
+	MonitorPeers *peers = &(keeper->monitor.peers);
+	char slotName[NAMEDATALEN];
+
+	/* the monitor returns the standby node being promoted as the other node */
+	keeper_config_standby_slot_name(config,
+									peers->valid && peers->hasOtherNode
+									? peers->otherNode.nodeId : -1,
+									slotName);
+
+	if (!primary_drain_writes(postgres,
+							  slotName,
+							  config->prepare_promotion_catchup * 1000))
+	{
+		log_warn("Failed to drain writes before stopping Postgres, "
+				 "see above for details");
+	}
+
+	if (!pgsql_set_default_transaction_mode_read_write(client))
+	{
+		log_warn("Failed to set default_transaction_read_only back to off "
+				 "before stopping Postgres, see above for details");
+	}
+
+	return fsm_stop_postgres(keeper);
+}
+
+
 /*
  * fsm_init_standby is used when the primary is now ready to accept a standby,
  * we're the standby.
@@ -407,6 +650,8 @@ fsm_init_standby(Keeper *keeper)
 	LocalPostgresServer *postgres = &(keeper->postgres);
 	ReplicationSource replicationSource = { 0 };
 	int groupId = keeper->state.current_group;
+	char slotName[NAMEDATALEN];
+	char applicationName[NAMEDATALEN];
 
 	/* get the primary node to follow */
 	if (!monitor_get_primary(monitor, config->formation, groupId,
@@ -417,10 +662,21 @@ fsm_init_standby(Keeper *keeper)
 		return false;
 	}
 
+	/* the primary keeps a replication slot for each of its standby nodes */
+	keeper_config_standby_slot_name(config, keeper->state.current_node_id,
+									slotName);
+	keeper_config_standby_application_name(keeper->state.current_node_id,
+										   applicationName);
+
 	replicationSource.userName = PG_AUTOCTL_REPLICA_USERNAME;
 	replicationSource.password = config->replication_password;
-	replicationSource.slotName = config->replication_slot_name;
+	replicationSource.slotName = slotName;
+	replicationSource.applicationName = applicationName;
 	replicationSource.maximumBackupRate = config->maximum_backup_rate;
+	replicationSource.backupCompression = config->backup_compression;
+	replicationSource.rewindSync = config->rewind_sync;
+	replicationSource.restoreCommand = config->restore_command;
+	replicationSource.walRestoreCommand = config->wal_restore_command;
 
 	if (!standby_init_database(postgres, &replicationSource))
 	{
@@ -434,7 +690,7 @@ fsm_init_standby(Keeper *keeper)
 
 /*
  * fsm_rewind_or_init is used when a new primary is available. First, try to
- * rewind. If that fails, do a pg_basebackup.
+ * rewind. If that fails, re-seed from a delta, and then do a pg_basebackup.
  */
 bool
 fsm_rewind_or_init(Keeper *keeper)
@@ -444,6 +700,8 @@ fsm_rewind_or_init(Keeper *keeper)
 	LocalPostgresServer *postgres = &(keeper->postgres);
 	ReplicationSource replicationSource = { 0 };
 	int groupId = keeper->state.current_group;
+	char slotName[NAMEDATALEN];
+	char applicationName[NAMEDATALEN];
 
 	/* get the primary node to follow */
 	if (!monitor_get_primary(monitor, config->formation, groupId,
@@ -454,27 +712,48 @@ fsm_rewind_or_init(Keeper *keeper)
 		return false;
 	}
 
+	/* the primary keeps a replication slot for each of its standby nodes */
+	keeper_config_standby_slot_name(config, keeper->state.current_node_id,
+									slotName);
+	keeper_config_standby_application_name(keeper->state.current_node_id,
+										   applicationName);
+
 	replicationSource.userName = PG_AUTOCTL_REPLICA_USERNAME;
 	replicationSource.password = config->replication_password;
-	replicationSource.slotName = config->replication_slot_name;
+	replicationSource.slotName = slotName;
+	replicationSource.applicationName = applicationName;
 	replicationSource.maximumBackupRate = config->maximum_backup_rate;
+	replicationSource.backupCompression = config->backup_compression;
+	replicationSource.rewindSync = config->rewind_sync;
+	replicationSource.restoreCommand = config->restore_command;
+	replicationSource.walRestoreCommand = config->wal_restore_command;
 
 	if (!primary_rewind_to_standby(postgres, &replicationSource))
 	{
 		log_warn("Failed to rewind demoted primary to standby, "
-				 "trying pg_basebackup instead");
+				 "trying a delta re-seed instead");
 
-		if (!standby_init_database(postgres, &replicationSource))
+		if (!standby_delta_reseed(postgres, &replicationSource))
 		{
-			log_error("Failed to become standby server, see above for details");
-			return false;
+			log_warn("Failed to re-seed demoted primary from a delta, "
+					 "trying pg_basebackup instead");
+
+			if (!standby_init_database(postgres, &replicationSource))
+			{
+				log_error("Failed to become standby server, "
+						  "see above for details");
+				return false;
+			}
 		}
 	}
 
-	if (!primary_drop_replication_slot(postgres, config->replication_slot_name))
+	/* we keep the slots for the other nodes, see keeper_maintain_standby_slots */
+	if (!primary_drop_stale_replication_slots(postgres,
+											  config->replication_slot_name,
+											  ""))
 	{
-		log_error("Failed to drop replication slot \"%s\" used by the standby failed",
-				  config->replication_slot_name);
+		log_error("Failed to drop the replication slots that were used by "
+				  "the standby nodes, see above for details");
 		return false;
 	}
 
@@ -486,27 +765,56 @@ fsm_rewind_or_init(Keeper *keeper)
  * fsm_prepare_standby_for_promotion used when the standby is asked to prepare
  * its own promotion.
  *
- * TODO: implement the prepare_promotion_walreceiver_timeout as follows:
- *
- *   We need to loop over the `ready_to_promote' until the standby is ready.
- *   This routine compare the time spent waiting to the setup:
- *
- *   prepare_promotion_walreceiver_timeout
- *
- *   The `ready_to_promote' routine eventually returns true.
- *
- *   Currently the keeper only supports Synchronous Replication so this timeout
- *   isn't necessary, that's why it's not implemented yet. The implementation
- *   needs to happen for async rep support.
+ * In a planned switchover the primary is still running, and we wait until
+ * we have received and replayed its current LSN, so that the promotion only
+ * has to wait for the actual replay gap. When the primary is not reachable,
+ * we wait until we have replayed all the WAL that we received. Either way we
+ * don't wait for more than timeout.prepare_promotion_catchup.
  */
 bool
 fsm_prepare_standby_for_promotion(Keeper *keeper)
 {
-	log_debug("No support for async replication means we don't wait until "
-			  "prepare_promotion_walreceiver_timeout (%ds)",
-			  keeper->config.prepare_promotion_walreceiver);
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	MonitorPeers *peers = &(keeper->monitor.peers);
+	ReplicationSource replicationSource = { 0 };
+	char targetLSN[PG_LSN_MAXLENGTH] = { 0 };
 
-	return true;
+	replicationSource.userName = PG_AUTOCTL_REPLICA_USERNAME;
+	replicationSource.password = config->replication_password;
+
+	/*
+	 * When the monitor health checks already found the primary unreachable,
+	 * don't wait for a connection timeout to learn the same.
+	 */
+	if (peers->valid && peers->hasOtherNode && peers->otherNodeHealth == 0)
+	{
+		log_info("The monitor reports primary %s:%d as unhealthy, waiting "
+				 "until the standby has replayed the WAL it received",
+				 peers->otherNode.host, peers->otherNode.port);
+	}
+	else if (monitor_get_other_node(&(keeper->monitor),
+									config->nodename, config->pgSetup.pgport,
+									&(replicationSource.primaryNode))
+			 && standby_get_primary_current_lsn(postgres, &replicationSource,
+												targetLSN, PG_LSN_MAXLENGTH))
+	{
+		log_info("Waiting until the standby has replayed up to the current "
+				 "LSN %s of primary %s:%d",
+				 targetLSN,
+				 replicationSource.primaryNode.host,
+				 replicationSource.primaryNode.port);
+	}
+	else
+	{
+		log_info("Failed to get the current LSN of the primary, waiting "
+				 "until the standby has replayed the WAL it received");
+
+		targetLSN[0] = '\0';
+	}
+
+	return standby_wait_for_catchup(postgres, targetLSN,
+									config->prepare_promotion_catchup * 1000);
 }
 
 
@@ -514,10 +822,43 @@ fsm_prepare_standby_for_promotion(Keeper *keeper)
  * fsm_suspend_standby is used when putting the standby in maintenance mode
  * (kernel upgrades, change of hardware, etc). Maintenance means that the user
  * now is driving the service, refrain from doing anything ourselves.
+ *
+ * The node is out of service already, so that's when we restart Postgres if
+ * some settings changed that only apply at restart.
  */
 bool
 fsm_start_maintenance_on_standby(Keeper *keeper)
 {
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	bool pendingRestart = false;
+
+	if (!postgres->pgIsRunning)
+	{
+		return true;
+	}
+
+	if (!pgsql_has_pending_restart(&(postgres->sqlClient), &pendingRestart))
+	{
+		log_warn("Failed to check whether Postgres settings need a restart");
+		return true;
+	}
+
+	if (pendingRestart)
+	{
+		log_info("Restarting Postgres to apply the settings that changed "
+				 "since it started");
+
+		/* the connection is going away with the restart */
+		pgsql_finish(&(postgres->sqlClient));
+
+		if (!pg_ctl_restart(pgSetup->pg_ctl, pgSetup->pgdata))
+		{
+			log_error("Failed to restart Postgres, see above for details");
+			return false;
+		}
+	}
+
 	return true;
 }
 
@@ -574,7 +915,7 @@ fsm_promote_standby(Keeper *keeper)
 	 * create a replication slot and add the other node to pg_hba.conf. These
 	 * steps are implemented in fsm_prepare_replication.
 	 */
-	if (!prepare_replication(keeper, other_node_missing_is_ok))
+	if (!prepare_replication(keeper, other_node_missing_is_ok, true))
 	{
 		/* prepare_replication logs relevant errors */
 		return false;
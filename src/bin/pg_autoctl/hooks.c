@@ -0,0 +1,380 @@
+/*
+ * src/bin/pg_autoctl/hooks.c
+ *   Commands that the keeper runs in the background around its state
+ *   transitions.
+ *
+ * Moving a virtual IP or updating DNS records on promotion may take a while,
+ * and must not delay Postgres becoming writable. The hooks.pre_transition and
+ * hooks.post_transition commands are thus started with /bin/sh in the
+ * background, and the keeper never waits for them: hooks_collect is called
+ * from the keeper loop to reap the hooks that are done, kill the hooks that
+ * exceed hooks.timeout, and start the hooks that had to wait for one of the
+ * hooks.max_processes slots. The results are then reported to the monitor as
+ * events, see keeper_report_hook_results.
+ *
+ * The deadline of a hook is checked at each loop of the keeper, so a hook
+ * may run a little longer than hooks.timeout before we kill it.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+#include "hooks.h"
+#include "log.h"
+#include "parsing.h"
+
+
+static uint64_t hooks_now_ms(void);
+static int hooks_max_processes(KeeperConfig *config);
+static bool hooks_spawn(KeeperHooks *hooks, KeeperConfig *config,
+						HookProcess *hook);
+static void hooks_record_result(KeeperHooks *hooks, HookProcess *hook,
+								bool succeeded, const char *detail);
+
+
+/*
+ * hooks_start starts the hook configured for the given event, or queues it
+ * when hooks.max_processes hooks are running already. It never waits for
+ * the hook to be done.
+ */
+void
+hooks_start(KeeperHooks *hooks, KeeperConfig *config,
+			HookEvent event, NodeState fromState, NodeState toState,
+			bool transitionSucceeded)
+{
+	char *command = event == HOOK_PRE_TRANSITION
+					? config->pre_transition_hook
+					: config->post_transition_hook;
+	HookProcess hook = { 0 };
+
+	if (command == NULL || IS_EMPTY_STRING_BUFFER(command))
+	{
+		return;
+	}
+
+	hook.event = event;
+	hook.fromState = fromState;
+	hook.toState = toState;
+	hook.transitionSucceeded = transitionSucceeded;
+	strlcpy(hook.command, command, BUFSIZE);
+
+	/* make room for the new hook when some are done already */
+	(void) hooks_collect(hooks, config);
+
+	if (hooks->runningCount < hooks_max_processes(config))
+	{
+		(void) hooks_spawn(hooks, config, &hook);
+		return;
+	}
+
+	if (hooks->pendingCount >= HOOKS_MAX_PENDING)
+	{
+		log_warn("Skipping the %s hook for the transition from \"%s\" to "
+				 "\"%s\": %d hooks are waiting to run already",
+				 HookEventToString(event),
+				 NodeStateToString(fromState), NodeStateToString(toState),
+				 hooks->pendingCount);
+
+		hooks_record_result(hooks, &hook, false, "skipped, too many hooks");
+		return;
+	}
+
+	log_debug("Queuing the %s hook, %d hooks are running",
+			  HookEventToString(event), hooks->runningCount);
+
+	hooks->pending[hooks->pendingCount++] = hook;
+}
+
+
+/*
+ * hooks_collect reaps the hooks that are done, terminates the hooks that
+ * exceeded their deadline, and starts the queued hooks that now have a slot.
+ */
+void
+hooks_collect(KeeperHooks *hooks, KeeperConfig *config)
+{
+	uint64_t nowMs = hooks_now_ms();
+	uint64_t timeoutMs = config->hook_timeout > 0
+						 ? (uint64_t) config->hook_timeout * 1000
+						 : 0;
+	int hookIndex = 0;
+
+	while (hookIndex < hooks->runningCount)
+	{
+		HookProcess *hook = &(hooks->running[hookIndex]);
+		int status = 0;
+		pid_t pid = waitpid(hook->pid, &status, WNOHANG);
+
+		if (pid == 0)
+		{
+			if (hook->terminateTimeMs == 0 &&
+				timeoutMs > 0 && nowMs - hook->startTimeMs >= timeoutMs)
+			{
+				log_warn("The %s hook process %d is still running after %ds, "
+						 "terminating it",
+						 HookEventToString(hook->event), hook->pid,
+						 config->hook_timeout);
+
+				/* the hook runs in its own process group, see hooks_spawn */
+				(void) kill(-(hook->pid), SIGTERM);
+				hook->terminateTimeMs = nowMs;
+			}
+			else if (hook->terminateTimeMs > 0 &&
+					 nowMs - hook->terminateTimeMs >= HOOK_KILL_DELAY_MS)
+			{
+				log_warn("The %s hook process %d ignored SIGTERM, killing it",
+						 HookEventToString(hook->event), hook->pid);
+
+				(void) kill(-(hook->pid), SIGKILL);
+			}
+
+			++hookIndex;
+			continue;
+		}
+
+		if (pid < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log_error("Failed to wait for the %s hook process %d: %s",
+					  HookEventToString(hook->event), hook->pid,
+					  strerror(errno));
+
+			hooks_record_result(hooks, hook, false, "lost track of the process");
+		}
+		else
+		{
+			char detail[BUFSIZE] = { 0 };
+			bool succeeded = false;
+
+			if (hook->terminateTimeMs > 0)
+			{
+				snprintf(detail, BUFSIZE, "timed out after %ds",
+						 config->hook_timeout);
+			}
+			else if (WIFEXITED(status))
+			{
+				succeeded = WEXITSTATUS(status) == 0;
+				snprintf(detail, BUFSIZE, "exit code %d", WEXITSTATUS(status));
+			}
+			else
+			{
+				snprintf(detail, BUFSIZE, "killed by signal %d",
+						 WTERMSIG(status));
+			}
+
+			hooks_record_result(hooks, hook, succeeded, detail);
+		}
+
+		/* the order of the running hooks doesn't matter */
+		hooks->running[hookIndex] = hooks->running[--hooks->runningCount];
+	}
+
+	/* start the queued hooks in order */
+	while (hooks->pendingCount > 0 &&
+		   hooks->runningCount < hooks_max_processes(config))
+	{
+		HookProcess hook = hooks->pending[0];
+
+		--hooks->pendingCount;
+		memmove(&(hooks->pending[0]), &(hooks->pending[1]),
+				hooks->pendingCount * sizeof(HookProcess));
+
+		(void) hooks_spawn(hooks, config, &hook);
+	}
+}
+
+
+/*
+ * HookEventToString returns the name of the setting of the given hook.
+ */
+char *
+HookEventToString(HookEvent event)
+{
+	switch (event)
+	{
+		case HOOK_PRE_TRANSITION:
+		{
+			return "pre_transition";
+		}
+
+		case HOOK_POST_TRANSITION:
+		{
+			return "post_transition";
+		}
+	}
+
+	/* keep compiler happy */
+	return "unknown";
+}
+
+
+/*
+ * hooks_now_ms returns the current time in milliseconds since the epoch.
+ */
+static uint64_t
+hooks_now_ms(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (uint64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+
+/*
+ * hooks_max_processes returns how many hooks may run at the same time.
+ */
+static int
+hooks_max_processes(KeeperConfig *config)
+{
+	if (config->hook_max_processes < 1)
+	{
+		return 1;
+	}
+
+	return Min(config->hook_max_processes, HOOKS_MAX_RUNNING);
+}
+
+
+/*
+ * hooks_spawn starts the given hook with /bin/sh, in its own process group
+ * so that hooks_collect can terminate the whole of it. The hook finds the
+ * transition and the node in its environment.
+ */
+static bool
+hooks_spawn(KeeperHooks *hooks, KeeperConfig *config, HookProcess *hook)
+{
+	pid_t pid;
+
+	fflush(stdout);
+	fflush(stderr);
+
+	pid = fork();
+
+	switch (pid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the %s hook process: %s",
+					  HookEventToString(hook->event), strerror(errno));
+
+			hooks_record_result(hooks, hook, false, "failed to fork");
+			return false;
+		}
+
+		case 0:
+		{
+			/* fork succeeded, in child */
+			(void) setpgid(0, 0);
+
+			setenv("PG_AUTOCTL_HOOK", HookEventToString(hook->event), 1);
+			setenv("PG_AUTOCTL_FROM_STATE", NodeStateToString(hook->fromState), 1);
+			setenv("PG_AUTOCTL_TO_STATE", NodeStateToString(hook->toState), 1);
+			setenv("PG_AUTOCTL_FORMATION", config->formation, 1);
+			setenv("PG_AUTOCTL_GROUP", intToString(config->groupId).strValue, 1);
+			setenv("PG_AUTOCTL_NODENAME", config->nodename, 1);
+			setenv("PG_AUTOCTL_PGPORT",
+				   intToString(config->pgSetup.pgport).strValue, 1);
+			setenv("PGDATA", config->pgSetup.pgdata, 1);
+
+			if (hook->event == HOOK_POST_TRANSITION)
+			{
+				setenv("PG_AUTOCTL_TRANSITION_SUCCEEDED",
+					   hook->transitionSucceeded ? "true" : "false", 1);
+			}
+
+			execl("/bin/sh", "sh", "-c", hook->command, (char *) NULL);
+
+			/* only reached when execl failed */
+			fprintf(stderr, "Failed to run /bin/sh: %s\n", strerror(errno));
+			_exit(127);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			break;
+		}
+	}
+
+	hook->pid = pid;
+	hook->startTimeMs = hooks_now_ms();
+	hook->terminateTimeMs = 0;
+
+	hooks->running[hooks->runningCount++] = *hook;
+
+	log_info("Started the %s hook for the transition from \"%s\" to \"%s\" "
+			 "in process %d",
+			 HookEventToString(hook->event),
+			 NodeStateToString(hook->fromState),
+			 NodeStateToString(hook->toState),
+			 pid);
+
+	return true;
+}
+
+
+/*
+ * hooks_record_result keeps the result of a hook until it's reported to the
+ * monitor. When too many results are waiting, we forget the oldest one.
+ */
+static void
+hooks_record_result(KeeperHooks *hooks, HookProcess *hook,
+					bool succeeded, const char *detail)
+{
+	HookResult *result = NULL;
+
+	if (succeeded)
+	{
+		log_info("The %s hook for the transition from \"%s\" to \"%s\" "
+				 "succeeded",
+				 HookEventToString(hook->event),
+				 NodeStateToString(hook->fromState),
+				 NodeStateToString(hook->toState));
+	}
+	else
+	{
+		log_warn("The %s hook for the transition from \"%s\" to \"%s\" "
+				 "failed: %s",
+				 HookEventToString(hook->event),
+				 NodeStateToString(hook->fromState),
+				 NodeStateToString(hook->toState),
+				 detail);
+	}
+
+	if (hooks->resultCount >= HOOKS_MAX_RESULTS)
+	{
+		--hooks->resultCount;
+		memmove(&(hooks->results[0]), &(hooks->results[1]),
+				hooks->resultCount * sizeof(HookResult));
+	}
+
+	result = &(hooks->results[hooks->resultCount++]);
+
+	result->event = hook->event;
+	result->fromState = hook->fromState;
+	result->toState = hook->toState;
+	result->succeeded = succeeded;
+	result->durationMs =
+		hook->startTimeMs > 0 ? (double) (hooks_now_ms() - hook->startTimeMs) : 0;
+	strlcpy(result->detail, detail, BUFSIZE);
+}
@@ -0,0 +1,76 @@
+/*
+ * src/bin/pg_autoctl/hooks.h
+ *   Commands that the keeper runs in the background around its state
+ *   transitions.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef HOOKS_H
+#define HOOKS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "defaults.h"
+#include "keeper_config.h"
+#include "state.h"
+
+/* hard limits, hooks.max_processes is capped to HOOKS_MAX_RUNNING */
+#define HOOKS_MAX_RUNNING 16
+#define HOOKS_MAX_PENDING 32
+#define HOOKS_MAX_RESULTS 32
+
+typedef enum
+{
+	HOOK_PRE_TRANSITION = 0,
+	HOOK_POST_TRANSITION
+} HookEvent;
+
+/* a hook to run, or that's running when pid is not zero */
+typedef struct HookProcess
+{
+	HookEvent event;
+	NodeState fromState;
+	NodeState toState;
+	bool transitionSucceeded;
+	char command[BUFSIZE];
+
+	pid_t pid;
+	uint64_t startTimeMs;
+	uint64_t terminateTimeMs;	/* when we sent SIGTERM, 0 until then */
+} HookProcess;
+
+/* the outcome of a hook, to be reported to the monitor */
+typedef struct HookResult
+{
+	HookEvent event;
+	NodeState fromState;
+	NodeState toState;
+	bool succeeded;
+	double durationMs;
+	char detail[BUFSIZE];
+} HookResult;
+
+typedef struct KeeperHooks
+{
+	HookProcess running[HOOKS_MAX_RUNNING];
+	int runningCount;
+
+	HookProcess pending[HOOKS_MAX_PENDING];
+	int pendingCount;
+
+	HookResult results[HOOKS_MAX_RESULTS];
+	int resultCount;
+} KeeperHooks;
+
+void hooks_start(KeeperHooks *hooks, KeeperConfig *config,
+				 HookEvent event, NodeState fromState, NodeState toState,
+				 bool transitionSucceeded);
+void hooks_collect(KeeperHooks *hooks, KeeperConfig *config);
+char * HookEventToString(HookEvent event);
+
+#endif /* HOOKS_H */
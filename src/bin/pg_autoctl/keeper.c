@@ -19,9 +19,23 @@
 #include "keeper_config.h"
 #include "pgsetup.h"
 #include "state.h"
+#include "timings.h"
 
 
 static bool keeper_get_replication_state(Keeper *keeper);
+static bool keeper_ensure_upstream(Keeper *keeper);
+static bool keeper_ensure_standby_nodes(Keeper *keeper);
+static bool keeper_prepare_standby_nodes(Keeper *keeper,
+										 NodeAddressArray *otherNodes,
+										 bool keepExistingSlots);
+static bool keeper_maintain_standby_slots(Keeper *keeper);
+static bool keeper_advance_standby_slots(Keeper *keeper);
+static bool keeper_ensure_synchronous_standby_names(Keeper *keeper);
+static bool keeper_same_nodes(NodeAddressArray *nodes,
+							  NodeAddressArray *otherNodes);
+static bool keeper_prewarm_fetch_block_list(Keeper *keeper);
+static bool keeper_prewarm_load_block_list(Keeper *keeper);
+static bool keeper_prewarm_continue(Keeper *keeper);
 
 
 /*
@@ -43,6 +57,9 @@ keeper_init(Keeper *keeper, KeeperConfig *config)
 		return false;
 	}
 
+	/* notice a dead monitor in seconds, see timeout.keepalives_idle */
+	keeper->monitor.pgsql.keepalives = config->keepalives;
+
 	if (!keeper_load_state(keeper))
 	{
 		/* errors logged in keeper_state_read */
@@ -117,6 +134,7 @@ keeper_update_state(Keeper *keeper, int node_id, int group_id,
 bool
 keeper_ensure_current_state(Keeper *keeper)
 {
+	KeeperConfig *config = &(keeper->config);
 	KeeperStateData *keeperState = &(keeper->state);
 	PostgresSetup *pgSetup = &(keeper->postgres.postgresSetup);
 	LocalPostgresServer *postgres = &(keeper->postgres);
@@ -145,6 +163,12 @@ keeper_ensure_current_state(Keeper *keeper)
 				postgres->pgFirstStartFailureTs = 0;
 				postgres->pgStartRetries = 0;
 
+				/* standby nodes may stream from another standby node */
+				(void) keeper_advance_standby_slots(keeper);
+
+				/* the monitor lists the standby nodes that we wait for */
+				(void) keeper_ensure_synchronous_standby_names(keeper);
+
 				return true;
 			}
 			else if (ensure_local_postgres_is_running(postgres))
@@ -174,6 +198,17 @@ keeper_ensure_current_state(Keeper *keeper)
 		{
 			if (postgres->pgIsRunning)
 			{
+				if (keeperState->current_role == SECONDARY_STATE ||
+					keeperState->current_role == CATCHINGUP_STATE)
+				{
+					return keeper_ensure_upstream(keeper);
+				}
+
+				/* standby nodes may join while we're in wait_primary */
+				if (keeperState->current_role == WAIT_PRIMARY_STATE)
+				{
+					return keeper_ensure_standby_nodes(keeper);
+				}
 				return true;
 			}
 			else if (ensure_local_postgres_is_running(postgres))
@@ -196,6 +231,13 @@ keeper_ensure_current_state(Keeper *keeper)
 		case DEMOTE_TIMEOUT_STATE:
 		case DRAINING_STATE:
 		{
+			/* see fsm_demote_timeout */
+			if (keeperState->current_role == DEMOTE_TIMEOUT_STATE &&
+				config->network_partition_read_only > 0)
+			{
+				return true;
+			}
+
 			if (postgres->pgIsRunning)
 			{
 				log_warn("PostgreSQL is running while in state \"%s\", "
@@ -218,6 +260,417 @@ keeper_ensure_current_state(Keeper *keeper)
 }
 
 
+/*
+ * keeper_ensure_upstream re-points the local standby when it doesn't follow
+ * the upstream node that the monitor returned with our goal state, as when
+ * the topology of the group changed while we were a standby already. The
+ * upstream node is either the primary, or another standby of our zone, that
+ * keeps a replication slot for us, see keeper_maintain_standby_slots.
+ */
+static bool
+keeper_ensure_upstream(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	PostgresReplicationState *replicationState = &(postgres->replicationState);
+	MonitorPeers *peers = &(keeper->monitor.peers);
+	ReplicationSource replicationSource = { 0 };
+	char slotName[NAMEDATALEN];
+	char applicationName[NAMEDATALEN];
+
+	/* we need to know both what we follow and what we should follow */
+	if (!peers->valid || !peers->hasUpstreamNode ||
+		IS_EMPTY_STRING_BUFFER(replicationState->upstreamHost))
+	{
+		return true;
+	}
+
+	keeper_config_standby_slot_name(config, keeper->state.current_node_id,
+									slotName);
+	keeper_config_standby_application_name(keeper->state.current_node_id,
+										   applicationName);
+
+	/*
+	 * Standby nodes set up by a previous version of pg_autoctl connect
+	 * without our application_name, and the primary would then not count
+	 * them in synchronous_standby_names: re-point those too.
+	 */
+	if (strcmp(replicationState->upstreamHost, peers->upstreamNode.host) == 0 &&
+		replicationState->upstreamPort == peers->upstreamNode.port &&
+		strcmp(replicationState->upstreamApplicationName, applicationName) == 0)
+	{
+		return true;
+	}
+
+	log_info("The monitor assigned upstream node %s:%d, and Postgres "
+			 "follows %s:%d as \"%s\", re-pointing the standby",
+			 peers->upstreamNode.host, peers->upstreamNode.port,
+			 replicationState->upstreamHost, replicationState->upstreamPort,
+			 replicationState->upstreamApplicationName);
+
+	replicationSource.primaryNode = peers->upstreamNode;
+	replicationSource.userName = PG_AUTOCTL_REPLICA_USERNAME;
+	replicationSource.password = config->replication_password;
+	replicationSource.slotName = slotName;
+	replicationSource.applicationName = applicationName;
+
+	if (!standby_follow_upstream(postgres, &replicationSource))
+	{
+		log_error("Failed to follow upstream node %s:%d, "
+				  "see above for details",
+				  peers->upstreamNode.host, peers->upstreamNode.port);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_prepare_replication gets the other nodes of our group from the
+ * monitor, and prepares replication for each of them: we add the standby node
+ * to pg_hba.conf, and create its own replication slot, see
+ * keeper_config_standby_slot_name. We also drop the slots of the standby
+ * nodes that left the group.
+ *
+ * Unless keepExistingSlots is true, we create the slots that exist already
+ * again, so that they don't retain WAL from an arbitrary point in the past.
+ */
+bool
+keeper_prepare_replication(Keeper *keeper, bool otherNodeMissingIsOk,
+						   bool keepExistingSlots)
+{
+	KeeperConfig *config = &(keeper->config);
+	NodeAddressArray otherNodes = { 0 };
+
+	if (!monitor_get_other_nodes(&(keeper->monitor),
+								 config->nodename, config->pgSetup.pgport,
+								 &otherNodes))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (otherNodes.count == 0)
+	{
+		if (otherNodeMissingIsOk)
+		{
+			log_debug("There's no other node for %s:%d",
+					  config->nodename, config->pgSetup.pgport);
+		}
+		else
+		{
+			log_error("There's no other node for %s:%d",
+					  config->nodename, config->pgSetup.pgport);
+		}
+		return otherNodeMissingIsOk;
+	}
+
+	return keeper_prepare_standby_nodes(keeper, &otherNodes, keepExistingSlots);
+}
+
+
+/*
+ * keeper_ensure_standby_nodes prepares replication for the standby nodes that
+ * joined the group since we last did, while we're in wait_primary. We ask the
+ * monitor at each loop, and only edit pg_hba.conf and create replication
+ * slots when the other nodes of the group have changed.
+ */
+static bool
+keeper_ensure_standby_nodes(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	NodeAddressArray otherNodes = { 0 };
+
+	if (!monitor_get_other_nodes(&(keeper->monitor),
+								 config->nodename, config->pgSetup.pgport,
+								 &otherNodes))
+	{
+		/* errors have already been logged, we try again next time */
+		return false;
+	}
+
+	if (keeper->otherNodesKnown &&
+		keeper_same_nodes(&otherNodes, &(keeper->otherNodes)))
+	{
+		return true;
+	}
+
+	log_info("The group now has %d other nodes, "
+			 "preparing replication for them", otherNodes.count);
+
+	return keeper_prepare_standby_nodes(keeper, &otherNodes, true);
+}
+
+
+/*
+ * keeper_prepare_standby_nodes adds each of the given standby nodes to
+ * pg_hba.conf and creates its replication slot, see
+ * keeper_prepare_replication, and then remembers those nodes.
+ */
+static bool
+keeper_prepare_standby_nodes(Keeper *keeper, NodeAddressArray *otherNodes,
+							 bool keepExistingSlots)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	char slotNames[BUFSIZE] = { 0 };
+	int index = 0;
+
+	for (index = 0; index < otherNodes->count; index++)
+	{
+		NodeAddress *node = &(otherNodes->nodes[index]);
+		char slotName[NAMEDATALEN];
+
+		keeper_config_standby_slot_name(config, node->nodeId, slotName);
+
+		if (!primary_add_standby_to_hba(postgres, node->host,
+										config->replication_password))
+		{
+			log_error("Failed to grant access to the standby node %s:%d by "
+					  "adding relevant lines to pg_hba.conf for the standby "
+					  "hostname and user, see above for details",
+					  node->host, node->port);
+			return false;
+		}
+
+		if (keepExistingSlots
+			? !primary_ensure_replication_slot(postgres, slotName)
+			: !primary_create_replication_slot(postgres, slotName))
+		{
+			log_error("Failed to create the replication slot \"%s\" of the "
+					  "standby node %s:%d, see above for details",
+					  slotName, node->host, node->port);
+			return false;
+		}
+
+		if (index > 0)
+		{
+			strlcat(slotNames, ",", BUFSIZE);
+		}
+		strlcat(slotNames, slotName, BUFSIZE);
+	}
+
+	/* an empty list would drop all our slots, see fsm_disable_replication */
+	if (otherNodes->count > 0 &&
+		!primary_drop_stale_replication_slots(postgres,
+											  config->replication_slot_name,
+											  slotNames))
+	{
+		log_warn("Failed to drop the replication slots of the nodes that "
+				 "left the group, see above for details");
+	}
+
+	keeper->otherNodes = *otherNodes;
+	keeper->otherNodesKnown = true;
+
+	return true;
+}
+
+
+/*
+ * keeper_maintain_standby_slots keeps a replication slot for each of the
+ * other nodes of our group while we're a standby, so that when we're
+ * promoted, they can follow us from where they are, see
+ * standby_maintain_replication_slot. The standby nodes of our zone may also
+ * stream from us with those slots, so we add the other nodes to pg_hba.conf.
+ * We get the other nodes from the monitor once per state transition.
+ */
+static bool
+keeper_maintain_standby_slots(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	int index = 0;
+	bool success = true;
+
+	if (!keeper->otherNodesKnown)
+	{
+		char slotNames[BUFSIZE] = { 0 };
+
+		if (!monitor_get_other_nodes(&(keeper->monitor),
+									 config->nodename, config->pgSetup.pgport,
+									 &(keeper->otherNodes)))
+		{
+			/* errors have already been logged, we try again next time */
+			return false;
+		}
+
+		keeper->otherNodesKnown = true;
+
+		for (index = 0; index < keeper->otherNodes.count; index++)
+		{
+			NodeAddress *node = &(keeper->otherNodes.nodes[index]);
+			char slotName[NAMEDATALEN];
+
+			keeper_config_standby_slot_name(config, node->nodeId, slotName);
+
+			/* standby nodes of our zone may stream from us */
+			if (!primary_add_standby_to_hba(postgres, node->host,
+											config->replication_password))
+			{
+				log_warn("Failed to grant access to the standby node %s:%d "
+						 "in pg_hba.conf, see above for details",
+						 node->host, node->port);
+			}
+
+			if (index > 0)
+			{
+				strlcat(slotNames, ",", BUFSIZE);
+			}
+			strlcat(slotNames, slotName, BUFSIZE);
+		}
+
+		/* the slots of the nodes that left, and the one before node ids */
+		if (!pgsql_drop_stale_replication_slots(&(postgres->sqlClient),
+												config->replication_slot_name,
+												slotNames) ||
+			!pgsql_drop_replication_slot(&(postgres->sqlClient),
+										 config->replication_slot_name,
+										 false))
+		{
+			log_warn("Failed to drop the replication slots of the nodes "
+					 "that left the group, see above for details");
+		}
+	}
+
+	for (index = 0; index < keeper->otherNodes.count; index++)
+	{
+		char slotName[NAMEDATALEN];
+
+		keeper_config_standby_slot_name(
+			config, keeper->otherNodes.nodes[index].nodeId, slotName);
+
+		success = standby_maintain_replication_slot(postgres, slotName) &&
+				  success;
+	}
+
+	return success;
+}
+
+
+/*
+ * keeper_advance_standby_slots advances the replication slots that no standby
+ * uses while we're the primary, such as the slots of the standby nodes that
+ * stream from another standby of their zone, to the LSN that the monitor has
+ * for their standby. Otherwise those slots would retain WAL from when their
+ * standby last streamed from us. We only ask the monitor when one of our
+ * slots isn't active.
+ */
+static bool
+keeper_advance_standby_slots(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	NodeAddressArray otherNodes = { 0 };
+	int index = 0;
+	bool success = true;
+
+	if (postgres->replicationState.slotActive)
+	{
+		return true;
+	}
+
+	if (!monitor_get_other_nodes(&(keeper->monitor),
+								 config->nodename, config->pgSetup.pgport,
+								 &otherNodes))
+	{
+		/* errors have already been logged, we try again next time */
+		return false;
+	}
+
+	for (index = 0; index < otherNodes.count; index++)
+	{
+		char slotName[NAMEDATALEN];
+
+		keeper_config_standby_slot_name(
+			config, otherNodes.nodes[index].nodeId, slotName);
+
+		success = primary_advance_replication_slot(postgres, slotName,
+												   otherNodes.lsn[index]) &&
+				  success;
+	}
+
+	return success;
+}
+
+
+/*
+ * keeper_ensure_synchronous_standby_names applies the synchronous_standby_names
+ * setting that the monitor returned with our goal state, when it changed
+ * since fsm_enable_sync_rep or our previous call: the monitor lists the
+ * healthy standby nodes that stream from us, and that list changes while we
+ * remain the primary when standby nodes join, fail, or cascade.
+ */
+static bool
+keeper_ensure_synchronous_standby_names(Keeper *keeper)
+{
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	MonitorPeers *peers = &(keeper->monitor.peers);
+	const char *synchronousCommit = "on";
+
+	if (!peers->valid || IS_EMPTY_STRING_BUFFER(peers->synchronousStandbyNames))
+	{
+		return true;
+	}
+
+	if (strcmp(peers->synchronousStandbyNames,
+			   keeper->synchronousStandbyNames) == 0)
+	{
+		return true;
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(peers->synchronousCommit))
+	{
+		synchronousCommit = peers->synchronousCommit;
+	}
+
+	if (!primary_enable_synchronous_replication(postgres,
+												peers->synchronousStandbyNames,
+												synchronousCommit))
+	{
+		/* errors have already been logged, we try again next time */
+		return false;
+	}
+
+	strlcpy(keeper->synchronousStandbyNames,
+			peers->synchronousStandbyNames, BUFSIZE);
+
+	return true;
+}
+
+
+/*
+ * keeper_same_nodes returns whether both arrays have the same nodes, in the
+ * same order.
+ */
+static bool
+keeper_same_nodes(NodeAddressArray *nodes, NodeAddressArray *otherNodes)
+{
+	int index = 0;
+
+	if (nodes->count != otherNodes->count)
+	{
+		return false;
+	}
+
+	for (index = 0; index < nodes->count; index++)
+	{
+		NodeAddress *node = &(nodes->nodes[index]);
+		NodeAddress *otherNode = &(otherNodes->nodes[index]);
+
+		if (node->nodeId != otherNode->nodeId ||
+			node->port != otherNode->port ||
+			strcmp(node->host, otherNode->host) != 0)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
 /*
  * reportPgIsRunning returns the boolean that we should use to report
  * pgIsRunning to the monitor. When the local PostgreSQL isn't running, we
@@ -337,6 +790,8 @@ keeper_update_pg_state(Keeper *keeper)
 	postgres->pgIsRunning = false;
 	memset(postgres->pgsrSyncState, 0, PGSR_SYNC_STATE_MAXLENGTH);
 	strcpy(postgres->currentLSN, "0/0");
+	memset(&(postgres->replicationState), 0, sizeof(PostgresReplicationState));
+	postgres->replicationState.archiveLagBytes = -1;
 
 	/*
 	 * In some states, it's ok to not have a PostgreSQL data directory at all.
@@ -464,10 +919,16 @@ keeper_update_pg_state(Keeper *keeper)
 
 		/*
 		 * Reinitialise connection string in case host changed or was first
-		 * discovered.
+		 * discovered. Otherwise we keep using the same connection from one
+		 * loop to the next.
 		 */
 		pg_setup_get_local_connection_string(pgSetup, connInfo);
-		pgsql_init(pgsql, connInfo);
+
+		if (strcmp(pgsql->connectionString, connInfo) != 0)
+		{
+			pgsql_finish(pgsql);
+			pgsql_init(pgsql, connInfo);
+		}
 	}
 	else
 	{
@@ -475,6 +936,24 @@ keeper_update_pg_state(Keeper *keeper)
 		postgres->pgIsRunning = false;
 	}
 
+	/* the checkpoint that follows a promotion runs in the background */
+	if (postgres->pgIsRunning
+		&& postgres->promotionCheckpointPending
+		&& (keeperState->current_role == SINGLE_STATE
+			|| keeperState->current_role == WAIT_PRIMARY_STATE
+			|| keeperState->current_role == PRIMARY_STATE))
+	{
+		(void) primary_check_promotion_checkpoint(postgres);
+	}
+
+	/* keep replication slots for the other nodes, in case we're promoted */
+	if (postgres->pgIsRunning
+		&& (keeperState->current_role == SECONDARY_STATE
+			|| keeperState->current_role == CATCHINGUP_STATE))
+	{
+		(void) keeper_maintain_standby_slots(keeper);
+	}
+
 	/*
 	 * In some states, PostgreSQL isn't expected to be running, or not expected
 	 * to have a streaming replication to monitor at all.
@@ -555,7 +1034,8 @@ keeper_restart_postgres(Keeper *keeper)
 /*
  * keeper_get_replication_state connects to the local PostgreSQL instance and
  * fetches replication related information: pg_stat_replication.sync_state and
- * WAL lag.
+ * WAL lag. We use a single query, see pgsql_get_replication_state, and keep
+ * the connection open for the next loop.
  */
 static bool
 keeper_get_replication_state(Keeper *keeper)
@@ -564,14 +1044,15 @@ keeper_get_replication_state(Keeper *keeper)
 	KeeperConfig *config = &(keeper->config);
 	PostgresSetup *pgSetup = &(keeper->postgres.postgresSetup);
 	LocalPostgresServer *postgres = &(keeper->postgres);
+	PostgresReplicationState *replicationState = &(postgres->replicationState);
 
 	PGSQL *pgsql = &(postgres->sqlClient);
 	bool missingStateOk = keeperState->current_role == WAIT_PRIMARY_STATE;
 
-	bool success = false;
-
-	/* figure out if we are in recovery or not */
-	if (!pgsql_is_in_recovery(pgsql, &pgSetup->is_in_recovery))
+	if (!pgsql_get_replication_state(pgsql,
+									 config->replication_slot_name,
+									 PG_AUTOCTL_REPLICA_USERNAME,
+									 replicationState))
 	{
 		/*
 		 * errors have been logged already, probably failed to connect.
@@ -580,39 +1061,122 @@ keeper_get_replication_state(Keeper *keeper)
 		return false;
 	}
 
+	pgSetup->is_in_recovery = replicationState->isInRecovery;
+
+	/*
+	 * A standby that doesn't stream from its primary replays the WAL that
+	 * the Postgres restore_command fetches from the archive, if it has one.
+	 */
+	if (replicationState->isInRecovery)
+	{
+		if (strcmp(replicationState->walReceiverStatus, "streaming") == 0)
+		{
+			strlcpy(replicationState->walSource, "stream",
+					PG_WAL_SOURCE_MAXLENGTH);
+		}
+		else if (replicationState->hasRestoreCommand)
+		{
+			strlcpy(replicationState->walSource, "archive",
+					PG_WAL_SOURCE_MAXLENGTH);
+		}
+	}
+
 	if (pg_setup_is_primary(pgSetup))
 	{
-		success =
-			pgsql_get_sync_state_and_current_lsn(
-				pgsql,
-				config->replication_slot_name,
-				postgres->pgsrSyncState,
-				postgres->currentLSN,
-				PG_LSN_MAXLENGTH,
-				missingStateOk);
-		log_warn("latest received lsn = %s", postgres->currentLSN);
+		if (IS_EMPTY_STRING_BUFFER(replicationState->syncState))
+		{
+			if (!missingStateOk)
+			{
+				log_error(
+					"PostgreSQL primary server has lost track of its standby: "
+					"pg_stat_replication reports no client using the slot \"%s\".",
+					config->replication_slot_name);
+			}
+			return false;
+		}
+
+		strlcpy(postgres->pgsrSyncState,
+				replicationState->syncState, PGSR_SYNC_STATE_MAXLENGTH);
+		strlcpy(postgres->currentLSN,
+				replicationState->currentLSN, PG_LSN_MAXLENGTH);
 	}
 	else
 	{
-		success = pgsql_get_received_lsn_from_standby(pgsql, postgres->currentLSN,
-													  PG_LSN_MAXLENGTH);
-	}
-	pgsql_finish(pgsql);
-
-	return success;
-}
+		MonitorPeers *peers = &(keeper->monitor.peers);
 
+		/*
+		 * With remote_apply, commits on the primary wait until we replayed
+		 * them, so that's the position the monitor compares to its lag
+		 * thresholds. Otherwise they wait until we received them. A standby
+		 * that never streamed only has what it replayed from the archive.
+		 */
+		if (IS_EMPTY_STRING_BUFFER(replicationState->receivedLSN))
+		{
+			if (strcmp(replicationState->walSource, "archive") != 0 ||
+				IS_EMPTY_STRING_BUFFER(replicationState->replayedLSN))
+			{
+				log_error("PostgreSQL cannot reach the primary server: "
+						  "the system view pg_stat_wal_receiver has no rows.");
+				return false;
+			}
 
-/*
- * keeper_check_monitor_extension_version checks that the monitor we connect to
+			strlcpy(postgres->currentLSN,
+					replicationState->replayedLSN, PG_LSN_MAXLENGTH);
+		}
+		else if (peers->valid &&
+				 strcmp(peers->synchronousCommit, "remote_apply") == 0 &&
+				 !IS_EMPTY_STRING_BUFFER(replicationState->replayedLSN))
+		{
+			strlcpy(postgres->currentLSN,
+					replicationState->replayedLSN, PG_LSN_MAXLENGTH);
+		}
+		else
+		{
+			strlcpy(postgres->currentLSN,
+					replicationState->receivedLSN, PG_LSN_MAXLENGTH);
+		}
+	}
+
+	log_debug("Local Postgres is %s, current lsn %s, received lsn %s, "
+			  "replayed lsn %s, wal receiver \"%s\", wal source \"%s\"",
+			  replicationState->isInRecovery ? "in recovery" : "primary",
+			  replicationState->currentLSN,
+			  replicationState->receivedLSN,
+			  replicationState->replayedLSN,
+			  replicationState->walReceiverStatus,
+			  replicationState->walSource);
+
+	return true;
+}
+
+
+/*
+ * keeper_check_monitor_extension_version checks that the monitor we connect to
  * has an extension version compatible with our expectations.
+ *
+ * The version we found is kept in the state file, so that we only check again
+ * when this pg_autoctl requires another version, after a package upgrade.
+ * When the monitor has the version we need available but not installed yet,
+ * its own pg_autoctl process is going to update the extension, and we wait
+ * for that rather than fail.
  */
 bool
 keeper_check_monitor_extension_version(Keeper *keeper)
 {
 	Monitor *monitor = &(keeper->monitor);
+	KeeperStateData *keeperState = &(keeper->state);
 	MonitorExtensionVersion version = { 0 };
 
+	if (strcmp(keeperState->monitor_extension_version,
+			   PG_AUTOCTL_EXTENSION_VERSION) == 0)
+	{
+		log_debug("The version of extension \"%s\" was \"%s\" on the "
+				  "monitor at the last check",
+				  PG_AUTOCTL_MONITOR_EXTENSION_NAME,
+				  keeperState->monitor_extension_version);
+		return true;
+	}
+
 	if (!monitor_get_extension_version(monitor, &version))
 	{
 		log_fatal("Failed to check version compatibility with the monitor "
@@ -622,27 +1186,562 @@ keeper_check_monitor_extension_version(Keeper *keeper)
 	}
 
 	/* from a member of the cluster, we don't try to upgrade the extension */
+	if (strcmp(version.installedVersion, PG_AUTOCTL_EXTENSION_VERSION) != 0 &&
+		strcmp(version.defaultVersion, PG_AUTOCTL_EXTENSION_VERSION) == 0)
+	{
+		if (!monitor_wait_for_extension_version(monitor,
+												PG_AUTOCTL_EXTENSION_VERSION,
+												PG_AUTOCTL_EXTENSION_UPDATE_TIMEOUT,
+												&version))
+		{
+			log_fatal("Failed to check version compatibility with the monitor "
+					  "extension \"%s\", see above for details",
+					  PG_AUTOCTL_MONITOR_EXTENSION_NAME);
+			return false;
+		}
+	}
+
 	if (strcmp(version.installedVersion, PG_AUTOCTL_EXTENSION_VERSION) != 0)
 	{
 		log_fatal("The monitor at \"%s\" has extension \"%s\" version \"%s\", "
 				  "this pg_autoctl version requires version \"%s\".",
 				  keeper->config.monitor_pguri,
 				  PG_AUTOCTL_MONITOR_EXTENSION_NAME,
-				  PG_AUTOCTL_EXTENSION_VERSION,
-				  version.installedVersion);
+				  version.installedVersion,
+				  PG_AUTOCTL_EXTENSION_VERSION);
 		log_info("Please connect to the monitor node and restart pg_autoctl.");
 		return false;
 	}
-	else
+
+	log_info("The version of extenstion \"%s\" is \"%s\" on the monitor",
+			 PG_AUTOCTL_MONITOR_EXTENSION_NAME, version.installedVersion);
+
+	strlcpy(keeperState->monitor_extension_version,
+			version.installedVersion, MONITOR_EXTENSION_VERSION_MAXLENGTH);
+
+	if (!keeper_store_state(keeper))
+	{
+		/* we check again at the next start, errors have already been logged */
+		log_warn("Failed to keep the version of the monitor extension in the "
+				 "state file");
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_prewarm pre-warms the local shared_buffers with the blocks that the
+ * primary has in its own, when replication.prewarm_interval is set, so that
+ * a promoted standby doesn't start with a cold cache:
+ *
+ *  - on a secondary, every prewarm_interval seconds we fetch the list of
+ *    blocks of the primary, keep it in KEEPER_PREWARM_FILENAME, and load
+ *    those blocks while still in recovery,
+ *
+ *  - once promoted, we load the last known list of blocks again, as a best
+ *    effort, as the standby may have restarted since.
+ *
+ * We only load PREWARM_RANGES_PER_LOOP ranges of blocks at each call, so
+ * that the keeper loop keeps running while we pre-warm in the background.
+ * Errors are not fatal, we try again at the next call.
+ */
+bool
+keeper_prewarm(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperPrewarm *prewarm = &(keeper->prewarm);
+	uint64_t now = time(NULL);
+
+	if (config->prewarm_interval <= 0 || !keeper->postgres.pgIsRunning)
+	{
+		return true;
+	}
+
+	switch (keeper->state.current_role)
+	{
+		case SECONDARY_STATE:
+		{
+			prewarm->doneAfterPromotion = false;
+
+			if (now - prewarm->lastFetchTime >= config->prewarm_interval)
+			{
+				prewarm->lastFetchTime = now;
+
+				if (!keeper_prewarm_fetch_block_list(keeper))
+				{
+					return false;
+				}
+			}
+			break;
+		}
+
+		case SINGLE_STATE:
+		case WAIT_PRIMARY_STATE:
+		case PRIMARY_STATE:
+		{
+			if (!prewarm->doneAfterPromotion)
+			{
+				prewarm->doneAfterPromotion = true;
+
+				if (!keeper_prewarm_load_block_list(keeper))
+				{
+					return false;
+				}
+			}
+			break;
+		}
+
+		default:
+		{
+			/* we don't pre-warm in the other states */
+			return true;
+		}
+	}
+
+	return keeper_prewarm_continue(keeper);
+}
+
+
+/*
+ * keeper_catchup applies the catch-up settings to the local standby while it
+ * is catching up with the primary, when replication.catchup_acceleration is
+ * set, and reverts them in any other state, see standby_set_catchup_profile.
+ *
+ * We don't know which settings are in place when the keeper starts, so when
+ * catch-up acceleration is enabled the first call applies or reverts them
+ * either way, in case an earlier keeper process stopped while catching up.
+ */
+bool
+keeper_catchup(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	bool catchingUp =
+		config->catchup_acceleration > 0 &&
+		keeper->state.current_role == CATCHINGUP_STATE;
+
+	if (!postgres->pgIsRunning)
+	{
+		return true;
+	}
+
+	if (keeper->catchupProfileApplied == catchingUp &&
+		(keeper->catchupProfileKnown || config->catchup_acceleration <= 0))
+	{
+		return true;
+	}
+
+	if (!standby_set_catchup_profile(postgres, catchingUp))
+	{
+		/* errors have already been logged, we try again next time */
+		return false;
+	}
+
+	keeper->catchupProfileKnown = true;
+	keeper->catchupProfileApplied = catchingUp;
+
+	return true;
+}
+
+
+/*
+ * keeper_guard_slot_retention keeps an eye on the WAL that our replication
+ * slots retain on a primary while no standby is connected to them, and
+ * reports the most any of them retains to the monitor, so that it shows in
+ * pg_autoctl show state.
+ *
+ * When a slot retains more than replication.slot_wal_budget MB of WAL, we
+ * release that WAL by creating the slot again, and have the monitor
+ * initialise its standby node again: it can't stream from where it stopped
+ * anymore. In the PRIMARY state, that's a standby node that is away while
+ * other standby nodes take part in synchronous replication.
+ */
+bool
+keeper_guard_slot_retention(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperStateData *keeperState = &(keeper->state);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	PostgresReplicationState *replicationState = &(postgres->replicationState);
+	Monitor *monitor = &(keeper->monitor);
+
+	int64_t budget = (int64_t) config->slot_wal_budget * 1024 * 1024;
+	int64_t retained = -1;
+	int64_t reported = keeper->slotRetainedWALReported;
+
+	if (postgres->pgIsRunning &&
+		!replicationState->slotActive &&
+		(keeperState->current_role == PRIMARY_STATE ||
+		 keeperState->current_role == WAIT_PRIMARY_STATE))
+	{
+		retained = replicationState->slotRetainedWALBytes;
+	}
+
+	if (budget > 0 && retained > budget)
+	{
+		size_t prefixLength = strlen(config->replication_slot_name);
+
+		log_warn("Replication slot \"%s\" retains %" PRId64 " bytes of WAL, "
+				 "more than replication.slot_wal_budget of %d MB: "
+				 "releasing it, the standby is going to be initialised again",
+				 replicationState->slotName, retained,
+				 config->slot_wal_budget);
+
+		if (!primary_create_replication_slot(postgres,
+											 replicationState->slotName))
+		{
+			log_error("Failed to create the replication slot \"%s\" again, "
+					  "see above for details",
+					  replicationState->slotName);
+			return false;
+		}
+
+		keeper->slotReleasedWALBytes = retained;
+
+		/* the slot is named after its standby node, or it's the only one */
+		keeper->slotReleasedNodeId = -1;
+
+		if (strncmp(replicationState->slotName,
+					config->replication_slot_name, prefixLength) == 0 &&
+			replicationState->slotName[prefixLength] == '_')
+		{
+			keeper->slotReleasedNodeId =
+				strtol(replicationState->slotName + prefixLength + 1, NULL, 10);
+		}
+
+		/* the new slot doesn't reserve any WAL until the standby is back */
+		retained = -1;
+	}
+
+	/* until the monitor knows, we keep telling it */
+	if (keeper->slotReleasedWALBytes > 0)
+	{
+		if ((keeperState->current_role != PRIMARY_STATE &&
+			 keeperState->current_role != WAIT_PRIMARY_STATE) ||
+			monitor_release_standby_slot(monitor,
+										 config->nodename,
+										 config->pgSetup.pgport,
+										 keeper->slotReleasedWALBytes,
+										 keeper->slotReleasedNodeId))
+		{
+			keeper->slotReleasedWALBytes = 0;
+		}
+	}
+
+	/* WAL is retained a segment at a time, so that's how often we report */
+	if (retained != reported &&
+		(retained < 0 || reported < 0 ||
+		 llabs(retained - reported) >= SLOT_WAL_REPORT_BYTES))
+	{
+		if (!monitor_report_retained_wal(monitor,
+										 config->nodename,
+										 config->pgSetup.pgport,
+										 retained))
+		{
+			/* errors have already been logged, we try again next time */
+			return false;
+		}
+
+		keeper->slotRetainedWALReported = retained;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_report_wal_source tells the monitor whether our standby streams its
+ * WAL from the primary or replays it from the archive, and how far behind on
+ * a primary the archiver is, so that the monitor doesn't count on a standby
+ * that can't get the latest WAL in time when it has to promote one.
+ *
+ * We report when the source changes, and when the archive lag changes by a
+ * WAL segment or more.
+ */
+bool
+keeper_report_wal_source(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	PostgresReplicationState *replicationState =
+		&(keeper->postgres.replicationState);
+	Monitor *monitor = &(keeper->monitor);
+
+	char *walSource = replicationState->walSource;
+	int64_t lag = replicationState->archiveLagBytes;
+	int64_t reported = keeper->reportedArchiveLag;
+
+	if (!keeper->postgres.pgIsRunning)
+	{
+		/* keep what we reported until we know better */
+		return true;
+	}
+
+	if (keeper->walSourceReported &&
+		strcmp(walSource, keeper->reportedWalSource) == 0 &&
+		(lag == reported ||
+		 (lag >= 0 && reported >= 0 &&
+		  llabs(lag - reported) < ARCHIVE_LAG_REPORT_BYTES)))
+	{
+		return true;
+	}
+
+	if (!monitor_report_wal_source(monitor,
+								   config->nodename,
+								   config->pgSetup.pgport,
+								   walSource,
+								   lag))
+	{
+		/* errors have already been logged, we try again next time */
+		return false;
+	}
+
+	if (strcmp(walSource, keeper->reportedWalSource) != 0 &&
+		strcmp(walSource, "archive") == 0)
+	{
+		log_warn("Replaying WAL from the archive, the primary can't be "
+				 "reached by streaming replication");
+	}
+
+	keeper->walSourceReported = true;
+	strlcpy(keeper->reportedWalSource, walSource, PG_WAL_SOURCE_MAXLENGTH);
+	keeper->reportedArchiveLag = lag;
+
+	return true;
+}
+
+
+/*
+ * keeper_prewarm_fetch_block_list fetches the list of blocks that the
+ * primary has in shared_buffers, and saves it to disk so that we can still
+ * use it after a failover.
+ */
+static bool
+keeper_prewarm_fetch_block_list(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperPrewarm *prewarm = &(keeper->prewarm);
+	ReplicationSource replicationSource = { 0 };
+	char filename[MAXPGPATH];
+	char *blockList = NULL;
+
+	if (!monitor_get_primary(&(keeper->monitor),
+							 config->formation,
+							 keeper->state.current_group,
+							 &(replicationSource.primaryNode)))
+	{
+		log_warn("Failed to get the primary node from the monitor, "
+				 "skipping pre-warming");
+		return false;
+	}
+
+	replicationSource.userName = PG_AUTOCTL_REPLICA_USERNAME;
+	replicationSource.password = config->replication_password;
+
+	if (!standby_get_primary_buffer_ranges(&(keeper->postgres),
+										   &replicationSource,
+										   &blockList))
+	{
+		log_warn("Failed to get the list of blocks in shared_buffers from "
+				 "the primary, is the extension pg_buffercache installed?");
+		return false;
+	}
+
+	path_in_same_directory(config->pathnames.state,
+						   KEEPER_PREWARM_FILENAME, filename);
+
+	if (!write_file(blockList, strlen(blockList), filename))
+	{
+		log_warn("Failed to write the list of blocks to pre-warm to \"%s\"",
+				 filename);
+	}
+
+	free(prewarm->blockList);
+	prewarm->blockList = blockList;
+	prewarm->nextRange = blockList;
+
+	return true;
+}
+
+
+/*
+ * keeper_prewarm_load_block_list reads the last known list of blocks of the
+ * primary from disk, and starts pre-warming from the beginning of it.
+ */
+static bool
+keeper_prewarm_load_block_list(Keeper *keeper)
+{
+	KeeperPrewarm *prewarm = &(keeper->prewarm);
+	char filename[MAXPGPATH];
+	char *blockList = NULL;
+	long fileSize = 0;
+
+	path_in_same_directory(keeper->config.pathnames.state,
+						   KEEPER_PREWARM_FILENAME, filename);
+
+	if (!file_exists(filename))
 	{
-		log_info("The version of extenstion \"%s\" is \"%s\" on the monitor",
-				 PG_AUTOCTL_MONITOR_EXTENSION_NAME, version.installedVersion);
+		return true;
 	}
 
+	if (!read_file(filename, &blockList, &fileSize))
+	{
+		log_warn("Failed to read the list of blocks to pre-warm from \"%s\"",
+				 filename);
+		return false;
+	}
+
+	log_info("Pre-warming shared_buffers from \"%s\"", filename);
+
+	free(prewarm->blockList);
+	prewarm->blockList = blockList;
+	prewarm->nextRange = blockList;
+
 	return true;
 }
 
 
+/*
+ * keeper_prewarm_continue loads the next PREWARM_RANGES_PER_LOOP ranges of
+ * blocks in shared_buffers.
+ */
+static bool
+keeper_prewarm_continue(Keeper *keeper)
+{
+	KeeperPrewarm *prewarm = &(keeper->prewarm);
+	PGSQL *pgsql = &(keeper->postgres.sqlClient);
+	int rangeCount = 0;
+
+	while (prewarm->nextRange != NULL
+		   && *prewarm->nextRange != '\0'
+		   && rangeCount < PREWARM_RANGES_PER_LOOP)
+	{
+		char line[BUFSIZE] = { 0 };
+		char *lineEnd = strchr(prewarm->nextRange, '\n');
+		int lineLength = lineEnd == NULL
+						 ? strlen(prewarm->nextRange)
+						 : lineEnd - prewarm->nextRange;
+		char *relation = NULL;
+		char *fork = NULL;
+		char *firstBlock = NULL;
+		char *lastBlock = NULL;
+
+		strlcpy(line, prewarm->nextRange, Min(lineLength + 1, BUFSIZE));
+		prewarm->nextRange = lineEnd == NULL ? NULL : lineEnd + 1;
+
+		relation = strtok(line, "\t");
+		fork = strtok(NULL, "\t");
+		firstBlock = strtok(NULL, "\t");
+		lastBlock = strtok(NULL, "\t");
+
+		if (relation == NULL || fork == NULL
+			|| firstBlock == NULL || lastBlock == NULL)
+		{
+			log_warn("Failed to parse pre-warming range \"%s\"", line);
+			continue;
+		}
+
+		if (!pgsql_prewarm_range(pgsql, relation, fork,
+								 strtoll(firstBlock, NULL, 10),
+								 strtoll(lastBlock, NULL, 10)))
+		{
+			/* errors have already been logged, stop there */
+			log_warn("Failed to pre-warm blocks %s to %s of %s, "
+					 "is the extension pg_prewarm installed?",
+					 firstBlock, lastBlock, relation);
+			prewarm->nextRange = NULL;
+			return false;
+		}
+
+		++rangeCount;
+	}
+
+	if (rangeCount > 0 && (prewarm->nextRange == NULL
+						   || *prewarm->nextRange == '\0'))
+	{
+		log_info("Pre-warming of shared_buffers is done");
+		prewarm->nextRange = NULL;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_report_transition_timings keeps the timings of the last state
+ * transition in the KEEPER_TIMINGS_FILENAME file, and sends them to the
+ * monitor. That's best-effort: failing to do so doesn't fail the transition.
+ */
+bool
+keeper_report_transition_timings(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	TransitionTimings *timings = timings_take_last_transition();
+	char filename[MAXPGPATH] = { 0 };
+	bool success = true;
+
+	if (timings == NULL)
+	{
+		return true;
+	}
+
+	path_in_same_directory(config->pathnames.state,
+						   KEEPER_TIMINGS_FILENAME, filename);
+
+	if (!timings_append_to_file(timings, filename))
+	{
+		log_warn("Failed to write transition timings to \"%s\"", filename);
+		success = false;
+	}
+
+	if (!monitor_report_transition_timings(&(keeper->monitor),
+										   config->nodename,
+										   config->pgSetup.pgport,
+										   timings))
+	{
+		log_warn("Failed to report transition timings to the monitor");
+		success = false;
+	}
+
+	return success;
+}
+
+
+/*
+ * keeper_report_hook_results sends the results of the hooks that are done to
+ * the monitor, where they are kept as events. That's best-effort: the results
+ * that we fail to send are logged and forgotten.
+ */
+bool
+keeper_report_hook_results(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperHooks *hooks = &(keeper->hooks);
+	bool success = true;
+	int resultIndex = 0;
+
+	for (resultIndex = 0; resultIndex < hooks->resultCount; resultIndex++)
+	{
+		HookResult *result = &(hooks->results[resultIndex]);
+
+		if (!monitor_report_hook_result(&(keeper->monitor),
+										config->nodename,
+										config->pgSetup.pgport,
+										result))
+		{
+			log_warn("Failed to report the result of the %s hook "
+					 "to the monitor",
+					 HookEventToString(result->event));
+			success = false;
+		}
+	}
+
+	hooks->resultCount = 0;
+
+	return success;
+}
+
+
 /*
  * keeper_register_and_init registers the local node to the pg_auto_failover
  * Monitor in the given initialState, and then create the state on-disk with
@@ -654,6 +1753,8 @@ keeper_register_and_init(Keeper *keeper,
 {
 	Monitor *monitor = &(keeper->monitor);
 	MonitorAssignedState assignedState = { 0 };
+	char monitorURI[MAXCONNINFO] = { 0 };
+	bool delegated = false;
 
 	if (!monitor_init(monitor, config->monitor_pguri))
 	{
@@ -662,6 +1763,45 @@ keeper_register_and_init(Keeper *keeper,
 		return false;
 	}
 
+	/*
+	 * A root monitor may have delegated our formation to a regional monitor,
+	 * where the health checks and the state machine of our group then run.
+	 * In that case we register with the regional monitor, and keep using it
+	 * from then on.
+	 */
+	if (!monitor_get_formation_monitor(monitor, config->formation,
+									   monitorURI, MAXCONNINFO, &delegated))
+	{
+		log_fatal("Failed to get the monitor of formation \"%s\", "
+				  "see above for details", config->formation);
+		return false;
+	}
+
+	if (delegated)
+	{
+		log_info("Formation \"%s\" is delegated to monitor %s, "
+				 "registering there", config->formation, monitorURI);
+
+		pgsql_finish(&(monitor->pgsql));
+		strlcpy(config->monitor_pguri, monitorURI, MAXCONNINFO);
+
+		if (!monitor_init(monitor, config->monitor_pguri))
+		{
+			log_fatal("Failed to contact the monitor because its URL is "
+					  "invalid, see above for details");
+			return false;
+		}
+
+		if (!keeper_config_write_file(config))
+		{
+			log_fatal("Failed to write the pg_autoctl configuration file, "
+					  "see above");
+			return false;
+		}
+	}
+
+	monitor->pgsql.keepalives = config->keepalives;
+
 	/*
 	 * First try to create our state file. The keeper_state_create_file function
 	 * may fail if we have no permission to write to the state file directory
@@ -686,7 +1826,7 @@ keeper_register_and_init(Keeper *keeper,
 							   &assignedState))
 	{
 		/* errors have already been logged, remove state file */
-		unlink_file(config->pathnames.state);
+		keeper_state_unlink(config->pathnames.state);
 
 		return false;
 	}
@@ -710,7 +1850,7 @@ keeper_register_and_init(Keeper *keeper,
 		 * Make sure we don't have a corrupted state file around, that could
 		 * prevent trying to init again and cause strange errors.
 		 */
-		unlink_file(config->pathnames.state);
+		keeper_state_unlink(config->pathnames.state);
 
 		return false;
 	}
@@ -786,7 +1926,7 @@ keeper_remove(Keeper *keeper, KeeperConfig *config, bool ignore_monitor_errors)
 
 	log_info("Removing local node state file: \"%s\"", config->pathnames.state);
 
-	if (!unlink_file(config->pathnames.state))
+	if (!keeper_state_unlink(config->pathnames.state))
 	{
 		/* we already logged about errors */
 		errors++;
@@ -11,11 +11,26 @@
 #define KEEPER_H
 
 #include "commandline.h"
+#include "file_utils.h"
+#include "hooks.h"
 #include "keeper_config.h"
 #include "log.h"
 #include "monitor.h"
 #include "primary_standby.h"
 #include "state.h"
+#include "status_page.h"
+
+/*
+ * KeeperPrewarm tracks the pre-warming of the local shared_buffers with the
+ * blocks that the primary has in its own, see keeper_prewarm.
+ */
+typedef struct KeeperPrewarm
+{
+	char *blockList;			/* lines of "relation fork first last" */
+	char *nextRange;			/* where we are in blockList, NULL when done */
+	uint64_t lastFetchTime;
+	bool doneAfterPromotion;
+} KeeperPrewarm;
 
 /* the keeper manages a postgres server according to the given configuration */
 typedef struct Keeper
@@ -24,8 +39,69 @@ typedef struct Keeper
 	LocalPostgresServer postgres;
 	KeeperStateData state;
 	Monitor monitor;
+	KeeperPrewarm prewarm;
+	KeeperHooks hooks;
+
+	/* whether the catch-up settings are in place, see keeper_catchup */
+	bool catchupProfileKnown;
+	bool catchupProfileApplied;
+
+	/* the other nodes of our group, see keeper_prepare_replication */
+	NodeAddressArray otherNodes;
+	bool otherNodesKnown;
+
+	/* WAL retained by our replication slot, see keeper_guard_slot_retention */
+	int64_t slotRetainedWALReported;
+	int64_t slotReleasedWALBytes;
+	int slotReleasedNodeId;
+
+	/* what we last applied, see keeper_ensure_synchronous_standby_names */
+	char synchronousStandbyNames[BUFSIZE];
+
+	/* where we get WAL from, see keeper_report_wal_source */
+	bool walSourceReported;
+	char reportedWalSource[PG_WAL_SOURCE_MAXLENGTH];
+	int64_t reportedArchiveLag;
+
+	/* what we discovered the Postgres setup from, see keeper_restart.c */
+	PostgresSetup pgSetupOptions;
+	FileFingerprint configFileFingerprint;
+	bool warmRestart;
 } Keeper;
 
+/*
+ * KeeperService is what the service loop of a keeper keeps from one iteration
+ * to the next, so that a single process may run the loops of several keepers,
+ * see keeper_supervisor_run.
+ */
+typedef struct KeeperService
+{
+	Keeper *keeper;
+	pid_t pid;
+	bool reloadState;
+	bool reportPgIsRunning;
+
+	/*
+	 * A keeper that keeper_supervisor_run runs with other keepers stops on
+	 * its own when it loses its PID file, rather than having the process
+	 * exit, see keeper_service_prepare.
+	 */
+	bool supervised;
+	bool stopped;
+
+	/* after a warm restart, we check our configuration at the first loop */
+	bool validateConfig;
+
+	/* we only read those files again when they have changed on-disk */
+	FileFingerprint pidFileFingerprint;
+	FileFingerprint stateFileFingerprint;
+	FileFingerprint configFileFingerprint;
+
+	/* what local readers see of us, NULL when we failed to publish it */
+	KeeperStatusPage *statusPage;
+	uint64_t loopCount;
+} KeeperService;
+
 
 bool keeper_init(Keeper *keeper, KeeperConfig *config);
 bool keeper_register_and_init(Keeper *keeper, KeeperConfig *config,
@@ -37,11 +113,19 @@ bool keeper_update_state(Keeper *keeper, int node_id, int group_id, NodeState st
 bool keeper_start_postgres(Keeper *keeper);
 bool keeper_restart_postgres(Keeper *keeper);
 bool keeper_ensure_current_state(Keeper *keeper);
+bool keeper_prepare_replication(Keeper *keeper, bool otherNodeMissingIsOk,
+								bool keepExistingSlots);
 bool keeper_update_pg_state(Keeper *keeper);
 bool ReportPgIsRunning(Keeper *keeper);
 bool keeper_remove(Keeper *keeper, KeeperConfig *config,
 				   bool ignore_monitor_errors);
 bool keeper_check_monitor_extension_version(Keeper *keeper);
+bool keeper_prewarm(Keeper *keeper);
+bool keeper_catchup(Keeper *keeper);
+bool keeper_guard_slot_retention(Keeper *keeper);
+bool keeper_report_wal_source(Keeper *keeper);
+bool keeper_report_transition_timings(Keeper *keeper);
+bool keeper_report_hook_results(Keeper *keeper);
 
 bool keeper_init_state_write(Keeper *keeper);
 bool keeper_init_state_read(Keeper *keeper, KeeperStateInit *initState);
@@ -49,5 +133,6 @@ bool keeper_init_state_read(Keeper *keeper, KeeperStateInit *initState);
 /* loop.c */
 bool keeper_service_init(Keeper *keeper, pid_t *pid);
 bool keeper_service_run(Keeper *keeper, pid_t *start_pid);
+bool keeper_supervisor_run(Keeper *keepers, pid_t *pids, int keeperCount);
 
 #endif /* KEEPER_H */
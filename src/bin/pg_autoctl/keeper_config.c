@@ -17,6 +17,7 @@
 #include "keeper.h"
 #include "keeper_config.h"
 #include "log.h"
+#include "parsing.h"
 #include "pgctl.h"
 
 #define OPTION_AUTOCTL_ROLE(config) \
@@ -93,12 +94,77 @@
 							   false, &config->maximum_backup_rate, \
 							   MAXIMUM_BACKUP_RATE)
 
+#define OPTION_REPLICATION_BACKUP_COMPRESSION(config) \
+	make_string_option_default("replication", "backup_compression", NULL, \
+							   false, &config->backup_compression, \
+							   NULL)
+
+#define OPTION_REPLICATION_REWIND_SYNC(config) \
+	make_string_option_default("replication", "rewind_sync", NULL, \
+							   false, &config->rewind_sync, \
+							   NULL)
+
+#define OPTION_REPLICATION_RESTORE_COMMAND(config) \
+	make_string_option_default("replication", "restore_command", NULL, \
+							   false, &config->restore_command, \
+							   NULL)
+
+#define OPTION_REPLICATION_WAL_RESTORE_COMMAND(config) \
+	make_string_option_default("replication", "wal_restore_command", NULL, \
+							   false, &config->wal_restore_command, \
+							   NULL)
+
+#define OPTION_REPLICATION_PREWARM_INTERVAL(config) \
+	make_int_option_default("replication", "prewarm_interval", \
+							NULL, false, \
+							&(config->prewarm_interval), \
+							PREWARM_INTERVAL)
+
+#define OPTION_REPLICATION_CATCHUP_ACCELERATION(config) \
+	make_int_option_default("replication", "catchup_acceleration", \
+							NULL, false, \
+							&(config->catchup_acceleration), \
+							CATCHUP_ACCELERATION)
+
+#define OPTION_REPLICATION_SLOT_WAL_BUDGET(config) \
+	make_int_option_default("replication", "slot_wal_budget", \
+							NULL, false, \
+							&(config->slot_wal_budget), \
+							SLOT_WAL_BUDGET)
+
+#define OPTION_HTTP_LISTEN_ADDRESS(config) \
+	make_strbuf_option_default("http", "listen_address", NULL, false, \
+							   _POSIX_HOST_NAME_MAX, \
+							   config->http_listen_address, \
+							   HTTP_LISTEN_ADDRESS_DEFAULT)
+
+#define OPTION_HTTP_PORT(config) \
+	make_int_option_default("http", "port", NULL, false, \
+							&(config->http_port), \
+							HTTP_PORT_DEFAULT)
+
+#define OPTION_LIVENESS_PORT(config) \
+	make_int_option_default("liveness", "port", NULL, false, \
+							&(config->liveness_port), \
+							LIVENESS_PORT_DEFAULT)
+
+#define OPTION_LIVENESS_INTERVAL(config) \
+	make_int_option_default("liveness", "interval", NULL, false, \
+							&(config->liveness_interval), \
+							LIVENESS_INTERVAL_DEFAULT)
+
 #define OPTION_TIMEOUT_NETWORK_PARTITION(config) \
 	make_int_option_default("timeout", "network_partition_timeout", \
 							NULL, false, \
 							&(config->network_partition_timeout), \
 							NETWORK_PARTITION_TIMEOUT)
 
+#define OPTION_TIMEOUT_NETWORK_PARTITION_READ_ONLY(config) \
+	make_int_option_default("timeout", "network_partition_read_only", \
+							NULL, false, \
+							&(config->network_partition_read_only), \
+							NETWORK_PARTITION_READ_ONLY)
+
 #define OPTION_TIMEOUT_PREPARE_PROMOTION_CATCHUP(config) \
 	make_int_option_default("timeout", "prepare_promotion_catchup", \
 							NULL, \
@@ -127,6 +193,65 @@
 							&(config->postgresql_restart_failure_max_retries), \
 							POSTGRESQL_FAILS_TO_START_RETRIES)
 
+#define OPTION_TIMEOUT_HEARTBEAT_INTERVAL(config) \
+	make_int_option_default("timeout", "heartbeat_interval", \
+							NULL, \
+							false, \
+							&(config->heartbeat_interval), \
+							PG_AUTOCTL_KEEPER_HEARTBEAT_INTERVAL)
+
+#define OPTION_TIMEOUT_KEEPALIVES_IDLE(config) \
+	make_int_option_default("timeout", "keepalives_idle", \
+							NULL, \
+							false, \
+							&(config->keepalives.idle), \
+							PG_AUTOCTL_KEEPALIVES_IDLE)
+
+#define OPTION_TIMEOUT_KEEPALIVES_INTERVAL(config) \
+	make_int_option_default("timeout", "keepalives_interval", \
+							NULL, \
+							false, \
+							&(config->keepalives.interval), \
+							PG_AUTOCTL_KEEPALIVES_INTERVAL)
+
+#define OPTION_TIMEOUT_KEEPALIVES_COUNT(config) \
+	make_int_option_default("timeout", "keepalives_count", \
+							NULL, \
+							false, \
+							&(config->keepalives.count), \
+							PG_AUTOCTL_KEEPALIVES_COUNT)
+
+#define OPTION_TIMEOUT_TCP_USER_TIMEOUT(config) \
+	make_int_option_default("timeout", "tcp_user_timeout", \
+							NULL, \
+							false, \
+							&(config->keepalives.tcpUserTimeout), \
+							PG_AUTOCTL_TCP_USER_TIMEOUT)
+
+#define OPTION_HOOKS_PRE_TRANSITION(config) \
+	make_string_option_default("hooks", "pre_transition", NULL, \
+							   false, &config->pre_transition_hook, \
+							   NULL)
+
+#define OPTION_HOOKS_POST_TRANSITION(config) \
+	make_string_option_default("hooks", "post_transition", NULL, \
+							   false, &config->post_transition_hook, \
+							   NULL)
+
+#define OPTION_HOOKS_TIMEOUT(config) \
+	make_int_option_default("hooks", "timeout", \
+							NULL, \
+							false, \
+							&(config->hook_timeout), \
+							HOOK_TIMEOUT)
+
+#define OPTION_HOOKS_MAX_PROCESSES(config) \
+	make_int_option_default("hooks", "max_processes", \
+							NULL, \
+							false, \
+							&(config->hook_max_processes), \
+							HOOK_MAX_PROCESSES)
+
 #define SET_INI_OPTIONS_ARRAY(config) \
 	{ \
 		OPTION_AUTOCTL_ROLE(config), \
@@ -146,15 +271,38 @@
 		OPTION_REPLICATION_PASSWORD(config), \
 		OPTION_REPLICATION_SLOT_NAME(config), \
 		OPTION_REPLICATION_MAXIMUM_BACKUP_RATE(config), \
+		OPTION_REPLICATION_BACKUP_COMPRESSION(config), \
+		OPTION_REPLICATION_REWIND_SYNC(config), \
+		OPTION_REPLICATION_RESTORE_COMMAND(config), \
+		OPTION_REPLICATION_WAL_RESTORE_COMMAND(config), \
+		OPTION_REPLICATION_PREWARM_INTERVAL(config), \
+		OPTION_REPLICATION_CATCHUP_ACCELERATION(config), \
+		OPTION_REPLICATION_SLOT_WAL_BUDGET(config), \
+		OPTION_HTTP_LISTEN_ADDRESS(config), \
+		OPTION_HTTP_PORT(config), \
+		OPTION_LIVENESS_PORT(config), \
+		OPTION_LIVENESS_INTERVAL(config), \
 		OPTION_TIMEOUT_NETWORK_PARTITION(config), \
+		OPTION_TIMEOUT_NETWORK_PARTITION_READ_ONLY(config), \
 		OPTION_TIMEOUT_PREPARE_PROMOTION_CATCHUP(config), \
 		OPTION_TIMEOUT_PREPARE_PROMOTION_WALRECEIVER(config), \
 		OPTION_TIMEOUT_POSTGRESQL_RESTART_FAILURE_TIMEOUT(config), \
 		OPTION_TIMEOUT_POSTGRESQL_RESTART_FAILURE_MAX_RETRIES(config), \
+		OPTION_TIMEOUT_HEARTBEAT_INTERVAL(config), \
+		OPTION_TIMEOUT_KEEPALIVES_IDLE(config), \
+		OPTION_TIMEOUT_KEEPALIVES_INTERVAL(config), \
+		OPTION_TIMEOUT_KEEPALIVES_COUNT(config), \
+		OPTION_TIMEOUT_TCP_USER_TIMEOUT(config), \
+		OPTION_HOOKS_PRE_TRANSITION(config), \
+		OPTION_HOOKS_POST_TRANSITION(config), \
+		OPTION_HOOKS_TIMEOUT(config), \
+		OPTION_HOOKS_MAX_PROCESSES(config), \
 		INI_OPTION_LAST \
 	}
 
 static bool keeper_config_init_nodekind(KeeperConfig *config);
+static void reload_optional_string(const char *optionName,
+								   char **value, const char *newValue);
 
 
 /*
@@ -258,9 +406,28 @@ bool
 keeper_config_read_file(KeeperConfig *config,
 						bool missing_pgdata_is_ok,
 						bool pg_not_running_is_ok)
+{
+	if (!keeper_config_read_file_skip_pgsetup(config))
+	{
+		/* errors have already been logged. */
+		return false;
+	}
+
+	return keeper_config_pgsetup_init(config,
+									  missing_pgdata_is_ok,
+									  pg_not_running_is_ok);
+}
+
+
+/*
+ * keeper_config_read_file_skip_pgsetup reads the configuration file, without
+ * discovering the local Postgres setup from the values found in there, see
+ * keeper_config_pgsetup_init.
+ */
+bool
+keeper_config_read_file_skip_pgsetup(KeeperConfig *config)
 {
 	const char *filename = config->pathnames.config;
-	PostgresSetup pgSetup = { 0 };
 	IniOption keeperOptions[] = SET_INI_OPTIONS_ARRAY(config);
 
 	log_debug("Reading configuration from %s", filename);
@@ -277,6 +444,22 @@ keeper_config_read_file(KeeperConfig *config,
 		return false;
 	}
 
+	return true;
+}
+
+
+/*
+ * keeper_config_pgsetup_init discovers the local Postgres setup, starting
+ * from the values of the configuration file: finds pg_ctl and its version,
+ * reads the control data and the postmaster.pid file.
+ */
+bool
+keeper_config_pgsetup_init(KeeperConfig *config,
+						   bool missing_pgdata_is_ok,
+						   bool pg_not_running_is_ok)
+{
+	PostgresSetup pgSetup = { 0 };
+
 	if (!pg_setup_init(&pgSetup,
 					   &config->pgSetup,
 					   missing_pgdata_is_ok,
@@ -509,6 +692,36 @@ keeper_config_destroy(KeeperConfig *config)
 	{
 		free(config->replication_password);
 	}
+
+	if (config->backup_compression != NULL)
+	{
+		free(config->backup_compression);
+	}
+
+	if (config->rewind_sync != NULL)
+	{
+		free(config->rewind_sync);
+	}
+
+	if (config->restore_command != NULL)
+	{
+		free(config->restore_command);
+	}
+
+	if (config->wal_restore_command != NULL)
+	{
+		free(config->wal_restore_command);
+	}
+
+	if (config->pre_transition_hook != NULL)
+	{
+		free(config->pre_transition_hook);
+	}
+
+	if (config->post_transition_hook != NULL)
+	{
+		free(config->post_transition_hook);
+	}
 }
 
 
@@ -522,6 +735,8 @@ keeper_config_destroy(KeeperConfig *config)
 bool
 keeper_config_accept_new(KeeperConfig *config, KeeperConfig *newConfig)
 {
+	char rate[BUFSIZE] = { 0 };
+
 	/* some elements are not supposed to change on a reload */
 	if (strneq(newConfig->pgSetup.pgdata, config->pgSetup.pgdata))
 	{
@@ -588,6 +803,21 @@ keeper_config_accept_new(KeeperConfig *config, KeeperConfig *newConfig)
 		strlcpy(config->nodename, newConfig->nodename, _POSIX_HOST_NAME_MAX);
 	}
 
+	/*
+	 * Changing postgresql.listen_addresses is applied to the running Postgres
+	 * instance at the next restart, see postgres_apply_default_settings.
+	 */
+	if (strneq(newConfig->pgSetup.listen_addresses,
+			   config->pgSetup.listen_addresses))
+	{
+		log_info("Reloading configuration: postgresql.listen_addresses is now "
+				 "\"%s\"; used to be \"%s\"",
+				 newConfig->pgSetup.listen_addresses,
+				 config->pgSetup.listen_addresses);
+		strlcpy(config->pgSetup.listen_addresses,
+				newConfig->pgSetup.listen_addresses, MAXPGPATH);
+	}
+
 	/*
 	 * Changing the replication password? Sure.
 	 */
@@ -603,7 +833,15 @@ keeper_config_accept_new(KeeperConfig *config, KeeperConfig *newConfig)
 	/*
 	 * Changing replication.maximum_backup_rate.
 	 */
-	if (strneq(newConfig->maximum_backup_rate, config->maximum_backup_rate))
+	if (strneq(newConfig->maximum_backup_rate, config->maximum_backup_rate)
+		&& !parse_backup_rate_schedule(newConfig->maximum_backup_rate, 0,
+									   rate, BUFSIZE))
+	{
+		log_warn("Failed to reload replication.maximum_backup_rate \"%s\", "
+				 "continuing with \"%s\"",
+				 newConfig->maximum_backup_rate, config->maximum_backup_rate);
+	}
+	else if (strneq(newConfig->maximum_backup_rate, config->maximum_backup_rate))
 	{
 		log_info("Reloading configuration: "
 				 "replication.maximum_backup_rate is now \"%s\"; "
@@ -615,6 +853,79 @@ keeper_config_accept_new(KeeperConfig *config, KeeperConfig *newConfig)
 		config->maximum_backup_rate = strdup(newConfig->maximum_backup_rate);
 	}
 
+	/*
+	 * Changing the standby build strategy, which settings may be unset.
+	 */
+	reload_optional_string("replication.backup_compression",
+						   &(config->backup_compression),
+						   newConfig->backup_compression);
+
+	reload_optional_string("replication.rewind_sync",
+						   &(config->rewind_sync),
+						   newConfig->rewind_sync);
+
+	reload_optional_string("replication.restore_command",
+						   &(config->restore_command),
+						   newConfig->restore_command);
+
+	reload_optional_string("replication.wal_restore_command",
+						   &(config->wal_restore_command),
+						   newConfig->wal_restore_command);
+
+	if (newConfig->prewarm_interval != config->prewarm_interval)
+	{
+		log_info("Reloading configuration: replication.prewarm_interval "
+				 "is now %d; used to be %d",
+				 newConfig->prewarm_interval,
+				 config->prewarm_interval);
+
+		config->prewarm_interval = newConfig->prewarm_interval;
+	}
+
+	if (newConfig->catchup_acceleration != config->catchup_acceleration)
+	{
+		log_info("Reloading configuration: replication.catchup_acceleration "
+				 "is now %d; used to be %d",
+				 newConfig->catchup_acceleration,
+				 config->catchup_acceleration);
+
+		config->catchup_acceleration = newConfig->catchup_acceleration;
+	}
+
+	if (newConfig->slot_wal_budget != config->slot_wal_budget)
+	{
+		log_info("Reloading configuration: replication.slot_wal_budget "
+				 "is now %d; used to be %d",
+				 newConfig->slot_wal_budget,
+				 config->slot_wal_budget);
+
+		config->slot_wal_budget = newConfig->slot_wal_budget;
+	}
+
+	/*
+	 * The HTTP server listens from the start of the service.
+	 */
+	if (strneq(newConfig->http_listen_address, config->http_listen_address) ||
+		newConfig->http_port != config->http_port)
+	{
+		log_warn("pg_autoctl doesn't know how to change http.listen_address "
+				 "or http.port at run-time, please restart the service; "
+				 "continuing with %s:%d.",
+				 config->http_listen_address, config->http_port);
+	}
+
+	/*
+	 * The liveness socket is bound from the start of the service too.
+	 */
+	if (newConfig->liveness_port != config->liveness_port ||
+		newConfig->liveness_interval != config->liveness_interval)
+	{
+		log_warn("pg_autoctl doesn't know how to change liveness.port "
+				 "or liveness.interval at run-time, please restart the "
+				 "service; continuing with port %d every %dms.",
+				 config->liveness_port, config->liveness_interval);
+	}
+
 	/*
 	 * And now the timeouts. Of course we support changing them at run-time.
 	 */
@@ -630,6 +941,18 @@ keeper_config_accept_new(KeeperConfig *config, KeeperConfig *newConfig)
 			newConfig->network_partition_timeout;
 	}
 
+	if (newConfig->network_partition_read_only
+		!= config->network_partition_read_only)
+	{
+		log_info("Reloading configuration: timeout.network_partition_read_only "
+				 "is now %d; used to be %d",
+				 newConfig->network_partition_read_only,
+				 config->network_partition_read_only);
+
+		config->network_partition_read_only =
+			newConfig->network_partition_read_only;
+	}
+
 	if (newConfig->prepare_promotion_catchup
 		!= config->prepare_promotion_catchup)
 	{
@@ -681,10 +1004,104 @@ keeper_config_accept_new(KeeperConfig *config, KeeperConfig *newConfig)
 			newConfig->postgresql_restart_failure_max_retries;
 	}
 
+	if (newConfig->heartbeat_interval != config->heartbeat_interval)
+	{
+		log_info(
+			"Reloading configuration: timeout.heartbeat_interval "
+			"is now %d; used to be %d",
+			newConfig->heartbeat_interval,
+			config->heartbeat_interval);
+
+		config->heartbeat_interval = newConfig->heartbeat_interval;
+	}
+
+	if (newConfig->keepalives.idle != config->keepalives.idle ||
+		newConfig->keepalives.interval != config->keepalives.interval ||
+		newConfig->keepalives.count != config->keepalives.count ||
+		newConfig->keepalives.tcpUserTimeout != config->keepalives.tcpUserTimeout)
+	{
+		log_info(
+			"Reloading configuration: keepalives are now %ds idle, %ds "
+			"interval, %d probes, and tcp_user_timeout %dms; "
+			"used to be %ds, %ds, %d, and %dms",
+			newConfig->keepalives.idle,
+			newConfig->keepalives.interval,
+			newConfig->keepalives.count,
+			newConfig->keepalives.tcpUserTimeout,
+			config->keepalives.idle,
+			config->keepalives.interval,
+			config->keepalives.count,
+			config->keepalives.tcpUserTimeout);
+
+		config->keepalives = newConfig->keepalives;
+	}
+
+	/*
+	 * Hooks are started at the next state transition, so we can change them
+	 * at run-time too.
+	 */
+	reload_optional_string("hooks.pre_transition",
+						   &(config->pre_transition_hook),
+						   newConfig->pre_transition_hook);
+
+	reload_optional_string("hooks.post_transition",
+						   &(config->post_transition_hook),
+						   newConfig->post_transition_hook);
+
+	if (newConfig->hook_timeout != config->hook_timeout)
+	{
+		log_info("Reloading configuration: hooks.timeout is now %d; "
+				 "used to be %d",
+				 newConfig->hook_timeout, config->hook_timeout);
+
+		config->hook_timeout = newConfig->hook_timeout;
+	}
+
+	if (newConfig->hook_max_processes != config->hook_max_processes)
+	{
+		log_info("Reloading configuration: hooks.max_processes is now %d; "
+				 "used to be %d",
+				 newConfig->hook_max_processes, config->hook_max_processes);
+
+		config->hook_max_processes = newConfig->hook_max_processes;
+	}
+
 	return true;
 }
 
 
+/*
+ * reload_optional_string sets *value to a copy of newValue when it changed,
+ * where both the current and the new value may be NULL.
+ */
+static void
+reload_optional_string(const char *optionName,
+					   char **value, const char *newValue)
+{
+	if (*value == NULL && newValue == NULL)
+	{
+		return;
+	}
+
+	if (*value != NULL && newValue != NULL && strcmp(*value, newValue) == 0)
+	{
+		return;
+	}
+
+	log_info("Reloading configuration: %s is now \"%s\"; used to be \"%s\"",
+			 optionName,
+			 newValue == NULL ? "" : newValue,
+			 *value == NULL ? "" : *value);
+
+	if (*value != NULL)
+	{
+		free(*value);
+	}
+
+	*value = newValue == NULL ? NULL : strdup(newValue);
+}
+
+
 /*
  * keeper_config_init_nodekind initializes the config->nodeKind and
  * config->pgSetup.pgKind values from the configuration file or command line
@@ -744,3 +1161,49 @@ keeper_config_update_with_absolute_pgdata(KeeperConfig *config)
 	}
 	return true;
 }
+
+
+/*
+ * keeper_config_standby_slot_name sets slotName to the name of the
+ * replication slot that the primary keeps for the standby node with the given
+ * node id: replication.slot_name followed by the node id, so that each
+ * standby node of a group has its own slot. Before the monitor assigned a
+ * node id, that's replication.slot_name itself.
+ */
+void
+keeper_config_standby_slot_name(KeeperConfig *config, int nodeId,
+								char *slotName)
+{
+	if (nodeId <= 0)
+	{
+		strlcpy(slotName, config->replication_slot_name, NAMEDATALEN);
+	}
+	else
+	{
+		snprintf(slotName, NAMEDATALEN, "%s_%d",
+				 config->replication_slot_name, nodeId);
+	}
+}
+
+
+/*
+ * keeper_config_standby_application_name sets applicationName to the
+ * application_name that the standby node with the given node id uses to
+ * connect to its primary. The monitor lists standby nodes by that name in
+ * synchronous_standby_names, and it doesn't know about replication.slot_name,
+ * so we use a fixed prefix here. Before the monitor assigned a node id, the
+ * applicationName is empty and libpq uses its default.
+ */
+void
+keeper_config_standby_application_name(int nodeId, char *applicationName)
+{
+	if (nodeId <= 0)
+	{
+		applicationName[0] = '\0';
+	}
+	else
+	{
+		snprintf(applicationName, NAMEDATALEN, "%s_%d",
+				 REPLICATION_APPLICATION_NAME_PREFIX, nodeId);
+	}
+}
@@ -37,13 +37,39 @@ typedef struct KeeperConfig
 	char *replication_slot_name;
 	char *replication_password;
 	char *maximum_backup_rate;
+	char *backup_compression;
+	char *rewind_sync;
+	char *restore_command;
+	char *wal_restore_command;
+	int prewarm_interval;
+	int catchup_acceleration;
+	int slot_wal_budget;
+
+	/* HTTP server of the keeper service, disabled when the port is 0 */
+	char http_listen_address[_POSIX_HOST_NAME_MAX];
+	int http_port;
+
+	/* UDP heartbeats with the other node, disabled when the port is 0 */
+	int liveness_port;
+	int liveness_interval;
 
 	/* pg_autoctl timeouts */
 	int network_partition_timeout;
+	int network_partition_read_only;
 	int prepare_promotion_catchup;
 	int prepare_promotion_walreceiver;
 	int postgresql_restart_failure_timeout;
 	int postgresql_restart_failure_max_retries;
+	int heartbeat_interval;
+
+	/* TCP keepalives settings of the monitor connections */
+	PGSQLKeepalives keepalives;
+
+	/* commands that the keeper runs around its state transitions */
+	char *pre_transition_hook;
+	char *post_transition_hook;
+	int hook_timeout;
+	int hook_max_processes;
 } KeeperConfig;
 
 bool keeper_config_set_pathnames_from_pgdata(ConfigFilePaths *pathnames,
@@ -55,6 +81,10 @@ void keeper_config_init(KeeperConfig *config,
 bool keeper_config_read_file(KeeperConfig *config,
 							 bool missing_pgdata_is_ok,
 							 bool pg_not_running_is_ok);
+bool keeper_config_read_file_skip_pgsetup(KeeperConfig *config);
+bool keeper_config_pgsetup_init(KeeperConfig *config,
+								bool missing_pgdata_is_ok,
+								bool pg_not_running_is_ok);
 bool keeper_config_write_file(KeeperConfig *config);
 bool keeper_config_write(FILE *stream, KeeperConfig *config);
 void keeper_config_log_settings(KeeperConfig config);
@@ -72,5 +102,9 @@ bool keeper_config_set_groupId(KeeperConfig *config, int groupId);
 void keeper_config_destroy(KeeperConfig *config);
 bool keeper_config_accept_new(KeeperConfig *config, KeeperConfig *newConfig);
 bool keeper_config_update_with_absolute_pgdata(KeeperConfig *config);
+void keeper_config_standby_slot_name(KeeperConfig *config, int nodeId,
+									 char *slotName);
+void keeper_config_standby_application_name(int nodeId,
+											char *applicationName);
 
 #endif /* KEEPER_CONFIG_H */
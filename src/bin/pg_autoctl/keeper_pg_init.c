@@ -7,8 +7,11 @@
  *
  */
 
+#include <errno.h>
 #include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/wait.h>
 
 #include "postgres_fe.h"
 
@@ -53,6 +56,23 @@ static bool wait_until_primary_is_ready(Keeper *config,
 
 static bool keeper_pg_init_node_active(Keeper *keeper);
 
+static void keeper_pg_init_stage_initdb(PostgresSetup *pgSetup);
+static bool keeper_pg_init_use_staged_initdb(const char *pgdata);
+static void keeper_pg_init_discard_staged_initdb(void);
+static bool wait_for_staged_initdb(void);
+
+/*
+ * When PGDATA doesn't exist yet, we run initdb in a staging directory next to
+ * it while registering to the monitor, see keeper_pg_init_stage_initdb.
+ */
+typedef struct StagedInitdb
+{
+	pid_t pid;
+	char pgdata[MAXPGPATH];
+} StagedInitdb;
+
+static StagedInitdb stagedInitdb = { -1, { 0 } };
+
 /*
  * keeper_pg_init initialises a pg_autoctl keeper and its local PostgreSQL
  * instance. Registering a PostgreSQL instance to the monitor is a 3 states
@@ -200,9 +220,19 @@ keeper_pg_init(Keeper *keeper, KeeperConfig *config)
 		 *
 		 * So our strategy is to ask the monitor to pick a state for us and
 		 * then implement whatever was decided.
+		 *
+		 * Most of the time the monitor assigns SINGLE to us and then we
+		 * initdb, so we run initdb while registering, at the cost of
+		 * removing the result when we're asked to join an existing group.
 		 */
+		bool success = false;
+
+		keeper_pg_init_stage_initdb(&pgSetup);
+
 		if (!keeper_register_and_init(keeper, config, INIT_STATE))
 		{
+			keeper_pg_init_discard_staged_initdb();
+
 			log_error("Failed to register the existing local Postgres node "
 					  "\"%s:%d\" running at \"%s\""
 					  "to the pg_auto_failover monitor at %s, "
@@ -215,7 +245,12 @@ keeper_pg_init(Keeper *keeper, KeeperConfig *config)
 		log_info("Successfully registered as \"%s\" to the monitor.",
 				 NodeStateToString(keeper->state.assigned_role));
 
-		return reach_initial_state(keeper);
+		success = reach_initial_state(keeper);
+
+		/* when the staged PGDATA has not been used, get rid of it */
+		keeper_pg_init_discard_staged_initdb();
+
+		return success;
 	}
 
 	/* unknown case, the logic above is faulty, at least admit we're defeated */
@@ -509,6 +544,9 @@ keeper_init_maybe_initdb(Keeper *keeper, bool *pgInstanceIsOurs)
 	if (!(keeper->state.current_role == INIT_STATE
 		  && keeper->state.assigned_role == SINGLE_STATE))
 	{
+		/* we might have started initdb while registering, for nothing */
+		keeper_pg_init_discard_staged_initdb();
+
 		*pgInstanceIsOurs = false;
 		return true;
 	}
@@ -530,7 +568,8 @@ keeper_init_maybe_initdb(Keeper *keeper, bool *pgInstanceIsOurs)
 	 */
 	if (!postgresInstanceExists)
 	{
-		if (!pg_ctl_initdb(pgSetup.pg_ctl, pgSetup.pgdata))
+		if (!keeper_pg_init_use_staged_initdb(pgSetup.pgdata) &&
+			!pg_ctl_initdb(pgSetup.pg_ctl, pgSetup.pgdata))
 		{
 			log_fatal("Failed to initialise a PostgreSQL instance at \"%s\""
 					  ", see above for details", pgSetup.pgdata);
@@ -594,6 +633,175 @@ keeper_init_maybe_initdb(Keeper *keeper, bool *pgInstanceIsOurs)
 }
 
 
+/*
+ * keeper_pg_init_stage_initdb starts running initdb in the background, in a
+ * staging directory next to PGDATA, so that it runs concurrently with our
+ * registration to the monitor. We don't initdb in PGDATA directly because
+ * the monitor might assign us a standby role, and because what we find in
+ * PGDATA at registration time is recorded in our init state.
+ *
+ * Failing to start initdb here is not an error: we then initdb in PGDATA
+ * later, when we know we need to.
+ */
+static void
+keeper_pg_init_stage_initdb(PostgresSetup *pgSetup)
+{
+	int length = strlcpy(stagedInitdb.pgdata, pgSetup->pgdata, MAXPGPATH);
+	pid_t pid;
+
+	/* PGDATA might have been given with a trailing slash */
+	while (length > 1 && stagedInitdb.pgdata[length - 1] == '/')
+	{
+		stagedInitdb.pgdata[--length] = '\0';
+	}
+
+	if (length + strlen(".initdb") >= MAXPGPATH)
+	{
+		stagedInitdb.pgdata[0] = '\0';
+		return;
+	}
+	strlcat(stagedInitdb.pgdata, ".initdb", MAXPGPATH);
+
+	/* the staging directory might be left-over from an interrupted attempt */
+	if (directory_exists(stagedInitdb.pgdata) &&
+		!rmtree(stagedInitdb.pgdata, true))
+	{
+		log_warn("Failed to remove directory \"%s\": %s",
+				 stagedInitdb.pgdata, strerror(errno));
+		stagedInitdb.pgdata[0] = '\0';
+		return;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+
+	pid = fork();
+
+	switch (pid)
+	{
+		case -1:
+		{
+			log_warn("Failed to fork a process to run initdb: %s",
+					 strerror(errno));
+			stagedInitdb.pgdata[0] = '\0';
+			return;
+		}
+
+		case 0:
+		{
+			/* fork succeeded, in child */
+			bool success = pg_ctl_initdb(pgSetup->pg_ctl, stagedInitdb.pgdata);
+
+			_exit(success ? EXIT_CODE_QUIT : EXIT_CODE_PGCTL);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			log_debug("Running initdb in \"%s\" in process %d",
+					  stagedInitdb.pgdata, pid);
+			stagedInitdb.pid = pid;
+			return;
+		}
+	}
+}
+
+
+/*
+ * keeper_pg_init_use_staged_initdb waits until the initdb started in
+ * keeper_pg_init_stage_initdb is done, and then moves its result in place at
+ * PGDATA. It returns false when there is no such result to use, and the
+ * caller should then initdb in PGDATA.
+ */
+static bool
+keeper_pg_init_use_staged_initdb(const char *pgdata)
+{
+	if (IS_EMPTY_STRING_BUFFER(stagedInitdb.pgdata))
+	{
+		return false;
+	}
+
+	if (!wait_for_staged_initdb())
+	{
+		log_warn("Failed to initialise a PostgreSQL instance at \"%s\", "
+				 "retrying at \"%s\"", stagedInitdb.pgdata, pgdata);
+		keeper_pg_init_discard_staged_initdb();
+		return false;
+	}
+
+	if (rename(stagedInitdb.pgdata, pgdata) != 0)
+	{
+		log_warn("Failed to rename \"%s\" to \"%s\": %s",
+				 stagedInitdb.pgdata, pgdata, strerror(errno));
+		keeper_pg_init_discard_staged_initdb();
+		return false;
+	}
+
+	log_info("Initialised a PostgreSQL cluster at \"%s\" while registering "
+			 "to the monitor", pgdata);
+
+	stagedInitdb.pgdata[0] = '\0';
+
+	return true;
+}
+
+
+/*
+ * keeper_pg_init_discard_staged_initdb waits until the initdb started in
+ * keeper_pg_init_stage_initdb is done, and removes its result.
+ */
+static void
+keeper_pg_init_discard_staged_initdb(void)
+{
+	if (IS_EMPTY_STRING_BUFFER(stagedInitdb.pgdata))
+	{
+		return;
+	}
+
+	(void) wait_for_staged_initdb();
+
+	if (directory_exists(stagedInitdb.pgdata) &&
+		!rmtree(stagedInitdb.pgdata, true))
+	{
+		log_warn("Failed to remove directory \"%s\": %s",
+				 stagedInitdb.pgdata, strerror(errno));
+	}
+
+	stagedInitdb.pgdata[0] = '\0';
+}
+
+
+/*
+ * wait_for_staged_initdb waits until the initdb process is done, and returns
+ * true when it was successful.
+ */
+static bool
+wait_for_staged_initdb(void)
+{
+	int status = 0;
+
+	if (stagedInitdb.pid <= 0)
+	{
+		return false;
+	}
+
+	while (waitpid(stagedInitdb.pid, &status, 0) < 0)
+	{
+		if (errno != EINTR)
+		{
+			log_warn("Failed to wait for the initdb process %d: %s",
+					 stagedInitdb.pid, strerror(errno));
+			stagedInitdb.pid = -1;
+			return false;
+		}
+	}
+
+	stagedInitdb.pid = -1;
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_CODE_QUIT;
+}
+
+
 /*
  * wait_until_primary_is_ready calls monitor_node_active every second until the
  * monitor tells us that we can move from our current state
@@ -680,16 +888,15 @@ wait_until_primary_is_ready(Keeper *keeper,
 /*
  * create_database_and_extension does the following:
  *
- *  - ensures PostgreSQL is running
+ *  - edit pg_hba.conf and postgresql.conf in the new PGDATA for pg_autoctl
+ *  - ensures PostgreSQL is running, with the new setup active already
  *  - create the proper role with login
- *  - to be able to fetch pg_hba.conf location and edit it for pg_autoctl
  *  - then createdb pgSetup.dbname, which might not be postgres
- *  - and restart PostgreSQL with the new setup, to make it active/current
  *  - finally when pgKind is Citus, create the citus extension
  *
- * When pgKind is Citus, the setup we install in step 2 contains the
+ * When pgKind is Citus, the setup we install in step 1 contains the
  * shared_preload_libraries = 'citus' entry, so we can proceed with create
- * extension citus after the restart.
+ * extension citus once PostgreSQL is running.
  */
 static bool
 create_database_and_extension(Keeper *keeper)
@@ -706,7 +913,12 @@ create_database_and_extension(Keeper *keeper)
 
 	char *pg_regress_sock_dir = getenv("PG_REGRESS_SOCK_DIR");
 
+	/* when continuing a previous attempt, Postgres might be running */
+	bool postgresWasRunning = pg_setup_is_running(pgSetup);
+
 	char hbaFilePath[MAXPGPATH];
+	char configFilePath[MAXPGPATH];
+	HBAEditor editor = { 0 };
 
 	/* we didn't start PostgreSQL yet, also we just ran initdb */
 	snprintf(hbaFilePath, MAXPGPATH, "%s/pg_hba.conf", pgSetup->pgdata);
@@ -720,15 +932,23 @@ create_database_and_extension(Keeper *keeper)
 	 * We need to make it so that the user can actually use that connection
 	 * string with at least the --username used to create the database.
 	 */
-	if (!pghba_ensure_host_rule_exists(hbaFilePath,
-									   HBA_DATABASE_DBNAME,
-									   pgSetup->dbname,
-									   pg_setup_get_username(pgSetup),
-									   config->nodename,
-									   "trust"))
+	if (!pghba_editor_init(&editor, hbaFilePath))
+	{
+		log_error("Failed to edit \"%s\", see above for details",
+				  hbaFilePath);
+		return false;
+	}
+
+	if (!pghba_editor_add_host_rule(&editor,
+									HBA_DATABASE_DBNAME,
+									pgSetup->dbname,
+									pg_setup_get_username(pgSetup),
+									config->nodename,
+									"trust"))
 	{
 		log_error("Failed to edit \"%s\" to grant connections to \"%s\", "
 				  "see above for details", hbaFilePath, config->nodename);
+		pghba_editor_destroy(&editor);
 		return false;
 	}
 
@@ -742,16 +962,44 @@ create_database_and_extension(Keeper *keeper)
 		log_info("Granting connection from \"%s\" in \"%s\"",
 				 pgSetup->pghost, hbaFilePath);
 
-		if (!pghba_ensure_host_rule_exists(hbaFilePath,
-										   HBA_DATABASE_ALL, NULL, NULL,
-										   pgSetup->pghost, "trust"))
+		if (!pghba_editor_add_host_rule(&editor,
+										HBA_DATABASE_ALL, NULL, NULL,
+										pgSetup->pghost, "trust"))
 		{
 			log_error("Failed to edit \"%s\" to grant connections to \"%s\", "
 					  "see above for details", hbaFilePath, pgSetup->pghost);
+			pghba_editor_destroy(&editor);
 			return false;
 		}
 	}
 
+	/* PostgreSQL is not running yet, there's nothing to reload */
+	if (!pghba_editor_commit(&editor))
+	{
+		log_error("Failed to edit \"%s\", see above for details",
+				  hbaFilePath);
+		pghba_editor_destroy(&editor);
+		return false;
+	}
+
+	pghba_editor_destroy(&editor);
+
+	/*
+	 * Now allow nodes on the same network to connect to the coordinator, and
+	 * the coordinator to connect to its workers. PostgreSQL is not running
+	 * yet, so we edit PGDATA/pg_hba.conf directly.
+	 */
+	if (IS_CITUS_INSTANCE_KIND(postgres->pgKind))
+	{
+		(void) pghba_enable_lan_cidr(NULL,
+									 HBA_DATABASE_DBNAME,
+									 pgSetup->dbname,
+									 config->nodename,
+									 pg_setup_get_username(pgSetup),
+									 "trust",
+									 pgSetup->pgdata);
+	}
+
 	/*
 	 * Use the "template1" database in the next operations when connecting to
 	 * do the initial PostgreSQL configuration, and to create our database. We
@@ -768,6 +1016,21 @@ create_database_and_extension(Keeper *keeper)
 	strlcpy(initPgSetup.dbname, "template1", NAMEDATALEN);
 	local_postgres_init(&initPostgres, &initPgSetup);
 
+	/*
+	 * Add pg_autoctl PostgreSQL settings, including Citus extension in
+	 * shared_preload_libraries when dealing with a Citus worker or coordinator
+	 * node. We just ran initdb, so postgresql.conf is in PGDATA, and having
+	 * the settings in place before the first start saves a restart.
+	 */
+	snprintf(configFilePath, MAXPGPATH, "%s/postgresql.conf", pgSetup->pgdata);
+
+	if (!postgres_add_default_settings_to_file(&initPostgres, configFilePath))
+	{
+		log_error("Failed to add default settings to newly initialized "
+				  "PostgreSQL instance, see above for details");
+		return false;
+	}
+
 	/*
 	 * Now start the database, we need to create our dbname and maybe the Citus
 	 * Extension too.
@@ -795,33 +1058,6 @@ create_database_and_extension(Keeper *keeper)
 		}
 	}
 
-	/*
-	 * Add pg_autoctl PostgreSQL settings, including Citus extension in
-	 * shared_preload_libraries when dealing with a Citus worker or coordinator
-	 * node.
-	 */
-	if (!postgres_add_default_settings(&initPostgres))
-	{
-		log_error("Failed to add default settings to newly initialized "
-				  "PostgreSQL instance, see above for details");
-		return false;
-	}
-
-	/*
-	 * Now allow nodes on the same network to connect to the coordinator, and
-	 * the coordinator to connect to its workers.
-	 */
-	if (IS_CITUS_INSTANCE_KIND(postgres->pgKind))
-	{
-		(void) pghba_enable_lan_cidr(&initPostgres.sqlClient,
-									 HBA_DATABASE_DBNAME,
-									 pgSetup->dbname,
-									 config->nodename,
-									 pg_setup_get_username(pgSetup),
-									 "trust",
-									 NULL);
-	}
-
 	/*
 	 * Now, maybe create the database (if "postgres", it already exists).
 	 *
@@ -847,15 +1083,26 @@ create_database_and_extension(Keeper *keeper)
 	pgsql_finish(&initPostgres.sqlClient);
 
 	/*
-	 * Because we did create the PostgreSQL cluster in this function, we feel
-	 * free to restart it to make sure that the defaults we just installed are
+	 * When we started PostgreSQL ourselves just above, our settings were in
+	 * place already and there's no need to restart it. When continuing from
+	 * a previous attempt though, PostgreSQL might have been running already,
+	 * and because we did create the PostgreSQL cluster, we feel free to
+	 * restart it to make sure that the defaults we just installed are
 	 * actually in place.
 	 */
-
-	if (!keeper_restart_postgres(keeper))
+	if (postgresWasRunning)
+	{
+		if (!keeper_restart_postgres(keeper))
+		{
+			log_fatal("Failed to restart PostgreSQL to enable pg_auto_failover "
+					  "configuration");
+			return false;
+		}
+	}
+	else if (!keeper_update_pg_state(keeper))
 	{
-		log_fatal("Failed to restart PostgreSQL to enable pg_auto_failover "
-				  "configuration");
+		log_error("Failed to update the keeper's state from the local "
+				  "PostgreSQL instance, see above for details.");
 		return false;
 	}
 
@@ -912,7 +1159,7 @@ keeper_pg_init_node_active(Keeper *keeper)
 		 * Make sure we don't have a corrupted state file around, that could
 		 * prevent trying to init again and cause strange errors.
 		 */
-		unlink_file(keeper->config.pathnames.state);
+		keeper_state_unlink(keeper->config.pathnames.state);
 
 		return false;
 	}
@@ -956,7 +1203,7 @@ keeper_pg_init_node_active(Keeper *keeper)
 		 * Make sure we don't have a corrupted state file around, that could
 		 * prevent trying to init again and cause strange errors.
 		 */
-		unlink_file(keeper->config.pathnames.state);
+		keeper_state_unlink(keeper->config.pathnames.state);
 
 		return false;
 	}
@@ -0,0 +1,259 @@
+/*
+ * src/bin/pg_autoctl/keeper_restart.c
+ *     Warm restart of the keeper service, from what it knew when it stopped.
+ *
+ * When `pg_autoctl run` starts, it discovers the local Postgres setup from
+ * its configuration: finds pg_ctl, reads the control data and the
+ * postmaster.pid file, and waits for Postgres to be ready when it's still
+ * starting. That's a supervision gap each time the service is restarted, for
+ * instance to upgrade pg_autoctl.
+ *
+ * A keeper service that stops cleanly leaves what it discovered in the
+ * pg_autoctl.restart file next to the state file. The next service trusts it
+ * when it starts soon enough, the file checksum matches, and the
+ * configuration and state files didn't change in between. It then calls the
+ * monitor right away, and only checks its configuration again once it's done
+ * that, see keeper_service_apply.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "port/pg_crc32c.h"
+
+#include "defaults.h"
+#include "file_utils.h"
+#include "keeper.h"
+#include "keeper_config.h"
+#include "keeper_restart.h"
+#include "log.h"
+#include "pgsetup.h"
+#include "state.h"
+
+
+/* bump when the layout of KeeperRestartData changes */
+#define KEEPER_RESTART_VERSION 1
+
+typedef struct KeeperRestartData
+{
+	int version;
+	uint64_t stopTime;
+	FileFingerprint configFile;
+	FileFingerprint stateFile;
+	PostgresSetup options;      /* what pg_setup_init started from */
+	PostgresSetup pgSetup;      /* what pg_setup_init found */
+	pg_crc32c crc;
+} KeeperRestartData;
+
+
+static pg_crc32c keeper_restart_crc(KeeperRestartData *data);
+static bool keeper_restart_read(Keeper *keeper, KeeperRestartData *data);
+static bool keeper_restart_same_options(PostgresSetup *a, PostgresSetup *b);
+
+
+/*
+ * keeper_restart_read_config reads the configuration of the keeper service,
+ * and discovers the local Postgres setup from it, unless we can use what the
+ * previous keeper service left for us when it stopped.
+ */
+bool
+keeper_restart_read_config(Keeper *keeper,
+						   bool missing_pgdata_is_ok,
+						   bool pg_is_not_running_is_ok)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperRestartData data = { 0 };
+
+	if (!keeper_config_read_file_skip_pgsetup(config))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	keeper->pgSetupOptions = config->pgSetup;
+	(void) file_has_changed(config->pathnames.config,
+							&(keeper->configFileFingerprint));
+
+	if (keeper_restart_read(keeper, &data))
+	{
+		log_info("Restarting from the Postgres setup found when the "
+				 "pg_autoctl service stopped %" PRIu64 "s ago",
+				 (uint64_t) time(NULL) - data.stopTime);
+
+		config->pgSetup = data.pgSetup;
+		keeper->warmRestart = true;
+
+		return true;
+	}
+
+	return keeper_config_pgsetup_init(config,
+									  missing_pgdata_is_ok,
+									  pg_is_not_running_is_ok);
+}
+
+
+/*
+ * keeper_restart_save leaves the Postgres setup that we use for the next
+ * keeper service, when our configuration didn't change since we read it.
+ * Failing to do so only means the next service discovers it again.
+ */
+void
+keeper_restart_save(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperRestartData data = { 0 };
+	FileFingerprint configFile = keeper->configFileFingerprint;
+	char filename[MAXPGPATH];
+	int fd;
+
+	path_in_same_directory(config->pathnames.state,
+						   KEEPER_RESTART_FILENAME, filename);
+
+	if (!configFile.exists ||
+		file_has_changed(config->pathnames.config, &configFile))
+	{
+		log_debug("Configuration changed since we started, "
+				  "not saving \"%s\"", filename);
+		return;
+	}
+
+	data.version = KEEPER_RESTART_VERSION;
+	data.stopTime = time(NULL);
+	data.configFile = configFile;
+	(void) file_has_changed(config->pathnames.state, &(data.stateFile));
+	data.options = keeper->pgSetupOptions;
+	data.pgSetup = config->pgSetup;
+	data.crc = keeper_restart_crc(&data);
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+	{
+		log_warn("Failed to open \"%s\": %s", filename, strerror(errno));
+		return;
+	}
+
+	if (write(fd, &data, sizeof(KeeperRestartData)) != sizeof(KeeperRestartData))
+	{
+		log_warn("Failed to write \"%s\": %s", filename, strerror(errno));
+		close(fd);
+		(void) unlink(filename);
+		return;
+	}
+
+	close(fd);
+
+	log_debug("Saved the Postgres setup for the next service in \"%s\"",
+			  filename);
+}
+
+
+/*
+ * keeper_restart_crc computes the CRC of a KeeperRestartData.
+ */
+static pg_crc32c
+keeper_restart_crc(KeeperRestartData *data)
+{
+	pg_crc32c crc;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, (char *) data, offsetof(KeeperRestartData, crc));
+	FIN_CRC32C(crc);
+
+	return crc;
+}
+
+
+/*
+ * keeper_restart_read reads the file that the previous keeper service left,
+ * and returns whether we can trust it. The file is used at most once: we
+ * remove it as soon as we read it.
+ */
+static bool
+keeper_restart_read(Keeper *keeper, KeeperRestartData *data)
+{
+	KeeperConfig *config = &(keeper->config);
+	char filename[MAXPGPATH];
+	uint64_t now = time(NULL);
+	int fd;
+	ssize_t bytes;
+
+	path_in_same_directory(config->pathnames.state,
+						   KEEPER_RESTART_FILENAME, filename);
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		/* no file is fine, that's a cold start */
+		return false;
+	}
+
+	bytes = read(fd, data, sizeof(KeeperRestartData));
+
+	close(fd);
+	(void) unlink(filename);
+
+	if (bytes != sizeof(KeeperRestartData) ||
+		data->version != KEEPER_RESTART_VERSION ||
+		!EQ_CRC32C(data->crc, keeper_restart_crc(data)))
+	{
+		log_debug("Skipping invalid restart file \"%s\"", filename);
+		return false;
+	}
+
+	if (now < data->stopTime ||
+		now - data->stopTime > PG_AUTOCTL_KEEPER_WARM_RESTART_TIMEOUT)
+	{
+		log_debug("Skipping restart file \"%s\" from %" PRIu64 "s ago",
+				  filename, now - data->stopTime);
+		return false;
+	}
+
+	if (file_has_changed(config->pathnames.config, &(data->configFile)) ||
+		file_has_changed(config->pathnames.state, &(data->stateFile)))
+	{
+		log_debug("Skipping restart file \"%s\": the configuration or the "
+				  "state changed since it was written", filename);
+		return false;
+	}
+
+	/* the command line options might have changed too */
+	if (!keeper_restart_same_options(&(data->options),
+									 &(keeper->pgSetupOptions)))
+	{
+		log_debug("Skipping restart file \"%s\": the Postgres options "
+				  "changed since it was written", filename);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_restart_same_options returns whether pg_setup_init would start from
+ * the same values with the given options.
+ */
+static bool
+keeper_restart_same_options(PostgresSetup *a, PostgresSetup *b)
+{
+	return strcmp(a->pgdata, b->pgdata) == 0
+		   && strcmp(a->pg_ctl, b->pg_ctl) == 0
+		   && strcmp(a->username, b->username) == 0
+		   && strcmp(a->dbname, b->dbname) == 0
+		   && strcmp(a->pghost, b->pghost) == 0
+		   && a->pgport == b->pgport
+		   && strcmp(a->listen_addresses, b->listen_addresses) == 0
+		   && a->proxyport == b->proxyport
+		   && strcmp(a->authMethod, b->authMethod) == 0
+		   && a->pgKind == b->pgKind;
+}
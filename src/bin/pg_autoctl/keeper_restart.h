@@ -0,0 +1,23 @@
+/*
+ * src/bin/pg_autoctl/keeper_restart.h
+ *     Warm restart of the keeper service, from what it knew when it stopped.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef KEEPER_RESTART_H
+#define KEEPER_RESTART_H
+
+#include <stdbool.h>
+
+#include "keeper.h"
+#include "keeper_config.h"
+
+bool keeper_restart_read_config(Keeper *keeper,
+								bool missing_pgdata_is_ok,
+								bool pg_is_not_running_is_ok);
+void keeper_restart_save(Keeper *keeper);
+
+#endif /* KEEPER_RESTART_H */
@@ -0,0 +1,495 @@
+/*
+ * src/bin/pg_autoctl/liveness.c
+ *   Liveness heartbeats in between the keepers of a group, over UDP.
+ *
+ * A primary that can't reach the monitor keeps running as long as it has a
+ * standby, and it used to know that only from pg_stat_replication, which
+ * reacts at the pace of the Postgres replication timeouts. When the
+ * liveness port is set, the keepers of a group also ping each other over
+ * UDP, a few times per second, at the address of the other node that the
+ * monitor gives us.
+ *
+ * Only the answer to one of our recent pings counts as a contact with the
+ * other node, and only when the other node reports that it's a standby that
+ * streams from us: once the monitor starts promoting it, or another standby
+ * that it then follows, its keeper is still alive yet we must stop counting
+ * on it, so that we demote in time.
+ *
+ * A thread of its own sends the pings and answers the other node, so that
+ * the service loop can block on the monitor without us missing a ping.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "portability/instr_time.h"
+
+#include "liveness.h"
+#include "log.h"
+#include "state.h"
+
+
+/* what the service loop tells us, and what we tell it */
+static struct
+{
+	pthread_mutex_t mutex;
+
+	char formation[NAMEDATALEN];
+	int groupId;
+	int nodeId;
+	NodeState role;
+
+	/* our address, and the address of the node that we stream from */
+	char host[_POSIX_HOST_NAME_MAX];
+	int port;
+	char upstreamHost[_POSIX_HOST_NAME_MAX];
+	int upstreamPort;
+
+	char peerHost[_POSIX_HOST_NAME_MAX];
+	bool peerChanged;
+
+	/* time(NULL) at the last answer of our standby to one of our pings */
+	uint64_t lastPeerContact;
+} L = { PTHREAD_MUTEX_INITIALIZER };
+
+static struct
+{
+	int fd;
+	int family;
+	int port;
+	int intervalMs;
+	pthread_t thread;
+	volatile bool running;
+} S = { -1 };
+
+/* only used from the liveness thread */
+static struct
+{
+	bool resolved;
+	struct sockaddr_storage address;
+	socklen_t addressLength;
+
+	uint64_t nonces[LIVENESS_NONCES];
+	int nextNonce;
+} P;
+
+static void * liveness_main(void *arg);
+static void liveness_resolve_peer(void);
+static void liveness_send_ping(void);
+static void liveness_handle_message(const char *message,
+									struct sockaddr *from, socklen_t fromLength);
+
+
+/*
+ * liveness_start binds our UDP socket on the given port, on all of our
+ * addresses, and starts the thread that pings the other node.
+ */
+bool
+liveness_start(int port, int intervalMs)
+{
+	struct sockaddr_storage address = { 0 };
+	socklen_t addressLength = 0;
+	sigset_t allSignals;
+	sigset_t oldSignals;
+	int disable = 0;
+	int error = 0;
+
+	if (S.running)
+	{
+		return true;
+	}
+
+	/* one socket for both IPv6 and IPv4 peers, unless there's no IPv6 */
+	S.fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	if (S.fd >= 0)
+	{
+		struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &address;
+
+		(void) setsockopt(S.fd, IPPROTO_IPV6, IPV6_V6ONLY,
+						  &disable, sizeof(disable));
+
+		in6->sin6_family = AF_INET6;
+		in6->sin6_addr = in6addr_any;
+		in6->sin6_port = htons(port);
+		addressLength = sizeof(struct sockaddr_in6);
+
+		S.family = AF_INET6;
+	}
+	else
+	{
+		struct sockaddr_in *in4 = (struct sockaddr_in *) &address;
+
+		S.fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+		in4->sin_family = AF_INET;
+		in4->sin_addr.s_addr = htonl(INADDR_ANY);
+		in4->sin_port = htons(port);
+		addressLength = sizeof(struct sockaddr_in);
+
+		S.family = AF_INET;
+	}
+
+	if (S.fd < 0)
+	{
+		log_error("Failed to create the liveness socket: %s", strerror(errno));
+		return false;
+	}
+
+	if (bind(S.fd, (struct sockaddr *) &address, addressLength) != 0)
+	{
+		log_error("Failed to bind the liveness socket on port %d: %s",
+				  port, strerror(errno));
+		close(S.fd);
+		S.fd = -1;
+		return false;
+	}
+
+	S.port = port;
+	S.intervalMs = intervalMs;
+	S.running = true;
+
+	/* signals are for the service loop, the liveness thread ignores them */
+	sigfillset(&allSignals);
+	pthread_sigmask(SIG_BLOCK, &allSignals, &oldSignals);
+
+	error = pthread_create(&S.thread, NULL, liveness_main, NULL);
+
+	pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+	if (error != 0)
+	{
+		log_error("Failed to start the liveness thread: %s", strerror(error));
+		S.running = false;
+		close(S.fd);
+		S.fd = -1;
+		return false;
+	}
+
+	log_info("Exchanging liveness heartbeats with the other node on "
+			 "UDP port %d, every %dms", port, intervalMs);
+
+	return true;
+}
+
+
+/*
+ * liveness_stop stops the liveness thread and closes our socket.
+ */
+void
+liveness_stop(void)
+{
+	if (!S.running)
+	{
+		return;
+	}
+
+	S.running = false;
+	pthread_join(S.thread, NULL);
+
+	close(S.fd);
+	S.fd = -1;
+}
+
+
+/*
+ * liveness_set_local sets who we are, as sent in our pings and answers.
+ */
+void
+liveness_set_local(const char *formation, int groupId, int nodeId,
+				   NodeState role)
+{
+	pthread_mutex_lock(&L.mutex);
+
+	strlcpy(L.formation, formation, NAMEDATALEN);
+	L.groupId = groupId;
+	L.nodeId = nodeId;
+	L.role = role;
+
+	pthread_mutex_unlock(&L.mutex);
+}
+
+
+/*
+ * liveness_set_replication sets our own address, as the monitor knows it, and
+ * the address of the node that we stream from, or an empty upstreamHost when
+ * we don't know it. Our answers tell the other node which node we stream
+ * from.
+ */
+void
+liveness_set_replication(const char *host, int port,
+						 const char *upstreamHost, int upstreamPort)
+{
+	pthread_mutex_lock(&L.mutex);
+
+	strlcpy(L.host, host, _POSIX_HOST_NAME_MAX);
+	L.port = port;
+	strlcpy(L.upstreamHost, upstreamHost, _POSIX_HOST_NAME_MAX);
+	L.upstreamPort = upstreamPort;
+
+	pthread_mutex_unlock(&L.mutex);
+}
+
+
+/*
+ * liveness_set_peer sets the host of the other node of our group, as the
+ * monitor knows it. We keep pinging the last known host when the monitor
+ * can't be reached, that's when we need it the most.
+ */
+void
+liveness_set_peer(const char *host)
+{
+	pthread_mutex_lock(&L.mutex);
+
+	if (strcmp(L.peerHost, host) != 0)
+	{
+		strlcpy(L.peerHost, host, _POSIX_HOST_NAME_MAX);
+		L.peerChanged = true;
+	}
+
+	pthread_mutex_unlock(&L.mutex);
+}
+
+
+/*
+ * liveness_last_peer_contact returns the time of the last answer of a
+ * standby to one of our pings, or zero when we never had one.
+ */
+uint64_t
+liveness_last_peer_contact(void)
+{
+	uint64_t lastPeerContact = 0;
+
+	pthread_mutex_lock(&L.mutex);
+	lastPeerContact = L.lastPeerContact;
+	pthread_mutex_unlock(&L.mutex);
+
+	return lastPeerContact;
+}
+
+
+/*
+ * liveness_main is the main loop of the liveness thread: we answer the pings
+ * of the other node as they arrive, and ping it every intervalMs.
+ */
+static void *
+liveness_main(void *arg)
+{
+	instr_time lastPing;
+
+	INSTR_TIME_SET_ZERO(lastPing);
+
+	while (S.running)
+	{
+		struct pollfd pfd = { S.fd, POLLIN, 0 };
+		instr_time elapsed;
+		int waitMs = 0;
+
+		if (INSTR_TIME_IS_ZERO(lastPing))
+		{
+			waitMs = 0;
+		}
+		else
+		{
+			INSTR_TIME_SET_CURRENT(elapsed);
+			INSTR_TIME_SUBTRACT(elapsed, lastPing);
+
+			waitMs = S.intervalMs - (int) INSTR_TIME_GET_MILLISEC(elapsed);
+		}
+
+		if (waitMs > 0 && poll(&pfd, 1, waitMs) > 0)
+		{
+			char message[LIVENESS_MESSAGE_MAXLEN] = { 0 };
+			struct sockaddr_storage from;
+			socklen_t fromLength = sizeof(from);
+			ssize_t length = recvfrom(S.fd, message, sizeof(message) - 1, 0,
+									  (struct sockaddr *) &from, &fromLength);
+
+			if (length > 0)
+			{
+				message[length] = '\0';
+
+				(void) liveness_handle_message(message,
+											   (struct sockaddr *) &from,
+											   fromLength);
+			}
+			continue;
+		}
+
+		INSTR_TIME_SET_CURRENT(lastPing);
+
+		(void) liveness_resolve_peer();
+		(void) liveness_send_ping();
+	}
+
+	return NULL;
+}
+
+
+/*
+ * liveness_resolve_peer resolves the host of the other node when it changed,
+ * or when we failed to resolve it before. The same liveness port is used on
+ * all the nodes of a group.
+ */
+static void
+liveness_resolve_peer(void)
+{
+	struct addrinfo hints = { 0 };
+	struct addrinfo *addresses = NULL;
+	char host[_POSIX_HOST_NAME_MAX];
+	char service[NI_MAXSERV];
+	bool peerChanged = false;
+
+	pthread_mutex_lock(&L.mutex);
+	strlcpy(host, L.peerHost, _POSIX_HOST_NAME_MAX);
+	peerChanged = L.peerChanged;
+	L.peerChanged = false;
+	pthread_mutex_unlock(&L.mutex);
+
+	if (host[0] == '\0' || (P.resolved && !peerChanged))
+	{
+		return;
+	}
+
+	P.resolved = false;
+
+	/* IPv4 addresses are mapped into IPv6 ones for our IPv6 socket */
+	hints.ai_family = S.family;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = S.family == AF_INET6 ? AI_V4MAPPED : 0;
+
+	snprintf(service, sizeof(service), "%d", S.port);
+
+	if (getaddrinfo(host, service, &hints, &addresses) != 0)
+	{
+		return;
+	}
+
+	memcpy(&(P.address), addresses->ai_addr, addresses->ai_addrlen);
+	P.addressLength = addresses->ai_addrlen;
+	P.resolved = true;
+
+	freeaddrinfo(addresses);
+}
+
+
+/*
+ * liveness_send_ping sends a ping to the other node, with a new nonce that
+ * its answer has to repeat.
+ */
+static void
+liveness_send_ping(void)
+{
+	char message[LIVENESS_MESSAGE_MAXLEN];
+	uint64_t nonce = 0;
+	int length = 0;
+
+	if (!P.resolved)
+	{
+		return;
+	}
+
+	nonce = ((uint64_t) random() << 32) ^ (uint64_t) random();
+
+	P.nonces[P.nextNonce] = nonce;
+	P.nextNonce = (P.nextNonce + 1) % LIVENESS_NONCES;
+
+	pthread_mutex_lock(&L.mutex);
+	length = snprintf(message, sizeof(message), "PING %s %d %d %" PRIu64,
+					  L.formation, L.groupId, L.nodeId, nonce);
+	pthread_mutex_unlock(&L.mutex);
+
+	(void) sendto(S.fd, message, length, 0,
+				  (struct sockaddr *) &(P.address), P.addressLength);
+}
+
+
+/*
+ * liveness_handle_message answers the pings of the other nodes of our group,
+ * and records a contact with the other node when it answers one of our
+ * recent pings as a standby that streams from us. Anything else is ignored.
+ *
+ * With several standby nodes in the group, the monitor may promote another
+ * standby than the one we ping: ours then follows the new primary, and we
+ * must not count its answers anymore.
+ */
+static void
+liveness_handle_message(const char *message,
+						struct sockaddr *from, socklen_t fromLength)
+{
+	char kind[5] = { 0 };
+	char formation[NAMEDATALEN] = { 0 };
+	int groupId = -1;
+	int nodeId = -1;
+	uint64_t nonce = 0;
+	int role = NO_STATE;
+	char upstreamHost[_POSIX_HOST_NAME_MAX] = { 0 };
+	int upstreamPort = -1;
+	int fields = sscanf(message, "%4s %63s %d %d %" SCNu64 " %d %254s %d",
+						kind, formation, &groupId, &nodeId, &nonce, &role,
+						upstreamHost, &upstreamPort);
+	int i = 0;
+
+	if (fields < 5)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&L.mutex);
+
+	if (strcmp(formation, L.formation) != 0 ||
+		groupId != L.groupId || nodeId == L.nodeId)
+	{
+		pthread_mutex_unlock(&L.mutex);
+		return;
+	}
+
+	if (strcmp(kind, "PING") == 0)
+	{
+		char answer[LIVENESS_MESSAGE_MAXLEN];
+		int length = snprintf(answer, sizeof(answer),
+							  "PONG %s %d %d %" PRIu64 " %d %s %d",
+							  L.formation, L.groupId, L.nodeId, nonce,
+							  (int) L.role,
+							  L.upstreamHost[0] == '\0' ? "-" : L.upstreamHost,
+							  L.upstreamPort);
+
+		pthread_mutex_unlock(&L.mutex);
+
+		(void) sendto(S.fd, answer, length, 0, from, fromLength);
+		return;
+	}
+
+	if (strcmp(kind, "PONG") == 0 && fields == 8 &&
+		(role == SECONDARY_STATE || role == CATCHINGUP_STATE) &&
+		strcmp(upstreamHost, L.host) == 0 && upstreamPort == L.port)
+	{
+		for (i = 0; i < LIVENESS_NONCES; i++)
+		{
+			if (P.nonces[i] != 0 && P.nonces[i] == nonce)
+			{
+				L.lastPeerContact = time(NULL);
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&L.mutex);
+}
@@ -0,0 +1,33 @@
+/*
+ * src/bin/pg_autoctl/liveness.h
+ *   Liveness heartbeats in between the keepers of a group, over UDP.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef LIVENESS_H
+#define LIVENESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "state.h"
+
+/* a datagram that doesn't fit in there is ignored */
+#define LIVENESS_MESSAGE_MAXLEN 1024
+
+/* how many of our recent pings may still be answered */
+#define LIVENESS_NONCES 8
+
+bool liveness_start(int port, int intervalMs);
+void liveness_stop(void);
+void liveness_set_local(const char *formation, int groupId, int nodeId,
+						NodeState role);
+void liveness_set_replication(const char *host, int port,
+							  const char *upstreamHost, int upstreamPort);
+void liveness_set_peer(const char *host);
+uint64_t liveness_last_peer_contact(void);
+
+#endif /* LIVENESS_H */
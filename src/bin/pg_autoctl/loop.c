@@ -11,6 +11,7 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -19,8 +20,12 @@
 #include "keeper.h"
 #include "keeper_config.h"
 #include "keeper_pg_init.h"
+#include "keeper_restart.h"
+#include "liveness.h"
 #include "log.h"
+#include "metrics.h"
 #include "monitor.h"
+#include "parsing.h"
 #include "pgctl.h"
 #include "state.h"
 #include "signals.h"
@@ -32,6 +37,19 @@ static bool is_network_healthy(Keeper *keeper);
 static bool in_network_partition(KeeperStateData *keeperState, uint64_t now,
 								 int networkPartitionTimeout);
 static void reload_configuration(Keeper *keeper);
+static void keeper_service_init_loop(KeeperService *service, Keeper *keeper,
+									 pid_t pid);
+static bool keeper_service_prepare(KeeperService *service, uint64_t now);
+static void keeper_service_quit(KeeperService *service);
+static bool keeper_service_apply(KeeperService *service, uint64_t now,
+								 bool couldContactMonitor,
+								 MonitorAssignedState *assignedState);
+static void keeper_service_update_metrics(Keeper *keeper);
+static void keeper_service_publish_status(KeeperService *service,
+										  double loopSeconds,
+										  double nodeActiveSeconds);
+static void keeper_service_close_status(KeeperService *service);
+static int keeper_heartbeat_interval(KeeperConfig *config);
 
 /* pid file creation and reading */
 static bool create_pidfile(const char *pidfile, pid_t pid);
@@ -51,19 +69,31 @@ keeper_service_run(Keeper *keeper, pid_t *start_pid)
 	KeeperStateData *keeperState = &(keeper->state);
 	Monitor *monitor = &(keeper->monitor);
 	LocalPostgresServer *postgres = &(keeper->postgres);
+	KeeperService service = { 0 };
 	bool doSleep = false;
 	bool couldContactMonitor = false;
-	pid_t pid = *start_pid, checkpid = 0;
+	int retryAfterMs = 0;
 
 	log_info("pg_autoctl service is starting");
 
+	/* spread the heartbeats of keepers that started at the same time */
+	srandom((unsigned int) (getpid() ^ time(NULL)));
+
+	/* heartbeats are cheaper on a connection that we keep open */
+	monitor->pgsql.keepConnection = true;
+	monitor->pgsql.connectTimeoutMs = PG_AUTOCTL_MONITOR_CONNECT_TIMEOUT_MS;
+
+	(void) keeper_service_init_loop(&service, keeper, *start_pid);
+
 	while (keepRunning)
 	{
 		MonitorAssignedState assignedState = { 0 };
-		bool needStateChange = false;
-		bool transitionFailed = false;
-		bool reportPgIsRunning = false;
+		int waitTimeMs = 0;
 		uint64_t now = time(NULL);
+		instr_time loopStartTime;
+		instr_time nodeActiveStartTime;
+		instr_time loopDuration;
+		double nodeActiveSeconds = 0;
 
 		/*
 		 * Handle signals.
@@ -76,7 +106,11 @@ keeper_service_run(Keeper *keeper, pid_t *start_pid)
 		 * signaled to us and from where we can immediately exit whatever we're
 		 * doing. It's important to avoid e.g. leaving state.new files behind.
 		 */
-		if (asked_to_reload)
+		(void) log_received_signals();
+
+		if (asked_to_reload ||
+			file_has_changed(config->pathnames.config,
+							 &(service.configFileFingerprint)))
 		{
 			(void) reload_configuration(keeper);
 		}
@@ -86,183 +120,426 @@ keeper_service_run(Keeper *keeper, pid_t *start_pid)
 			break;
 		}
 
-		if (doSleep)
-		{
-			sleep(PG_AUTOCTL_KEEPER_SLEEP_TIME);
-		}
-
-		doSleep = true;
-
 		/*
-		 * Before loading the current state from disk, make sure it's still our
-		 * state file. It might happen that the PID file got removed from disk,
-		 * then allowing another keeper to run.
-		 *
-		 * We should then quit in an emergency if our PID file either doesn't
-		 * exist anymore, or has been overwritten with another PID, so that we
-		 * don't enter a keeper state file war in between several services.
+		 * When the monitor is reachable, we wait for our next goal state in
+		 * the node_active call itself, see below. Otherwise sleep a little
+		 * before trying again, or for as long as the monitor asked us to when
+		 * it was too busy to run the state machine for us. Both waits end as
+		 * soon as we receive a signal.
 		 */
-		if (read_pidfile(config->pathnames.pid, &checkpid))
+		if (doSleep && (!couldContactMonitor || retryAfterMs > 0))
 		{
-			if (checkpid != pid)
+			(void) wait_for_signal(-1,
+								   retryAfterMs > 0
+								   ? retryAfterMs
+								   : keeper_heartbeat_interval(config));
+
+			if (asked_to_reload)
 			{
-				log_fatal("Our PID file \"%s\" now contains PID %d, "
-						  "instead of expected pid %d. Quitting.",
-						  config->pathnames.pid, checkpid, pid);
+				(void) reload_configuration(keeper);
+			}
 
-				exit(EXIT_CODE_QUIT);
+			if (asked_to_stop || asked_to_stop_fast)
+			{
+				break;
 			}
 		}
-		else
+		else if (doSleep)
 		{
-			/*
-			 * Surrendering seems the less risky option for us now.
-			 *
-			 * Any other strategy would need to be careful about race
-			 * conditions happening when several processes (keeper or others) are
-			 * trying to create or remove the pidfile at the same time, possibly in
-			 * different orders. Yeah, let's quit.
-			 */
-			log_fatal("Our PID file disappeared from \"%s\", quitting.",
-					  config->pathnames.pid);
-			exit(EXIT_CODE_QUIT);
+			waitTimeMs = keeper_heartbeat_interval(config);
 		}
 
-		CHECK_FOR_FAST_SHUTDOWN;
+		doSleep = true;
+		retryAfterMs = 0;
 
-		/*
-		 * Read the current state. While we could preserve the state in memory,
-		 * re-reading the file simplifies recovery from failures. For example,
-		 * if we fail to write the state file after making a transition, then
-		 * we should not tell the monitor that the transition succeeded, because
-		 * a subsequent crash of the keeper would cause the states to become
-		 * inconsistent. By re-reading the file, we make sure the state on disk
-		 * on the keeper is consistent with the state on the monitor
-		 */
-		if (!keeper_load_state(keeper))
+		/* we only know that we reached the monitor once we called it */
+		couldContactMonitor = false;
+
+		INSTR_TIME_SET_CURRENT(loopStartTime);
+
+		if (!keeper_service_prepare(&service, now))
 		{
-			log_error("Failed to read keeper state file, retrying...");
+			double loopSeconds =
+				metrics_observe(METRIC_LOOP, loopStartTime, false);
+
+			(void) keeper_service_publish_status(&service, loopSeconds, 0);
+
 			CHECK_FOR_FAST_SHUTDOWN;
 			continue;
 		}
 
+		(void) keeper_service_update_metrics(keeper);
+
 		/*
-		 * Check for any changes in the local PostgreSQL instance, and update
-		 * our in-memory values for the replication WAL lag and sync_state.
+		 * Report the current state to the monitor and get the assigned state.
+		 *
+		 * When the monitor has nothing new for us, we then wait until it
+		 * notifies us of a new goal state, or for PG_AUTOCTL_KEEPER_SLEEP_TIME
+		 * at most. That's how we learn about a new goal state as soon as the
+		 * monitor decides it.
 		 */
-		keeper_update_pg_state(keeper);
+		INSTR_TIME_SET_CURRENT(nodeActiveStartTime);
 
-		CHECK_FOR_FAST_SHUTDOWN;
+		couldContactMonitor =
+			monitor_node_active_wait(monitor,
+									 config->formation,
+									 config->nodename,
+									 config->pgSetup.pgport,
+									 keeperState->current_node_id,
+									 keeperState->current_group,
+									 keeperState->current_role,
+									 service.reportPgIsRunning,
+									 postgres->currentLSN,
+									 postgres->pgsrSyncState,
+									 waitTimeMs,
+									 &assignedState);
+
+		nodeActiveSeconds = metrics_observe(METRIC_NODE_ACTIVE,
+											nodeActiveStartTime,
+											couldContactMonitor);
+
+		if (couldContactMonitor)
+		{
+			retryAfterMs = monitor->pgsql.retryAfterMs;
+		}
+
+		if (!couldContactMonitor && (asked_to_stop || asked_to_stop_fast))
+		{
+			/* we canceled the call to the monitor to stop now */
+			break;
+		}
+
+		if (keeper_service_apply(&service, now,
+								 couldContactMonitor, &assignedState))
+		{
+			/* cycle faster if we made a state transition */
+			doSleep = false;
+		}
+
+		/* the loop duration doesn't count the time we waited for the monitor */
+		INSTR_TIME_SET_CURRENT(loopDuration);
+		INSTR_TIME_SUBTRACT(loopDuration, loopStartTime);
+
+		(void) metrics_observe_seconds(METRIC_LOOP,
+									   INSTR_TIME_GET_DOUBLE(loopDuration)
+									   - nodeActiveSeconds,
+									   couldContactMonitor);
+
+		(void) keeper_service_publish_status(&service,
+											 INSTR_TIME_GET_DOUBLE(loopDuration)
+											 - nodeActiveSeconds,
+											 nodeActiveSeconds);
+
+		if (asked_to_stop || asked_to_stop_fast)
+		{
+			keepRunning = false;
+		}
+	}
 
-		reportPgIsRunning = ReportPgIsRunning(keeper);
-
-		/* a single line of logs every 5s whatever happens is nice to have */
-		log_info("Calling node_active for node %s/%d/%d with current state: "
-				 "%s, "
-				 "PostgreSQL %s running, "
-				 "sync_state is \"%s\", "
-				 "current lsn is \"%s\".",
-				 config->formation,
-				 keeperState->current_node_id,
-				 keeperState->current_group,
-				 NodeStateToString(keeperState->current_role),
-				 reportPgIsRunning ? "is" : "is not",
-				 postgres->pgsrSyncState,
-				 postgres->currentLSN);
+	(void) log_received_signals();
+	log_info("pg_autoctl service stopping");
+
+	pgsql_finish(&(monitor->pgsql));
+
+	/* the next service can start from what we know */
+	(void) keeper_restart_save(keeper);
+	(void) keeper_service_close_status(&service);
+
+	if (!remove_pidfile(config->pathnames.pid))
+	{
+		log_error("Failed to remove pidfile \"%s\"", config->pathnames.pid);
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_supervisor_run runs the service loop of several keepers in a single
+ * process, one keeper per local Postgres instance. The keepers share the
+ * signal handling, the log stream, and one connection to the monitor: at each
+ * loop we report the state of all the nodes in a single node_active_batch
+ * call, then each keeper reaches its assigned state in turn.
+ *
+ * When the monitor fails to answer the node_active_batch call, we report the
+ * state of each node in its own node_active call instead. A keeper that
+ * loses its PID file stops, and the other keepers keep running.
+ *
+ * All the keepers must use the same monitor, and the function
+ * keeper_service_init() must have been called for each of them.
+ */
+bool
+keeper_supervisor_run(Keeper *keepers, pid_t *pids, int keeperCount)
+{
+	Monitor monitor = { 0 };
+	KeeperService *services = NULL;
+	MonitorNodeReport *reports = NULL;
+	int *reportedServices = NULL;
+	bool doSleep = false;
+	bool allStopped = false;
+	int index = 0;
+
+	services = (KeeperService *) calloc(keeperCount, sizeof(KeeperService));
+	reports = (MonitorNodeReport *) calloc(keeperCount,
+										   sizeof(MonitorNodeReport));
+	reportedServices = (int *) calloc(keeperCount, sizeof(int));
+
+	if (services == NULL || reports == NULL || reportedServices == NULL)
+	{
+		log_error("Failed to allocate memory for %d keepers", keeperCount);
+		free(services);
+		free(reports);
+		free(reportedServices);
+		return false;
+	}
+
+	log_info("pg_autoctl service is starting for %d Postgres instances",
+			 keeperCount);
+
+	/* spread the heartbeats of keepers that started at the same time */
+	srandom((unsigned int) (getpid() ^ time(NULL)));
+
+	for (index = 0; index < keeperCount; index++)
+	{
+		(void) keeper_service_init_loop(&(services[index]),
+										&(keepers[index]),
+										pids[index]);
+		services[index].supervised = true;
+	}
+
+	/* the monitor connection is shared in between all our keepers */
+	if (monitor_init(&monitor, keepers[0].config.monitor_pguri))
+	{
+		monitor.pgsql.keepConnection = true;
+		monitor.pgsql.connectTimeoutMs = PG_AUTOCTL_MONITOR_CONNECT_TIMEOUT_MS;
+		monitor.pgsql.keepalives = keepers[0].config.keepalives;
+	}
+
+	while (keepRunning)
+	{
+		bool reload = false;
+		bool couldContactMonitor = false;
+		bool madeTransition = false;
+		int reportCount = 0;
+		int runningCount = 0;
+		uint64_t now = 0;
+		instr_time batchStartTime;
+		instr_time batchDuration;
+
+		(void) log_received_signals();
+		reload = asked_to_reload;
+
+		for (index = 0; index < keeperCount; index++)
+		{
+			KeeperService *service = &(services[index]);
+			KeeperConfig *config = &(service->keeper->config);
+
+			if (service->stopped)
+			{
+				continue;
+			}
+
+			if (reload ||
+				file_has_changed(config->pathnames.config,
+								 &(service->configFileFingerprint)))
+			{
+				(void) reload_configuration(service->keeper);
+			}
+		}
+
+		if (asked_to_stop)
+		{
+			break;
+		}
 
 		/*
-		 * Report the current state to the monitor and get the assigned state.
+		 * A node_active_batch call doesn't wait for new goal states, so we
+		 * always sleep in between two calls, unless one of our keepers just
+		 * made a state transition.
 		 */
-		couldContactMonitor =
-			monitor_node_active(monitor,
-								config->formation,
-								config->nodename,
-								config->pgSetup.pgport,
-								keeperState->current_node_id,
-								keeperState->current_group,
-								keeperState->current_role,
-								reportPgIsRunning,
-								postgres->currentLSN,
-								postgres->pgsrSyncState,
-								&assignedState);
+		if (doSleep)
+		{
+			int waitTimeMs = keeper_heartbeat_interval(&(keepers[0].config));
 
-		if (couldContactMonitor)
+			for (index = 1; index < keeperCount; index++)
+			{
+				int interval = keeper_heartbeat_interval(&(keepers[index].config));
+
+				waitTimeMs = interval < waitTimeMs ? interval : waitTimeMs;
+			}
+
+			/* the monitor may have asked us to call again sooner */
+			if (monitor.pgsql.retryAfterMs > 0 &&
+				monitor.pgsql.retryAfterMs < waitTimeMs)
+			{
+				waitTimeMs = monitor.pgsql.retryAfterMs;
+			}
+
+			(void) wait_for_signal(-1, waitTimeMs);
+
+			if (asked_to_stop || asked_to_stop_fast)
+			{
+				break;
+			}
+
+			if (asked_to_reload)
+			{
+				/* reload the configuration files first */
+				doSleep = false;
+				continue;
+			}
+		}
+
+		doSleep = true;
+
+		/* use the new monitor URI from now on, if it changed */
+		if (strcmp(monitor.pgsql.connectionString,
+				   keepers[0].config.monitor_pguri) != 0)
 		{
-			keeperState->last_monitor_contact = now;
-			keeperState->assigned_role = assignedState.state;
+			pgsql_finish(&(monitor.pgsql));
+
+			if (monitor_init(&monitor, keepers[0].config.monitor_pguri))
+			{
+				monitor.pgsql.keepConnection = true;
+				monitor.pgsql.connectTimeoutMs =
+					PG_AUTOCTL_MONITOR_CONNECT_TIMEOUT_MS;
+			}
 		}
-		else
+
+		monitor.pgsql.keepalives = keepers[0].config.keepalives;
+
+		now = time(NULL);
+
+		for (index = 0; index < keeperCount; index++)
 		{
-			log_error("Failed to get the goal state from the monitor");
+			KeeperService *service = &(services[index]);
+			Keeper *keeper = service->keeper;
+			MonitorNodeReport *report = &(reports[reportCount]);
 
-			/*
-			 * Check whether we're likely to be in a network partition.
-			 * That will cause the assigned_role to become demoted.
-			 */
-			if (keeperState->current_role == PRIMARY_STATE)
+			if (service->stopped)
 			{
-				log_warn("Checking for network partitions...");
+				continue;
+			}
 
-				if (!is_network_healthy(keeper))
+			if (!keeper_service_prepare(service, now))
+			{
+				if (!service->stopped)
 				{
-					keeperState->assigned_role = DEMOTE_TIMEOUT_STATE;
+					++runningCount;
 				}
+
+				CHECK_FOR_FAST_SHUTDOWN;
+				continue;
 			}
+
+			++runningCount;
+
+			report->formation = keeper->config.formation;
+			report->host = keeper->config.nodename;
+			report->port = keeper->config.pgSetup.pgport;
+			report->nodeId = keeper->state.current_node_id;
+			report->groupId = keeper->state.current_group;
+			report->currentState = keeper->state.current_role;
+			report->pgIsRunning = service->reportPgIsRunning;
+			report->currentLSN = keeper->postgres.currentLSN;
+			report->pgsrSyncState = keeper->postgres.pgsrSyncState;
+
+			reportedServices[reportCount++] = index;
 		}
 
 		CHECK_FOR_FAST_SHUTDOWN;
 
+		if (runningCount == 0)
+		{
+			log_fatal("All the keepers of this service stopped, quitting.");
+			allStopped = true;
+			break;
+		}
+
+		if (reportCount == 0)
+		{
+			continue;
+		}
+
+		INSTR_TIME_SET_CURRENT(batchStartTime);
+
+		couldContactMonitor =
+			monitor_node_active_batch(&monitor, reports, reportCount);
+
 		/*
-		 * If we see that PostgreSQL is not running when we know it should be,
-		 * the least we can do is start PostgreSQL again. Same if PostgreSQL is
-		 * running and we are DEMOTED, or in another one of those states where
-		 * the monitor asked us to stop serving queries, in order to ensure
-		 * consistency.
-		 *
-		 * Only enfore current state when we have a recent enough version of
-		 * it, meaning that we could contact the monitor.
-		 *
-		 * We need to prevent the keeper from restarting PostgreSQL at boot
-		 * time when meanwhile the Monitor did set our goal_state to DEMOTED
-		 * because the other node has been promoted, which could happen if this
-		 * node was rebooting for a long enough time.
+		 * When the batch failed, try again one node at a time, so that a
+		 * monitor that can't run the batch still hears from our nodes.
 		 */
-		if (couldContactMonitor)
+		if (!couldContactMonitor && !asked_to_stop && !asked_to_stop_fast)
 		{
-			if (!keeper_ensure_current_state(keeper))
+			log_warn("Reporting the state of each of our %d nodes "
+					 "to the monitor in its own node_active call",
+					 reportCount);
+
+			for (index = 0; index < reportCount; index++)
 			{
-				log_warn("pg_autoctl failed to ensure current state \"%s\": "
-						 "PostgreSQL %s running",
-						 NodeStateToString(keeperState->current_role),
-						 postgres->pgIsRunning ? "is" : "is not");
+				MonitorNodeReport *report = &(reports[index]);
+
+				report->assigned =
+					monitor_node_active(&monitor,
+										report->formation,
+										report->host,
+										report->port,
+										report->nodeId,
+										report->groupId,
+										report->currentState,
+										report->pgIsRunning,
+										report->currentLSN,
+										report->pgsrSyncState,
+										&(report->assignedState));
+
+				if (report->assigned)
+				{
+					couldContactMonitor = true;
+				}
+
+				CHECK_FOR_FAST_SHUTDOWN;
 			}
 		}
 
+		INSTR_TIME_SET_CURRENT(batchDuration);
+		INSTR_TIME_SUBTRACT(batchDuration, batchStartTime);
+
 		CHECK_FOR_FAST_SHUTDOWN;
 
-		if (keeperState->assigned_role != keeperState->current_role)
+		for (index = 0; index < reportCount; index++)
 		{
-			needStateChange = true;
+			MonitorNodeReport *report = &(reports[index]);
+			KeeperService *service = &(services[reportedServices[index]]);
+			instr_time applyStartTime;
+			instr_time applyDuration;
 
-			if (!keeper_fsm_reach_assigned_state(keeper))
+			INSTR_TIME_SET_CURRENT(applyStartTime);
+
+			if (couldContactMonitor && !report->assigned)
 			{
-				log_error("Failed to transition to state \"%s\", retrying... ",
-						  NodeStateToString(keeperState->assigned_role));
+				log_warn("The monitor returned no goal state for node %s:%d",
+						 report->host, report->port);
+			}
 
-				transitionFailed = true;
+			if (keeper_service_apply(service, now,
+									 couldContactMonitor && report->assigned,
+									 &(report->assignedState)))
+			{
+				madeTransition = true;
 			}
-		}
 
-		/*
-		 * Even if a transition failed, we still write the state file to update
-		 * timestamps used for the network partition checks.
-		 */
-		if (!keeper_store_state(keeper))
-		{
-			transitionFailed = true;
+			INSTR_TIME_SET_CURRENT(applyDuration);
+			INSTR_TIME_SUBTRACT(applyDuration, applyStartTime);
+
+			(void) keeper_service_publish_status(service,
+												 INSTR_TIME_GET_DOUBLE(applyDuration),
+												 INSTR_TIME_GET_DOUBLE(batchDuration));
+
+			CHECK_FOR_FAST_SHUTDOWN;
 		}
 
-		if (needStateChange && !transitionFailed)
+		if (madeTransition)
 		{
 			/* cycle faster if we made a state transition */
 			doSleep = false;
@@ -274,17 +551,465 @@ keeper_service_run(Keeper *keeper, pid_t *start_pid)
 		}
 	}
 
+	(void) log_received_signals();
 	log_info("pg_autoctl service stopping");
 
-	if (!remove_pidfile(config->pathnames.pid))
+	pgsql_finish(&(monitor.pgsql));
+
+	for (index = 0; index < keeperCount; index++)
 	{
-		log_error("Failed to remove pidfile \"%s\"", config->pathnames.pid);
+		KeeperConfig *config = &(keepers[index].config);
+
+		/* the PID file and the state now belong to another process */
+		if (services[index].stopped)
+		{
+			continue;
+		}
+
+		(void) keeper_restart_save(&(keepers[index]));
+		(void) keeper_service_close_status(&(services[index]));
+
+		if (!remove_pidfile(config->pathnames.pid))
+		{
+			log_error("Failed to remove pidfile \"%s\"", config->pathnames.pid);
+		}
+	}
+
+	free(services);
+	free(reports);
+	free(reportedServices);
+
+	/* when all our keepers stopped, the process quits as a keeper would */
+	if (allStopped)
+	{
+		exit(EXIT_CODE_QUIT);
 	}
 
 	return true;
 }
 
 
+/*
+ * keeper_service_init_loop initialises the KeeperService that the service
+ * loop uses for the given keeper.
+ */
+static void
+keeper_service_init_loop(KeeperService *service, Keeper *keeper, pid_t pid)
+{
+	char filename[MAXPGPATH];
+
+	service->keeper = keeper;
+	service->pid = pid;
+	service->reloadState = true;
+	service->validateConfig = keeper->warmRestart;
+
+	/* we just read our configuration file, no need to reload it */
+	(void) file_has_changed(keeper->config.pathnames.config,
+							&(service->configFileFingerprint));
+
+	/* local readers get our status from there, see status_page.c */
+	path_in_same_directory(keeper->config.pathnames.pid,
+						   KEEPER_STATUS_FILENAME, filename);
+
+	service->statusPage = status_page_open(filename, pid);
+
+	if (service->statusPage == NULL)
+	{
+		log_warn("Running without publishing our status in \"%s\"",
+				 filename);
+	}
+}
+
+
+/*
+ * keeper_service_prepare gets a keeper ready to call the monitor: it checks
+ * our PID file, reads the current state when needed, and updates what we
+ * know about the local Postgres instance. It returns false when the keeper
+ * should skip calling the monitor in this loop.
+ */
+static bool
+keeper_service_prepare(KeeperService *service, uint64_t now)
+{
+	Keeper *keeper = service->keeper;
+	KeeperConfig *config = &(keeper->config);
+	KeeperStateData *keeperState = &(keeper->state);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	pid_t checkpid = 0;
+	char logId[BUFSIZE];
+	char logKey[BUFSIZE];
+	instr_time startTime;
+	bool updatedPgState = false;
+
+	/*
+	 * Before loading the current state from disk, make sure it's still our
+	 * state file. It might happen that the PID file got removed from disk,
+	 * then allowing another keeper to run.
+	 *
+	 * We should then quit in an emergency if our PID file either doesn't
+	 * exist anymore, or has been overwritten with another PID, so that we
+	 * don't enter a keeper state file war in between several services.
+	 *
+	 * We only read the PID file again when it changed on-disk.
+	 */
+	if (!file_has_changed(config->pathnames.pid,
+						  &(service->pidFileFingerprint)))
+	{
+		/* still the same PID file as in the previous loop */
+	}
+	else if (read_pidfile(config->pathnames.pid, &checkpid))
+	{
+		if (checkpid != service->pid)
+		{
+			log_fatal("Our PID file \"%s\" now contains PID %d, "
+					  "instead of expected pid %d.",
+					  config->pathnames.pid, checkpid, service->pid);
+
+			(void) keeper_service_quit(service);
+			return false;
+		}
+	}
+	else
+	{
+		/*
+		 * Surrendering seems the less risky option for us now.
+		 *
+		 * Any other strategy would need to be careful about race
+		 * conditions happening when several processes (keeper or others) are
+		 * trying to create or remove the pidfile at the same time, possibly in
+		 * different orders. Yeah, let's quit.
+		 */
+		log_fatal("Our PID file disappeared from \"%s\".",
+				  config->pathnames.pid);
+
+		(void) keeper_service_quit(service);
+		return false;
+	}
+
+	if (asked_to_stop_fast)
+	{
+		return false;
+	}
+
+	/*
+	 * Read the current state, when needed. We keep the state in memory
+	 * as long as what's on-disk is what we last read or wrote. When we
+	 * fail to write the state file, for instance after making a
+	 * transition, we read it again: we should not tell the monitor that
+	 * the transition succeeded, because a subsequent crash of the keeper
+	 * would cause the states to become inconsistent. By re-reading the
+	 * file, we make sure the state on disk on the keeper is consistent
+	 * with the state on the monitor.
+	 */
+	if (file_has_changed(config->pathnames.state,
+						 &(service->stateFileFingerprint))
+		|| service->reloadState)
+	{
+		if (!keeper_load_state(keeper))
+		{
+			log_error("Failed to read keeper state file, retrying...");
+			return false;
+		}
+
+		service->reloadState = false;
+	}
+
+	/*
+	 * Check for any changes in the local PostgreSQL instance, and update
+	 * our in-memory values for the replication WAL lag and sync_state.
+	 */
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	updatedPgState = keeper_update_pg_state(keeper);
+
+	(void) metrics_observe(METRIC_UPDATE_PG_STATE, startTime, updatedPgState);
+
+	/*
+	 * Keep track of our last contact with a standby at each loop, so that
+	 * is_network_healthy doesn't have to query for it when the monitor
+	 * can't be reached.
+	 */
+	if (postgres->replicationState.hasReplica)
+	{
+		keeperState->last_secondary_contact = now;
+	}
+
+	/* the standby keeper answering our liveness pings counts too */
+	if (config->liveness_port > 0)
+	{
+		uint64_t lastPeerContact = 0;
+		PostgresReplicationState *replicationState =
+			&(postgres->replicationState);
+
+		(void) liveness_set_local(config->formation,
+								  keeperState->current_group,
+								  keeperState->current_node_id,
+								  keeperState->current_role);
+
+		/* our standby still answers while Postgres restarts */
+		(void) liveness_set_replication(config->nodename,
+										config->pgSetup.pgport,
+										replicationState->upstreamHost,
+										replicationState->upstreamPort);
+
+		lastPeerContact = liveness_last_peer_contact();
+
+		if (lastPeerContact > keeperState->last_secondary_contact)
+		{
+			keeperState->last_secondary_contact = lastPeerContact;
+		}
+	}
+
+	if (asked_to_stop_fast)
+	{
+		return false;
+	}
+
+	service->reportPgIsRunning = ReportPgIsRunning(keeper);
+
+	/*
+	 * A single line of logs every 5s whatever happens is nice to have, but
+	 * it adds up to a lot of identical lines. We log it again only when the
+	 * state, sync_state or whether PostgreSQL is running changes, and
+	 * otherwise count how many times the line is repeated.
+	 */
+	snprintf(logId, sizeof(logId), "node %s/%d/%d",
+			 config->formation,
+			 keeperState->current_node_id,
+			 keeperState->current_group);
+
+	snprintf(logKey, sizeof(logKey), "%s %s %s",
+			 NodeStateToString(keeperState->current_role),
+			 service->reportPgIsRunning ? "running" : "not running",
+			 postgres->pgsrSyncState);
+
+	log_info_dedup(logId, logKey,
+				   "Calling node_active for node %s/%d/%d with current state: "
+				   "%s, "
+				   "PostgreSQL %s running, "
+				   "sync_state is \"%s\", "
+				   "current lsn is \"%s\".",
+				   config->formation,
+				   keeperState->current_node_id,
+				   keeperState->current_group,
+				   NodeStateToString(keeperState->current_role),
+				   service->reportPgIsRunning ? "is" : "is not",
+				   postgres->pgsrSyncState,
+				   postgres->currentLSN);
+
+	return true;
+}
+
+
+/*
+ * keeper_service_quit is how a keeper surrenders when it lost its PID file:
+ * another process may now run the same keeper, so we must stop touching its
+ * state and status files. A keeper that runs on its own exits, and in a
+ * supervisor this keeper stops while the other keepers keep running.
+ */
+static void
+keeper_service_quit(KeeperService *service)
+{
+	KeeperConfig *config = &(service->keeper->config);
+
+	if (!service->supervised)
+	{
+		log_fatal("Quitting.");
+		exit(EXIT_CODE_QUIT);
+	}
+
+	log_fatal("Stopping the keeper for \"%s\", "
+			  "the other keepers of this service keep running.",
+			  config->pgSetup.pgdata);
+
+	/* the process that took over our PID file publishes its own status */
+	(void) status_page_detach(service->statusPage);
+	service->statusPage = NULL;
+
+	service->stopped = true;
+}
+
+
+/*
+ * keeper_service_apply takes into account what we got from the monitor, when
+ * couldContactMonitor is true, then makes the state transitions and stores
+ * the resulting state. It returns true when we reached a new state.
+ */
+static bool
+keeper_service_apply(KeeperService *service, uint64_t now,
+					 bool couldContactMonitor,
+					 MonitorAssignedState *assignedState)
+{
+	Keeper *keeper = service->keeper;
+	KeeperConfig *config = &(keeper->config);
+	KeeperStateData *keeperState = &(keeper->state);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	bool needStateChange = false;
+	bool transitionFailed = false;
+	bool storedState = false;
+	instr_time startTime;
+
+	/* reap the hooks of the previous transitions, and enforce deadlines */
+	(void) hooks_collect(&(keeper->hooks), config);
+
+	if (couldContactMonitor)
+	{
+		MonitorPeers *peers = &(keeper->monitor.peers);
+
+		keeperState->last_monitor_contact = now;
+		keeperState->assigned_role = assignedState->state;
+
+		if (peers->valid && peers->hasOtherNode)
+		{
+			(void) liveness_set_peer(peers->otherNode.host);
+		}
+	}
+	else
+	{
+		log_error("Failed to get the goal state from the monitor");
+
+		/*
+		 * Check whether we're likely to be in a network partition.
+		 * That will cause the assigned_role to become demoted.
+		 */
+		if (keeperState->current_role == PRIMARY_STATE)
+		{
+			log_warn("Checking for network partitions...");
+
+			if (!is_network_healthy(keeper))
+			{
+				keeperState->assigned_role = DEMOTE_TIMEOUT_STATE;
+			}
+		}
+	}
+
+	/* health checks stop routing to us before we start the transition */
+	(void) metrics_set_routing_state(keeperState->assigned_role,
+									 postgres->pgIsRunning);
+
+	if (asked_to_stop_fast)
+	{
+		return false;
+	}
+
+	/*
+	 * If we see that PostgreSQL is not running when we know it should be,
+	 * the least we can do is start PostgreSQL again. Same if PostgreSQL is
+	 * running and we are DEMOTED, or in another one of those states where
+	 * the monitor asked us to stop serving queries, in order to ensure
+	 * consistency.
+	 *
+	 * Only enfore current state when we have a recent enough version of
+	 * it, meaning that we could contact the monitor.
+	 *
+	 * We need to prevent the keeper from restarting PostgreSQL at boot
+	 * time when meanwhile the Monitor did set our goal_state to DEMOTED
+	 * because the other node has been promoted, which could happen if this
+	 * node was rebooting for a long enough time.
+	 */
+	if (couldContactMonitor)
+	{
+		if (!keeper_ensure_current_state(keeper))
+		{
+			log_warn("pg_autoctl failed to ensure current state \"%s\": "
+					 "PostgreSQL %s running",
+					 NodeStateToString(keeperState->current_role),
+					 postgres->pgIsRunning ? "is" : "is not");
+		}
+	}
+
+	if (asked_to_stop_fast)
+	{
+		return false;
+	}
+
+	if (keeperState->assigned_role != keeperState->current_role)
+	{
+		needStateChange = true;
+
+		INSTR_TIME_SET_CURRENT(startTime);
+
+		if (!keeper_fsm_reach_assigned_state(keeper))
+		{
+			log_error("Failed to transition to state \"%s\", retrying... ",
+					  NodeStateToString(keeperState->assigned_role));
+
+			transitionFailed = true;
+		}
+
+		(void) metrics_observe(METRIC_FSM_TRANSITION, startTime,
+							   !transitionFailed);
+	}
+
+	/*
+	 * Even if a transition failed, we still write the state file to update
+	 * timestamps used for the network partition checks.
+	 */
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	storedState = keeper_store_state(keeper);
+
+	(void) metrics_observe(METRIC_STORE_STATE, startTime, storedState);
+
+	if (storedState)
+	{
+		/* what's on-disk now is our in-memory state */
+		(void) file_has_changed(config->pathnames.state,
+								&(service->stateFileFingerprint));
+	}
+	else
+	{
+		transitionFailed = true;
+	}
+
+	if (transitionFailed)
+	{
+		/* start again from the state we have on-disk */
+		service->reloadState = true;
+	}
+	else
+	{
+		/* the catch-up settings follow the state we just reached */
+		(void) keeper_catchup(keeper);
+
+		/* the monitor is told, errors have already been logged */
+		(void) keeper_guard_slot_retention(keeper);
+		(void) keeper_report_wal_source(keeper);
+
+		if (!needStateChange)
+		{
+			/* pre-warming is best-effort, errors have already been logged */
+			(void) keeper_prewarm(keeper);
+		}
+	}
+
+	if (needStateChange)
+	{
+		/* reporting timings is best-effort too */
+		(void) keeper_report_transition_timings(keeper);
+	}
+
+	if (couldContactMonitor)
+	{
+		/* and so is reporting the results of the hooks */
+		(void) keeper_report_hook_results(keeper);
+	}
+
+	/*
+	 * After a warm restart, we called the monitor without discovering the
+	 * Postgres setup again. Now is the time to check it, as a reload does.
+	 */
+	if (service->validateConfig)
+	{
+		service->validateConfig = false;
+
+		log_info("Checking the configuration that we restarted with");
+		(void) reload_configuration(keeper);
+	}
+
+	return needStateChange && !transitionFailed;
+}
+
+
 /*
  * keeper_service_init initialises the bits and pieces that the keeper service
  * depend on:
@@ -361,7 +1086,6 @@ is_network_healthy(Keeper *keeper)
 	LocalPostgresServer *postgres = &(keeper->postgres);
 	int networkPartitionTimeout = config->network_partition_timeout;
 	uint64_t now = time(NULL);
-	bool hasReplica = false;
 
 	if (keeperState->current_role != PRIMARY_STATE)
 	{
@@ -372,10 +1096,9 @@ is_network_healthy(Keeper *keeper)
 		return true;
 	}
 
-	if (primary_has_replica(postgres, PG_AUTOCTL_REPLICA_USERNAME, &hasReplica) &&
-		hasReplica)
+	/* that's been probed at the beginning of this loop already */
+	if (postgres->replicationState.hasReplica)
 	{
-		keeperState->last_secondary_contact = now;
 		log_warn("We lost the monitor, but still have a standby: "
 				 "we're not in a network partition, continuing.");
 		return true;
@@ -388,8 +1111,10 @@ is_network_healthy(Keeper *keeper)
 	}
 
 	log_info("Failed to contact the monitor or standby in %" PRIu64 " seconds, "
-			 "at %d seconds we shut down PostgreSQL to prevent split brain issues",
-			 keeperState->last_monitor_contact - now, networkPartitionTimeout);
+			 "at %d seconds we %s PostgreSQL to prevent split brain issues",
+			 now - keeperState->last_monitor_contact, networkPartitionTimeout,
+			 config->network_partition_read_only > 0
+			 ? "switch to read-only" : "shut down");
 
 	return false;
 }
@@ -417,11 +1142,15 @@ in_network_partition(KeeperStateData *keeperState, uint64_t now,
 /*
  * reload_configuration reads the supposedly new configuration file and
  * integrates accepted new values into the current setup.
+ *
+ * We then apply the Postgres settings that changed to the running instance
+ * with a reload when possible, see postgres_apply_default_settings.
  */
 static void
 reload_configuration(Keeper *keeper)
 {
 	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
 
 	if (file_exists(config->pathnames.config))
 	{
@@ -447,6 +1176,37 @@ reload_configuration(Keeper *keeper)
 			 */
 			log_info("Reloaded the new configuration from \"%s\"",
 					 config->pathnames.config);
+
+			/* new connections to the monitor use the new keepalives */
+			keeper->monitor.pgsql.keepalives = config->keepalives;
+
+			/* use the new monitor URI from now on, if it changed */
+			if (strcmp(keeper->monitor.pgsql.connectionString,
+					   config->monitor_pguri) != 0)
+			{
+				bool keepConnection = keeper->monitor.pgsql.keepConnection;
+				int connectTimeoutMs = keeper->monitor.pgsql.connectTimeoutMs;
+
+				pgsql_finish(&(keeper->monitor.pgsql));
+
+				if (monitor_init(&(keeper->monitor), config->monitor_pguri))
+				{
+					keeper->monitor.pgsql.keepConnection = keepConnection;
+					keeper->monitor.pgsql.connectTimeoutMs = connectTimeoutMs;
+					keeper->monitor.pgsql.keepalives = config->keepalives;
+				}
+			}
+
+			/* see keeper_update_pg_state */
+			strlcpy(postgres->postgresSetup.listen_addresses,
+					config->pgSetup.listen_addresses, MAXPGPATH);
+
+			if (postgres->pgIsRunning &&
+				!postgres_apply_default_settings(postgres))
+			{
+				log_warn("Failed to apply the new Postgres settings, "
+						 "see above for details");
+			}
 		}
 		else
 		{
@@ -470,6 +1230,123 @@ reload_configuration(Keeper *keeper)
 }
 
 
+/*
+ * keeper_service_update_metrics registers the current and assigned states of
+ * the keeper, and how far behind the WAL it received a standby is replaying.
+ */
+static void
+keeper_service_update_metrics(Keeper *keeper)
+{
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	PostgresReplicationState *replicationState = &(postgres->replicationState);
+	uint64_t receivedLSN = 0;
+	uint64_t replayedLSN = 0;
+	bool hasReplayLag =
+		postgres->pgIsRunning &&
+		replicationState->isInRecovery &&
+		parse_lsn(replicationState->receivedLSN, &receivedLSN) &&
+		parse_lsn(replicationState->replayedLSN, &replayedLSN);
+
+	(void) metrics_set_node_state(keeper->state.current_role);
+
+	(void) metrics_set_routing_state(keeper->state.assigned_role,
+									 postgres->pgIsRunning);
+
+	(void) metrics_set_replay_lag(hasReplayLag,
+								  receivedLSN > replayedLSN
+								  ? receivedLSN - replayedLSN : 0);
+}
+
+
+/*
+ * keeper_service_publish_status updates the status page that local readers
+ * map, see status_page.c. That's only memory stores, no system call.
+ */
+static void
+keeper_service_publish_status(KeeperService *service,
+							  double loopSeconds,
+							  double nodeActiveSeconds)
+{
+	KeeperStatusPage *page = service->statusPage;
+	KeeperStateData *keeperState = &(service->keeper->state);
+	LocalPostgresServer *postgres = &(service->keeper->postgres);
+	PostgresReplicationState *replicationState = &(postgres->replicationState);
+
+	if (page == NULL)
+	{
+		return;
+	}
+
+	(void) status_page_begin_update(page);
+
+	page->updateTime = time(NULL);
+	page->loopCount = ++service->loopCount;
+	page->lastMonitorContact = keeperState->last_monitor_contact;
+	page->lastSecondaryContact = keeperState->last_secondary_contact;
+	page->loopSeconds = loopSeconds;
+	page->nodeActiveSeconds = nodeActiveSeconds;
+
+	page->nodeId = keeperState->current_node_id;
+	page->groupId = keeperState->current_group;
+	page->currentRole = keeperState->current_role;
+	page->assignedRole = keeperState->assigned_role;
+	page->pgIsRunning = postgres->pgIsRunning;
+
+	strlcpy(page->syncState, postgres->pgsrSyncState,
+			PGSR_SYNC_STATE_MAXLENGTH);
+	strlcpy(page->currentLSN, postgres->currentLSN, PG_LSN_MAXLENGTH);
+	strlcpy(page->receivedLSN, replicationState->receivedLSN,
+			PG_LSN_MAXLENGTH);
+	strlcpy(page->replayedLSN, replicationState->replayedLSN,
+			PG_LSN_MAXLENGTH);
+
+	(void) status_page_end_update(page);
+}
+
+
+/*
+ * keeper_service_close_status removes our status page when we stop.
+ */
+static void
+keeper_service_close_status(KeeperService *service)
+{
+	char filename[MAXPGPATH];
+
+	if (service->statusPage == NULL)
+	{
+		return;
+	}
+
+	path_in_same_directory(service->keeper->config.pathnames.pid,
+						   KEEPER_STATUS_FILENAME, filename);
+
+	(void) status_page_close(service->statusPage, filename);
+	service->statusPage = NULL;
+}
+
+
+/*
+ * keeper_heartbeat_interval returns how long to wait in between two calls to
+ * the monitor, in milliseconds. We take off up to 10% of the configured
+ * timeout.heartbeat_interval at random, so that the keepers of a formation
+ * don't all contact the monitor at the same time.
+ */
+static int
+keeper_heartbeat_interval(KeeperConfig *config)
+{
+	int interval = config->heartbeat_interval;
+	int jitter = 0;
+
+	if (interval < PG_AUTOCTL_KEEPER_HEARTBEAT_MIN_INTERVAL)
+	{
+		interval = PG_AUTOCTL_KEEPER_HEARTBEAT_MIN_INTERVAL;
+	}
+
+	jitter = interval / 10;
+
+	return interval - (jitter > 0 ? (int) (random() % (jitter + 1)) : 0);
+}
+
 /*
  * create_pidfile writes our pid in a file.
  *
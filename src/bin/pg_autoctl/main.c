@@ -60,6 +60,16 @@ main(int argc, char **argv)
 	 */
 	log_use_colors(isatty(fileno(stderr)));
 
+	/*
+	 * Log pipelines can ask for JSON lines instead of our text format, so
+	 * that they don't have to parse the messages.
+	 */
+	if (getenv(PG_AUTOCTL_LOG_FORMAT) != NULL
+		&& strcmp(getenv(PG_AUTOCTL_LOG_FORMAT), "json") == 0)
+	{
+		log_set_format(LOG_FORMAT_JSON);
+	}
+
 	(void) commandline_run(&command, argc, argv);
 
 	return 0;
@@ -0,0 +1,703 @@
+/*
+ * src/bin/pg_autoctl/metrics.c
+ *   Timers and counters of the keeper service, served over HTTP in the
+ *   Prometheus text format.
+ *
+ * The service loop records its timings in memory, protected by a mutex, and
+ * a thread of its own answers the HTTP requests, so that a slow or stuck
+ * scraper never delays the service loop.
+ *
+ * The same thread also answers the health checks of load balancers at
+ * /primary and /replica, from what the keeper knows of its state, so that
+ * routing a client doesn't need a connection to Postgres.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "pqexpbuffer.h"
+
+#include "log.h"
+#include "metrics.h"
+#include "state.h"
+
+
+typedef struct MetricHistogram
+{
+	const char *operation;
+
+	/* each bucket counts the observations that are not in the previous one */
+	uint64_t buckets[METRICS_BUCKET_COUNT];
+	uint64_t count;
+	double sum;
+	uint64_t errors;
+} MetricHistogram;
+
+static const double MetricBuckets[METRICS_BUCKET_COUNT] = { METRICS_BUCKETS };
+
+static struct
+{
+	pthread_mutex_t mutex;
+	MetricHistogram timers[METRIC_TIMER_COUNT];
+
+	/* time spent in each state, not counting the current one */
+	NodeState currentState;
+	bool hasState;
+	instr_time stateStartTime;
+	double stateSeconds[MAINTENANCE_STATE + 1];
+
+	bool hasReplayLag;
+	uint64_t replayLagBytes;
+
+	/* the goal state that the monitor assigned, for the health checks */
+	NodeState assignedState;
+	bool pgIsRunning;
+} M = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.timers = {
+		{ .operation = "loop" },
+		{ .operation = "update_pg_state" },
+		{ .operation = "node_active" },
+		{ .operation = "fsm_transition" },
+		{ .operation = "store_state" }
+	}
+};
+
+static struct
+{
+	int listenFd;
+	pthread_t thread;
+	volatile bool running;
+	time_t startTime;
+} S = { -1 };
+
+static void * metrics_server_main(void *arg);
+static void metrics_handle_request(int fd);
+static bool metrics_render(PQExpBuffer out);
+static const char * metrics_health_check(const char *path, PQExpBuffer out);
+static bool metrics_send(int fd, const char *data, size_t length);
+
+
+/*
+ * metrics_observe records in the histogram of the given timer the time
+ * elapsed since startTime, and whether the operation succeeded. It returns
+ * the elapsed time in seconds.
+ */
+double
+metrics_observe(MetricTimer timer, instr_time startTime, bool success)
+{
+	instr_time duration;
+	double seconds = 0;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, startTime);
+
+	seconds = INSTR_TIME_GET_DOUBLE(duration);
+
+	(void) metrics_observe_seconds(timer, seconds, success);
+
+	return seconds;
+}
+
+
+/*
+ * metrics_observe_seconds records a duration given in seconds in the
+ * histogram of the given timer.
+ */
+void
+metrics_observe_seconds(MetricTimer timer, double seconds, bool success)
+{
+	MetricHistogram *histogram = &(M.timers[timer]);
+	int bucket = 0;
+
+	while (bucket < METRICS_BUCKET_COUNT && MetricBuckets[bucket] < seconds)
+	{
+		++bucket;
+	}
+
+	pthread_mutex_lock(&M.mutex);
+
+	if (bucket < METRICS_BUCKET_COUNT)
+	{
+		++histogram->buckets[bucket];
+	}
+
+	++histogram->count;
+	histogram->sum += seconds;
+
+	if (!success)
+	{
+		++histogram->errors;
+	}
+
+	pthread_mutex_unlock(&M.mutex);
+}
+
+
+/*
+ * metrics_set_node_state registers the current state of the node, and adds
+ * the time spent since the previous call to the state we were in then.
+ */
+void
+metrics_set_node_state(NodeState state)
+{
+	instr_time now;
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	pthread_mutex_lock(&M.mutex);
+
+	if (M.hasState && M.currentState <= MAINTENANCE_STATE)
+	{
+		instr_time duration = now;
+
+		INSTR_TIME_SUBTRACT(duration, M.stateStartTime);
+		M.stateSeconds[M.currentState] += INSTR_TIME_GET_DOUBLE(duration);
+	}
+
+	M.currentState = state;
+	M.stateStartTime = now;
+	M.hasState = true;
+
+	pthread_mutex_unlock(&M.mutex);
+}
+
+
+/*
+ * metrics_set_replay_lag registers how many bytes of WAL a standby has
+ * received and not replayed yet, when known.
+ */
+void
+metrics_set_replay_lag(bool known, uint64_t lagBytes)
+{
+	pthread_mutex_lock(&M.mutex);
+
+	M.hasReplayLag = known;
+	M.replayLagBytes = known ? lagBytes : 0;
+
+	pthread_mutex_unlock(&M.mutex);
+}
+
+
+/*
+ * metrics_set_routing_state registers the goal state that the monitor
+ * assigned to this node, and whether Postgres is running, which the health
+ * checks use along with the current state.
+ */
+void
+metrics_set_routing_state(NodeState assignedState, bool pgIsRunning)
+{
+	pthread_mutex_lock(&M.mutex);
+
+	M.assignedState = assignedState;
+	M.pgIsRunning = pgIsRunning;
+
+	pthread_mutex_unlock(&M.mutex);
+}
+
+
+/*
+ * metrics_start_server listens for HTTP connections on the given address and
+ * port, and starts the thread that answers the requests for /metrics.
+ */
+bool
+metrics_start_server(const char *listenAddress, int port)
+{
+	struct addrinfo hints = { 0 };
+	struct addrinfo *addresses = NULL;
+	char service[NI_MAXSERV];
+	sigset_t allSignals;
+	sigset_t oldSignals;
+	int enable = 1;
+	int error = 0;
+
+	if (S.running)
+	{
+		return true;
+	}
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	snprintf(service, sizeof(service), "%d", port);
+
+	error = getaddrinfo(listenAddress, service, &hints, &addresses);
+
+	if (error != 0)
+	{
+		log_error("Failed to resolve the metrics listen address \"%s\": %s",
+				  listenAddress, gai_strerror(error));
+		return false;
+	}
+
+	/* the processes that we run must not inherit our listening socket */
+	S.listenFd = socket(addresses->ai_family,
+						addresses->ai_socktype | SOCK_CLOEXEC,
+						addresses->ai_protocol);
+
+	if (S.listenFd < 0)
+	{
+		log_error("Failed to create the metrics socket: %s", strerror(errno));
+		freeaddrinfo(addresses);
+		return false;
+	}
+
+	(void) setsockopt(S.listenFd, SOL_SOCKET, SO_REUSEADDR,
+					  &enable, sizeof(enable));
+
+	if (bind(S.listenFd, addresses->ai_addr, addresses->ai_addrlen) != 0 ||
+		listen(S.listenFd, SOMAXCONN) != 0)
+	{
+		log_error("Failed to listen for metrics requests on %s:%d: %s",
+				  listenAddress, port, strerror(errno));
+		close(S.listenFd);
+		S.listenFd = -1;
+		freeaddrinfo(addresses);
+		return false;
+	}
+
+	freeaddrinfo(addresses);
+
+	S.startTime = time(NULL);
+	S.running = true;
+
+	/* signals are for the service loop, the metrics thread ignores them */
+	sigfillset(&allSignals);
+	pthread_sigmask(SIG_BLOCK, &allSignals, &oldSignals);
+
+	error = pthread_create(&S.thread, NULL, metrics_server_main, NULL);
+
+	pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+	if (error != 0)
+	{
+		log_error("Failed to start the metrics thread: %s", strerror(error));
+		S.running = false;
+		close(S.listenFd);
+		S.listenFd = -1;
+		return false;
+	}
+
+	log_info("Serving metrics at http://%s:%d/metrics", listenAddress, port);
+
+	return true;
+}
+
+
+/*
+ * metrics_stop_server stops the metrics thread and closes our socket.
+ */
+void
+metrics_stop_server(void)
+{
+	if (!S.running)
+	{
+		return;
+	}
+
+	S.running = false;
+	pthread_join(S.thread, NULL);
+
+	close(S.listenFd);
+	S.listenFd = -1;
+}
+
+
+/*
+ * metrics_server_main is the main loop of the metrics thread. We answer one
+ * request at a time, and check every second whether we've been asked to
+ * stop.
+ */
+static void *
+metrics_server_main(void *arg)
+{
+	while (S.running)
+	{
+		struct pollfd pfd = { S.listenFd, POLLIN, 0 };
+		int fd = -1;
+
+		if (poll(&pfd, 1, 1000) <= 0)
+		{
+			continue;
+		}
+
+		fd = accept4(S.listenFd, NULL, NULL, SOCK_CLOEXEC);
+
+		if (fd < 0)
+		{
+			continue;
+		}
+
+		(void) metrics_handle_request(fd);
+
+		close(fd);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * metrics_handle_request reads an HTTP request line from the given socket,
+ * and sends our metrics when that's a GET request for /metrics, or the
+ * result of a health check for /primary and /replica. HEAD requests get the
+ * same status without a body, as some load balancers use them. We don't need
+ * the request headers, so we don't read them.
+ */
+static void
+metrics_handle_request(int fd)
+{
+	struct timeval timeout = { 1, 0 };
+	char request[METRICS_REQUEST_MAXLEN] = { 0 };
+	size_t length = 0;
+	char *path = NULL;
+	bool isHead = false;
+	const char *status = "200 OK";
+	PQExpBuffer body = createPQExpBuffer();
+	PQExpBuffer response = createPQExpBuffer();
+
+	/* don't let a slow client hold the metrics thread */
+	(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	(void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	while (length < sizeof(request) - 1 && strstr(request, "\r\n") == NULL)
+	{
+		ssize_t bytes = recv(fd, request + length,
+							 sizeof(request) - 1 - length, 0);
+
+		if (bytes < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (bytes <= 0)
+		{
+			break;
+		}
+
+		length += bytes;
+		request[length] = '\0';
+	}
+
+	isHead = strncmp(request, "HEAD ", 5) == 0;
+
+	if (strstr(request, "\r\n") == NULL)
+	{
+		status = "400 Bad Request";
+	}
+	else if (strncmp(request, "GET ", 4) != 0 && !isHead)
+	{
+		status = "405 Method Not Allowed";
+	}
+	else
+	{
+		/* isolate the path, the request line is "METHOD path HTTP/x.y" */
+		path = request + (isHead ? 5 : 4);
+		path[strcspn(path, " \r")] = '\0';
+
+		if (strcmp(path, "/metrics") == 0 ||
+			strncmp(path, "/metrics?", 9) == 0)
+		{
+			if (!metrics_render(body))
+			{
+				status = "500 Internal Server Error";
+			}
+		}
+		else
+		{
+			status = metrics_health_check(path, body);
+		}
+	}
+
+	if (body->len == 0 || strcmp(status, "500 Internal Server Error") == 0)
+	{
+		resetPQExpBuffer(body);
+		appendPQExpBuffer(body, "%s\n", status);
+	}
+
+	appendPQExpBuffer(response,
+					  "HTTP/1.1 %s\r\n"
+					  "Content-Type: text/plain; version=0.0.4\r\n"
+					  "Content-Length: %zu\r\n"
+					  "Connection: close\r\n"
+					  "\r\n"
+					  "%s",
+					  status, body->len, isHead ? "" : body->data);
+
+	if (!PQExpBufferBroken(response))
+	{
+		(void) metrics_send(fd, response->data, response->len);
+	}
+
+	destroyPQExpBuffer(body);
+	destroyPQExpBuffer(response);
+}
+
+
+/*
+ * metrics_render appends our metrics to the given buffer, in the Prometheus
+ * text format. We only hold the mutex while copying the metrics.
+ */
+static bool
+metrics_render(PQExpBuffer out)
+{
+	MetricHistogram timers[METRIC_TIMER_COUNT];
+	double stateSeconds[MAINTENANCE_STATE + 1];
+	NodeState currentState = NO_STATE;
+	bool hasState = false;
+	bool hasReplayLag = false;
+	uint64_t replayLagBytes = 0;
+	instr_time now;
+	int timer = 0;
+	int state = 0;
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	pthread_mutex_lock(&M.mutex);
+
+	memcpy(timers, M.timers, sizeof(timers));
+	memcpy(stateSeconds, M.stateSeconds, sizeof(stateSeconds));
+
+	currentState = M.currentState;
+	hasState = M.hasState && M.currentState <= MAINTENANCE_STATE;
+	hasReplayLag = M.hasReplayLag;
+	replayLagBytes = M.replayLagBytes;
+
+	if (hasState)
+	{
+		instr_time duration = now;
+
+		INSTR_TIME_SUBTRACT(duration, M.stateStartTime);
+		stateSeconds[currentState] += INSTR_TIME_GET_DOUBLE(duration);
+	}
+
+	pthread_mutex_unlock(&M.mutex);
+
+	appendPQExpBufferStr(out,
+						 "# HELP pg_autoctl_operation_duration_seconds "
+						 "Duration of the keeper operations.\n"
+						 "# TYPE pg_autoctl_operation_duration_seconds "
+						 "histogram\n");
+
+	for (timer = 0; timer < METRIC_TIMER_COUNT; timer++)
+	{
+		MetricHistogram *histogram = &(timers[timer]);
+		uint64_t cumulative = 0;
+		int bucket = 0;
+
+		for (bucket = 0; bucket < METRICS_BUCKET_COUNT; bucket++)
+		{
+			cumulative += histogram->buckets[bucket];
+
+			appendPQExpBuffer(out,
+							  "pg_autoctl_operation_duration_seconds_bucket"
+							  "{operation=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+							  histogram->operation,
+							  MetricBuckets[bucket],
+							  cumulative);
+		}
+
+		appendPQExpBuffer(out,
+						  "pg_autoctl_operation_duration_seconds_bucket"
+						  "{operation=\"%s\",le=\"+Inf\"} %" PRIu64 "\n"
+						  "pg_autoctl_operation_duration_seconds_sum"
+						  "{operation=\"%s\"} %.6f\n"
+						  "pg_autoctl_operation_duration_seconds_count"
+						  "{operation=\"%s\"} %" PRIu64 "\n",
+						  histogram->operation, histogram->count,
+						  histogram->operation, histogram->sum,
+						  histogram->operation, histogram->count);
+	}
+
+	appendPQExpBufferStr(out,
+						 "# HELP pg_autoctl_operation_errors_total "
+						 "Number of keeper operations that failed.\n"
+						 "# TYPE pg_autoctl_operation_errors_total counter\n");
+
+	for (timer = 0; timer < METRIC_TIMER_COUNT; timer++)
+	{
+		appendPQExpBuffer(out,
+						  "pg_autoctl_operation_errors_total"
+						  "{operation=\"%s\"} %" PRIu64 "\n",
+						  timers[timer].operation, timers[timer].errors);
+	}
+
+	appendPQExpBufferStr(out,
+						 "# HELP pg_autoctl_node_state "
+						 "Current state of the node.\n"
+						 "# TYPE pg_autoctl_node_state gauge\n");
+
+	for (state = NO_STATE; state <= MAINTENANCE_STATE; state++)
+	{
+		appendPQExpBuffer(out,
+						  "pg_autoctl_node_state{state=\"%s\"} %d\n",
+						  NodeStateToString((NodeState) state),
+						  hasState && currentState == state ? 1 : 0);
+	}
+
+	appendPQExpBufferStr(out,
+						 "# HELP pg_autoctl_node_state_seconds_total "
+						 "Time spent by the node in each state.\n"
+						 "# TYPE pg_autoctl_node_state_seconds_total counter\n");
+
+	for (state = NO_STATE; state <= MAINTENANCE_STATE; state++)
+	{
+		appendPQExpBuffer(out,
+						  "pg_autoctl_node_state_seconds_total"
+						  "{state=\"%s\"} %.3f\n",
+						  NodeStateToString((NodeState) state),
+						  stateSeconds[state]);
+	}
+
+	if (hasReplayLag)
+	{
+		appendPQExpBuffer(out,
+						  "# HELP pg_autoctl_replay_lag_bytes "
+						  "WAL received by the standby and not replayed yet.\n"
+						  "# TYPE pg_autoctl_replay_lag_bytes gauge\n"
+						  "pg_autoctl_replay_lag_bytes %" PRIu64 "\n",
+						  replayLagBytes);
+	}
+
+	appendPQExpBuffer(out,
+					  "# HELP pg_autoctl_start_time_seconds "
+					  "Start time of the keeper service since the epoch.\n"
+					  "# TYPE pg_autoctl_start_time_seconds gauge\n"
+					  "pg_autoctl_start_time_seconds %" PRId64 "\n",
+					  (int64_t) S.startTime);
+
+	return !PQExpBufferBroken(out);
+}
+
+
+/*
+ * metrics_health_check answers a health check of a load balancer for the
+ * given path, and returns the HTTP status: /primary succeeds when this node
+ * is a primary that the monitor wants to keep as such, and /replica when it
+ * is a secondary that the monitor wants to keep as such. With /replica, the
+ * max_lag parameter sets how many bytes of WAL the standby may have received
+ * and not replayed yet.
+ */
+static const char *
+metrics_health_check(const char *path, PQExpBuffer out)
+{
+	NodeState currentState = NO_STATE;
+	NodeState assignedState = NO_STATE;
+	bool pgIsRunning = false;
+	bool hasReplayLag = false;
+	uint64_t replayLagBytes = 0;
+	bool checkLag = false;
+	uint64_t maxLagBytes = 0;
+	bool healthy = false;
+
+	if (strncmp(path, "/replica?max_lag=", 17) == 0)
+	{
+		const char *value = path + 17;
+		char *endptr = NULL;
+		unsigned long long maxLag = 0;
+
+		errno = 0;
+		maxLag = strtoull(value, &endptr, 10);
+
+		if (*value < '0' || *value > '9' || *endptr != '\0' ||
+			(maxLag == ULLONG_MAX && errno == ERANGE))
+		{
+			return "400 Bad Request";
+		}
+
+		checkLag = true;
+		maxLagBytes = (uint64_t) maxLag;
+	}
+	else if (strcmp(path, "/replica") != 0 && strcmp(path, "/primary") != 0)
+	{
+		return "404 Not Found";
+	}
+
+	pthread_mutex_lock(&M.mutex);
+
+	currentState = M.hasState ? M.currentState : NO_STATE;
+	assignedState = M.assignedState;
+	pgIsRunning = M.pgIsRunning;
+	hasReplayLag = M.hasReplayLag;
+	replayLagBytes = M.replayLagBytes;
+
+	pthread_mutex_unlock(&M.mutex);
+
+	if (strcmp(path, "/primary") == 0)
+	{
+		healthy = pgIsRunning &&
+				  (currentState == SINGLE_STATE ||
+				   currentState == PRIMARY_STATE ||
+				   currentState == WAIT_PRIMARY_STATE) &&
+				  (assignedState == SINGLE_STATE ||
+				   assignedState == PRIMARY_STATE ||
+				   assignedState == WAIT_PRIMARY_STATE);
+	}
+	else
+	{
+		healthy = pgIsRunning &&
+				  currentState == SECONDARY_STATE &&
+				  assignedState == SECONDARY_STATE &&
+				  (!checkLag || (hasReplayLag && replayLagBytes <= maxLagBytes));
+	}
+
+	appendPQExpBuffer(out, "current_role: %s\nassigned_role: %s\n",
+					  NodeStateToString(currentState),
+					  NodeStateToString(assignedState));
+
+	if (hasReplayLag)
+	{
+		appendPQExpBuffer(out, "replay_lag_bytes: %" PRIu64 "\n",
+						  replayLagBytes);
+	}
+
+	return healthy ? "200 OK" : "503 Service Unavailable";
+}
+
+
+/*
+ * metrics_send writes all of the given data to the socket, unless the client
+ * is gone or too slow.
+ */
+static bool
+metrics_send(int fd, const char *data, size_t length)
+{
+	size_t sent = 0;
+
+	while (sent < length)
+	{
+		ssize_t bytes = send(fd, data + sent, length - sent, MSG_NOSIGNAL);
+
+		if (bytes < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (bytes <= 0)
+		{
+			return false;
+		}
+
+		sent += bytes;
+	}
+
+	return true;
+}
@@ -0,0 +1,50 @@
+/*
+ * src/bin/pg_autoctl/metrics.h
+ *   Timers and counters of the keeper service, served over HTTP in the
+ *   Prometheus text format.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "postgres_fe.h"
+#include "portability/instr_time.h"
+
+#include "state.h"
+
+/* the parts of the keeper loop that we time */
+typedef enum
+{
+	METRIC_LOOP = 0,
+	METRIC_UPDATE_PG_STATE,
+	METRIC_NODE_ACTIVE,
+	METRIC_FSM_TRANSITION,
+	METRIC_STORE_STATE,
+	METRIC_TIMER_COUNT
+} MetricTimer;
+
+/* histogram buckets, in seconds */
+#define METRICS_BUCKETS \
+	0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30
+#define METRICS_BUCKET_COUNT 14
+
+/* an HTTP request line that doesn't fit in there is refused */
+#define METRICS_REQUEST_MAXLEN 1024
+
+double metrics_observe(MetricTimer timer, instr_time startTime, bool success);
+void metrics_observe_seconds(MetricTimer timer, double seconds, bool success);
+void metrics_set_node_state(NodeState state);
+void metrics_set_replay_lag(bool known, uint64_t lagBytes);
+void metrics_set_routing_state(NodeState assignedState, bool pgIsRunning);
+
+bool metrics_start_server(const char *listenAddress, int port);
+void metrics_stop_server(void);
+
+#endif /* METRICS_H */
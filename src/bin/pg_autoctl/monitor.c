@@ -6,9 +6,12 @@
  * Licensed under the PostgreSQL License.
  *
  */
+#include <arpa/inet.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
 #include <sys/select.h>
+#include <time.h>
 
 #include "postgres.h"
 
@@ -18,7 +21,10 @@
 #include "monitor.h"
 #include "parsing.h"
 #include "pgsql.h"
+#include "pqexpbuffer.h"
+#include "signals.h"
 #include "catalog/pg_type.h"
+#include "portability/instr_time.h"
 
 
 typedef struct NodeAddressParseContext
@@ -27,41 +33,154 @@ typedef struct NodeAddressParseContext
 	bool parsedOK;
 } NodeAddressParseContext;
 
+typedef struct NodeAddressArrayParseContext
+{
+	NodeAddressArray *nodeArray;
+	bool parsedOK;
+} NodeAddressArrayParseContext;
+
 typedef struct MonitorAssignedStateParseContext
 {
 	MonitorAssignedState *assignedState;
 	bool parsedOK;
+	MonitorPeers *peers;		/* only with node_active_peers */
 } MonitorAssignedStateParseContext;
 
+/* number of columns returned by node_active_peers */
+#define NODE_ACTIVE_PEERS_COLUMNS 14
+
+typedef struct MonitorNodeReportParseContext
+{
+	MonitorNodeReport *reports;
+	int reportCount;
+	bool parsedOK;
+} MonitorNodeReportParseContext;
+
 typedef struct MonitorExtensionVersionParseContext
 {
 	MonitorExtensionVersion *version;
 	bool parsedOK;
 } MonitorExtensionVersionParseContext;
 
+typedef struct MonitorRollingGroupsParseContext
+{
+	MonitorRollingGroup *groups;
+	int maxCount;
+	int count;
+	bool parsedOK;
+} MonitorRollingGroupsParseContext;
+
+typedef struct MonitorURIsParseContext
+{
+	char (*monitorURIs)[MAXCONNINFO];
+	int maxCount;
+	int count;
+	bool parsedOK;
+} MonitorURIsParseContext;
+
+typedef struct MonitorStateChangeContext
+{
+	int nodeId;
+	NodeState goalState;
+	bool changed;
+} MonitorStateChangeContext;
+
 static void parseNode(void *ctx, PGresult *result);
+static void parseNodeArray(void *ctx, PGresult *result);
 static void parseNodeState(void *ctx, PGresult *result);
+static bool parseNodePeers(PGresult *result, MonitorPeers *peers);
+static void parseNodeReports(void *ctx, PGresult *result);
+static void appendArrayElement(PQExpBuffer buffer, const char *value);
 static void printCurrentState(void *ctx, PGresult *result);
+static void logStateNotification(void *context,
+								 StateNotification *notification);
+static void monitor_wait_for_state_change(Monitor *monitor, int nodeId,
+										  NodeState goalState, int timeoutMs);
+static void checkStateNotification(void *context,
+								   StateNotification *notification);
 static void printLastEvents(void *ctx, PGresult *result);
 static void parseCoordinatorNode(void *ctx, PGresult *result);
 static void parseExtensionVersion(void *ctx, PGresult *result);
+static void parseMonitorURIs(void *ctx, PGresult *result);
+static void parseRollingGroups(void *ctx, PGresult *result);
 
+static bool monitor_extension_update_locked(Monitor *dbOwnerMonitor,
+											const char *targetVersion,
+											MonitorExtensionVersion *version);
 static bool prepare_connection_to_current_system_user(Monitor *source,
 													  Monitor *target);
 
 /*
  * monitor_init initialises a Monitor struct to connect to the given
  * database URL.
+ *
+ * The URL may list the primary monitor and its standby nodes, as in
+ * postgres://monitor1:6000,monitor2:6000/pg_auto_failover. The standby nodes
+ * refuse the writes of node_active, so unless the URL says otherwise we
+ * connect to the host that accepts them.
  */
 bool
 monitor_init(Monitor *monitor, char *url)
 {
-	if (!pgsql_init(&monitor->pgsql, url))
+	PGSQL *pgsql = &(monitor->pgsql);
+	char connInfo[MAXCONNINFO] = { 0 };
+
+	if (!pgsql_init(pgsql, url))
 	{
 		/* URL must be invalid, pgsql_init logged an error */
 		return false;
 	}
 
+	if (pgsql_conninfo_host_count(url) > 1)
+	{
+		if (!pgsql_conninfo_set_option(url,
+									   "target_session_attrs", "read-write",
+									   false, connInfo, MAXCONNINFO))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		strlcpy(pgsql->connectionString, connInfo, MAXCONNINFO);
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_prefer_standby changes the connection string of an initialised
+ * monitor so that we connect to one of its standby nodes when the URL lists
+ * some, which moves the load of the read-only commands off the primary
+ * monitor. That needs libpq 14 for target_session_attrs=prefer-standby,
+ * with an older libpq we connect to the first host that answers.
+ */
+bool
+monitor_prefer_standby(Monitor *monitor)
+{
+	PGSQL *pgsql = &(monitor->pgsql);
+	char connInfo[MAXCONNINFO] = { 0 };
+	const char *targetSessionAttrs =
+		PQlibVersion() >= 140000 ? "prefer-standby" : "any";
+
+	if (pgsql_conninfo_host_count(pgsql->connectionString) <= 1)
+	{
+		return true;
+	}
+
+	if (!pgsql_conninfo_set_option(pgsql->connectionString,
+								   "target_session_attrs", targetSessionAttrs,
+								   true, connInfo, MAXCONNINFO))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_debug("Using target_session_attrs=%s for a read-only command",
+			  targetSessionAttrs);
+
+	strlcpy(pgsql->connectionString, connInfo, MAXCONNINFO);
+
 	return true;
 }
 
@@ -84,16 +203,27 @@ monitor_get_other_node(Monitor *monitor, char *myHost, int myPort, NodeAddress *
 	paramValues[0] = myHost;
 	paramValues[1] = myPortString.strValue;
 
-	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
-								   &parseContext, parseNode))
+	/* the last node_active call already told us about the other node */
+	if (monitor->peers.valid && monitor->peers.hasOtherNode)
+	{
+		*node = monitor->peers.otherNode;
+
+		log_info("Other node in the HA group is %s:%d", node->host, node->port);
+		return true;
+	}
+
+	if (!pgsql_execute_with_params_format(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  NULL, NULL, PGSQL_FORMAT_BINARY,
+										  &parseContext, parseNode))
 	{
 		log_error("Failed to get the secondary from the monitor while running "
 				  "\"%s\" with host %s and port %d", sql, myHost, myPort);
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
 
 	if (!parseContext.parsedOK)
 	{
@@ -109,6 +239,54 @@ monitor_get_other_node(Monitor *monitor, char *myHost, int myPort, NodeAddress *
 }
 
 
+/*
+ * monitor_get_other_nodes gets the node id, hostname, port and last reported
+ * LSN of the other nodes in the group, in the order of their node ids.
+ */
+bool
+monitor_get_other_nodes(Monitor *monitor, char *myHost, int myPort,
+						NodeAddressArray *nodeArray)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql = "SELECT * FROM pgautofailover.get_other_nodes($1, $2)";
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, INT4OID };
+	const char *paramValues[2];
+	NodeAddressArrayParseContext parseContext = { nodeArray, false };
+	IntString myPortString = intToString(myPort);
+
+	paramValues[0] = myHost;
+	paramValues[1] = myPortString.strValue;
+
+	if (!pgsql_execute_with_params_format(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  NULL, NULL, PGSQL_FORMAT_BINARY,
+										  &parseContext, parseNodeArray))
+	{
+		log_error("Failed to get the other nodes from the monitor while "
+				  "running \"%s\" with host %s and port %d",
+				  sql, myHost, myPort);
+		return false;
+	}
+
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
+
+	if (!parseContext.parsedOK)
+	{
+		log_error("Failed to get the other nodes from the monitor while "
+				  "running \"%s\" with host %s and port %d because it "
+				  "returned an unexpected result. "
+				  "See previous line for details.",
+				  sql, myHost, myPort);
+		return false;
+	}
+
+	log_debug("The HA group has %d other nodes", nodeArray->count);
+	return true;
+}
+
+
 /*
  * monitor_get_primary gets the primary node in a give formation and group.
  */
@@ -126,8 +304,22 @@ monitor_get_primary(Monitor *monitor, char *formation, int groupId, NodeAddress
 	paramValues[0] = formation;
 	paramValues[1] = groupIdString.strValue;
 
-	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
-								   &parseContext, parseNode))
+	/* the last node_active call already told us about the primary node */
+	if (monitor->peers.valid && monitor->peers.hasPrimaryNode &&
+		monitor->peers.groupId == groupId &&
+		strcmp(monitor->peers.formation, formation) == 0)
+	{
+		*node = monitor->peers.primaryNode;
+
+		log_info("The primary node returned by the monitor is %s:%d",
+				 node->host, node->port);
+		return true;
+	}
+
+	if (!pgsql_execute_with_params_format(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  NULL, NULL, PGSQL_FORMAT_BINARY,
+										  &parseContext, parseNode))
 	{
 		log_error("Failed to get the primary node in the HA group from the monitor "
 				  "while running \"%s\" with formation \"%s\" and group ID %d",
@@ -135,8 +327,8 @@ monitor_get_primary(Monitor *monitor, char *formation, int groupId, NodeAddress
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
 
 	if (!parseContext.parsedOK)
 	{
@@ -178,8 +370,8 @@ monitor_get_coordinator(Monitor *monitor, char *formation, NodeAddress *node)
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
 
 	if (!parseContext.parsedOK)
 	{
@@ -250,8 +442,10 @@ monitor_register_node(Monitor *monitor, char *formation, char *host, int port,
 	paramValues[5] = nodeStateString;
 	paramValues[6] = nodeKindToString(kind);
 
-	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
-								   &parseContext, parseNodeState))
+	if (!pgsql_execute_with_params_format(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  NULL, NULL, PGSQL_FORMAT_BINARY,
+										  &parseContext, parseNodeState))
 	{
 		log_error("Failed to register node %s:%d in group %d of formation \"%s\" "
 				  "with initial state \"%s\", see previous lines for details",
@@ -259,8 +453,8 @@ monitor_register_node(Monitor *monitor, char *formation, char *host, int port,
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
 
 	if (!parseContext.parsedOK)
 	{
@@ -291,31 +485,102 @@ monitor_node_active(Monitor *monitor,
 					bool pgIsRunning,
 					char *currentLSN, char *pgsrSyncState,
 					MonitorAssignedState *assignedState)
+{
+	return monitor_node_active_wait(monitor, formation, host, port, nodeId,
+									groupId, currentState, pgIsRunning,
+									currentLSN, pgsrSyncState, 0,
+									assignedState);
+}
+
+
+/*
+ * monitor_node_active_wait is like monitor_node_active, but when timeoutMs is
+ * positive and the monitor has no new goal state for us, we then wait for up
+ * to that long until the monitor notifies one, see
+ * monitor_wait_for_state_change.
+ *
+ * We call node_active_peers, which also returns the other node and the
+ * primary node of our group, and keep them in monitor->peers until the next
+ * call: see monitor_get_other_node and monitor_get_primary.
+ */
+bool
+monitor_node_active_wait(Monitor *monitor,
+						 char *formation, char *host, int port, int nodeId,
+						 int groupId, NodeState currentState,
+						 bool pgIsRunning,
+						 char *currentLSN, char *pgsrSyncState,
+						 int timeoutMs,
+						 MonitorAssignedState *assignedState)
 {
 	PGSQL *pgsql = &monitor->pgsql;
 	const char *sql =
-		"SELECT * FROM pgautofailover.node_active($1, $2, $3, $4, $5, "
-		"$6::pgautofailover.replication_state, $7, $8, $9)";
-	int paramCount = 9;
-	Oid paramTypes[9] = { TEXTOID, TEXTOID, INT4OID, INT4OID,
-						  INT4OID, TEXTOID, BOOLOID, LSNOID, TEXTOID };
-	const char *paramValues[9];
-	MonitorAssignedStateParseContext parseContext = { assignedState, false };
+		"SELECT * FROM pgautofailover.node_active_peers($1, $2, $3, $4, $5, "
+		"$6::pgautofailover.replication_state, $7, $8, $9, $10)";
+	int paramCount = 10;
+	Oid paramTypes[10] = { TEXTOID, TEXTOID, INT4OID, INT4OID,
+						   INT4OID, TEXTOID, BOOLOID, LSNOID, TEXTOID, INT4OID };
+	const char *paramValues[10];
+
+	/* integers and booleans are sent in binary, see pgsql_get_int4 */
+	int paramLengths[10] = { 0, 0, 4, 4, 4, 0, 1, 0, 0, 4 };
+	int paramFormats[10] = { 0, 0, 1, 1, 1, 0, 1, 0, 0, 1 };
+	uint32_t portValue = htonl((uint32_t) port);
+	uint32_t nodeIdValue = htonl((uint32_t) nodeId);
+	uint32_t groupIdValue = htonl((uint32_t) groupId);
+	char pgIsRunningValue = pgIsRunning ? 1 : 0;
+
+	/* the monitor would wait with our statement snapshot, we wait ourselves */
+	uint32_t timeoutValue = htonl(0);
+
+	MonitorAssignedStateParseContext parseContext =
+	{ assignedState, false, &(monitor->peers) };
 	const char *nodeStateString = NodeStateToString(currentState);
 
+	/* the peers we got from the previous call are now outdated */
+	monitor->peers.valid = false;
+
 	paramValues[0] = formation;
 	paramValues[1] = host;
-	paramValues[2] = intToString(port).strValue;
-	paramValues[3] = intToString(nodeId).strValue;
-	paramValues[4] = intToString(groupId).strValue;
+	paramValues[2] = (const char *) &portValue;
+	paramValues[3] = (const char *) &nodeIdValue;
+	paramValues[4] = (const char *) &groupIdValue;
 	paramValues[5] = nodeStateString;
-	paramValues[6] = pgIsRunning ? "true" : "false";
+	paramValues[6] = &pgIsRunningValue;
 	paramValues[7] = currentLSN;
 	paramValues[8] = pgsrSyncState;
+	paramValues[9] = (const char *) &timeoutValue;
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &parseContext, parseNodeState))
+	/* LISTEN before node_active, so that we can't miss a new goal state */
+	if (timeoutMs > 0 && pgsql->keepConnection && !pgsql->listening)
+	{
+		char *channels[] = { "state", NULL };
+
+		if (!pgsql_listen(pgsql, channels))
+		{
+			log_warn("Failed to LISTEN to the monitor notifications, "
+					 "see above for details");
+		}
+	}
+
+	/* the node_active result is newer than what we've been notified */
+	if (pgsql->connection != NULL)
+	{
+		PGnotify *notify = NULL;
+
+		while ((notify = PQnotifies(pgsql->connection)) != NULL)
+		{
+			PQfreemem(notify);
+		}
+	}
+
+	/* the monitor tells us when it's too busy to run the state machine */
+	pgsql->retryAfterMs = 0;
+
+	if (!pgsql_execute_with_params_format(pgsql, sql,
+										  paramCount, paramTypes, paramValues,
+										  paramLengths, paramFormats,
+										  PGSQL_FORMAT_BINARY,
+										  &parseContext, parseNodeState))
 	{
 		log_error("Failed to get node state for node %d (%s:%d) "
 				  "in group %d of formation \"%s\" with initial state "
@@ -327,8 +592,8 @@ monitor_node_active(Monitor *monitor,
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
 
 	if (!parseContext.parsedOK)
 	{
@@ -342,10 +607,241 @@ monitor_node_active(Monitor *monitor,
 		return false;
 	}
 
+	strlcpy(monitor->peers.formation, formation, NAMEDATALEN);
+	monitor->peers.groupId = assignedState->groupId;
+	monitor->peers.valid = true;
+
+	if (timeoutMs > 0 && assignedState->state == currentState)
+	{
+		(void) monitor_wait_for_state_change(monitor, assignedState->nodeId,
+											 assignedState->state, timeoutMs);
+	}
+
 	return true;
 }
 
 
+/*
+ * monitor_wait_for_state_change waits for up to timeoutMs milliseconds until
+ * the monitor notifies a new goal state for the given node, or until we
+ * receive a signal.
+ *
+ * We wait for the notifications on our connection to the monitor, outside of
+ * any transaction: a node_active_wait call would wait on the monitor with the
+ * snapshot of its statement, which prevents vacuum from removing the dead
+ * rows of the node table in the meantime. Without a connection that LISTENs,
+ * we only wait for the timeout.
+ */
+static void
+monitor_wait_for_state_change(Monitor *monitor, int nodeId,
+							  NodeState goalState, int timeoutMs)
+{
+	PGSQL *pgsql = &(monitor->pgsql);
+	MonitorStateChangeContext context = { nodeId, goalState, false };
+	instr_time startTime;
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	while (!context.changed &&
+		   !asked_to_stop && !asked_to_stop_fast && !asked_to_reload)
+	{
+		PGnotify *notify = NULL;
+		instr_time duration;
+		int remainingMs = 0;
+
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, startTime);
+
+		remainingMs = timeoutMs - (int) INSTR_TIME_GET_MILLISEC(duration);
+
+		if (remainingMs <= 0)
+		{
+			break;
+		}
+
+		if (pgsql->connection == NULL || !pgsql->listening)
+		{
+			(void) wait_for_signal(-1, remainingMs);
+			continue;
+		}
+
+		if (wait_for_signal(PQsocket(pgsql->connection), remainingMs) &&
+			!PQconsumeInput(pgsql->connection))
+		{
+			log_warn("Lost connection to the monitor: %s",
+					 PQerrorMessage(pgsql->connection));
+			pgsql_finish(pgsql);
+			continue;
+		}
+
+		while ((notify = PQnotifies(pgsql->connection)) != NULL)
+		{
+			if (strcmp(notify->relname, "state") == 0)
+			{
+				log_debug("received \"%s\"", notify->extra);
+
+				/* errors are logged by monitor_parse_state_notifications */
+				(void) monitor_parse_state_notifications(notify->extra,
+														 &checkStateNotification,
+														 &context);
+			}
+
+			PQfreemem(notify);
+		}
+	}
+}
+
+
+/*
+ * checkStateNotification sets context->changed when the notified state change
+ * assigns a new goal state to the node of the context.
+ */
+static void
+checkStateNotification(void *context, StateNotification *notification)
+{
+	MonitorStateChangeContext *stateChangeContext =
+		(MonitorStateChangeContext *) context;
+
+	if (notification->nodeId == stateChangeContext->nodeId &&
+		notification->goalState != stateChangeContext->goalState)
+	{
+		stateChangeContext->changed = true;
+	}
+}
+
+
+/*
+ * monitor_node_active_batch calls the pgautofailover.node_active_batch
+ * function on the monitor, so that the keepers of several nodes that run in
+ * the same process report to the monitor in a single round-trip.
+ *
+ * The reports are sent as one array per node_report field, and the function
+ * sets the assignedState of each of the reports the monitor answered for. The
+ * monitor runs each report on its own, and returns the error of the reports
+ * that failed, which are then left unassigned.
+ */
+bool
+monitor_node_active_batch(Monitor *monitor,
+						  MonitorNodeReport *reports, int reportCount)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT node_name, node_port, assigned_node_id, assigned_group_id, "
+		"assigned_group_state, error "
+		"FROM pgautofailover.node_active_batch(array("
+		"SELECT row(f, n, p, i, g, s::pgautofailover.replication_state, "
+		"r, l::pg_lsn, ss)::pgautofailover.node_report "
+		"FROM unnest($1::text[], $2::text[], $3::int[], $4::int[], "
+		"$5::int[], $6::text[], $7::bool[], $8::text[], $9::text[]) "
+		"AS t(f, n, p, i, g, s, r, l, ss)))";
+	int paramCount = 9;
+	Oid paramTypes[9] = { TEXTARRAYOID, TEXTARRAYOID, TEXTARRAYOID,
+						  TEXTARRAYOID, TEXTARRAYOID, TEXTARRAYOID,
+						  TEXTARRAYOID, TEXTARRAYOID, TEXTARRAYOID };
+	const char *paramValues[9];
+	PQExpBuffer arrays[9];
+	MonitorNodeReportParseContext parseContext = { reports, reportCount, false };
+	bool success = true;
+	int paramIndex = 0;
+	int reportIndex = 0;
+
+	for (paramIndex = 0; paramIndex < paramCount; paramIndex++)
+	{
+		arrays[paramIndex] = createPQExpBuffer();
+		appendPQExpBufferChar(arrays[paramIndex], '{');
+	}
+
+	for (reportIndex = 0; reportIndex < reportCount; reportIndex++)
+	{
+		MonitorNodeReport *report = &(reports[reportIndex]);
+		IntString portString = intToString(report->port);
+		IntString nodeIdString = intToString(report->nodeId);
+		IntString groupIdString = intToString(report->groupId);
+		const char *values[9];
+
+		report->assigned = false;
+
+		values[0] = report->formation;
+		values[1] = report->host;
+		values[2] = portString.strValue;
+		values[3] = nodeIdString.strValue;
+		values[4] = groupIdString.strValue;
+		values[5] = NodeStateToString(report->currentState);
+		values[6] = report->pgIsRunning ? "true" : "false";
+		values[7] = report->currentLSN;
+		values[8] = report->pgsrSyncState;
+
+		for (paramIndex = 0; paramIndex < paramCount; paramIndex++)
+		{
+			if (reportIndex > 0)
+			{
+				appendPQExpBufferChar(arrays[paramIndex], ',');
+			}
+			appendArrayElement(arrays[paramIndex], values[paramIndex]);
+		}
+	}
+
+	for (paramIndex = 0; paramIndex < paramCount; paramIndex++)
+	{
+		appendPQExpBufferChar(arrays[paramIndex], '}');
+		paramValues[paramIndex] = arrays[paramIndex]->data;
+	}
+
+	/* the monitor tells us when it's too busy to run the state machine */
+	pgsql->retryAfterMs = 0;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseNodeReports))
+	{
+		log_error("Failed to report the state of %d nodes to the monitor, "
+				  "see previous lines for details", reportCount);
+		success = false;
+	}
+	else if (!parseContext.parsedOK)
+	{
+		log_error("Failed to report the state of %d nodes to the monitor "
+				  "because the monitor returned an unexpected result, "
+				  "see previous lines for details", reportCount);
+		success = false;
+	}
+
+	for (paramIndex = 0; paramIndex < paramCount; paramIndex++)
+	{
+		destroyPQExpBuffer(arrays[paramIndex]);
+	}
+
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
+
+	return success;
+}
+
+
+/*
+ * appendArrayElement appends value to a Postgres array literal that is being
+ * built in buffer, as a double-quoted element.
+ */
+static void
+appendArrayElement(PQExpBuffer buffer, const char *value)
+{
+	const char *ptr = NULL;
+
+	appendPQExpBufferChar(buffer, '"');
+
+	for (ptr = value; *ptr != '\0'; ptr++)
+	{
+		if (*ptr == '"' || *ptr == '\\')
+		{
+			appendPQExpBufferChar(buffer, '\\');
+		}
+		appendPQExpBufferChar(buffer, *ptr);
+	}
+
+	appendPQExpBufferChar(buffer, '"');
+}
+
+
 /*
  * monitor_remove calls the pgautofailover.monitor_remove function on the monitor.
  */
@@ -372,8 +868,8 @@ monitor_remove(Monitor *monitor, char *host, int port)
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
 
 	if (!context.parsedOk)
 	{
@@ -395,38 +891,173 @@ monitor_remove(Monitor *monitor, char *host, int port)
 
 
 /*
- * parseNode parses a hostname and a port from the libpq result and writes
- * it to the NodeAddressParseContext pointed to by ctx.
+ * monitor_report_transition_timings sends the timings of a state transition
+ * of the given node to the monitor, where they are kept in the
+ * pgautofailover.transition_timing table.
  */
-static void
-parseNode(void *ctx, PGresult *result)
+bool
+monitor_report_transition_timings(Monitor *monitor, char *host, int port,
+								  TransitionTimings *timings)
 {
-	NodeAddressParseContext *context = (NodeAddressParseContext *) ctx;
-	char *value = NULL;
-	int hostLength = 0;
+	SingleValueResultContext context;
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.report_transition_timings($1, $2, "
+		"$3::pgautofailover.replication_state, "
+		"$4::pgautofailover.replication_state, $5, $6, $7)";
+	int paramCount = 7;
+	Oid paramTypes[7] = {
+		TEXTOID, INT4OID, TEXTOID, TEXTOID, BOOLOID, FLOAT8OID, TEXTOID
+	};
+	const char *paramValues[7];
+	char durationMs[BUFSIZE] = { 0 };
+	PQExpBuffer spans = createPQExpBuffer();
 
-	if (PQntuples(result) != 1)
+	if (spans == NULL)
 	{
-		log_error("Query returned %d rows, expected 1", PQntuples(result));
-		context->parsedOK = false;
-		return;
+		log_error("Failed to allocate memory");
+		return false;
 	}
 
-	if (PQnfields(result) != 2)
+	(void) timings_format_spans(timings, spans);
+
+	if (PQExpBufferBroken(spans))
 	{
-		log_error("Query returned %d columns, expected 2", PQnfields(result));
-		context->parsedOK = false;
-		return;
+		log_error("Failed to allocate memory");
+		destroyPQExpBuffer(spans);
+		return false;
 	}
 
-	if (PQgetisnull(result, 0, 0) || PQgetisnull(result, 0, 1))
+	snprintf(durationMs, BUFSIZE, "%.3f", timings->durationMs);
+
+	paramValues[0] = host;
+	paramValues[1] = intToString(port).strValue;
+	paramValues[2] = NodeStateToString(timings->current);
+	paramValues[3] = NodeStateToString(timings->assigned);
+	paramValues[4] = timings->success ? "true" : "false";
+	paramValues[5] = durationMs;
+	paramValues[6] = spans->data;
+
+	context.resultType = PGSQL_RESULT_BOOL;
+	context.parsedOk = false;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
 	{
-		log_error("Hostname or port returned by monitor is NULL");
-		context->parsedOK = false;
-		return;
+		log_error("Failed to report transition timings of node %s:%d "
+				  "to the monitor", host, port);
+		destroyPQExpBuffer(spans);
+		return false;
 	}
 
-	value = PQgetvalue(result, 0, 0);
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
+
+	destroyPQExpBuffer(spans);
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to report transition timings of node %s:%d "
+				  "to the monitor: could not parse monitor's result.",
+				  host, port);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_report_hook_result sends the result of a transition hook of the
+ * given node to the monitor, where it's kept as an event.
+ */
+bool
+monitor_report_hook_result(Monitor *monitor, char *host, int port,
+						   HookResult *result)
+{
+	SingleValueResultContext context;
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.report_hook_result($1, $2, $3, "
+		"$4::pgautofailover.replication_state, "
+		"$5::pgautofailover.replication_state, $6, $7, $8)";
+	int paramCount = 8;
+	Oid paramTypes[8] = {
+		TEXTOID, INT4OID, TEXTOID, TEXTOID, TEXTOID, BOOLOID, FLOAT8OID, TEXTOID
+	};
+	const char *paramValues[8];
+	char durationMs[BUFSIZE] = { 0 };
+
+	snprintf(durationMs, BUFSIZE, "%.3f", result->durationMs);
+
+	paramValues[0] = host;
+	paramValues[1] = intToString(port).strValue;
+	paramValues[2] = HookEventToString(result->event);
+	paramValues[3] = NodeStateToString(result->fromState);
+	paramValues[4] = NodeStateToString(result->toState);
+	paramValues[5] = result->succeeded ? "true" : "false";
+	paramValues[6] = durationMs;
+	paramValues[7] = result->detail;
+
+	context.resultType = PGSQL_RESULT_BOOL;
+	context.parsedOk = false;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to report the result of a hook of node %s:%d "
+				  "to the monitor", host, port);
+		return false;
+	}
+
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to report the result of a hook of node %s:%d "
+				  "to the monitor: could not parse monitor's result.",
+				  host, port);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * parseNode parses a hostname and a port from the libpq result and writes
+ * it to the NodeAddressParseContext pointed to by ctx.
+ */
+static void
+parseNode(void *ctx, PGresult *result)
+{
+	NodeAddressParseContext *context = (NodeAddressParseContext *) ctx;
+	char *value = NULL;
+	int hostLength = 0;
+
+	if (PQntuples(result) != 1)
+	{
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	if (PQnfields(result) != 2)
+	{
+		log_error("Query returned %d columns, expected 2", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	if (PQgetisnull(result, 0, 0) || PQgetisnull(result, 0, 1))
+	{
+		log_error("Hostname or port returned by monitor is NULL");
+		context->parsedOK = false;
+		return;
+	}
+
+	value = PQgetvalue(result, 0, 0);
 	hostLength = strlcpy(context->node->host, value, _POSIX_HOST_NAME_MAX);
 	if (hostLength >= _POSIX_HOST_NAME_MAX)
 	{
@@ -437,21 +1068,196 @@ parseNode(void *ctx, PGresult *result)
 		return;
 	}
 
-	value = PQgetvalue(result, 0, 1);
-	context->node->port = strtol(value, NULL, 0);
-	if (context->node->port == 0)
+	if (!pgsql_get_int4(result, 0, 1, &context->node->port) ||
+		context->node->port == 0)
+	{
+		log_error("Invalid port number returned by monitor");
+		context->parsedOK = false;
+		return;
+	}
+
+	context->parsedOK = true;
+}
+
+
+/*
+ * parseNodeArray parses the node id, hostname, port and last reported LSN of
+ * the nodes returned by get_other_nodes, and writes them to the
+ * NodeAddressArrayParseContext pointed to by ctx.
+ */
+static void
+parseNodeArray(void *ctx, PGresult *result)
+{
+	NodeAddressArrayParseContext *context = (NodeAddressArrayParseContext *) ctx;
+	int rowNumber = 0;
+
+	if (PQntuples(result) > NODE_ARRAY_MAX_COUNT)
+	{
+		log_error("Query returned %d rows, pg_autoctl supports at most %d "
+				  "nodes in a group", PQntuples(result), NODE_ARRAY_MAX_COUNT);
+		context->parsedOK = false;
+		return;
+	}
+
+	if (PQnfields(result) != 4)
+	{
+		log_error("Query returned %d columns, expected 4", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	for (rowNumber = 0; rowNumber < PQntuples(result); rowNumber++)
+	{
+		NodeAddress *node = &(context->nodeArray->nodes[rowNumber]);
+		char *value = PQgetvalue(result, rowNumber, 1);
+		uint64_t lsn = 0;
+
+		if (!pgsql_get_int4(result, rowNumber, 0, &node->nodeId) ||
+			node->nodeId <= 0)
+		{
+			log_error("Invalid node id returned by monitor");
+			context->parsedOK = false;
+			return;
+		}
+
+		if (strlcpy(node->host, value, _POSIX_HOST_NAME_MAX) >=
+			_POSIX_HOST_NAME_MAX)
+		{
+			log_error("Hostname \"%s\" returned by monitor is too long, "
+					  "the maximum supported by pg_autoctl is %d characters",
+					  value, _POSIX_HOST_NAME_MAX - 1);
+			context->parsedOK = false;
+			return;
+		}
+
+		if (!pgsql_get_int4(result, rowNumber, 2, &node->port) ||
+			node->port == 0)
+		{
+			log_error("Invalid port number returned by monitor");
+			context->parsedOK = false;
+			return;
+		}
+
+		if (!pgsql_get_lsn(result, rowNumber, 3, &lsn))
+		{
+			log_error("Invalid LSN returned by monitor");
+			context->parsedOK = false;
+			return;
+		}
+
+		pgsql_format_lsn(lsn, context->nodeArray->lsn[rowNumber],
+						 PG_LSN_MAXLENGTH);
+	}
+
+	context->nodeArray->count = PQntuples(result);
+	context->parsedOK = true;
+}
+
+
+/*
+ * parseNodeReports parses the rows returned by node_active_batch, and sets
+ * the assigned state of the report for the same node name and port. The
+ * reports that the monitor failed to run are logged, and stay unassigned.
+ */
+static void
+parseNodeReports(void *ctx, PGresult *result)
+{
+	MonitorNodeReportParseContext *context =
+		(MonitorNodeReportParseContext *) ctx;
+	int rowNumber = 0;
+	int errors = 0;
+
+	if (PQnfields(result) != 6)
+	{
+		log_error("Query returned %d columns, expected 6", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	for (rowNumber = 0; rowNumber < PQntuples(result); rowNumber++)
+	{
+		char *nodeName = PQgetvalue(result, rowNumber, 0);
+		char *value = PQgetvalue(result, rowNumber, 1);
+		MonitorNodeReport *report = NULL;
+		int nodePort = 0;
+		int reportIndex = 0;
+
+		if (sscanf(value, "%d", &nodePort) != 1)
+		{
+			log_error("Invalid node port \"%s\" returned by monitor", value);
+			++errors;
+			continue;
+		}
+
+		for (reportIndex = 0; reportIndex < context->reportCount; reportIndex++)
+		{
+			if (strcmp(context->reports[reportIndex].host, nodeName) == 0 &&
+				context->reports[reportIndex].port == nodePort)
+			{
+				report = &(context->reports[reportIndex]);
+				break;
+			}
+		}
+
+		if (report == NULL)
+		{
+			log_error("The monitor returned a state for unknown node %s:%d",
+					  nodeName, nodePort);
+			++errors;
+			continue;
+		}
+
+		if (!PQgetisnull(result, rowNumber, 5))
+		{
+			/* the other reports of the batch went through */
+			log_error("Failed to report the state of node %s:%d "
+					  "to the monitor: %s",
+					  nodeName, nodePort, PQgetvalue(result, rowNumber, 5));
+			continue;
+		}
+
+		value = PQgetvalue(result, rowNumber, 2);
+		if (sscanf(value, "%d", &report->assignedState.nodeId) != 1)
+		{
+			log_error("Invalid node ID \"%s\" returned by monitor", value);
+			++errors;
+			continue;
+		}
+
+		value = PQgetvalue(result, rowNumber, 3);
+		if (sscanf(value, "%d", &report->assignedState.groupId) != 1)
+		{
+			log_error("Invalid group ID \"%s\" returned by monitor", value);
+			++errors;
+			continue;
+		}
+
+		value = PQgetvalue(result, rowNumber, 4);
+		report->assignedState.state = NodeStateFromString(value);
+		if (report->assignedState.state == NO_STATE)
+		{
+			log_error("Invalid node state \"%s\" returned by monitor", value);
+			++errors;
+			continue;
+		}
+
+		report->assigned = true;
+	}
+
+	if (errors > 0)
 	{
-		log_error("Invalid port number \"%s\" returned by monitor", value);
 		context->parsedOK = false;
+		return;
 	}
 
+	/* if we reach this line, then we're good. */
 	context->parsedOK = true;
 }
 
 
 /*
  * parseNodeState parses a node state coming back from a call to
- * register_node or node_active.
+ * register_node, node_active or node_active_peers.
  */
 static void
 parseNodeState(void *ctx, PGresult *result)
@@ -459,6 +1265,7 @@ parseNodeState(void *ctx, PGresult *result)
 	MonitorAssignedStateParseContext *context = (MonitorAssignedStateParseContext *) ctx;
 	char *value = NULL;
 	int errors = 0;
+	int expectedColumns = context->peers == NULL ? 3 : NODE_ACTIVE_PEERS_COLUMNS;
 
 	if (PQntuples(result) != 1)
 	{
@@ -467,27 +1274,27 @@ parseNodeState(void *ctx, PGresult *result)
 		return;
 	}
 
-	if (PQnfields(result) != 3)
+	if (PQnfields(result) != expectedColumns)
 	{
-		log_error("Query returned %d columns, expected 3", PQnfields(result));
+		log_error("Query returned %d columns, expected %d",
+				  PQnfields(result), expectedColumns);
 		context->parsedOK = false;
 		return;
 	}
 
-	value = PQgetvalue(result, 0, 0);
-	if (sscanf(value, "%d", &context->assignedState->nodeId) != 1)
+	if (!pgsql_get_int4(result, 0, 0, &context->assignedState->nodeId))
 	{
-		log_error("Invalid node ID \"%s\" returned by monitor", value);
+		log_error("Invalid node ID returned by monitor");
 		++errors;
 	}
 
-	value = PQgetvalue(result, 0, 1);
-	if (sscanf(value, "%d", &context->assignedState->groupId) != 1)
+	if (!pgsql_get_int4(result, 0, 1, &context->assignedState->groupId))
 	{
-		log_error("Invalid group ID \"%s\" returned by monitor", value);
+		log_error("Invalid group ID returned by monitor");
 		++errors;
 	}
 
+	/* in binary format too, an enum value is sent as its label */
 	value = PQgetvalue(result, 0, 2);
 	context->assignedState->state = NodeStateFromString(value);
 	if (context->assignedState->state == NO_STATE)
@@ -496,6 +1303,11 @@ parseNodeState(void *ctx, PGresult *result)
 		++errors;
 	}
 
+	if (context->peers != NULL && !parseNodePeers(result, context->peers))
+	{
+		++errors;
+	}
+
 	if (errors > 0)
 	{
 		context->parsedOK = false;
@@ -507,9 +1319,91 @@ parseNodeState(void *ctx, PGresult *result)
 }
 
 
+/*
+ * parseNodePeers parses the other node, the primary node, the
+ * synchronous_commit and the upstream node columns of a node_active_peers
+ * result. Any of the nodes is NULL when the group has no such node at the
+ * moment.
+ */
+static bool
+parseNodePeers(PGresult *result, MonitorPeers *peers)
+{
+	uint64_t otherNodeLSN = 0;
+
+	peers->hasOtherNode = !PQgetisnull(result, 0, 3);
+
+	if (peers->hasOtherNode)
+	{
+		if (strlcpy(peers->otherNode.host, PQgetvalue(result, 0, 3),
+					_POSIX_HOST_NAME_MAX) >= _POSIX_HOST_NAME_MAX ||
+			!pgsql_get_int4(result, 0, 4, &peers->otherNode.port) ||
+			!pgsql_get_lsn(result, 0, 5, &otherNodeLSN) ||
+			!pgsql_get_int4(result, 0, 6, &peers->otherNodeHealth) ||
+			!pgsql_get_int4(result, 0, 10, &peers->otherNode.nodeId))
+		{
+			log_error("Invalid other node returned by monitor");
+			return false;
+		}
+
+		pgsql_format_lsn(otherNodeLSN, peers->otherNodeLSN, PG_LSN_MAXLENGTH);
+	}
+
+	peers->hasPrimaryNode = !PQgetisnull(result, 0, 7);
+
+	if (peers->hasPrimaryNode)
+	{
+		if (strlcpy(peers->primaryNode.host, PQgetvalue(result, 0, 7),
+					_POSIX_HOST_NAME_MAX) >= _POSIX_HOST_NAME_MAX ||
+			!pgsql_get_int4(result, 0, 8, &peers->primaryNode.port))
+		{
+			log_error("Invalid primary node returned by monitor");
+			return false;
+		}
+	}
+
+	if (PQgetisnull(result, 0, 9))
+	{
+		peers->synchronousCommit[0] = '\0';
+	}
+	else if (strlcpy(peers->synchronousCommit, PQgetvalue(result, 0, 9),
+					 NAMEDATALEN) >= NAMEDATALEN)
+	{
+		log_error("Invalid synchronous_commit returned by monitor");
+		return false;
+	}
+
+	peers->hasUpstreamNode = !PQgetisnull(result, 0, 11);
+
+	if (peers->hasUpstreamNode)
+	{
+		if (strlcpy(peers->upstreamNode.host, PQgetvalue(result, 0, 11),
+					_POSIX_HOST_NAME_MAX) >= _POSIX_HOST_NAME_MAX ||
+			!pgsql_get_int4(result, 0, 12, &peers->upstreamNode.port))
+		{
+			log_error("Invalid upstream node returned by monitor");
+			return false;
+		}
+	}
+
+	if (PQgetisnull(result, 0, 13))
+	{
+		peers->synchronousStandbyNames[0] = '\0';
+	}
+	else if (strlcpy(peers->synchronousStandbyNames, PQgetvalue(result, 0, 13),
+					 BUFSIZE) >= BUFSIZE)
+	{
+		log_error("Invalid synchronous_standby_names returned by monitor");
+		return false;
+	}
+
+	return true;
+}
+
+
 /*
  * monitor_print_state calls the function pgautofailover.current_state on the monitor,
- * and prints a line of output per state record obtained.
+ * and prints a line of output per state record obtained, along with the WAL
+ * that the replication slot of a primary retains while its standby is away.
  */
 bool
 monitor_print_state(Monitor *monitor, char *formation, int group)
@@ -528,7 +1422,12 @@ monitor_print_state(Monitor *monitor, char *formation, int group)
 	{
 		case -1:
 		{
-			sql = "SELECT * FROM pgautofailover.current_state($1)";
+			sql =
+				"SELECT s.*, pg_size_pretty(n.slotretainedwal) "
+				"  FROM pgautofailover.current_state($1) s "
+				"  JOIN pgautofailover.node n "
+				"    ON n.nodename = s.nodename AND n.nodeport = s.nodeport "
+				"ORDER BY s.group_id, s.node_id";
 
 			paramCount = 1;
 			paramTypes[0] = TEXTOID;
@@ -539,7 +1438,12 @@ monitor_print_state(Monitor *monitor, char *formation, int group)
 
 		default:
 		{
-			sql = "SELECT * FROM pgautofailover.current_state($1,$2)";
+			sql =
+				"SELECT s.*, pg_size_pretty(n.slotretainedwal) "
+				"  FROM pgautofailover.current_state($1,$2) s "
+				"  JOIN pgautofailover.node n "
+				"    ON n.nodename = s.nodename AND n.nodeport = s.nodeport "
+				"ORDER BY s.group_id, s.node_id";
 
 			groupStr = intToString(group);
 
@@ -560,8 +1464,8 @@ monitor_print_state(Monitor *monitor, char *formation, int group)
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
 
 	if (!context.parsedOK)
 	{
@@ -587,9 +1491,9 @@ printCurrentState(void *ctx, PGresult *result)
 	int maxNodeNameSize = 5;	/* strlen("Name") + 1, the header */
 	char *nameSeparatorHeader = NULL;
 
-	if (PQnfields(result) != 6)
+	if (PQnfields(result) != 7)
 	{
-		log_error("Query returned %d columns, expected 6", PQnfields(result));
+		log_error("Query returned %d columns, expected 7", PQnfields(result));
 		context->parsedOK = false;
 		return;
 	}
@@ -623,13 +1527,15 @@ printCurrentState(void *ctx, PGresult *result)
 		}
 	}
 
-	fprintf(stdout, "%*s | %6s | %5s | %5s | %17s | %17s\n",
+	fprintf(stdout, "%*s | %6s | %5s | %5s | %17s | %17s | %12s\n",
 			maxNodeNameSize, "Name", "Port",
-			"Group", "Node", "Current State", "Assigned State");
+			"Group", "Node", "Current State", "Assigned State",
+			"Retained WAL");
 
-	fprintf(stdout, "%*s-+-%6s-+-%5s-+-%5s-+-%17s-+-%17s\n",
+	fprintf(stdout, "%*s-+-%6s-+-%5s-+-%5s-+-%17s-+-%17s-+-%12s\n",
 			maxNodeNameSize, nameSeparatorHeader, "------",
-			"-----", "-----", "-----------------", "-----------------");
+			"-----", "-----", "-----------------", "-----------------",
+			"------------");
 
 	free(nameSeparatorHeader);
 
@@ -641,10 +1547,11 @@ printCurrentState(void *ctx, PGresult *result)
 		char *nodeId = PQgetvalue(result, currentTupleIndex, 3);
 		char *currentState = PQgetvalue(result, currentTupleIndex, 4);
 		char *goalState = PQgetvalue(result, currentTupleIndex, 5);
+		char *retainedWAL = PQgetvalue(result, currentTupleIndex, 6);
 
-		fprintf(stdout, "%*s | %6s | %5s | %5s | %17s | %17s\n",
+		fprintf(stdout, "%*s | %6s | %5s | %5s | %17s | %17s | %12s\n",
 				maxNodeNameSize, nodename, nodeport,
-				groupId, nodeId, currentState, goalState);
+				groupId, nodeId, currentState, goalState, retainedWAL);
 	}
 	fprintf(stdout, "\n");
 
@@ -715,8 +1622,8 @@ monitor_print_last_events(Monitor *monitor, char *formation, int group, int coun
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
 
 	if (!context.parsedOK)
 	{
@@ -810,8 +1717,8 @@ monitor_create_formation(Monitor *monitor, char *formation, char *kind, char *db
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
 
 
 	return true;
@@ -842,8 +1749,8 @@ monitor_enable_secondary_for_formation(Monitor *monitor, const char *formation)
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
 
 	return true;
 }
@@ -877,8 +1784,8 @@ monitor_disable_secondary_for_formation(Monitor *monitor, const char *formation)
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
 
 	return true;
 }
@@ -908,8 +1815,8 @@ monitor_drop_formation(Monitor *monitor, char *formation)
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
 
 	return true;
 }
@@ -917,139 +1824,692 @@ monitor_drop_formation(Monitor *monitor, char *formation)
 
 /*
  * monitor_formation_uri calls the SQL API on the monitor that returns the connection
- * string that can be used by applications to connect to the formation.
+ * string that can be used by applications to connect to the formation. When
+ * role is not NULL, the connection string only targets the nodes that fit
+ * that role, and load balances the connections among them.
  */
 bool
-monitor_formation_uri(Monitor *monitor, const char *formation, char *connectionString,
-					  size_t size)
+monitor_formation_uri(Monitor *monitor, const char *formation, const char *role,
+					  char *connectionString, size_t size)
 {
 	SingleValueResultContext context;
 	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql = role == NULL
+					  ? "SELECT formation_uri FROM pgautofailover.formation_uri($1)"
+					  : "SELECT formation_uri FROM pgautofailover.formation_uri($1, $2)";
+	int paramCount = role == NULL ? 1 : 2;
+	Oid paramTypes[2] = { TEXTOID, TEXTOID };
+	const char *paramValues[2];
+
+	context.resultType = PGSQL_RESULT_STRING;
+	context.parsedOk = false;
+
+	paramValues[0] = formation;
+	paramValues[1] = role;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to list the formation uri for \"%s\", "
+				  "see previous lines for details.",
+				  formation);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (context.strVal == NULL || strcmp(context.strVal, "") == 0)
+	{
+		if (role == NULL)
+		{
+			log_error("Formation \"%s\" currently has no nodes in group 0",
+					  formation);
+		}
+		else
+		{
+			log_error("Formation \"%s\" currently has no %s nodes in group 0",
+					  formation, role);
+		}
+		return false;
+	}
+
+	strlcpy(connectionString, context.strVal, size);
+
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
+
+	return true;
+}
+
+
+/*
+ * monitor_get_formation_monitor gets the URI of the monitor that the given
+ * formation has been delegated to, when this monitor is the root of regional
+ * monitors. delegated is set to false when the nodes of the formation
+ * register with this monitor.
+ */
+bool
+monitor_get_formation_monitor(Monitor *monitor, const char *formation,
+							  char *monitorURI, size_t size, bool *delegated)
+{
+	SingleValueResultContext context;
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.formation_monitor($1)";
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1];
+
+	context.resultType = PGSQL_RESULT_STRING;
+	context.parsedOk = false;
+
+	paramValues[0] = formation;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to get the monitor of formation \"%s\", "
+				  "see previous lines for details.",
+				  formation);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	*delegated = context.strVal != NULL && strcmp(context.strVal, "") != 0;
+
+	if (*delegated)
+	{
+		strlcpy(monitorURI, context.strVal, size);
+	}
+
+	free(context.strVal);
+
+	return true;
+}
+
+
+/*
+ * monitor_synchronous_standby_names gets the synchronous_standby_names
+ * setting that the monitor computes for the primary of the given group: a
+ * quorum of the healthy standbys, listed by application_name, such as
+ * ANY 1 (pgautofailover_standby_2, pgautofailover_standby_3).
+ */
+bool
+monitor_synchronous_standby_names(Monitor *monitor, const char *formation,
+								  int groupId, char *standbyNames, size_t size)
+{
+	SingleValueResultContext context;
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.synchronous_standby_names($1, $2)";
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, INT4OID };
+	const char *paramValues[2];
+	IntString groupIdString = intToString(groupId);
+
+	context.resultType = PGSQL_RESULT_STRING;
+	context.parsedOk = false;
+	context.strVal = NULL;
+
+	paramValues[0] = formation;
+	paramValues[1] = groupIdString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to get the synchronous_standby_names setting for "
+				  "group %d of formation \"%s\", see previous lines for details.",
+				  groupId, formation);
+		return false;
+	}
+
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
+
+	if (!context.parsedOk || context.strVal == NULL ||
+		IS_EMPTY_STRING_BUFFER(context.strVal))
+	{
+		log_error("The monitor has no synchronous_standby_names setting for "
+				  "group %d of formation \"%s\"", groupId, formation);
+		free(context.strVal);
+		return false;
+	}
+
+	strlcpy(standbyNames, context.strVal, size);
+	free(context.strVal);
+
+	return true;
+}
+
+
+/*
+ * monitor_get_delegated_monitors gets the URIs of the monitors that the
+ * formations of this monitor have been delegated to, at most maxCount of
+ * them.
+ */
+bool
+monitor_get_delegated_monitors(Monitor *monitor,
+							   char monitorURIs[][MAXCONNINFO],
+							   int maxCount, int *count)
+{
+	MonitorURIsParseContext context = { monitorURIs, maxCount, 0, false };
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT DISTINCT monitoruri FROM pgautofailover.delegated_formation "
+		"ORDER BY monitoruri";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseMonitorURIs))
+	{
+		log_error("Failed to get the monitors that formations are "
+				  "delegated to, see previous lines for details.");
+		return false;
+	}
+
+	if (!context.parsedOK)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	*count = context.count;
+
+	return true;
+}
+
+
+/*
+ * parseMonitorURIs copies the monitor URIs of the first column of the result
+ * to the context array.
+ */
+static void
+parseMonitorURIs(void *ctx, PGresult *result)
+{
+	MonitorURIsParseContext *context = (MonitorURIsParseContext *) ctx;
+	int rowNumber = 0;
+
+	if (PQntuples(result) > context->maxCount)
+	{
+		log_error("Query returned %d monitors, the maximum is %d",
+				  PQntuples(result), context->maxCount);
+		context->parsedOK = false;
+		return;
+	}
+
+	for (rowNumber = 0; rowNumber < PQntuples(result); rowNumber++)
+	{
+		strlcpy(context->monitorURIs[rowNumber],
+				PQgetvalue(result, rowNumber, 0), MAXCONNINFO);
+	}
+
+	context->count = PQntuples(result);
+	context->parsedOK = true;
+}
+
+
+/*
+ * parseCoordinatorNode parses a hostname and a port from the libpq result and
+ * writes it to the NodeAddressParseContext pointed to by ctx. This is about
+ * the same as parseNode: the only difference is that an empty result set is
+ * not an error condition in parseCoordinatorNode.
+ */
+static void
+parseCoordinatorNode(void *ctx, PGresult *result)
+{
+	NodeAddressParseContext *context = (NodeAddressParseContext *) ctx;
+	char *value = NULL;
+	int hostLength = 0;
+
+	/* no rows, set the node to NULL, return */
+	if (PQntuples(result) == 0)
+	{
+		context->node = NULL;
+		context->parsedOK = true;
+		return;
+	}
+
+	/* we have rows: we accept only one */
+	if (PQntuples(result) != 1)
+	{
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	if (PQnfields(result) != 2)
+	{
+		log_error("Query returned %d columns, expected 2", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	if (PQgetisnull(result, 0, 0) || PQgetisnull(result, 0, 1))
+	{
+		log_error("Hostname or port returned by monitor is NULL");
+		context->parsedOK = false;
+		return;
+	}
+
+	value = PQgetvalue(result, 0, 0);
+	hostLength = strlcpy(context->node->host, value, _POSIX_HOST_NAME_MAX);
+	if (hostLength >= _POSIX_HOST_NAME_MAX)
+	{
+		log_error("Hostname \"%s\" returned by monitor is %d characters, "
+				  "the maximum supported by pg_autoctl is %d",
+				  value, hostLength, _POSIX_HOST_NAME_MAX - 1);
+		context->parsedOK = false;
+		return;
+	}
+
+	value = PQgetvalue(result, 0, 1);
+	context->node->port = strtol(value, NULL, 0);
+	if (context->node->port == 0)
+	{
+		log_error("Invalid port number \"%s\" returned by monitor", value);
+		context->parsedOK = false;
+	}
+
+	context->parsedOK = true;
+}
+
+
+/*
+ * monitor_start_maintenance calls the pgautofailover.start_maintenance(node,
+ * port) on the monitor, so that the monitor assigns the MAINTENANCE_STATE at
+ * the next call to node_active().
+ */
+bool
+monitor_start_maintenance(Monitor *monitor, char *host, int port)
+{
+	SingleValueResultContext context;
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql = "SELECT pgautofailover.start_maintenance($1, $2)";
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, INT4OID };
+	const char *paramValues[2];
+
+	paramValues[0] = host;
+	paramValues[1] = intToString(port).strValue;
+
+	context.resultType = PGSQL_RESULT_BOOL;
+	context.parsedOk = false;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to start_maintenance of node %s:%d from the monitor",
+				  host, port);
+		return false;
+	}
+
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to start_maintenance of node %s:%d from the monitor: "
+				  "could not parse monitor's result.", host, port);
+		return false;
+	}
+
+	return context.boolVal;
+}
+
+
+/*
+ * monitor_stop_maintenance calls the pgautofailover.start_maintenance(node,
+ * port) on the monitor, so that the monitor assigns the CATCHINGUP_STATE at
+ * the next call to node_active().
+ */
+bool
+monitor_stop_maintenance(Monitor *monitor, char *host, int port)
+{
+	SingleValueResultContext context;
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql = "SELECT pgautofailover.stop_maintenance($1, $2)";
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, INT4OID };
+	const char *paramValues[2];
+
+	paramValues[0] = host;
+	paramValues[1] = intToString(port).strValue;
+
+	context.resultType = PGSQL_RESULT_BOOL;
+	context.parsedOk = false;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to stop_maintenance of node %s:%d from the monitor",
+				  host, port);
+		return false;
+	}
+
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to stop_maintenance of node %s:%d from the monitor: "
+				  "could not parse monitor's result.", host, port);
+		return false;
+	}
+
+	return context.boolVal;
+}
+
+
+/*
+ * monitor_report_retained_wal calls pgautofailover.report_retained_wal(node,
+ * port, bytes) on the monitor, to record how much WAL our replication slot
+ * retains while the standby is away. A negative amount of bytes resets the
+ * value to NULL, once the standby is back.
+ */
+bool
+monitor_report_retained_wal(Monitor *monitor, char *host, int port,
+							int64_t retainedWALBytes)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql = "SELECT pgautofailover.report_retained_wal($1, $2, $3)";
+	int paramCount = 3;
+	Oid paramTypes[3] = { TEXTOID, INT4OID, INT8OID };
+	const char *paramValues[3];
+	IntString portString = intToString(port);
+	IntString bytesString = intToString(retainedWALBytes);
+
+	paramValues[0] = host;
+	paramValues[1] = portString.strValue;
+	paramValues[2] = retainedWALBytes < 0 ? NULL : bytesString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   NULL, NULL))
+	{
+		log_error("Failed to report the WAL retained for the standby of "
+				  "node %s:%d to the monitor", host, port);
+		return false;
+	}
+
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
+
+	return true;
+}
+
+
+/*
+ * monitor_report_wal_source calls pgautofailover.report_wal_source(node, port,
+ * source, bytes) on the monitor, to record whether a standby streams its WAL
+ * or replays it from the archive, and how far behind the archiver of a
+ * primary is. An empty source or a negative amount of bytes is NULL.
+ */
+bool
+monitor_report_wal_source(Monitor *monitor, char *host, int port,
+						  const char *walSource, int64_t archiveLagBytes)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql = "SELECT pgautofailover.report_wal_source($1, $2, $3, $4)";
+	int paramCount = 4;
+	Oid paramTypes[4] = { TEXTOID, INT4OID, TEXTOID, INT8OID };
+	const char *paramValues[4];
+	IntString portString = intToString(port);
+	IntString bytesString = intToString(archiveLagBytes);
+
+	paramValues[0] = host;
+	paramValues[1] = portString.strValue;
+	paramValues[2] = IS_EMPTY_STRING_BUFFER(walSource) ? NULL : walSource;
+	paramValues[3] = archiveLagBytes < 0 ? NULL : bytesString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   NULL, NULL))
+	{
+		log_error("Failed to report the WAL source of node %s:%d "
+				  "to the monitor", host, port);
+		return false;
+	}
+
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
+
+	return true;
+}
+
+
+/*
+ * monitor_release_standby_slot calls pgautofailover.release_standby_slot(node,
+ * port, bytes, standby) on the monitor, once we dropped the replication slot
+ * of the given standby node that retained too much WAL, so that the monitor
+ * has the standby initialise again.
+ */
+bool
+monitor_release_standby_slot(Monitor *monitor, char *host, int port,
+							 int64_t retainedWALBytes, int standbyNodeId)
+{
+	SingleValueResultContext context;
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.release_standby_slot($1, $2, $3, $4)";
+	int paramCount = 4;
+	Oid paramTypes[4] = { TEXTOID, INT4OID, INT8OID, INT4OID };
+	const char *paramValues[4];
+	IntString portString = intToString(port);
+	IntString bytesString = intToString(retainedWALBytes);
+	IntString standbyNodeIdString = intToString(standbyNodeId);
+
+	paramValues[0] = host;
+	paramValues[1] = portString.strValue;
+	paramValues[2] = bytesString.strValue;
+	paramValues[3] = standbyNodeIdString.strValue;
+
+	context.resultType = PGSQL_RESULT_BOOL;
+	context.parsedOk = false;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to release the standby slot of node %s:%d "
+				  "from the monitor", host, port);
+		return false;
+	}
+
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to release the standby slot of node %s:%d "
+				  "from the monitor: could not parse monitor's result.",
+				  host, port);
+		return false;
+	}
+
+	return context.boolVal;
+}
+
+
+/*
+ * monitor_rolling_operation starts an operation on every group of the given
+ * formation, at most maxParallel groups at a time, and sets operationId to
+ * the identifier of the operation that rolling_operation_step advances.
+ */
+bool
+monitor_rolling_operation(Monitor *monitor, const char *formation,
+						  const char *operation, int maxParallel,
+						  int64_t *operationId)
+{
+	SingleValueResultContext context;
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.rolling_operation($1, $2, $3)";
+	int paramCount = 3;
+	Oid paramTypes[3] = { TEXTOID, TEXTOID, INT4OID };
+	const char *paramValues[3];
+	IntString maxParallelString = intToString(maxParallel);
+
+	paramValues[0] = formation;
+	paramValues[1] = operation;
+	paramValues[2] = maxParallelString.strValue;
+
+	context.resultType = PGSQL_RESULT_BIGINT;
+	context.parsedOk = false;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to start a rolling %s of formation \"%s\" "
+				  "on the monitor", operation, formation);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to start a rolling %s of formation \"%s\" "
+				  "on the monitor: could not parse monitor's result.",
+				  operation, formation);
+		return false;
+	}
+
+	*operationId = (int64_t) context.bigint;
+
+	return true;
+}
+
+
+/*
+ * monitor_rolling_operation_step advances the given rolling operation on the
+ * monitor, and gets the state of each of its groups.
+ */
+bool
+monitor_rolling_operation_step(Monitor *monitor, int64_t operationId,
+							   MonitorRollingGroup *groups,
+							   int maxCount, int *count)
+{
+	MonitorRollingGroupsParseContext context = { groups, maxCount, 0, false };
+	PGSQL *pgsql = &monitor->pgsql;
 	const char *sql =
-		"SELECT formation_uri FROM pgautofailover.formation_uri($1)";
+		"SELECT group_id, group_state, node_name, node_port, group_detail "
+		"FROM pgautofailover.rolling_operation_step($1)";
 	int paramCount = 1;
-	Oid paramTypes[1] = { TEXTOID };
+	Oid paramTypes[1] = { INT8OID };
 	const char *paramValues[1];
+	char operationIdString[BUFSIZE];
 
-	context.resultType = PGSQL_RESULT_STRING;
-	context.parsedOk = false;
-
-	paramValues[0] = formation;
+	snprintf(operationIdString, BUFSIZE, "%" PRId64, operationId);
+	paramValues[0] = operationIdString;
 
 	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
-								   &context, &parseSingleValueResult))
+								   &context, &parseRollingGroups))
 	{
-		log_error("Failed to list the formation uri for \"%s\", "
-				  "see previous lines for details.",
-				  formation);
+		log_error("Failed to advance rolling operation %" PRId64
+				  " on the monitor", operationId);
 		return false;
 	}
 
-	if (!context.parsedOk)
+	if (!context.parsedOK)
 	{
 		/* errors have already been logged */
 		return false;
 	}
 
-	if (context.strVal == NULL || strcmp(context.strVal, "") == 0)
-	{
-		log_error("Formation \"%s\" currently has no nodes in group 0",
-				  formation);
-		return false;
-	}
-
-	strlcpy(connectionString, context.strVal, size);
-
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
+	*count = context.count;
 
 	return true;
 }
 
 
 /*
- * parseCoordinatorNode parses a hostname and a port from the libpq result and
- * writes it to the NodeAddressParseContext pointed to by ctx. This is about
- * the same as parseNode: the only difference is that an empty result set is
- * not an error condition in parseCoordinatorNode.
+ * parseRollingGroups parses the groups returned by rolling_operation_step.
  */
 static void
-parseCoordinatorNode(void *ctx, PGresult *result)
+parseRollingGroups(void *ctx, PGresult *result)
 {
-	NodeAddressParseContext *context = (NodeAddressParseContext *) ctx;
-	char *value = NULL;
-	int hostLength = 0;
-
-	/* no rows, set the node to NULL, return */
-	if (PQntuples(result) == 0)
-	{
-		context->node = NULL;
-		context->parsedOK = true;
-		return;
-	}
+	MonitorRollingGroupsParseContext *context =
+		(MonitorRollingGroupsParseContext *) ctx;
+	int rowNumber = 0;
 
-	/* we have rows: we accept only one */
-	if (PQntuples(result) != 1)
+	if (PQnfields(result) != 5)
 	{
-		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		log_error("Query returned %d columns, expected 5", PQnfields(result));
 		context->parsedOK = false;
 		return;
 	}
 
-	if (PQnfields(result) != 2)
+	if (PQntuples(result) > context->maxCount)
 	{
-		log_error("Query returned %d columns, expected 2", PQnfields(result));
+		log_error("Query returned %d groups, the maximum is %d",
+				  PQntuples(result), context->maxCount);
 		context->parsedOK = false;
 		return;
 	}
 
-	if (PQgetisnull(result, 0, 0) || PQgetisnull(result, 0, 1))
+	for (rowNumber = 0; rowNumber < PQntuples(result); rowNumber++)
 	{
-		log_error("Hostname or port returned by monitor is NULL");
-		context->parsedOK = false;
-		return;
-	}
+		MonitorRollingGroup *group = &(context->groups[rowNumber]);
+		char *value = PQgetvalue(result, rowNumber, 0);
 
-	value = PQgetvalue(result, 0, 0);
-	hostLength = strlcpy(context->node->host, value, _POSIX_HOST_NAME_MAX);
-	if (hostLength >= _POSIX_HOST_NAME_MAX)
-	{
-		log_error("Hostname \"%s\" returned by monitor is %d characters, "
-				  "the maximum supported by pg_autoctl is %d",
-				  value, hostLength, _POSIX_HOST_NAME_MAX - 1);
-		context->parsedOK = false;
-		return;
-	}
+		if (sscanf(value, "%d", &group->groupId) != 1)
+		{
+			log_error("Invalid group id \"%s\" returned by monitor", value);
+			context->parsedOK = false;
+			return;
+		}
 
-	value = PQgetvalue(result, 0, 1);
-	context->node->port = strtol(value, NULL, 0);
-	if (context->node->port == 0)
-	{
-		log_error("Invalid port number \"%s\" returned by monitor", value);
-		context->parsedOK = false;
+		strlcpy(group->state, PQgetvalue(result, rowNumber, 1), NAMEDATALEN);
+		strlcpy(group->nodeName, PQgetvalue(result, rowNumber, 2),
+				_POSIX_HOST_NAME_MAX);
+
+		/* pending groups have no node yet */
+		group->nodePort = 0;
+
+		if (!PQgetisnull(result, rowNumber, 3))
+		{
+			value = PQgetvalue(result, rowNumber, 3);
+
+			if (sscanf(value, "%d", &group->nodePort) != 1)
+			{
+				log_error("Invalid node port \"%s\" returned by monitor", value);
+				context->parsedOK = false;
+				return;
+			}
+		}
+
+		strlcpy(group->detail, PQgetvalue(result, rowNumber, 4), BUFSIZE);
 	}
 
+	context->count = PQntuples(result);
 	context->parsedOK = true;
 }
 
 
 /*
- * monitor_start_maintenance calls the pgautofailover.start_maintenance(node,
- * port) on the monitor, so that the monitor assigns the MAINTENANCE_STATE at
- * the next call to node_active().
+ * monitor_rolling_operation_release has the node of a group of a rolling
+ * maintenance leave the maintenance state, once it's been taken care of.
  */
 bool
-monitor_start_maintenance(Monitor *monitor, char *host, int port)
+monitor_rolling_operation_release(Monitor *monitor, int64_t operationId,
+								  int groupId)
 {
 	SingleValueResultContext context;
 	PGSQL *pgsql = &monitor->pgsql;
-	const char *sql = "SELECT pgautofailover.start_maintenance($1, $2)";
+	const char *sql =
+		"SELECT pgautofailover.rolling_operation_release($1, $2)";
 	int paramCount = 2;
-	Oid paramTypes[2] = { TEXTOID, INT4OID };
+	Oid paramTypes[2] = { INT8OID, INT4OID };
 	const char *paramValues[2];
+	char operationIdString[BUFSIZE];
+	IntString groupIdString = intToString(groupId);
 
-	paramValues[0] = host;
-	paramValues[1] = intToString(port).strValue;
+	snprintf(operationIdString, BUFSIZE, "%" PRId64, operationId);
+	paramValues[0] = operationIdString;
+	paramValues[1] = groupIdString.strValue;
 
 	context.resultType = PGSQL_RESULT_BOOL;
 	context.parsedOk = false;
@@ -1057,18 +2517,16 @@ monitor_start_maintenance(Monitor *monitor, char *host, int port)
 	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
 								   &context, &parseSingleValueResult))
 	{
-		log_error("Failed to start_maintenance of node %s:%d from the monitor",
-				  host, port);
+		log_error("Failed to release group %d of rolling operation %" PRId64
+				  " on the monitor", groupId, operationId);
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
-
 	if (!context.parsedOk)
 	{
-		log_error("Failed to start_maintenance of node %s:%d from the monitor: "
-				  "could not parse monitor's result.", host, port);
+		log_error("Failed to release group %d of rolling operation %" PRId64
+				  " on the monitor: could not parse monitor's result.",
+				  groupId, operationId);
 		return false;
 	}
 
@@ -1077,22 +2535,23 @@ monitor_start_maintenance(Monitor *monitor, char *host, int port)
 
 
 /*
- * monitor_stop_maintenance calls the pgautofailover.start_maintenance(node,
- * port) on the monitor, so that the monitor assigns the CATCHINGUP_STATE at
- * the next call to node_active().
+ * monitor_rolling_operation_cancel ends the given rolling operation, so that
+ * it doesn't start any other group. The groups in progress keep converging.
  */
 bool
-monitor_stop_maintenance(Monitor *monitor, char *host, int port)
+monitor_rolling_operation_cancel(Monitor *monitor, int64_t operationId)
 {
 	SingleValueResultContext context;
 	PGSQL *pgsql = &monitor->pgsql;
-	const char *sql = "SELECT pgautofailover.stop_maintenance($1, $2)";
-	int paramCount = 2;
-	Oid paramTypes[2] = { TEXTOID, INT4OID };
-	const char *paramValues[2];
+	const char *sql =
+		"SELECT pgautofailover.rolling_operation_cancel($1)";
+	int paramCount = 1;
+	Oid paramTypes[1] = { INT8OID };
+	const char *paramValues[1];
+	char operationIdString[BUFSIZE];
 
-	paramValues[0] = host;
-	paramValues[1] = intToString(port).strValue;
+	snprintf(operationIdString, BUFSIZE, "%" PRId64, operationId);
+	paramValues[0] = operationIdString;
 
 	context.resultType = PGSQL_RESULT_BOOL;
 	context.parsedOk = false;
@@ -1100,22 +2559,30 @@ monitor_stop_maintenance(Monitor *monitor, char *host, int port)
 	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
 								   &context, &parseSingleValueResult))
 	{
-		log_error("Failed to stop_maintenance of node %s:%d from the monitor",
-				  host, port);
+		log_error("Failed to cancel rolling operation %" PRId64
+				  " on the monitor", operationId);
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
 
 	if (!context.parsedOk)
 	{
-		log_error("Failed to stop_maintenance of node %s:%d from the monitor: "
-				  "could not parse monitor's result.", host, port);
+		log_error("Failed to cancel rolling operation %" PRId64
+				  " on the monitor: could not parse monitor's result.",
+				  operationId);
 		return false;
 	}
 
-	return context.boolVal;
+	if (!context.boolVal)
+	{
+		log_error("Rolling operation %" PRId64 " is not in progress",
+				  operationId);
+		return false;
+	}
+
+	return true;
 }
 
 
@@ -1169,23 +2636,12 @@ monitor_get_notifications(Monitor *monitor)
 		}
 		else if (strcmp(notify->relname, "state") == 0)
 		{
-			StateNotification notification = { 0 };
-
 			log_debug("received \"%s\"", notify->extra);
 
-			/* the parsing scribbles on the message, make a copy now */
-			strlcpy(notification.message, notify->extra, BUFSIZE);
-
-			/* errors are logged by parse_state_notification_message */
-			if (parse_state_notification_message(&notification))
-			{
-				log_info("New state for %s:%d in formation \"%s\": %s/%s",
-						 notification.nodeName,
-						 notification.nodePort,
-						 notification.formationId,
-						 NodeStateToString(notification.reportedState),
-						 NodeStateToString(notification.goalState));
-			}
+			/* errors are logged by monitor_parse_state_notifications */
+			(void) monitor_parse_state_notifications(notify->extra,
+													 &logStateNotification,
+													 NULL);
 		}
 		else
 		{
@@ -1201,6 +2657,104 @@ monitor_get_notifications(Monitor *monitor)
 }
 
 
+/*
+ * monitor_parse_state_notifications parses the payload of a notification on
+ * the "state" channel, and calls the given callback for each state change
+ * found in it. Current monitors coalesce the state changes of a transaction
+ * in a single payload that begins with "2;", older ones send a single state
+ * change that begins with "S:".
+ */
+bool
+monitor_parse_state_notifications(const char *payload,
+								  StateNotificationCB *callback, void *context)
+{
+	if (strncmp(payload, "2;", 2) == 0)
+	{
+		/*
+		 * A coalesced notification might be larger than BUFSIZE, and the
+		 * parsing scribbles on the message: work on a copy.
+		 */
+		char *message = strdup(payload);
+		char *ptr = NULL;
+		bool success = true;
+
+		if (message == NULL)
+		{
+			log_error("Failed to allocate memory for a notification");
+			return false;
+		}
+
+		ptr = message + 2;
+
+		while (*ptr != '\0')
+		{
+			StateNotification notification = { 0 };
+
+			/* errors are logged by parse_state_notification_entry */
+			ptr = parse_state_notification_entry(ptr, &notification);
+
+			if (ptr == NULL)
+			{
+				success = false;
+				break;
+			}
+
+			(*callback)(context, &notification);
+		}
+
+		free(message);
+
+		return success;
+	}
+	else
+	{
+		StateNotification notification = { 0 };
+
+		/* the parsing scribbles on the message, make a copy now */
+		strlcpy(notification.message, payload, BUFSIZE);
+
+		/* errors are logged by parse_state_notification_message */
+		if (!parse_state_notification_message(&notification))
+		{
+			return false;
+		}
+
+		(*callback)(context, &notification);
+
+		return true;
+	}
+}
+
+
+/*
+ * logStateNotification logs a state change that the monitor notified.
+ */
+static void
+logStateNotification(void *context, StateNotification *notification)
+{
+	if (notification->eventId > 0)
+	{
+		log_info("New state for %s:%d in formation \"%s\": %s/%s "
+				 "(event %" PRId64 ")",
+				 notification->nodeName,
+				 notification->nodePort,
+				 notification->formationId,
+				 NodeStateToString(notification->reportedState),
+				 NodeStateToString(notification->goalState),
+				 notification->eventId);
+	}
+	else
+	{
+		log_info("New state for %s:%d in formation \"%s\": %s/%s",
+				 notification->nodeName,
+				 notification->nodePort,
+				 notification->formationId,
+				 NodeStateToString(notification->reportedState),
+				 NodeStateToString(notification->goalState));
+	}
+}
+
+
 /*
  * monitor_get_extension_version gets the current extension version from the
  * Monitor's Postgres catalog pg_available_extensions.
@@ -1234,8 +2788,8 @@ monitor_get_extension_version(Monitor *monitor, MonitorExtensionVersion *version
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(&monitor->pgsql);
+	/* disconnect from PostgreSQL now, unless we keep the connection */
+	pgsql_release(&monitor->pgsql);
 
 	return true;
 }
@@ -1320,7 +2874,8 @@ monitor_extension_update(Monitor *monitor, const char *targetVersion)
  * monitor_ensure_extension_version checks that we are running a extension
  * version on the monitor that we are compatible with in pg_autoctl. If that's
  * not the case, we blindly try to update the extension version on the monitor
- * to the target version we have in our default.h.
+ * to the target version we have in our default.h, see
+ * monitor_extension_update_locked.
  *
  * NOTE: we don't check here if the update is an upgrade or a downgrade, we
  * rely on the extension's update path to be free of downgrade paths (such as
@@ -1383,39 +2938,219 @@ monitor_ensure_extension_version(Monitor *monitor,
 			return false;
 		}
 
-		if (!monitor_extension_update(&dbOwnerMonitor,
-									  extensionVersion))
+		/* we take an advisory lock on that connection */
+		dbOwnerMonitor.pgsql.keepConnection = true;
+
+		if (!monitor_extension_update_locked(&dbOwnerMonitor,
+											 extensionVersion,
+											 version))
 		{
 			log_fatal("Failed to update extension \"%s\" to version \"%s\" "
 					  "on the monitor, see above for details",
 					  PG_AUTOCTL_MONITOR_EXTENSION_NAME,
 					  extensionVersion);
+			pgsql_finish(&(dbOwnerMonitor.pgsql));
 			return false;
 		}
 
-		if (!monitor_get_extension_version(monitor, version))
+		pgsql_finish(&(dbOwnerMonitor.pgsql));
+
+		return true;
+	}
+
+	/* just mention we checked, and it's ok */
+	log_info("The version of extenstion \"%s\" is \"%s\" on the monitor",
+			 PG_AUTOCTL_MONITOR_EXTENSION_NAME, version->installedVersion);
+
+	return true;
+}
+
+
+/*
+ * monitor_extension_update_locked updates the extension on the monitor to the
+ * target version, under an advisory lock, so that only one pg_autoctl process
+ * runs ALTER EXTENSION at a time: the others wait for the lock, and then find
+ * that the extension has been updated already. Once the extension is at the
+ * target version, we notify the keepers that wait for it, see
+ * monitor_wait_for_extension_version.
+ *
+ * The lock is released when we disconnect, so the caller must disconnect
+ * dbOwnerMonitor when it's done, in any case.
+ */
+static bool
+monitor_extension_update_locked(Monitor *dbOwnerMonitor,
+								const char *targetVersion,
+								MonitorExtensionVersion *version)
+{
+	PGSQL *pgsql = &(dbOwnerMonitor->pgsql);
+	Oid lockParamTypes[1] = { INT8OID };
+	const char *lockParamValues[1] = { PG_AUTOCTL_EXTENSION_UPDATE_LOCK };
+	Oid notifyParamTypes[2] = { TEXTOID, TEXTOID };
+	const char *notifyParamValues[2];
+
+	log_debug("Waiting for other pg_autoctl processes to be done updating "
+			  "extension \"%s\"", PG_AUTOCTL_MONITOR_EXTENSION_NAME);
+
+	if (!pgsql_execute_with_params(pgsql, "SELECT pg_advisory_lock($1)",
+								   1, lockParamTypes, lockParamValues,
+								   NULL, NULL))
+	{
+		log_error("Failed to lock the update of extension \"%s\"",
+				  PG_AUTOCTL_MONITOR_EXTENSION_NAME);
+		return false;
+	}
+
+	/* another process might have updated the extension while we waited */
+	if (!monitor_get_extension_version(dbOwnerMonitor, version))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (strcmp(version->installedVersion, targetVersion) == 0)
+	{
+		log_info("Extension \"%s\" has been updated to version \"%s\" "
+				 "by another pg_autoctl process",
+				 PG_AUTOCTL_MONITOR_EXTENSION_NAME,
+				 version->installedVersion);
+	}
+	else
+	{
+		if (!monitor_extension_update(dbOwnerMonitor, targetVersion))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (!monitor_get_extension_version(dbOwnerMonitor, version))
 		{
-			log_fatal("Failed to check version compatibility with the monitor "
-					  "extension \"%s\", see above for details",
-					  PG_AUTOCTL_MONITOR_EXTENSION_NAME);
+			/* errors have already been logged */
 			return false;
 		}
 
 		log_info("Updated extension \"%s\" to version \"%s\"",
 				 PG_AUTOCTL_MONITOR_EXTENSION_NAME,
 				 version->installedVersion);
+	}
 
-		return true;
+	notifyParamValues[0] = PG_AUTOCTL_EXTENSION_UPDATE_CHANNEL;
+	notifyParamValues[1] = version->installedVersion;
+
+	/* keepers also check the version again every now and then */
+	if (!pgsql_execute_with_params(pgsql, "SELECT pg_notify($1, $2)",
+								   2, notifyParamTypes, notifyParamValues,
+								   NULL, NULL))
+	{
+		log_warn("Failed to notify the keepers that wait for the update "
+				 "of extension \"%s\"", PG_AUTOCTL_MONITOR_EXTENSION_NAME);
 	}
 
-	/* just mention we checked, and it's ok */
-	log_info("The version of extenstion \"%s\" is \"%s\" on the monitor",
-			 PG_AUTOCTL_MONITOR_EXTENSION_NAME, version->installedVersion);
+	if (!pgsql_execute_with_params(pgsql, "SELECT pg_advisory_unlock($1)",
+								   1, lockParamTypes, lockParamValues,
+								   NULL, NULL))
+	{
+		/* disconnecting releases the lock anyway */
+		log_warn("Failed to unlock the update of extension \"%s\"",
+				 PG_AUTOCTL_MONITOR_EXTENSION_NAME);
+	}
 
 	return true;
 }
 
 
+/*
+ * monitor_wait_for_extension_version waits until the extension on the monitor
+ * is at the target version, for at most timeoutSecs seconds. We LISTEN to the
+ * notifications sent by monitor_extension_update_locked, and also check the
+ * version again every PG_AUTOCTL_EXTENSION_UPDATE_POLL_MS, in case the
+ * extension is updated by other means.
+ */
+bool
+monitor_wait_for_extension_version(Monitor *monitor, const char *targetVersion,
+								   int timeoutSecs,
+								   MonitorExtensionVersion *version)
+{
+	PGSQL *pgsql = &(monitor->pgsql);
+	char *channels[] = { PG_AUTOCTL_EXTENSION_UPDATE_CHANNEL, NULL };
+	bool keepConnection = pgsql->keepConnection;
+	uint64_t startTime = time(NULL);
+	bool updated = false;
+
+	log_info("Waiting up to %d seconds for the monitor to update extension "
+			 "\"%s\" to version \"%s\"",
+			 timeoutSecs, PG_AUTOCTL_MONITOR_EXTENSION_NAME, targetVersion);
+
+	/* we LISTEN on that connection, don't let it be closed in between */
+	pgsql->keepConnection = true;
+
+	if (!pgsql_listen(pgsql, channels))
+	{
+		/* errors have already been logged */
+		pgsql->keepConnection = keepConnection;
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	while (!asked_to_stop && !asked_to_stop_fast)
+	{
+		struct pollfd pollFd = { 0 };
+		PGnotify *notify = NULL;
+
+		/* we check after LISTEN, so that we can't miss the update */
+		if (!monitor_get_extension_version(monitor, version))
+		{
+			/* errors have already been logged */
+			break;
+		}
+
+		if (strcmp(version->installedVersion, targetVersion) == 0)
+		{
+			updated = true;
+			break;
+		}
+
+		if (time(NULL) - startTime >= timeoutSecs)
+		{
+			log_error("The monitor did not update extension \"%s\" to "
+					  "version \"%s\" within %d seconds",
+					  PG_AUTOCTL_MONITOR_EXTENSION_NAME, targetVersion,
+					  timeoutSecs);
+			break;
+		}
+
+		pollFd.fd = PQsocket(pgsql->connection);
+		pollFd.events = POLLIN;
+
+		if (poll(&pollFd, 1, PG_AUTOCTL_EXTENSION_UPDATE_POLL_MS) < 0 &&
+			errno != EINTR)
+		{
+			log_error("Failed to wait for notifications: %s", strerror(errno));
+			break;
+		}
+
+		if (pollFd.revents != 0 && !PQconsumeInput(pgsql->connection))
+		{
+			log_error("Lost connection to the monitor: %s",
+					  PQerrorMessage(pgsql->connection));
+			break;
+		}
+
+		while ((notify = PQnotifies(pgsql->connection)) != NULL)
+		{
+			log_debug("received \"%s\" on channel \"%s\"",
+					  notify->extra, notify->relname);
+			PQfreemem(notify);
+		}
+	}
+
+	/* don't keep listening on the connection that the keeper uses */
+	pgsql->keepConnection = keepConnection;
+	pgsql_finish(pgsql);
+
+	return updated;
+}
+
+
 /*
  * prepare_connection_to_current_system_user changes a given pguri to remove
  * its "user" connection parameter, filling in the pre-allocated keywords and
@@ -11,14 +11,47 @@
 #define MONITOR_H
 
 
+#include "hooks.h"
 #include "pgsql.h"
 #include "state.h"
+#include "timings.h"
 
 
+/*
+ * MonitorPeers is what the last node_active call returned about the other
+ * nodes of our group, see node_active_peers. Transitions that follow that
+ * call use it rather than calling get_other_node and get_primary.
+ */
+typedef struct MonitorPeers
+{
+	bool valid;
+	char formation[NAMEDATALEN];
+	int groupId;
+
+	bool hasOtherNode;
+	NodeAddress otherNode;
+	char otherNodeLSN[PG_LSN_MAXLENGTH];
+	int otherNodeHealth;
+
+	bool hasPrimaryNode;
+	NodeAddress primaryNode;
+
+	/* synchronous_commit level of the formation, empty when unknown */
+	char synchronousCommit[NAMEDATALEN];
+
+	/* the node that a standby streams from: a primary, or a standby */
+	bool hasUpstreamNode;
+	NodeAddress upstreamNode;
+
+	/* synchronous_standby_names of a primary node, empty on other nodes */
+	char synchronousStandbyNames[BUFSIZE];
+} MonitorPeers;
+
 /* interface to the monitor */
 typedef struct Monitor
 {
 	PGSQL pgsql;
+	MonitorPeers peers;
 } Monitor;
 
 typedef struct MonitorAssignedState
@@ -28,9 +61,30 @@ typedef struct MonitorAssignedState
 	NodeState state;
 } MonitorAssignedState;
 
+/*
+ * MonitorNodeReport is a node_active call in a node_active_batch call: the
+ * current state of a node, and then the assigned state we receive for it.
+ */
+typedef struct MonitorNodeReport
+{
+	char *formation;
+	char *host;
+	int port;
+	int nodeId;
+	int groupId;
+	NodeState currentState;
+	bool pgIsRunning;
+	char *currentLSN;
+	char *pgsrSyncState;
+
+	bool assigned;
+	MonitorAssignedState assignedState;
+} MonitorNodeReport;
+
 typedef struct StateNotification
 {
 	char        message[BUFSIZE];
+	int64_t		eventId;			/* 0 with monitors before version 2 */
 	NodeState	reportedState;
 	NodeState	goalState;
 	char	    formationId[NAMEDATALEN];
@@ -40,6 +94,20 @@ typedef struct StateNotification
 	int			nodePort;
 } StateNotification;
 
+/* called for each state change found in a notification */
+typedef void (StateNotificationCB)(void *context,
+								   StateNotification *notification);
+
+/* the state of a group of a rolling operation, see rolling_operation_step */
+typedef struct MonitorRollingGroup
+{
+	int groupId;
+	char state[NAMEDATALEN];
+	char nodeName[_POSIX_HOST_NAME_MAX];
+	int nodePort;
+	char detail[BUFSIZE];
+} MonitorRollingGroup;
+
 typedef struct MonitorExtensionVersion
 {
 	char defaultVersion[BUFSIZE];
@@ -47,9 +115,12 @@ typedef struct MonitorExtensionVersion
 } MonitorExtensionVersion;
 
 bool monitor_init(Monitor *monitor, char *url);
+bool monitor_prefer_standby(Monitor *monitor);
 void monitor_finish(Monitor *monitor);
 bool monitor_get_other_node(Monitor *monitor, char *myHost, int myPort,
 							NodeAddress *otherNode);
+bool monitor_get_other_nodes(Monitor *monitor, char *myHost, int myPort,
+							 NodeAddressArray *nodeArray);
 bool monitor_get_primary(Monitor *monitor, char *formation, int groupId,
 						 NodeAddress *node);
 bool monitor_get_coordinator(Monitor *monitor, char *formation,
@@ -64,7 +135,20 @@ bool monitor_node_active(Monitor *monitor,
 						 bool pgIsRunning,
 						 char *currentLSN, char *pgsrSyncState,
 						 MonitorAssignedState *assignedState);
+bool monitor_node_active_wait(Monitor *monitor,
+							  char *formation, char *host, int port, int nodeId,
+							  int groupId, NodeState currentState,
+							  bool pgIsRunning,
+							  char *currentLSN, char *pgsrSyncState,
+							  int timeoutMs,
+							  MonitorAssignedState *assignedState);
+bool monitor_node_active_batch(Monitor *monitor,
+							   MonitorNodeReport *reports, int reportCount);
 bool monitor_remove(Monitor *monitor, char *host, int port);
+bool monitor_report_transition_timings(Monitor *monitor, char *host, int port,
+									   TransitionTimings *timings);
+bool monitor_report_hook_result(Monitor *monitor, char *host, int port,
+								HookResult *result);
 bool monitor_print_state(Monitor *monitor, char *formation, int group);
 bool monitor_print_last_events(Monitor *monitor,
 							   char *formation, int group, int count);
@@ -75,17 +159,50 @@ bool monitor_enable_secondary_for_formation(Monitor *monitor, const char *format
 bool monitor_disable_secondary_for_formation(Monitor *monitor, const char *formation);
 bool monitor_drop_formation(Monitor *monitor, char *formation);
 bool monitor_formation_uri(Monitor *monitor, const char *formation,
+						   const char *role,
 						   char *connectionString, size_t size);
+bool monitor_get_formation_monitor(Monitor *monitor, const char *formation,
+								   char *monitorURI, size_t size,
+								   bool *delegated);
+bool monitor_synchronous_standby_names(Monitor *monitor, const char *formation,
+									   int groupId, char *standbyNames,
+									   size_t size);
+bool monitor_get_delegated_monitors(Monitor *monitor,
+									char monitorURIs[][MAXCONNINFO],
+									int maxCount, int *count);
 
 bool monitor_start_maintenance(Monitor *monitor, char *host, int port);
 bool monitor_stop_maintenance(Monitor *monitor, char *host, int port);
+bool monitor_report_retained_wal(Monitor *monitor, char *host, int port,
+								 int64_t retainedWALBytes);
+bool monitor_release_standby_slot(Monitor *monitor, char *host, int port,
+								  int64_t retainedWALBytes, int standbyNodeId);
+bool monitor_report_wal_source(Monitor *monitor, char *host, int port,
+							   const char *walSource, int64_t archiveLagBytes);
+
+bool monitor_rolling_operation(Monitor *monitor, const char *formation,
+							   const char *operation, int maxParallel,
+							   int64_t *operationId);
+bool monitor_rolling_operation_step(Monitor *monitor, int64_t operationId,
+									MonitorRollingGroup *groups,
+									int maxCount, int *count);
+bool monitor_rolling_operation_release(Monitor *monitor, int64_t operationId,
+									   int groupId);
+bool monitor_rolling_operation_cancel(Monitor *monitor, int64_t operationId);
 
 bool monitor_get_notifications(Monitor *monitor);
+bool monitor_parse_state_notifications(const char *payload,
+									   StateNotificationCB *callback,
+									   void *context);
 
 bool monitor_get_extension_version(Monitor *monitor,
 								   MonitorExtensionVersion *version);
 bool monitor_extension_update(Monitor *monitor, const char *targetVersion);
 bool monitor_ensure_extension_version(Monitor *monitor,
 									  MonitorExtensionVersion *version);
+bool monitor_wait_for_extension_version(Monitor *monitor,
+										const char *targetVersion,
+										int timeoutSecs,
+										MonitorExtensionVersion *version);
 
 #endif /* MONITOR_H */
@@ -14,6 +14,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "defaults.h"
 #include "log.h"
 #include "parsing.h"
 
@@ -26,8 +27,11 @@ static bool parse_controldata_field_uint64(const char *controlDataString,
 										   const char *fieldName,
 										   uint64_t *dest);
 
+static char * parse_state_notification_fields(char *ptr,
+											  StateNotification *notification);
 static int read_length_delimited_string_at(const char *ptr,
 										   char *buffer, int size);
+static bool is_valid_backup_rate(const char *rate);
 
 #define RE_MATCH_COUNT 10
 
@@ -238,7 +242,6 @@ bool
 parse_state_notification_message(StateNotification *notification)
 {
 	char *ptr = (char *) notification->message;
-	char *col = NULL;
 
 	/* 10 is the amount of character S, colons (:) and dots (.) */
 	if (ptr == NULL || strlen(ptr) < 10 || *ptr != 'S')
@@ -250,7 +253,72 @@ parse_state_notification_message(StateNotification *notification)
 	/* skip S: */
 	ptr++; ptr++;
 
+	return parse_state_notification_fields(ptr, notification) != NULL;
+}
+
+
+/*
+ * Parse a state change of a notification from a monitor that coalesces them,
+ * where each state change also has its event id:
+ *
+ *  2;42:catchingup:secondary:7.default:0:3:9.localhost:6020;43:...
+ *
+ * The given pointer is the beginning of an entry, past the "2;" version
+ * prefix for the first one. We return a pointer to the next entry, or to the
+ * end of the message, or NULL when the entry could not be parsed.
+ */
+char *
+parse_state_notification_entry(char *ptr, StateNotification *notification)
+{
+	char *col = strchr(ptr, FIELD_SEP);
+	char *end = NULL;
+
+	if (col == NULL)
+	{
+		log_warn("Failed to parse notification entry \"%s\"", ptr);
+		return NULL;
+	}
+
+	*col = '\0';
+	notification->eventId = strtoll(ptr, &end, 10);
+
+	if (end == ptr || *end != '\0')
+	{
+		log_warn("Failed to parse event id \"%s\" in notification", ptr);
+		return NULL;
+	}
+
+	ptr = parse_state_notification_fields(++col, notification);
+
+	if (ptr == NULL)
+	{
+		return NULL;
+	}
+
+	/* skip the port, then the separator with the next entry */
+	ptr += strspn(ptr, "0123456789");
+
+	return *ptr == ';' ? ptr + 1 : ptr;
+}
+
+
+/*
+ * parse_state_notification_fields reads the fields of a state change that
+ * come after "S:" and the event id. It returns a pointer to the port, the
+ * last field, or NULL when a field is missing.
+ */
+static char *
+parse_state_notification_fields(char *ptr, StateNotification *notification)
+{
+	char *col = NULL;
+
 	/* read the states */
+	if (strchr(ptr, FIELD_SEP) == NULL)
+	{
+		log_warn("Failed to parse notification \"%s\"", ptr);
+		return NULL;
+	}
+
 	col = strchr(ptr, FIELD_SEP);
 	*col = '\0';
 
@@ -289,7 +357,7 @@ parse_state_notification_message(StateNotification *notification)
 	/* read the nodePort */
 	notification->nodePort = atoi(ptr);
 
-	return true;
+	return ptr;
 }
 
 
@@ -316,3 +384,155 @@ read_length_delimited_string_at(const char *ptr, char *buffer, int size)
 	/* col - ptr is the length of the digits plus the separator  */
 	return (col - ptr) + len + 1;
 }
+
+
+/*
+ * parse_backup_rate_schedule finds the pg_basebackup --max-rate to use at the
+ * given time of the day (in minutes since midnight) from the
+ * replication.maximum_backup_rate setting. The setting is either a single
+ * rate such as 100M, or a comma separated list of time windows and their
+ * rates, followed by an optional default rate:
+ *
+ *   22:00-06:00 1024M, 100M
+ *
+ * A rate of 0 means that pg_basebackup is not throttled, and then rate is set
+ * to the empty string. When no window matches and there is no default rate,
+ * we use MAXIMUM_BACKUP_RATE. Returns false when the setting is invalid.
+ */
+bool
+parse_backup_rate_schedule(const char *schedule, int minuteOfDay,
+						   char *rate, int size)
+{
+	char buffer[BUFSIZE];
+	char windowRate[BUFSIZE] = { 0 };
+	char defaultRate[BUFSIZE] = { 0 };
+	char *entry = NULL;
+	char *savePtr = NULL;
+
+	strlcpy(buffer, schedule, BUFSIZE);
+
+	for (entry = strtok_r(buffer, ",", &savePtr);
+		 entry != NULL;
+		 entry = strtok_r(NULL, ",", &savePtr))
+	{
+		char entryRate[BUFSIZE] = { 0 };
+		int startHour, startMinute, endHour, endMinute;
+
+		/* skip leading spaces */
+		while (*entry == ' ')
+		{
+			entry++;
+		}
+
+		if (strchr(entry, ':') == NULL)
+		{
+			if (sscanf(entry, "%1023s", entryRate) != 1 ||
+				!is_valid_backup_rate(entryRate))
+			{
+				log_error("Failed to parse backup rate \"%s\"", entry);
+				return false;
+			}
+
+			strlcpy(defaultRate, entryRate, BUFSIZE);
+		}
+		else if (sscanf(entry, "%d:%d-%d:%d %1023s",
+						&startHour, &startMinute, &endHour, &endMinute,
+						entryRate) == 5 &&
+				 startHour >= 0 && startHour < 24 &&
+				 startMinute >= 0 && startMinute < 60 &&
+				 endHour >= 0 && endHour < 24 &&
+				 endMinute >= 0 && endMinute < 60 &&
+				 is_valid_backup_rate(entryRate))
+		{
+			int start = startHour * 60 + startMinute;
+			int end = endHour * 60 + endMinute;
+
+			/* windows such as 22:00-06:00 span over midnight */
+			bool inWindow =
+				start <= end
+				? (minuteOfDay >= start && minuteOfDay < end)
+				: (minuteOfDay >= start || minuteOfDay < end);
+
+			/* the first window that matches wins */
+			if (inWindow && IS_EMPTY_STRING_BUFFER(windowRate))
+			{
+				strlcpy(windowRate, entryRate, BUFSIZE);
+			}
+		}
+		else
+		{
+			log_error("Failed to parse backup rate time window \"%s\", "
+					  "expected a window such as \"22:00-06:00 100M\"",
+					  entry);
+			return false;
+		}
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(windowRate))
+	{
+		strlcpy(rate, windowRate, size);
+	}
+	else if (!IS_EMPTY_STRING_BUFFER(defaultRate))
+	{
+		strlcpy(rate, defaultRate, size);
+	}
+	else
+	{
+		strlcpy(rate, MAXIMUM_BACKUP_RATE, size);
+	}
+
+	/* a rate of zero disables throttling */
+	if (strcmp(rate, "0") == 0)
+	{
+		rate[0] = '\0';
+	}
+
+	return true;
+}
+
+
+/*
+ * is_valid_backup_rate returns true when the given rate is something that
+ * pg_basebackup --max-rate accepts: a number followed by an optional k or M
+ * unit, or 0 in our case.
+ */
+static bool
+is_valid_backup_rate(const char *rate)
+{
+	char *unit = NULL;
+
+	errno = 0;
+	(void) strtol(rate, &unit, 10);
+
+	if (errno != 0 || unit == rate)
+	{
+		return false;
+	}
+
+	return *unit == '\0' ||
+		   ((*unit == 'k' || *unit == 'K' || *unit == 'M') && unit[1] == '\0');
+}
+
+
+/*
+ * parse_lsn parses a pg_lsn text representation such as 0/3000148 into its
+ * 64 bits value, so that we can compare LSNs without asking Postgres.
+ */
+bool
+parse_lsn(const char *lsn, uint64_t *lsnValue)
+{
+	uint32_t high = 0;
+	uint32_t low = 0;
+	int length = 0;
+
+	if (lsn == NULL
+		|| sscanf(lsn, "%X/%X%n", &high, &low, &length) != 2
+		|| lsn[length] != '\0')
+	{
+		return false;
+	}
+
+	*lsnValue = ((uint64_t) high << 32) | low;
+
+	return true;
+}
@@ -33,6 +33,13 @@ bool parse_controldata(PostgresControlData *pgControlData,
 IntString intToString(int64_t number);
 
 bool parse_state_notification_message(StateNotification *notification);
+char * parse_state_notification_entry(char *ptr,
+									  StateNotification *notification);
+
+bool parse_lsn(const char *lsn, uint64_t *lsnValue);
+
+bool parse_backup_rate_schedule(const char *schedule, int minuteOfDay,
+								char *rate, int size);
 
 
 #endif /* PARSING_H */
@@ -8,21 +8,29 @@
  *
  */
 
+#include <dirent.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "postgres_fe.h"
+#include "catalog/pg_control.h"
+#include "port/pg_crc32c.h"
 #include "pqexpbuffer.h"
 
+#include "config.h"
 #include "defaults.h"
 #include "file_utils.h"
 #include "parsing.h"
 #include "pgctl.h"
 #include "pgsql.h"
 #include "log.h"
+#include "signals.h"
+#include "timings.h"
 
 #define RUN_PROGRAM_IMPLEMENTATION
 #include "runprogram.h"
@@ -40,6 +48,65 @@
 #define PROGRAM_NOT_RUNNING 3
 
 
+/*
+ * We cache the fixed fields of the last pg_control file we read, and only
+ * read the file again when its inode, size or mtime changed.
+ */
+typedef struct ControlFileCache
+{
+	bool valid;
+	char path[MAXPGPATH];
+	ino_t inode;
+	off_t size;
+	time_t mtime;
+	PostgresControlData control;
+} ControlFileCache;
+
+static ControlFileCache controlFileCache = { 0 };
+
+/*
+ * Running "pg_ctl --version" costs a fork and exec at each pg_autoctl
+ * command, so we cache the versions we found in a file that's shared by all
+ * the pg_autoctl commands of the current user, see pg_ctl_version. An entry
+ * is only used while the program file has the same device, inode, size and
+ * mtime, which change when the program is upgraded or replaced.
+ */
+#define PG_CTL_VERSION_CACHE_FILENAME "pg_ctl_version.cache"
+
+typedef struct ProgramVersionCache
+{
+	bool valid;
+	char path[MAXPGPATH];
+	dev_t device;
+	ino_t inode;
+	off_t size;
+	time_t mtime;
+	char version[PG_VERSION_STRING_MAX];
+} ProgramVersionCache;
+
+static ProgramVersionCache programVersionCache = { 0 };
+
+/*
+ * ProgramProgress tracks the progress of a running pg_basebackup or
+ * pg_rewind, as parsed from its --progress output lines, see
+ * log_progress_output. For pg_rewind we also track the current step, which
+ * is a timing span of the transition.
+ */
+typedef struct ProgramProgress
+{
+	const char *name;
+	const char *step;
+	uint64_t startTime;
+	uint64_t lastLogTime;
+	int64_t doneKB;
+	int64_t totalKB;
+	int percent;
+} ProgramProgress;
+
+
+static bool pg_read_control_file(const char *pgdata,
+								 PostgresControlData *control,
+								 bool *missing);
 static bool pg_include_config(const char *configFilePath,
 							  const char *configIncludeLine,
 							  const char *configIncludeRegex,
@@ -48,6 +115,16 @@ static bool ensure_default_settings_file_exists(const char *configFilePath,
 												GUC *settings,
 												PostgresSetup *pgSetup);
 static void log_program_output(Program prog);
+static int pg_ctl_wait_timeout_ms(void);
+static void log_restore_command_output(void *context, bool isStderr,
+									   const char *line);
+static void log_rewind_output(void *context, bool isStderr,
+							  const char *line);
+static void pg_rewind_start_step(ProgramProgress *progress, const char *step,
+								 bool success);
+static bool pg_rewind_sync_pgdata(const char *pgdata);
+static void log_progress_output(void *context, bool isStderr,
+								const char *line);
 static bool escape_recovery_conf_string(char *destination,
 										int destinationSize,
 										const char *recoveryConfString);
@@ -55,14 +132,27 @@ static bool prepare_primary_conninfo(char *primaryConnInfo,
 									 int primaryConnInfoSize,
 									 const char *primaryHost, int primaryPort,
 									 const char *replicationUsername,
-									 const char *replicationPassword);
+									 const char *replicationPassword,
+									 const char *applicationName);
 static bool pg_write_recovery_conf(const char *pgdata,
 								   const char *primaryConnInfo,
-								   const char *replicationSlotName);
+								   const char *replicationSlotName,
+								   const char *restoreCommand);
+static bool program_version_cache_matches(ProgramVersionCache *entry,
+										  const char *path,
+										  struct stat *programStat);
+static bool program_version_cache_parse_line(const char *line,
+											 ProgramVersionCache *entry);
+static bool program_version_cache_lookup(const char *path,
+										 struct stat *programStat);
+static bool program_version_cache_store(const char *path,
+										struct stat *programStat,
+										const char *version);
 static bool pg_write_standby_signal(const char *configFilePath,
 									const char *pgdata,
 									const char *primaryConnInfo,
-									const char *replicationSlotName);
+									const char *replicationSlotName,
+									const char *restoreCommand);
 
 
 /*
@@ -74,7 +164,23 @@ char *
 pg_ctl_version(const char *pg_ctl_path)
 {
 	char *version;
-	Program prog = run_program(pg_ctl_path, "--version", NULL);
+	Program prog;
+	struct stat programStat;
+
+	/* the cache file is found in ${HOME}/.cache unless XDG_CACHE_HOME is set */
+	bool cacheable = getenv("HOME") != NULL
+					 && stat(pg_ctl_path, &programStat) == 0;
+
+	if (cacheable && program_version_cache_lookup(pg_ctl_path, &programStat))
+	{
+		log_trace("pg_ctl_version: %s is version %s (cached)",
+				  pg_ctl_path, programVersionCache.version);
+		return strdup(programVersionCache.version);
+	}
+
+	(void) timings_start_span("pg_ctl --version");
+	prog = run_program(pg_ctl_path, "--version", NULL);
+	(void) timings_end_span(prog.returnCode == 0);
 
 	if (prog.returnCode != 0)
 	{
@@ -87,17 +193,212 @@ pg_ctl_version(const char *pg_ctl_path)
 	version = parse_version_number(prog.stdout);
 	free_program(&prog);
 
+	if (cacheable && version != NULL)
+	{
+		(void) program_version_cache_store(pg_ctl_path, &programStat, version);
+	}
+
 	return version;
 }
 
 
+/*
+ * program_version_cache_matches returns true when the given cache entry is
+ * about the given program file as it is now.
+ */
+static bool
+program_version_cache_matches(ProgramVersionCache *entry,
+							  const char *path, struct stat *programStat)
+{
+	return entry->valid
+		   && strcmp(entry->path, path) == 0
+		   && entry->device == programStat->st_dev
+		   && entry->inode == programStat->st_ino
+		   && entry->size == programStat->st_size
+		   && entry->mtime == programStat->st_mtime;
+}
+
+
+/*
+ * program_version_cache_parse_line parses a line of the version cache file,
+ * which has the format "version device inode size mtime path", the path
+ * being last because it may contain spaces.
+ */
+static bool
+program_version_cache_parse_line(const char *line, ProgramVersionCache *entry)
+{
+	char version[PG_VERSION_STRING_MAX];
+	unsigned long long device = 0, inode = 0;
+	long long size = 0, mtime = 0;
+	int pathOffset = 0;
+
+	if (sscanf(line, "%11s %llu %llu %lld %lld %n",
+			   version, &device, &inode, &size, &mtime, &pathOffset) != 5
+		|| pathOffset == 0
+		|| line[pathOffset] == '\0')
+	{
+		return false;
+	}
+
+	entry->valid = true;
+	strlcpy(entry->version, version, PG_VERSION_STRING_MAX);
+	entry->device = (dev_t) device;
+	entry->inode = (ino_t) inode;
+	entry->size = (off_t) size;
+	entry->mtime = (time_t) mtime;
+	strlcpy(entry->path, line + pathOffset, MAXPGPATH);
+
+	return true;
+}
+
+
+/*
+ * program_version_cache_lookup looks for the version of the given program in
+ * memory first, then in the version cache file, and sets programVersionCache
+ * to the entry found. It returns false when the program is not in the cache,
+ * or has changed on-disk since it was cached.
+ */
+static bool
+program_version_cache_lookup(const char *path, struct stat *programStat)
+{
+	char cacheFilePath[MAXPGPATH];
+	char *contents = NULL;
+	long size = 0L;
+	bool found = false;
+
+	if (program_version_cache_matches(&programVersionCache, path, programStat))
+	{
+		return true;
+	}
+
+	if (!build_xdg_path(cacheFilePath, XDG_CACHE, NULL,
+						PG_CTL_VERSION_CACHE_FILENAME)
+		|| !file_exists(cacheFilePath)
+		|| !read_file(cacheFilePath, &contents, &size))
+	{
+		return false;
+	}
+
+	for (char *line = strtok(contents, "\n");
+		 line != NULL && !found;
+		 line = strtok(NULL, "\n"))
+	{
+		ProgramVersionCache entry = { 0 };
+
+		if (program_version_cache_parse_line(line, &entry)
+			&& program_version_cache_matches(&entry, path, programStat))
+		{
+			programVersionCache = entry;
+			found = true;
+		}
+	}
+
+	free(contents);
+
+	return found;
+}
+
+
+/*
+ * program_version_cache_store adds the version of the given program to the
+ * version cache file, replacing the previous entry for the same path. Other
+ * pg_autoctl commands might be doing the same concurrently, so we write a
+ * new file and rename it over the previous one.
+ *
+ * The cache is only an optimisation, failing to write it is not an error.
+ */
+static bool
+program_version_cache_store(const char *path, struct stat *programStat,
+							const char *version)
+{
+	char cacheFilePath[MAXPGPATH];
+	char tempFilePath[MAXPGPATH];
+	char *contents = NULL;
+	long size = 0L;
+	PQExpBuffer newContents = NULL;
+	bool success = false;
+
+	programVersionCache.valid = true;
+	strlcpy(programVersionCache.path, path, MAXPGPATH);
+	programVersionCache.device = programStat->st_dev;
+	programVersionCache.inode = programStat->st_ino;
+	programVersionCache.size = programStat->st_size;
+	programVersionCache.mtime = programStat->st_mtime;
+	strlcpy(programVersionCache.version, version, PG_VERSION_STRING_MAX);
+
+	if (!build_xdg_path(cacheFilePath, XDG_CACHE, NULL,
+						PG_CTL_VERSION_CACHE_FILENAME))
+	{
+		return false;
+	}
+
+	newContents = createPQExpBuffer();
+	if (newContents == NULL)
+	{
+		return false;
+	}
+
+	/* keep the entries for the other programs */
+	if (file_exists(cacheFilePath) && read_file(cacheFilePath, &contents, &size))
+	{
+		for (char *line = strtok(contents, "\n");
+			 line != NULL;
+			 line = strtok(NULL, "\n"))
+		{
+			ProgramVersionCache entry = { 0 };
+
+			if (program_version_cache_parse_line(line, &entry)
+				&& strcmp(entry.path, path) != 0)
+			{
+				appendPQExpBuffer(newContents, "%s\n", line);
+			}
+		}
+		free(contents);
+	}
+
+	appendPQExpBuffer(newContents, "%s %llu %llu %lld %lld %s\n",
+					  version,
+					  (unsigned long long) programStat->st_dev,
+					  (unsigned long long) programStat->st_ino,
+					  (long long) programStat->st_size,
+					  (long long) programStat->st_mtime,
+					  path);
+
+	snprintf(tempFilePath, MAXPGPATH, "%s.%d", cacheFilePath, getpid());
+
+	if (!PQExpBufferBroken(newContents)
+		&& write_file(newContents->data, newContents->len, tempFilePath))
+	{
+		success = rename(tempFilePath, cacheFilePath) == 0;
+
+		if (!success)
+		{
+			log_debug("Failed to rename \"%s\" to \"%s\": %s",
+					  tempFilePath, cacheFilePath, strerror(errno));
+			(void) unlink_file(tempFilePath);
+		}
+	}
+
+	destroyPQExpBuffer(newContents);
+
+	return success;
+}
+
+
 /*
  * Read some of the information from pg_controldata output.
+ *
+ * We first try to read the global/pg_control file directly, which doesn't
+ * need a fork and exec of pg_controldata at each keeper loop. When that's not
+ * possible, for instance because PGDATA was initialized with another major
+ * version of Postgres than the one we've been compiled against, we run
+ * pg_controldata and parse its output.
  */
 bool
 pg_controldata(PostgresSetup *pgSetup, bool missing_ok)
 {
 	bool success;
+	bool missing = false;
 	char pg_controldata[MAXPGPATH];
 	Program prog;
 
@@ -107,12 +408,26 @@ pg_controldata(PostgresSetup *pgSetup, bool missing_ok)
 		return false;
 	}
 
+	if (pg_read_control_file(pgSetup->pgdata, &(pgSetup->control), &missing))
+	{
+		return true;
+	}
+
+	if (missing && missing_ok)
+	{
+		return true;
+	}
+
 	path_in_same_directory(pgSetup->pg_ctl, "pg_controldata", pg_controldata);
 	log_debug("%s %s", pg_controldata, pgSetup->pgdata);
 
 	/* we parse the output of pg_controldata, make sure it's as expected */
 	setenv("LANG", "C", 1);
-	prog = run_program(pg_controldata, pgSetup->pgdata, NULL);
+	(void) timings_start_span("pg_controldata");
+	prog = run_program_with_timeout(PG_CTL_STATUS_TIMEOUT_MS,
+									&asked_to_stop_fast,
+									pg_controldata, pgSetup->pgdata, NULL);
+	(void) timings_end_span(prog.returnCode == 0);
 
 	if (prog.returnCode == 0)
 	{
@@ -137,6 +452,100 @@ pg_controldata(PostgresSetup *pgSetup, bool missing_ok)
 }
 
 
+/*
+ * pg_read_control_file reads the system identifier, pg_control version and
+ * catalog version from PGDATA/global/pg_control.
+ *
+ * Those fields are at the beginning of the ControlFileData struct in every
+ * Postgres version, but the CRC is found at the end of the struct, so we can
+ * only verify it when the file has been written by the same major version that
+ * we've been compiled against. We return false in all the other cases, and set
+ * missing to true when the file doesn't exist.
+ */
+static bool
+pg_read_control_file(const char *pgdata, PostgresControlData *control,
+					 bool *missing)
+{
+	char controlFilePath[MAXPGPATH];
+	struct stat controlFileStat;
+	char *contents = NULL;
+	long fileSize = 0L;
+	ControlFileData controlFile;
+	pg_crc32c crc;
+
+	*missing = false;
+
+	snprintf(controlFilePath, MAXPGPATH, "%s/%s", pgdata, XLOG_CONTROL_FILE);
+
+	if (stat(controlFilePath, &controlFileStat) != 0)
+	{
+		*missing = errno == ENOENT;
+
+		log_debug("Failed to stat \"%s\": %s",
+				  controlFilePath, strerror(errno));
+		return false;
+	}
+
+	if (controlFileCache.valid
+		&& strcmp(controlFileCache.path, controlFilePath) == 0
+		&& controlFileCache.inode == controlFileStat.st_ino
+		&& controlFileCache.size == controlFileStat.st_size
+		&& controlFileCache.mtime == controlFileStat.st_mtime)
+	{
+		*control = controlFileCache.control;
+		return true;
+	}
+
+	if (!read_file(controlFilePath, &contents, &fileSize))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (fileSize < sizeof(ControlFileData))
+	{
+		log_debug("Failed to read \"%s\": file is too small (%ld bytes)",
+				  controlFilePath, fileSize);
+		free(contents);
+		return false;
+	}
+
+	memcpy(&controlFile, contents, sizeof(ControlFileData));
+	free(contents);
+
+	if (controlFile.pg_control_version != PG_CONTROL_VERSION)
+	{
+		log_debug("Control file \"%s\" has version %u, expected %u",
+				  controlFilePath,
+				  controlFile.pg_control_version, PG_CONTROL_VERSION);
+		return false;
+	}
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, (char *) &controlFile, offsetof(ControlFileData, crc));
+	FIN_CRC32C(crc);
+
+	if (!EQ_CRC32C(crc, controlFile.crc))
+	{
+		log_warn("Calculated CRC checksum does not match value stored "
+				 "in file \"%s\"", controlFilePath);
+		return false;
+	}
+
+	control->pg_control_version = controlFile.pg_control_version;
+	control->catalog_version_no = controlFile.catalog_version_no;
+	control->system_identifier = controlFile.system_identifier;
+
+	controlFileCache.valid = true;
+	strlcpy(controlFileCache.path, controlFilePath, MAXPGPATH);
+	controlFileCache.inode = controlFileStat.st_ino;
+	controlFileCache.size = controlFileStat.st_size;
+	controlFileCache.mtime = controlFileStat.st_mtime;
+	controlFileCache.control = *control;
+
+	return true;
+}
+
 /*
  * Find "pg_ctl" programs in the PATH. If a single one exists, set its absolute
  * location in pg_ctl, and the PostgreSQL version number in pg_version.
@@ -221,6 +630,68 @@ pg_add_auto_failover_default_settings(PostgresSetup *pgSetup,
 }
 
 
+/*
+ * pg_default_setting_value formats the value of one of our default settings
+ * as we write it in postgresql-auto-failover.conf.
+ */
+bool
+pg_default_setting_value(GUC *setting, PostgresSetup *pgSetup,
+						 char *value, int size)
+{
+	/*
+	 * Settings for "listen_addresses" and "port" are replaced with the
+	 * respective values present in pgSetup allowing those to be dynamic.
+	 *
+	 * At the moment our "needs quote" heuristic is pretty simple.
+	 * There's the one parameter within those that we hardcode from
+	 * pg_auto_failover that needs quoting, and that's
+	 * listen_addresses.
+	 *
+	 * The reason why POSTGRES_DEFAULT_LISTEN_ADDRESSES is not quoting
+	 * the value directly in the constant is that we are using that
+	 * value both in the configuration file and at the pg_ctl start
+	 * --options "-h *" command line.
+	 *
+	 * At the command line, using --options "-h '*'" would give:
+	 *    could not create listen socket for "'*'"
+	 */
+	if (strcmp(setting->name, "listen_addresses") == 0)
+	{
+		snprintf(value, size, "'%s'", pgSetup->listen_addresses);
+	}
+	else if (strcmp(setting->name, "port") == 0)
+	{
+		snprintf(value, size, "%d", pgSetup->pgport);
+	}
+	else if (setting->value != NULL)
+	{
+		strlcpy(value, setting->value, size);
+	}
+	else
+	{
+		log_error("BUG: GUC setting \"%s\" has a NULL value", setting->name);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pg_is_default_settings_file returns whether the given path, as found in
+ * pg_settings.sourcefile, is our postgresql-auto-failover.conf file.
+ */
+bool
+pg_is_default_settings_file(const char *path)
+{
+	const char *filename = strrchr(path, '/');
+
+	filename = filename == NULL ? path : filename + 1;
+
+	return strcmp(filename, AUTOCTL_DEFAULTS_CONF_FILENAME) == 0;
+}
+
+
 /*
  * pg_include_config adds an include line to postgresql.conf to include the
  * given configuration file, with a comment refering pg_auto_failover.
@@ -311,47 +782,15 @@ ensure_default_settings_file_exists(const char *configFilePath,
 	for (settingIndex = 0; settings[settingIndex].name != NULL; settingIndex++)
 	{
 		GUC *setting = &settings[settingIndex];
-		/*
-		 * Settings for "listen_addresses" and "port" are replaced with the
-		 * respective values present in pgSetup allowing those to be dynamic.
-		 *
-		 * At the moment our "needs quote" heuristic is pretty simple.
-		 * There's the one parameter within those that we hardcode from
-		 * pg_auto_failover that needs quoting, and that's
-		 * listen_addresses.
-		 *
-		 * The reason why POSTGRES_DEFAULT_LISTEN_ADDRESSES is not quoting
-		 * the value directly in the constant is that we are using that
-		 * value both in the configuration file and at the pg_ctl start
-		 * --options "-h *" command line.
-		 *
-		 * At the command line, using --options "-h '*'" would give:
-		 *    could not create listen socket for "'*'"
-		 */
-		if (strcmp(setting->name, "listen_addresses") == 0)
-		{
-			appendPQExpBuffer(defaultConfContents, "%s = '%s'\n",
-							  setting->name,
-							  pgSetup->listen_addresses);
-		}
-		else if (strcmp(setting->name, "port") == 0)
-		{
-			appendPQExpBuffer(defaultConfContents, "%s = %d\n",
-					  setting->name,
-					  pgSetup->pgport);
-		}
-		else if (setting->value != NULL)
-		{
-			appendPQExpBuffer(defaultConfContents, "%s = %s\n",
-							  setting->name,
-							  setting->value);
-		}
-		else
+		char value[BUFSIZE];
+
+		if (!pg_default_setting_value(setting, pgSetup, value, BUFSIZE))
 		{
-			log_error("BUG: GUC setting \"%s\" has a NULL value", setting->name);
 			destroyPQExpBuffer(defaultConfContents);
 			return false;
 		}
+
+		appendPQExpBuffer(defaultConfContents, "%s = %s\n", setting->name, value);
 	}
 
 	/* memory allocation could have failed while building string */
@@ -415,6 +854,7 @@ bool
 pg_basebackup(const char *pgdata,
 			  const char *pg_ctl,
 			  const char *maximum_backup_rate,
+			  const char *backup_compression,
 			  const char *replication_username,
 			  const char *replication_password,
 			  const char *replication_slot_name,
@@ -422,9 +862,61 @@ pg_basebackup(const char *pgdata,
 {
 	int returnCode;
 	Program program;
+	ProgramProgress progress = { "pg_basebackup", NULL, 0 };
 	char primary_port_str[10];
 	char backupdir[MAXPGPATH];
 	char pg_basebackup[MAXPGPATH];
+	char maxRate[BUFSIZE] = { 0 };
+	char compress[BUFSIZE] = { 0 };
+	time_t now = time(NULL);
+	struct tm *localNow = localtime(&now);
+
+	char *args[21] = {
+		pg_basebackup,
+		"-w",
+		"-h", (char *) primary_hostname,
+		"-p", primary_port_str,
+		"--pgdata", backupdir,
+		"-U", (char *) replication_username,
+		"--verbose",
+		"--progress",
+		"--write-recovery-conf",
+		"--wal-method=stream",
+		"--slot", (char *) replication_slot_name,
+		NULL
+	};
+	int argsIndex = 16;
+
+	/* the backup rate may depend on the time of the day */
+	if (!parse_backup_rate_schedule(maximum_backup_rate,
+									localNow->tm_hour * 60 + localNow->tm_min,
+									maxRate, BUFSIZE))
+	{
+		log_error("Failed to parse replication.maximum_backup_rate \"%s\"",
+				  maximum_backup_rate);
+		return false;
+	}
+
+	/* a rate of 0 means that we don't throttle pg_basebackup */
+	if (!IS_EMPTY_STRING_BUFFER(maxRate))
+	{
+		args[argsIndex++] = "--max-rate";
+		args[argsIndex++] = maxRate;
+	}
+
+	/*
+	 * Compressing the base backup trades CPU for network bandwidth, which is
+	 * worth it when the standby is far away from the primary. In the plain
+	 * format that we use, that's server-side compression, as in
+	 * --compress=server-lz4, which needs pg_basebackup 15 or later.
+	 */
+	if (backup_compression != NULL && !IS_EMPTY_STRING_BUFFER(backup_compression))
+	{
+		snprintf(compress, BUFSIZE, "--compress=%s", backup_compression);
+		args[argsIndex++] = compress;
+	}
+
+	args[argsIndex] = NULL;
 
 	/* create the temporary backup directory at $pgdata/../backup */
 	path_in_same_directory(pgdata, "backup", backupdir);
@@ -445,25 +937,28 @@ pg_basebackup(const char *pgdata,
 		setenv("PGPASSWORD", replication_password, 1);
 	}
 	log_info("Running %s -w -h %s -p %d --pgdata %s -U %s --write-recovery-conf "
-			 "--max-rate %s --wal-method=stream --slot %s ...",
+			 "--wal-method=stream --slot %s --max-rate %s%s%s ...",
 			 pg_basebackup, primary_hostname, primary_port, backupdir,
-			 replication_username, maximum_backup_rate,
-			 replication_slot_name);
-	program = run_program(pg_basebackup,
-						  "-w",
-						  "-h", primary_hostname,
-						  "-p", primary_port_str,
-						  "--pgdata", backupdir,
-						  "-U", replication_username,
-						  "--verbose",
-						  "--progress",
-						  "--write-recovery-conf",
-						  "--max-rate", maximum_backup_rate,
-						  "--wal-method=stream",
-						  "--slot", replication_slot_name,
-						  NULL);
+			 replication_username, replication_slot_name,
+			 IS_EMPTY_STRING_BUFFER(maxRate) ? "unlimited" : maxRate,
+			 IS_EMPTY_STRING_BUFFER(compress) ? "" : " ",
+			 compress);
+
+	/*
+	 * A base backup may run for hours, so we log its output as it comes, and
+	 * turn its progress lines into a throughput and ETA every once in a
+	 * while, rather than keeping everything in memory until it's done.
+	 */
+	program = initialize_program(args, false);
+	program.processLine = log_progress_output;
+	program.processLineContext = &progress;
+
+	progress.startTime = time(NULL);
+
+	(void) timings_start_span("pg_basebackup");
+	execute_program(&program);
+	(void) timings_end_span(program.returnCode == 0);
 
-	log_program_output(program);
 	returnCode = program.returnCode;
 	free_program(&program);
 
@@ -498,21 +993,77 @@ pg_basebackup(const char *pgdata,
 }
 
 
+/*
+ * pg_restore_from_repository runs the replication.restore_command given by
+ * the user to seed PGDATA from a backup repository (pgBackRest, WAL-G, a
+ * storage snapshot...) that is usually much closer than the primary. The
+ * command is given the target directory in the PGDATA environment variable,
+ * and is responsible for leaving a copy of the database in there.
+ */
+bool
+pg_restore_from_repository(const char *pgdata, const char *restore_command)
+{
+	int returnCode;
+	Program program;
+	char *args[] = { "/bin/sh", "-c", (char *) restore_command, NULL };
+
+	setenv("PGDATA", pgdata, 1);
+
+	log_info("Running replication.restore_command: %s", restore_command);
+
+	program = initialize_program(args, false);
+	program.processLine = log_restore_command_output;
+	program.processLineContext = NULL;
+
+	(void) timings_start_span("replication.restore_command");
+	execute_program(&program);
+	(void) timings_end_span(program.returnCode == 0);
+
+	returnCode = program.returnCode;
+	free_program(&program);
+
+	if (returnCode != 0)
+	{
+		log_error("Failed to run replication.restore_command: exit code %d",
+				  returnCode);
+		return false;
+	}
+
+	return true;
+}
+
+
 /*
  * pg_rewind runs the pg_rewind program to rewind the given database directory
  * to a state where it can follow the given primary. We need the ability to
  * connect to the node.
+ *
+ * With rewindSync set to "syncfs", we run pg_rewind --no-sync and then sync
+ * the file systems of PGDATA with syncfs(2), rather than having pg_rewind
+ * fsync every file of PGDATA one after the other, which dominates the
+ * duration of a rewind of a large data directory.
  */
 bool
 pg_rewind(const char *pgdata, const char *pg_ctl, const char *primaryHost,
 		  int primaryPort, const char *databaseName, const char *replicationUsername,
-		  const char *replicationPassword)
+		  const char *replicationPassword, const char *rewindSync)
 {
 	int returnCode;
 	Program program;
+	ProgramProgress progress = { "pg_rewind", NULL, 0 };
 	char primaryConnInfo[MAXCONNINFO] = { 0 };
 	char *connInfoEnd = primaryConnInfo;
 	char pg_rewind[MAXPGPATH] = { 0 };
+	bool useSyncfs = false;
+
+	char *args[8] = {
+		pg_rewind,
+		"--target-pgdata", (char *) pgdata,
+		"--source-server", primaryConnInfo,
+		"--progress",
+		NULL
+	};
+	int argsIndex = 6;
 
 	connInfoEnd += make_conninfo_field_str(connInfoEnd, "host", primaryHost);
 	connInfoEnd += make_conninfo_field_int(connInfoEnd, "port", primaryPort);
@@ -522,6 +1073,35 @@ pg_rewind(const char *pgdata, const char *pg_ctl, const char *primaryHost,
 	/* call pg_rewind*/
 	path_in_same_directory(pg_ctl, "pg_rewind", pg_rewind);
 
+	if (rewindSync != NULL && strcmp(rewindSync, "syncfs") == 0)
+	{
+		char *version = pg_ctl_version(pg_rewind);
+
+		/* pg_rewind --no-sync is new in Postgres 12 */
+		if (version != NULL && atoi(version) >= 12)
+		{
+			useSyncfs = true;
+			args[argsIndex++] = "--no-sync";
+		}
+		else
+		{
+			log_warn("Ignoring replication.rewind_sync \"%s\": "
+					 "pg_rewind %s has no --no-sync option",
+					 rewindSync, version != NULL ? version : "");
+		}
+
+		if (version != NULL)
+		{
+			free(version);
+		}
+	}
+	else if (rewindSync != NULL && strcmp(rewindSync, "fsync") != 0)
+	{
+		log_warn("Ignoring unknown replication.rewind_sync \"%s\", "
+				 "expected \"fsync\" or \"syncfs\"", rewindSync);
+	}
+	args[argsIndex] = NULL;
+
 	setenv("PGCONNECT_TIMEOUT", POSTGRES_CONNECT_TIMEOUT, 1);
 
 	if (replicationPassword != NULL)
@@ -529,19 +1109,40 @@ pg_rewind(const char *pgdata, const char *pg_ctl, const char *primaryHost,
 		setenv("PGPASSWORD", replicationPassword, 1);
 	}
 
-	log_info("Running %s --target-pgdata \"%s\" --source-server \"%s\" --progress ...",
-			 pg_rewind, pgdata, primaryConnInfo);
+	log_info("Running %s --target-pgdata \"%s\" --source-server \"%s\" "
+			 "--progress%s ...",
+			 pg_rewind, pgdata, primaryConnInfo,
+			 useSyncfs ? " --no-sync" : "");
 
-	program = run_program(pg_rewind,
-						  "--target-pgdata", pgdata,
-						  "--source-server", primaryConnInfo,
-						  "--progress",
-						  NULL);
+	/*
+	 * We log the output of pg_rewind as it comes, and time each of its steps
+	 * as a nested span: analyzing the divergence, copying the changed blocks
+	 * and files, and syncing PGDATA.
+	 */
+	program = initialize_program(args, false);
+	program.processLine = log_rewind_output;
+	program.processLineContext = &progress;
+
+	progress.startTime = time(NULL);
+
+	(void) timings_start_span("pg_rewind");
+	pg_rewind_start_step(&progress, "pg_rewind analyze", true);
+
+	execute_program(&program);
 
-	log_program_output(program);
 	returnCode = program.returnCode;
 	free_program(&program);
 
+	pg_rewind_start_step(&progress, NULL, returnCode == 0);
+
+	if (returnCode == 0 && useSyncfs)
+	{
+		(void) timings_start_span("syncfs");
+		(void) timings_end_span(pg_rewind_sync_pgdata(pgdata));
+	}
+
+	(void) timings_end_span(returnCode == 0);
+
 	if (returnCode != 0)
 	{
 		log_error("Failed to run pg_rewind: exit code %d", returnCode);
@@ -552,6 +1153,101 @@ pg_rewind(const char *pgdata, const char *pg_ctl, const char *primaryHost,
 }
 
 
+/*
+ * log_rewind_output is given each line of output of pg_rewind, and notices
+ * when pg_rewind begins copying data, and then syncing PGDATA, to time those
+ * steps. Lines are then logged as in log_progress_output.
+ */
+static void
+log_rewind_output(void *context, bool isStderr, const char *line)
+{
+	ProgramProgress *progress = (ProgramProgress *) context;
+
+	if (strstr(line, "need to copy") != NULL)
+	{
+		pg_rewind_start_step(progress, "pg_rewind copy", true);
+	}
+	else if (strstr(line, "syncing target data directory") != NULL)
+	{
+		pg_rewind_start_step(progress, "pg_rewind sync", true);
+	}
+
+	log_progress_output(context, isStderr, line);
+}
+
+
+/*
+ * pg_rewind_start_step ends the timing span of the current step of pg_rewind
+ * if any, and starts a new one, unless step is NULL.
+ */
+static void
+pg_rewind_start_step(ProgramProgress *progress, const char *step, bool success)
+{
+	if (progress->step != NULL)
+	{
+		(void) timings_end_span(success);
+	}
+
+	progress->step = step;
+
+	if (step != NULL)
+	{
+		(void) timings_start_span(step);
+	}
+}
+
+
+/*
+ * pg_rewind_sync_pgdata syncs the file system of PGDATA, and the file systems
+ * of pg_wal and the tablespaces when they are symbolic links to another
+ * place, as pg_rewind would otherwise have done file by file.
+ */
+static bool
+pg_rewind_sync_pgdata(const char *pgdata)
+{
+	char path[MAXPGPATH];
+	struct stat st;
+	DIR *dir;
+	struct dirent *entry;
+	bool success = true;
+
+	log_info("Syncing the file systems of \"%s\"", pgdata);
+
+	success = sync_file_system(pgdata);
+
+	join_path_components(path, pgdata, "pg_wal");
+
+	if (lstat(path, &st) == 0 && S_ISLNK(st.st_mode))
+	{
+		success = sync_file_system(path) && success;
+	}
+
+	join_path_components(path, pgdata, "pg_tblspc");
+
+	if ((dir = opendir(path)) == NULL)
+	{
+		return success;
+	}
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		char tablespace[MAXPGPATH];
+
+		if (entry->d_name[0] == '.')
+		{
+			continue;
+		}
+
+		join_path_components(tablespace, path, entry->d_name);
+		success = sync_file_system(tablespace) && success;
+	}
+
+	closedir(dir);
+
+	return success;
+}
+
+
 /* log_program_output logs the output of the given program. */
 static void
 log_program_output(Program prog)
@@ -575,6 +1271,78 @@ log_program_output(Program prog)
 }
 
 
+/*
+ * log_restore_command_output logs each line of output of the user provided
+ * replication.restore_command as soon as it's available.
+ */
+static void
+log_restore_command_output(void *context, bool isStderr, const char *line)
+{
+	log_info("restore_command: %s", line);
+}
+
+
+/*
+ * log_progress_output is given each line of output of pg_basebackup or
+ * pg_rewind as soon as it's available. Progress lines look like the following:
+ *
+ *   123456/987654 kB (12%), 0/1 tablespace
+ *   123456/987654 kB (12%) copied
+ *
+ * We parse them to log the throughput and an estimated time of completion
+ * once every PG_BASEBACKUP_PROGRESS_LOG_INTERVAL seconds, and log any other
+ * line as it is.
+ */
+static void
+log_progress_output(void *context, bool isStderr, const char *line)
+{
+	ProgramProgress *progress = (ProgramProgress *) context;
+	int64_t doneKB = 0;
+	int64_t totalKB = 0;
+	int percent = 0;
+
+	if (sscanf(line, "%" SCNd64 "/%" SCNd64 " kB (%d%%)",
+			   &doneKB, &totalKB, &percent) == 3)
+	{
+		uint64_t now = time(NULL);
+		uint64_t elapsed = now - progress->startTime;
+		double rateKBs = 0.0;
+
+		progress->doneKB = doneKB;
+		progress->totalKB = totalKB;
+		progress->percent = percent;
+
+		if (now - progress->lastLogTime < PG_BASEBACKUP_PROGRESS_LOG_INTERVAL
+			&& doneKB < totalKB)
+		{
+			return;
+		}
+
+		progress->lastLogTime = now;
+		rateKBs = elapsed > 0 ? (double) doneKB / elapsed : 0.0;
+
+		if (rateKBs > 0.0 && totalKB > doneKB)
+		{
+			uint64_t eta = (uint64_t) ((totalKB - doneKB) / rateKBs);
+
+			log_info("%s: %" PRId64 "/%" PRId64 " MB (%d%%), "
+					 "%.1f MB/s, done in %02" PRIu64 ":%02" PRIu64 ":%02" PRIu64,
+					 progress->name, doneKB / 1024, totalKB / 1024, percent,
+					 rateKBs / 1024,
+					 eta / 3600, (eta / 60) % 60, eta % 60);
+		}
+		else
+		{
+			log_info("%s: %" PRId64 "/%" PRId64 " MB (%d%%)",
+					 progress->name, doneKB / 1024, totalKB / 1024, percent);
+		}
+		return;
+	}
+
+	log_info("%s", line);
+}
+
+
 /*
  * pg_ctl_initdb initialises a PostgreSQL directory from scratch by calling
  * "pg_ctl initdb", and returns true when this was successful. Beware that it
@@ -585,8 +1353,13 @@ log_program_output(Program prog)
 bool
 pg_ctl_initdb(const char *pg_ctl, const char *pgdata)
 {
-	Program program = run_program(pg_ctl, "initdb", "-s", "-D", pgdata, NULL);
-	int returnCode = program.returnCode;
+	Program program;
+	int returnCode = 0;
+
+	(void) timings_start_span("pg_ctl initdb");
+	program = run_program(pg_ctl, "initdb", "-s", "-D", pgdata, NULL);
+	returnCode = program.returnCode;
+	(void) timings_end_span(returnCode == 0);
 
 	log_info("Initialising a PostgreSQL cluster at \"%s\"", pgdata);
 	log_debug("%s initdb -s -D %s [%d]", pg_ctl, pgdata, returnCode);
@@ -601,9 +1374,32 @@ pg_ctl_initdb(const char *pg_ctl, const char *pgdata)
 }
 
 
+/*
+ * pg_ctl_wait_timeout_ms returns how long we wait for Postgres to start or
+ * stop, which is PGCTLTIMEOUT seconds when set, as with pg_ctl --wait.
+ */
+static int
+pg_ctl_wait_timeout_ms(void)
+{
+	char *pgctltimeout = getenv("PGCTLTIMEOUT");
+	int timeout = 0;
+
+	if (pgctltimeout != NULL &&
+		sscanf(pgctltimeout, "%d", &timeout) == 1 && timeout > 0)
+	{
+		return timeout * 1000;
+	}
+
+	return PG_CTL_WAIT_TIMEOUT * 1000;
+}
+
+
 /*
  * pg_ctl_start tries to start a PostgreSQL server by running a "pg_ctl start"
  * command. If the server was started successfully, it returns true.
+ *
+ * We don't use pg_ctl --wait, which polls the server: instead we watch the
+ * postmaster.pid file and return as soon as Postgres is ready.
  */
 bool
 pg_ctl_start(const char *pg_ctl,
@@ -622,6 +1418,9 @@ pg_ctl_start(const char *pg_ctl,
 	char command[BUFSIZE];
 	int commandSize = 0;
 
+	long stalePid = pg_setup_get_postmaster_pid(pgdata);
+	int watchFd = pg_setup_watch_pidfile(pgdata);
+
 	join_path_components(logfile, pgdata, "startup.log");
 	snprintf(pgport_option, sizeof(pgport_option), "\"-p %d\"", pgport);
 
@@ -652,7 +1451,7 @@ pg_ctl_start(const char *pg_ctl,
 		args[argsIndex++] = option_unix_socket_directory;
 	}
 
-	args[argsIndex++] = "--wait";
+	args[argsIndex++] = "--no-wait";
 	args[argsIndex++] = "start";
 	args[argsIndex] = NULL;
 
@@ -672,7 +1471,20 @@ pg_ctl_start(const char *pg_ctl,
 		log_info("%s", command);
 	}
 
-	(void) execute_program(&program);
+	(void) timings_start_span("pg_ctl start");
+	execute_program(&program);
+
+	if (program.returnCode == 0)
+	{
+		success = pg_setup_wait_until_ready(pgdata, stalePid, watchFd,
+											pg_ctl_wait_timeout_ms());
+	}
+	(void) timings_end_span(program.returnCode == 0 && success);
+
+	if (watchFd >= 0)
+	{
+		close(watchFd);
+	}
 
 	if (program.returnCode != 0)
 	{
@@ -688,8 +1500,13 @@ pg_ctl_start(const char *pg_ctl,
 		 * That PostgreSQL is currently running is a sign of success condition
 		 * for pg_ctl_start, though.
 		 */
-		Program statusProgram = run_program(pg_ctl, "status", "-D", pgdata, NULL);
-		int statusReturnCode = statusProgram.returnCode;
+		Program statusProgram;
+		int statusReturnCode;
+
+		(void) timings_start_span("pg_ctl status");
+		statusProgram = run_program(pg_ctl, "status", "-D", pgdata, NULL);
+		statusReturnCode = statusProgram.returnCode;
+		(void) timings_end_span(true);
 
 		if (statusReturnCode == 0)
 		{
@@ -724,10 +1541,6 @@ pg_ctl_start(const char *pg_ctl,
 
 		free_program(&statusProgram);
 	}
-	else
-	{
-		success = true;
-	}
 
 	/*
 	 * Now append the output from pg_ctl start (known to be all in stdout) to
@@ -756,24 +1569,50 @@ pg_ctl_stop(const char *pg_ctl, const char *pgdata)
 	int status = 0;
 	bool pgdata_exists = false;
 	const bool log_output = true;
+	long pid = pg_setup_get_postmaster_pid(pgdata);
+	int watchFd = pg_setup_watch_pidfile(pgdata);
+
+	log_debug("%s --pgdata %s --no-wait stop --mode fast", pg_ctl, pgdata);
 
-	log_debug("%s --pgdata %s --wait stop --mode fast", pg_ctl, pgdata);
+	(void) timings_start_span("pg_ctl stop");
 
+	/*
+	 * pg_ctl --no-wait stop signals the postmaster and returns, then we watch
+	 * the postmaster.pid file to notice as soon as Postgres has stopped.
+	 */
 	program = run_program(pg_ctl,
 						  "--pgdata", pgdata,
-						  "--wait",
+						  "--no-wait",
 						  "stop",
 						  "--mode", "fast",
 						  NULL);
 
 	/*
 	 * Case 1. "pg_ctl stop" was successful, so we could stop the PostgreSQL
-	 * server successfully.
+	 * server successfully, once it's done shutting down.
 	 */
 	if (program.returnCode == 0)
 	{
+		bool stopped = pid <= 0 ||
+			pg_setup_wait_until_stopped(pgdata, pid, watchFd,
+										pg_ctl_wait_timeout_ms());
+
+		(void) timings_end_span(stopped);
+
+		if (watchFd >= 0)
+		{
+			close(watchFd);
+		}
+
 		free_program(&program);
-		return true;
+		return stopped;
+	}
+
+	(void) timings_end_span(false);
+
+	if (watchFd >= 0)
+	{
+		close(watchFd);
 	}
 
 	/*
@@ -826,8 +1665,15 @@ pg_ctl_stop(const char *pg_ctl, const char *pgdata)
 int
 pg_ctl_status(const char *pg_ctl, const char *pgdata, bool log_output)
 {
-	Program program = run_program(pg_ctl, "status", "-D", pgdata, NULL);
-	int returnCode = program.returnCode;
+	Program program;
+	int returnCode = 0;
+
+	(void) timings_start_span("pg_ctl status");
+	program = run_program_with_timeout(PG_CTL_STATUS_TIMEOUT_MS,
+									   &asked_to_stop_fast,
+									   pg_ctl, "status", "-D", pgdata, NULL);
+	returnCode = program.returnCode;
+	(void) timings_end_span(true);
 
 	log_debug("%s status -D %s [%d]", pg_ctl, pgdata, returnCode);
 
@@ -847,14 +1693,21 @@ pg_ctl_status(const char *pg_ctl, const char *pgdata, bool log_output)
 bool
 pg_ctl_restart(const char *pg_ctl, const char *pgdata)
 {
-	Program program = run_program(pg_ctl,
-								  "restart",
-								  "--pgdata", pgdata,
-								  "--silent",
-								  "--wait",
-								  "--mode", "fast",
-								  NULL);
-	int returnCode = program.returnCode;
+	Program program;
+	int returnCode = 0;
+
+	(void) timings_start_span("pg_ctl restart");
+
+	program = run_program(pg_ctl,
+						  "restart",
+						  "--pgdata", pgdata,
+						  "--silent",
+						  "--wait",
+						  "--mode", "fast",
+						  NULL);
+	returnCode = program.returnCode;
+
+	(void) timings_end_span(returnCode == 0);
 
 	log_debug("%s restart --pgdata %s --silient --wait --mode fast [%d]",
 			  pg_ctl, pgdata, returnCode);
@@ -875,8 +1728,13 @@ pg_ctl_restart(const char *pg_ctl, const char *pgdata)
 bool
 pg_ctl_promote(const char *pg_ctl, const char *pgdata)
 {
-	Program program = run_program(pg_ctl, "promote", "-D", pgdata, "-w", NULL);
-	int returnCode = program.returnCode;
+	Program program;
+	int returnCode = 0;
+
+	(void) timings_start_span("pg_ctl promote");
+	program = run_program(pg_ctl, "promote", "-D", pgdata, "-w", NULL);
+	returnCode = program.returnCode;
+	(void) timings_end_span(returnCode == 0);
 
 	log_debug("%s promote -D %s", pg_ctl, pgdata);
 
@@ -910,6 +1768,8 @@ pg_setup_standby_mode(uint32_t pg_control_version,
 {
 	NodeAddress *primaryNode = &(replicationSource->primaryNode);
 	char primaryConnInfo[MAXCONNINFO] = { 0 };
+	char restoreCommand[MAXCONNINFO] = { 0 };
+	const char *walRestoreCommand = replicationSource->walRestoreCommand;
 
 	/* we ignore the length returned by prepare_primary_conninfo... */
 	if (!prepare_primary_conninfo(primaryConnInfo,
@@ -917,12 +1777,24 @@ pg_setup_standby_mode(uint32_t pg_control_version,
 								  primaryNode->host,
 								  primaryNode->port,
 								  replicationSource->userName,
-								  replicationSource->password))
+								  replicationSource->password,
+								  replicationSource->applicationName))
 	{
 		/* errors have already been logged. */
 		return false;
 	}
 
+	/* the standby fetches the WAL it can't stream from the repository */
+	if (walRestoreCommand != NULL && !IS_EMPTY_STRING_BUFFER(walRestoreCommand))
+	{
+		if (!escape_recovery_conf_string(restoreCommand, MAXCONNINFO,
+										 walRestoreCommand))
+		{
+			/* errors have already been logged. */
+			return false;
+		}
+	}
+
 	if (pg_control_version < 1200)
 	{
 		/*
@@ -933,7 +1805,8 @@ pg_setup_standby_mode(uint32_t pg_control_version,
 		 */
 		return pg_write_recovery_conf(pgdata,
 									  primaryConnInfo,
-									  replicationSource->slotName);
+									  replicationSource->slotName,
+									  restoreCommand);
 	}
 	else
 	{
@@ -945,19 +1818,22 @@ pg_setup_standby_mode(uint32_t pg_control_version,
 		return pg_write_standby_signal(configFilePath,
 									   pgdata,
 									   primaryConnInfo,
-									   replicationSource->slotName);
+									   replicationSource->slotName,
+									   restoreCommand);
 	}
 }
 
 
 /*
  * pg_write_recovery_conf writes a recovery.conf file to a postgres data
- * directory with the given primary connection info and replication slot name.
+ * directory with the given primary connection info and replication slot name,
+ * and the given restore_command unless it's empty.
  */
 static bool
 pg_write_recovery_conf(const char *pgdata,
 					   const char *primaryConnInfo,
-					   const char *replicationSlotName)
+					   const char *replicationSlotName,
+					   const char *restoreCommand)
 {
 	char recoveryConfPath[MAXPGPATH];
 	PQExpBuffer content = NULL;
@@ -970,6 +1846,10 @@ pg_write_recovery_conf(const char *pgdata,
 	appendPQExpBuffer(content, "\nprimary_conninfo = %s", primaryConnInfo);
 	appendPQExpBuffer(content, "\nprimary_slot_name = '%s'", replicationSlotName);
 	appendPQExpBuffer(content, "\nrecovery_target_timeline = 'latest'");
+	if (!IS_EMPTY_STRING_BUFFER(restoreCommand))
+	{
+		appendPQExpBuffer(content, "\nrestore_command = %s", restoreCommand);
+	}
 	appendPQExpBuffer(content, "\n");
 
 	/* memory allocation could have failed while building string */
@@ -1062,7 +1942,8 @@ static bool
 prepare_primary_conninfo(char *primaryConnInfo, int primaryConnInfoSize,
 						 const char *primaryHost, int primaryPort,
 						 const char *replicationUsername,
-						 const char *replicationPassword)
+						 const char *replicationPassword,
+						 const char *applicationName)
 {
 	int size = 0;
 	char escaped[BUFSIZE];
@@ -1087,6 +1968,18 @@ prepare_primary_conninfo(char *primaryConnInfo, int primaryConnInfoSize,
 	}
 	appendPQExpBuffer(buffer, "user = %s", escaped);
 
+	/* the primary lists its synchronous standbys by application_name */
+	if (applicationName != NULL && !IS_EMPTY_STRING_BUFFER(applicationName))
+	{
+		if (!escape_recovery_conf_string(escaped, BUFSIZE, applicationName))
+		{
+			/* errors have already been logged. */
+			destroyPQExpBuffer(buffer);
+			return false;
+		}
+		appendPQExpBuffer(buffer, "application_name = %s", escaped);
+	}
+
 	if (replicationPassword != NULL)
 	{
 		if (!escape_recovery_conf_string(escaped, BUFSIZE, replicationPassword))
@@ -1127,18 +2020,20 @@ prepare_primary_conninfo(char *primaryConnInfo, int primaryConnInfoSize,
  * pg_write_standby_signal writes the ${PGDATA}/standby.signal file that is in
  * use starting with Postgres 12 for starting a standby server. The file only
  * needs to exists, and the setup is to be found in the main Postgres
- * configuration file.
+ * configuration file. The restore_command is only set when not empty.
  */
 static bool
 pg_write_standby_signal(const char *configFilePath,
 						const char *pgdata,
 						const char *primaryConnInfo,
-						const char *replicationSlotName)
+						const char *replicationSlotName,
+						const char *restoreCommand)
 {
 	GUC standby_settings[] = {
 		{ "primary_conninfo", (char  *)primaryConnInfo },
 		{ "primary_slot_name", (char  *) replicationSlotName},
 		{ "recovery_target_timeline", "latest"},
+		{ NULL, NULL },
 		{ NULL, NULL }
 	};
 	char standbyConfigFilePath[MAXPGPATH];
@@ -1146,6 +2041,12 @@ pg_write_standby_signal(const char *configFilePath,
 
 	log_trace("pg_write_standby_signal");
 
+	if (!IS_EMPTY_STRING_BUFFER(restoreCommand))
+	{
+		standby_settings[3].name = "restore_command";
+		standby_settings[3].value = (char *) restoreCommand;
+	}
+
 	/*
 	 * First install the standby.signal file, so that if there's a problem
 	 * later and Postgres is started, it is started as a standby, with missing
@@ -1198,9 +2099,39 @@ pg_write_standby_signal(const char *configFilePath,
 
 /*
  * pg_is_running returns true if PostgreSQL is running.
+ *
+ * We do the same check as "pg_ctl status" without running it, as we are
+ * called at every keeper loop: read the postmaster PID from the first line of
+ * PGDATA/postmaster.pid and check that the process exists.
  */
 bool
 pg_is_running(const char *pg_ctl, const char *pgdata)
 {
-	return pg_ctl_status(pg_ctl, pgdata, false) == 0;
+	FILE *fp;
+	char pidfile[MAXPGPATH];
+	long pid = 0;
+
+	join_path_components(pidfile, pgdata, "postmaster.pid");
+
+	if ((fp = fopen(pidfile, "r")) == NULL)
+	{
+		log_debug("Failed to open file \"%s\": %s", pidfile, strerror(errno));
+		return false;
+	}
+
+	if (fscanf(fp, "%ld", &pid) != 1)
+	{
+		/* the file is empty or being written, Postgres is not running yet */
+		pid = 0;
+	}
+
+	fclose(fp);
+
+	/* a negative pid is a single-user backend, pg_ctl status accepts it too */
+	if (pid < 0)
+	{
+		pid = -pid;
+	}
+
+	return pid > 0 && kill((pid_t) pid, 0) == 0;
 }
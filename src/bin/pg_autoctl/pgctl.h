@@ -30,15 +30,21 @@ char * pg_ctl_version(const char *pg_ctl_path);
 bool pg_add_auto_failover_default_settings(PostgresSetup *pgSetup,
 										   char *configFilePath,
 										   GUC *settings);
+bool pg_default_setting_value(GUC *setting, PostgresSetup *pgSetup,
+							  char *value, int size);
+bool pg_is_default_settings_file(const char *path);
 bool pg_basebackup(const char *pgdata, const char *pg_ctl,
 				   const char *maximum_backup_rate,
+				   const char *backup_compression,
 				   const char *replication_username,
 				   const char *replication_password,
 				   const char *replication_slot_name,
 				   const char *primary_hostname, int primary_port);
+bool pg_restore_from_repository(const char *pgdata,
+								const char *restore_command);
 bool pg_rewind(const char *pgdata, const char *pg_ctl, const char *primaryHost,
 			   int primaryPort, const char *databaseName, const char *replicationUsername,
-			   const char *replicationPassword);
+			   const char *replicationPassword, const char *rewindSync);
 
 bool pg_ctl_initdb(const char *pg_ctl, const char *pgdata);
 bool pg_ctl_start(const char *pg_ctl,
@@ -0,0 +1,1124 @@
+/*
+ * src/bin/pg_autoctl/pgdelta.c
+ *   Re-seed an existing PGDATA from a primary server by only fetching the
+ *   parts of the files that differ, rsync-style.
+ *
+ * When pg_rewind can't be used, most of an old primary's data directory is
+ * still the same as the new primary's. Rather than copying the whole
+ * database again with pg_basebackup, we take a non-exclusive backup on the
+ * primary and then, for each file, compare the md5 checksums of chunks of
+ * DELTA_RESEED_CHUNK_SIZE bytes on both sides, and only fetch the chunks
+ * that differ using pg_read_binary_file(). That's the same SQL level access
+ * to the primary's files that pg_rewind uses.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "common/md5.h"
+
+#include "defaults.h"
+#include "file_utils.h"
+#include "log.h"
+#include "parsing.h"
+#include "pgdelta.h"
+#include "pgsql.h"
+
+
+/* length of an md5 checksum in hexadecimal, with its NUL byte */
+#define MD5_HEXSUM_LENGTH 33
+
+/*
+ * List all the files of the primary's data directory, as pg_rewind does.
+ * Tablespaces are not supported here, see pg_delta_reseed.
+ */
+#define DELTA_LIST_FILES_SQL \
+	"WITH RECURSIVE files (path, filename, size, isdir) AS (" \
+	" SELECT '' AS path, filename, size, isdir FROM" \
+	" (SELECT pg_ls_dir('.', true, false) AS filename) AS fn," \
+	" pg_stat_file(fn.filename, true) AS this" \
+	" UNION ALL" \
+	" SELECT parent.path || parent.filename || '/' AS path," \
+	" fn, this.size, this.isdir" \
+	" FROM files AS parent," \
+	" pg_ls_dir(parent.path || parent.filename, true, false) AS fn," \
+	" pg_stat_file(parent.path || parent.filename || '/' || fn, true) AS this" \
+	" WHERE parent.isdir = 't'" \
+	")" \
+	" SELECT path || filename, size, isdir FROM files" \
+	" WHERE size IS NOT NULL"
+
+#define DELTA_CHECKSUMS_SQL \
+	"SELECT md5(pg_read_binary_file($1, off, $2, true))" \
+	" FROM generate_series(0, $3 - 1, $2) AS off" \
+	" ORDER BY off"
+
+#define DELTA_FETCH_CHUNK_SQL \
+	"SELECT pg_read_binary_file($1, $2, $3, true)"
+
+/* file contents that Postgres rebuilds, so that we don't copy them */
+static const char *deltaExcludedDirectories[] = {
+	"pg_wal", "pg_xlog", "pg_replslot", "pg_dynshmem", "pg_notify",
+	"pg_serial", "pg_snapshots", "pg_stat_tmp", "pg_subtrans",
+	NULL
+};
+
+/* files that we never copy, and that we remove locally, but postmaster.* */
+static const char *deltaExcludedFiles[] = {
+	"postmaster.pid", "postmaster.opts", "pg_internal.init",
+	"backup_label", "tablespace_map",
+	"recovery.conf", "recovery.signal", "standby.signal",
+	NULL
+};
+
+/* the control file is copied last, once all the rest is in place */
+#define DELTA_CONTROL_FILE "global/pg_control"
+
+
+typedef struct DeltaSourceFile
+{
+	char path[MAXPGPATH];
+	int64_t size;
+	bool isdir;
+} DeltaSourceFile;
+
+typedef struct DeltaFileList
+{
+	bool parsedOk;
+	int count;
+	DeltaSourceFile *files;
+} DeltaFileList;
+
+typedef struct DeltaChecksums
+{
+	bool parsedOk;
+	int count;
+	char (*md5)[MD5_HEXSUM_LENGTH];	/* empty when the chunk is missing */
+} DeltaChecksums;
+
+typedef struct DeltaChunk
+{
+	bool parsedOk;
+	bool isNull;
+	size_t length;
+	char *data;					/* DELTA_RESEED_CHUNK_SIZE bytes */
+} DeltaChunk;
+
+typedef struct DeltaBackupLabel
+{
+	bool parsedOk;
+	char *labelFile;
+	char *spcmapFile;
+} DeltaBackupLabel;
+
+typedef struct DeltaReseedStats
+{
+	int filesDone;
+	int filesTotal;
+	int filesRemoved;
+	uint64_t bytesCompared;
+	uint64_t bytesFetched;
+	time_t startTime;
+	time_t lastLogTime;
+} DeltaReseedStats;
+
+
+static bool delta_reseed_from_source(PGSQL *pgsql, const char *pgdata,
+									 int serverVersionNum,
+									 const char *slotName,
+									 DeltaFileList *fileList,
+									 char *buffer);
+static bool delta_check_source(PGSQL *pgsql, uint64_t systemIdentifier,
+							   int *serverVersionNum);
+static bool delta_start_backup(PGSQL *pgsql, int serverVersionNum);
+static bool delta_stop_backup(PGSQL *pgsql, int serverVersionNum,
+							  const char *pgdata);
+static bool delta_list_files(PGSQL *pgsql, DeltaFileList *fileList);
+static bool delta_remove_extra_files(const char *pgdata, const char *relpath,
+									 DeltaFileList *fileList,
+									 DeltaReseedStats *stats);
+static bool delta_sync_file(PGSQL *pgsql, const char *pgdata,
+							DeltaSourceFile *file, char *buffer,
+							DeltaReseedStats *stats);
+static bool delta_fetch_checksums(PGSQL *pgsql, DeltaSourceFile *file,
+								  DeltaChecksums *checksums);
+static bool delta_fetch_chunk(PGSQL *pgsql, DeltaSourceFile *file,
+							  int64_t offset, size_t length, DeltaChunk *chunk);
+static bool delta_md5(const char *data, size_t length, char *hexsum);
+static bool delta_is_excluded_directory(const char *path);
+static bool delta_is_excluded_file(const char *path);
+static DeltaSourceFile * delta_find_file(DeltaFileList *fileList,
+										 const char *path);
+static int delta_compare_files(const void *a, const void *b);
+static int delta_compare_path_to_file(const void *key, const void *elem);
+static void delta_log_progress(DeltaReseedStats *stats, bool force);
+static void parseDeltaFileList(void *ctx, PGresult *result);
+static void parseDeltaChecksums(void *ctx, PGresult *result);
+static void parseDeltaChunk(void *ctx, PGresult *result);
+static void parseDeltaBackupLabel(void *ctx, PGresult *result);
+
+
+/*
+ * pg_delta_reseed re-seeds the given PGDATA from the primary described in
+ * replicationSource. Postgres must not be running on pgdata. On success,
+ * pgdata contains a backup_label file and is ready to be setup in standby
+ * mode, where Postgres replays the WAL it needs from the primary.
+ *
+ * When the primary is not a copy of the same cluster as the local one, as
+ * found with their system identifiers, there's nothing to gain from a delta
+ * and we return false so that the caller uses pg_basebackup.
+ */
+bool
+pg_delta_reseed(const char *pgdata,
+				const char *dbname,
+				uint64_t systemIdentifier,
+				ReplicationSource *replicationSource)
+{
+	PGSQL pgsql = { 0 };
+	NodeAddress *primaryNode = &(replicationSource->primaryNode);
+	char connInfo[MAXCONNINFO] = { 0 };
+	char *connInfoEnd = connInfo;
+	DeltaFileList fileList = { 0 };
+	char *buffer = NULL;
+	int serverVersionNum = 0;
+	bool success = false;
+
+	connInfoEnd += make_conninfo_field_str(connInfoEnd, "host", primaryNode->host);
+	connInfoEnd += make_conninfo_field_int(connInfoEnd, "port", primaryNode->port);
+	connInfoEnd += make_conninfo_field_str(connInfoEnd, "user",
+										   replicationSource->userName);
+	connInfoEnd += make_conninfo_field_str(connInfoEnd, "dbname", dbname);
+
+	setenv("PGCONNECT_TIMEOUT", POSTGRES_CONNECT_TIMEOUT, 1);
+
+	if (replicationSource->password != NULL)
+	{
+		setenv("PGPASSWORD", replicationSource->password, 1);
+	}
+
+	if (!pgsql_init(&pgsql, connInfo))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* a non-exclusive backup only lasts as long as its session */
+	pgsql.keepConnection = true;
+
+	if (!delta_check_source(&pgsql, systemIdentifier, &serverVersionNum))
+	{
+		pgsql_finish(&pgsql);
+		return false;
+	}
+
+	buffer = (char *) malloc(DELTA_RESEED_CHUNK_SIZE);
+
+	if (buffer == NULL)
+	{
+		log_error("Failed to allocate %d bytes for the delta re-seed",
+				  DELTA_RESEED_CHUNK_SIZE);
+		pgsql_finish(&pgsql);
+		return false;
+	}
+
+	success = delta_reseed_from_source(&pgsql, pgdata, serverVersionNum,
+									   replicationSource->slotName,
+									   &fileList, buffer);
+
+	/* when we failed, closing the session aborts the backup on the primary */
+	pgsql_finish(&pgsql);
+
+	free(buffer);
+	free(fileList.files);
+
+	return success;
+}
+
+
+/*
+ * delta_reseed_from_source implements pg_delta_reseed once connected to the
+ * primary.
+ */
+static bool
+delta_reseed_from_source(PGSQL *pgsql, const char *pgdata,
+						 int serverVersionNum,
+						 const char *slotName,
+						 DeltaFileList *fileList,
+						 char *buffer)
+{
+	DeltaReseedStats stats = { 0 };
+	DeltaSourceFile *controlFile = NULL;
+	char archiveStatusPath[MAXPGPATH];
+	int fileIndex = 0;
+
+	/*
+	 * The primary must keep the WAL from the backup checkpoint on until we
+	 * stream from our slot, or we would re-seed a standby that can't start.
+	 */
+	if (!pgsql_reserve_replication_slot(pgsql, slotName))
+	{
+		log_warn("Failed to reserve WAL on replication slot \"%s\" "
+				 "of the primary", slotName);
+		return false;
+	}
+
+	if (!delta_start_backup(pgsql, serverVersionNum))
+	{
+		return false;
+	}
+
+	if (!delta_list_files(pgsql, fileList))
+	{
+		return false;
+	}
+
+	qsort(fileList->files, fileList->count, sizeof(DeltaSourceFile),
+		  delta_compare_files);
+
+	for (fileIndex = 0; fileIndex < fileList->count; fileIndex++)
+	{
+		DeltaSourceFile *file = &(fileList->files[fileIndex]);
+
+		if (strncmp(file->path, "pg_tblspc/", strlen("pg_tblspc/")) == 0)
+		{
+			log_warn("Failed to re-seed \"%s\" from a delta: tablespaces "
+					 "are not supported", pgdata);
+			return false;
+		}
+
+		if (!file->isdir
+			&& !delta_is_excluded_directory(file->path)
+			&& !delta_is_excluded_file(file->path))
+		{
+			++stats.filesTotal;
+		}
+	}
+
+	log_info("Re-seeding \"%s\" from the %d files of the primary, only "
+			 "fetching the %d kB chunks that differ",
+			 pgdata, stats.filesTotal, DELTA_RESEED_CHUNK_SIZE / 1024);
+
+	stats.startTime = time(NULL);
+	stats.lastLogTime = stats.startTime;
+
+	/* first, remove what's not on the primary anymore */
+	if (!delta_remove_extra_files(pgdata, NULL, fileList, &stats))
+	{
+		return false;
+	}
+
+	/* then create directories and copy files, in the sorted path order */
+	for (fileIndex = 0; fileIndex < fileList->count; fileIndex++)
+	{
+		DeltaSourceFile *file = &(fileList->files[fileIndex]);
+
+		/* don't create pg_replslot/<slot> and such */
+		if (file->isdir
+			&& delta_is_excluded_directory(file->path)
+			&& strchr(file->path, '/') != NULL)
+		{
+			continue;
+		}
+
+		if (file->isdir)
+		{
+			char localPath[MAXPGPATH];
+
+			join_path_components(localPath, pgdata, file->path);
+
+			if (mkdir(localPath, 0700) != 0 && errno != EEXIST)
+			{
+				log_error("Failed to create directory \"%s\": %s",
+						  localPath, strerror(errno));
+				return false;
+			}
+			continue;
+		}
+
+		if (delta_is_excluded_directory(file->path)
+			|| delta_is_excluded_file(file->path))
+		{
+			continue;
+		}
+
+		if (strcmp(file->path, DELTA_CONTROL_FILE) == 0)
+		{
+			controlFile = file;
+			continue;
+		}
+
+		if (!delta_sync_file(pgsql, pgdata, file, buffer, &stats))
+		{
+			return false;
+		}
+	}
+
+	if (controlFile == NULL)
+	{
+		log_error("Failed to re-seed \"%s\": the primary has no %s file",
+				  pgdata, DELTA_CONTROL_FILE);
+		return false;
+	}
+
+	if (!delta_sync_file(pgsql, pgdata, controlFile, buffer, &stats))
+	{
+		return false;
+	}
+
+	/* pg_basebackup also creates that one */
+	join_path_components(archiveStatusPath, pgdata, "pg_wal/archive_status");
+
+	if (!directory_exists(archiveStatusPath)
+		&& mkdir(archiveStatusPath, 0700) != 0)
+	{
+		log_error("Failed to create directory \"%s\": %s",
+				  archiveStatusPath, strerror(errno));
+		return false;
+	}
+
+	delta_log_progress(&stats, true);
+
+	return delta_stop_backup(pgsql, serverVersionNum, pgdata);
+}
+
+
+/*
+ * delta_check_source checks that the primary is a copy of the same cluster
+ * as the local one, and fetches its version number.
+ */
+static bool
+delta_check_source(PGSQL *pgsql, uint64_t systemIdentifier,
+				   int *serverVersionNum)
+{
+	SingleValueResultContext sysIdContext = { 0 };
+	SingleValueResultContext versionContext = { 0 };
+
+	sysIdContext.resultType = PGSQL_RESULT_BIGINT;
+	versionContext.resultType = PGSQL_RESULT_INT;
+
+	if (!pgsql_execute_with_params(pgsql,
+								   "SELECT system_identifier "
+								   "FROM pg_control_system()",
+								   0, NULL, NULL,
+								   &sysIdContext, &parseSingleValueResult)
+		|| !sysIdContext.parsedOk)
+	{
+		log_warn("Failed to get the system identifier of the primary");
+		return false;
+	}
+
+	if (sysIdContext.bigint != systemIdentifier)
+	{
+		log_warn("The primary has system identifier %" PRIu64
+				 ", and the local data directory has %" PRIu64,
+				 sysIdContext.bigint, systemIdentifier);
+		return false;
+	}
+
+	if (!pgsql_execute_with_params(pgsql,
+								   "SELECT current_setting('server_version_num')",
+								   0, NULL, NULL,
+								   &versionContext, &parseSingleValueResult)
+		|| !versionContext.parsedOk)
+	{
+		log_warn("Failed to get the version of the primary");
+		return false;
+	}
+
+	*serverVersionNum = versionContext.intVal;
+
+	return true;
+}
+
+
+/*
+ * delta_start_backup starts a non-exclusive backup on the primary, which
+ * makes it safe to copy the files while Postgres is writing to them: the
+ * WAL replay from the backup checkpoint fixes torn pages.
+ */
+static bool
+delta_start_backup(PGSQL *pgsql, int serverVersionNum)
+{
+	const char *paramValues[1] = { "pg_autoctl delta re-seed" };
+	Oid paramTypes[1] = { TEXTOID };
+	const char *sql =
+		serverVersionNum >= 150000
+		? "SELECT pg_backup_start($1, true)"
+		: "SELECT pg_start_backup($1, true, false)";
+
+	return pgsql_execute_with_params(pgsql, sql, 1, paramTypes, paramValues,
+									 NULL, NULL);
+}
+
+
+/*
+ * delta_stop_backup stops the backup on the primary and writes the
+ * backup_label file (and tablespace_map) that it returns in pgdata.
+ */
+static bool
+delta_stop_backup(PGSQL *pgsql, int serverVersionNum, const char *pgdata)
+{
+	DeltaBackupLabel label = { 0 };
+	char labelPath[MAXPGPATH];
+	const char *sql =
+		serverVersionNum >= 150000
+		? "SELECT labelfile, spcmapfile FROM pg_backup_stop(true)"
+		: "SELECT labelfile, spcmapfile FROM pg_stop_backup(false, true)";
+	bool success = true;
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &label, &parseDeltaBackupLabel)
+		|| !label.parsedOk)
+	{
+		log_error("Failed to stop the backup on the primary");
+		free(label.labelFile);
+		free(label.spcmapFile);
+		return false;
+	}
+
+	join_path_components(labelPath, pgdata, "backup_label");
+
+	if (!write_file(label.labelFile, strlen(label.labelFile), labelPath))
+	{
+		success = false;
+	}
+
+	if (success && label.spcmapFile != NULL && strlen(label.spcmapFile) > 0)
+	{
+		join_path_components(labelPath, pgdata, "tablespace_map");
+
+		if (!write_file(label.spcmapFile, strlen(label.spcmapFile), labelPath))
+		{
+			success = false;
+		}
+	}
+
+	free(label.labelFile);
+	free(label.spcmapFile);
+
+	return success;
+}
+
+
+/*
+ * delta_list_files fetches the list of files of the primary.
+ */
+static bool
+delta_list_files(PGSQL *pgsql, DeltaFileList *fileList)
+{
+	if (!pgsql_execute_with_params(pgsql, DELTA_LIST_FILES_SQL,
+								   0, NULL, NULL,
+								   fileList, &parseDeltaFileList)
+		|| !fileList->parsedOk)
+	{
+		log_error("Failed to list the files of the primary");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * delta_remove_extra_files walks the local data directory and removes the
+ * files that don't exist on the primary, the contents of the directories
+ * that Postgres rebuilds (WAL from our old timeline, replication slots...)
+ * and the files that we never copy.
+ */
+static bool
+delta_remove_extra_files(const char *pgdata, const char *relpath,
+						 DeltaFileList *fileList,
+						 DeltaReseedStats *stats)
+{
+	char dirPath[MAXPGPATH];
+	DIR *dir = NULL;
+	struct dirent *entry = NULL;
+	bool success = true;
+
+	if (relpath == NULL)
+	{
+		strlcpy(dirPath, pgdata, MAXPGPATH);
+	}
+	else
+	{
+		join_path_components(dirPath, pgdata, relpath);
+	}
+
+	dir = opendir(dirPath);
+
+	if (dir == NULL)
+	{
+		log_error("Failed to open directory \"%s\": %s",
+				  dirPath, strerror(errno));
+		return false;
+	}
+
+	while (success && (entry = readdir(dir)) != NULL)
+	{
+		char path[MAXPGPATH];
+		char localPath[MAXPGPATH];
+		struct stat localStat;
+		DeltaSourceFile *sourceFile = NULL;
+
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+		{
+			continue;
+		}
+
+		if (relpath == NULL)
+		{
+			strlcpy(path, entry->d_name, MAXPGPATH);
+		}
+		else
+		{
+			join_path_components(path, relpath, entry->d_name);
+		}
+
+		join_path_components(localPath, pgdata, path);
+
+		if (lstat(localPath, &localStat) != 0)
+		{
+			log_error("Failed to stat \"%s\": %s", localPath, strerror(errno));
+			success = false;
+			break;
+		}
+
+		if (relpath == NULL && S_ISDIR(localStat.st_mode)
+			&& delta_is_excluded_directory(path))
+		{
+			/* keep the directory itself, but not its contents */
+			if (!rmtree(localPath, false))
+			{
+				log_error("Failed to remove the contents of \"%s\"", localPath);
+				success = false;
+			}
+			continue;
+		}
+
+		if (delta_is_excluded_file(path))
+		{
+			if (strncmp(entry->d_name, "postmaster.", strlen("postmaster.")) != 0
+				&& !unlink_file(localPath))
+			{
+				success = false;
+			}
+			continue;
+		}
+
+		sourceFile = delta_find_file(fileList, path);
+
+		if (sourceFile != NULL
+			&& sourceFile->isdir == (S_ISDIR(localStat.st_mode) != 0))
+		{
+			if (sourceFile->isdir)
+			{
+				success = delta_remove_extra_files(pgdata, path,
+												   fileList, stats);
+			}
+			continue;
+		}
+
+		log_debug("rm -rf \"%s\"", localPath);
+
+		if (S_ISDIR(localStat.st_mode))
+		{
+			if (!rmtree(localPath, true))
+			{
+				log_error("Failed to remove directory \"%s\"", localPath);
+				success = false;
+			}
+		}
+		else if (!unlink_file(localPath))
+		{
+			success = false;
+		}
+
+		++stats->filesRemoved;
+	}
+
+	closedir(dir);
+
+	return success;
+}
+
+
+/*
+ * delta_sync_file makes the local copy of the given file the same as the
+ * primary's, fetching only the chunks that differ.
+ */
+static bool
+delta_sync_file(PGSQL *pgsql, const char *pgdata,
+				DeltaSourceFile *file, char *buffer,
+				DeltaReseedStats *stats)
+{
+	char localPath[MAXPGPATH];
+	struct stat localStat;
+	DeltaChecksums checksums = { 0 };
+	int64_t offset = 0;
+	int chunkIndex = 0;
+	bool success = true;
+	int fd = -1;
+
+	join_path_components(localPath, pgdata, file->path);
+
+	fd = open(localPath, O_RDWR | O_CREAT, 0600);
+
+	if (fd < 0)
+	{
+		log_error("Failed to open file \"%s\": %s", localPath, strerror(errno));
+		return false;
+	}
+
+	if (fstat(fd, &localStat) != 0)
+	{
+		log_error("Failed to stat file \"%s\": %s", localPath, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	/* there's nothing to compare with an empty local file */
+	if (localStat.st_size > 0 && file->size > 0)
+	{
+		if (!delta_fetch_checksums(pgsql, file, &checksums))
+		{
+			close(fd);
+			return false;
+		}
+	}
+
+	for (offset = 0;
+		 success && offset < file->size;
+		 offset += DELTA_RESEED_CHUNK_SIZE, chunkIndex++)
+	{
+		size_t length = Min(DELTA_RESEED_CHUNK_SIZE, file->size - offset);
+		DeltaChunk chunk = { 0 };
+
+		if (offset + (int64_t) length <= localStat.st_size
+			&& chunkIndex < checksums.count
+			&& checksums.md5[chunkIndex][0] != '\0')
+		{
+			char localSum[MD5_HEXSUM_LENGTH] = { 0 };
+
+			if (pread(fd, buffer, length, offset) != (ssize_t) length)
+			{
+				log_error("Failed to read file \"%s\": %s",
+						  localPath, strerror(errno));
+				success = false;
+				break;
+			}
+
+			if (!delta_md5(buffer, length, localSum))
+			{
+				success = false;
+				break;
+			}
+
+			stats->bytesCompared += length;
+
+			if (strcmp(localSum, checksums.md5[chunkIndex]) == 0)
+			{
+				continue;
+			}
+		}
+
+		chunk.data = buffer;
+
+		if (!delta_fetch_chunk(pgsql, file, offset, length, &chunk))
+		{
+			success = false;
+			break;
+		}
+
+		/* the file has been removed on the primary, WAL replay knows */
+		if (chunk.isNull)
+		{
+			break;
+		}
+
+		if (pwrite(fd, chunk.data, chunk.length, offset) != (ssize_t) chunk.length)
+		{
+			log_error("Failed to write file \"%s\": %s",
+					  localPath, strerror(errno));
+			success = false;
+			break;
+		}
+
+		stats->bytesFetched += chunk.length;
+
+		/* the file has been truncated on the primary, WAL replay knows */
+		if (chunk.length < length)
+		{
+			break;
+		}
+	}
+
+	if (success && ftruncate(fd, file->size) != 0)
+	{
+		log_error("Failed to truncate file \"%s\": %s",
+				  localPath, strerror(errno));
+		success = false;
+	}
+
+	if (success && fsync(fd) != 0)
+	{
+		log_error("Failed to fsync file \"%s\": %s", localPath, strerror(errno));
+		success = false;
+	}
+
+	close(fd);
+	free(checksums.md5);
+
+	++stats->filesDone;
+	delta_log_progress(stats, false);
+
+	return success;
+}
+
+
+/*
+ * delta_fetch_checksums fetches the md5 checksums of all the chunks of the
+ * given file on the primary, in a single query.
+ */
+static bool
+delta_fetch_checksums(PGSQL *pgsql, DeltaSourceFile *file,
+					  DeltaChecksums *checksums)
+{
+	IntString chunkSize = intToString(DELTA_RESEED_CHUNK_SIZE);
+	IntString fileSize = intToString(file->size);
+	const char *paramValues[3] = {
+		file->path, chunkSize.strValue, fileSize.strValue
+	};
+	Oid paramTypes[3] = { TEXTOID, INT8OID, INT8OID };
+
+	if (!pgsql_execute_with_params(pgsql, DELTA_CHECKSUMS_SQL,
+								   3, paramTypes, paramValues,
+								   checksums, &parseDeltaChecksums)
+		|| !checksums->parsedOk)
+	{
+		log_error("Failed to fetch the checksums of \"%s\" from the primary",
+				  file->path);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * delta_fetch_chunk fetches length bytes at offset of the given file on the
+ * primary into chunk->data.
+ */
+static bool
+delta_fetch_chunk(PGSQL *pgsql, DeltaSourceFile *file,
+				  int64_t offset, size_t length, DeltaChunk *chunk)
+{
+	IntString offsetString = intToString(offset);
+	IntString lengthString = intToString(length);
+	const char *paramValues[3] = {
+		file->path, offsetString.strValue, lengthString.strValue
+	};
+	Oid paramTypes[3] = { TEXTOID, INT8OID, INT8OID };
+
+	if (!pgsql_execute_with_params(pgsql, DELTA_FETCH_CHUNK_SQL,
+								   3, paramTypes, paramValues,
+								   chunk, &parseDeltaChunk)
+		|| !chunk->parsedOk)
+	{
+		log_error("Failed to fetch %zu bytes at offset %" PRId64
+				  " of \"%s\" from the primary",
+				  length, offset, file->path);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * delta_md5 computes the md5 checksum of the given data in hexadecimal, the
+ * same as the md5() SQL function.
+ */
+static bool
+delta_md5(const char *data, size_t length, char *hexsum)
+{
+#if PG_VERSION_NUM >= 140000
+	const char *errstr = NULL;
+
+	if (!pg_md5_hash(data, length, hexsum, &errstr))
+	{
+		log_error("Failed to compute an md5 checksum: %s", errstr);
+		return false;
+	}
+#else
+	if (!pg_md5_hash(data, length, hexsum))
+	{
+		log_error("Failed to compute an md5 checksum: out of memory");
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+
+/*
+ * delta_is_excluded_directory returns true when the given path is within
+ * one of the directories that Postgres rebuilds, or is one of them.
+ */
+static bool
+delta_is_excluded_directory(const char *path)
+{
+	int index = 0;
+
+	for (index = 0; deltaExcludedDirectories[index] != NULL; index++)
+	{
+		const char *directory = deltaExcludedDirectories[index];
+		int length = strlen(directory);
+
+		if (strncmp(path, directory, length) == 0
+			&& (path[length] == '\0' || path[length] == '/'))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * delta_is_excluded_file returns true when the file name of the given path
+ * is one of the files that we never copy.
+ */
+static bool
+delta_is_excluded_file(const char *path)
+{
+	const char *filename = strrchr(path, '/');
+	int index = 0;
+
+	filename = filename == NULL ? path : filename + 1;
+
+	for (index = 0; deltaExcludedFiles[index] != NULL; index++)
+	{
+		if (strcmp(filename, deltaExcludedFiles[index]) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * delta_find_file finds the given path in the sorted list of files of the
+ * primary, or returns NULL.
+ */
+static DeltaSourceFile *
+delta_find_file(DeltaFileList *fileList, const char *path)
+{
+	return (DeltaSourceFile *) bsearch(path,
+									   fileList->files,
+									   fileList->count,
+									   sizeof(DeltaSourceFile),
+									   delta_compare_path_to_file);
+}
+
+
+/* delta_compare_files is a qsort comparator of DeltaSourceFile paths */
+static int
+delta_compare_files(const void *a, const void *b)
+{
+	return strcmp(((const DeltaSourceFile *) a)->path,
+				  ((const DeltaSourceFile *) b)->path);
+}
+
+
+/* delta_compare_path_to_file is a bsearch comparator */
+static int
+delta_compare_path_to_file(const void *key, const void *elem)
+{
+	return strcmp((const char *) key, ((const DeltaSourceFile *) elem)->path);
+}
+
+
+/*
+ * delta_log_progress logs how far we are in the re-seed, once every
+ * PG_BASEBACKUP_PROGRESS_LOG_INTERVAL seconds, or now when force is true.
+ */
+static void
+delta_log_progress(DeltaReseedStats *stats, bool force)
+{
+	time_t now = time(NULL);
+
+	if (!force && now - stats->lastLogTime < PG_BASEBACKUP_PROGRESS_LOG_INTERVAL)
+	{
+		return;
+	}
+
+	stats->lastLogTime = now;
+
+	log_info("Delta re-seed: %d/%d files, %" PRIu64 " MB compared, "
+			 "%" PRIu64 " MB fetched, %d files removed, in %ds",
+			 stats->filesDone, stats->filesTotal,
+			 stats->bytesCompared / (1024 * 1024),
+			 stats->bytesFetched / (1024 * 1024),
+			 stats->filesRemoved,
+			 (int) (now - stats->startTime));
+}
+
+
+/*
+ * parseDeltaFileList parses the result of DELTA_LIST_FILES_SQL.
+ */
+static void
+parseDeltaFileList(void *ctx, PGresult *result)
+{
+	DeltaFileList *fileList = (DeltaFileList *) ctx;
+	int rowCount = PQntuples(result);
+	int rowNumber = 0;
+
+	if (PQnfields(result) != 3)
+	{
+		log_error("Query returned %d columns, expected 3", PQnfields(result));
+		fileList->parsedOk = false;
+		return;
+	}
+
+	fileList->files =
+		(DeltaSourceFile *) calloc(rowCount + 1, sizeof(DeltaSourceFile));
+
+	if (fileList->files == NULL)
+	{
+		log_error("Failed to allocate memory for %d files", rowCount);
+		fileList->parsedOk = false;
+		return;
+	}
+
+	for (rowNumber = 0; rowNumber < rowCount; rowNumber++)
+	{
+		DeltaSourceFile *file = &(fileList->files[rowNumber]);
+
+		strlcpy(file->path, PQgetvalue(result, rowNumber, 0), MAXPGPATH);
+		file->size = strtoll(PQgetvalue(result, rowNumber, 1), NULL, 10);
+		file->isdir = strcmp(PQgetvalue(result, rowNumber, 2), "t") == 0;
+	}
+
+	fileList->count = rowCount;
+	fileList->parsedOk = true;
+}
+
+
+/*
+ * parseDeltaChecksums parses the result of DELTA_CHECKSUMS_SQL.
+ */
+static void
+parseDeltaChecksums(void *ctx, PGresult *result)
+{
+	DeltaChecksums *checksums = (DeltaChecksums *) ctx;
+	int rowCount = PQntuples(result);
+	int rowNumber = 0;
+
+	checksums->md5 = calloc(rowCount + 1, MD5_HEXSUM_LENGTH);
+
+	if (checksums->md5 == NULL)
+	{
+		log_error("Failed to allocate memory for %d checksums", rowCount);
+		checksums->parsedOk = false;
+		return;
+	}
+
+	for (rowNumber = 0; rowNumber < rowCount; rowNumber++)
+	{
+		if (!PQgetisnull(result, rowNumber, 0))
+		{
+			strlcpy(checksums->md5[rowNumber],
+					PQgetvalue(result, rowNumber, 0),
+					MD5_HEXSUM_LENGTH);
+		}
+	}
+
+	checksums->count = rowCount;
+	checksums->parsedOk = true;
+}
+
+
+/*
+ * parseDeltaChunk parses the result of DELTA_FETCH_CHUNK_SQL.
+ */
+static void
+parseDeltaChunk(void *ctx, PGresult *result)
+{
+	DeltaChunk *chunk = (DeltaChunk *) ctx;
+	unsigned char *data = NULL;
+	size_t length = 0;
+
+	if (PQntuples(result) != 1)
+	{
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		chunk->parsedOk = false;
+		return;
+	}
+
+	if (PQgetisnull(result, 0, 0))
+	{
+		chunk->isNull = true;
+		chunk->parsedOk = true;
+		return;
+	}
+
+	data = PQunescapeBytea((unsigned char *) PQgetvalue(result, 0, 0), &length);
+
+	if (data == NULL || length > DELTA_RESEED_CHUNK_SIZE)
+	{
+		log_error("Failed to decode a chunk of %zu bytes", length);
+		PQfreemem(data);
+		chunk->parsedOk = false;
+		return;
+	}
+
+	memcpy(chunk->data, data, length);
+	chunk->length = length;
+	chunk->parsedOk = true;
+
+	PQfreemem(data);
+}
+
+
+/*
+ * parseDeltaBackupLabel parses the labelfile and spcmapfile columns of the
+ * result of pg_stop_backup.
+ */
+static void
+parseDeltaBackupLabel(void *ctx, PGresult *result)
+{
+	DeltaBackupLabel *label = (DeltaBackupLabel *) ctx;
+
+	if (PQntuples(result) != 1 || PQnfields(result) != 2)
+	{
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		label->parsedOk = false;
+		return;
+	}
+
+	label->labelFile = strdup(PQgetvalue(result, 0, 0));
+
+	if (!PQgetisnull(result, 0, 1))
+	{
+		label->spcmapFile = strdup(PQgetvalue(result, 0, 1));
+	}
+
+	label->parsedOk = label->labelFile != NULL;
+}
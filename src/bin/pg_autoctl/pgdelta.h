@@ -0,0 +1,27 @@
+/*
+ * src/bin/pg_autoctl/pgdelta.h
+ *   API for re-seeding an existing PGDATA from a primary server by only
+ *   fetching the parts of the files that differ.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef PGDELTA_H
+#define PGDELTA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pgsql.h"
+
+/* we compare and fetch files in chunks of that many bytes */
+#define DELTA_RESEED_CHUNK_SIZE (1024 * 1024)
+
+bool pg_delta_reseed(const char *pgdata,
+					 const char *dbname,
+					 uint64_t systemIdentifier,
+					 ReplicationSource *replicationSource);
+
+#endif /* PGDELTA_H */
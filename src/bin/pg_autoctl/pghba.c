@@ -6,11 +6,16 @@
  * Licensed under the PostgreSQL License.
  *
  */
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/stat.h>
 
 #include "postgres_fe.h"
 #include "pqexpbuffer.h"
@@ -22,6 +27,7 @@
 #include "pgctl.h"
 #include "pghba.h"
 #include "log.h"
+#include "timings.h"
 
 
 #define HBA_LINE_COMMENT " # Auto-generated by pg_auto_failover"
@@ -31,12 +37,24 @@ static int get_database_field(char *destination, HBADatabaseType databaseType,
 							  const char *databaseName);
 static int convert_ip_to_cidr(char *destination, const char *host);
 static int escape_hba_string(char *destination, const char *hbaString);
+static void build_host_rule(char *hbaLine, HBADatabaseType databaseType,
+							const char *database,
+							const char *username,
+							const char *host,
+							const char *authenticationScheme);
+static bool normalize_hba_line(const char *line, int lineLength,
+							   char *destination, int size);
+static int compare_hba_rules(const void *a, const void *b);
+static bool hba_editor_index_rule(HBAEditor *editor, const char *rule);
+static bool write_file_atomically(const char *data, long fileSize,
+								  const char *filePath);
 
 
 /*
  * pghba_ensure_host_rule_exists ensures that a host rule exists in the
  * pg_hba file with the given database, username, host and authentication
- * scheme.
+ * scheme. When the caller has several rules to add, it should rather use an
+ * HBAEditor so that the file is written only once.
  */
 bool
 pghba_ensure_host_rule_exists(const char *hbaFilePath,
@@ -46,12 +64,243 @@ pghba_ensure_host_rule_exists(const char *hbaFilePath,
 							  const char *host,
 							  const char *authenticationScheme)
 {
-	char hbaLine[BUFSIZE];
-	char *hbaLineEnd = hbaLine;
+	HBAEditor editor = { 0 };
+	bool success = false;
+
+	if (!pghba_editor_init(&editor, hbaFilePath))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	success =
+		pghba_editor_add_host_rule(&editor, databaseType, database,
+								   username, host, authenticationScheme) &&
+		pghba_editor_commit(&editor);
+
+	pghba_editor_destroy(&editor);
+
+	return success;
+}
+
+
+/*
+ * pghba_editor_init reads the given HBA file once, and indexes the rules it
+ * already contains so that pghba_editor_add_host_rule can skip the rules
+ * that exist without searching the whole file contents each time.
+ */
+bool
+pghba_editor_init(HBAEditor *editor, const char *hbaFilePath)
+{
 	char *currentHbaContents = NULL;
 	long currentHbaSize = 0L;
-	char *includeLine = NULL;
-	PQExpBuffer newHbaContents = NULL;
+	char *line = NULL;
+
+	strlcpy(editor->hbaFilePath, hbaFilePath, MAXPGPATH);
+	editor->contents = NULL;
+	editor->rules = NULL;
+	editor->ruleCount = 0;
+	editor->ruleCapacity = 0;
+	editor->changed = false;
+
+	if (!read_file(hbaFilePath, &currentHbaContents, &currentHbaSize))
+	{
+		/* read_file logs an error */
+		return false;
+	}
+
+	editor->contents = createPQExpBuffer();
+	if (editor->contents == NULL)
+	{
+		log_error("Failed to allocate memory");
+		free(currentHbaContents);
+		return false;
+	}
+
+	appendPQExpBufferStr(editor->contents, currentHbaContents);
+
+	for (line = currentHbaContents; *line != '\0';)
+	{
+		char *lineEnd = strchr(line, '\n');
+		int lineLength = lineEnd ? lineEnd - line : strlen(line);
+		char rule[BUFSIZE];
+
+		if (normalize_hba_line(line, lineLength, rule, BUFSIZE) &&
+			!hba_editor_index_rule(editor, rule))
+		{
+			free(currentHbaContents);
+			pghba_editor_destroy(editor);
+			return false;
+		}
+
+		line += lineLength + (lineEnd ? 1 : 0);
+	}
+
+	free(currentHbaContents);
+
+	/* the index is kept sorted for pghba_editor_add_host_rule */
+	if (editor->ruleCount > 0)
+	{
+		qsort(editor->rules, editor->ruleCount, sizeof(char *),
+			  compare_hba_rules);
+	}
+
+	log_debug("Read %d rules from the HBA file \"%s\"",
+			  editor->ruleCount, hbaFilePath);
+
+	return true;
+}
+
+
+/*
+ * pghba_editor_add_host_rule adds a host rule with the given database,
+ * username, host and authentication scheme to the HBA file contents held in
+ * the editor, unless the same rule already exists there. Rules that only
+ * differ in spacing or trailing comments are considered the same.
+ */
+bool
+pghba_editor_add_host_rule(HBAEditor *editor,
+						   HBADatabaseType databaseType,
+						   const char *database,
+						   const char *username,
+						   const char *host,
+						   const char *authenticationScheme)
+{
+	char hbaLine[BUFSIZE];
+	char *rule = hbaLine;
+	int lower = 0;
+	int upper = editor->ruleCount;
+
+	(void) build_host_rule(hbaLine, databaseType, database, username, host,
+						   authenticationScheme);
+
+	log_debug("Ensuring the HBA file \"%s\" contains the line: %s",
+			  editor->hbaFilePath, hbaLine);
+
+	/* binary search for the rule, or for where to insert it */
+	while (lower < upper)
+	{
+		int middle = lower + (upper - lower) / 2;
+		int cmp = strcmp(editor->rules[middle], hbaLine);
+
+		if (cmp == 0)
+		{
+			log_debug("Line already exists in %s, skipping",
+					  editor->hbaFilePath);
+			return true;
+		}
+		else if (cmp < 0)
+		{
+			lower = middle + 1;
+		}
+		else
+		{
+			upper = middle;
+		}
+	}
+
+	if (!hba_editor_index_rule(editor, rule))
+	{
+		return false;
+	}
+
+	/* hba_editor_index_rule appends, move the new rule to its sorted place */
+	rule = editor->rules[editor->ruleCount - 1];
+	memmove(&(editor->rules[lower + 1]), &(editor->rules[lower]),
+			(editor->ruleCount - 1 - lower) * sizeof(char *));
+	editor->rules[lower] = rule;
+
+	/* make sure our rule starts on a new line */
+	if (editor->contents->len > 0 &&
+		editor->contents->data[editor->contents->len - 1] != '\n')
+	{
+		appendPQExpBufferChar(editor->contents, '\n');
+	}
+
+	appendPQExpBufferStr(editor->contents, hbaLine);
+	appendPQExpBufferStr(editor->contents, HBA_LINE_COMMENT "\n");
+
+	/* memory allocation could have failed while building string */
+	if (PQExpBufferBroken(editor->contents))
+	{
+		log_error("Failed to allocate memory");
+		return false;
+	}
+
+	editor->changed = true;
+
+	return true;
+}
+
+
+/*
+ * pghba_editor_commit writes the HBA file when rules have been added to it
+ * since pghba_editor_init, in a single atomic step. Callers should reload
+ * Postgres only when editor->changed is true after a successful commit.
+ */
+bool
+pghba_editor_commit(HBAEditor *editor)
+{
+	if (!editor->changed)
+	{
+		log_debug("HBA file \"%s\" already contains all the rules, "
+				  "skipping", editor->hbaFilePath);
+		return true;
+	}
+
+	(void) timings_start_span("edit pg_hba.conf");
+
+	if (!write_file_atomically(editor->contents->data,
+							   editor->contents->len,
+							   editor->hbaFilePath))
+	{
+		/* write_file_atomically logs an error */
+		return timings_end_span(false);
+	}
+
+	log_debug("Wrote new %s", editor->hbaFilePath);
+
+	return timings_end_span(true);
+}
+
+
+/*
+ * pghba_editor_destroy releases the memory used by the editor.
+ */
+void
+pghba_editor_destroy(HBAEditor *editor)
+{
+	for (int ruleIndex = 0; ruleIndex < editor->ruleCount; ruleIndex++)
+	{
+		free(editor->rules[ruleIndex]);
+	}
+	free(editor->rules);
+
+	if (editor->contents != NULL)
+	{
+		destroyPQExpBuffer(editor->contents);
+	}
+
+	editor->rules = NULL;
+	editor->ruleCount = 0;
+	editor->ruleCapacity = 0;
+	editor->contents = NULL;
+}
+
+
+/*
+ * build_host_rule writes the HBA host rule for the given database, username,
+ * host and authentication scheme to hbaLine, in the normalized form that
+ * normalize_hba_line produces, so that both can be compared directly.
+ */
+static void
+build_host_rule(char *hbaLine, HBADatabaseType databaseType,
+				const char *database,
+				const char *username,
+				const char *host,
+				const char *authenticationScheme)
+{
+	char *hbaLineEnd = hbaLine;
 
 	hbaLineEnd += sprintf(hbaLineEnd, "host ");
 	hbaLineEnd += get_database_field(hbaLineEnd, databaseType, database);
@@ -67,65 +316,165 @@ pghba_ensure_host_rule_exists(const char *hbaFilePath,
 	hbaLineEnd += sprintf(hbaLineEnd, " ");
 	hbaLineEnd += convert_ip_to_cidr(hbaLineEnd, host);
 	hbaLineEnd += sprintf(hbaLineEnd, " %s", authenticationScheme);
+}
 
-	log_debug("Ensuring the HBA file \"%s\" contains the line: %s",
-			  hbaFilePath, hbaLine);
 
-	if (!read_file(hbaFilePath, &currentHbaContents, &currentHbaSize))
+/*
+ * normalize_hba_line copies the rule found in the given HBA file line to
+ * destination, with a single space between fields and without the comment.
+ * Whitespace and # characters within double quotes are kept. The function
+ * returns false for lines that contain no rule, and for rules that do not
+ * fit in destination, which we then never match.
+ */
+static bool
+normalize_hba_line(const char *line, int lineLength,
+				   char *destination, int size)
+{
+	bool inQuotes = false;
+	bool pendingSpace = false;
+	int length = 0;
+
+	for (int charIndex = 0; charIndex < lineLength; charIndex++)
 	{
-		/* read_file logs an error */
-		return false;
+		char currentChar = line[charIndex];
+
+		if (!inQuotes && currentChar == '#')
+		{
+			break;
+		}
+
+		if (!inQuotes && isspace((unsigned char) currentChar))
+		{
+			pendingSpace = length > 0;
+			continue;
+		}
+
+		if (length + 2 >= size)
+		{
+			return false;
+		}
+
+		if (pendingSpace)
+		{
+			destination[length++] = ' ';
+			pendingSpace = false;
+		}
+
+		if (currentChar == '"')
+		{
+			inQuotes = !inQuotes;
+		}
+
+		destination[length++] = currentChar;
 	}
 
-	includeLine = strstr(currentHbaContents, hbaLine);
+	destination[length] = '\0';
 
-	/*
-	 * If the rule was found and it starts on a new line. We can
-	 * skip adding it.
-	 */
-	if (includeLine != NULL && (includeLine == currentHbaContents ||
-								includeLine[-1] == '\n'))
+	return length > 0;
+}
+
+
+/*
+ * compare_hba_rules is a qsort comparator for the rules index of an
+ * HBAEditor.
+ */
+static int
+compare_hba_rules(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+
+/*
+ * hba_editor_index_rule appends a copy of the given rule to the editor index.
+ */
+static bool
+hba_editor_index_rule(HBAEditor *editor, const char *rule)
+{
+	if (editor->ruleCount == editor->ruleCapacity)
 	{
-		log_debug("Line already exists in %s, skipping", hbaFilePath);
-		free(currentHbaContents);
-		return true;
+		int capacity = editor->ruleCapacity == 0 ? 16 : 2 * editor->ruleCapacity;
+		char **rules = realloc(editor->rules, capacity * sizeof(char *));
+
+		if (rules == NULL)
+		{
+			log_error("Failed to allocate memory");
+			return false;
+		}
+
+		editor->rules = rules;
+		editor->ruleCapacity = capacity;
 	}
 
-	/* build the new postgresql.conf contents */
-	newHbaContents = createPQExpBuffer();
-	if (newHbaContents == NULL)
+	editor->rules[editor->ruleCount] = strdup(rule);
+
+	if (editor->rules[editor->ruleCount] == NULL)
 	{
 		log_error("Failed to allocate memory");
-		free(currentHbaContents);
 		return false;
 	}
 
-	appendPQExpBufferStr(newHbaContents, currentHbaContents);
-	appendPQExpBufferStr(newHbaContents, hbaLine);
-	appendPQExpBufferStr(newHbaContents, HBA_LINE_COMMENT "\n");
+	++editor->ruleCount;
 
-	/* done with the old postgresql.conf contents */
-	free(currentHbaContents);
+	return true;
+}
 
-	/* memory allocation could have failed while building string */
-	if (PQExpBufferBroken(newHbaContents))
+
+/*
+ * write_file_atomically writes data to a temporary file next to filePath,
+ * flushes it to disk, and then renames it over filePath. Postgres reading
+ * the HBA file at the same time sees either the old or the new contents,
+ * never a partially written file.
+ */
+static bool
+write_file_atomically(const char *data, long fileSize, const char *filePath)
+{
+	char tempFilePath[MAXPGPATH];
+	int fd = -1;
+
+	snprintf(tempFilePath, MAXPGPATH, "%s.tmp", filePath);
+
+	fd = open(tempFilePath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0)
 	{
-		log_error("Failed to allocate memory");
-		destroyPQExpBuffer(newHbaContents);
+		log_error("Failed to open file \"%s\": %s",
+				  tempFilePath, strerror(errno));
+		return false;
+	}
+
+	errno = 0;
+	if (write(fd, data, fileSize) != fileSize)
+	{
+		/* if write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+		{
+			errno = ENOSPC;
+		}
+		log_error("Failed to write file \"%s\": %s",
+				  tempFilePath, strerror(errno));
+		close(fd);
+		(void) unlink_file(tempFilePath);
 		return false;
 	}
 
-	/* write the new postgresql.conf */
-	if (!write_file(newHbaContents->data, newHbaContents->len, hbaFilePath))
+	if (fsync(fd) != 0)
 	{
-		/* write_file logs an error */
-		destroyPQExpBuffer(newHbaContents);
+		log_error("Failed to fsync file \"%s\": %s",
+				  tempFilePath, strerror(errno));
+		close(fd);
+		(void) unlink_file(tempFilePath);
 		return false;
 	}
 
-	destroyPQExpBuffer(newHbaContents);
+	close(fd);
 
-	log_debug("Wrote new %s", hbaFilePath);
+	if (rename(tempFilePath, filePath) != 0)
+	{
+		log_error("Failed to rename \"%s\" to \"%s\": %s",
+				  tempFilePath, filePath, strerror(errno));
+		(void) unlink_file(tempFilePath);
+		return false;
+	}
 
 	return true;
 }
@@ -267,6 +616,8 @@ pghba_enable_lan_cidr(PGSQL *pgsql, HBADatabaseType databaseType,
 	char hbaFilePath[MAXPGPATH];
 	char ipAddr[BUFSIZE];
 	char cidr[BUFSIZE];
+	HBAEditor editor = { 0 };
+	bool changed = false;
 
 	/* Compute the CIDR notation for our hostname */
 	if (!findHostnameLocalAddress(hostname, ipAddr, BUFSIZE))
@@ -305,18 +656,31 @@ pghba_enable_lan_cidr(PGSQL *pgsql, HBADatabaseType databaseType,
 		snprintf(hbaFilePath, MAXPGPATH, "%s/pg_hba.conf", pgdata);
 	}
 
-	if (!pghba_ensure_host_rule_exists(hbaFilePath, databaseType, database,
-									   username, cidr, authenticationScheme))
+	if (!pghba_editor_init(&editor, hbaFilePath))
+	{
+		log_error("Failed to add the local network to PostgreSQL HBA file: "
+				  "couldn't read the pg_hba file");
+		return false;
+	}
+
+	if (!pghba_editor_add_host_rule(&editor, databaseType, database,
+									username, cidr, authenticationScheme) ||
+		!pghba_editor_commit(&editor))
 	{
 		log_error("Failed to add the local network to PostgreSQL HBA file: "
 				  "couldn't modify the pg_hba file");
+		pghba_editor_destroy(&editor);
 		return false;
 	}
 
+	changed = editor.changed;
+	pghba_editor_destroy(&editor);
+
 	/*
-	 * pgdata is given when PostgreSQL is not yet running, don't reload then...
+	 * pgdata is given when PostgreSQL is not yet running, don't reload then,
+	 * and there's no need to reload when the rule was already there.
 	 */
-	if (pgdata == NULL && !pgsql_reload_conf(pgsql))
+	if (pgdata == NULL && changed && !pgsql_reload_conf(pgsql))
 	{
 		log_error("Failed to reload PostgreSQL configuration for new HBA rule");
 		return false;
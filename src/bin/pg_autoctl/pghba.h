@@ -10,6 +10,9 @@
 #ifndef PGHBA_H
 #define PGHBA_H
 
+#include "postgres_fe.h"
+#include "pqexpbuffer.h"
+
 #include "pgsql.h"
 
 /* supported HBA database values */
@@ -20,6 +23,21 @@ typedef enum HBADatabaseType
 	HBA_DATABASE_DBNAME
 } HBADatabaseType;
 
+/*
+ * An HBAEditor holds the contents of a pg_hba file in memory, along with a
+ * sorted index of the rules it contains, so that callers can add several
+ * rules and then write the file (and reload Postgres) only once.
+ */
+typedef struct HBAEditor
+{
+	char hbaFilePath[MAXPGPATH];
+	PQExpBuffer contents;
+	char **rules;               /* normalized rules, sorted */
+	int ruleCount;
+	int ruleCapacity;
+	bool changed;               /* rules were added since init */
+} HBAEditor;
+
 
 bool pghba_ensure_host_rule_exists(const char *hbaFilePath,
 								   HBADatabaseType,
@@ -28,6 +46,16 @@ bool pghba_ensure_host_rule_exists(const char *hbaFilePath,
 								   const char *hostname,
 								   const char *authenticationScheme);
 
+bool pghba_editor_init(HBAEditor *editor, const char *hbaFilePath);
+bool pghba_editor_add_host_rule(HBAEditor *editor,
+								HBADatabaseType databaseType,
+								const char *database,
+								const char *username,
+								const char *hostname,
+								const char *authenticationScheme);
+bool pghba_editor_commit(HBAEditor *editor);
+void pghba_editor_destroy(HBAEditor *editor);
+
 bool pghba_enable_lan_cidr(PGSQL *pgsql, HBADatabaseType databaseType,
 						   const char *database,
 						   const char *hostname,
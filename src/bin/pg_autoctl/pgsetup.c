@@ -10,12 +10,19 @@
  */
 
 #include <inttypes.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#include "portability/instr_time.h"
+
 #include "defaults.h"
 #include "pgctl.h"
 #include "log.h"
@@ -25,6 +32,9 @@
 static bool get_pgpid(PostgresSetup *pgSetup, bool pg_is_not_running_is_ok);
 static PostmasterStatus pmStatusFromString(const char *postmasterStatus);
 static char *pmStatusToString(PostmasterStatus pm_status);
+static bool read_pidfile_status(const char *pgdata,
+								long *pid, PostmasterStatus *pm_status);
+static bool wait_for_pidfile_event(int watchFd, int timeoutMs);
 
 
 /*
@@ -680,6 +690,11 @@ pg_setup_is_ready(PostgresSetup *pgSetup, bool pg_is_not_running_is_ok)
 	{
 		bool firstTime = true;
 		int warnings = 0;
+		instr_time startTime;
+		instr_time lastWarningTime;
+
+		INSTR_TIME_SET_CURRENT(startTime);
+		lastWarningTime = startTime;
 
 		/*
 		 * Invalidate in-memory Postmaster status cache.
@@ -743,15 +758,39 @@ pg_setup_is_ready(PostgresSetup *pgSetup, bool pg_is_not_running_is_ok)
 			{
 				firstTime = false;
 			}
-			else
+			else if (pgSetup->pm_status != POSTMASTER_STATUS_READY)
 			{
-				warnings++;
-				log_warn("Postgres is not ready for connections: "
-						 "postmaster status is \"%s\", retrying in %ds.",
-						 pmStatusToString(pgSetup->pm_status),
-						 PG_AUTOCTL_KEEPER_SLEEP_TIME);
+				instr_time now;
+				instr_time sinceLastWarning;
+
+				INSTR_TIME_SET_CURRENT(now);
+				sinceLastWarning = now;
+				INSTR_TIME_SUBTRACT(sinceLastWarning, lastWarningTime);
+
+				/*
+				 * We poll the pid file often so that we notice that Postgres
+				 * is ready as soon as possible, but only warn every now and
+				 * then.
+				 */
+				if (warnings == 0 ||
+					INSTR_TIME_GET_MILLISEC(sinceLastWarning) >=
+					PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000)
+				{
+					instr_time elapsed = now;
+
+					INSTR_TIME_SUBTRACT(elapsed, startTime);
 
-				sleep(PG_AUTOCTL_KEEPER_SLEEP_TIME);
+					warnings++;
+					lastWarningTime = now;
+
+					log_warn("Postgres is not ready for connections: "
+							 "postmaster status is \"%s\" after %.0f ms, "
+							 "retrying.",
+							 pmStatusToString(pgSetup->pm_status),
+							 INSTR_TIME_GET_MILLISEC(elapsed));
+				}
+
+				pg_usleep(PG_SETUP_IS_READY_POLL_TIME_MS * 1000);
 			}
 
 			if (asked_to_stop == 1 || asked_to_stop_fast == 1)
@@ -767,7 +806,13 @@ pg_setup_is_ready(PostgresSetup *pgSetup, bool pg_is_not_running_is_ok)
 		 */
 		if (warnings > 0 && pgSetup->pm_status == POSTMASTER_STATUS_READY)
 		{
-			log_info("Postgres is ready");
+			instr_time elapsed;
+
+			INSTR_TIME_SET_CURRENT(elapsed);
+			INSTR_TIME_SUBTRACT(elapsed, startTime);
+
+			log_info("Postgres is ready after %.0f ms",
+					 INSTR_TIME_GET_MILLISEC(elapsed));
 		}
 	}
 
@@ -1028,3 +1073,269 @@ pmStatusToString(PostmasterStatus pm_status)
 	/* keep compiler happy */
 	return "unknown";
 }
+
+
+/*
+ * pg_setup_watch_pidfile returns a file descriptor that becomes readable when
+ * PGDATA/postmaster.pid is created, written to, or removed, or -1 when that's
+ * not supported on this platform. We use inotify on Linux, elsewhere callers
+ * poll the file at PG_SETUP_IS_READY_POLL_TIME_MS intervals.
+ *
+ * Watching starts at once, so that the caller may call this function before
+ * starting or stopping Postgres and not miss any change.
+ */
+int
+pg_setup_watch_pidfile(const char *pgdata)
+{
+#if defined(__linux__)
+	int watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (watchFd < 0)
+	{
+		log_debug("Failed to initialize inotify: %s", strerror(errno));
+		return -1;
+	}
+
+	if (inotify_add_watch(watchFd, pgdata,
+						  IN_CREATE | IN_DELETE | IN_MODIFY |
+						  IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		log_debug("Failed to watch directory \"%s\": %s",
+				  pgdata, strerror(errno));
+		close(watchFd);
+		return -1;
+	}
+
+	return watchFd;
+#else
+	return -1;
+#endif
+}
+
+
+/*
+ * pg_setup_get_postmaster_pid returns the pid found in PGDATA/postmaster.pid,
+ * or 0 when there's no such file. The process might not be running.
+ */
+long
+pg_setup_get_postmaster_pid(const char *pgdata)
+{
+	long pid = 0;
+	PostmasterStatus pm_status = POSTMASTER_STATUS_UNKNOWN;
+
+	if (!read_pidfile_status(pgdata, &pid, &pm_status))
+	{
+		return 0;
+	}
+
+	return pid;
+}
+
+
+/*
+ * pg_setup_wait_until_ready waits until the postmaster.pid file in PGDATA
+ * shows that Postgres accepts connections, or that it exited, or until
+ * timeoutMs have passed. It returns true when Postgres is ready.
+ *
+ * Postgres writes its status in the pid file as soon as it is ready, so we
+ * notice within a few milliseconds rather than at the next poll of pg_ctl.
+ * The stalePid is the one that was in the pid file before starting Postgres,
+ * if any: until the new postmaster replaces the file, we ignore its contents.
+ */
+bool
+pg_setup_wait_until_ready(const char *pgdata, long stalePid,
+						  int watchFd, int timeoutMs)
+{
+	instr_time startTime;
+	long postmasterPid = 0;
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	for (;;)
+	{
+		long pid = 0;
+		PostmasterStatus pm_status = POSTMASTER_STATUS_UNKNOWN;
+		instr_time elapsed;
+
+		if (read_pidfile_status(pgdata, &pid, &pm_status) &&
+			pid > 0 && pid != stalePid)
+		{
+			postmasterPid = pid;
+
+			/* pg_ctl --wait considers a standby without hot_standby ready */
+			if (pm_status == POSTMASTER_STATUS_READY ||
+				pm_status == POSTMASTER_STATUS_STANDBY)
+			{
+				INSTR_TIME_SET_CURRENT(elapsed);
+				INSTR_TIME_SUBTRACT(elapsed, startTime);
+
+				log_debug("Postgres is ready after %.0f ms",
+						  INSTR_TIME_GET_MILLISEC(elapsed));
+				return true;
+			}
+		}
+
+		/* the pid file might be gone already, check the process itself */
+		if (postmasterPid > 0 && kill(postmasterPid, 0) != 0)
+		{
+			log_error("Postgres exited while starting, "
+					  "see \"%s/startup.log\" for details", pgdata);
+			return false;
+		}
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, startTime);
+
+		if (INSTR_TIME_GET_MILLISEC(elapsed) >= timeoutMs)
+		{
+			log_error("Postgres is still not ready after %d ms", timeoutMs);
+			return false;
+		}
+
+		if (asked_to_stop_fast)
+		{
+			return false;
+		}
+
+		(void) wait_for_pidfile_event(watchFd, PG_SETUP_IS_READY_POLL_TIME_MS);
+	}
+}
+
+
+/*
+ * pg_setup_wait_until_stopped waits until the postmaster process pid has
+ * exited and removed its pid file, or until timeoutMs have passed. It returns
+ * true when Postgres is stopped.
+ */
+bool
+pg_setup_wait_until_stopped(const char *pgdata, long pid,
+							int watchFd, int timeoutMs)
+{
+	instr_time startTime;
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	for (;;)
+	{
+		long currentPid = 0;
+		PostmasterStatus pm_status = POSTMASTER_STATUS_UNKNOWN;
+		instr_time elapsed;
+
+		/*
+		 * The postmaster removes its pid file as the very last step of a
+		 * shutdown. When the process is gone and the file is still there, it
+		 * crashed: it's stopped too.
+		 */
+		if (!read_pidfile_status(pgdata, &currentPid, &pm_status) ||
+			currentPid != pid ||
+			kill(pid, 0) != 0)
+		{
+			INSTR_TIME_SET_CURRENT(elapsed);
+			INSTR_TIME_SUBTRACT(elapsed, startTime);
+
+			log_debug("Postgres is stopped after %.0f ms",
+					  INSTR_TIME_GET_MILLISEC(elapsed));
+			return true;
+		}
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, startTime);
+
+		if (INSTR_TIME_GET_MILLISEC(elapsed) >= timeoutMs)
+		{
+			log_error("Postgres pid %ld is still running after %d ms",
+					  pid, timeoutMs);
+			return false;
+		}
+
+		(void) wait_for_pidfile_event(watchFd, PG_SETUP_IS_READY_POLL_TIME_MS);
+	}
+}
+
+
+/*
+ * read_pidfile_status reads the pid and the status of the postmaster from its
+ * pid file, without logging anything: while Postgres starts the file may be
+ * incomplete, in which case the status is left unknown. Returns false when
+ * there is no pid file.
+ */
+static bool
+read_pidfile_status(const char *pgdata, long *pid, PostmasterStatus *pm_status)
+{
+	FILE *fp;
+	int lineno;
+	char line[BUFSIZE];
+	char pidfile[MAXPGPATH];
+
+	join_path_components(pidfile, pgdata, "postmaster.pid");
+
+	if ((fp = fopen(pidfile, "r")) == NULL)
+	{
+		return false;
+	}
+
+	*pid = 0;
+	*pm_status = POSTMASTER_STATUS_UNKNOWN;
+
+	for (lineno = 1; lineno <= LOCK_FILE_LINE_PM_STATUS; lineno++)
+	{
+		int lineLength = 0;
+
+		if (fgets(line, sizeof(line), fp) == NULL)
+		{
+			break;
+		}
+
+		lineLength = strlen(line);
+
+		if (lineno == LOCK_FILE_LINE_PID)
+		{
+			sscanf(line, "%ld", pid);
+		}
+
+		/* only parse the status line once it's been written fully */
+		if (lineno == LOCK_FILE_LINE_PM_STATUS &&
+			lineLength > 1 && line[lineLength - 1] == '\n')
+		{
+			line[lineLength - 1] = '\0';
+			*pm_status = pmStatusFromString(line);
+		}
+	}
+	fclose(fp);
+
+	return true;
+}
+
+
+/*
+ * wait_for_pidfile_event waits until something changes in PGDATA, such as the
+ * pid file, or timeoutMs have passed. It returns true when there was a change.
+ */
+static bool
+wait_for_pidfile_event(int watchFd, int timeoutMs)
+{
+	if (watchFd < 0)
+	{
+		pg_usleep(timeoutMs * 1000L);
+		return false;
+	}
+
+#if defined(__linux__)
+	{
+		struct pollfd pollFd = { watchFd, POLLIN, 0 };
+		char buffer[BUFSIZE];
+
+		if (poll(&pollFd, 1, timeoutMs) <= 0)
+		{
+			return false;
+		}
+
+		/* we don't need the events themselves, just drain the queue */
+		while (read(watchFd, buffer, sizeof(buffer)) > 0)
+		{
+		}
+	}
+#endif
+
+	return true;
+}
@@ -67,9 +67,9 @@ typedef enum
  * citus extension in shared_preload_libraries, which the keeper ensures.
  *
  * At failover time, when dealing with a Citus worker instance, the keeper
- * fetches its coordinator nodename and port from the monitor and blocks writes
- * using the citus master_update_node() function call in a prepared
- * transaction.
+ * fetches its coordinator nodename and port from the monitor and, once
+ * promoted, points the coordinator metadata at the new primary using the
+ * citus master_update_node() function, within a bounded deadline.
  */
 
 typedef enum PgInstanceKind
@@ -131,6 +131,12 @@ bool pg_setup_pgdata_exists(PostgresSetup *pgSetup);
 bool pg_setup_is_running(PostgresSetup *pgSetup);
 bool pg_setup_is_primary(PostgresSetup *pgSetup);
 bool pg_setup_is_ready(PostgresSetup *pgSetup, bool pg_is_not_running_is_ok);
+int pg_setup_watch_pidfile(const char *pgdata);
+long pg_setup_get_postmaster_pid(const char *pgdata);
+bool pg_setup_wait_until_ready(const char *pgdata, long stalePid,
+							   int watchFd, int timeoutMs);
+bool pg_setup_wait_until_stopped(const char *pgdata, long pid,
+								 int watchFd, int timeoutMs);
 char *pg_setup_get_username(PostgresSetup *pgSetup);
 char *pg_setup_get_auth_method(PostgresSetup *pgSetup);
 bool pg_setup_set_absolute_pgdata(PostgresSetup *pgSetup);
@@ -7,13 +7,23 @@
  *
  */
 
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
 #include "postgres_fe.h"
 #include "libpq-fe.h"
+#include "portability/instr_time.h"
 #include "pqexpbuffer.h"
 
 #include "defaults.h"
 #include "log.h"
 #include "pgsql.h"
+#include "signals.h"
+#include "timings.h"
 
 
 #define ERRCODE_DUPLICATE_OBJECT "42710"
@@ -23,6 +33,31 @@
 static void pgAutoCtlDefaultNoticeProcessor(void *arg, const char *message);
 static void pgAutoCtlDebugNoticeProcessor(void *arg, const char *message);
 static PGconn * pgsql_open_connection(PGSQL *pgsql);
+static uint64_t pgsql_now_ms(void);
+static int pgsql_connection_params(PGSQL *pgsql,
+								   const char **keywords, const char **values,
+								   char buffers[][BUFSIZE]);
+static PGconn * pgsql_connect_with_deadline(const char **keywords,
+											const char **values,
+											int timeoutMs);
+static bool pgsql_connection_is_usable(PGconn *connection);
+static bool pgsql_connection_may_retry(PGSQL *pgsql);
+static void pgsql_connection_failed(PGSQL *pgsql);
+static void pgsql_connection_succeeded(PGSQL *pgsql, PGconn *connection);
+static void pgsql_async_send(PGSQLAsyncQuery *query);
+static void pgsql_async_read(PGSQLAsyncQuery *query);
+static void pgsql_async_fail(PGSQLAsyncQuery *query, const char *message);
+static void pgsql_async_cancel(PGSQLAsyncQuery *query);
+static PGresult * pgsql_exec_prepared(PGSQL *pgsql, const char *sql,
+									  int paramCount, const Oid *paramTypes,
+									  const char **paramValues,
+									  const int *paramLengths,
+									  const int *paramFormats,
+									  int resultFormat);
+static uint32_t pgsql_read_uint32(const char *buffer);
+static uint64_t pgsql_read_uint64(const char *buffer);
+static PGresult * pgsql_get_result(PGSQL *pgsql);
+static void pgsql_forget_prepared_statements(PGSQL *pgsql);
 static bool is_response_ok(PGresult *result);
 static bool clear_results(PGconn *connection);
 static bool pgsql_alter_system_set(PGSQL *pgsql, GUC setting);
@@ -30,6 +65,11 @@ static bool pgsql_get_current_setting(PGSQL *pgsql, char *settingName,
 									  char **currentValue);
 static int escape_conninfo_value(char *destination, const char *string);
 static void parsePgsrSyncStateAndWAL(void *ctx, PGresult *result);
+static void parseReplicationState(void *ctx, PGresult *result);
+static void parseUpstreamConninfo(const char *conninfo,
+								  PostgresReplicationState *state);
+static void parseReceivedAndReplayedLSN(void *ctx, PGresult *result);
+static void parsePostgresSetting(void *ctx, PGresult *result);
 
 
 /*
@@ -91,6 +131,198 @@ parseSingleValueResult(void *ctx, PGresult *result)
 }
 
 
+/*
+ * pgsql_get_int4 sets value to the integer at the given row and column of a
+ * result, and returns false when it's NULL or not an integer. Results in the
+ * binary format are read straight from the libpq buffer, in network byte
+ * order.
+ */
+bool
+pgsql_get_int4(PGresult *result, int row, int column, int *value)
+{
+	char *buffer = NULL;
+	char *endptr = NULL;
+	long parsed = 0;
+
+	if (PQgetisnull(result, row, column))
+	{
+		return false;
+	}
+
+	buffer = PQgetvalue(result, row, column);
+
+	if (PQfformat(result, column) == PGSQL_FORMAT_BINARY)
+	{
+		if (PQgetlength(result, row, column) != 4)
+		{
+			return false;
+		}
+
+		*value = (int32_t) pgsql_read_uint32(buffer);
+		return true;
+	}
+
+	errno = 0;
+	parsed = strtol(buffer, &endptr, 10);
+
+	if (errno != 0 || endptr == buffer || *endptr != '\0' ||
+		parsed < INT_MIN || parsed > INT_MAX)
+	{
+		return false;
+	}
+
+	*value = (int) parsed;
+	return true;
+}
+
+
+/*
+ * pgsql_get_int8 is pgsql_get_int4 for bigint values.
+ */
+bool
+pgsql_get_int8(PGresult *result, int row, int column, int64_t *value)
+{
+	char *buffer = NULL;
+	char *endptr = NULL;
+	long long parsed = 0;
+
+	if (PQgetisnull(result, row, column))
+	{
+		return false;
+	}
+
+	buffer = PQgetvalue(result, row, column);
+
+	if (PQfformat(result, column) == PGSQL_FORMAT_BINARY)
+	{
+		if (PQgetlength(result, row, column) != 8)
+		{
+			return false;
+		}
+
+		*value = (int64_t) pgsql_read_uint64(buffer);
+		return true;
+	}
+
+	errno = 0;
+	parsed = strtoll(buffer, &endptr, 10);
+
+	if (errno != 0 || endptr == buffer || *endptr != '\0')
+	{
+		return false;
+	}
+
+	*value = (int64_t) parsed;
+	return true;
+}
+
+
+/*
+ * pgsql_get_bool is pgsql_get_int4 for boolean values.
+ */
+bool
+pgsql_get_bool(PGresult *result, int row, int column, bool *value)
+{
+	char *buffer = NULL;
+
+	if (PQgetisnull(result, row, column))
+	{
+		return false;
+	}
+
+	buffer = PQgetvalue(result, row, column);
+
+	if (PQfformat(result, column) == PGSQL_FORMAT_BINARY)
+	{
+		if (PQgetlength(result, row, column) != 1)
+		{
+			return false;
+		}
+
+		*value = *buffer != 0;
+		return true;
+	}
+
+	*value = strcmp(buffer, "t") == 0;
+	return true;
+}
+
+
+/*
+ * pgsql_get_lsn is pgsql_get_int4 for pg_lsn values, which the binary format
+ * sends as a 64 bit integer, and the text format as two hexadecimal numbers
+ * separated by a slash.
+ */
+bool
+pgsql_get_lsn(PGresult *result, int row, int column, uint64_t *lsn)
+{
+	char *buffer = NULL;
+	uint32_t hi = 0;
+	uint32_t lo = 0;
+
+	if (PQgetisnull(result, row, column))
+	{
+		return false;
+	}
+
+	buffer = PQgetvalue(result, row, column);
+
+	if (PQfformat(result, column) == PGSQL_FORMAT_BINARY)
+	{
+		if (PQgetlength(result, row, column) != 8)
+		{
+			return false;
+		}
+
+		*lsn = pgsql_read_uint64(buffer);
+		return true;
+	}
+
+	if (sscanf(buffer, "%X/%X", &hi, &lo) != 2)
+	{
+		return false;
+	}
+
+	*lsn = ((uint64_t) hi) << 32 | lo;
+	return true;
+}
+
+
+/*
+ * pgsql_format_lsn writes the text representation of an LSN to buffer, the
+ * same as Postgres does, such as 0/3000060.
+ */
+void
+pgsql_format_lsn(uint64_t lsn, char *buffer, int size)
+{
+	snprintf(buffer, size, "%X/%X", (uint32_t) (lsn >> 32), (uint32_t) lsn);
+}
+
+
+/*
+ * pgsql_read_uint32 reads a 32 bit integer in network byte order.
+ */
+static uint32_t
+pgsql_read_uint32(const char *buffer)
+{
+	const unsigned char *bytes = (const unsigned char *) buffer;
+
+	return ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) |
+		   ((uint32_t) bytes[2] << 8) | (uint32_t) bytes[3];
+}
+
+
+/*
+ * pgsql_read_uint64 reads a 64 bit integer in network byte order.
+ */
+static uint64_t
+pgsql_read_uint64(const char *buffer)
+{
+	return ((uint64_t) pgsql_read_uint32(buffer) << 32) |
+		   pgsql_read_uint32(buffer + 4);
+}
+
+
 /*
  * pgsql_init initialises a PGSQL struct to connect to the given database
  * URL or connection string.
@@ -99,6 +331,14 @@ bool
 pgsql_init(PGSQL *pgsql, char *url)
 {
 	pgsql->connection = NULL;
+	pgsql->keepConnection = false;
+	pgsql->connectionFailures = 0;
+	pgsql->nextConnectionTimeMs = 0;
+	pgsql->cancelOnStop = false;
+	pgsql->listening = false;
+	pgsql->connectTimeoutMs = 0;
+	memset(&(pgsql->keepalives), 0, sizeof(PGSQLKeepalives));
+	pgsql->preparedStatementCount = 0;
 
 	if (validate_connection_string(url))
 	{
@@ -113,207 +353,1283 @@ pgsql_init(PGSQL *pgsql, char *url)
 }
 
 
-/*
- * Finish a PGSQL client connection.
- */
-void
-pgsql_finish(PGSQL *pgsql)
-{
-	if (pgsql->connection != NULL)
+/*
+ * Finish a PGSQL client connection.
+ */
+void
+pgsql_finish(PGSQL *pgsql)
+{
+	if (pgsql->connection != NULL)
+	{
+		log_debug("Disconnecting from \"%s\"", pgsql->connectionString);
+		PQfinish(pgsql->connection);
+		pgsql->connection = NULL;
+	}
+
+	/* prepared statements only live as long as their connection */
+	pgsql_forget_prepared_statements(pgsql);
+	pgsql->listening = false;
+}
+
+
+/*
+ * pgsql_release is called when we're done with a series of queries. It closes
+ * the connection, unless the PGSQL client has been setup to keep it open.
+ */
+void
+pgsql_release(PGSQL *pgsql)
+{
+	if (!pgsql->keepConnection)
+	{
+		pgsql_finish(pgsql);
+	}
+}
+
+
+/*
+ * pgsql_connection_is_usable checks that a connection that we kept open is
+ * still usable. Reading from the connection is how we notice that the server
+ * closed it, e.g. because it has been restarted.
+ */
+static bool
+pgsql_connection_is_usable(PGconn *connection)
+{
+	if (PQstatus(connection) != CONNECTION_OK ||
+		PQtransactionStatus(connection) != PQTRANS_IDLE)
+	{
+		return false;
+	}
+
+	if (PQconsumeInput(connection) == 0)
+	{
+		return false;
+	}
+
+	return PQstatus(connection) == CONNECTION_OK;
+}
+
+
+/*
+ * pgsql_open_connection opens a PostgreSQL connection, given a PGSQL client
+ * instance. If a connection is already open in the client (it's not NULL),
+ * then pgsql_open_connection reuses it and returns it immediately.
+ */
+static PGconn *
+pgsql_open_connection(PGSQL *pgsql)
+{
+	PGconn *connection = NULL;
+	const char *keywords[PGSQL_MAX_CONNECTION_PARAMS + 1];
+	const char *values[PGSQL_MAX_CONNECTION_PARAMS + 1];
+	char buffers[PGSQL_MAX_CONNECTION_PARAMS][BUFSIZE];
+
+	/* we might be connected already */
+	if (pgsql->connection != NULL)
+	{
+		if (pgsql_connection_is_usable(pgsql->connection))
+		{
+			return pgsql->connection;
+		}
+
+		log_info("Connection to \"%s\" has been lost, reconnecting",
+				 pgsql->connectionString);
+		pgsql_finish(pgsql);
+	}
+
+	/* don't hammer a server that we failed to connect to */
+	if (!pgsql_connection_may_retry(pgsql))
+	{
+		return NULL;
+	}
+
+	log_debug("Connecting to \"%s\"", pgsql->connectionString);
+
+	/* Make a connection to the database, with our keepalives settings */
+	(void) pgsql_connection_params(pgsql, keywords, values, buffers);
+
+	if (pgsql->connectTimeoutMs > 0)
+	{
+		connection = pgsql_connect_with_deadline(keywords, values,
+												 pgsql->connectTimeoutMs);
+	}
+	else
+	{
+		connection = PQconnectdbParams(keywords, values, 1);
+	}
+
+	/* Check to see that the backend connection was successfully made */
+	if (PQstatus(connection) != CONNECTION_OK)
+	{
+		log_error("Connection to database failed: %s", PQerrorMessage(connection));
+		PQfinish(connection);
+
+		pgsql_connection_failed(pgsql);
+
+		return NULL;
+	}
+
+	pgsql_connection_succeeded(pgsql, connection);
+
+	return connection;
+}
+
+
+/*
+ * pgsql_connection_may_retry returns false when we failed to connect to the
+ * server of a persistent connection recently: persistent connections are
+ * re-established with a jittered exponential backoff, so that we don't hammer
+ * a server that we failed to connect to.
+ */
+static bool
+pgsql_connection_may_retry(PGSQL *pgsql)
+{
+	if (pgsql->keepConnection && pgsql->connectionFailures > 0)
+	{
+		uint64_t nowMs = pgsql_now_ms();
+
+		if (nowMs < pgsql->nextConnectionTimeMs)
+		{
+			log_error("Failed to connect to \"%s\" %d times, "
+					  "waiting for another %d ms before retrying",
+					  pgsql->connectionString,
+					  pgsql->connectionFailures,
+					  (int) (pgsql->nextConnectionTimeMs - nowMs));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * pgsql_connection_failed computes when we may try to connect again after
+ * failing to connect, for persistent connections.
+ */
+static void
+pgsql_connection_failed(PGSQL *pgsql)
+{
+	if (pgsql->keepConnection)
+	{
+		/*
+		 * Wait for 1s after the first failure, then 2s, 4s, and so on,
+		 * minus up to half of that at random: when the server restarts,
+		 * all its clients failed at the same time, and we don't want them
+		 * to try connecting again all at the same time.
+		 */
+		int delayMs = PG_AUTOCTL_RECONNECT_MAX_DELAY * 1000;
+
+		if (pgsql->connectionFailures < 16)
+		{
+			delayMs = Min(1000 << pgsql->connectionFailures,
+						  PG_AUTOCTL_RECONNECT_MAX_DELAY * 1000);
+		}
+
+		delayMs -= (int) (random() % (delayMs / 2 + 1));
+
+		pgsql->connectionFailures++;
+		pgsql->nextConnectionTimeMs = pgsql_now_ms() + delayMs;
+	}
+}
+
+
+/*
+ * pgsql_connection_succeeded registers a new connection in the client.
+ */
+static void
+pgsql_connection_succeeded(PGSQL *pgsql, PGconn *connection)
+{
+	pgsql->connection = connection;
+	pgsql->connectionFailures = 0;
+	pgsql->nextConnectionTimeMs = 0;
+
+	/* set the libpq notice receiver to integrate notifications as warnings. */
+	PQsetNoticeProcessor(connection, &pgAutoCtlDefaultNoticeProcessor, pgsql);
+}
+
+
+/*
+ * pgsql_now_ms returns the current time in milliseconds since the epoch.
+ */
+static uint64_t
+pgsql_now_ms(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (uint64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+
+/*
+ * pgsql_connection_params prepares the keywords and values arrays that we
+ * give to libpq: the keepalives settings that are set, then our connection
+ * string, to be expanded by libpq. libpq processes the parameters in order,
+ * so that settings found in the connection string override ours. The values
+ * are written in the given buffers, and the function returns the number of
+ * parameters.
+ */
+static int
+pgsql_connection_params(PGSQL *pgsql,
+						const char **keywords, const char **values,
+						char buffers[][BUFSIZE])
+{
+	PGSQLKeepalives *keepalives = &(pgsql->keepalives);
+	int count = 0;
+
+	if (keepalives->idle > 0)
+	{
+		sprintf(buffers[count], "%d", keepalives->idle);
+		keywords[count] = "keepalives_idle";
+		values[count] = buffers[count];
+		count++;
+	}
+
+	if (keepalives->interval > 0)
+	{
+		sprintf(buffers[count], "%d", keepalives->interval);
+		keywords[count] = "keepalives_interval";
+		values[count] = buffers[count];
+		count++;
+	}
+
+	if (keepalives->count > 0)
+	{
+		sprintf(buffers[count], "%d", keepalives->count);
+		keywords[count] = "keepalives_count";
+		values[count] = buffers[count];
+		count++;
+	}
+
+#if PG_VERSION_NUM >= 120000
+
+	/* tcp_user_timeout is new in libpq 12 */
+	if (keepalives->tcpUserTimeout > 0)
+	{
+		sprintf(buffers[count], "%d", keepalives->tcpUserTimeout);
+		keywords[count] = "tcp_user_timeout";
+		values[count] = buffers[count];
+		count++;
+	}
+#endif
+
+	keywords[count] = "dbname";
+	values[count] = pgsql->connectionString;
+	count++;
+
+	keywords[count] = NULL;
+	values[count] = NULL;
+
+	return count;
+}
+
+
+/*
+ * pgsql_connect_with_deadline connects with the given parameters using the
+ * non-blocking libpq API, and gives up after timeoutMs milliseconds. The
+ * caller checks PQstatus() of the returned connection, as with PQconnectdb.
+ */
+static PGconn *
+pgsql_connect_with_deadline(const char **keywords, const char **values,
+							int timeoutMs)
+{
+	PGconn *connection = PQconnectStartParams(keywords, values, 1);
+	PostgresPollingStatusType pollStatus = PGRES_POLLING_WRITING;
+	instr_time startTime;
+
+	if (connection == NULL || PQstatus(connection) == CONNECTION_BAD)
+	{
+		return connection;
+	}
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	while (pollStatus != PGRES_POLLING_OK && pollStatus != PGRES_POLLING_FAILED)
+	{
+		struct pollfd pollFd;
+		instr_time elapsed;
+		int remainingMs = 0;
+		int ready = 0;
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, startTime);
+		remainingMs = timeoutMs - (int) INSTR_TIME_GET_MILLISEC(elapsed);
+
+		if (remainingMs <= 0)
+		{
+			log_warn("Failed to connect within %d ms, giving up", timeoutMs);
+			break;
+		}
+
+		pollFd.fd = PQsocket(connection);
+		pollFd.events =
+			pollStatus == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+		pollFd.revents = 0;
+
+		ready = poll(&pollFd, 1, remainingMs);
+
+		if (ready < 0 && errno != EINTR)
+		{
+			log_warn("Failed to wait for the connection: %s", strerror(errno));
+			break;
+		}
+
+		if (ready > 0)
+		{
+			pollStatus = PQconnectPoll(connection);
+		}
+	}
+
+	/*
+	 * When we gave up, the connection status is still in progress: the caller
+	 * only accepts CONNECTION_OK connections.
+	 */
+	return connection;
+}
+
+/*
+ * pgAutoCtlDefaultNoticeProcessor is our default PostgreSQL libpq Notice
+ * Processing: NOTICE, WARNING, HINT etc are processed as log_warn messages by
+ * default. When the server asks us to retry later, we also keep how long it
+ * asked us to wait in pgsql->retryAfterMs.
+ */
+static void
+pgAutoCtlDefaultNoticeProcessor(void *arg, const char *message)
+{
+	PGSQL *pgsql = (PGSQL *) arg;
+	const char *hint = strstr(message, "HINT:  Retry after ");
+	int retryAfterMs = 0;
+
+	log_warn("%s", message);
+
+	if (pgsql != NULL && hint != NULL &&
+		sscanf(hint, "HINT:  Retry after %d ms.", &retryAfterMs) == 1 &&
+		retryAfterMs > 0)
+	{
+		pgsql->retryAfterMs = retryAfterMs;
+	}
+}
+
+
+/*
+ * pgAutoCtlDebugNoticeProcessor is our PostgreSQL libpq Notice Processing to
+ * use when wanting to send NOTICE, WARNING, HINT as log_debug messages.
+ */
+static void
+pgAutoCtlDebugNoticeProcessor(void *arg, const char *message)
+{
+    log_debug("%s", message);
+}
+
+
+/*
+ * pgsql_execute opens a connection, runs a given SQL command, and closes
+ * the connection again.
+ *
+ * We avoid persisting connection across multiple commands to simplify error
+ * handling.
+ */
+static bool
+pgsql_execute(PGSQL *pgsql, const char *sql)
+{
+	return pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL, NULL, NULL);
+}
+
+
+/*
+ * pgsql_execute_with_params opens a connection, runs a given SQL command,
+ * and closes the connection again.
+ *
+ * We avoid persisting connection across multiple commands to simplify error
+ * handling.
+ */
+bool
+pgsql_execute_with_params(PGSQL *pgsql, const char *sql, int paramCount,
+						  const Oid *paramTypes, const char **paramValues,
+						  void *context, ParsePostgresResultCB *parseFun)
+{
+	return pgsql_execute_with_params_format(pgsql, sql,
+											paramCount, paramTypes, paramValues,
+											NULL, NULL, PGSQL_FORMAT_TEXT,
+											context, parseFun);
+}
+
+
+/*
+ * pgsql_execute_with_params_format is pgsql_execute_with_params with the
+ * paramLengths, paramFormats and resultFormat arguments of PQexecParams.
+ *
+ * The calls that happen at each keeper loop, such as node_active, send their
+ * integer parameters and fetch their results in binary format, so that
+ * neither the keeper nor the monitor print and parse them at each heartbeat.
+ * The parse callbacks then use pgsql_get_int4 and friends, which decode both
+ * formats.
+ */
+bool
+pgsql_execute_with_params_format(PGSQL *pgsql, const char *sql,
+								 int paramCount, const Oid *paramTypes,
+								 const char **paramValues,
+								 const int *paramLengths,
+								 const int *paramFormats,
+								 int resultFormat,
+								 void *context, ParsePostgresResultCB *parseFun)
+{
+	PGconn *connection = NULL;
+	PGresult *result = NULL;
+
+	/* state transitions time each of their SQL queries */
+	(void) timings_start_span(sql);
+
+	connection = pgsql_open_connection(pgsql);
+	if (connection == NULL)
+	{
+		return timings_end_span(false);
+	}
+
+	log_debug("%s;", sql);
+	if (paramCount > 0)
+	{
+		int paramIndex = 0;
+		int remainingBytes = BUFSIZE;
+		char debugParameters[BUFSIZE] = { 0 };
+		char *writePointer = (char *) debugParameters;
+
+		for (paramIndex=0; paramIndex < paramCount; paramIndex++)
+		{
+			int bytesWritten = 0;
+			const char *value = paramValues[paramIndex];
+
+			if (paramIndex > 0)
+			{
+				bytesWritten = snprintf(writePointer, remainingBytes, ", ");
+				remainingBytes -= bytesWritten;
+				writePointer += bytesWritten;
+			}
+
+			if (paramFormats != NULL &&
+				paramFormats[paramIndex] == PGSQL_FORMAT_BINARY)
+			{
+				/* we only send int4 and bool values in binary */
+				if (paramLengths[paramIndex] == 4)
+				{
+					bytesWritten = snprintf(writePointer, remainingBytes, "%d",
+											(int32_t) pgsql_read_uint32(value));
+				}
+				else
+				{
+					bytesWritten = snprintf(writePointer, remainingBytes, "%s",
+											*value ? "true" : "false");
+				}
+			}
+			else
+			{
+				bytesWritten = snprintf(writePointer, remainingBytes, "'%s'", value);
+			}
+			remainingBytes -= bytesWritten;
+			writePointer += bytesWritten;
+		}
+		log_debug("%s", debugParameters);
+	}
+
+	/*
+	 * When we keep the connection, we also keep the statements prepared, so
+	 * that the server doesn't have to parse and plan them again each time.
+	 */
+	if (pgsql->keepConnection)
+	{
+		result = pgsql_exec_prepared(pgsql, sql,
+									 paramCount, paramTypes, paramValues,
+									 paramLengths, paramFormats, resultFormat);
+	}
+	else
+	{
+		result = PQexecParams(connection, sql,
+							  paramCount, paramTypes, paramValues,
+							  paramLengths, paramFormats, resultFormat);
+	}
+
+	if (!is_response_ok(result))
+	{
+		log_error("Failed to execute \"%s\": %s", sql, PQerrorMessage(connection));
+		PQclear(result);
+		clear_results(connection);
+		pgsql_finish(pgsql);
+		return timings_end_span(false);
+	}
+
+	if (parseFun != NULL)
+	{
+		(*parseFun)(context, result);
+	}
+
+	PQclear(result);
+	clear_results(connection);
+
+	return timings_end_span(true);
+}
+
+
+/*
+ * pgsql_exec_prepared executes the given SQL statement with PQexecPrepared,
+ * preparing it first when that's the first time we execute it on the current
+ * connection. When the cache of prepared statements is full, we just use
+ * PQexecParams.
+ */
+static PGresult *
+pgsql_exec_prepared(PGSQL *pgsql, const char *sql,
+					int paramCount, const Oid *paramTypes,
+					const char **paramValues,
+					const int *paramLengths,
+					const int *paramFormats,
+					int resultFormat)
+{
+	PGconn *connection = pgsql->connection;
+	char statementName[BUFSIZE];
+	int statementIndex = 0;
+
+	for (statementIndex = 0;
+		 statementIndex < pgsql->preparedStatementCount;
+		 statementIndex++)
+	{
+		if (strcmp(pgsql->preparedStatements[statementIndex], sql) == 0)
+		{
+			break;
+		}
+	}
+
+	snprintf(statementName, BUFSIZE, "pgautoctl_%d", statementIndex);
+
+	if (statementIndex == pgsql->preparedStatementCount)
+	{
+		PGresult *result = NULL;
+
+		if (pgsql->preparedStatementCount == PGSQL_MAX_PREPARED_STATEMENTS)
+		{
+			if (!PQsendQueryParams(connection, sql,
+								   paramCount, paramTypes, paramValues,
+								   paramLengths, paramFormats, resultFormat))
+			{
+				return NULL;
+			}
+
+			return pgsql_get_result(pgsql);
+		}
+
+		log_debug("Preparing statement %s", statementName);
+
+		result = PQprepare(connection, statementName, sql,
+						   paramCount, paramTypes);
+
+		if (!is_response_ok(result))
+		{
+			return result;
+		}
+
+		PQclear(result);
+
+		pgsql->preparedStatements[statementIndex] = strdup(sql);
+		pgsql->preparedStatementCount++;
+	}
+
+	if (!PQsendQueryPrepared(connection, statementName,
+							 paramCount, paramValues,
+							 paramLengths, paramFormats, resultFormat))
+	{
+		return NULL;
+	}
+
+	return pgsql_get_result(pgsql);
+}
+
+
+/*
+ * pgsql_get_result waits for the result of the query that has been sent on
+ * the connection, like PQexec does, and returns the last result.
+ *
+ * Rather than blocking in libpq, we wait for either the connection socket or
+ * a signal, so that a long query doesn't delay our reaction to a shutdown
+ * request: we then cancel the query. A smart shutdown
+ * only cancels queries when pgsql->cancelOnStop is set, so that we still
+ * finish the current transition otherwise.
+ */
+static PGresult *
+pgsql_get_result(PGSQL *pgsql)
+{
+	PGconn *connection = pgsql->connection;
+	PGresult *lastResult = NULL;
+	bool canceled = false;
+
+	while (true)
+	{
+		PGresult *result = NULL;
+
+		while (PQisBusy(connection))
+		{
+			if (!canceled &&
+				(asked_to_stop_fast || (asked_to_stop && pgsql->cancelOnStop)))
+			{
+				char errbuf[256];
+				PGcancel *cancel = PQgetCancel(connection);
+
+				log_debug("Canceling the current query, pg_autoctl is stopping");
+
+				if (cancel == NULL || !PQcancel(cancel, errbuf, sizeof(errbuf)))
+				{
+					log_warn("Failed to cancel the current query: %s",
+							 cancel == NULL ? "no connection" : errbuf);
+				}
+
+				PQfreeCancel(cancel);
+				canceled = true;
+			}
+
+			(void) wait_for_signal(PQsocket(connection), -1);
+
+			if (!PQconsumeInput(connection))
+			{
+				/* PQgetResult now returns the error */
+				break;
+			}
+		}
+
+		result = PQgetResult(connection);
+
+		if (result == NULL)
+		{
+			break;
+		}
+
+		/* like PQexec, keep the first error rather than later results */
+		if (lastResult != NULL && !is_response_ok(lastResult))
+		{
+			PQclear(result);
+		}
+		else
+		{
+			PQclear(lastResult);
+			lastResult = result;
+		}
+
+		if (PQstatus(connection) == CONNECTION_BAD)
+		{
+			break;
+		}
+	}
+
+	return lastResult;
+}
+
+
+/*
+ * pgsql_forget_prepared_statements empties the cache of prepared statements,
+ * which is needed each time we close the connection.
+ */
+static void
+pgsql_forget_prepared_statements(PGSQL *pgsql)
+{
+	int statementIndex = 0;
+
+	for (statementIndex = 0;
+		 statementIndex < pgsql->preparedStatementCount;
+		 statementIndex++)
+	{
+		free(pgsql->preparedStatements[statementIndex]);
+		pgsql->preparedStatements[statementIndex] = NULL;
+	}
+
+	pgsql->preparedStatementCount = 0;
+}
+
+
+/*
+ * is_response_ok returns whether the query result is a correct response
+ * (not an error or failure).
+ */
+static bool
+is_response_ok(PGresult *result)
+{
+	ExecStatusType resultStatus = PQresultStatus(result);
+
+	return resultStatus == PGRES_SINGLE_TUPLE || resultStatus == PGRES_TUPLES_OK ||
+		   resultStatus == PGRES_COMMAND_OK;
+}
+
+
+/*
+ * clear_results consumes results on a connection until NULL is returned.
+ * If an error is returned it returns false.
+ */
+static bool
+clear_results(PGconn *connection)
+{
+	bool success = true;
+
+	while (true)
+	{
+		PGresult *result = PQgetResult(connection);
+		if (result == NULL)
+		{
+			break;
+		}
+
+		if (!is_response_ok(result))
+		{
+			log_error("Failure from Postgres: %s", PQerrorMessage(connection));
+			success = false;
+		}
+
+		PQclear(result);
+	}
+
+	return success;
+}
+
+
+/*
+ * Asynchronous queries.
+ *
+ * pgsql_async_start connects when needed and sends a query without waiting
+ * for anything: the caller then waits until the socket of the connection is
+ * ready for what pgsql_async_events returns, and calls pgsql_async_poll to
+ * move the query forward, until pgsql_async_poll returns true. When the query
+ * succeeded, its parseFun callback has been called with the result, as with
+ * pgsql_execute_with_params.
+ *
+ * pgsql_async_wait_all implements that loop for several queries, which then
+ * run concurrently on their own connections. The SQL text and parameters must
+ * remain valid until the query is done.
+ */
+bool
+pgsql_async_start(PGSQLAsyncQuery *query, PGSQL *pgsql, const char *sql,
+				  int paramCount, const Oid *paramTypes,
+				  const char **paramValues,
+				  void *context, ParsePostgresResultCB *parseFun)
+{
+	const char *keywords[PGSQL_MAX_CONNECTION_PARAMS + 1];
+	const char *values[PGSQL_MAX_CONNECTION_PARAMS + 1];
+	char buffers[PGSQL_MAX_CONNECTION_PARAMS][BUFSIZE];
+	PGconn *connection = NULL;
+
+	query->pgsql = pgsql;
+	query->sql = sql;
+	query->paramCount = paramCount;
+	query->paramTypes = paramTypes;
+	query->paramValues = paramValues;
+	query->context = context;
+	query->parseFun = parseFun;
+	query->result = NULL;
+	query->flushPending = false;
+	query->deadlineMs = 0;
+
+	/* we might be connected already */
+	if (pgsql->connection != NULL)
+	{
+		if (pgsql_connection_is_usable(pgsql->connection))
+		{
+			pgsql_async_send(query);
+			return query->state != PGSQL_ASYNC_FAILED;
+		}
+
+		log_info("Connection to \"%s\" has been lost, reconnecting",
+				 pgsql->connectionString);
+		pgsql_finish(pgsql);
+	}
+
+	if (!pgsql_connection_may_retry(pgsql))
+	{
+		query->state = PGSQL_ASYNC_FAILED;
+		return false;
+	}
+
+	log_debug("Connecting to \"%s\"", pgsql->connectionString);
+
+	(void) pgsql_connection_params(pgsql, keywords, values, buffers);
+
+	connection = PQconnectStartParams(keywords, values, 1);
+
+	if (connection == NULL || PQstatus(connection) == CONNECTION_BAD)
+	{
+		log_error("Connection to database failed: %s",
+				  connection == NULL
+				  ? "out of memory"
+				  : PQerrorMessage(connection));
+		PQfinish(connection);
+		pgsql_connection_failed(pgsql);
+
+		query->state = PGSQL_ASYNC_FAILED;
+		return false;
+	}
+
+	/* libpq expects us to wait until the socket is writable first */
+	pgsql->connection = connection;
+	query->pollStatus = PGRES_POLLING_WRITING;
+	query->state = PGSQL_ASYNC_CONNECTING;
+
+	if (pgsql->connectTimeoutMs > 0)
+	{
+		query->deadlineMs = pgsql_now_ms() + pgsql->connectTimeoutMs;
+	}
+
+	return true;
+}
+
+
+/*
+ * pgsql_async_events returns the poll(2) events that the query is waiting
+ * for on the socket of its connection, or zero when the query is done.
+ */
+short
+pgsql_async_events(PGSQLAsyncQuery *query)
+{
+	switch (query->state)
+	{
+		case PGSQL_ASYNC_CONNECTING:
+		{
+			return query->pollStatus == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+		}
+
+		case PGSQL_ASYNC_BUSY:
+		{
+			return POLLIN | (query->flushPending ? POLLOUT : 0);
+		}
+
+		default:
+			return 0;
+	}
+}
+
+
+/*
+ * pgsql_async_poll moves the query forward without blocking, and returns
+ * true when the query is done, successfully or not.
+ */
+bool
+pgsql_async_poll(PGSQLAsyncQuery *query)
+{
+	PGSQL *pgsql = query->pgsql;
+
+	if (query->state == PGSQL_ASYNC_CONNECTING)
+	{
+		query->pollStatus = PQconnectPoll(pgsql->connection);
+
+		if (query->pollStatus == PGRES_POLLING_FAILED)
+		{
+			log_error("Connection to database failed: %s",
+					  PQerrorMessage(pgsql->connection));
+			pgsql_finish(pgsql);
+			pgsql_connection_failed(pgsql);
+			query->state = PGSQL_ASYNC_FAILED;
+		}
+		else if (query->pollStatus == PGRES_POLLING_OK)
+		{
+			pgsql_connection_succeeded(pgsql, pgsql->connection);
+			pgsql_async_send(query);
+		}
+	}
+	else if (query->state == PGSQL_ASYNC_BUSY)
+	{
+		pgsql_async_read(query);
+	}
+
+	return query->state == PGSQL_ASYNC_DONE ||
+		   query->state == PGSQL_ASYNC_FAILED;
+}
+
+
+/*
+ * pgsql_async_wait_all waits until all the given queries are done, or until
+ * timeoutMs milliseconds have passed when timeoutMs is positive, and then
+ * cancels the queries that are not done. A fast shutdown request cancels the
+ * queries too. It returns true when all the queries succeeded.
+ */
+bool
+pgsql_async_wait_all(PGSQLAsyncQuery *queries, int queryCount, int timeoutMs)
+{
+	uint64_t deadlineMs = timeoutMs > 0 ? pgsql_now_ms() + timeoutMs : 0;
+	struct pollfd *pollFds = calloc(queryCount, sizeof(struct pollfd));
+	int *queryIndexes = calloc(queryCount, sizeof(int));
+	bool success = true;
+
+	if (pollFds == NULL || queryIndexes == NULL)
+	{
+		log_error("Failed to allocate memory");
+		free(pollFds);
+		free(queryIndexes);
+		return false;
+	}
+
+	while (true)
+	{
+		uint64_t nowMs = pgsql_now_ms();
+		int pollTimeoutMs = -1;
+		int pollFdCount = 0;
+
+		for (int queryIndex = 0; queryIndex < queryCount; queryIndex++)
+		{
+			PGSQLAsyncQuery *query = &(queries[queryIndex]);
+			uint64_t queryDeadlineMs = query->deadlineMs;
+			short events = pgsql_async_events(query);
+
+			if (events == 0)
+			{
+				continue;
+			}
+
+			if (deadlineMs > 0 &&
+				(queryDeadlineMs == 0 || deadlineMs < queryDeadlineMs))
+			{
+				queryDeadlineMs = deadlineMs;
+			}
+
+			if (asked_to_stop_fast ||
+				(queryDeadlineMs > 0 && nowMs >= queryDeadlineMs))
+			{
+				pgsql_async_cancel(query);
+				continue;
+			}
+
+			if (queryDeadlineMs > 0 &&
+				(pollTimeoutMs < 0 ||
+				 (int) (queryDeadlineMs - nowMs) < pollTimeoutMs))
+			{
+				pollTimeoutMs = (int) (queryDeadlineMs - nowMs);
+			}
+
+			pollFds[pollFdCount].fd = PQsocket(query->pgsql->connection);
+			pollFds[pollFdCount].events = events;
+			pollFds[pollFdCount].revents = 0;
+			queryIndexes[pollFdCount] = queryIndex;
+			++pollFdCount;
+		}
+
+		if (pollFdCount == 0)
+		{
+			break;
+		}
+
+		if (poll(pollFds, pollFdCount, pollTimeoutMs) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log_error("Failed to wait for queries: %s", strerror(errno));
+
+			for (int fdIndex = 0; fdIndex < pollFdCount; fdIndex++)
+			{
+				pgsql_async_cancel(&(queries[queryIndexes[fdIndex]]));
+			}
+			break;
+		}
+
+		for (int fdIndex = 0; fdIndex < pollFdCount; fdIndex++)
+		{
+			if (pollFds[fdIndex].revents != 0)
+			{
+				(void) pgsql_async_poll(&(queries[queryIndexes[fdIndex]]));
+			}
+		}
+	}
+
+	for (int queryIndex = 0; queryIndex < queryCount; queryIndex++)
+	{
+		success = success && queries[queryIndex].state == PGSQL_ASYNC_DONE;
+	}
+
+	free(pollFds);
+	free(queryIndexes);
+
+	return success;
+}
+
+
+/*
+ * pgsql_async_send sends the query on the connection, which is open.
+ */
+static void
+pgsql_async_send(PGSQLAsyncQuery *query)
+{
+	PGconn *connection = query->pgsql->connection;
+	int flushed = 0;
+
+	log_debug("%s;", query->sql);
+
+	if (PQsetnonblocking(connection, 1) != 0 ||
+		!PQsendQueryParams(connection, query->sql,
+						   query->paramCount, query->paramTypes,
+						   query->paramValues, NULL, NULL, 0))
+	{
+		pgsql_async_fail(query, PQerrorMessage(connection));
+		return;
+	}
+
+	/* in non-blocking mode, the query might not have been sent entirely */
+	flushed = PQflush(connection);
+
+	if (flushed < 0)
 	{
-		log_debug("Disconnecting from \"%s\"", pgsql->connectionString);
-		PQfinish(pgsql->connection);
-		pgsql->connection = NULL;
+		pgsql_async_fail(query, PQerrorMessage(connection));
+		return;
 	}
+
+	/* the connection deadline doesn't apply to the query */
+	query->flushPending = flushed == 1;
+	query->deadlineMs = 0;
+	query->state = PGSQL_ASYNC_BUSY;
 }
 
+
 /*
- * pgsql_open_connection opens a PostgreSQL connection, given a PGSQL client
- * instance. If a connection is already open in the client (it's not NULL),
- * then pgsql_open_connection reuses it and returns it immediately.
+ * pgsql_async_read reads what the server sent, and when all the results of
+ * the query have been received, calls the parseFun callback of the query.
  */
-static PGconn *
-pgsql_open_connection(PGSQL *pgsql)
+static void
+pgsql_async_read(PGSQLAsyncQuery *query)
 {
-	PGconn *connection = NULL;
+	PGconn *connection = query->pgsql->connection;
 
-	/* we might be connected already */
-	if (pgsql->connection != NULL)
+	if (query->flushPending)
+	{
+		int flushed = PQflush(connection);
+
+		if (flushed < 0)
+		{
+			pgsql_async_fail(query, PQerrorMessage(connection));
+			return;
+		}
+
+		query->flushPending = flushed == 1;
+	}
+
+	if (!PQconsumeInput(connection))
 	{
-		return pgsql->connection;
+		pgsql_async_fail(query, PQerrorMessage(connection));
+		return;
 	}
 
-	log_debug("Connecting to \"%s\"", pgsql->connectionString);
+	while (!PQisBusy(connection))
+	{
+		PGresult *result = PQgetResult(connection);
 
-	/* Make a connection to the database */
-	connection = PQconnectdb(pgsql->connectionString);
+		if (result == NULL)
+		{
+			break;
+		}
 
-	/* Check to see that the backend connection was successfully made */
-	if (PQstatus(connection) != CONNECTION_OK)
+		/* like PQexec, keep the first error rather than later results */
+		if (query->result != NULL && !is_response_ok(query->result))
+		{
+			PQclear(result);
+		}
+		else
+		{
+			PQclear(query->result);
+			query->result = result;
+		}
+	}
+
+	/* PQgetResult returned NULL: we have all the results of the query */
+	if (PQisBusy(connection))
 	{
-		log_error("Connection to database failed: %s", PQerrorMessage(connection));
-		pgsql_finish(pgsql);
-		return NULL;
+		return;
 	}
 
-	pgsql->connection = connection;
+	if (!is_response_ok(query->result))
+	{
+		pgsql_async_fail(query, PQerrorMessage(connection));
+		return;
+	}
 
-	/* set the libpq notice receiver to integrate notifications as warnings. */
-	PQsetNoticeProcessor(connection, &pgAutoCtlDefaultNoticeProcessor, NULL);
+	/* get back to the blocking mode that the other pgsql_ functions use */
+	(void) PQsetnonblocking(connection, 0);
 
-	return connection;
+	if (query->parseFun != NULL)
+	{
+		(*query->parseFun)(query->context, query->result);
+	}
+
+	PQclear(query->result);
+	query->result = NULL;
+	query->state = PGSQL_ASYNC_DONE;
 }
 
 
 /*
- * pgAutoCtlDefaultNoticeProcessor is our default PostgreSQL libpq Notice
- * Processing: NOTICE, WARNING, HINT etc are processed as log_warn messages by
- * default.
+ * pgsql_async_fail logs about a failed query and closes its connection.
  */
 static void
-pgAutoCtlDefaultNoticeProcessor(void *arg, const char *message)
+pgsql_async_fail(PGSQLAsyncQuery *query, const char *message)
 {
-    log_warn("%s", message);
+	log_error("Failed to execute \"%s\": %s", query->sql, message);
+
+	PQclear(query->result);
+	query->result = NULL;
+	query->state = PGSQL_ASYNC_FAILED;
+
+	pgsql_finish(query->pgsql);
 }
 
 
 /*
- * pgAutoCtlDebugNoticeProcessor is our PostgreSQL libpq Notice Processing to
- * use when wanting to send NOTICE, WARNING, HINT as log_debug messages.
+ * pgsql_async_cancel cancels a query that is not done, and closes its
+ * connection.
  */
 static void
-pgAutoCtlDebugNoticeProcessor(void *arg, const char *message)
+pgsql_async_cancel(PGSQLAsyncQuery *query)
 {
-    log_debug("%s", message);
+	PGconn *connection = query->pgsql->connection;
+
+	if (query->state == PGSQL_ASYNC_BUSY)
+	{
+		char errbuf[256];
+		PGcancel *cancel = PQgetCancel(connection);
+
+		if (cancel == NULL || !PQcancel(cancel, errbuf, sizeof(errbuf)))
+		{
+			log_warn("Failed to cancel \"%s\": %s", query->sql,
+					 cancel == NULL ? "no connection" : errbuf);
+		}
+
+		PQfreeCancel(cancel);
+	}
+	else if (query->state == PGSQL_ASYNC_CONNECTING)
+	{
+		pgsql_connection_failed(query->pgsql);
+	}
+	else
+	{
+		return;
+	}
+
+	pgsql_async_fail(query, asked_to_stop_fast
+					 ? "pg_autoctl is stopping"
+					 : "timeout expired");
 }
 
 
 /*
- * pgsql_execute opens a connection, runs a given SQL command, and closes
- * the connection again.
- *
- * We avoid persisting connection across multiple commands to simplify error
- * handling.
+ * pgsql_pool_init initializes a pool of client connections, that keeps up to
+ * maxPerTarget connections open to each target connection string, so that
+ * several queries may run concurrently on the same server.
  */
-static bool
-pgsql_execute(PGSQL *pgsql, const char *sql)
+void
+pgsql_pool_init(PGSQLPool *pool, int maxPerTarget)
 {
-	return pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL, NULL, NULL);
+	memset(pool, 0, sizeof(PGSQLPool));
+
+	pool->maxPerTarget = Max(1, maxPerTarget);
 }
 
 
 /*
- * pgsql_execute_with_params opens a connection, runs a given SQL command,
- * and closes the connection again.
- *
- * We avoid persisting connection across multiple commands to simplify error
- * handling.
+ * pgsql_pool_acquire returns a client of the pool for the given connection
+ * string, that's not in use. We prefer a client that is connected already,
+ * then we open a new one when the target doesn't have too many yet, and then
+ * we recycle one of another target. When all the clients of the pool are in
+ * use, pgsql_pool_acquire returns NULL.
  */
-bool
-pgsql_execute_with_params(PGSQL *pgsql, const char *sql, int paramCount,
-						  const Oid *paramTypes, const char **paramValues,
-						  void *context, ParsePostgresResultCB *parseFun)
+PGSQL *
+pgsql_pool_acquire(PGSQLPool *pool, const char *connectionString)
 {
-	PGconn *connection = NULL;
-	PGresult *result = NULL;
-
-	connection = pgsql_open_connection(pgsql);
-	if (connection == NULL)
-	{
-		return false;
-	}
+	PGSQLPoolClient *chosen = NULL;
+	PGSQLPoolClient *recyclable = NULL;
+	int targetCount = 0;
 
-	log_debug("%s;", sql);
-	if (paramCount > 0)
+	for (int clientIndex = 0; clientIndex < pool->clientCount; clientIndex++)
 	{
-		int paramIndex = 0;
-		int remainingBytes = BUFSIZE;
-		char debugParameters[BUFSIZE] = { 0 };
-		char *writePointer = (char *) debugParameters;
+		PGSQLPoolClient *client = &(pool->clients[clientIndex]);
+		bool sameTarget =
+			strcmp(client->pgsql.connectionString, connectionString) == 0;
 
-		for (paramIndex=0; paramIndex < paramCount; paramIndex++)
+		if (sameTarget)
 		{
-			int bytesWritten = 0;
-			const char *value = paramValues[paramIndex];
+			++targetCount;
+		}
 
-			if (paramIndex > 0)
-			{
-				bytesWritten = snprintf(writePointer, remainingBytes, ", ");
-				remainingBytes -= bytesWritten;
-				writePointer += bytesWritten;
-			}
+		if (client->inUse)
+		{
+			continue;
+		}
 
-			bytesWritten = snprintf(writePointer, remainingBytes, "'%s'", value);
-			remainingBytes -= bytesWritten;
-			writePointer += bytesWritten;
+		if (sameTarget &&
+			(chosen == NULL || client->pgsql.connection != NULL))
+		{
+			chosen = client;
+		}
+		else if (!sameTarget && recyclable == NULL)
+		{
+			recyclable = client;
 		}
-		log_debug("%s", debugParameters);
 	}
 
-	result = PQexecParams(connection, sql,
-						  paramCount, paramTypes, paramValues, NULL, NULL, 0);
-	if (!is_response_ok(result))
+	if (chosen == NULL &&
+		(targetCount < pool->maxPerTarget || recyclable == NULL) &&
+		pool->clientCount < PGSQL_POOL_SIZE)
 	{
-		log_error("Failed to execute \"%s\": %s", sql, PQerrorMessage(connection));
-		PQclear(result);
-		clear_results(connection);
-		pgsql_finish(pgsql);
-		return false;
+		chosen = &(pool->clients[pool->clientCount++]);
+		memset(chosen, 0, sizeof(PGSQLPoolClient));
 	}
-
-	if (parseFun != NULL)
+	else if (chosen == NULL && recyclable != NULL)
 	{
-		(*parseFun)(context, result);
+		pgsql_finish(&(recyclable->pgsql));
+		chosen = recyclable;
 	}
 
-	PQclear(result);
-	clear_results(connection);
+	if (chosen == NULL)
+	{
+		log_error("Failed to get a connection to \"%s\": all the %d "
+				  "connections of the pool are in use",
+				  connectionString, pool->clientCount);
+		return NULL;
+	}
 
-	return true;
-}
+	if (strcmp(chosen->pgsql.connectionString, connectionString) != 0)
+	{
+		if (!pgsql_init(&(chosen->pgsql), (char *) connectionString))
+		{
+			/* errors have already been logged */
+			return NULL;
+		}
 
+		chosen->pgsql.keepConnection = true;
+	}
 
-/*
- * is_response_ok returns whether the query result is a correct response
- * (not an error or failure).
- */
-static bool
-is_response_ok(PGresult *result)
-{
-	ExecStatusType resultStatus = PQresultStatus(result);
+	chosen->inUse = true;
 
-	return resultStatus == PGRES_SINGLE_TUPLE || resultStatus == PGRES_TUPLES_OK ||
-		   resultStatus == PGRES_COMMAND_OK;
+	return &(chosen->pgsql);
 }
 
 
 /*
- * clear_results consumes results on a connection until NULL is returned.
- * If an error is returned it returns false.
+ * pgsql_pool_release gives back a client to the pool, its connection stays
+ * open for the next pgsql_pool_acquire of the same target.
  */
-static bool
-clear_results(PGconn *connection)
+void
+pgsql_pool_release(PGSQLPool *pool, PGSQL *pgsql)
 {
-	bool success = true;
-
-	while (true)
+	for (int clientIndex = 0; clientIndex < pool->clientCount; clientIndex++)
 	{
-		PGresult *result = PQgetResult(connection);
-		if (result == NULL)
+		if (&(pool->clients[clientIndex].pgsql) == pgsql)
 		{
-			break;
+			pool->clients[clientIndex].inUse = false;
+			return;
 		}
+	}
+}
 
-		if (!is_response_ok(result))
-		{
-			log_error("Failure from Postgres: %s", PQerrorMessage(connection));
-			success = false;
-		}
 
-		PQclear(result);
+/*
+ * pgsql_pool_finish closes all the connections of the pool.
+ */
+void
+pgsql_pool_finish(PGSQLPool *pool)
+{
+	for (int clientIndex = 0; clientIndex < pool->clientCount; clientIndex++)
+	{
+		pgsql_finish(&(pool->clients[clientIndex].pgsql));
+		pool->clients[clientIndex].inUse = false;
 	}
-
-	return success;
 }
 
 
@@ -441,6 +1757,96 @@ pgsql_create_replication_slot(PGSQL *pgsql, const char *slotName)
 }
 
 
+/*
+ * pgsql_create_replication_slot_if_missing creates a physical replication slot
+ * with the given name when it doesn't exist yet, reserving WAL right away. It
+ * can be used on a standby.
+ */
+bool
+pgsql_create_replication_slot_if_missing(PGSQL *pgsql, const char *slotName)
+{
+	char *sql =
+		"SELECT pg_create_physical_replication_slot($1, true) "
+		" WHERE NOT EXISTS "
+		"       (SELECT 1 FROM pg_replication_slots WHERE slot_name = $1)";
+	const Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { slotName };
+
+	return pgsql_execute_with_params(pgsql, sql,
+									 1, paramTypes, paramValues, NULL, NULL);
+}
+
+
+/*
+ * pgsql_reserve_replication_slot makes sure that the given physical
+ * replication slot holds WAL from now on. A slot that has never been used
+ * doesn't hold any WAL, so we create it again with immediately_reserve, and
+ * we create the slot when it's missing.
+ */
+bool
+pgsql_reserve_replication_slot(PGSQL *pgsql, const char *slotName)
+{
+	char *sql =
+		"SELECT pg_drop_replication_slot(slot_name) "
+		"  FROM pg_replication_slots "
+		" WHERE slot_name = $1 AND NOT active AND restart_lsn IS NULL";
+	const Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { slotName };
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   1, paramTypes, paramValues, NULL, NULL))
+	{
+		return false;
+	}
+
+	return pgsql_create_replication_slot_if_missing(pgsql, slotName);
+}
+
+
+/*
+ * pgsql_advance_replication_slot advances the given physical replication slot
+ * on a standby up to the LSN that the standby has replayed, unless the slot is
+ * in use. Requires Postgres 11 or later.
+ */
+bool
+pgsql_advance_replication_slot(PGSQL *pgsql, const char *slotName)
+{
+	char *sql =
+		"SELECT pg_replication_slot_advance(slot_name, pg_last_wal_replay_lsn()) "
+		"  FROM pg_replication_slots "
+		" WHERE slot_name = $1 AND NOT active "
+		"   AND restart_lsn < pg_last_wal_replay_lsn()";
+	const Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { slotName };
+
+	return pgsql_execute_with_params(pgsql, sql,
+									 1, paramTypes, paramValues, NULL, NULL);
+}
+
+
+/*
+ * pgsql_advance_replication_slot_to_lsn advances the given replication slot
+ * on a primary to the given LSN, when no standby uses the slot. We only
+ * advance a slot, and never past the WAL that we flushed already.
+ */
+bool
+pgsql_advance_replication_slot_to_lsn(PGSQL *pgsql, const char *slotName,
+									  const char *lsn)
+{
+	char *sql =
+		"SELECT pg_replication_slot_advance(slot_name, $2) "
+		"  FROM pg_replication_slots "
+		" WHERE slot_name = $1 AND NOT active "
+		"   AND restart_lsn < $2 "
+		"   AND $2 <= pg_current_wal_flush_lsn()";
+	const Oid paramTypes[2] = { TEXTOID, LSNOID };
+	const char *paramValues[2] = { slotName, lsn };
+
+	return pgsql_execute_with_params(pgsql, sql,
+									 2, paramTypes, paramValues, NULL, NULL);
+}
+
+
 /*
  * pgsql_drop_replication_slot drops a given replication slot. If the verbose
  * flag is false, then no info message will be logged.
@@ -461,21 +1867,86 @@ pgsql_drop_replication_slot(PGSQL *pgsql, const char *slotName, bool verbose)
 	}
 
 	return pgsql_execute_with_params(pgsql, sql,
-									 1, paramTypes, paramValues, NULL, NULL);
+									 1, paramTypes, paramValues, NULL, NULL);
+}
+
+
+/*
+ * pgsql_drop_stale_replication_slots drops the replication slots that we
+ * created for standby nodes that left the group: the slots named after the
+ * given prefix and a node id, that are not in the comma separated list of
+ * slotNames, and that no standby uses.
+ */
+bool
+pgsql_drop_stale_replication_slots(PGSQL *pgsql, const char *slotPrefix,
+								   const char *slotNames)
+{
+	char *sql =
+		"SELECT pg_drop_replication_slot(slot_name) "
+		"  FROM pg_replication_slots "
+		" WHERE left(slot_name, length($1) + 1) = $1 || '_' "
+		"   AND slot_name <> ALL(string_to_array($2, ',')) "
+		"   AND NOT active";
+	Oid paramTypes[2] = { TEXTOID, TEXTOID };
+	const char *paramValues[2] = { slotPrefix, slotNames };
+
+	return pgsql_execute_with_params(pgsql, sql,
+									 2, paramTypes, paramValues, NULL, NULL);
 }
 
 
 /*
  * pgsql_enable_synchronous_replication enables synchronous replication
  * in Postgres such that all writes block post-commit until they are
- * replicated.
+ * replicated to the given standbyNames, such as * or ANY 2 (*). The
+ * synchronousCommit level tells how far: remote_write, on (flushed) or
+ * remote_apply (visible to queries on the standbys).
+ *
+ * For the default level "on" we reset synchronous_commit instead, so that
+ * a value set in postgresql.conf, such as local, still applies.
  */
 bool
-pgsql_enable_synchronous_replication(PGSQL *pgsql)
+pgsql_enable_synchronous_replication(PGSQL *pgsql, const char *standbyNames,
+									 const char *synchronousCommit)
 {
-	GUC setting = { "synchronous_standby_names", "'*'" };
+	char value[BUFSIZE];
+	char level[BUFSIZE];
+	GUC setting = { "synchronous_standby_names", value };
+	GUC commitSetting = { "synchronous_commit", level };
+
+	if (strchr(standbyNames, '\'') != NULL)
+	{
+		log_error("Invalid synchronous_standby_names value \"%s\"",
+				  standbyNames);
+		return false;
+	}
+
+	if (strcmp(synchronousCommit, "remote_write") != 0 &&
+		strcmp(synchronousCommit, "on") != 0 &&
+		strcmp(synchronousCommit, "remote_apply") != 0)
+	{
+		log_error("Invalid synchronous_commit value \"%s\"", synchronousCommit);
+		return false;
+	}
+
+	snprintf(value, BUFSIZE, "'%s'", standbyNames);
+	strlcpy(level, synchronousCommit, BUFSIZE);
+
+	log_info("Enabling synchronous replication with "
+			 "synchronous_standby_names %s and synchronous_commit %s",
+			 value, synchronousCommit);
 
-	log_info("Enabling synchronous replication");
+	if (strcmp(synchronousCommit, "on") == 0)
+	{
+		if (!pgsql_execute(pgsql, "ALTER SYSTEM RESET synchronous_commit"))
+		{
+			return false;
+		}
+	}
+	else if (!pgsql_alter_system_set(pgsql, commitSetting))
+	{
+		return false;
+	}
 
 	return pgsql_alter_system_set(pgsql, setting);
 }
@@ -544,6 +2015,42 @@ pgsql_set_default_transaction_mode_read_write(PGSQL *pgsql)
 }
 
 
+/*
+ * pgsql_terminate_write_sessions terminates the sessions that have a write
+ * transaction in progress, that is a transaction that has been assigned a
+ * transaction id, and sets terminatedCount to how many there were.
+ */
+bool
+pgsql_terminate_write_sessions(PGSQL *pgsql, int *terminatedCount)
+{
+	SingleValueResultContext context;
+	char *sql =
+		"SELECT count(pg_terminate_backend(pid))::int "
+		"  FROM pg_stat_activity "
+		" WHERE backend_xid IS NOT NULL AND pid <> pg_backend_pid()";
+
+	context.resultType = PGSQL_RESULT_INT;
+	context.parsedOk = false;
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have been logged already */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to terminate the sessions with write transactions");
+		return false;
+	}
+
+	*terminatedCount = context.intVal;
+
+	return true;
+}
+
+
 /*
  * pgsql_checkpoint runs a CHECKPOINT command on postgres to trigger a checkpoint.
  */
@@ -554,6 +2061,42 @@ pgsql_checkpoint(PGSQL *pgsql)
 }
 
 
+/*
+ * pgsql_checkpoint_is_on_current_timeline sets onCurrentTimeline to true when
+ * the latest checkpoint of the server has been done on its current timeline.
+ * After a promotion, that's when the new timeline is found in pg_control.
+ */
+bool
+pgsql_checkpoint_is_on_current_timeline(PGSQL *pgsql, bool *onCurrentTimeline)
+{
+	SingleValueResultContext context;
+	char *sql =
+		"SELECT c.timeline_id = ('x' || "
+		"substr(pg_walfile_name(pg_current_wal_lsn()), 1, 8))::bit(32)::int "
+		"FROM pg_control_checkpoint() c";
+
+	context.resultType = PGSQL_RESULT_BOOL;
+	context.parsedOk = false;
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have been logged already */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get result from pg_control_checkpoint()");
+		return false;
+	}
+
+	*onCurrentTimeline = context.boolVal;
+
+	return true;
+}
+
+
 /*
  * pgsql_alter_system_set runs an ALTER SYSTEM SET ... command on Postgres
  * to globally set a GUC and then runs pg_reload_conf() to make existing
@@ -580,6 +2123,65 @@ pgsql_alter_system_set(PGSQL *pgsql, GUC setting)
 }
 
 
+/*
+ * pgsql_alter_system_settings runs ALTER SYSTEM SET for each of the given
+ * settings, or ALTER SYSTEM RESET when reset is true, and then reloads the
+ * configuration once. Settings that this version of Postgres doesn't have
+ * are skipped.
+ */
+bool
+pgsql_alter_system_settings(PGSQL *pgsql, GUC *settings, bool reset)
+{
+	int settingIndex = 0;
+
+	for (settingIndex = 0; settings[settingIndex].name != NULL; settingIndex++)
+	{
+		GUC *setting = &(settings[settingIndex]);
+		SingleValueResultContext context = { 0 };
+		char *sql = "SELECT exists(SELECT 1 FROM pg_settings WHERE name = $1)";
+		const Oid paramTypes[1] = { TEXTOID };
+		const char *paramValues[1] = { setting->name };
+		char command[BUFSIZE];
+
+		context.resultType = PGSQL_RESULT_BOOL;
+
+		if (!pgsql_execute_with_params(pgsql, sql, 1, paramTypes, paramValues,
+									   &context, &parseSingleValueResult) ||
+			!context.parsedOk)
+		{
+			log_error("Failed to check for setting \"%s\" in pg_settings",
+					  setting->name);
+			return false;
+		}
+
+		if (!context.boolVal)
+		{
+			log_debug("Skipping setting \"%s\", "
+					  "unknown to this version of Postgres", setting->name);
+			continue;
+		}
+
+		if (reset)
+		{
+			snprintf(command, BUFSIZE, "ALTER SYSTEM RESET %s", setting->name);
+		}
+		else
+		{
+			snprintf(command, BUFSIZE, "ALTER SYSTEM SET %s TO %s",
+					 setting->name, setting->value);
+		}
+
+		if (!pgsql_execute(pgsql, command))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	return pgsql_reload_conf(pgsql);
+}
+
+
 /*
  * pgsql_reload_conf causes open sessions to reload the PostgresSQL configuration
  * files.
@@ -649,6 +2251,110 @@ pgsql_get_hba_file_path(PGSQL *pgsql, char *hbaFilePath, int maxPathLength)
 }
 
 
+/*
+ * pgsql_get_setting gets the current value of the given setting from
+ * pg_settings, along with its context and source file.
+ */
+typedef struct PostgresSettingContext
+{
+	bool parsedOk;
+	PostgresSetting *setting;
+} PostgresSettingContext;
+
+bool
+pgsql_get_setting(PGSQL *pgsql, const char *name, PostgresSetting *setting)
+{
+	PostgresSettingContext context = { false, setting };
+	char *sql =
+		"SELECT current_setting(name), context, coalesce(sourcefile, '') "
+		"  FROM pg_settings WHERE name = $1";
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { name };
+
+	memset(setting, 0, sizeof(PostgresSetting));
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   &context, &parsePostgresSetting))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get setting \"%s\" from pg_settings", name);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * parsePostgresSetting parses the result of pgsql_get_setting.
+ */
+static void
+parsePostgresSetting(void *ctx, PGresult *result)
+{
+	PostgresSettingContext *context = (PostgresSettingContext *) ctx;
+	PostgresSetting *setting = context->setting;
+
+	if (PQnfields(result) != 3)
+	{
+		log_error("Query returned %d columns, expected 3", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	if (PQntuples(result) != 1)
+	{
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	strlcpy(setting->value, PQgetvalue(result, 0, 0), BUFSIZE);
+	strlcpy(setting->context, PQgetvalue(result, 0, 1), NAMEDATALEN);
+	strlcpy(setting->sourceFile, PQgetvalue(result, 0, 2), MAXPGPATH);
+
+	context->parsedOk = true;
+}
+
+
+/*
+ * pgsql_has_pending_restart sets pendingRestart to whether Postgres has
+ * settings that changed in its configuration files, and that only apply
+ * once it restarts.
+ */
+bool
+pgsql_has_pending_restart(PGSQL *pgsql, bool *pendingRestart)
+{
+	SingleValueResultContext context;
+	char *sql = "SELECT exists(SELECT 1 FROM pg_settings WHERE pending_restart)";
+
+	context.resultType = PGSQL_RESULT_BOOL;
+	context.parsedOk = false;
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have been logged already */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get pending_restart from pg_settings");
+		return false;
+	}
+
+	*pendingRestart = context.boolVal;
+
+	return true;
+}
+
+
 /*
  * pgsql_get_current_setting gets the value of a GUC in Postgres by running
  * SELECT current_setting($settingName), or returns false if a failure occurred.
@@ -966,7 +2672,7 @@ pgsql_create_user(PGSQL *pgsql, const char *userName, const char *password,
 	clear_results(connection);
 
 	/* restore the normal notice message processing, if needed. */
-	PQsetNoticeProcessor(connection, previousNoticeProcessor, NULL);
+	PQsetNoticeProcessor(connection, previousNoticeProcessor, pgsql);
 
 	return true;
 }
@@ -1013,15 +2719,38 @@ pgsql_has_replica(PGSQL *pgsql, char *userName, bool *hasReplica)
 
 /*
  * hostname_from_uri parses a PostgreSQL connection string URI and returns
- * whether the URL was successfully parsed.
+ * whether the URL was successfully parsed. With a multi-host URI, we get the
+ * first host and port.
  */
 bool
 hostname_from_uri(const char *pguri,
 				  char *hostname, int maxHostLength, int *port)
 {
-	int found = 0;
+	bool found = false;
+
+	return hostname_from_uri_at(pguri, 0,
+								hostname, maxHostLength, port, &found);
+}
+
+
+/*
+ * hostname_from_uri_at parses a PostgreSQL connection string URI and gets
+ * its host and port of the given index, as in a multi-host URI such as
+ * postgres://host1:6000,host2:6000/pg_auto_failover. found is set to false
+ * when the URI has less hosts than that.
+ */
+bool
+hostname_from_uri_at(const char *pguri, int index,
+					 char *hostname, int maxHostLength, int *port,
+					 bool *found)
+{
 	char *errmsg;
 	PQconninfoOption *conninfo, *option;
+	char *hosts = NULL;
+	char *ports = NULL;
+	char *host = NULL;
+	int hostLength = 0;
+	int position = 0;
 
 	conninfo = PQconninfoParse(pguri, &errmsg);
 	if (conninfo == NULL)
@@ -1033,49 +2762,192 @@ hostname_from_uri(const char *pguri,
 
 	for (option = conninfo; option->keyword != NULL; option++)
 	{
-		if (strcmp(option->keyword, "host") == 0 ||
-			strcmp(option->keyword, "hostaddr") == 0)
+		if ((strcmp(option->keyword, "host") == 0 ||
+			 strcmp(option->keyword, "hostaddr") == 0) &&
+			option->val != NULL && hosts == NULL)
 		{
-			if (option->val)
-			{
-				int hostNameLength = strlcpy(hostname, option->val, maxHostLength);
+			hosts = option->val;
+		}
+		else if (strcmp(option->keyword, "port") == 0)
+		{
+			ports = option->val;
+		}
+	}
 
-				if (hostNameLength >= maxHostLength)
-				{
-					log_error(
-						"The URL \"%s\" contains a hostname of %d characters, "
-						"the maximum supported by pg_autoctl is %d characters",
-						option->val, hostNameLength, maxHostLength);
-					PQconninfoFree(conninfo);
-					return false;
-				}
+	*found = false;
+	*port = POSTGRES_PORT;
 
-				++found;
-			}
+	/* skip to the host at the given index in the comma separated list */
+	for (host = hosts; host != NULL && position < index; position++)
+	{
+		host = strchr(host, ',');
+
+		if (host != NULL)
+		{
+			++host;
 		}
+	}
+
+	if (host == NULL)
+	{
+		PQconninfoFree(conninfo);
+		return true;
+	}
+
+	hostLength = strcspn(host, ",");
+
+	if (hostLength >= maxHostLength)
+	{
+		log_error(
+			"The URL \"%s\" contains a hostname of %d characters, "
+			"the maximum supported by pg_autoctl is %d characters",
+			pguri, hostLength, maxHostLength);
+		PQconninfoFree(conninfo);
+		return false;
+	}
+
+	strlcpy(hostname, host, hostLength + 1);
+	*found = true;
 
-		if (strcmp(option->keyword, "port") == 0)
+	/* a single port applies to all the hosts, otherwise ports are a list */
+	if (ports != NULL)
+	{
+		char *portValue = ports;
+
+		for (position = 0; position < index && strchr(portValue, ','); position++)
 		{
-			if (option->val)
-			{
-				/* we expect a single port number in a monitor's URI */
-				*port = atoi(option->val);
-				++found;
-			}
-			else
+			portValue = strchr(portValue, ',') + 1;
+		}
+
+		if (*portValue != '\0' && *portValue != ',')
+		{
+			*port = atoi(portValue);
+		}
+	}
+
+	PQconninfoFree(conninfo);
+
+	return true;
+}
+
+
+/*
+ * pgsql_conninfo_host_count returns how many hosts the given connection
+ * string lists, or 0 when it has no host at all.
+ */
+int
+pgsql_conninfo_host_count(const char *conninfo)
+{
+	char hostname[_POSIX_HOST_NAME_MAX];
+	int port = 0;
+	int count = 0;
+	bool found = true;
+
+	while (found)
+	{
+		if (!hostname_from_uri_at(conninfo, count,
+								  hostname, _POSIX_HOST_NAME_MAX, &port,
+								  &found))
+		{
+			/* errors have already been logged */
+			return 0;
+		}
+
+		if (found)
+		{
+			++count;
+		}
+	}
+
+	return count;
+}
+
+
+/*
+ * pgsql_conninfo_set_option writes to result the given connection string
+ * where the connection parameter keyword is set to value. When the
+ * connection string has a value for keyword already, it's only changed when
+ * overwrite is true. The result uses the keyword=value format.
+ */
+bool
+pgsql_conninfo_set_option(const char *conninfo,
+						  const char *keyword, const char *value,
+						  bool overwrite, char *result, int size)
+{
+	char *errmsg;
+	PQconninfoOption *options, *option;
+	PQExpBuffer buffer = NULL;
+	bool success = false;
+
+	/* escaping at most doubles the length, and adds quotes */
+	char escaped[2 * MAXCONNINFO + 3];
+
+	options = PQconninfoParse(conninfo, &errmsg);
+	if (options == NULL)
+	{
+		log_error("Failed to parse pguri \"%s\": %s", conninfo, errmsg);
+		PQfreemem(errmsg);
+		return false;
+	}
+
+	buffer = createPQExpBuffer();
+
+	if (buffer == NULL)
+	{
+		log_error("Failed to allocate memory");
+		PQconninfoFree(options);
+		return false;
+	}
+
+	for (option = options; option->keyword != NULL; option++)
+	{
+		const char *optionValue = option->val;
+
+		if (strcmp(option->keyword, keyword) == 0)
+		{
+			if (optionValue == NULL || overwrite)
 			{
-				*port = POSTGRES_PORT;
+				optionValue = value;
 			}
+
+			/* added at the end, see below */
+			value = optionValue;
+			continue;
 		}
 
-		if (found == 2)
+		if (optionValue != NULL && strlen(optionValue) < MAXCONNINFO)
 		{
-			break;
+			(void) escape_conninfo_value(escaped, optionValue);
+			appendPQExpBuffer(buffer, "%s%s=%s",
+							  buffer->len > 0 ? " " : "",
+							  option->keyword, escaped);
 		}
 	}
-	PQconninfoFree(conninfo);
 
-	return true;
+	(void) escape_conninfo_value(escaped, value);
+	appendPQExpBuffer(buffer, "%s%s=%s",
+					  buffer->len > 0 ? " " : "", keyword, escaped);
+
+	if (PQExpBufferBroken(buffer))
+	{
+		log_error("Failed to allocate memory");
+	}
+	else if (buffer->len >= size)
+	{
+		log_error("Connection string \"%s\" is %d characters, the maximum "
+				  "supported by pg_autoctl is %d",
+				  buffer->data, (int) buffer->len, size - 1);
+	}
+	else
+	{
+		strlcpy(result, buffer->data, size);
+		success = true;
+	}
+
+	destroyPQExpBuffer(buffer);
+	PQconninfoFree(options);
+
+	return success;
 }
 
 
@@ -1209,8 +3081,10 @@ pgsql_get_sync_state_and_current_lsn(PGSQL *pgsql, const char *slotName,
 	const char *paramValues[1] = { slotName };
 	int paramCount = 1;
 
-	pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
-							  &context, &parsePgsrSyncStateAndWAL);
+	pgsql_execute_with_params_format(pgsql, sql,
+									 paramCount, paramTypes, paramValues,
+									 NULL, NULL, PGSQL_FORMAT_BINARY,
+									 &context, &parsePgsrSyncStateAndWAL);
 
 	if (!context.parsedOk)
 	{
@@ -1233,7 +3107,9 @@ pgsql_get_sync_state_and_current_lsn(PGSQL *pgsql, const char *slotName,
 
 /*
  * parsePgsrSyncStateAndWAL parses the result from a PostgreSQL query fetching
- * two columns from pg_stat_replication: sync_state and currentLSN.
+ * two columns from pg_stat_replication: sync_state and currentLSN. The query
+ * is run in binary format: sync_state is still its text, and the LSN is a 64
+ * bit integer that we format only once here.
  */
 static void
 parsePgsrSyncStateAndWAL(void *ctx, PGresult *result)
@@ -1255,14 +3131,21 @@ parsePgsrSyncStateAndWAL(void *ctx, PGresult *result)
 
 		case 1:
 		{
+			uint64_t currentLSN = 0;
+
+			if (!pgsql_get_lsn(result, 0, 1, &currentLSN))
+			{
+				log_error("Failed to parse the current LSN returned by Postgres");
+				context->parsedOk = false;
+				return;
+			}
+
 			/* we trust our length and PostgreSQL results */
 			strlcpy(context->syncState,
 					PQgetvalue(result, 0, 0),
 					PGSR_SYNC_STATE_MAXLENGTH);
 
-			strlcpy(context->currentLSN,
-					PQgetvalue(result, 0, 1),
-					PG_LSN_MAXLENGTH);
+			pgsql_format_lsn(currentLSN, context->currentLSN, PG_LSN_MAXLENGTH);
 
 			context->parsedOk = true;
 			return;
@@ -1326,6 +3209,515 @@ pgsql_get_received_lsn_from_standby(PGSQL *pgsql, char *receivedLSN, int maxLSNS
 	return true;
 }
 
+/*
+ * pgsql_get_buffer_ranges fetches the list of the blocks of the current
+ * database that are in shared_buffers, using the pg_buffercache extension.
+ * Consecutive blocks are grouped in ranges of at most maxRangeBlocks, one
+ * per line, as "relation<TAB>fork<TAB>first block<TAB>last block". The
+ * caller is responsible for freeing *ranges.
+ */
+bool
+pgsql_get_buffer_ranges(PGSQL *pgsql, int maxRangeBlocks, char **ranges)
+{
+	SingleValueResultContext context;
+	char *sql =
+		"WITH blocks AS ("
+		" SELECT c.oid::regclass::text AS rel,"
+		" CASE b.relforknumber"
+		" WHEN 0 THEN 'main' WHEN 1 THEN 'fsm' WHEN 2 THEN 'vm' END AS fork,"
+		" b.relblocknumber::bigint AS block"
+		" FROM pg_buffercache b"
+		" JOIN pg_class c ON pg_relation_filenode(c.oid) = b.relfilenode"
+		" WHERE b.reldatabase = (SELECT oid FROM pg_database"
+		" WHERE datname = current_database())"
+		" AND b.relforknumber IN (0, 1, 2)"
+		"), islands AS ("
+		" SELECT rel, fork, block,"
+		" block - row_number() OVER (PARTITION BY rel, fork ORDER BY block)"
+		" AS island"
+		" FROM blocks"
+		") "
+		"SELECT coalesce(string_agg(format(E'%s\\t%s\\t%s\\t%s',"
+		" rel, fork, first, last), E'\\n'), '')"
+		" FROM (SELECT rel, fork, min(block) AS first, max(block) AS last"
+		" FROM islands"
+		" GROUP BY rel, fork, island, block / $1"
+		" ORDER BY rel, fork, first) AS ranges";
+	char maxRangeBlocksString[BUFSIZE];
+	const Oid paramTypes[1] = { INT8OID };
+	const char *paramValues[1] = { maxRangeBlocksString };
+
+	snprintf(maxRangeBlocksString, BUFSIZE, "%d", maxRangeBlocks);
+
+	context.resultType = PGSQL_RESULT_STRING;
+	context.parsedOk = false;
+
+	if (!pgsql_execute_with_params(pgsql, sql, 1, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get the list of blocks from pg_buffercache");
+		return false;
+	}
+
+	*ranges = context.strVal;
+
+	return true;
+}
+
+
+/*
+ * pgsql_prewarm_range loads the given range of blocks of a relation in
+ * shared_buffers, using the pg_prewarm extension. Relations that don't exist
+ * anymore and blocks past the end of the relation are skipped.
+ */
+bool
+pgsql_prewarm_range(PGSQL *pgsql, const char *relation, const char *fork,
+					int64_t firstBlock, int64_t lastBlock)
+{
+	char *sql =
+		"SELECT pg_prewarm(c, 'buffer', $2, $3,"
+		" least($4, s.blocks - 1))"
+		" FROM to_regclass($1) AS c,"
+		" LATERAL (SELECT pg_relation_size(c, $2)"
+		" / current_setting('block_size')::bigint AS blocks) AS s"
+		" WHERE c IS NOT NULL AND s.blocks > $3";
+	char firstBlockString[BUFSIZE];
+	char lastBlockString[BUFSIZE];
+	const Oid paramTypes[4] = { TEXTOID, TEXTOID, INT8OID, INT8OID };
+	const char *paramValues[4] = {
+		relation, fork, firstBlockString, lastBlockString
+	};
+
+	snprintf(firstBlockString, BUFSIZE, "%" PRId64, firstBlock);
+	snprintf(lastBlockString, BUFSIZE, "%" PRId64, lastBlock);
+
+	return pgsql_execute_with_params(pgsql, sql, 4, paramTypes, paramValues,
+									 NULL, NULL);
+}
+
+
+/*
+ * pgsql_update_worker_node connects to a Citus coordinator and updates the
+ * address of a worker node in its metadata, from the old primary of the
+ * worker group to the new one, using master_update_node(). The update waits
+ * for lockCooldownMs at most for the distributed queries that use the old
+ * worker to finish, and then cancels them.
+ *
+ * When the coordinator already knows about the new address, as when we retry
+ * the transition, there's nothing to do.
+ */
+bool
+pgsql_update_worker_node(PGSQL *pgsql, NodeAddress *oldNode,
+						 NodeAddress *newNode, int lockCooldownMs)
+{
+	SingleValueResultContext context = { 0 };
+	char *sql =
+		"WITH updated AS ("
+		" SELECT master_update_node(nodeid, $3, $4, true, $5)"
+		" FROM pg_dist_node WHERE nodename = $1 AND nodeport = $2)"
+		" SELECT ((SELECT count(*) FROM updated)"
+		" + (SELECT count(*) FROM pg_dist_node"
+		" WHERE nodename = $3 AND nodeport = $4))::int";
+	char oldPortString[BUFSIZE];
+	char newPortString[BUFSIZE];
+	char lockCooldownString[BUFSIZE];
+	const Oid paramTypes[5] = { TEXTOID, INT4OID, TEXTOID, INT4OID, INT4OID };
+	const char *paramValues[5] = {
+		oldNode->host, oldPortString,
+		newNode->host, newPortString,
+		lockCooldownString
+	};
+
+	snprintf(oldPortString, BUFSIZE, "%d", oldNode->port);
+	snprintf(newPortString, BUFSIZE, "%d", newNode->port);
+	snprintf(lockCooldownString, BUFSIZE, "%d", lockCooldownMs);
+
+	context.resultType = PGSQL_RESULT_INT;
+
+	if (!pgsql_execute_with_params(pgsql, sql, 5, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the result of master_update_node()");
+		return false;
+	}
+
+	if (context.intVal == 0)
+	{
+		log_error("Failed to find worker node %s:%d in the coordinator "
+				  "metadata, nor %s:%d",
+				  oldNode->host, oldNode->port, newNode->host, newNode->port);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pgsql_get_current_wal_lsn fetches pg_current_wal_lsn() from a primary.
+ */
+bool
+pgsql_get_current_wal_lsn(PGSQL *pgsql, char *currentLSN, int maxLSNSize)
+{
+	SingleValueResultContext context;
+	char *sql = "SELECT pg_current_wal_lsn()";
+
+	context.resultType = PGSQL_RESULT_STRING;
+	context.parsedOk = false;
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get result from pg_current_wal_lsn()");
+		return false;
+	}
+
+	strlcpy(currentLSN, context.strVal, maxLSNSize);
+	free(context.strVal);
+
+	return true;
+}
+
+
+/*
+ * pgsql_get_received_and_replayed_lsn fetches pg_last_wal_receive_lsn() and
+ * pg_last_wal_replay_lsn() from a standby, in a single round trip. NULL
+ * values are returned as empty strings.
+ */
+typedef struct ReceivedAndReplayedLSNContext
+{
+	bool parsedOk;
+	char *receivedLSN;
+	char *replayedLSN;
+	int maxLSNSize;
+} ReceivedAndReplayedLSNContext;
+
+bool
+pgsql_get_received_and_replayed_lsn(PGSQL *pgsql,
+									char *receivedLSN,
+									char *replayedLSN,
+									int maxLSNSize)
+{
+	ReceivedAndReplayedLSNContext context = {
+		false, receivedLSN, replayedLSN, maxLSNSize
+	};
+	char *sql = "SELECT pg_last_wal_receive_lsn(), pg_last_wal_replay_lsn()";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseReceivedAndReplayedLSN))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get result from pg_last_wal_receive_lsn()");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pgsql_get_current_and_standby_replay_lsn fetches pg_current_wal_lsn() from
+ * a primary and the replay_lsn of the standby that uses the given replication
+ * slot, in a single round trip. When no standby uses the slot, standbyLSN is
+ * an empty string.
+ */
+bool
+pgsql_get_current_and_standby_replay_lsn(PGSQL *pgsql, const char *slotName,
+										 char *currentLSN, char *standbyLSN,
+										 int maxLSNSize)
+{
+	ReceivedAndReplayedLSNContext context = {
+		false, currentLSN, standbyLSN, maxLSNSize
+	};
+	char *sql =
+		"select pg_current_wal_lsn(), "
+		"(select rep.replay_lsn "
+		"   from pg_replication_slots slot "
+		"   join pg_stat_replication rep on rep.pid = slot.active_pid "
+		"  where slot_name = $1)";
+	int paramCount = 1;
+	const Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { slotName };
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseReceivedAndReplayedLSN))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get result from pg_current_wal_lsn()");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * parseReceivedAndReplayedLSN parses the result of the query in
+ * pgsql_get_received_and_replayed_lsn and
+ * pgsql_get_current_and_standby_replay_lsn.
+ */
+static void
+parseReceivedAndReplayedLSN(void *ctx, PGresult *result)
+{
+	ReceivedAndReplayedLSNContext *context =
+		(ReceivedAndReplayedLSNContext *) ctx;
+
+	if (PQntuples(result) != 1 || PQnfields(result) != 2)
+	{
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	strlcpy(context->receivedLSN,
+			PQgetisnull(result, 0, 0) ? "" : PQgetvalue(result, 0, 0),
+			context->maxLSNSize);
+
+	strlcpy(context->replayedLSN,
+			PQgetisnull(result, 0, 1) ? "" : PQgetvalue(result, 0, 1),
+			context->maxLSNSize);
+
+	context->parsedOk = true;
+}
+
+
+/*
+ * pgsql_get_replication_state fetches in a single round trip everything the
+ * keeper loop wants to know about the local Postgres instance: whether it's
+ * in recovery, the best sync_state of the standbys using our replication
+ * slots, the current, received and replayed LSN, the WAL receiver status,
+ * whether a replica with the given username is connected, the upstream node
+ * that a standby streams from, or is configured to stream from, the slot that
+ * retains the most WAL on a primary, preferably one that no standby uses,
+ * and how much, how far behind the primary its archiver is, and whether a
+ * standby may restore WAL from the archive.
+ *
+ * Our replication slots are the one named slotName, and the ones named after
+ * it and the node id of a standby, see keeper_config_standby_slot_name.
+ */
+typedef struct ReplicationStateContext
+{
+	bool parsedOk;
+	PostgresReplicationState *state;
+} ReplicationStateContext;
+
+bool
+pgsql_get_replication_state(PGSQL *pgsql, const char *slotName,
+							const char *replicaUserName,
+							PostgresReplicationState *state)
+{
+	ReplicationStateContext context = { false, state };
+	char *sql =
+		"with slots as "
+		"(select slot_name, active, active_pid, "
+		"        case when pg_is_in_recovery() then null "
+		"             else pg_current_wal_lsn() - restart_lsn end as retained "
+		"   from pg_replication_slots "
+		"  where slot_name = $1 "
+		"     or left(slot_name, length($1) + 1) = $1 || '_') "
+		"select pg_is_in_recovery(), "
+		"(select sync_state "
+		"   from slots "
+		"   join pg_stat_replication rep on rep.pid = slots.active_pid "
+		"  order by array_position(array['sync', 'quorum', 'potential'], "
+		"                          sync_state::text) nulls last "
+		"  limit 1), "
+		"case when pg_is_in_recovery() then null else pg_current_wal_lsn() end, "
+		"pg_last_wal_receive_lsn(), "
+		"pg_last_wal_replay_lsn(), "
+		"(select status from pg_stat_wal_receiver), "
+		"exists(select 1 from pg_stat_replication where usename = $2), "
+		"coalesce((select conninfo from pg_stat_wal_receiver), "
+		"         current_setting('primary_conninfo', true)), "
+		"(select bool_and(active) from slots), "
+		"(select retained from slots "
+		"  order by active, retained desc nulls last limit 1)::bigint, "
+		"(select greatest(0, pg_current_wal_lsn() - '0/0'::pg_lsn "
+		"  - (('x' || substr(last_archived_wal, 9, 8))::bit(32)::bigint "
+		"     * 4294967296 "
+		"     + (('x' || substr(last_archived_wal, 17, 8))::bit(32)::bigint + 1) "
+		"     * pg_size_bytes(current_setting('wal_segment_size')))) "
+		"   from pg_stat_archiver "
+		"  where not pg_is_in_recovery() "
+		"    and current_setting('archive_mode') <> 'off' "
+		"    and last_archived_wal ~ '^[0-9A-F]{24}$')::bigint, "
+		"coalesce(current_setting('restore_command', true), '') <> '', "
+		"(select slot_name from slots "
+		"  order by active, retained desc nulls last limit 1)";
+
+	const Oid paramTypes[2] = { TEXTOID, TEXTOID };
+	const char *paramValues[2] = { slotName, replicaUserName };
+	int paramCount = 2;
+
+	memset(state, 0, sizeof(PostgresReplicationState));
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseReplicationState))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the replication state of the local "
+				  "Postgres instance");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * parseReplicationState parses the result of pgsql_get_replication_state.
+ */
+static void
+parseReplicationState(void *ctx, PGresult *result)
+{
+	ReplicationStateContext *context = (ReplicationStateContext *) ctx;
+	PostgresReplicationState *state = context->state;
+
+	if (PQnfields(result) != 13)
+	{
+		log_error("Query returned %d columns, expected 13", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	if (PQntuples(result) != 1)
+	{
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	state->isInRecovery = strcmp(PQgetvalue(result, 0, 0), "t") == 0;
+
+	/* PQgetvalue returns an empty string for NULL values */
+	strlcpy(state->syncState, PQgetvalue(result, 0, 1),
+			PGSR_SYNC_STATE_MAXLENGTH);
+	strlcpy(state->currentLSN, PQgetvalue(result, 0, 2), PG_LSN_MAXLENGTH);
+	strlcpy(state->receivedLSN, PQgetvalue(result, 0, 3), PG_LSN_MAXLENGTH);
+	strlcpy(state->replayedLSN, PQgetvalue(result, 0, 4), PG_LSN_MAXLENGTH);
+	strlcpy(state->walReceiverStatus, PQgetvalue(result, 0, 5),
+			PG_WAL_RECEIVER_STATUS_MAXLENGTH);
+
+	state->hasReplica = strcmp(PQgetvalue(result, 0, 6), "t") == 0;
+
+	if (!PQgetisnull(result, 0, 7))
+	{
+		parseUpstreamConninfo(PQgetvalue(result, 0, 7), state);
+	}
+
+	state->slotActive = strcmp(PQgetvalue(result, 0, 8), "t") == 0;
+
+	/* the slot has no restart_lsn until a standby connects to it */
+	if (PQgetisnull(result, 0, 9))
+	{
+		state->slotRetainedWALBytes = -1;
+	}
+	else
+	{
+		state->slotRetainedWALBytes = strtoll(PQgetvalue(result, 0, 9), NULL, 10);
+	}
+
+	/* the WAL after the end of the last segment that the archiver archived */
+	if (PQgetisnull(result, 0, 10))
+	{
+		state->archiveLagBytes = -1;
+	}
+	else
+	{
+		state->archiveLagBytes = strtoll(PQgetvalue(result, 0, 10), NULL, 10);
+	}
+
+	/* before Postgres 12, restore_command is not a GUC and we don't know */
+	state->hasRestoreCommand = strcmp(PQgetvalue(result, 0, 11), "t") == 0;
+
+	strlcpy(state->slotName, PQgetvalue(result, 0, 12), NAMEDATALEN);
+
+	context->parsedOk = true;
+}
+
+
+/*
+ * parseUpstreamConninfo sets the upstream host, port and application_name of
+ * the replication state from the connection string of the WAL receiver. We
+ * run at each keeper loop and only use the upstream to compare it with the
+ * one the monitor assigns, so a connection string that we can't parse is
+ * just ignored, silently.
+ */
+static void
+parseUpstreamConninfo(const char *conninfo, PostgresReplicationState *state)
+{
+	PQconninfoOption *options = NULL;
+	PQconninfoOption *option = NULL;
+
+	options = PQconninfoParse(conninfo, NULL);
+	if (options == NULL)
+	{
+		return;
+	}
+
+	state->upstreamPort = POSTGRES_PORT;
+	state->upstreamApplicationName[0] = '\0';
+
+	for (option = options; option->keyword != NULL; option++)
+	{
+		if (option->val == NULL)
+		{
+			continue;
+		}
+
+		if (strcmp(option->keyword, "host") == 0)
+		{
+			strlcpy(state->upstreamHost, option->val, _POSIX_HOST_NAME_MAX);
+		}
+		else if (strcmp(option->keyword, "port") == 0)
+		{
+			state->upstreamPort = atoi(option->val);
+		}
+		else if (strcmp(option->keyword, "application_name") == 0)
+		{
+			strlcpy(state->upstreamApplicationName, option->val, NAMEDATALEN);
+		}
+	}
+
+	PQconninfoFree(options);
+}
+
+
 /*
  * LISTEN/NOTIFY support.
  *
@@ -1379,6 +3771,8 @@ pgsql_listen(PGSQL *pgsql, char *channels[])
 		clear_results(connection);
 	}
 
+	pgsql->listening = true;
+
 	return true;
 }
 
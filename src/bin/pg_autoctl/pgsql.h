@@ -23,6 +23,8 @@
 #define INT4OID 23
 #define INT8OID 20
 #define TEXTOID 25
+#define FLOAT8OID 701
+#define TEXTARRAYOID 1009
 
 /*
  * Maximum connection info length as used in walreceiver.h
@@ -45,12 +47,90 @@
  */
 #define PGSR_SYNC_STATE_MAXLENGTH 10
 
+/*
+ * pg_stat_wal_receiver.status is one of:
+ *   stopped, starting, streaming, waiting, restarting, stopping
+ */
+#define PG_WAL_RECEIVER_STATUS_MAXLENGTH 16
+
+/* where a standby gets its WAL from: "stream" or "archive" */
+#define PG_WAL_SOURCE_MAXLENGTH 8
+
+/*
+ * libpq result and parameter formats, see PQexecParams.
+ */
+#define PGSQL_FORMAT_TEXT 0
+#define PGSQL_FORMAT_BINARY 1
+
+/*
+ * Maximum number of prepared statements that we keep on a connection, see
+ * pgsql_execute_with_params.
+ */
+#define PGSQL_MAX_PREPARED_STATEMENTS 16
+
+/* our connection string, and then the keepalives settings */
+#define PGSQL_MAX_CONNECTION_PARAMS 5
+
+
+/*
+ * TCP keepalives settings used when connecting to a Postgres server, so that
+ * we notice a dead peer in seconds rather than when the kernel defaults
+ * expire. A zero value keeps the libpq and system defaults.
+ */
+typedef struct PGSQLKeepalives
+{
+	int idle;					/* seconds */
+	int interval;				/* seconds */
+	int count;
+	int tcpUserTimeout;			/* milliseconds */
+} PGSQLKeepalives;
 
 /* abstract representation of a Postgres server that we can connect to */
 typedef struct PGSQL
 {
 	char	connectionString[MAXCONNINFO];
 	PGconn *connection;
+
+	/*
+	 * When keepConnection is true, pgsql_release keeps the connection open
+	 * for the next queries, and we wait for a while before connecting again
+	 * after failing to connect, see pgsql_open_connection.
+	 */
+	bool	keepConnection;
+	int		connectionFailures;
+	uint64_t nextConnectionTimeMs;
+
+	/*
+	 * Queries on a kept connection wait for the socket or a signal, and when
+	 * cancelOnStop is true a smart shutdown request cancels them, see
+	 * pgsql_get_result.
+	 */
+	bool	cancelOnStop;
+
+	/* whether we LISTEN on the current connection, see pgsql_listen */
+	bool	listening;
+
+	/*
+	 * When connectTimeoutMs is positive, we give up connecting after that
+	 * many milliseconds, rather than after libpq's connect_timeout seconds.
+	 */
+	int		connectTimeoutMs;
+
+	PGSQLKeepalives keepalives;
+
+	/*
+	 * When the server sends a notice with the hint "Retry after N ms.", such
+	 * as the monitor does when it's too busy to run our node_active call, we
+	 * keep N here until the caller resets it.
+	 */
+	int		retryAfterMs;
+
+	/*
+	 * SQL text of the statements prepared on the current connection, the
+	 * statement at index i is named "pgautoctl_<i>".
+	 */
+	char   *preparedStatements[PGSQL_MAX_PREPARED_STATEMENTS];
+	int		preparedStatementCount;
 } PGSQL;
 
 /* PostgreSQL ("Grand Unified Configuration") setting */
@@ -60,23 +140,78 @@ typedef struct GUC
 	char *value;
 } GUC;
 
-/* network address of a node in an HA group */
+/*
+ * PostgresSetting is the current value of a setting in Postgres, with its
+ * pg_settings.context, which tells when a new value applies, and the file
+ * it has been set from, empty when it has its default value.
+ */
+typedef struct PostgresSetting
+{
+	char value[BUFSIZE];
+	char context[NAMEDATALEN];
+	char sourceFile[MAXPGPATH];
+} PostgresSetting;
+
+/* network address of a node in an HA group, and its node id when known */
 typedef struct NodeAddress
 {
+	int nodeId;
 	char host[_POSIX_HOST_NAME_MAX];
 	int port;
 } NodeAddress;
 
+/* the other nodes of an HA group, see monitor_get_other_nodes */
+#define NODE_ARRAY_MAX_COUNT 12
+
+typedef struct NodeAddressArray
+{
+	int count;
+	NodeAddress nodes[NODE_ARRAY_MAX_COUNT];
+	char lsn[NODE_ARRAY_MAX_COUNT][PG_LSN_MAXLENGTH];   /* last reported */
+} NodeAddressArray;
+
 typedef struct ReplicationSource
 {
 	NodeAddress primaryNode;
 	char *userName;
 	char *slotName;
+	char *applicationName;		/* primary_conninfo application_name, if set */
 	char *password;
 	char *maximumBackupRate;
+	char *backupCompression;	/* pg_basebackup --compress, when set */
+	char *rewindSync;			/* how pg_rewind syncs PGDATA, when set */
+	char *restoreCommand;		/* seeds PGDATA instead of pg_basebackup */
+	char *walRestoreCommand;	/* Postgres restore_command, when set */
 } ReplicationSource;
 
 
+/*
+ * PostgresReplicationState is what the keeper needs to know about the local
+ * Postgres instance at each loop, as fetched in a single query by
+ * pgsql_get_replication_state. Values that are NULL in Postgres (e.g. the
+ * received LSN on a primary) are empty strings here.
+ */
+typedef struct PostgresReplicationState
+{
+	bool isInRecovery;
+	char syncState[PGSR_SYNC_STATE_MAXLENGTH];
+	char currentLSN[PG_LSN_MAXLENGTH];
+	char receivedLSN[PG_LSN_MAXLENGTH];
+	char replayedLSN[PG_LSN_MAXLENGTH];
+	char walReceiverStatus[PG_WAL_RECEIVER_STATUS_MAXLENGTH];
+	bool hasReplica;
+	char upstreamHost[_POSIX_HOST_NAME_MAX];
+	int upstreamPort;
+	char upstreamApplicationName[NAMEDATALEN];
+	bool slotActive;                /* all our slots are in use */
+	int64_t slotRetainedWALBytes;   /* -1 when unknown */
+	char slotName[NAMEDATALEN];     /* the slot that retains that WAL */
+	int64_t archiveLagBytes;        /* -1 when unknown */
+	bool hasRestoreCommand;
+	char walSource[PG_WAL_SOURCE_MAXLENGTH]; /* "stream", "archive" or "" */
+} PostgresReplicationState;
+
+
 /*
  * Arrange a generic way to parse PostgreSQL result from a query. Most of the
  * queries we need here return a single row of a single column, so that's what
@@ -106,6 +241,55 @@ typedef struct SingleValueResultContext
 } SingleValueResultContext;
 
 
+/*
+ * An asynchronous query, see pgsql_async_start.
+ */
+typedef enum
+{
+	PGSQL_ASYNC_IDLE = 0,
+	PGSQL_ASYNC_CONNECTING,
+	PGSQL_ASYNC_BUSY,
+	PGSQL_ASYNC_DONE,
+	PGSQL_ASYNC_FAILED
+} PGSQLAsyncState;
+
+typedef struct PGSQLAsyncQuery
+{
+	PGSQL *pgsql;
+	const char *sql;
+	int paramCount;
+	const Oid *paramTypes;
+	const char **paramValues;
+	void *context;
+	ParsePostgresResultCB *parseFun;
+
+	PGSQLAsyncState state;
+	PostgresPollingStatusType pollStatus;
+	bool flushPending;          /* the query has not been sent entirely */
+	PGresult *result;           /* first error, or last result */
+	uint64_t deadlineMs;        /* when we give up connecting, or zero */
+} PGSQLAsyncQuery;
+
+/*
+ * A small pool of client connections, keyed on their connection string, see
+ * pgsql_pool_acquire.
+ */
+#define PGSQL_POOL_SIZE 16
+
+typedef struct PGSQLPoolClient
+{
+	PGSQL pgsql;
+	bool inUse;
+} PGSQLPoolClient;
+
+typedef struct PGSQLPool
+{
+	PGSQLPoolClient clients[PGSQL_POOL_SIZE];
+	int clientCount;
+	int maxPerTarget;
+} PGSQLPool;
+
+
 #define CHECK__SETTINGS_SQL											\
 	"select bool_and(ok) "											\
 	"from ("														\
@@ -133,24 +317,65 @@ typedef struct SingleValueResultContext
 
 bool pgsql_init(PGSQL *pgsql, char *url);
 void pgsql_finish(PGSQL *pgsql);
+void pgsql_release(PGSQL *pgsql);
 void parseSingleValueResult(void *ctx, PGresult *result);
 bool pgsql_execute_with_params(PGSQL *pgsql, const char *sql, int paramCount,
 							   const Oid *paramTypes, const char **paramValues,
 							   void *parseContext, ParsePostgresResultCB *parseFun);
+bool pgsql_execute_with_params_format(PGSQL *pgsql, const char *sql,
+									  int paramCount, const Oid *paramTypes,
+									  const char **paramValues,
+									  const int *paramLengths,
+									  const int *paramFormats,
+									  int resultFormat,
+									  void *parseContext,
+									  ParsePostgresResultCB *parseFun);
+bool pgsql_get_int4(PGresult *result, int row, int column, int *value);
+bool pgsql_get_int8(PGresult *result, int row, int column, int64_t *value);
+bool pgsql_get_bool(PGresult *result, int row, int column, bool *value);
+bool pgsql_get_lsn(PGresult *result, int row, int column, uint64_t *lsn);
+void pgsql_format_lsn(uint64_t lsn, char *buffer, int size);
+bool pgsql_async_start(PGSQLAsyncQuery *query, PGSQL *pgsql, const char *sql,
+					   int paramCount, const Oid *paramTypes,
+					   const char **paramValues,
+					   void *context, ParsePostgresResultCB *parseFun);
+short pgsql_async_events(PGSQLAsyncQuery *query);
+bool pgsql_async_poll(PGSQLAsyncQuery *query);
+bool pgsql_async_wait_all(PGSQLAsyncQuery *queries, int queryCount,
+						  int timeoutMs);
+void pgsql_pool_init(PGSQLPool *pool, int maxPerTarget);
+PGSQL * pgsql_pool_acquire(PGSQLPool *pool, const char *connectionString);
+void pgsql_pool_release(PGSQLPool *pool, PGSQL *pgsql);
+void pgsql_pool_finish(PGSQLPool *pool);
 bool pgsql_check_postgresql_settings(PGSQL *pgsql, bool isCitusInstanceKind,
 									 bool *settings_are_ok);
 bool pgsql_check_monitor_settings(PGSQL *pgsql, bool *settings_are_ok);
 bool pgsql_is_in_recovery(PGSQL *pgsql, bool *is_in_recovery);
 bool pgsql_reload_conf(PGSQL *pgsql);
+bool pgsql_alter_system_settings(PGSQL *pgsql, GUC *settings, bool reset);
 bool pgsql_create_replication_slot(PGSQL *pgsql, const char *slotName);
+bool pgsql_create_replication_slot_if_missing(PGSQL *pgsql, const char *slotName);
+bool pgsql_reserve_replication_slot(PGSQL *pgsql, const char *slotName);
+bool pgsql_advance_replication_slot(PGSQL *pgsql, const char *slotName);
+bool pgsql_advance_replication_slot_to_lsn(PGSQL *pgsql, const char *slotName,
+										   const char *lsn);
 bool pgsql_drop_replication_slot(PGSQL *pgsql, const char *slotName, bool verbose);
-bool pgsql_enable_synchronous_replication(PGSQL *pgsql);
+bool pgsql_drop_stale_replication_slots(PGSQL *pgsql, const char *slotPrefix,
+									  const char *slotNames);
+bool pgsql_enable_synchronous_replication(PGSQL *pgsql,
+										  const char *standbyNames,
+										  const char *synchronousCommit);
 bool pgsql_disable_synchronous_replication(PGSQL *pgsql);
 bool pgsql_set_default_transaction_mode_read_only(PGSQL *pgsql);
 bool pgsql_set_default_transaction_mode_read_write(PGSQL *pgsql);
+bool pgsql_terminate_write_sessions(PGSQL *pgsql, int *terminatedCount);
 bool pgsql_checkpoint(PGSQL *pgsql);
+bool pgsql_checkpoint_is_on_current_timeline(PGSQL *pgsql,
+											 bool *onCurrentTimeline);
 bool pgsql_get_config_file_path(PGSQL *pgsql, char *configFilePath, int maxPathLength);
 bool pgsql_get_hba_file_path(PGSQL *pgsql, char *hbaFilePath, int maxPathLength);
+bool pgsql_get_setting(PGSQL *pgsql, const char *name, PostgresSetting *setting);
+bool pgsql_has_pending_restart(PGSQL *pgsql, bool *pendingRestart);
 bool pgsql_create_database(PGSQL *pgsql, const char *dbname, const char *owner);
 bool pgsql_create_extension(PGSQL *pgsql, const char *name);
 bool pgsql_create_user(PGSQL *pgsql, const char *userName, const char *password,
@@ -158,6 +383,13 @@ bool pgsql_create_user(PGSQL *pgsql, const char *userName, const char *password,
 bool pgsql_has_replica(PGSQL *pgsql, char *userName, bool *hasReplica);
 bool hostname_from_uri(const char *pguri,
 					   char *hostname, int maxHostLength, int *port);
+bool hostname_from_uri_at(const char *pguri, int index,
+						  char *hostname, int maxHostLength, int *port,
+						  bool *found);
+int pgsql_conninfo_host_count(const char *conninfo);
+bool pgsql_conninfo_set_option(const char *conninfo,
+							   const char *keyword, const char *value,
+							   bool overwrite, char *result, int size);
 int make_conninfo_field_str(char *destination, const char *key, const char *value);
 int make_conninfo_field_int(char *destination, const char *key, int value);
 bool validate_connection_string(const char *connectionString);
@@ -165,7 +397,25 @@ bool validate_connection_string(const char *connectionString);
 bool pgsql_get_sync_state_and_current_lsn(PGSQL *pgsql, const char *slotName,
 									  	  char *pgsrSyncState, char *currentLSN,
 										  int maxLSNSize, bool missing_ok);
+bool pgsql_get_buffer_ranges(PGSQL *pgsql, int maxRangeBlocks, char **ranges);
+bool pgsql_prewarm_range(PGSQL *pgsql, const char *relation, const char *fork,
+						 int64_t firstBlock, int64_t lastBlock);
+bool pgsql_update_worker_node(PGSQL *pgsql, NodeAddress *oldNode,
+							  NodeAddress *newNode, int lockCooldownMs);
+bool pgsql_get_current_wal_lsn(PGSQL *pgsql, char *currentLSN, int maxLSNSize);
+bool pgsql_get_received_and_replayed_lsn(PGSQL *pgsql,
+										 char *receivedLSN,
+										 char *replayedLSN,
+										 int maxLSNSize);
+bool pgsql_get_current_and_standby_replay_lsn(PGSQL *pgsql,
+											  const char *slotName,
+											  char *currentLSN,
+											  char *standbyLSN,
+											  int maxLSNSize);
 bool pgsql_get_received_lsn_from_standby(PGSQL *pgsql, char *receivedLSN, int maxLSNSize);
+bool pgsql_get_replication_state(PGSQL *pgsql, const char *slotName,
+								 const char *replicaUserName,
+								 PostgresReplicationState *state);
 bool pgsql_listen(PGSQL *pgsql, char *channels[]);
 
 bool pgsql_alter_extension_update_to(PGSQL *pgsql,
@@ -9,18 +9,31 @@
 #include <time.h>
 
 #include "postgres_fe.h"
+#include "portability/instr_time.h"
 
 #include "file_utils.h"
 #include "log.h"
+#include "parsing.h"
 #include "pgctl.h"
+#include "pgdelta.h"
 #include "pghba.h"
 #include "pgsql.h"
 #include "primary_standby.h"
+#include "signals.h"
 
 
 static void local_postgres_update_pg_failures_tracking(
 	LocalPostgresServer *postgres,
 	bool pgIsRunning);
+static bool standby_restore_from_repository(LocalPostgresServer *postgres,
+											ReplicationSource *replicationSource);
+static bool standby_ensure_primary_checkpoint(PostgresSetup *pgSetup,
+											  ReplicationSource *replicationSource);
+static bool standby_init_primary_connection(PostgresSetup *pgSetup,
+											ReplicationSource *replicationSource,
+											PGSQL *pgsql);
+static void standby_set_upstream(LocalPostgresServer *postgres,
+								 ReplicationSource *replicationSource);
 
 /*
  * Default settings for postgres databases managed by pg_auto_failover.
@@ -55,6 +68,21 @@ GUC citus_default_settings[] = {
 	{ NULL, NULL }
 };
 
+/*
+ * While catching up, a standby isn't used for read queries, so WAL replay
+ * never waits for conflicting queries, and we send less feedback to the
+ * primary. Recovery prefetching, where the Postgres version has it, reads
+ * maintenance_io_concurrency blocks ahead of replay.
+ */
+GUC catchup_settings[] = {
+	{ "maintenance_io_concurrency", "64" },
+	{ "max_standby_streaming_delay", "0" },
+	{ "max_standby_archive_delay", "0" },
+	{ "hot_standby_feedback", "'off'" },
+	{ "wal_receiver_status_interval", "'30s'" },
+	{ NULL, NULL }
+};
+
 
 /*
  * local_postgres_init initialises an interface for managing a local
@@ -76,6 +104,8 @@ local_postgres_init(LocalPostgresServer *postgres, PostgresSetup *pgSetup)
 
 	/* set the local instance kind from the configuration. */
 	postgres->pgKind = pgSetup->pgKind;
+
+	postgres->promotionCheckpointPending = false;
 }
 
 
@@ -224,6 +254,29 @@ primary_create_replication_slot(LocalPostgresServer *postgres, char *replication
 }
 
 
+/*
+ * primary_ensure_replication_slot creates a replication slot unless it
+ * already exists. After a promotion, the slot that we maintained as a standby
+ * retains the WAL that the former primary needs to rejoin, see
+ * standby_maintain_replication_slot, so we keep it.
+ */
+bool
+primary_ensure_replication_slot(LocalPostgresServer *postgres,
+								char *replicationSlotName)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	bool result = false;
+
+	log_trace("primary_ensure_replication_slot");
+
+	result = pgsql_create_replication_slot_if_missing(pgsql,
+													  replicationSlotName);
+
+	pgsql_finish(pgsql);
+	return result;
+}
+
+
 /*
  * primary_drop_replication_slot drops a replication slot if it exists. The return
  * value indicates whether the operation was successful.
@@ -243,19 +296,53 @@ primary_drop_replication_slot(LocalPostgresServer *postgres, char *replicationSl
 }
 
 
+/*
+ * primary_drop_stale_replication_slots drops the replication slots named
+ * after replicationSlotName and a node id that are not in the comma separated
+ * list of slotNames, and that no standby uses: those of the standby nodes
+ * that left the group. An empty slotNames drops them all, and then we also
+ * drop the replication slot named replicationSlotName.
+ */
+bool
+primary_drop_stale_replication_slots(LocalPostgresServer *postgres,
+									 char *replicationSlotName,
+									 const char *slotNames)
+{
+	bool result = false;
+	PGSQL *pgsql = &(postgres->sqlClient);
+
+	log_trace("primary_drop_stale_replication_slots");
+
+	result = pgsql_drop_stale_replication_slots(pgsql, replicationSlotName,
+												slotNames);
+
+	if (result && IS_EMPTY_STRING_BUFFER(slotNames))
+	{
+		result = pgsql_drop_replication_slot(pgsql, replicationSlotName, true);
+	}
+
+	pgsql_finish(pgsql);
+	return result;
+}
+
+
 /*
  * primary_enable_synchronous_replication enables synchronous replication
- * on a primary postgres node.
+ * on a primary postgres node, waiting for the given standbyNames at the
+ * given synchronousCommit level.
  */
 bool
-primary_enable_synchronous_replication(LocalPostgresServer *postgres)
+primary_enable_synchronous_replication(LocalPostgresServer *postgres,
+									   const char *standbyNames,
+									   const char *synchronousCommit)
 {
 	bool result = false;
 	PGSQL *pgsql = &(postgres->sqlClient);
 
 	log_trace("primary_enable_synchronous_replication");
 
-	result = pgsql_enable_synchronous_replication(pgsql);
+	result = pgsql_enable_synchronous_replication(pgsql, standbyNames,
+												  synchronousCommit);
 
 	pgsql_finish(pgsql);
 	return result;
@@ -290,9 +377,7 @@ bool
 postgres_add_default_settings(LocalPostgresServer *postgres)
 {
 	PGSQL *pgsql = &(postgres->sqlClient);
-	PostgresSetup *pgSetup = &(postgres->postgresSetup);
 	char configFilePath[MAXPGPATH];
-	GUC *default_settings = postgres_default_settings;
 
 	log_trace("primary_add_default_postgres_settings");
 
@@ -308,6 +393,22 @@ postgres_add_default_settings(LocalPostgresServer *postgres)
 	/* in case of errors, pgsql_ functions finish the connection */
 	pgsql_finish(pgsql);
 
+	return postgres_add_default_settings_to_file(postgres, configFilePath);
+}
+
+
+/*
+ * postgres_add_default_settings_to_file is postgres_add_default_settings for
+ * a known postgresql.conf path, which allows installing our settings before
+ * starting a freshly initialized Postgres instance for the first time.
+ */
+bool
+postgres_add_default_settings_to_file(LocalPostgresServer *postgres,
+									  char *configFilePath)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	GUC *default_settings = postgres_default_settings;
+
 	/* default settings are different when dealing with a Citus node */
 	if (IS_CITUS_INSTANCE_KIND(postgres->pgKind))
 	{
@@ -327,6 +428,108 @@ postgres_add_default_settings(LocalPostgresServer *postgres)
 }
 
 
+/*
+ * postgres_apply_default_settings compares our default settings with the
+ * values that the running Postgres instance uses. When some of them differ,
+ * we write them to our configuration file and reload Postgres, rather than
+ * restarting it, which would empty its caches.
+ *
+ * Settings that can't change without a restart, as told by pg_settings, are
+ * then marked pending_restart by Postgres, and we restart it the next time
+ * the node enters maintenance, see fsm_start_maintenance_on_standby.
+ *
+ * Settings that have been set from another file than ours, such as with
+ * ALTER SYSTEM, are left alone: our file is included first.
+ */
+bool
+postgres_apply_default_settings(LocalPostgresServer *postgres)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	GUC *default_settings = postgres_default_settings;
+	int settingIndex = 0;
+	int changedCount = 0;
+
+	if (IS_CITUS_INSTANCE_KIND(postgres->pgKind))
+	{
+		default_settings = citus_default_settings;
+	}
+
+	for (settingIndex = 0;
+		 default_settings[settingIndex].name != NULL;
+		 settingIndex++)
+	{
+		GUC *setting = &default_settings[settingIndex];
+		PostgresSetting current = { 0 };
+		char value[BUFSIZE];
+		char *unquotedValue = value;
+		int length = 0;
+
+		if (!pg_default_setting_value(setting, pgSetup, value, BUFSIZE) ||
+			!pgsql_get_setting(pgsql, setting->name, &current))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (!IS_EMPTY_STRING_BUFFER(current.sourceFile) &&
+			!pg_is_default_settings_file(current.sourceFile))
+		{
+			continue;
+		}
+
+		/* current_setting() returns string values without their quotes */
+		length = strlen(value);
+
+		if (length >= 2 && value[0] == '\'' && value[length - 1] == '\'')
+		{
+			value[length - 1] = '\0';
+			unquotedValue = value + 1;
+		}
+
+		if (strcmp(unquotedValue, current.value) == 0)
+		{
+			continue;
+		}
+
+		++changedCount;
+
+		if (strcmp(current.context, "postmaster") == 0)
+		{
+			log_info("Setting %s changes from \"%s\" to \"%s\" at the next "
+					 "restart of Postgres, when the node enters maintenance",
+					 setting->name, current.value, unquotedValue);
+		}
+		else
+		{
+			log_info("Setting %s changes from \"%s\" to \"%s\"",
+					 setting->name, current.value, unquotedValue);
+		}
+	}
+
+	if (changedCount == 0)
+	{
+		log_debug("Postgres already uses the default settings of "
+				  "pg_auto_failover");
+		return true;
+	}
+
+	if (!postgres_add_default_settings(postgres))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgsql_reload_conf(pgsql))
+	{
+		log_error("Failed to reload Postgres to apply the new settings");
+		return false;
+	}
+
+	return true;
+}
+
+
 /*
  * primary_create_user_with_hba creates a user and updates pg_hba.conf
  * to allow the user to connect from the given hostname.
@@ -340,6 +543,8 @@ primary_create_user_with_hba(LocalPostgresServer *postgres, char *userName,
 	bool superuser = false;
 	bool replication = false;
 	char hbaFilePath[MAXPGPATH];
+	HBAEditor editor = { 0 };
+	bool changed = false;
 
 	log_trace("primary_create_user_with_hba");
 
@@ -356,14 +561,25 @@ primary_create_user_with_hba(LocalPostgresServer *postgres, char *userName,
 		return false;
 	}
 
-	if (!pghba_ensure_host_rule_exists(hbaFilePath, HBA_DATABASE_ALL, NULL, userName,
-									   hostname, authMethod))
+	if (!pghba_editor_init(&editor, hbaFilePath))
 	{
 		log_error("Failed to set the pg_hba rule for user \"%s\"", userName);
 		return false;
 	}
 
-	if (!pgsql_reload_conf(pgsql))
+	if (!pghba_editor_add_host_rule(&editor, HBA_DATABASE_ALL, NULL, userName,
+									hostname, authMethod) ||
+		!pghba_editor_commit(&editor))
+	{
+		log_error("Failed to set the pg_hba rule for user \"%s\"", userName);
+		pghba_editor_destroy(&editor);
+		return false;
+	}
+
+	changed = editor.changed;
+	pghba_editor_destroy(&editor);
+
+	if (changed && !pgsql_reload_conf(pgsql))
 	{
 		log_error("Failed to reload pg_hba settings after updating pg_hba.conf");
 		return false;
@@ -412,6 +628,8 @@ primary_add_standby_to_hba(LocalPostgresServer *postgres, char *standbyHostname,
 	PostgresSetup *postgresSetup = &(postgres->postgresSetup);
 	char hbaFilePath[MAXPGPATH];
 	char *authMethod =  "trust";
+	HBAEditor editor = { 0 };
+	bool changed = false;
 
 	if (replicationPassword)
 	{
@@ -428,27 +646,34 @@ primary_add_standby_to_hba(LocalPostgresServer *postgres, char *standbyHostname,
 		return false;
 	}
 
-	if (!pghba_ensure_host_rule_exists(hbaFilePath,
-									   HBA_DATABASE_REPLICATION, NULL,
-									   PG_AUTOCTL_REPLICA_USERNAME,
-									   standbyHostname, authMethod))
+	if (!pghba_editor_init(&editor, hbaFilePath))
 	{
 		log_error("Failed to add the standby node to PostgreSQL HBA file: "
-				  "couldn't modify the pg_hba file");
+				  "couldn't read the pg_hba file");
 		return false;
 	}
 
-	if (!pghba_ensure_host_rule_exists(hbaFilePath, HBA_DATABASE_DBNAME,
-									   postgresSetup->dbname,
-									   PG_AUTOCTL_REPLICA_USERNAME,
-									   standbyHostname, authMethod))
+	/* both rules are written to the file at once, with a single reload */
+	if (!pghba_editor_add_host_rule(&editor,
+									HBA_DATABASE_REPLICATION, NULL,
+									PG_AUTOCTL_REPLICA_USERNAME,
+									standbyHostname, authMethod) ||
+		!pghba_editor_add_host_rule(&editor, HBA_DATABASE_DBNAME,
+									postgresSetup->dbname,
+									PG_AUTOCTL_REPLICA_USERNAME,
+									standbyHostname, authMethod) ||
+		!pghba_editor_commit(&editor))
 	{
 		log_error("Failed to add the standby node to PostgreSQL HBA file: "
 				  "couldn't modify the pg_hba file");
+		pghba_editor_destroy(&editor);
 		return false;
 	}
 
-	if (!pgsql_reload_conf(pgsql))
+	changed = editor.changed;
+	pghba_editor_destroy(&editor);
+
+	if (changed && !pgsql_reload_conf(pgsql))
 	{
 		log_error("Failed to reload the postgres configuration after adding "
 				  "the standby user to pg_hba");
@@ -462,8 +687,9 @@ primary_add_standby_to_hba(LocalPostgresServer *postgres, char *standbyHostname,
 
 
 /*
- * standby_init_database tries to initialize PostgreSQL as a hot standby. It uses
- * pg_basebackup to do so. Returns false on failure.
+ * standby_init_database tries to initialize PostgreSQL as a hot standby. It
+ * uses the replication.restore_command when one is set, and pg_basebackup
+ * otherwise or when the restore fails. Returns false on failure.
  */
 bool
 standby_init_database(LocalPostgresServer *postgres,
@@ -490,18 +716,24 @@ standby_init_database(LocalPostgresServer *postgres,
 
 	/*
 	 * Now, we know that pgdata either doesn't exists or belongs to a stopped
-	 * PostgreSQL instance. We can safely proceed with pg_basebackup.
+	 * PostgreSQL instance. We can safely proceed with pg_basebackup, unless
+	 * we can seed the standby from a nearby backup repository and only fetch
+	 * the WAL since that backup from the primary.
 	 */
-	if (!pg_basebackup(pgSetup->pgdata,
-					   pgSetup->pg_ctl,
-					   replicationSource->maximumBackupRate,
-					   replicationSource->userName,
-					   replicationSource->password,
-					   replicationSource->slotName,
-					   replicationSource->primaryNode.host,
-					   replicationSource->primaryNode.port))
+	if (!standby_restore_from_repository(postgres, replicationSource))
 	{
-		return false;
+		if (!pg_basebackup(pgSetup->pgdata,
+						   pgSetup->pg_ctl,
+						   replicationSource->maximumBackupRate,
+						   replicationSource->backupCompression,
+						   replicationSource->userName,
+						   replicationSource->password,
+						   replicationSource->slotName,
+						   replicationSource->primaryNode.host,
+						   replicationSource->primaryNode.port))
+		{
+			return false;
+		}
 	}
 
 	if (!ensure_local_postgres_is_running(postgres))
@@ -528,6 +760,164 @@ standby_init_database(LocalPostgresServer *postgres,
 		return false;
 	}
 
+	(void) standby_set_upstream(postgres, replicationSource);
+
+	return true;
+}
+
+
+/*
+ * standby_restore_from_repository seeds PGDATA using the user provided
+ * replication.restore_command, and then sets up the standby mode so that
+ * Postgres catches up from the repository and then from the primary. Returns
+ * false when there's no restore command, or when it failed, in which case
+ * the caller falls back to pg_basebackup.
+ *
+ * Our replication slot doesn't hold WAL until the standby first connects to
+ * it, and the backup is older than the slot anyway: the primary might have
+ * recycled the WAL since the backup already. So the standby must fetch that
+ * WAL from the repository, using replication.wal_restore_command.
+ */
+static bool
+standby_restore_from_repository(LocalPostgresServer *postgres,
+								ReplicationSource *replicationSource)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	char configFilePath[MAXPGPATH];
+
+	if (replicationSource->restoreCommand == NULL
+		|| IS_EMPTY_STRING_BUFFER(replicationSource->restoreCommand))
+	{
+		return false;
+	}
+
+	if (replicationSource->walRestoreCommand == NULL
+		|| IS_EMPTY_STRING_BUFFER(replicationSource->walRestoreCommand))
+	{
+		log_warn("Ignoring replication.restore_command: without a "
+				 "replication.wal_restore_command the standby can't fetch "
+				 "the WAL since the backup from the repository, "
+				 "using pg_basebackup instead");
+		return false;
+	}
+
+	if (!pg_restore_from_repository(pgSetup->pgdata,
+									replicationSource->restoreCommand))
+	{
+		log_warn("Failed to restore \"%s\" from the backup repository, "
+				 "using pg_basebackup instead", pgSetup->pgdata);
+		return false;
+	}
+
+	/* we need the control version of the restored cluster */
+	if (!pg_controldata(pgSetup, false))
+	{
+		log_warn("Failed to read the control data of the restored "
+				 "directory \"%s\", using pg_basebackup instead",
+				 pgSetup->pgdata);
+		return false;
+	}
+
+	join_path_components(configFilePath, pgSetup->pgdata, "postgresql.conf");
+
+	if (!pg_setup_standby_mode(pgSetup->control.pg_control_version,
+							   configFilePath,
+							   pgSetup->pgdata,
+							   replicationSource))
+	{
+		log_warn("Failed to setup Postgres as a standby after restore, "
+				 "using pg_basebackup instead");
+		return false;
+	}
+
+	log_info("Restored \"%s\" from the backup repository, Postgres now "
+			 "catches up from the repository and then the primary %s:%d",
+			 pgSetup->pgdata,
+			 replicationSource->primaryNode.host,
+			 replicationSource->primaryNode.port);
+
+	return true;
+}
+
+
+/*
+ * standby_delta_reseed re-seeds the existing data directory from the primary
+ * by only fetching the parts of the files that differ, which is much faster
+ * than pg_basebackup after a failover when pg_rewind can't be used. Returns
+ * false when that's not possible, and then the caller uses pg_basebackup.
+ */
+bool
+standby_delta_reseed(LocalPostgresServer *postgres,
+					 ReplicationSource *replicationSource)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	char configFilePath[MAXPGPATH];
+
+	log_trace("standby_delta_reseed");
+
+	if (!directory_exists(pgSetup->pgdata))
+	{
+		return false;
+	}
+
+	if (!pg_ctl_stop(pgSetup->pg_ctl, pgSetup->pgdata))
+	{
+		log_error("Failed to stop postgres to re-seed \"%s\"",
+				  pgSetup->pgdata);
+		return false;
+	}
+
+	/* we need the system identifier of the local cluster */
+	if (!pg_controldata(pgSetup, false))
+	{
+		return false;
+	}
+
+	log_info("Re-seeding \"%s\" from primary %s:%d",
+			 pgSetup->pgdata,
+			 replicationSource->primaryNode.host,
+			 replicationSource->primaryNode.port);
+
+	if (!pg_delta_reseed(pgSetup->pgdata,
+						 pgSetup->dbname,
+						 pgSetup->control.system_identifier,
+						 replicationSource))
+	{
+		return false;
+	}
+
+	/* the control file now is the primary's one */
+	if (!pg_controldata(pgSetup, false))
+	{
+		return false;
+	}
+
+	join_path_components(configFilePath, pgSetup->pgdata, "postgresql.conf");
+
+	if (!pg_setup_standby_mode(pgSetup->control.pg_control_version,
+							   configFilePath,
+							   pgSetup->pgdata,
+							   replicationSource))
+	{
+		log_error("Failed to setup Postgres as a standby, after re-seed");
+		return false;
+	}
+
+	if (!ensure_local_postgres_is_running(postgres))
+	{
+		log_error("Failed to start postgres after re-seed");
+		return false;
+	}
+
+	if (!postgres_add_default_settings(postgres))
+	{
+		log_error("Failed to add default settings to the secondary, "
+				  "see above for details.");
+		return false;
+	}
+
+	(void) standby_set_upstream(postgres, replicationSource);
+
 	return true;
 }
 
@@ -563,10 +953,17 @@ primary_rewind_to_standby(LocalPostgresServer *postgres,
 		return false;
 	}
 
+	if (!standby_ensure_primary_checkpoint(pgSetup, replicationSource))
+	{
+		log_error("Failed to rewind old data directory");
+		return false;
+	}
+
 	if (!pg_rewind(pgSetup->pgdata, pgSetup->pg_ctl,
 				   primaryNode->host, primaryNode->port,
 				   pgSetup->dbname, replicationSource->userName,
-				   replicationSource->password))
+				   replicationSource->password,
+				   replicationSource->rewindSync))
 	{
 		log_error("Failed to rewind old data directory");
 		return false;
@@ -587,54 +984,421 @@ primary_rewind_to_standby(LocalPostgresServer *postgres,
 		return false;
 	}
 
+	(void) standby_set_upstream(postgres, replicationSource);
+
 	return true;
 }
 
 
 /*
- * standby_promote promotes a standby postgres server to primary.
+ * standby_ensure_primary_checkpoint makes sure that the new primary is done
+ * with the checkpoint that follows its promotion, and runs a CHECKPOINT
+ * there when that's not the case yet. Before that checkpoint pg_control
+ * still has the old timeline, and pg_rewind would then decide that there's
+ * nothing to rewind.
  */
-bool
-standby_promote(LocalPostgresServer *postgres)
+static bool
+standby_ensure_primary_checkpoint(PostgresSetup *pgSetup,
+								  ReplicationSource *replicationSource)
 {
-	PGSQL *pgsql = &(postgres->sqlClient);
-	PostgresSetup *pgSetup = &(postgres->postgresSetup);
-	bool inRecovery = false;
+	PGSQL pgsql = { 0 };
+	NodeAddress *primaryNode = &(replicationSource->primaryNode);
+	bool onCurrentTimeline = false;
 
-	log_trace("standby_promote");
+	if (!standby_init_primary_connection(pgSetup, replicationSource, &pgsql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
 
-	if (!pgsql_is_in_recovery(pgsql, &inRecovery))
+	if (!pgsql_checkpoint_is_on_current_timeline(&pgsql, &onCurrentTimeline))
 	{
-		log_error("Failed to promote standby: couldn't determine whether postgres "
-				  "is in recovery mode");
+		log_error("Failed to check the latest checkpoint of the new primary");
+		pgsql_finish(&pgsql);
 		return false;
 	}
 
-	if (!inRecovery)
+	if (!onCurrentTimeline)
 	{
-		log_info("Skipping promotion: postgres is not in recovery mode");
+		log_info("Running a checkpoint on the new primary %s:%d before rewind",
+				 primaryNode->host, primaryNode->port);
 
-		/*
-		 * Ensure idempotency: if in the last run we managed to promote, but
-		 * failed to checkpoint, we still need to checkpoint.
-		 */
-		if (!pgsql_checkpoint(pgsql))
+		if (!pgsql_checkpoint(&pgsql))
 		{
-			log_error("Failed to checkpoint after promotion");
+			log_error("Failed to checkpoint the new primary");
+			pgsql_finish(&pgsql);
 			return false;
 		}
-
-		return true;
 	}
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(pgsql);
 
-	log_info("Promoting postgres");
+	pgsql_finish(&pgsql);
 
-	if (!pg_ctl_promote(pgSetup->pg_ctl, pgSetup->pgdata))
+	return true;
+}
+
+
+/*
+ * standby_init_primary_connection initialises pgsql to connect to our
+ * primary as the replication user, on a database connection, as pg_rewind
+ * does.
+ */
+static bool
+standby_init_primary_connection(PostgresSetup *pgSetup,
+								ReplicationSource *replicationSource,
+								PGSQL *pgsql)
+{
+	NodeAddress *primaryNode = &(replicationSource->primaryNode);
+	char connInfo[MAXCONNINFO] = { 0 };
+	char *connInfoEnd = connInfo;
+
+	connInfoEnd += make_conninfo_field_str(connInfoEnd, "host", primaryNode->host);
+	connInfoEnd += make_conninfo_field_int(connInfoEnd, "port", primaryNode->port);
+	connInfoEnd += make_conninfo_field_str(connInfoEnd, "user",
+										   replicationSource->userName);
+	connInfoEnd += make_conninfo_field_str(connInfoEnd, "dbname", pgSetup->dbname);
+
+	if (replicationSource->password != NULL)
 	{
-		log_error("Failed to promote standby: see pg_ctl promote errors above");
-		return false;
+		setenv("PGPASSWORD", replicationSource->password, 1);
+	}
+
+	return pgsql_init(pgsql, connInfo);
+}
+
+
+/*
+ * standby_get_primary_current_lsn connects to our primary and fetches its
+ * current LSN. We don't wait for long when the primary is not reachable, as
+ * that's expected in a failover.
+ */
+bool
+standby_get_primary_current_lsn(LocalPostgresServer *postgres,
+								ReplicationSource *replicationSource,
+								char *currentLSN, int maxLSNSize)
+{
+	PGSQL pgsql = { 0 };
+	bool success = false;
+
+	if (!standby_init_primary_connection(&(postgres->postgresSetup),
+										 replicationSource, &pgsql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	pgsql.connectTimeoutMs = PREPARE_PROMOTION_PRIMARY_CONNECT_TIMEOUT_MS;
+
+	success = pgsql_get_current_wal_lsn(&pgsql, currentLSN, maxLSNSize);
+
+	pgsql_finish(&pgsql);
+
+	return success;
+}
+
+
+/*
+ * standby_get_primary_buffer_ranges connects to our primary and fetches the
+ * ranges of blocks that it has in shared_buffers, see
+ * pgsql_get_buffer_ranges.
+ */
+bool
+standby_get_primary_buffer_ranges(LocalPostgresServer *postgres,
+								  ReplicationSource *replicationSource,
+								  char **ranges)
+{
+	PGSQL pgsql = { 0 };
+	bool success = false;
+
+	if (!standby_init_primary_connection(&(postgres->postgresSetup),
+										 replicationSource, &pgsql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	success = pgsql_get_buffer_ranges(&pgsql, PREWARM_RANGE_BLOCKS, ranges);
+
+	pgsql_finish(&pgsql);
+
+	return success;
+}
+
+
+/*
+ * standby_set_catchup_profile applies the catch-up settings to the local
+ * standby when enable is true, and otherwise resets them to the values of
+ * the configuration files, using ALTER SYSTEM and a reload.
+ */
+bool
+standby_set_catchup_profile(LocalPostgresServer *postgres, bool enable)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+
+	log_info("%s the catch-up settings of the standby",
+			 enable ? "Applying" : "Reverting");
+
+	return pgsql_alter_system_settings(pgsql, catchup_settings, !enable);
+}
+
+
+/*
+ * standby_update_coordinator_metadata connects to the coordinator of our
+ * Citus worker group and points its metadata at our newly promoted node
+ * rather than at the old primary, so that distributed queries are routed to
+ * us. The whole update, including the wait for the queries that still use
+ * the old primary, is bounded by CITUS_COORDINATOR_UPDATE_TIMEOUT_MS.
+ */
+bool
+standby_update_coordinator_metadata(LocalPostgresServer *postgres,
+									NodeAddress *coordinatorNode,
+									NodeAddress *oldPrimaryNode,
+									NodeAddress *newPrimaryNode)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	PGSQL pgsql = { 0 };
+	char connInfo[MAXCONNINFO] = { 0 };
+	char *connInfoEnd = connInfo;
+	char options[BUFSIZE];
+	bool success = false;
+
+	snprintf(options, BUFSIZE, "-c statement_timeout=%d",
+			 CITUS_COORDINATOR_UPDATE_TIMEOUT_MS);
+
+	connInfoEnd += make_conninfo_field_str(connInfoEnd, "host",
+										   coordinatorNode->host);
+	connInfoEnd += make_conninfo_field_int(connInfoEnd, "port",
+										   coordinatorNode->port);
+	connInfoEnd += make_conninfo_field_str(connInfoEnd, "user",
+										   pg_setup_get_username(pgSetup));
+	connInfoEnd += make_conninfo_field_str(connInfoEnd, "dbname",
+										   pgSetup->dbname);
+	connInfoEnd += make_conninfo_field_str(connInfoEnd, "options", options);
+
+	if (!pgsql_init(&pgsql, connInfo))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	pgsql.connectTimeoutMs = CITUS_COORDINATOR_CONNECT_TIMEOUT_MS;
+
+	log_info("Updating the metadata of coordinator %s:%d: "
+			 "worker %s:%d is now %s:%d",
+			 coordinatorNode->host, coordinatorNode->port,
+			 oldPrimaryNode->host, oldPrimaryNode->port,
+			 newPrimaryNode->host, newPrimaryNode->port);
+
+	success = pgsql_update_worker_node(&pgsql, oldPrimaryNode, newPrimaryNode,
+									   CITUS_UPDATE_NODE_LOCK_COOLDOWN_MS);
+
+	pgsql_finish(&pgsql);
+
+	return success;
+}
+
+
+/*
+ * standby_wait_for_catchup waits until the local standby has received and
+ * replayed the WAL up to targetLSN, polling every few milliseconds, and for
+ * at most timeoutMs. When targetLSN is empty, we wait until the standby has
+ * replayed all the WAL that it received.
+ *
+ * Reaching the timeout is not an error: the promotion then replays what's
+ * left to replay.
+ */
+bool
+standby_wait_for_catchup(LocalPostgresServer *postgres,
+						 const char *targetLSN, int timeoutMs)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	char receivedLSN[PG_LSN_MAXLENGTH] = { 0 };
+	char replayedLSN[PG_LSN_MAXLENGTH] = { 0 };
+	instr_time startTime;
+	bool hasTarget = !IS_EMPTY_STRING_BUFFER(targetLSN);
+	uint64_t target = 0;
+
+	if (hasTarget && !parse_lsn(targetLSN, &target))
+	{
+		log_error("Failed to parse LSN \"%s\"", targetLSN);
+		return false;
+	}
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	for (;;)
+	{
+		instr_time elapsed;
+		uint64_t received = 0;
+		uint64_t replayed = 0;
+		bool hasReceived = false;
+		bool hasReplayed = false;
+
+		if (!pgsql_get_received_and_replayed_lsn(pgsql,
+												 receivedLSN, replayedLSN,
+												 PG_LSN_MAXLENGTH))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		hasReceived = parse_lsn(receivedLSN, &received);
+		hasReplayed = parse_lsn(replayedLSN, &replayed);
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, startTime);
+
+		if (hasTarget
+			? (hasReceived && hasReplayed
+			   && received >= target && replayed >= target)
+			: (!hasReceived || (hasReplayed && replayed >= received)))
+		{
+			log_info("Standby caught up at %s in %.0f ms",
+					 replayedLSN, INSTR_TIME_GET_MILLISEC(elapsed));
+			return true;
+		}
+
+		if (INSTR_TIME_GET_MILLISEC(elapsed) >= timeoutMs)
+		{
+			log_warn("Standby failed to catch up with %s in %d ms: received "
+					 "%s and replayed %s, promoting anyway",
+					 hasTarget ? targetLSN : receivedLSN, timeoutMs,
+					 receivedLSN, replayedLSN);
+			return true;
+		}
+
+		if (asked_to_stop || asked_to_stop_fast)
+		{
+			return false;
+		}
+
+		pg_usleep(PREPARE_PROMOTION_CATCHUP_POLL_TIME_MS * 1000);
+	}
+}
+
+
+/*
+ * standby_follow_upstream points a running standby to another upstream node,
+ * without re-seeding it: the new upstream must be on the same timeline, as is
+ * the case when the monitor reassigns the node to follow. Postgres 13 reloads
+ * primary_conninfo, previous versions need a restart.
+ */
+bool
+standby_follow_upstream(LocalPostgresServer *postgres,
+						ReplicationSource *replicationSource)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	NodeAddress *upstreamNode = &(replicationSource->primaryNode);
+	char configFilePath[MAXPGPATH];
+
+	log_trace("standby_follow_upstream");
+
+	if (!pgsql_get_config_file_path(pgsql, configFilePath, MAXPGPATH))
+	{
+		log_error("Failed to get the postgresql.conf path from the "
+				  "local postgres server, see above for details");
+		return false;
+	}
+
+	if (!pg_setup_standby_mode(pgSetup->control.pg_control_version,
+							   configFilePath,
+							   pgSetup->pgdata,
+							   replicationSource))
+	{
+		log_error("Failed to setup Postgres to follow %s:%d",
+				  upstreamNode->host, upstreamNode->port);
+		return false;
+	}
+
+	if (pgSetup->control.pg_control_version >= 1300)
+	{
+		if (!pgsql_reload_conf(pgsql))
+		{
+			log_error("Failed to reload Postgres to follow %s:%d",
+					  upstreamNode->host, upstreamNode->port);
+			return false;
+		}
+	}
+	else
+	{
+		/* the connection is going away with the restart */
+		pgsql_finish(pgsql);
+
+		if (!pg_ctl_restart(pgSetup->pg_ctl, pgSetup->pgdata))
+		{
+			log_error("Failed to restart Postgres to follow %s:%d",
+					  upstreamNode->host, upstreamNode->port);
+			return false;
+		}
+	}
+
+	log_info("Postgres now follows %s:%d",
+			 upstreamNode->host, upstreamNode->port);
+
+	(void) standby_set_upstream(postgres, replicationSource);
+
+	return true;
+}
+
+
+/*
+ * standby_set_upstream records the node that we just set up Postgres to
+ * follow in the replication state. The WAL receiver only shows it once it
+ * connected, and until then we would still show the node we followed before,
+ * such as the old primary after a failover, see liveness_set_replication.
+ */
+static void
+standby_set_upstream(LocalPostgresServer *postgres,
+					 ReplicationSource *replicationSource)
+{
+	PostgresReplicationState *replicationState = &(postgres->replicationState);
+	const char *applicationName = replicationSource->applicationName;
+
+	strlcpy(replicationState->upstreamHost,
+			replicationSource->primaryNode.host, _POSIX_HOST_NAME_MAX);
+	replicationState->upstreamPort = replicationSource->primaryNode.port;
+	strlcpy(replicationState->upstreamApplicationName,
+			applicationName == NULL ? "" : applicationName, NAMEDATALEN);
+}
+
+
+/*
+ * standby_promote promotes a standby postgres server to primary.
+ */
+bool
+standby_promote(LocalPostgresServer *postgres)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	bool inRecovery = false;
+
+	log_trace("standby_promote");
+
+	if (!pgsql_is_in_recovery(pgsql, &inRecovery))
+	{
+		log_error("Failed to promote standby: couldn't determine whether postgres "
+				  "is in recovery mode");
+		return false;
+	}
+
+	if (!inRecovery)
+	{
+		log_info("Skipping promotion: postgres is not in recovery mode");
+
+		/* we might have been promoted in a previous run */
+		postgres->promotionCheckpointPending = true;
+
+		return true;
+	}
+	/* disconnect from PostgreSQL now */
+	pgsql_finish(pgsql);
+
+	log_info("Promoting postgres");
+
+	if (!pg_ctl_promote(pgSetup->pg_ctl, pgSetup->pgdata))
+	{
+		log_error("Failed to promote standby: see pg_ctl promote errors above");
+		return false;
 	}
 
 	if (!pgsql_is_in_recovery(pgsql, &inRecovery))
@@ -658,24 +1422,240 @@ standby_promote(LocalPostgresServer *postgres)
 	}
 
 	/*
-	 * It's necessary to do a checkpoint before allowing the old primary to rewind,
-	 * since there can be a race condition in which pg_rewind detects no change in
-	 * timeline in the pg_control file, but a checkpoint is already in progress
-	 * causing the timelines to diverge before replication starts.
+	 * Postgres requests a spread checkpoint at the end of a promotion, and we
+	 * don't wait for it: the new primary is available to clients as soon as
+	 * it's out of recovery. The old primary must not rewind before that
+	 * checkpoint is done though, see standby_ensure_primary_checkpoint, and
+	 * we track its completion in primary_check_promotion_checkpoint.
 	 */
-	if (!pgsql_checkpoint(pgsql))
+	postgres->promotionCheckpointPending = true;
+
+	/* disconnect from PostgreSQL now */
+	pgsql_finish(pgsql);
+
+	return true;
+}
+
+
+/*
+ * primary_check_promotion_checkpoint checks whether the checkpoint that
+ * Postgres runs after a promotion is done yet, and logs about it when that's
+ * the case. It's called at each keeper loop until then.
+ */
+bool
+primary_check_promotion_checkpoint(LocalPostgresServer *postgres)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	bool onCurrentTimeline = false;
+
+	if (!postgres->promotionCheckpointPending)
 	{
-		log_error("Failed to checkpoint after promotion");
+		return true;
+	}
+
+	if (!pgsql_checkpoint_is_on_current_timeline(pgsql, &onCurrentTimeline))
+	{
+		/* errors have already been logged */
 		return false;
 	}
 
-	/* disconnect from PostgreSQL now */
-	pgsql_finish(pgsql);
+	if (onCurrentTimeline)
+	{
+		log_info("The checkpoint following the promotion is done");
+		postgres->promotionCheckpointPending = false;
+	}
+
+	return true;
+}
+
+
+/*
+ * standby_maintain_replication_slot maintains on a standby the same physical
+ * replication slot as the one its primary has for it, and advances it to the
+ * LSN the standby has replayed. When the standby is promoted, the slot then
+ * retains the WAL that the former primary needs to stream from us, rather
+ * than having to be rebuilt. It's called at each keeper loop.
+ *
+ * Advancing a slot requires Postgres 11, so with Postgres 10 we don't create
+ * the slot, otherwise it would retain WAL forever.
+ */
+bool
+standby_maintain_replication_slot(LocalPostgresServer *postgres,
+								  const char *replicationSlotName)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+
+	if (pgSetup->control.pg_control_version < 1100)
+	{
+		return true;
+	}
+
+	if (!pgsql_create_replication_slot_if_missing(pgsql, replicationSlotName))
+	{
+		log_warn("Failed to create replication slot \"%s\" on the standby",
+				 replicationSlotName);
+		return false;
+	}
+
+	if (!pgsql_advance_replication_slot(pgsql, replicationSlotName))
+	{
+		log_warn("Failed to advance replication slot \"%s\" on the standby",
+				 replicationSlotName);
+		return false;
+	}
 
 	return true;
 }
 
 
+/*
+ * primary_advance_replication_slot advances the replication slot of a standby
+ * that doesn't stream from us to the LSN that the standby last reported, such
+ * as a standby that streams from another standby of its zone. The slot then
+ * only retains the WAL that the standby needs if it streams from us again.
+ */
+bool
+primary_advance_replication_slot(LocalPostgresServer *postgres,
+								 const char *replicationSlotName,
+								 const char *lsn)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+
+	if (pgSetup->control.pg_control_version < 1100 ||
+		strcmp(lsn, "0/0") == 0)
+	{
+		return true;
+	}
+
+	if (!pgsql_advance_replication_slot_to_lsn(pgsql, replicationSlotName, lsn))
+	{
+		log_warn("Failed to advance replication slot \"%s\" to %s",
+				 replicationSlotName, lsn);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * primary_set_read_only makes the local primary strictly read-only while it
+ * keeps serving reads from its cache: new transactions are read-only, and we
+ * terminate the sessions that are in the middle of a write transaction.
+ *
+ * We keep synchronous replication as it is, so that a write that would still
+ * slip through, in a transaction that was already read-write, waits for a
+ * standby rather than committing on this node only.
+ */
+bool
+primary_set_read_only(LocalPostgresServer *postgres)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	int terminatedCount = 0;
+
+	if (!pgsql_set_default_transaction_mode_read_only(pgsql))
+	{
+		log_error("Failed to switch to read-only mode");
+		return false;
+	}
+
+	if (!pgsql_terminate_write_sessions(pgsql, &terminatedCount))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Postgres is now read-only, terminated %d session%s with "
+			 "a write transaction in progress",
+			 terminatedCount, terminatedCount == 1 ? "" : "s");
+
+	return true;
+}
+
+
+/*
+ * primary_drain_writes is used when a primary is asked to drain in a planned
+ * switchover. We set the primary read-only so that new transactions can't
+ * write anymore, then wait until the standby that uses our replication slot
+ * has replayed all our WAL, polling every few milliseconds and for at most
+ * timeoutMs, so that the primary can be stopped right away and the standby
+ * promoted without anything left to replay.
+ *
+ * Reaching the timeout, or not having a standby connected, is not an error:
+ * then we stop as usual, and Postgres sends the WAL that's left to the
+ * standby at shutdown.
+ */
+bool
+primary_drain_writes(LocalPostgresServer *postgres,
+					 const char *replicationSlotName, int timeoutMs)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	char currentLSN[PG_LSN_MAXLENGTH] = { 0 };
+	char standbyLSN[PG_LSN_MAXLENGTH] = { 0 };
+	instr_time startTime;
+
+	if (!pgsql_set_default_transaction_mode_read_only(pgsql))
+	{
+		log_error("Failed to switch to read-only mode");
+		return false;
+	}
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	for (;;)
+	{
+		instr_time elapsed;
+		uint64_t current = 0;
+		uint64_t standby = 0;
+
+		if (!pgsql_get_current_and_standby_replay_lsn(pgsql,
+													  replicationSlotName,
+													  currentLSN, standbyLSN,
+													  PG_LSN_MAXLENGTH))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (IS_EMPTY_STRING_BUFFER(standbyLSN))
+		{
+			log_warn("No standby is using replication slot \"%s\", "
+					 "stopping without waiting", replicationSlotName);
+			return true;
+		}
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, startTime);
+
+		if (parse_lsn(currentLSN, &current) &&
+			parse_lsn(standbyLSN, &standby) &&
+			standby >= current)
+		{
+			log_info("Standby replayed up to the current LSN %s in %.0f ms",
+					 currentLSN, INSTR_TIME_GET_MILLISEC(elapsed));
+			return true;
+		}
+
+		if (INSTR_TIME_GET_MILLISEC(elapsed) >= timeoutMs)
+		{
+			log_warn("Standby failed to replay up to the current LSN %s "
+					 "in %d ms, replayed \"%s\", stopping anyway",
+					 currentLSN, timeoutMs, standbyLSN);
+			return true;
+		}
+
+		if (asked_to_stop || asked_to_stop_fast)
+		{
+			return false;
+		}
+
+		pg_usleep(PREPARE_PROMOTION_CATCHUP_POLL_TIME_MS * 1000);
+	}
+}
+
+
 /*
  * check_postgresql_settings returns true when our minimal set of PostgreSQL
  * settings are correctly setup on the target server.
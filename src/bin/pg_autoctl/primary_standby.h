@@ -31,9 +31,11 @@ typedef struct LocalPostgresServer
 	bool			pgIsRunning;
 	char			pgsrSyncState[PGSR_SYNC_STATE_MAXLENGTH];
 	char            currentLSN[PG_LSN_MAXLENGTH];
+	PostgresReplicationState replicationState;
 	uint64_t		pgFirstStartFailureTs;
 	int				pgStartRetries;
 	PgInstanceKind	pgKind;
+	bool			promotionCheckpointPending;
 } LocalPostgresServer;
 
 
@@ -45,11 +47,21 @@ bool primary_has_replica(LocalPostgresServer *postgres, char *userName,
 						 bool *hasStandby);
 bool primary_create_replication_slot(LocalPostgresServer *postgres,
 									 char *replicationSlotName);
+bool primary_ensure_replication_slot(LocalPostgresServer *postgres,
+									 char *replicationSlotName);
 bool primary_drop_replication_slot(LocalPostgresServer *postgres,
 								   char *replicationSlotName);
-bool primary_enable_synchronous_replication(LocalPostgresServer *postgres);
+bool primary_drop_stale_replication_slots(LocalPostgresServer *postgres,
+										  char *replicationSlotName,
+										  const char *slotNames);
+bool primary_enable_synchronous_replication(LocalPostgresServer *postgres,
+										   const char *standbyNames,
+										   const char *synchronousCommit);
 bool primary_disable_synchronous_replication(LocalPostgresServer *postgres);
 bool postgres_add_default_settings(LocalPostgresServer *postgres);
+bool postgres_add_default_settings_to_file(LocalPostgresServer *postgres,
+										   char *configFilePath);
+bool postgres_apply_default_settings(LocalPostgresServer *postgres);
 bool primary_create_user_with_hba(LocalPostgresServer *postgres, char *userName,
 								  char *password, char *hostname, char *authMethod);
 bool primary_create_replication_user(LocalPostgresServer *postgres,
@@ -59,8 +71,34 @@ bool primary_add_standby_to_hba(LocalPostgresServer *postgres,
 								char *standbyHost, const char *replicationPassword);
 bool primary_rewind_to_standby(LocalPostgresServer *postgres,
 							   ReplicationSource *replicationSource);
+bool primary_check_promotion_checkpoint(LocalPostgresServer *postgres);
+bool primary_set_read_only(LocalPostgresServer *postgres);
+bool primary_drain_writes(LocalPostgresServer *postgres,
+						  const char *replicationSlotName, int timeoutMs);
+bool standby_get_primary_current_lsn(LocalPostgresServer *postgres,
+									 ReplicationSource *replicationSource,
+									 char *currentLSN, int maxLSNSize);
+bool standby_get_primary_buffer_ranges(LocalPostgresServer *postgres,
+									   ReplicationSource *replicationSource,
+									   char **ranges);
+bool standby_set_catchup_profile(LocalPostgresServer *postgres, bool enable);
+bool standby_update_coordinator_metadata(LocalPostgresServer *postgres,
+										 NodeAddress *coordinatorNode,
+										 NodeAddress *oldPrimaryNode,
+										 NodeAddress *newPrimaryNode);
+bool standby_maintain_replication_slot(LocalPostgresServer *postgres,
+									   const char *replicationSlotName);
+bool primary_advance_replication_slot(LocalPostgresServer *postgres,
+									  const char *replicationSlotName,
+									  const char *lsn);
+bool standby_wait_for_catchup(LocalPostgresServer *postgres,
+							  const char *targetLSN, int timeoutMs);
+bool standby_delta_reseed(LocalPostgresServer *postgres,
+						  ReplicationSource *replicationSource);
 bool standby_init_database(LocalPostgresServer *postgres,
 						   ReplicationSource *replicationSource);
+bool standby_follow_upstream(LocalPostgresServer *postgres,
+							 ReplicationSource *replicationSource);
 bool standby_promote(LocalPostgresServer *postgres);
 bool check_postgresql_settings(LocalPostgresServer *postgres,
 							   bool *settings_are_ok);
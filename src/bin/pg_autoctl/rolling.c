@@ -0,0 +1,447 @@
+/*
+ * src/bin/pg_autoctl/rolling.c
+ *   Drive a rolling operation of the monitor over the groups of a formation.
+ *
+ * The monitor keeps the state of the operation, and starts the operation on
+ * its pending groups in pgautofailover.rolling_operation_step, as long as
+ * fewer than max_parallel groups are in progress. We LISTEN to the state
+ * changes of the monitor, and call that function again each time a node
+ * changes state, so that the next groups start as soon as previous ones
+ * converged.
+ *
+ * With a rolling maintenance, the monitor puts the secondary node of each
+ * group in maintenance, and we then run the given command for that node.
+ * When the command succeeds, we have the node leave the maintenance state.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "libpq-fe.h"
+
+#include "defaults.h"
+#include "log.h"
+#include "parsing.h"
+#include "rolling.h"
+#include "signals.h"
+
+static bool rolling_step(RollingContext *context, bool *done);
+static bool rolling_start_command(RollingContext *context, int groupIndex);
+static void rolling_collect_commands(RollingContext *context);
+static int rolling_running_commands(RollingContext *context);
+static bool rolling_wait(RollingContext *context);
+static bool rolling_report(RollingContext *context);
+
+
+/*
+ * rolling_run starts the rolling operation, unless we follow one that has
+ * been started already, and then advances it until all of its groups are
+ * done, or one of them failed.
+ */
+bool
+rolling_run(RollingContext *context)
+{
+	PGSQL *pgsql = &(context->monitor.pgsql);
+	char *channels[] = { "state", NULL };
+	bool done = false;
+
+	(void) set_signal_handlers();
+
+	/* we LISTEN on that connection, don't let it be closed in between */
+	pgsql->keepConnection = true;
+
+	if (!pgsql_listen(pgsql, channels))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (context->operationId == 0)
+	{
+		if (!monitor_rolling_operation(&(context->monitor),
+									   context->formation,
+									   context->operation,
+									   context->maxParallel,
+									   &(context->operationId)))
+		{
+			/* errors have already been logged */
+			pgsql_finish(pgsql);
+			return false;
+		}
+
+		log_info("Started rolling %s %" PRId64 " of formation \"%s\", "
+				 "%d group(s) at a time",
+				 context->operation, context->operationId,
+				 context->formation, context->maxParallel);
+	}
+	else
+	{
+		log_info("Following rolling operation %" PRId64,
+				 context->operationId);
+	}
+
+	while (!done)
+	{
+		if (asked_to_stop || asked_to_stop_fast)
+		{
+			log_warn("Stopping: the groups in progress keep converging, and "
+					 "no other group is started until `pg_autoctl rolling "
+					 "--resume %" PRId64 "`", context->operationId);
+			pgsql_finish(pgsql);
+			return false;
+		}
+
+		if (!rolling_step(context, &done))
+		{
+			/* errors have already been logged */
+			pgsql_finish(pgsql);
+			return false;
+		}
+
+		if (context->commandFailed && rolling_running_commands(context) == 0)
+		{
+			log_error("Stopping rolling operation %" PRId64 " because the "
+					  "maintenance command failed, see above for details",
+					  context->operationId);
+			pgsql_finish(pgsql);
+			return false;
+		}
+
+		if (!done && !rolling_wait(context))
+		{
+			/* errors have already been logged */
+			pgsql_finish(pgsql);
+			return false;
+		}
+	}
+
+	pgsql_finish(pgsql);
+
+	return rolling_report(context);
+}
+
+
+/*
+ * rolling_step advances the operation on the monitor, logs the groups that
+ * changed state, and takes care of the groups that are in maintenance. done
+ * is set when the operation is over.
+ */
+static bool
+rolling_step(RollingContext *context, bool *done)
+{
+	static MonitorRollingGroup groups[ROLLING_MAX_GROUPS];
+	int groupCount = 0;
+	int inFlight = 0;
+	int pending = 0;
+	int failed = 0;
+
+	rolling_collect_commands(context);
+
+	if (!monitor_rolling_operation_step(&(context->monitor),
+										context->operationId,
+										groups, ROLLING_MAX_GROUPS,
+										&groupCount))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int groupIndex = 0; groupIndex < groupCount; groupIndex++)
+	{
+		MonitorRollingGroup *group = &(groups[groupIndex]);
+		MonitorRollingGroup *previous =
+			groupIndex < context->groupCount
+			? &(context->groups[groupIndex])
+			: NULL;
+
+		if (previous == NULL || strcmp(previous->state, group->state) != 0)
+		{
+			if (strcmp(group->state, "failed") == 0)
+			{
+				log_error("Group %d: failed: %s",
+						  group->groupId, group->detail);
+			}
+			else if (group->nodePort > 0)
+			{
+				log_info("Group %d: %s, node %s:%d",
+						 group->groupId, group->state,
+						 group->nodeName, group->nodePort);
+			}
+			else
+			{
+				log_info("Group %d: %s", group->groupId, group->state);
+			}
+		}
+
+		if (strcmp(group->state, "pending") == 0)
+		{
+			++pending;
+		}
+		else if (strcmp(group->state, "failed") == 0)
+		{
+			++failed;
+		}
+		else if (strcmp(group->state, "done") != 0)
+		{
+			++inFlight;
+		}
+	}
+
+	memcpy(context->groups, groups, groupCount * sizeof(MonitorRollingGroup));
+	context->groupCount = groupCount;
+
+	/* run the maintenance command of the nodes that are in maintenance */
+	for (int groupIndex = 0; groupIndex < groupCount; groupIndex++)
+	{
+		if (strcmp(groups[groupIndex].state, "ready") == 0 &&
+			context->commandPids[groupIndex] == 0 &&
+			!context->commandFailed)
+		{
+			if (IS_EMPTY_STRING_BUFFER(context->command))
+			{
+				log_error("Node %s:%d of group %d is in maintenance, "
+						  "and no --command has been given",
+						  groups[groupIndex].nodeName,
+						  groups[groupIndex].nodePort,
+						  groups[groupIndex].groupId);
+				context->commandFailed = true;
+			}
+			else if (!rolling_start_command(context, groupIndex))
+			{
+				/* errors have already been logged */
+				context->commandFailed = true;
+			}
+		}
+	}
+
+	*done = inFlight == 0 && (pending == 0 || failed > 0);
+
+	return true;
+}
+
+
+/*
+ * rolling_start_command runs the maintenance command for the node of the
+ * given group, with the node in its environment.
+ */
+static bool
+rolling_start_command(RollingContext *context, int groupIndex)
+{
+	MonitorRollingGroup *group = &(context->groups[groupIndex]);
+	IntString groupId = intToString(group->groupId);
+	IntString nodePort = intToString(group->nodePort);
+	char operationId[BUFSIZE];
+	pid_t pid;
+
+	snprintf(operationId, BUFSIZE, "%" PRId64, context->operationId);
+
+	setenv("PG_AUTOCTL_ROLLING_OPERATION", operationId, 1);
+	setenv("PG_AUTOCTL_FORMATION", context->formation, 1);
+	setenv("PG_AUTOCTL_GROUP", groupId.strValue, 1);
+	setenv("PG_AUTOCTL_NODE_HOST", group->nodeName, 1);
+	setenv("PG_AUTOCTL_NODE_PORT", nodePort.strValue, 1);
+
+	fflush(stdout);
+	fflush(stderr);
+
+	pid = fork();
+
+	switch (pid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the maintenance command of "
+					  "node %s:%d: %s",
+					  group->nodeName, group->nodePort, strerror(errno));
+			return false;
+		}
+
+		case 0:
+		{
+			/* fork succeeded, in child */
+			execl("/bin/sh", "sh", "-c", context->command, (char *) NULL);
+
+			/* only reached when execl failed */
+			fprintf(stderr, "Failed to run /bin/sh: %s\n", strerror(errno));
+			_exit(127);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			log_info("Running the maintenance command of node %s:%d "
+					 "in group %d, pid %d",
+					 group->nodeName, group->nodePort, group->groupId, pid);
+
+			context->commandPids[groupIndex] = pid;
+			return true;
+		}
+	}
+}
+
+
+/*
+ * rolling_collect_commands reaps the maintenance commands that are done, and
+ * has their node leave the maintenance state when they succeeded. The pid of
+ * a command that is done is set to -1, so that it doesn't run again.
+ */
+static void
+rolling_collect_commands(RollingContext *context)
+{
+	for (int groupIndex = 0; groupIndex < context->groupCount; groupIndex++)
+	{
+		MonitorRollingGroup *group = &(context->groups[groupIndex]);
+		pid_t pid = context->commandPids[groupIndex];
+		int status = 0;
+
+		if (pid <= 0 || waitpid(pid, &status, WNOHANG) != pid)
+		{
+			continue;
+		}
+
+		context->commandPids[groupIndex] = -1;
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			log_error("The maintenance command of node %s:%d failed, "
+					  "the node is still in maintenance",
+					  group->nodeName, group->nodePort);
+			log_info("HINT: use `pg_autoctl disable maintenance` on that "
+					 "node once it has been taken care of");
+			context->commandFailed = true;
+			continue;
+		}
+
+		if (!monitor_rolling_operation_release(&(context->monitor),
+											   context->operationId,
+											   group->groupId))
+		{
+			/* errors have already been logged */
+			context->commandFailed = true;
+		}
+	}
+}
+
+
+/*
+ * rolling_running_commands returns how many maintenance commands are still
+ * running, and reaps the ones that are done.
+ */
+static int
+rolling_running_commands(RollingContext *context)
+{
+	int running = 0;
+
+	rolling_collect_commands(context);
+
+	for (int groupIndex = 0; groupIndex < context->groupCount; groupIndex++)
+	{
+		if (context->commandPids[groupIndex] > 0)
+		{
+			++running;
+		}
+	}
+
+	return running;
+}
+
+
+/*
+ * rolling_wait waits until the monitor notifies a state change, or for
+ * ROLLING_STEP_INTERVAL_MS, so that we also notice the maintenance commands
+ * that are done.
+ */
+static bool
+rolling_wait(RollingContext *context)
+{
+	PGconn *connection = context->monitor.pgsql.connection;
+	struct pollfd pollFd = { 0 };
+	PGnotify *notify = NULL;
+
+	pollFd.fd = PQsocket(connection);
+	pollFd.events = POLLIN;
+
+	if (poll(&pollFd, 1, ROLLING_STEP_INTERVAL_MS) < 0)
+	{
+		if (errno == EINTR)
+		{
+			return true;
+		}
+
+		log_error("Failed to wait for notifications: %s", strerror(errno));
+		return false;
+	}
+
+	if (pollFd.revents == 0)
+	{
+		return true;
+	}
+
+	if (!PQconsumeInput(connection))
+	{
+		log_error("Lost connection to the monitor: %s",
+				  PQerrorMessage(connection));
+		log_info("HINT: use `pg_autoctl rolling --resume %" PRId64 "` to "
+				 "follow the operation again", context->operationId);
+		return false;
+	}
+
+	/* any state change may have a group converge, we just step again */
+	while ((notify = PQnotifies(connection)) != NULL)
+	{
+		log_debug("received \"%s\"", notify->extra);
+		PQfreemem(notify);
+	}
+
+	return true;
+}
+
+
+/*
+ * rolling_report logs a summary of the operation, and returns false when
+ * some of its groups failed.
+ */
+static bool
+rolling_report(RollingContext *context)
+{
+	int doneCount = 0;
+	int failedCount = 0;
+
+	for (int groupIndex = 0; groupIndex < context->groupCount; groupIndex++)
+	{
+		if (strcmp(context->groups[groupIndex].state, "done") == 0)
+		{
+			++doneCount;
+		}
+		else if (strcmp(context->groups[groupIndex].state, "failed") == 0)
+		{
+			++failedCount;
+		}
+	}
+
+	if (failedCount > 0)
+	{
+		log_error("Rolling operation %" PRId64 " stopped after %d group(s) "
+				  "out of %d, %d group(s) failed",
+				  context->operationId, doneCount, context->groupCount,
+				  failedCount);
+		return false;
+	}
+
+	log_info("Rolling operation %" PRId64 " is done with its %d group(s)",
+			 context->operationId, doneCount);
+
+	return true;
+}
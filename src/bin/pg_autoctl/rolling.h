@@ -0,0 +1,48 @@
+/*
+ * src/bin/pg_autoctl/rolling.h
+ *   Drive a rolling operation of the monitor over the groups of a formation,
+ *   advancing it as the monitor notifies the state changes of its nodes.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef ROLLING_H
+#define ROLLING_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "monitor.h"
+
+/* maximum number of groups of a rolling operation that we follow */
+#define ROLLING_MAX_GROUPS 512
+
+/* we advance the operation at least that often, even without notifications */
+#define ROLLING_STEP_INTERVAL_MS 1000
+
+typedef struct RollingContext
+{
+	Monitor monitor;
+	char formation[NAMEDATALEN];
+	char operation[NAMEDATALEN];
+	int maxParallel;
+
+	/* set to follow an operation that has been started already */
+	int64_t operationId;
+
+	/* shell command to run on each node of a rolling maintenance */
+	char command[BUFSIZE];
+
+	MonitorRollingGroup groups[ROLLING_MAX_GROUPS];
+	int groupCount;
+
+	/* the pid of the command running for each group, or 0 */
+	pid_t commandPids[ROLLING_MAX_GROUPS];
+	bool commandFailed;
+} RollingContext;
+
+bool rolling_run(RollingContext *context);
+
+#endif /* ROLLING_H */
@@ -0,0 +1,256 @@
+/*
+ * src/bin/pg_autoctl/route.c
+ *   Update the routing of the clients, by running a hook or rewriting the
+ *   configuration of a connection pooler, when a group has a new primary.
+ *
+ * The new primary is learnt from the notifications of the monitor, see
+ * watch_track_primary, so that the clients are routed to it as soon as it
+ * accepts writes, rather than when some cron job polls the monitor next.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "libpq-fe.h"
+
+#include "defaults.h"
+#include "file_utils.h"
+#include "log.h"
+#include "parsing.h"
+#include "route.h"
+
+
+static bool route_write_pooler_config(RouteContext *route,
+									  WatchPrimary *primary);
+static bool route_reload_pooler(RouteContext *route);
+static bool route_run_hook(RouteContext *route,
+						   WatchPrimary *previous, WatchPrimary *primary);
+
+
+/*
+ * route_primary_changed is the WatchPrimaryCB of pg_autoctl route. The
+ * pooler is updated first, as it's the fastest way to route the clients to
+ * the new primary, and then the hook runs.
+ */
+void
+route_primary_changed(void *ctx, WatchPrimary *previous, WatchPrimary *primary)
+{
+	RouteContext *route = (RouteContext *) ctx;
+
+	if (previous == NULL)
+	{
+		log_info("Primary of formation \"%s\" group %d is node %d \"%s:%d\"",
+				 primary->formation, primary->groupId,
+				 primary->nodeId, primary->nodeName, primary->nodePort);
+	}
+	else
+	{
+		log_info("Primary of formation \"%s\" group %d is now node %d \"%s:%d\", "
+				 "it was node %d \"%s:%d\"",
+				 primary->formation, primary->groupId,
+				 primary->nodeId, primary->nodeName, primary->nodePort,
+				 previous->nodeId, previous->nodeName, previous->nodePort);
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(route->poolerConfig))
+	{
+		if (route_write_pooler_config(route, primary) &&
+			!IS_EMPTY_STRING_BUFFER(route->poolerURI))
+		{
+			/* errors are logged, we keep routing the next changes */
+			(void) route_reload_pooler(route);
+		}
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(route->hookCommand))
+	{
+		/* errors are logged, we keep routing the next changes */
+		(void) route_run_hook(route, previous, primary);
+	}
+}
+
+
+/*
+ * route_write_pooler_config writes a pgbouncer [databases] section that
+ * routes the pooler database to the given primary. The file is meant to be
+ * included from the main pgbouncer configuration with %include, and is
+ * written in a temporary file first and then renamed, so that pgbouncer
+ * never reads a partial file.
+ */
+static bool
+route_write_pooler_config(RouteContext *route, WatchPrimary *primary)
+{
+	char tempFileName[MAXPGPATH];
+	char contents[BUFSIZE];
+	int length = 0;
+
+	snprintf(tempFileName, MAXPGPATH, "%s.new", route->poolerConfig);
+
+	length = snprintf(contents, BUFSIZE,
+					  "; written by pg_autoctl route for formation \"%s\" "
+					  "group %d, do not edit\n"
+					  "[databases]\n"
+					  "%s = host=%s port=%d\n",
+					  primary->formation, primary->groupId,
+					  route->poolerDatabase,
+					  primary->nodeName, primary->nodePort);
+
+	if (length >= BUFSIZE)
+	{
+		log_error("Failed to prepare the pooler configuration for \"%s:%d\"",
+				  primary->nodeName, primary->nodePort);
+		return false;
+	}
+
+	if (!write_file(contents, length, tempFileName))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (rename(tempFileName, route->poolerConfig) != 0)
+	{
+		log_error("Failed to rename \"%s\" to \"%s\": %s",
+				  tempFileName, route->poolerConfig, strerror(errno));
+		return false;
+	}
+
+	log_info("Routed the pooler database \"%s\" to \"%s:%d\" in \"%s\"",
+			 route->poolerDatabase, primary->nodeName, primary->nodePort,
+			 route->poolerConfig);
+
+	return true;
+}
+
+
+/*
+ * route_reload_pooler issues RELOAD on the pgbouncer admin console. The
+ * admin console only implements the simple query protocol, so we don't use
+ * pgsql_execute_with_params here.
+ */
+static bool
+route_reload_pooler(RouteContext *route)
+{
+	PGconn *connection = PQconnectdb(route->poolerURI);
+	PGresult *result = NULL;
+	bool success = false;
+
+	if (PQstatus(connection) != CONNECTION_OK)
+	{
+		log_error("Failed to connect to the pooler \"%s\": %s",
+				  route->poolerURI, PQerrorMessage(connection));
+		PQfinish(connection);
+		return false;
+	}
+
+	result = PQexec(connection, "RELOAD");
+	success = PQresultStatus(result) == PGRES_COMMAND_OK;
+
+	if (!success)
+	{
+		log_error("Failed to reload the pooler \"%s\": %s",
+				  route->poolerURI, PQerrorMessage(connection));
+	}
+	else
+	{
+		log_info("Reloaded the pooler \"%s\"", route->poolerURI);
+	}
+
+	PQclear(result);
+	PQfinish(connection);
+
+	return success;
+}
+
+
+/*
+ * route_run_hook runs the hook command with /bin/sh, and waits until it's
+ * done. The hook finds the new primary, and the previous one when we knew
+ * it, in its environment.
+ */
+static bool
+route_run_hook(RouteContext *route,
+			   WatchPrimary *previous, WatchPrimary *primary)
+{
+	IntString groupId = intToString(primary->groupId);
+	IntString nodeId = intToString(primary->nodeId);
+	IntString nodePort = intToString(primary->nodePort);
+	IntString previousNodeId = intToString(previous ? previous->nodeId : 0);
+	IntString previousNodePort = intToString(previous ? previous->nodePort : 0);
+	int status = 0;
+	pid_t pid;
+
+	setenv("PG_AUTOCTL_FORMATION", primary->formation, 1);
+	setenv("PG_AUTOCTL_GROUP", groupId.strValue, 1);
+	setenv("PG_AUTOCTL_PRIMARY_NODE_ID", nodeId.strValue, 1);
+	setenv("PG_AUTOCTL_PRIMARY_HOST", primary->nodeName, 1);
+	setenv("PG_AUTOCTL_PRIMARY_PORT", nodePort.strValue, 1);
+	setenv("PG_AUTOCTL_PREVIOUS_NODE_ID",
+		   previous ? previousNodeId.strValue : "", 1);
+	setenv("PG_AUTOCTL_PREVIOUS_HOST", previous ? previous->nodeName : "", 1);
+	setenv("PG_AUTOCTL_PREVIOUS_PORT",
+		   previous ? previousNodePort.strValue : "", 1);
+
+	fflush(stdout);
+	fflush(stderr);
+
+	pid = fork();
+
+	switch (pid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the hook process: %s", strerror(errno));
+			return false;
+		}
+
+		case 0:
+		{
+			/* fork succeeded, in child */
+			execl("/bin/sh", "sh", "-c", route->hookCommand, (char *) NULL);
+
+			/* only reached when execl failed */
+			fprintf(stderr, "Failed to run /bin/sh: %s\n", strerror(errno));
+			_exit(127);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			while (waitpid(pid, &status, 0) < 0)
+			{
+				if (errno != EINTR)
+				{
+					log_error("Failed to wait for the hook process %d: %s",
+							  pid, strerror(errno));
+					return false;
+				}
+			}
+			break;
+		}
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		log_error("Hook \"%s\" failed with %s %d",
+				  route->hookCommand,
+				  WIFEXITED(status) ? "exit code" : "signal",
+				  WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+		return false;
+	}
+
+	log_info("Hook \"%s\" routed the clients to \"%s:%d\"",
+			 route->hookCommand, primary->nodeName, primary->nodePort);
+
+	return true;
+}
@@ -0,0 +1,36 @@
+/*
+ * src/bin/pg_autoctl/route.h
+ *   Update the routing of the clients, by running a hook or rewriting the
+ *   configuration of a connection pooler, when a group has a new primary.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include <stdbool.h>
+
+#include "pgsql.h"
+#include "watch.h"
+
+/* the pooler database entry that routes all the databases to the primary */
+#define ROUTE_DEFAULT_POOLER_DATABASE "*"
+
+typedef struct RouteContext
+{
+	/* shell command to run, with the new primary in its environment */
+	char hookCommand[BUFSIZE];
+
+	/* pgbouncer [databases] file to rewrite, and its admin console */
+	char poolerConfig[MAXPGPATH];
+	char poolerURI[MAXCONNINFO];
+	char poolerDatabase[NAMEDATALEN];
+} RouteContext;
+
+void route_primary_changed(void *ctx,
+						   WatchPrimary *previous, WatchPrimary *primary);
+
+#endif /* ROUTE_H */
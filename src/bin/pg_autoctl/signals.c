@@ -7,6 +7,9 @@
  *
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,6 +24,26 @@ volatile sig_atomic_t asked_to_stop = 0;	  /* SIGTERM */
 volatile sig_atomic_t asked_to_stop_fast = 0; /* SIGINT */
 volatile sig_atomic_t asked_to_reload = 0;	  /* SIGHUP */
 
+/*
+ * Our signal handlers don't log anything: in asynchronous mode the logging
+ * functions take a mutex, and a signal received while the main thread holds
+ * it would then deadlock. The handlers set these flags instead, and
+ * log_received_signals logs from the main thread.
+ */
+static volatile sig_atomic_t received_sighup = 0;
+static volatile sig_atomic_t received_sigint = 0;
+static volatile sig_atomic_t received_sigterm = 0;
+
+/*
+ * Our signal handlers write a byte to this pipe, so that wait_for_signal can
+ * poll() it together with other file descriptors without missing a signal
+ * received right before calling poll().
+ */
+static int signalPipe[2] = { -1, -1 };
+
+static void set_signal_pipe(void);
+static void wakeup_signal_pipe(void);
+
 
 /*
  * set_signal_handlers sets our signal handlers for the 4 signals that we
@@ -29,6 +52,8 @@ volatile sig_atomic_t asked_to_reload = 0;	  /* SIGHUP */
 void
 set_signal_handlers()
 {
+	(void) set_signal_pipe();
+
 	/* Establish a handler for signals. */
 	signal (SIGHUP, catch_reload);
 	signal (SIGINT, catch_int);
@@ -43,7 +68,8 @@ void
 catch_reload(int sig)
 {
 	asked_to_reload = 1;
-	log_warn("Received signal %s", strsignal(sig));
+	received_sighup = 1;
+	wakeup_signal_pipe();
 	signal(sig, catch_reload);
 }
 
@@ -55,7 +81,8 @@ void
 catch_int(int sig)
 {
 	asked_to_stop_fast = 1;
-	log_warn("Fast shutdown: received signal %s", strsignal(sig));
+	received_sigint = 1;
+	wakeup_signal_pipe();
 	signal(sig, catch_int);
 }
 
@@ -67,18 +94,163 @@ void
 catch_term(int sig)
 {
 	asked_to_stop = 1;
-	log_warn("Smart shutdown: received signal %s", strsignal(sig));
+	received_sigterm = 1;
+	wakeup_signal_pipe();
 	signal(sig, catch_term);
 }
 
 
 /*
  * catch_quit receives the SIGQUIT signal.
+ *
+ * We exit right away, without the exit handlers that stop the logging
+ * thread, since they could deadlock as the logging functions would: our
+ * message then goes straight to stderr.
  */
 void
 catch_quit(int sig)
 {
+	const char *message = "Immediate shutdown: received signal SIGQUIT\n";
+	ssize_t written = write(STDERR_FILENO, message, strlen(message));
+
+	(void) written;
+
 	/* default signal handler disposition is to core dump, we don't */
-	log_warn("Immediate shutdown: received signal %s", strsignal(sig));
-	exit(EXIT_CODE_QUIT);
+	_exit(EXIT_CODE_QUIT);
+}
+
+
+/*
+ * log_received_signals logs the signals that our handlers received since the
+ * previous call. It's called from the main thread, when waiting for signals
+ * and in the main loops.
+ */
+void
+log_received_signals()
+{
+	if (received_sighup)
+	{
+		received_sighup = 0;
+		log_warn("Received signal %s", strsignal(SIGHUP));
+	}
+
+	if (received_sigint)
+	{
+		received_sigint = 0;
+		log_warn("Fast shutdown: received signal %s", strsignal(SIGINT));
+	}
+
+	if (received_sigterm)
+	{
+		received_sigterm = 0;
+		log_warn("Smart shutdown: received signal %s", strsignal(SIGTERM));
+	}
+}
+
+
+/*
+ * wait_for_signal waits until either timeoutMs milliseconds have passed, one
+ * of the signals we handle has been received, or the given file descriptor is
+ * readable. A negative fd is ignored, and a negative timeoutMs waits forever.
+ *
+ * Returns true when the file descriptor is readable.
+ */
+bool
+wait_for_signal(int fd, int timeoutMs)
+{
+	struct pollfd fds[2];
+	int nfds = 0;
+	int signalIndex = -1;
+	int fdIndex = -1;
+
+	if (signalPipe[0] >= 0)
+	{
+		signalIndex = nfds++;
+		fds[signalIndex].fd = signalPipe[0];
+		fds[signalIndex].events = POLLIN;
+		fds[signalIndex].revents = 0;
+	}
+
+	if (fd >= 0)
+	{
+		fdIndex = nfds++;
+		fds[fdIndex].fd = fd;
+		fds[fdIndex].events = POLLIN;
+		fds[fdIndex].revents = 0;
+	}
+
+	if (poll(fds, nfds, timeoutMs) < 0)
+	{
+		if (errno != EINTR)
+		{
+			log_warn("Failed to wait for signals: %s", strerror(errno));
+		}
+		(void) log_received_signals();
+		return false;
+	}
+
+	(void) log_received_signals();
+
+	if (signalIndex >= 0 && fds[signalIndex].revents != 0)
+	{
+		char buffer[16];
+
+		/* the pipe is non-blocking, empty it now that we've seen it */
+		while (read(signalPipe[0], buffer, sizeof(buffer)) > 0)
+		{
+		}
+	}
+
+	return fdIndex >= 0 && fds[fdIndex].revents != 0;
+}
+
+
+/*
+ * set_signal_pipe creates the non-blocking pipe used by our signal handlers to
+ * wake up wait_for_signal. When that fails we just don't use the pipe, and
+ * poll() gets interrupted by signals anyway, only with a small race window.
+ */
+static void
+set_signal_pipe()
+{
+	if (signalPipe[0] >= 0)
+	{
+		return;
+	}
+
+	if (pipe(signalPipe) != 0)
+	{
+		log_warn("Failed to create a pipe for signal handling: %s",
+				 strerror(errno));
+		signalPipe[0] = signalPipe[1] = -1;
+		return;
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		int flags = fcntl(signalPipe[i], F_GETFL);
+
+		(void) fcntl(signalPipe[i], F_SETFL, flags | O_NONBLOCK);
+		(void) fcntl(signalPipe[i], F_SETFD, FD_CLOEXEC);
+	}
+}
+
+
+/*
+ * wakeup_signal_pipe is called from our signal handlers.
+ */
+static void
+wakeup_signal_pipe()
+{
+	int save_errno = errno;
+
+	if (signalPipe[1] >= 0)
+	{
+		/* a full pipe already wakes the loop up, we can ignore failures */
+		ssize_t written = write(signalPipe[1], "x", 1);
+
+		(void) written;
+	}
+
+	errno = save_errno;
 }
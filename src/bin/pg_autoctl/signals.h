@@ -11,6 +11,8 @@
 #define SIGNALS_H
 
 #include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
 
 /* This flag controls termination of the main loop. */
 extern volatile sig_atomic_t asked_to_stop;		 /* SIGTERM */
@@ -24,5 +26,7 @@ void catch_reload(int sig);
 void catch_int(int sig);
 void catch_term(int sig);
 void catch_quit(int sig);
+void log_received_signals(void);
+bool wait_for_signal(int fd, int timeoutMs);
 
 #endif /* SIGNALS_H */
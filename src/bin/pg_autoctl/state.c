@@ -17,6 +17,7 @@
 
 #include "postgres_fe.h"
 #include "libpq-fe.h"
+#include "port/pg_crc32c.h"
 
 #include "defaults.h"
 #include "file_utils.h"
@@ -28,7 +29,49 @@
 #include "pgsql.h"
 #include "state.h"
 
+/*
+ * The contact timestamps of the keeper state change at every loop, so rather
+ * than fsync'ing a new state file each time, we keep them in a small sidecar
+ * file next to the state file, which we overwrite in place without fsync. The
+ * state file itself is only written again when one of its other fields
+ * changed. When the sidecar is missing or torn after a crash, we use the
+ * older values found in the state file.
+ */
+typedef struct KeeperStateContact
+{
+	int pg_autoctl_state_version;
+	uint64_t last_monitor_contact;
+	uint64_t last_secondary_contact;
+	int64_t xlog_lag;
+	pg_crc32c crc;
+} KeeperStateContact;
+
+/*
+ * We keep a copy of the state we last read from or wrote to each state file,
+ * so that pg_autoctl service supervise, which writes the state files of
+ * several keepers in turn, still only updates their contact files.
+ */
+typedef struct KeeperStateCache
+{
+	char filename[MAXPGPATH];
+	bool valid;
+	KeeperStateData state;
+	struct KeeperStateCache *next;
+} KeeperStateCache;
+
+static KeeperStateCache *stateCacheList = NULL;
+
 static bool keeper_state_is_readable(int pg_autoctl_state_version);
+static bool keeper_state_durable_fields_equal(KeeperStateData *a,
+											  KeeperStateData *b);
+static KeeperStateCache * keeper_state_cache_lookup(const char *filename);
+static void keeper_state_remember(KeeperStateData *keeperState,
+								  const char *filename);
+static pg_crc32c keeper_state_contact_crc(KeeperStateContact *contact);
+static bool keeper_state_write_contact(KeeperStateData *keeperState,
+									   const char *filename);
+static void keeper_state_read_contact(KeeperStateData *keeperState,
+									  const char *filename);
 
 
 /*
@@ -57,6 +100,10 @@ keeper_state_read(KeeperStateData *keeperState, const char *filename)
 	{
 		memcpy(keeperState, content, sizeof(KeeperStateData));
 		free(content);
+
+		keeper_state_remember(keeperState, filename);
+		keeper_state_read_contact(keeperState, filename);
+
 		return true;
 	}
 
@@ -85,6 +132,8 @@ keeper_state_is_readable(int pg_autoctl_state_version)
  * The KeeperState data structure contains only direct values (int, long), not
  * a single pointer, so writing to disk is a single fwrite() instruction.
  *
+ * When only the contact timestamps changed since we last read or wrote the
+ * file, we just update the sidecar contact file, see KeeperStateContact.
  */
 bool
 keeper_state_write(KeeperStateData *keeperState, const char *filename)
@@ -92,6 +141,20 @@ keeper_state_write(KeeperStateData *keeperState, const char *filename)
 	int fd;
 	char buffer[PG_AUTOCTL_KEEPER_STATE_FILE_SIZE];
 	char tempFileName[MAXPGPATH];
+	KeeperStateCache *cache = keeper_state_cache_lookup(filename);
+
+	if (cache != NULL
+		&& cache->valid
+		&& keeper_state_durable_fields_equal(keeperState, &(cache->state))
+		&& file_exists(filename))
+	{
+		if (keeper_state_write_contact(keeperState, filename))
+		{
+			return true;
+		}
+
+		/* fall back to writing the whole state file */
+	}
 
 	/* we're going to write our contents to keeper.state.new first */
 	sprintf(tempFileName, "%s.new", filename);
@@ -163,10 +226,213 @@ keeper_state_write(KeeperStateData *keeperState, const char *filename)
 		return false;
 	}
 
+	keeper_state_remember(keeperState, filename);
+
+	/* don't let an older contact file override what we just wrote */
+	(void) keeper_state_write_contact(keeperState, filename);
+
 	return true;
 }
 
 
+/*
+ * keeper_state_unlink removes the state file and its contact file.
+ */
+bool
+keeper_state_unlink(const char *filename)
+{
+	char contactFileName[MAXPGPATH];
+	KeeperStateCache *cache = keeper_state_cache_lookup(filename);
+
+	snprintf(contactFileName, MAXPGPATH, "%s.contact", filename);
+
+	if (cache != NULL)
+	{
+		cache->valid = false;
+	}
+
+	return unlink_file(contactFileName) && unlink_file(filename);
+}
+
+
+/*
+ * keeper_state_durable_fields_equal returns true when both states only differ
+ * in the fields that we keep in the contact file.
+ */
+static bool
+keeper_state_durable_fields_equal(KeeperStateData *a, KeeperStateData *b)
+{
+	return a->pg_autoctl_state_version == b->pg_autoctl_state_version
+		&& a->pg_version == b->pg_version
+		&& a->pg_control_version == b->pg_control_version
+		&& a->catalog_version_no == b->catalog_version_no
+		&& a->system_identifier == b->system_identifier
+		&& a->current_node_id == b->current_node_id
+		&& a->current_group == b->current_group
+		&& a->assigned_role == b->assigned_role
+		&& a->current_nodes_version == b->current_nodes_version
+		&& a->current_role == b->current_role
+		&& a->keeper_is_paused == b->keeper_is_paused
+		&& strcmp(a->monitor_extension_version,
+				  b->monitor_extension_version) == 0;
+}
+
+
+/*
+ * keeper_state_cache_lookup returns the cached state of the given file, or
+ * NULL when we didn't read nor write that file yet.
+ */
+static KeeperStateCache *
+keeper_state_cache_lookup(const char *filename)
+{
+	KeeperStateCache *cache = NULL;
+
+	for (cache = stateCacheList; cache != NULL; cache = cache->next)
+	{
+		if (strcmp(cache->filename, filename) == 0)
+		{
+			return cache;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * keeper_state_remember keeps a copy of the state found in the given file.
+ * When we fail to allocate memory for a new file, we just don't cache its
+ * state, and write the whole state file each time.
+ */
+static void
+keeper_state_remember(KeeperStateData *keeperState, const char *filename)
+{
+	KeeperStateCache *cache = keeper_state_cache_lookup(filename);
+
+	if (cache == NULL)
+	{
+		cache = (KeeperStateCache *) calloc(1, sizeof(KeeperStateCache));
+
+		if (cache == NULL)
+		{
+			return;
+		}
+
+		strlcpy(cache->filename, filename, MAXPGPATH);
+		cache->next = stateCacheList;
+		stateCacheList = cache;
+	}
+
+	cache->state = *keeperState;
+	cache->valid = true;
+}
+
+
+/*
+ * keeper_state_contact_crc computes the CRC of a KeeperStateContact.
+ */
+static pg_crc32c
+keeper_state_contact_crc(KeeperStateContact *contact)
+{
+	pg_crc32c crc;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, (char *) contact, offsetof(KeeperStateContact, crc));
+	FIN_CRC32C(crc);
+
+	return crc;
+}
+
+
+/*
+ * keeper_state_write_contact overwrites the contact file in place, without
+ * fsync: losing its contents in a crash only means we go back to the contact
+ * timestamps of the state file.
+ */
+static bool
+keeper_state_write_contact(KeeperStateData *keeperState, const char *filename)
+{
+	int fd;
+	char contactFileName[MAXPGPATH];
+	KeeperStateContact contact = { 0 };
+
+	snprintf(contactFileName, MAXPGPATH, "%s.contact", filename);
+
+	contact.pg_autoctl_state_version = PG_AUTOCTL_STATE_VERSION;
+	contact.last_monitor_contact = keeperState->last_monitor_contact;
+	contact.last_secondary_contact = keeperState->last_secondary_contact;
+	contact.xlog_lag = keeperState->xlog_lag;
+	contact.crc = keeper_state_contact_crc(&contact);
+
+	fd = open(contactFileName, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+	{
+		log_warn("Failed to open keeper contact file \"%s\": %s",
+				 contactFileName, strerror(errno));
+		return false;
+	}
+
+	if (pwrite(fd, &contact, sizeof(KeeperStateContact), 0) !=
+		sizeof(KeeperStateContact))
+	{
+		log_warn("Failed to write keeper contact file \"%s\": %s",
+				 contactFileName, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+
+	return true;
+}
+
+
+/*
+ * keeper_state_read_contact updates the contact timestamps of the given state
+ * with the ones found in the contact file, when it's valid and more recent.
+ */
+static void
+keeper_state_read_contact(KeeperStateData *keeperState, const char *filename)
+{
+	int fd;
+	char contactFileName[MAXPGPATH];
+	KeeperStateContact contact = { 0 };
+
+	snprintf(contactFileName, MAXPGPATH, "%s.contact", filename);
+
+	fd = open(contactFileName, O_RDONLY);
+	if (fd < 0)
+	{
+		/* no contact file yet is fine */
+		return;
+	}
+
+	if (read(fd, &contact, sizeof(KeeperStateContact)) !=
+		sizeof(KeeperStateContact)
+		|| contact.pg_autoctl_state_version != PG_AUTOCTL_STATE_VERSION
+		|| !EQ_CRC32C(contact.crc, keeper_state_contact_crc(&contact)))
+	{
+		log_debug("Skipping invalid keeper contact file \"%s\"",
+				  contactFileName);
+		close(fd);
+		return;
+	}
+
+	close(fd);
+
+	if (contact.last_monitor_contact > keeperState->last_monitor_contact)
+	{
+		keeperState->last_monitor_contact = contact.last_monitor_contact;
+		keeperState->xlog_lag = contact.xlog_lag;
+	}
+
+	if (contact.last_secondary_contact > keeperState->last_secondary_contact)
+	{
+		keeperState->last_secondary_contact = contact.last_secondary_contact;
+	}
+}
+
+
 /*
  * keeper_state_init initializes a new state structure with default values.
  */
@@ -235,6 +501,8 @@ log_keeper_state(KeeperStateData *keeperState)
 
 	log_trace("state.keeper_is_paused: %d", keeperState->keeper_is_paused);
 	log_trace("state.pg_version: %d", keeperState->pg_version);
+	log_trace("state.monitor_extension_version: %s",
+			  keeperState->monitor_extension_version);
 }
 
 
@@ -272,6 +540,8 @@ print_keeper_state(KeeperStateData *keeperState, FILE *stream)
 	fprintf(stream, "node id:                  %d\n", keeperState->current_node_id);
 	fprintf(stream, "nodes version:            %" PRIu64 "\n",
 			keeperState->current_nodes_version);
+	fprintf(stream, "monitor extension:        %s\n",
+			keeperState->monitor_extension_version);
 
 	/*
 	 * PostgreSQL bits.
@@ -59,6 +59,9 @@ typedef enum
  */
 #define PREPARED_TRANSACTION_NAMELEN 200
 
+/* versions of the monitor extension are short strings such as "1.1" */
+#define MONITOR_EXTENSION_VERSION_MAXLENGTH 64
+
 
 /*
  * The Keeper's state is composed of information from three different sources:
@@ -72,6 +75,9 @@ typedef enum
  *  - last_secondary_contact
  *  - xlog_location                    note: should we keep that?
  *  - keeper_is_paused
+ *
+ * We also keep the version of the monitor extension that we last checked, so
+ * that a restart of the keeper doesn't need to check it again.
  */
 typedef struct
 {
@@ -95,6 +101,9 @@ typedef struct
 	uint64_t last_secondary_contact;
 	int64_t xlog_lag;
 	int keeper_is_paused;
+
+	/* empty in state files written by earlier versions of pg_autoctl */
+	char monitor_extension_version[MONITOR_EXTENSION_VERSION_MAXLENGTH];
 } KeeperStateData;
 
 
@@ -121,6 +130,7 @@ void keeper_state_init(KeeperStateData *keeperState);
 bool keeper_state_create_file(const char *filename);
 bool keeper_state_read(KeeperStateData *keeperState, const char *filename);
 bool keeper_state_write(KeeperStateData *keeperState, const char *filename);
+bool keeper_state_unlink(const char *filename);
 
 void log_keeper_state(KeeperStateData *keeperState);
 void print_keeper_state(KeeperStateData *keeperState, FILE *fp);
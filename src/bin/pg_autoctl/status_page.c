@@ -0,0 +1,256 @@
+/*
+ * src/bin/pg_autoctl/status_page.c
+ *     Status page that the keeper service publishes in a memory-mapped file.
+ *
+ * Local tools that want the status of the keeper would otherwise parse the
+ * state file, which the keeper only writes at state changes, or query the
+ * monitor. Instead, the running keeper maps the pg_autoctl.status file next
+ * to its pid file, and updates the status page in there at each loop with
+ * plain memory stores: that's no system call at all on the keeper side, and
+ * any number of readers may map the same file.
+ *
+ * The page is protected with a sequence lock: the keeper makes the sequence
+ * odd before updating the page, and even again once done. A reader copies the
+ * page, and retries when the sequence was odd or changed during its copy.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+#include "log.h"
+#include "status_page.h"
+
+
+/* a reader gives up when the keeper keeps updating the page */
+#define STATUS_PAGE_READ_RETRIES 1000
+
+static uint32_t status_page_read_sequence(KeeperStatusPage *page);
+
+
+/*
+ * status_page_open creates the status page file, maps it in memory, and
+ * returns the mapped page, or NULL when we failed to do so.
+ */
+KeeperStatusPage *
+status_page_open(const char *filename, int32_t pid)
+{
+	KeeperStatusPage *page = NULL;
+	int fd;
+
+	StaticAssertStmt(sizeof(KeeperStatusPage) <= STATUS_PAGE_SIZE,
+					 "KeeperStatusPage does not fit in STATUS_PAGE_SIZE");
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+	{
+		log_warn("Failed to open \"%s\": %s", filename, strerror(errno));
+		return NULL;
+	}
+
+	if (ftruncate(fd, STATUS_PAGE_SIZE) != 0)
+	{
+		log_warn("Failed to resize \"%s\": %s", filename, strerror(errno));
+		close(fd);
+		(void) unlink(filename);
+		return NULL;
+	}
+
+	page = (KeeperStatusPage *) mmap(NULL, STATUS_PAGE_SIZE,
+									 PROT_READ | PROT_WRITE, MAP_SHARED,
+									 fd, 0);
+
+	/* the mapping stays valid once the file is closed */
+	close(fd);
+
+	if (page == MAP_FAILED)
+	{
+		log_warn("Failed to map \"%s\": %s", filename, strerror(errno));
+		(void) unlink(filename);
+		return NULL;
+	}
+
+	page->version = STATUS_PAGE_VERSION;
+	page->pid = pid;
+
+	/* readers only trust the page once the magic number is set */
+	__atomic_store_n(&(page->magic), STATUS_PAGE_MAGIC, __ATOMIC_RELEASE);
+
+	log_debug("Publishing the keeper status in \"%s\"", filename);
+
+	return page;
+}
+
+
+/*
+ * status_page_close unmaps the status page and removes its file, so that
+ * readers don't mistake a stale page for the status of a running keeper.
+ */
+void
+status_page_close(KeeperStatusPage *page, const char *filename)
+{
+	if (page == NULL)
+	{
+		return;
+	}
+
+	(void) unlink(filename);
+	(void) munmap(page, STATUS_PAGE_SIZE);
+}
+
+
+/*
+ * status_page_detach unmaps the status page and leaves its file alone, for
+ * when another process took over our PID file and publishes its own status
+ * page in the same file.
+ */
+void
+status_page_detach(KeeperStatusPage *page)
+{
+	if (page == NULL)
+	{
+		return;
+	}
+
+	(void) munmap(page, STATUS_PAGE_SIZE);
+}
+
+
+/*
+ * status_page_begin_update makes the sequence odd, so that readers know that
+ * an update of the page is in progress.
+ */
+void
+status_page_begin_update(KeeperStatusPage *page)
+{
+	uint32_t sequence = __atomic_load_n(&(page->sequence), __ATOMIC_RELAXED);
+
+	__atomic_store_n(&(page->sequence), sequence + 1, __ATOMIC_RELAXED);
+
+	/* the odd sequence must be visible before any change to the page */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+/*
+ * status_page_end_update makes the sequence even again, once all the changes
+ * to the page are visible.
+ */
+void
+status_page_end_update(KeeperStatusPage *page)
+{
+	uint32_t sequence = __atomic_load_n(&(page->sequence), __ATOMIC_RELAXED);
+
+	__atomic_store_n(&(page->sequence), sequence + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * status_page_read maps the status page published in the given file, and
+ * copies a consistent version of it to the given status.
+ */
+bool
+status_page_read(const char *filename, KeeperStatusPage *status)
+{
+	KeeperStatusPage *page = NULL;
+	struct stat sb;
+	int fd;
+	int retries;
+	bool success = false;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		log_error("Failed to open \"%s\": %s", filename, strerror(errno));
+		return false;
+	}
+
+	if (fstat(fd, &sb) != 0 || sb.st_size < STATUS_PAGE_SIZE)
+	{
+		log_error("Failed to read \"%s\": the file is not a status page",
+				  filename);
+		close(fd);
+		return false;
+	}
+
+	page = (KeeperStatusPage *) mmap(NULL, STATUS_PAGE_SIZE,
+									 PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (page == MAP_FAILED)
+	{
+		log_error("Failed to map \"%s\": %s", filename, strerror(errno));
+		return false;
+	}
+
+	if (__atomic_load_n(&(page->magic), __ATOMIC_ACQUIRE) != STATUS_PAGE_MAGIC
+		|| page->version != STATUS_PAGE_VERSION)
+	{
+		log_error("Failed to read \"%s\": expected a status page version %d",
+				  filename, STATUS_PAGE_VERSION);
+		(void) munmap(page, STATUS_PAGE_SIZE);
+		return false;
+	}
+
+	for (retries = 0; retries < STATUS_PAGE_READ_RETRIES; retries++)
+	{
+		uint32_t before = status_page_read_sequence(page);
+		uint32_t after = 0;
+
+		if (before % 2 == 1)
+		{
+			/* the keeper is updating the page right now */
+			continue;
+		}
+
+		memcpy(status, page, sizeof(KeeperStatusPage));
+
+		/* the copy must be done before we check the sequence again */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = status_page_read_sequence(page);
+
+		if (before == after)
+		{
+			success = true;
+			break;
+		}
+	}
+
+	(void) munmap(page, STATUS_PAGE_SIZE);
+
+	if (!success)
+	{
+		log_error("Failed to read a consistent status page from \"%s\" "
+				  "after %d attempts", filename, STATUS_PAGE_READ_RETRIES);
+		return false;
+	}
+
+	/* make sure that the strings are terminated, whatever the page has */
+	status->syncState[PGSR_SYNC_STATE_MAXLENGTH - 1] = '\0';
+	status->currentLSN[PG_LSN_MAXLENGTH - 1] = '\0';
+	status->receivedLSN[PG_LSN_MAXLENGTH - 1] = '\0';
+	status->replayedLSN[PG_LSN_MAXLENGTH - 1] = '\0';
+
+	return true;
+}
+
+
+/*
+ * status_page_read_sequence reads the sequence of the page, and orders the
+ * reads of the page that follow after it.
+ */
+static uint32_t
+status_page_read_sequence(KeeperStatusPage *page)
+{
+	return __atomic_load_n(&(page->sequence), __ATOMIC_ACQUIRE);
+}
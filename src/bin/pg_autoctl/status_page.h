@@ -0,0 +1,67 @@
+/*
+ * src/bin/pg_autoctl/status_page.h
+ *   Status page that the keeper service publishes in a memory-mapped file.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef STATUS_PAGE_H
+#define STATUS_PAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pgsql.h"
+
+#define STATUS_PAGE_MAGIC 0x70676166    /* "pgaf" */
+
+/* bump when the layout of KeeperStatusPage changes */
+#define STATUS_PAGE_VERSION 1
+
+/* the page is mapped in full, readers may rely on that size */
+#define STATUS_PAGE_SIZE 4096
+
+/*
+ * The status page only uses fixed-size types, so that other programs than
+ * pg_autoctl may read it too. The keeper increments the sequence before and
+ * after each update, so that it's odd while an update is in progress: readers
+ * copy the page, and copy it again when the sequence was odd or changed
+ * during their copy, see status_page_read.
+ */
+typedef struct KeeperStatusPage
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sequence;
+	int32_t pid;
+
+	uint64_t updateTime;           /* epoch, when the keeper last updated */
+	uint64_t loopCount;
+	uint64_t lastMonitorContact;   /* epoch */
+	uint64_t lastSecondaryContact; /* epoch */
+
+	double loopSeconds;            /* last loop, not counting node_active */
+	double nodeActiveSeconds;      /* last node_active call */
+
+	int32_t nodeId;
+	int32_t groupId;
+	int32_t currentRole;           /* NodeState */
+	int32_t assignedRole;          /* NodeState */
+	int32_t pgIsRunning;
+
+	char syncState[PGSR_SYNC_STATE_MAXLENGTH];
+	char currentLSN[PG_LSN_MAXLENGTH];
+	char receivedLSN[PG_LSN_MAXLENGTH];
+	char replayedLSN[PG_LSN_MAXLENGTH];
+} KeeperStatusPage;
+
+KeeperStatusPage * status_page_open(const char *filename, int32_t pid);
+void status_page_close(KeeperStatusPage *page, const char *filename);
+void status_page_detach(KeeperStatusPage *page);
+void status_page_begin_update(KeeperStatusPage *page);
+void status_page_end_update(KeeperStatusPage *page);
+bool status_page_read(const char *filename, KeeperStatusPage *status);
+
+#endif /* STATUS_PAGE_H */
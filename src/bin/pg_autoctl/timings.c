@@ -0,0 +1,382 @@
+/*
+ * src/bin/pg_autoctl/timings.c
+ *   Timing spans of the keeper state transitions.
+ *
+ * While the keeper runs a state transition, the external programs and the
+ * SQL queries that it runs are timed with the monotonic clock. The timings
+ * of the last transitions are kept in a file next to the state file, which
+ * `pg_autoctl show timings` prints, and are sent to the monitor. The same
+ * spans are also written to the trace file when one is given with --trace.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "postgres_fe.h"
+#include "portability/instr_time.h"
+#include "pqexpbuffer.h"
+
+#include "file_utils.h"
+#include "log.h"
+#include "state.h"
+#include "timings.h"
+#include "trace.h"
+
+
+static struct
+{
+	bool active;
+	instr_time startTime;
+	TransitionTimings current;
+
+	/* the spans that are currently open, innermost last */
+	int depth;
+	int openSpans[TIMINGS_MAX_DEPTH];
+	instr_time openTimes[TIMINGS_MAX_DEPTH];
+
+	bool hasLast;
+	TransitionTimings last;
+} T = { 0 };
+
+static void timings_span_name(const char *name, char *buffer, int size);
+
+
+/*
+ * timings_start_transition starts recording the spans of a transition from
+ * the current state to the assigned one.
+ */
+void
+timings_start_transition(NodeState current, NodeState assigned)
+{
+	char traceName[BUFSIZE] = { 0 };
+
+	snprintf(traceName, sizeof(traceName), "fsm transition %s -> %s",
+			 NodeStateToString(current), NodeStateToString(assigned));
+
+	(void) trace_begin(traceName);
+
+	memset(&(T.current), 0, sizeof(TransitionTimings));
+
+	T.current.current = current;
+	T.current.assigned = assigned;
+	T.current.startTime = time(NULL);
+
+	INSTR_TIME_SET_CURRENT(T.startTime);
+
+	T.depth = 0;
+	T.active = true;
+}
+
+
+/*
+ * timings_end_transition stops recording spans, and keeps the timings of the
+ * transition until timings_take_last_transition is called.
+ */
+void
+timings_end_transition(bool success)
+{
+	instr_time duration;
+
+	if (!T.active)
+	{
+		return;
+	}
+
+	(void) trace_end(success);
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, T.startTime);
+
+	T.current.success = success;
+	T.current.durationMs = INSTR_TIME_GET_MILLISEC(duration);
+
+	T.last = T.current;
+	T.hasLast = true;
+	T.active = false;
+}
+
+
+/*
+ * timings_take_last_transition returns the timings of the last transition,
+ * only once, or NULL when there's none.
+ */
+TransitionTimings *
+timings_take_last_transition(void)
+{
+	if (!T.hasLast)
+	{
+		return NULL;
+	}
+
+	T.hasLast = false;
+
+	return &(T.last);
+}
+
+
+/*
+ * timings_start_span opens a span with the given name, which is only
+ * recorded while a transition is running, and always traced. The name may be
+ * a SQL query, of which we only keep the beginning.
+ */
+void
+timings_start_span(const char *name)
+{
+	char spanName[TIMINGS_SPAN_NAMELEN];
+	int spanIndex = 0;
+
+	(void) trace_begin(name);
+
+	if (!T.active)
+	{
+		return;
+	}
+
+	/* we still count the spans that are too deep for us to record */
+	if (T.depth >= TIMINGS_MAX_DEPTH)
+	{
+		++T.depth;
+		return;
+	}
+
+	timings_span_name(name, spanName, sizeof(spanName));
+
+	for (spanIndex = 0; spanIndex < T.current.spanCount; spanIndex++)
+	{
+		TimingSpan *span = &(T.current.spans[spanIndex]);
+
+		if (span->depth == T.depth && strcmp(span->name, spanName) == 0)
+		{
+			break;
+		}
+	}
+
+	if (spanIndex == T.current.spanCount)
+	{
+		if (T.current.spanCount < TIMINGS_MAX_SPANS)
+		{
+			TimingSpan *span = &(T.current.spans[T.current.spanCount++]);
+
+			strlcpy(span->name, spanName, sizeof(span->name));
+			span->depth = T.depth;
+		}
+		else
+		{
+			/* too many different spans, we don't record that one */
+			spanIndex = -1;
+		}
+	}
+
+	T.openSpans[T.depth] = spanIndex;
+	INSTR_TIME_SET_CURRENT(T.openTimes[T.depth]);
+
+	++T.depth;
+}
+
+
+/*
+ * timings_end_span closes the innermost open span, and returns success, so
+ * that callers can return what timings_end_span returns.
+ */
+bool
+timings_end_span(bool success)
+{
+	int spanIndex = 0;
+	instr_time duration;
+
+	(void) trace_end(success);
+
+	if (!T.active || T.depth == 0)
+	{
+		return success;
+	}
+
+	--T.depth;
+
+	if (T.depth >= TIMINGS_MAX_DEPTH || T.openSpans[T.depth] < 0)
+	{
+		return success;
+	}
+
+	spanIndex = T.openSpans[T.depth];
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, T.openTimes[T.depth]);
+
+	T.current.spans[spanIndex].durationMs += INSTR_TIME_GET_MILLISEC(duration);
+	T.current.spans[spanIndex].count++;
+
+	if (!success)
+	{
+		T.current.spans[spanIndex].failed = true;
+	}
+
+	return success;
+}
+
+
+/*
+ * timings_format_spans appends one line per span of the given transition to
+ * the buffer, indented by their depth.
+ */
+void
+timings_format_spans(TransitionTimings *timings, PQExpBuffer out)
+{
+	int spanIndex = 0;
+
+	for (spanIndex = 0; spanIndex < timings->spanCount; spanIndex++)
+	{
+		TimingSpan *span = &(timings->spans[spanIndex]);
+		int indent = 2 + 2 * span->depth;
+
+		appendPQExpBuffer(out, "%*s%-*s %4d x %10.3f ms%s\n",
+						  indent, "",
+						  50 - 2 * span->depth, span->name,
+						  span->count,
+						  span->durationMs,
+						  span->failed ? " (failed)" : "");
+	}
+}
+
+
+/*
+ * timings_format appends the given transition timings to the buffer: a
+ * first line for the transition itself, then the spans.
+ */
+void
+timings_format(TransitionTimings *timings, PQExpBuffer out)
+{
+	time_t startTime = (time_t) timings->startTime;
+	char timestamp[BUFSIZE] = { 0 };
+
+	strftime(timestamp, sizeof(timestamp),
+			 "%Y-%m-%d %H:%M:%S", localtime(&startTime));
+
+	appendPQExpBuffer(out, "%s  %s -> %s: %.3f ms%s\n",
+					  timestamp,
+					  NodeStateToString(timings->current),
+					  NodeStateToString(timings->assigned),
+					  timings->durationMs,
+					  timings->success ? "" : " (failed)");
+
+	(void) timings_format_spans(timings, out);
+}
+
+
+/*
+ * timings_append_to_file adds the given transition timings at the end of the
+ * timings file, and only keeps the last TIMINGS_MAX_TRANSITIONS there.
+ */
+bool
+timings_append_to_file(TransitionTimings *timings, const char *filename)
+{
+	PQExpBuffer contents = createPQExpBuffer();
+	char *previousContents = NULL;
+	long previousSize = 0;
+	bool success = false;
+
+	if (contents == NULL)
+	{
+		log_error("Failed to allocate memory");
+		return false;
+	}
+
+	if (file_exists(filename) &&
+		read_file(filename, &previousContents, &previousSize))
+	{
+		char *keepFrom = previousContents;
+		char *line = NULL;
+		int transitionCount = 0;
+
+		/* transitions start with a line that isn't indented */
+		for (line = previousContents; line != NULL && *line != '\0';)
+		{
+			char *nextLine = strchr(line, '\n');
+
+			if (!isspace((unsigned char) *line))
+			{
+				++transitionCount;
+			}
+
+			line = nextLine == NULL ? NULL : nextLine + 1;
+		}
+
+		for (line = previousContents; line != NULL && *line != '\0' &&
+			 transitionCount >= TIMINGS_MAX_TRANSITIONS;)
+		{
+			char *nextLine = strchr(line, '\n');
+
+			line = nextLine == NULL ? NULL : nextLine + 1;
+
+			if (line != NULL && *line != '\0' &&
+				!isspace((unsigned char) *line))
+			{
+				--transitionCount;
+				keepFrom = line;
+			}
+		}
+
+		if (transitionCount < TIMINGS_MAX_TRANSITIONS)
+		{
+			appendPQExpBufferStr(contents, keepFrom);
+		}
+
+		free(previousContents);
+	}
+
+	(void) timings_format(timings, contents);
+
+	if (PQExpBufferBroken(contents))
+	{
+		log_error("Failed to allocate memory");
+		destroyPQExpBuffer(contents);
+		return false;
+	}
+
+	success = write_file(contents->data, contents->len, filename);
+
+	destroyPQExpBuffer(contents);
+
+	return success;
+}
+
+
+/*
+ * timings_span_name copies the given name to the buffer, on a single line
+ * with consecutive spaces squeezed, and truncated to the buffer size.
+ */
+static void
+timings_span_name(const char *name, char *buffer, int size)
+{
+	const char *ptr = name;
+	int length = 0;
+	bool previousIsSpace = true;
+
+	for (ptr = name; *ptr != '\0' && length < size - 1; ptr++)
+	{
+		bool isSpace = isspace((unsigned char) *ptr);
+
+		if (isSpace && previousIsSpace)
+		{
+			continue;
+		}
+
+		buffer[length++] = isSpace ? ' ' : *ptr;
+		previousIsSpace = isSpace;
+	}
+
+	/* remove the trailing space, if any */
+	if (length > 0 && buffer[length - 1] == ' ')
+	{
+		--length;
+	}
+
+	buffer[length] = '\0';
+}
@@ -0,0 +1,65 @@
+/*
+ * src/bin/pg_autoctl/timings.h
+ *   Timing spans of the keeper state transitions.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef TIMINGS_H
+#define TIMINGS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "postgres_fe.h"
+#include "pqexpbuffer.h"
+
+#include "state.h"
+
+#define TIMINGS_MAX_SPANS 32
+#define TIMINGS_MAX_DEPTH 8
+#define TIMINGS_SPAN_NAMELEN 64
+
+/* how many transitions we keep in the timings file */
+#define TIMINGS_MAX_TRANSITIONS 20
+
+/*
+ * A span is a step of a state transition, such as running an external
+ * program or a SQL query. Spans that have the same name at the same depth
+ * are accumulated, so that a query that we run in a loop while waiting for
+ * something is a single span.
+ */
+typedef struct TimingSpan
+{
+	char name[TIMINGS_SPAN_NAMELEN];
+	int depth;
+	int count;
+	bool failed;
+	double durationMs;
+} TimingSpan;
+
+typedef struct TransitionTimings
+{
+	NodeState current;
+	NodeState assigned;
+	uint64_t startTime;
+	bool success;
+	double durationMs;
+	int spanCount;
+	TimingSpan spans[TIMINGS_MAX_SPANS];
+} TransitionTimings;
+
+void timings_start_transition(NodeState current, NodeState assigned);
+void timings_end_transition(bool success);
+TransitionTimings * timings_take_last_transition(void);
+
+void timings_start_span(const char *name);
+bool timings_end_span(bool success);
+
+void timings_format_spans(TransitionTimings *timings, PQExpBuffer out);
+void timings_format(TransitionTimings *timings, PQExpBuffer out);
+bool timings_append_to_file(TransitionTimings *timings, const char *filename);
+
+#endif /* TIMINGS_H */
@@ -0,0 +1,220 @@
+/*
+ * src/bin/pg_autoctl/trace.c
+ *   Trace of the steps of a pg_autoctl command, in the Chrome trace-event
+ *   format.
+ *
+ * With the --trace option, every span that the keeper times (SQL queries,
+ * external programs, FSM transitions and the steps of the node bootstrap) is
+ * written to the given file as a complete event ("ph": "X"). The file can
+ * then be opened in chrome://tracing or any viewer of that format, which
+ * shows the nested spans as a flamegraph.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "portability/instr_time.h"
+
+#include "log.h"
+#include "trace.h"
+
+
+static struct
+{
+	FILE *stream;
+	pid_t pid;
+	bool firstEvent;
+	instr_time origin;
+
+	/* the spans that are currently open, innermost last */
+	int depth;
+	char names[TRACE_MAX_DEPTH][TRACE_NAMELEN];
+	instr_time startTimes[TRACE_MAX_DEPTH];
+} Trace = { 0 };
+
+static void trace_escape_name(const char *name, char *buffer, int size);
+
+
+/*
+ * trace_start opens the trace file, and registers trace_stop to run at exit
+ * so that the file is a complete JSON array.
+ */
+bool
+trace_start(const char *filename)
+{
+	Trace.stream = fopen(filename, "w");
+
+	if (Trace.stream == NULL)
+	{
+		log_error("Failed to open trace file \"%s\": %s",
+				  filename, strerror(errno));
+		return false;
+	}
+
+	Trace.pid = getpid();
+	Trace.firstEvent = true;
+	Trace.depth = 0;
+
+	INSTR_TIME_SET_CURRENT(Trace.origin);
+
+	fprintf(Trace.stream, "[");
+	fflush(Trace.stream);
+
+	if (atexit(trace_stop) != 0)
+	{
+		log_warn("Failed to register the trace file to be closed at exit");
+	}
+
+	return true;
+}
+
+
+/*
+ * trace_begin opens a span with the given name, which may be a SQL query.
+ */
+void
+trace_begin(const char *name)
+{
+	/* forked processes don't write to the trace of their parent */
+	if (Trace.stream == NULL || Trace.pid != getpid())
+	{
+		return;
+	}
+
+	if (Trace.depth < TRACE_MAX_DEPTH)
+	{
+		trace_escape_name(name, Trace.names[Trace.depth], TRACE_NAMELEN);
+		INSTR_TIME_SET_CURRENT(Trace.startTimes[Trace.depth]);
+	}
+
+	++Trace.depth;
+}
+
+
+/*
+ * trace_end closes the innermost open span and writes it to the trace file.
+ * We flush the file at each event, so that a fork doesn't inherit buffered
+ * events, and that the trace of a command that is killed is still useful.
+ */
+void
+trace_end(bool success)
+{
+	instr_time now;
+	instr_time startTime;
+	instr_time duration;
+
+	if (Trace.stream == NULL || Trace.pid != getpid() || Trace.depth == 0)
+	{
+		return;
+	}
+
+	--Trace.depth;
+
+	if (Trace.depth >= TRACE_MAX_DEPTH)
+	{
+		return;
+	}
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	startTime = Trace.startTimes[Trace.depth];
+	INSTR_TIME_SUBTRACT(startTime, Trace.origin);
+
+	duration = now;
+	INSTR_TIME_SUBTRACT(duration, Trace.startTimes[Trace.depth]);
+
+	fprintf(Trace.stream,
+			"%s\n{\"name\": \"%s\", \"cat\": \"pg_autoctl\", \"ph\": \"X\", "
+			"\"ts\": %.0f, \"dur\": %.0f, \"pid\": %d, \"tid\": %d, "
+			"\"args\": {\"success\": %s}}",
+			Trace.firstEvent ? "" : ",",
+			Trace.names[Trace.depth],
+			(double) INSTR_TIME_GET_MICROSEC(startTime),
+			(double) INSTR_TIME_GET_MICROSEC(duration),
+			Trace.pid, Trace.pid,
+			success ? "true" : "false");
+	fflush(Trace.stream);
+
+	Trace.firstEvent = false;
+}
+
+
+/*
+ * trace_stop closes the spans that are still open, as when we exit in the
+ * middle of a step, and then closes the trace file.
+ */
+void
+trace_stop(void)
+{
+	if (Trace.stream == NULL || Trace.pid != getpid())
+	{
+		return;
+	}
+
+	while (Trace.depth > 0)
+	{
+		(void) trace_end(false);
+	}
+
+	fprintf(Trace.stream, "\n]\n");
+	fclose(Trace.stream);
+
+	Trace.stream = NULL;
+}
+
+
+/*
+ * trace_escape_name copies the given name to the buffer as the contents of a
+ * JSON string: on a single line with consecutive spaces squeezed, quotes and
+ * backslashes escaped, and truncated to the buffer size.
+ */
+static void
+trace_escape_name(const char *name, char *buffer, int size)
+{
+	const char *ptr = name;
+	int length = 0;
+	bool previousIsSpace = true;
+
+	for (ptr = name; *ptr != '\0' && length < size - 2; ptr++)
+	{
+		bool isSpace = isspace((unsigned char) *ptr);
+
+		if (isSpace && previousIsSpace)
+		{
+			continue;
+		}
+
+		previousIsSpace = isSpace;
+
+		if (isSpace)
+		{
+			buffer[length++] = ' ';
+		}
+		else if (*ptr == '"' || *ptr == '\\')
+		{
+			buffer[length++] = '\\';
+			buffer[length++] = *ptr;
+		}
+		else if ((unsigned char) *ptr >= 0x20)
+		{
+			buffer[length++] = *ptr;
+		}
+	}
+
+	/* remove the trailing space, if any */
+	if (length > 0 && buffer[length - 1] == ' ')
+	{
+		--length;
+	}
+
+	buffer[length] = '\0';
+}
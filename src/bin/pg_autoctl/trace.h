@@ -0,0 +1,27 @@
+/*
+ * src/bin/pg_autoctl/trace.h
+ *   Trace of the steps of a pg_autoctl command, in the Chrome trace-event
+ *   format.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+
+/* spans nested deeper than that are not traced */
+#define TRACE_MAX_DEPTH 32
+
+/* span names are truncated to that size in the trace */
+#define TRACE_NAMELEN 256
+
+bool trace_start(const char *filename);
+void trace_begin(const char *name);
+void trace_end(bool success);
+void trace_stop(void);
+
+#endif /* TRACE_H */
@@ -0,0 +1,960 @@
+/*
+ * src/bin/pg_autoctl/watch.c
+ *   Live view of the nodes of one or several monitors, maintained from their
+ *   notifications.
+ *
+ * We connect to every monitor, LISTEN to its "state" channel, and then take
+ * a snapshot of its nodes with pgautofailover.current_state(). From then on
+ * the monitors are never queried again: the state changes that they notify
+ * are applied to our model of the nodes, and only the rows that changed are
+ * printed again. All the connections are watched in a single poll(2) loop.
+ *
+ * When a connection to a monitor is lost, we connect to it again after
+ * WATCH_RECONNECT_INTERVAL_MS, and take a new snapshot of its nodes, as we
+ * might have missed notifications meanwhile.
+ *
+ * With refreshGroups, as in pg_autoctl show state --watch, a notification
+ * rather has us fetch the current state of the group of the node again, and
+ * only that group, so that the nodes that the monitor changed in the same
+ * decision are shown together.
+ *
+ * With primaryChanged, as in pg_autoctl route, we call it as soon as a node
+ * that is not the one we knew reaches a writable state in its group.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+#include "log.h"
+#include "monitor.h"
+#include "parsing.h"
+#include "pgsql.h"
+#include "signals.h"
+#include "state.h"
+#include "watch.h"
+
+
+/* a group that a monitor notified about, to be fetched again */
+typedef struct WatchGroup
+{
+	char formation[NAMEDATALEN];
+	int groupId;
+} WatchGroup;
+
+/*
+ * Context of the callbacks that receive the nodes and the changes of a
+ * monitor. When formation is set, the nodes received are the ones of that
+ * formation and group only.
+ */
+typedef struct WatchMonitorContext
+{
+	WatchContext *context;
+	int monitorIndex;
+	const char *formation;
+	int groupId;
+	bool parsedOK;
+
+	/* groups to fetch again, and whether there were more than we can keep */
+	WatchGroup groups[WATCH_MAX_REFRESHED_GROUPS];
+	int groupCount;
+	bool tooManyGroups;
+} WatchMonitorContext;
+
+
+static uint64_t watch_now_ms(void);
+static void watch_connect_all(WatchContext *context, uint64_t nowMs);
+static bool watch_connect(WatchContext *context, int monitorIndex);
+static bool watch_fetch_nodes(WatchContext *context, int monitorIndex,
+							  const char *formation, int groupId);
+static void watch_disconnect(WatchContext *context, int monitorIndex);
+static bool watch_read_notifications(WatchContext *context, int monitorIndex);
+static void parseWatchNodes(void *ctx, PGresult *result);
+static void applyStateNotification(void *ctx, StateNotification *notification);
+static void queueGroupRefresh(void *ctx, StateNotification *notification);
+static bool watch_node_is_shown(WatchContext *context,
+								const char *formation, int groupId);
+static int watch_find_node(WatchContext *context, int monitorIndex, int nodeId);
+static void watch_remove_stale_nodes(WatchContext *context);
+static void watch_node_changed(WatchContext *context, int nodeIndex, bool isNew);
+static void watch_track_primary(WatchContext *context, int nodeIndex);
+static bool watch_state_is_writable(NodeState state);
+static void watch_redraw(WatchContext *context);
+static void watch_print_row(WatchContext *context, int nodeIndex);
+static void watch_print_dashes(int count);
+
+
+/*
+ * watch_init prepares the given context to watch the given monitors.
+ */
+bool
+watch_init(WatchContext *context, char **monitorURIs, int monitorCount,
+		   const char *formation, int groupId)
+{
+	int monitorIndex = 0;
+
+	if (monitorCount > WATCH_MAX_MONITORS)
+	{
+		log_error("Failed to watch %d monitors, the maximum is %d",
+				  monitorCount, WATCH_MAX_MONITORS);
+		return false;
+	}
+
+	context->monitorCount = monitorCount;
+	context->groupId = groupId;
+	context->isatty = isatty(fileno(stdout));
+	context->redrawAll = true;
+
+	if (formation != NULL)
+	{
+		strlcpy(context->formation, formation, NAMEDATALEN);
+	}
+
+	for (monitorIndex = 0; monitorIndex < monitorCount; monitorIndex++)
+	{
+		WatchMonitor *watchMonitor = &(context->monitors[monitorIndex]);
+
+		if (!monitor_init(&(watchMonitor->monitor), monitorURIs[monitorIndex]))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		/* until we are connected, we don't know the host and port */
+		snprintf(watchMonitor->label, BUFSIZE, "%d", monitorIndex + 1);
+	}
+
+	return true;
+}
+
+
+/*
+ * watch_main_loop waits for the notifications of all the monitors, and
+ * applies them, until we are asked to stop.
+ */
+bool
+watch_main_loop(WatchContext *context)
+{
+	(void) set_signal_handlers();
+
+	while (!asked_to_stop && !asked_to_stop_fast)
+	{
+		struct pollfd pollFds[WATCH_MAX_MONITORS];
+		int monitorIndexes[WATCH_MAX_MONITORS];
+		int pollFdCount = 0;
+		int timeoutMs = -1;
+		int monitorIndex = 0;
+		int fdIndex = 0;
+		uint64_t nowMs = watch_now_ms();
+
+		(void) watch_connect_all(context, nowMs);
+
+		for (monitorIndex = 0; monitorIndex < context->monitorCount; monitorIndex++)
+		{
+			WatchMonitor *watchMonitor = &(context->monitors[monitorIndex]);
+
+			if (watchMonitor->connected)
+			{
+				PGconn *connection = watchMonitor->monitor.pgsql.connection;
+
+				pollFds[pollFdCount].fd = PQsocket(connection);
+				pollFds[pollFdCount].events = POLLIN;
+				pollFds[pollFdCount].revents = 0;
+				monitorIndexes[pollFdCount] = monitorIndex;
+				++pollFdCount;
+			}
+			else
+			{
+				int delayMs = watchMonitor->nextConnectTimeMs > nowMs
+							  ? (int) (watchMonitor->nextConnectTimeMs - nowMs)
+							  : 0;
+
+				if (timeoutMs < 0 || delayMs < timeoutMs)
+				{
+					timeoutMs = delayMs;
+				}
+			}
+		}
+
+		if (context->redrawAll)
+		{
+			watch_redraw(context);
+		}
+
+		if (poll(pollFds, pollFdCount, timeoutMs) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log_error("Failed to wait for notifications: %s", strerror(errno));
+			return false;
+		}
+
+		for (fdIndex = 0; fdIndex < pollFdCount; fdIndex++)
+		{
+			if (pollFds[fdIndex].revents != 0)
+			{
+				(void) watch_read_notifications(context, monitorIndexes[fdIndex]);
+			}
+		}
+	}
+
+	for (int monitorIndex = 0; monitorIndex < context->monitorCount; monitorIndex++)
+	{
+		pgsql_finish(&(context->monitors[monitorIndex].monitor.pgsql));
+	}
+
+	return true;
+}
+
+
+/*
+ * watch_now_ms returns the current time in milliseconds since the epoch.
+ */
+static uint64_t
+watch_now_ms(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (uint64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+
+/*
+ * watch_connect_all connects to the monitors that we are not connected to and
+ * that are due for a new attempt, and LISTENs to their state changes. The
+ * connections are made concurrently, so that an unreachable monitor doesn't
+ * delay watching the other ones.
+ */
+static void
+watch_connect_all(WatchContext *context, uint64_t nowMs)
+{
+	PGSQLAsyncQuery queries[WATCH_MAX_MONITORS];
+	int monitorIndexes[WATCH_MAX_MONITORS];
+	int queryCount = 0;
+
+	for (int monitorIndex = 0; monitorIndex < context->monitorCount; monitorIndex++)
+	{
+		WatchMonitor *watchMonitor = &(context->monitors[monitorIndex]);
+
+		if (watchMonitor->connected || nowMs < watchMonitor->nextConnectTimeMs)
+		{
+			continue;
+		}
+
+		/* "state" is a plain identifier, no need to quote it */
+		(void) pgsql_async_start(&(queries[queryCount]),
+								 &(watchMonitor->monitor.pgsql),
+								 "LISTEN state", 0, NULL, NULL,
+								 NULL, NULL);
+
+		monitorIndexes[queryCount++] = monitorIndex;
+	}
+
+	if (queryCount == 0)
+	{
+		return;
+	}
+
+	/* errors are logged for each query */
+	(void) pgsql_async_wait_all(queries, queryCount, -1);
+
+	for (int queryIndex = 0; queryIndex < queryCount; queryIndex++)
+	{
+		if (queries[queryIndex].state == PGSQL_ASYNC_DONE)
+		{
+			(void) watch_connect(context, monitorIndexes[queryIndex]);
+		}
+		else
+		{
+			watch_disconnect(context, monitorIndexes[queryIndex]);
+		}
+	}
+}
+
+
+/*
+ * watch_connect takes a snapshot of the nodes of a monitor that we just
+ * connected to and LISTEN to. We LISTEN first so that no change committed
+ * during the snapshot is missed.
+ */
+static bool
+watch_connect(WatchContext *context, int monitorIndex)
+{
+	WatchMonitor *watchMonitor = &(context->monitors[monitorIndex]);
+	PGSQL *pgsql = &(watchMonitor->monitor.pgsql);
+
+	if (!watch_fetch_nodes(context, monitorIndex, NULL, -1))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	snprintf(watchMonitor->label, BUFSIZE, "%s:%s",
+			 PQhost(pgsql->connection), PQport(pgsql->connection));
+
+	watchMonitor->connected = true;
+	context->redrawAll = true;
+
+	log_debug("Watching the monitor %s", watchMonitor->label);
+
+	return true;
+}
+
+
+/*
+ * watch_fetch_nodes fetches the current state of the nodes of a monitor that
+ * we show, or only of the given formation and group when formation is not
+ * NULL, and replaces our model of those nodes with it.
+ */
+static bool
+watch_fetch_nodes(WatchContext *context, int monitorIndex,
+				  const char *formation, int groupId)
+{
+	WatchMonitor *watchMonitor = &(context->monitors[monitorIndex]);
+	PGSQL *pgsql = &(watchMonitor->monitor.pgsql);
+	WatchMonitorContext monitorContext = { 0 };
+	const char *sql = NULL;
+	int paramCount = 0;
+	Oid paramTypes[2] = { TEXTOID, INT4OID };
+	const char *paramValues[2] = { 0 };
+	IntString groupIdString = intToString(groupId);
+
+	monitorContext.context = context;
+	monitorContext.monitorIndex = monitorIndex;
+	monitorContext.formation = formation;
+	monitorContext.groupId = groupId;
+
+	if (formation != NULL)
+	{
+		sql = "SELECT $1::text, * FROM pgautofailover.current_state($1, $2)";
+
+		paramCount = 2;
+		paramValues[0] = formation;
+		paramValues[1] = groupIdString.strValue;
+	}
+	else if (!IS_EMPTY_STRING_BUFFER(context->formation))
+	{
+		sql = "SELECT $1::text, * FROM pgautofailover.current_state($1)";
+
+		paramCount = 1;
+		paramValues[0] = context->formation;
+	}
+	else
+	{
+		sql =
+			"SELECT f.formationid, s.*"
+			"  FROM pgautofailover.formation f,"
+			"       pgautofailover.current_state(f.formationid) s"
+			" ORDER BY f.formationid, s.group_id, s.node_id";
+	}
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes,
+								   paramValues,
+								   &monitorContext, &parseWatchNodes) ||
+		!monitorContext.parsedOK)
+	{
+		log_error("Failed to retrieve current state from the monitor %s",
+				  watchMonitor->label);
+		watch_disconnect(context, monitorIndex);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * watch_disconnect closes the connection to a monitor, and arranges for us to
+ * connect to it again later.
+ */
+static void
+watch_disconnect(WatchContext *context, int monitorIndex)
+{
+	WatchMonitor *watchMonitor = &(context->monitors[monitorIndex]);
+
+	pgsql_finish(&(watchMonitor->monitor.pgsql));
+
+	watchMonitor->connected = false;
+	watchMonitor->nextConnectTimeMs = watch_now_ms() + WATCH_RECONNECT_INTERVAL_MS;
+}
+
+
+/*
+ * watch_read_notifications applies the notifications that a monitor sent.
+ */
+static bool
+watch_read_notifications(WatchContext *context, int monitorIndex)
+{
+	WatchMonitor *watchMonitor = &(context->monitors[monitorIndex]);
+	PGconn *connection = watchMonitor->monitor.pgsql.connection;
+	WatchMonitorContext monitorContext = { 0 };
+	StateNotificationCB *callback = context->refreshGroups
+									? &queueGroupRefresh
+									: &applyStateNotification;
+	PGnotify *notify = NULL;
+	int groupIndex = 0;
+
+	monitorContext.context = context;
+	monitorContext.monitorIndex = monitorIndex;
+
+	if (!PQconsumeInput(connection))
+	{
+		log_warn("Lost connection to the monitor %s: %s",
+				 watchMonitor->label, PQerrorMessage(connection));
+		watch_disconnect(context, monitorIndex);
+		return false;
+	}
+
+	while ((notify = PQnotifies(connection)) != NULL)
+	{
+		log_debug("received \"%s\" from %s", notify->extra, watchMonitor->label);
+
+		/* errors are logged by monitor_parse_state_notifications */
+		(void) monitor_parse_state_notifications(notify->extra,
+												 callback,
+												 &monitorContext);
+
+		PQfreemem(notify);
+	}
+
+	/* with too many groups to fetch again, fetch all the nodes at once */
+	if (monitorContext.tooManyGroups)
+	{
+		return watch_fetch_nodes(context, monitorIndex, NULL, -1);
+	}
+
+	for (groupIndex = 0; groupIndex < monitorContext.groupCount; groupIndex++)
+	{
+		WatchGroup *group = &(monitorContext.groups[groupIndex]);
+
+		if (!watch_fetch_nodes(context, monitorIndex,
+							   group->formation, group->groupId))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * parseWatchNodes replaces the nodes of a monitor, or of a group of a
+ * monitor, with the result of the query of watch_fetch_nodes. The nodes that
+ * are not in the result anymore have been dropped.
+ */
+static void
+parseWatchNodes(void *ctx, PGresult *result)
+{
+	WatchMonitorContext *monitorContext = (WatchMonitorContext *) ctx;
+	WatchContext *context = monitorContext->context;
+	int rowNumber = 0;
+	int nodeIndex = 0;
+
+	if (PQnfields(result) != 7)
+	{
+		log_error("Query returned %d columns, expected 7", PQnfields(result));
+		monitorContext->parsedOK = false;
+		return;
+	}
+
+	for (nodeIndex = 0; nodeIndex < context->nodeCount; nodeIndex++)
+	{
+		WatchNode *node = &(context->nodes[nodeIndex]);
+
+		node->stale =
+			node->monitorIndex == monitorContext->monitorIndex &&
+			(monitorContext->formation == NULL ||
+			 (strcmp(node->formation, monitorContext->formation) == 0 &&
+			  node->groupId == monitorContext->groupId));
+	}
+
+	for (rowNumber = 0; rowNumber < PQntuples(result); rowNumber++)
+	{
+		WatchNode *node = NULL;
+		char *formation = PQgetvalue(result, rowNumber, 0);
+		char *nodeName = PQgetvalue(result, rowNumber, 1);
+		int nodePort = atoi(PQgetvalue(result, rowNumber, 2));
+		int groupId = atoi(PQgetvalue(result, rowNumber, 3));
+		int nodeId = atoi(PQgetvalue(result, rowNumber, 4));
+		NodeState reportedState =
+			NodeStateFromString(PQgetvalue(result, rowNumber, 5));
+		NodeState goalState =
+			NodeStateFromString(PQgetvalue(result, rowNumber, 6));
+		bool isNew = false;
+
+		if (!watch_node_is_shown(context, formation, groupId))
+		{
+			continue;
+		}
+
+		nodeIndex = watch_find_node(context, monitorContext->monitorIndex, nodeId);
+
+		if (nodeIndex < 0)
+		{
+			if (context->nodeCount >= WATCH_MAX_NODES)
+			{
+				log_warn("Not watching more than %d nodes", WATCH_MAX_NODES);
+				break;
+			}
+
+			isNew = true;
+			nodeIndex = context->nodeCount++;
+		}
+
+		node = &(context->nodes[nodeIndex]);
+		node->stale = false;
+
+		if (!isNew &&
+			strcmp(node->formation, formation) == 0 &&
+			strcmp(node->nodeName, nodeName) == 0 &&
+			node->nodePort == nodePort &&
+			node->groupId == groupId &&
+			node->reportedState == reportedState &&
+			node->goalState == goalState)
+		{
+			continue;
+		}
+
+		node->monitorIndex = monitorContext->monitorIndex;
+		strlcpy(node->formation, formation, NAMEDATALEN);
+		strlcpy(node->nodeName, nodeName, _POSIX_HOST_NAME_MAX);
+		node->nodePort = nodePort;
+		node->groupId = groupId;
+		node->nodeId = nodeId;
+		node->reportedState = reportedState;
+		node->goalState = goalState;
+
+		watch_node_changed(context, nodeIndex, isNew);
+	}
+
+	watch_remove_stale_nodes(context);
+
+	monitorContext->parsedOK = true;
+}
+
+
+/*
+ * queueGroupRefresh remembers the group of a node that a monitor notified
+ * about, so that watch_read_notifications fetches that group again, once.
+ */
+static void
+queueGroupRefresh(void *ctx, StateNotification *notification)
+{
+	WatchMonitorContext *monitorContext = (WatchMonitorContext *) ctx;
+	WatchGroup *group = NULL;
+	int groupIndex = 0;
+
+	if (!watch_node_is_shown(monitorContext->context,
+							 notification->formationId, notification->groupId))
+	{
+		return;
+	}
+
+	for (groupIndex = 0; groupIndex < monitorContext->groupCount; groupIndex++)
+	{
+		group = &(monitorContext->groups[groupIndex]);
+
+		if (strcmp(group->formation, notification->formationId) == 0 &&
+			group->groupId == notification->groupId)
+		{
+			return;
+		}
+	}
+
+	if (monitorContext->groupCount >= WATCH_MAX_REFRESHED_GROUPS)
+	{
+		monitorContext->tooManyGroups = true;
+		return;
+	}
+
+	group = &(monitorContext->groups[monitorContext->groupCount++]);
+
+	strlcpy(group->formation, notification->formationId, NAMEDATALEN);
+	group->groupId = notification->groupId;
+}
+
+
+/*
+ * applyStateNotification updates our model of the nodes with a state change
+ * that a monitor notified.
+ */
+static void
+applyStateNotification(void *ctx, StateNotification *notification)
+{
+	WatchMonitorContext *monitorContext = (WatchMonitorContext *) ctx;
+	WatchContext *context = monitorContext->context;
+	WatchNode *node = NULL;
+	bool isNew = false;
+	int nodeIndex = 0;
+
+	if (!watch_node_is_shown(context,
+							 notification->formationId, notification->groupId))
+	{
+		return;
+	}
+
+	nodeIndex = watch_find_node(context,
+								monitorContext->monitorIndex,
+								notification->nodeId);
+
+	if (nodeIndex < 0)
+	{
+		if (context->nodeCount >= WATCH_MAX_NODES)
+		{
+			log_warn("Not watching more than %d nodes", WATCH_MAX_NODES);
+			return;
+		}
+
+		isNew = true;
+		nodeIndex = context->nodeCount++;
+	}
+
+	node = &(context->nodes[nodeIndex]);
+
+	node->monitorIndex = monitorContext->monitorIndex;
+	strlcpy(node->formation, notification->formationId, NAMEDATALEN);
+	node->groupId = notification->groupId;
+	node->nodeId = notification->nodeId;
+	strlcpy(node->nodeName, notification->nodeName, _POSIX_HOST_NAME_MAX);
+	node->nodePort = notification->nodePort;
+	node->reportedState = notification->reportedState;
+	node->goalState = notification->goalState;
+
+	watch_node_changed(context, nodeIndex, isNew);
+}
+
+
+/*
+ * watch_node_is_shown returns true when the nodes of the given formation and
+ * group are shown.
+ */
+static bool
+watch_node_is_shown(WatchContext *context, const char *formation, int groupId)
+{
+	if (!IS_EMPTY_STRING_BUFFER(context->formation) &&
+		strcmp(context->formation, formation) != 0)
+	{
+		return false;
+	}
+
+	return context->groupId < 0 || context->groupId == groupId;
+}
+
+
+/*
+ * watch_find_node returns the index of the given node of the given monitor,
+ * or -1 when we don't know about it yet.
+ */
+static int
+watch_find_node(WatchContext *context, int monitorIndex, int nodeId)
+{
+	int nodeIndex = 0;
+
+	for (nodeIndex = 0; nodeIndex < context->nodeCount; nodeIndex++)
+	{
+		WatchNode *node = &(context->nodes[nodeIndex]);
+
+		if (node->monitorIndex == monitorIndex && node->nodeId == nodeId)
+		{
+			return nodeIndex;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * watch_remove_stale_nodes removes the nodes that parseWatchNodes did not
+ * find anymore, keeping the other nodes in the same order.
+ */
+static void
+watch_remove_stale_nodes(WatchContext *context)
+{
+	int nodeIndex = 0;
+	int keptCount = 0;
+
+	for (nodeIndex = 0; nodeIndex < context->nodeCount; nodeIndex++)
+	{
+		if (!context->nodes[nodeIndex].stale)
+		{
+			if (keptCount != nodeIndex)
+			{
+				context->nodes[keptCount] = context->nodes[nodeIndex];
+			}
+			++keptCount;
+		}
+	}
+
+	if (keptCount != context->nodeCount)
+	{
+		context->nodeCount = keptCount;
+		context->redrawAll = true;
+	}
+}
+
+
+/*
+ * watch_node_changed prints a node that changed. On a terminal, the row of
+ * the node is printed again in place, unless it is a new node or it doesn't
+ * fit in the columns anymore, in which case the whole table is printed
+ * again. Otherwise, we print the row of the node at the end of the output.
+ */
+static void
+watch_node_changed(WatchContext *context, int nodeIndex, bool isNew)
+{
+	WatchNode *node = &(context->nodes[nodeIndex]);
+	WatchMonitor *watchMonitor = &(context->monitors[node->monitorIndex]);
+
+	if (context->primaryChanged != NULL)
+	{
+		watch_track_primary(context, nodeIndex);
+	}
+
+	/* rows are printed again all together after the first snapshot */
+	if (context->quiet || context->redrawAll)
+	{
+		return;
+	}
+
+	if (!context->isatty)
+	{
+		watch_print_row(context, nodeIndex);
+		fflush(stdout);
+		return;
+	}
+
+	if (isNew ||
+		strlen(watchMonitor->label) > context->monitorWidth ||
+		strlen(node->formation) > context->formationWidth ||
+		strlen(node->nodeName) > context->nodeNameWidth)
+	{
+		context->redrawAll = true;
+		return;
+	}
+
+	/* save the cursor, move to the row of the node, and clear the line */
+	fprintf(stdout, "\0337\033[%d;1H\033[2K", nodeIndex + 3);
+	watch_print_row(context, nodeIndex);
+	fprintf(stdout, "\0338");
+	fflush(stdout);
+}
+
+
+/*
+ * watch_track_primary calls the primaryChanged callback when the given node
+ * is writable and is not the writable node that we knew in its group. Both
+ * its current and assigned states have to be writable: a node being promoted
+ * only accepts writes once it reports having reached its goal state.
+ */
+static void
+watch_track_primary(WatchContext *context, int nodeIndex)
+{
+	WatchNode *node = &(context->nodes[nodeIndex]);
+	WatchPrimary *primary = NULL;
+	WatchPrimary previous = { 0 };
+	bool hadPrimary = false;
+	int primaryIndex = 0;
+
+	if (!watch_state_is_writable(node->reportedState) ||
+		!watch_state_is_writable(node->goalState))
+	{
+		return;
+	}
+
+	for (primaryIndex = 0; primaryIndex < context->primaryCount; primaryIndex++)
+	{
+		WatchPrimary *groupPrimary = &(context->primaries[primaryIndex]);
+
+		if (groupPrimary->monitorIndex == node->monitorIndex &&
+			groupPrimary->groupId == node->groupId &&
+			strcmp(groupPrimary->formation, node->formation) == 0)
+		{
+			primary = groupPrimary;
+			break;
+		}
+	}
+
+	if (primary != NULL)
+	{
+		if (primary->nodeId == node->nodeId &&
+			primary->nodePort == node->nodePort &&
+			strcmp(primary->nodeName, node->nodeName) == 0)
+		{
+			return;
+		}
+
+		previous = *primary;
+		hadPrimary = true;
+	}
+	else
+	{
+		if (context->primaryCount >= WATCH_MAX_NODES)
+		{
+			log_warn("Not tracking the primary of more than %d groups",
+					 WATCH_MAX_NODES);
+			return;
+		}
+
+		primary = &(context->primaries[context->primaryCount++]);
+
+		primary->monitorIndex = node->monitorIndex;
+		strlcpy(primary->formation, node->formation, NAMEDATALEN);
+		primary->groupId = node->groupId;
+	}
+
+	primary->nodeId = node->nodeId;
+	strlcpy(primary->nodeName, node->nodeName, _POSIX_HOST_NAME_MAX);
+	primary->nodePort = node->nodePort;
+
+	(*context->primaryChanged)(context->primaryChangedContext,
+							   hadPrimary ? &previous : NULL,
+							   primary);
+}
+
+
+/*
+ * watch_state_is_writable returns true when a node in the given state
+ * accepts writes.
+ */
+static bool
+watch_state_is_writable(NodeState state)
+{
+	return state == SINGLE_STATE ||
+		   state == WAIT_PRIMARY_STATE ||
+		   state == PRIMARY_STATE;
+}
+
+
+/*
+ * watch_redraw prints the whole table of the nodes, after clearing the
+ * terminal, if any.
+ */
+static void
+watch_redraw(WatchContext *context)
+{
+	int monitorIndex = 0;
+	int nodeIndex = 0;
+
+	if (context->quiet)
+	{
+		context->redrawAll = false;
+		return;
+	}
+
+	context->monitorWidth = strlen("Monitor");
+	context->formationWidth = strlen("Formation");
+	context->nodeNameWidth = strlen("Name");
+
+	for (monitorIndex = 0; monitorIndex < context->monitorCount; monitorIndex++)
+	{
+		int width = strlen(context->monitors[monitorIndex].label);
+
+		context->monitorWidth = Max(context->monitorWidth, width);
+	}
+
+	for (nodeIndex = 0; nodeIndex < context->nodeCount; nodeIndex++)
+	{
+		WatchNode *node = &(context->nodes[nodeIndex]);
+
+		context->formationWidth =
+			Max(context->formationWidth, (int) strlen(node->formation));
+		context->nodeNameWidth =
+			Max(context->nodeNameWidth, (int) strlen(node->nodeName));
+	}
+
+	if (context->isatty)
+	{
+		/* move the cursor to the top left corner and clear the screen */
+		fprintf(stdout, "\033[H\033[2J");
+	}
+
+	/* the monitor column is only useful with several monitors */
+	if (context->monitorCount > 1)
+	{
+		fprintf(stdout, "%*s | ", context->monitorWidth, "Monitor");
+	}
+
+	fprintf(stdout, "%*s | %*s | %6s | %5s | %5s | %17s | %17s\n",
+			context->formationWidth, "Formation",
+			context->nodeNameWidth, "Name",
+			"Port", "Group", "Node", "Current State", "Assigned State");
+
+	if (context->monitorCount > 1)
+	{
+		watch_print_dashes(context->monitorWidth);
+		fprintf(stdout, "-+-");
+	}
+
+	watch_print_dashes(context->formationWidth);
+	fprintf(stdout, "-+-");
+	watch_print_dashes(context->nodeNameWidth);
+	fprintf(stdout, "-+-%6s-+-%5s-+-%5s-+-%17s-+-%17s\n",
+			"------", "-----", "-----",
+			"-----------------", "-----------------");
+
+	for (nodeIndex = 0; nodeIndex < context->nodeCount; nodeIndex++)
+	{
+		watch_print_row(context, nodeIndex);
+	}
+
+	fflush(stdout);
+
+	context->redrawAll = false;
+}
+
+
+/*
+ * watch_print_row prints the row of a node.
+ */
+static void
+watch_print_row(WatchContext *context, int nodeIndex)
+{
+	WatchNode *node = &(context->nodes[nodeIndex]);
+	WatchMonitor *watchMonitor = &(context->monitors[node->monitorIndex]);
+
+	if (context->monitorCount > 1)
+	{
+		fprintf(stdout, "%*s | ", context->monitorWidth, watchMonitor->label);
+	}
+
+	fprintf(stdout, "%*s | %*s | %6d | %5d | %5d | %17s | %17s\n",
+			context->formationWidth, node->formation,
+			context->nodeNameWidth, node->nodeName,
+			node->nodePort, node->groupId, node->nodeId,
+			NodeStateToString(node->reportedState),
+			NodeStateToString(node->goalState));
+}
+
+
+/*
+ * watch_print_dashes prints the given number of dashes, to separate the
+ * header of a column from its rows.
+ */
+static void
+watch_print_dashes(int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		fputc('-', stdout);
+	}
+}
@@ -0,0 +1,104 @@
+/*
+ * src/bin/pg_autoctl/watch.h
+ *   Live view of the nodes of one or several monitors, maintained from their
+ *   notifications.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdbool.h>
+
+#include "monitor.h"
+#include "state.h"
+
+/* maximum number of monitors and nodes of a pg_autoctl watch command */
+#define WATCH_MAX_MONITORS 16
+#define WATCH_MAX_NODES 1024
+
+/* how long we wait before connecting again to a monitor we lost */
+#define WATCH_RECONNECT_INTERVAL_MS 5000
+
+/* a notification about more groups than that fetches all the nodes again */
+#define WATCH_MAX_REFRESHED_GROUPS 16
+
+/* a node, as last notified by its monitor */
+typedef struct WatchNode
+{
+	int monitorIndex;
+	char formation[NAMEDATALEN];
+	int groupId;
+	int nodeId;
+	char nodeName[_POSIX_HOST_NAME_MAX];
+	int nodePort;
+	NodeState reportedState;
+	NodeState goalState;
+
+	/* not found again yet when fetching the nodes, see parseWatchNodes */
+	bool stale;
+} WatchNode;
+
+/* the writable node of a group, see watch_track_primary */
+typedef struct WatchPrimary
+{
+	int monitorIndex;
+	char formation[NAMEDATALEN];
+	int groupId;
+	int nodeId;
+	char nodeName[_POSIX_HOST_NAME_MAX];
+	int nodePort;
+} WatchPrimary;
+
+/* previous is NULL for the first writable node that we see in a group */
+typedef void (WatchPrimaryCB)(void *ctx,
+							  WatchPrimary *previous, WatchPrimary *primary);
+
+typedef struct WatchMonitor
+{
+	Monitor monitor;
+	char label[BUFSIZE];
+	bool connected;
+	uint64_t nextConnectTimeMs;
+} WatchMonitor;
+
+typedef struct WatchContext
+{
+	WatchMonitor monitors[WATCH_MAX_MONITORS];
+	int monitorCount;
+
+	/* only show the nodes of this formation and group, when set */
+	char formation[NAMEDATALEN];
+	int groupId;
+
+	/* fetch the group of a notified node again, rather than apply it */
+	bool refreshGroups;
+
+	WatchNode nodes[WATCH_MAX_NODES];
+	int nodeCount;
+
+	/* when set, called as soon as a group has a new writable node */
+	WatchPrimaryCB *primaryChanged;
+	void *primaryChangedContext;
+	WatchPrimary primaries[WATCH_MAX_NODES];
+	int primaryCount;
+
+	/* only track the nodes, don't print them */
+	bool quiet;
+
+	/* with a terminal, we redraw the rows in place */
+	bool isatty;
+	bool redrawAll;
+	int monitorWidth;
+	int formationWidth;
+	int nodeNameWidth;
+} WatchContext;
+
+bool watch_init(WatchContext *context, char **monitorURIs, int monitorCount,
+				const char *formation, int groupId);
+bool watch_main_loop(WatchContext *context);
+
+#endif /* WATCH_H */
@@ -0,0 +1,611 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/event_buffer.c
+ *
+ * Shared-memory buffer of the events that the monitor decides.
+ *
+ * When pgautofailover.event_buffer_size is set, the events are not inserted
+ * in the event table by the transaction that decides them, such as a
+ * node_active call that holds the lock of its group. Instead, their eventid
+ * is taken with NextEventId, and they are copied to a ring buffer in shared
+ * memory when the transaction commits. The first health
+ * check worker of the database then inserts them in the event table, by
+ * batches of EVENT_FLUSH_BATCH_SIZE rows.
+ *
+ * Each event is given a slot in the ring when it is decided, so that there is
+ * always room for the events of a transaction that commits. When the ring is
+ * full, or when the description of an event is too long, the event is
+ * inserted at once, as if the buffer was disabled.
+ *
+ * The events stay below the horizon of events_since until they are inserted,
+ * see OldestBufferedEventId.
+ *
+ * The events that are in the buffer when the server crashes are lost. They
+ * have been notified on the "state" channel already.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "miscadmin.h"
+
+#include "event_buffer.h"
+#include "function_stats.h"
+#include "health_check.h"
+#include "metadata.h"
+#include "notifications.h"
+
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/pg_lsn.h"
+
+
+/* number of columns that InsertBufferedEvents gives for each event */
+#define BUFFERED_EVENT_COLUMNS 12
+
+
+/*
+ * EventBufferControlData is the ring of events: the events from position
+ * head to position tail are still to be inserted, except for the ones that
+ * have an invalid databaseId, which their flusher inserted already.
+ */
+typedef struct EventBufferControlData
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+
+	uint64 head;
+	uint64 tail;
+
+	/* slots given to the events of transactions in progress */
+	int reserved;
+
+	BufferedEvent events[FLEXIBLE_ARRAY_MEMBER];
+} EventBufferControlData;
+
+
+/* GUC */
+int EventBufferSize = 0;
+
+static EventBufferControlData *EventBufferControl = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/* events of the current transaction, and the slots we reserved for them */
+static List *PendingBufferedEvents = NIL;
+static int ReservedEventCount = 0;
+static bool EventBufferCallbacksRegistered = false;
+
+
+static size_t EventBufferShmemSize(void);
+static void EventBufferShmemInit(void);
+static void EventBufferXactCallback(XactEvent event, void *arg);
+static void EventBufferSubXactCallback(SubXactEvent event,
+									   SubTransactionId mySubid,
+									   SubTransactionId parentSubid,
+									   void *arg);
+static void ReleaseReservedEvents(void);
+
+
+/*
+ * InitializeEventBuffer, called at server start, requests the shared memory
+ * of the event buffer when pgautofailover.event_buffer_size is set.
+ */
+void
+InitializeEventBuffer(void)
+{
+	if (EventBufferSize <= 0)
+	{
+		return;
+	}
+
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(EventBufferShmemSize());
+	}
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = EventBufferShmemInit;
+}
+
+
+/*
+ * EventBufferShmemSize returns the size of the ring of events.
+ */
+static size_t
+EventBufferShmemSize(void)
+{
+	return add_size(offsetof(EventBufferControlData, events),
+					mul_size(EventBufferSize, sizeof(BufferedEvent)));
+}
+
+
+/*
+ * EventBufferShmemInit initializes the ring of events.
+ */
+static void
+EventBufferShmemInit(void)
+{
+	bool alreadyInitialized = false;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	EventBufferControl =
+		(EventBufferControlData *)
+		ShmemInitStruct("pg_auto_failover Event Buffer",
+						EventBufferShmemSize(),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		memset(EventBufferControl, 0, EventBufferShmemSize());
+
+		EventBufferControl->trancheId = LWLockNewTrancheId();
+		EventBufferControl->lockTrancheName = "pg_auto_failover Event Buffer";
+		LWLockRegisterTranche(EventBufferControl->trancheId,
+							  EventBufferControl->lockTrancheName);
+
+		LWLockInitialize(&EventBufferControl->lock,
+						 EventBufferControl->trancheId);
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * BufferEvent keeps the given event in the current transaction, to be copied
+ * to the event buffer when it commits, and sets eventId to the eventid of the
+ * event. It returns false when the event should be inserted at once instead,
+ * because the buffer is disabled or full, or the event doesn't fit in it.
+ */
+bool
+BufferEvent(const char *formationId, int groupId, int64 nodeId,
+			const char *nodeName, int nodePort,
+			ReplicationState reportedState,
+			ReplicationState goalState,
+			SyncState pgsrSyncState,
+			XLogRecPtr reportedLSN,
+			const char *description,
+			int64 *eventId)
+{
+	BufferedEvent *event = NULL;
+	MemoryContext oldContext = NULL;
+	bool reserved = false;
+
+	if (EventBufferControl == NULL ||
+		strlen(formationId) >= NAMEDATALEN ||
+		strlen(nodeName) >= MAX_NODE_NAME_SIZE ||
+		strlen(description) >= BUFFERED_EVENT_DESCRIPTION_SIZE)
+	{
+		return false;
+	}
+
+	if (IsInParallelMode())
+	{
+		return false;
+	}
+
+	if (!EventBufferCallbacksRegistered)
+	{
+		RegisterXactCallback(EventBufferXactCallback, NULL);
+		RegisterSubXactCallback(EventBufferSubXactCallback, NULL);
+		EventBufferCallbacksRegistered = true;
+	}
+
+	LWLockAcquire(&EventBufferControl->lock, LW_EXCLUSIVE);
+
+	if (EventBufferControl->tail - EventBufferControl->head +
+		EventBufferControl->reserved < EventBufferSize)
+	{
+		EventBufferControl->reserved++;
+		reserved = true;
+	}
+
+	LWLockRelease(&EventBufferControl->lock);
+
+	if (!reserved)
+	{
+		return false;
+	}
+
+	/* from now on, the slot is given back when the transaction ends */
+	ReservedEventCount++;
+
+	oldContext = MemoryContextSwitchTo(TopTransactionContext);
+
+	event = (BufferedEvent *) palloc0(sizeof(BufferedEvent));
+
+	event->databaseId = MyDatabaseId;
+	event->subXactId = GetCurrentSubTransactionId();
+	event->eventId = NextEventId();
+	event->eventTime = GetCurrentTransactionStartTimestamp();
+	strlcpy(event->formationId, formationId, NAMEDATALEN);
+	event->nodeId = nodeId;
+	event->groupId = groupId;
+	strlcpy(event->nodeName, nodeName, MAX_NODE_NAME_SIZE);
+	event->nodePort = nodePort;
+	event->reportedState = reportedState;
+	event->goalState = goalState;
+	event->pgsrSyncState = pgsrSyncState;
+	event->reportedLSN = reportedLSN;
+	strlcpy(event->description, description, BUFFERED_EVENT_DESCRIPTION_SIZE);
+
+	PendingBufferedEvents = lappend(PendingBufferedEvents, event);
+
+	MemoryContextSwitchTo(oldContext);
+
+	*eventId = event->eventId;
+
+	return true;
+}
+
+
+/*
+ * EventBufferXactCallback gives back the slots that the transaction reserved
+ * when it is rolled back. The events of a transaction that commits are copied
+ * to the buffer by EventWriterXactCallback, see CommitBufferedEvents.
+ */
+static void
+EventBufferXactCallback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_PREPARE:
+		{
+			if (PendingBufferedEvents != NIL)
+			{
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot prepare a transaction that has "
+								"buffered pg_auto_failover events")));
+			}
+			break;
+		}
+
+		case XACT_EVENT_ABORT:
+		{
+			ReleaseReservedEvents();
+			break;
+		}
+
+		default:
+		{
+			/* nothing to do */
+			break;
+		}
+	}
+}
+
+
+/*
+ * EventBufferSubXactCallback forgets the events of a subtransaction that is
+ * rolled back, as the event table would not have them either. Subtransactions
+ * that began after the one that is rolled back are its children, that are
+ * rolled back too.
+ */
+static void
+EventBufferSubXactCallback(SubXactEvent event, SubTransactionId mySubid,
+						   SubTransactionId parentSubid, void *arg)
+{
+	List *keptEvents = NIL;
+	ListCell *eventCell = NULL;
+	MemoryContext oldContext = NULL;
+
+	if (event != SUBXACT_EVENT_ABORT_SUB || PendingBufferedEvents == NIL)
+	{
+		return;
+	}
+
+	oldContext = MemoryContextSwitchTo(TopTransactionContext);
+
+	foreach(eventCell, PendingBufferedEvents)
+	{
+		BufferedEvent *bufferedEvent = (BufferedEvent *) lfirst(eventCell);
+
+		if (bufferedEvent->subXactId < mySubid)
+		{
+			keptEvents = lappend(keptEvents, bufferedEvent);
+		}
+	}
+
+	MemoryContextSwitchTo(oldContext);
+
+	/* the slots of the forgotten events are given back at commit */
+	PendingBufferedEvents = keptEvents;
+}
+
+
+/*
+ * CommitBufferedEvents copies the events of the transaction that commits to
+ * the slots that were reserved for them, and wakes up the worker that inserts
+ * them in the event table. The events must be in the buffer before the
+ * transaction releases its EventWriter slot, so that EventHorizon always
+ * finds their eventid in one or the other.
+ */
+void
+CommitBufferedEvents(void)
+{
+	ListCell *eventCell = NULL;
+	bool committedEvents = PendingBufferedEvents != NIL;
+
+	if (ReservedEventCount == 0)
+	{
+		return;
+	}
+
+	LWLockAcquire(&EventBufferControl->lock, LW_EXCLUSIVE);
+
+	foreach(eventCell, PendingBufferedEvents)
+	{
+		BufferedEvent *bufferedEvent = (BufferedEvent *) lfirst(eventCell);
+		uint64 position = EventBufferControl->tail++;
+		BufferedEvent *slot =
+			&EventBufferControl->events[position % EventBufferSize];
+
+		memcpy(slot, bufferedEvent, sizeof(BufferedEvent));
+		slot->position = position;
+	}
+
+	EventBufferControl->reserved -= ReservedEventCount;
+
+	LWLockRelease(&EventBufferControl->lock);
+
+	/* the memory is gone with the transaction */
+	PendingBufferedEvents = NIL;
+	ReservedEventCount = 0;
+
+	if (committedEvents)
+	{
+		WakeEventFlusher(MyDatabaseId);
+	}
+}
+
+
+/*
+ * ReleaseReservedEvents gives back the slots of a transaction that is rolled
+ * back.
+ */
+static void
+ReleaseReservedEvents(void)
+{
+	if (ReservedEventCount > 0)
+	{
+		LWLockAcquire(&EventBufferControl->lock, LW_EXCLUSIVE);
+		EventBufferControl->reserved -= ReservedEventCount;
+		LWLockRelease(&EventBufferControl->lock);
+	}
+
+	PendingBufferedEvents = NIL;
+	ReservedEventCount = 0;
+}
+
+
+/*
+ * CopyBufferedEvents copies up to maxCount of the oldest events of the
+ * current database that are still to be inserted, and returns how many it
+ * copied. The events stay in the buffer until ReleaseBufferedEvents is called
+ * for them, once they are inserted.
+ */
+int
+CopyBufferedEvents(BufferedEvent *events, int maxCount)
+{
+	uint64 position = 0;
+	int count = 0;
+
+	if (EventBufferControl == NULL)
+	{
+		return 0;
+	}
+
+	LWLockAcquire(&EventBufferControl->lock, LW_SHARED);
+
+	for (position = EventBufferControl->head;
+		 position < EventBufferControl->tail && count < maxCount;
+		 position++)
+	{
+		BufferedEvent *slot =
+			&EventBufferControl->events[position % EventBufferSize];
+
+		if (slot->databaseId == MyDatabaseId)
+		{
+			memcpy(&events[count++], slot, sizeof(BufferedEvent));
+		}
+	}
+
+	LWLockRelease(&EventBufferControl->lock);
+
+	return count;
+}
+
+
+/*
+ * ReleaseBufferedEvents frees the slots of the given events, which were
+ * obtained by CopyBufferedEvents, and moves the head of the ring past the
+ * events that all the databases inserted.
+ */
+void
+ReleaseBufferedEvents(BufferedEvent *events, int count)
+{
+	int eventIndex = 0;
+
+	if (EventBufferControl == NULL || count == 0)
+	{
+		return;
+	}
+
+	LWLockAcquire(&EventBufferControl->lock, LW_EXCLUSIVE);
+
+	for (eventIndex = 0; eventIndex < count; eventIndex++)
+	{
+		uint64 position = events[eventIndex].position;
+		BufferedEvent *slot =
+			&EventBufferControl->events[position % EventBufferSize];
+
+		if (slot->position == position)
+		{
+			slot->databaseId = InvalidOid;
+		}
+	}
+
+	while (EventBufferControl->head < EventBufferControl->tail &&
+		   EventBufferControl->events[EventBufferControl->head %
+									  EventBufferSize].databaseId == InvalidOid)
+	{
+		EventBufferControl->head++;
+	}
+
+	LWLockRelease(&EventBufferControl->lock);
+}
+
+
+/*
+ * OldestBufferedEventId returns the lowest eventid of the events of the
+ * current database that are still to be inserted, or PG_INT64_MAX when there
+ * is none. The flusher releases the events once its transaction is visible as
+ * committed, so an event is either in the buffer or in the event table.
+ */
+int64
+OldestBufferedEventId(void)
+{
+	uint64 position = 0;
+	int64 oldestEventId = PG_INT64_MAX;
+
+	if (EventBufferControl == NULL)
+	{
+		return PG_INT64_MAX;
+	}
+
+	LWLockAcquire(&EventBufferControl->lock, LW_SHARED);
+
+	for (position = EventBufferControl->head;
+		 position < EventBufferControl->tail;
+		 position++)
+	{
+		BufferedEvent *slot =
+			&EventBufferControl->events[position % EventBufferSize];
+
+		if (slot->databaseId == MyDatabaseId &&
+			slot->eventId < oldestEventId)
+		{
+			oldestEventId = slot->eventId;
+		}
+	}
+
+	LWLockRelease(&EventBufferControl->lock);
+
+	return oldestEventId;
+}
+
+
+/*
+ * InsertBufferedEvents inserts the given events in the event table of the
+ * current database with a single multi-row INSERT statement, with the eventid
+ * and the eventtime that they got in the transaction that decided them.
+ */
+void
+InsertBufferedEvents(BufferedEvent *events, int count)
+{
+	Oid replicationStateTypeOid = ReplicationStateTypeOid();
+	int argCount = count * BUFFERED_EVENT_COLUMNS;
+	Oid *argTypes = (Oid *) palloc(argCount * sizeof(Oid));
+	Datum *argValues = (Datum *) palloc(argCount * sizeof(Datum));
+	StringInfoData query;
+	int eventIndex = 0;
+	int spiStatus = 0;
+	WriteUsage writeUsage;
+
+	initStringInfo(&query);
+	appendStringInfoString(&query,
+						   "INSERT INTO " AUTO_FAILOVER_EVENT_TABLE
+						   "(eventid, eventtime, formationid, nodeid, groupid,"
+						   " nodename, nodeport, reportedstate, goalstate,"
+						   " reportedrepstate, reportedlsn, description) "
+						   "VALUES ");
+
+	for (eventIndex = 0; eventIndex < count; eventIndex++)
+	{
+		BufferedEvent *event = &events[eventIndex];
+		int first = eventIndex * BUFFERED_EVENT_COLUMNS;
+		int columnIndex = 0;
+
+		Oid rowTypes[BUFFERED_EVENT_COLUMNS] = {
+			INT8OID,                 /* eventid */
+			TIMESTAMPTZOID,          /* eventtime */
+			TEXTOID,                 /* formationid */
+			INT8OID,                 /* nodeid */
+			INT4OID,                 /* groupid */
+			TEXTOID,                 /* nodename */
+			INT4OID,                 /* nodeport */
+			replicationStateTypeOid, /* reportedstate */
+			replicationStateTypeOid, /* goalstate */
+			TEXTOID,                 /* pg_stat_replication.sync_state */
+			LSNOID,                  /* reportedLSN */
+			TEXTOID                  /* description */
+		};
+
+		Datum rowValues[BUFFERED_EVENT_COLUMNS] = {
+			Int64GetDatum(event->eventId),
+			TimestampTzGetDatum(event->eventTime),
+			CStringGetTextDatum(event->formationId),
+			Int64GetDatum(event->nodeId),
+			Int32GetDatum(event->groupId),
+			CStringGetTextDatum(event->nodeName),
+			Int32GetDatum(event->nodePort),
+			ObjectIdGetDatum(ReplicationStateGetEnum(event->reportedState)),
+			ObjectIdGetDatum(ReplicationStateGetEnum(event->goalState)),
+			CStringGetTextDatum(SyncStateToString(event->pgsrSyncState)),
+			LSNGetDatum(event->reportedLSN),
+			CStringGetTextDatum(event->description)
+		};
+
+		memcpy(&argTypes[first], rowTypes, sizeof(rowTypes));
+		memcpy(&argValues[first], rowValues, sizeof(rowValues));
+
+		appendStringInfoString(&query, eventIndex == 0 ? "(" : ", (");
+
+		for (columnIndex = 0; columnIndex < BUFFERED_EVENT_COLUMNS; columnIndex++)
+		{
+			appendStringInfo(&query, "%s$%d",
+							 columnIndex == 0 ? "" : ", ",
+							 first + columnIndex + 1);
+		}
+
+		appendStringInfoChar(&query, ')');
+	}
+
+	SPI_connect();
+
+	WriteUsageStart(&writeUsage);
+
+	spiStatus = SPI_execute_with_args(query.data, argCount, argTypes,
+									  argValues, NULL, false, 0);
+
+	WriteUsageEnd(WRITE_INSERT_EVENT, &writeUsage);
+
+	if (spiStatus != SPI_OK_INSERT)
+	{
+		elog(ERROR, "could not insert into " AUTO_FAILOVER_EVENT_TABLE);
+	}
+
+	SPI_finish();
+
+	pfree(query.data);
+	pfree(argTypes);
+	pfree(argValues);
+}
@@ -0,0 +1,74 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/event_buffer.h
+ *
+ * Declarations for the shared-memory buffer of the events that the health
+ * check workers insert in the event table.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "access/xlogdefs.h"
+#include "datatype/timestamp.h"
+
+#include "health_check.h"
+#include "node_metadata.h"
+#include "replication_state.h"
+
+
+/* events with a longer description are inserted at once */
+#define BUFFERED_EVENT_DESCRIPTION_SIZE 2048
+
+/* number of events that a single INSERT statement writes */
+#define EVENT_FLUSH_BATCH_SIZE 64
+
+
+/*
+ * BufferedEvent is an event that a transaction committed, and that is still
+ * to be inserted in the event table of its database.
+ */
+typedef struct BufferedEvent
+{
+	Oid databaseId;
+	uint64 position;            /* in the ring, see ReleaseBufferedEvents */
+	SubTransactionId subXactId; /* until committed, see EventBufferXactCallback */
+	int64 eventId;
+	TimestampTz eventTime;
+	char formationId[NAMEDATALEN];
+	int64 nodeId;
+	int groupId;
+	char nodeName[MAX_NODE_NAME_SIZE];
+	int nodePort;
+	ReplicationState reportedState;
+	ReplicationState goalState;
+	SyncState pgsrSyncState;
+	XLogRecPtr reportedLSN;
+	char description[BUFFERED_EVENT_DESCRIPTION_SIZE];
+} BufferedEvent;
+
+
+/* GUC to size the event buffer, 0 disables it */
+extern int EventBufferSize;
+
+
+extern void InitializeEventBuffer(void);
+extern bool BufferEvent(const char *formationId, int groupId, int64 nodeId,
+						const char *nodeName, int nodePort,
+						ReplicationState reportedState,
+						ReplicationState goalState,
+						SyncState pgsrSyncState,
+						XLogRecPtr reportedLSN,
+						const char *description,
+						int64 *eventId);
+extern void CommitBufferedEvents(void);
+extern int64 OldestBufferedEventId(void);
+extern int CopyBufferedEvents(BufferedEvent *events, int maxCount);
+extern void InsertBufferedEvents(BufferedEvent *events, int count);
+extern void ReleaseBufferedEvents(BufferedEvent *events, int count);
@@ -22,19 +22,44 @@
 #include "access/htup_details.h"
 #include "access/xlogdefs.h"
 #include "catalog/pg_type.h"
+#include "commands/trigger.h"
 #include "executor/spi.h"
 #include "nodes/makefuncs.h"
 #include "nodes/parsenodes.h"
 #include "parser/parse_type.h"
 #include "storage/lockdefs.h"
 #include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
 #include "utils/syscache.h"
 
 
+/*
+ * Formations are seldom changed, so we cache them in each backend until the
+ * pgautofailover.formation relation is invalidated. The trigger function
+ * invalidate_formation_cache sends that invalidation when the table changes.
+ */
+typedef struct FormationCacheEntry
+{
+	char formationId[NAMEDATALEN];
+	AutoFailoverFormation formation;
+} FormationCacheEntry;
+
+static HTAB *FormationCacheHash = NULL;
+static Oid FormationCacheRelationId = InvalidOid;
+static bool FormationCacheCallbackRegistered = false;
+
+static AutoFailoverFormation * LookupFormationCache(const char *formationId);
+static void StoreFormationCache(AutoFailoverFormation *formation);
+static void FormationCacheRelcacheCallback(Datum argument, Oid relationId);
+
+
 PG_FUNCTION_INFO_V1(create_formation);
 PG_FUNCTION_INFO_V1(drop_formation);
 PG_FUNCTION_INFO_V1(enable_secondary);
 PG_FUNCTION_INFO_V1(disable_secondary);
+PG_FUNCTION_INFO_V1(invalidate_formation_cache);
 
 
 /*
@@ -61,6 +86,12 @@ GetFormation(const char *formationId)
 	const char *selectQuery =
 		"SELECT * FROM " AUTO_FAILOVER_FORMATION_TABLE " WHERE formationId = $1";
 
+	formation = LookupFormationCache(formationId);
+	if (formation != NULL)
+	{
+		return formation;
+	}
+
 	SPI_connect();
 
 	spiStatus = SPI_execute_with_args(selectQuery, argCount, argTypes, argValues,
@@ -89,6 +120,13 @@ GetFormation(const char *formationId)
 		Datum opt_secondary =
 			heap_getattr(heapTuple, Anum_pgautofailover_formation_opt_secondary,
 						 tupleDescriptor, &isNull);
+		Datum numberSyncStandbys =
+			heap_getattr(heapTuple,
+						 Anum_pgautofailover_formation_number_sync_standbys,
+						 tupleDescriptor, &isNull);
+		Datum synchronousCommit =
+			heap_getattr(heapTuple, Anum_pgautofailover_formation_synchronous_commit,
+						 tupleDescriptor, &isNull);
 
 		formation =
 			(AutoFailoverFormation *) palloc0(sizeof(AutoFailoverFormation));
@@ -97,6 +135,9 @@ GetFormation(const char *formationId)
 		formation->kind = FormationKindFromString(TextDatumGetCString(kind));
 		strlcpy(formation->dbname, NameStr(*DatumGetName(dbname)), NAMEDATALEN);
 		formation->opt_secondary = DatumGetBool(opt_secondary);
+		formation->numberSyncStandbys = DatumGetInt32(numberSyncStandbys);
+		strlcpy(formation->synchronousCommit,
+				TextDatumGetCString(synchronousCommit), NAMEDATALEN);
 
 		MemoryContextSwitchTo(spiContext);
 	}
@@ -107,10 +148,144 @@ GetFormation(const char *formationId)
 
 	SPI_finish();
 
+	if (formation != NULL)
+	{
+		StoreFormationCache(formation);
+	}
+
 	return formation;
 }
 
 
+/*
+ * LookupFormationCache returns a copy of the cached formation with the given
+ * name, or NULL when we don't have it.
+ */
+static AutoFailoverFormation *
+LookupFormationCache(const char *formationId)
+{
+	FormationCacheEntry *entry = NULL;
+	AutoFailoverFormation *formation = NULL;
+
+	if (FormationCacheHash == NULL || strlen(formationId) >= NAMEDATALEN)
+	{
+		return NULL;
+	}
+
+	entry = (FormationCacheEntry *) hash_search(FormationCacheHash, formationId,
+												HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		return NULL;
+	}
+
+	formation = (AutoFailoverFormation *) palloc(sizeof(AutoFailoverFormation));
+	*formation = entry->formation;
+	formation->formationId = pstrdup(entry->formationId);
+
+	return formation;
+}
+
+
+/*
+ * StoreFormationCache adds the given formation to the cache.
+ */
+static void
+StoreFormationCache(AutoFailoverFormation *formation)
+{
+	FormationCacheEntry *entry = NULL;
+	Oid relationId = InvalidOid;
+
+	if (strlen(formation->formationId) >= NAMEDATALEN)
+	{
+		return;
+	}
+
+	if (!FormationCacheCallbackRegistered)
+	{
+		CacheRegisterRelcacheCallback(FormationCacheRelcacheCallback, (Datum) 0);
+		FormationCacheCallbackRegistered = true;
+	}
+
+	relationId = pgAutoFailoverRelationId(AUTO_FAILOVER_FORMATION_TABLE_NAME);
+
+	if (FormationCacheHash == NULL || FormationCacheRelationId != relationId)
+	{
+		HASHCTL info;
+
+		InvalidateFormationCache();
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = NAMEDATALEN;
+		info.entrysize = sizeof(FormationCacheEntry);
+		info.hcxt = CacheMemoryContext;
+
+		FormationCacheHash = hash_create("pg_auto_failover formations", 8, &info,
+										 HASH_ELEM | HASH_CONTEXT);
+		FormationCacheRelationId = relationId;
+	}
+
+	entry = (FormationCacheEntry *) hash_search(FormationCacheHash,
+												formation->formationId,
+												HASH_ENTER, NULL);
+	entry->formation = *formation;
+	entry->formation.formationId = NULL;
+}
+
+
+/*
+ * InvalidateFormationCache forgets about all the formations we have cached.
+ */
+void
+InvalidateFormationCache(void)
+{
+	if (FormationCacheHash != NULL)
+	{
+		hash_destroy(FormationCacheHash);
+	}
+
+	FormationCacheHash = NULL;
+}
+
+
+/*
+ * FormationCacheRelcacheCallback resets the cache when
+ * pgautofailover.formation is invalidated, or when all the relations are.
+ */
+static void
+FormationCacheRelcacheCallback(Datum argument, Oid relationId)
+{
+	if (relationId == InvalidOid || relationId == FormationCacheRelationId)
+	{
+		InvalidateFormationCache();
+	}
+}
+
+
+/*
+ * invalidate_formation_cache is a statement level trigger on the formation
+ * table. It resets our own formation cache right away, and has the other
+ * backends reset theirs when the current transaction commits.
+ */
+Datum
+invalidate_formation_cache(PG_FUNCTION_ARGS)
+{
+	TriggerData *triggerData = (TriggerData *) fcinfo->context;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("invalidate_formation_cache must be called as a trigger")));
+	}
+
+	InvalidateFormationCache();
+	CacheInvalidateRelcache(triggerData->tg_relation);
+
+	PG_RETURN_POINTER(NULL);
+}
+
+
 /*
  * create_formation inserts a new tuple in pgautofailover.formation table, of
  * the given formation kind. We know only two formation kind at the moment,
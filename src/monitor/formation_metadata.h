@@ -21,11 +21,13 @@
 #define AUTO_FAILOVER_FORMATION_TABLE_NAME "formation"
 
 /* column indexes for pgautofailover.node */
-#define Natts_pgautofailover_formation 4
+#define Natts_pgautofailover_formation 6
 #define Anum_pgautofailover_formation_formationid 1
 #define Anum_pgautofailover_formation_kind 2
 #define Anum_pgautofailover_formation_dbname 3
 #define Anum_pgautofailover_formation_opt_secondary 4
+#define Anum_pgautofailover_formation_number_sync_standbys 5
+#define Anum_pgautofailover_formation_synchronous_commit 6
 
 
 /* formation.kind: "pgsql" or "citus" */
@@ -47,11 +49,14 @@ typedef struct AutoFailoverFormation
 	FormationKind kind;
 	char dbname[NAMEDATALEN];
 	bool opt_secondary;
+	int numberSyncStandbys;
+	char synchronousCommit[NAMEDATALEN];
 } AutoFailoverFormation;
 
 
 /* public function declarations */
 extern AutoFailoverFormation *GetFormation(const char *formationId);
+extern void InvalidateFormationCache(void);
 extern void AddFormation(const char *formationId, FormationKind kind, Name dbname,
 							  bool optionSecondary);
 extern void RemoveFormation(const char *formationId);
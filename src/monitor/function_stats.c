@@ -0,0 +1,828 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/function_stats.c
+ *
+ * Call statistics of the pg_auto_failover functions.
+ *
+ * We count the calls to the functions of the pgautofailover schema, how long
+ * they take, how long they wait on the formation and group locks, and how
+ * many queries they run, so that the load of the monitor may be known. The
+ * counters are kept in shared memory and are exposed by the
+ * pgautofailover.stat_functions view.
+ *
+ * Functions are timed using the function manager hook, the same that
+ * sepgsql uses, which PostgreSQL calls around the functions for which
+ * needs_fmgr_hook returns true. That covers the C functions as well as the
+ * SQL ones, such as pgautofailover.current_state, which the planner then
+ * doesn't inline anymore.
+ *
+ * When pgautofailover.track_write_usage is on, we also account for the WAL,
+ * the buffers and the HOT updates of the node table of the writes that the
+ * monitor does the most: keeper reports, health check results and events.
+ * Those are exposed by the pgautofailover.stat_writes view.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "function_stats.h"
+#include "metadata.h"
+#include "node_metadata.h"
+
+#include "access/transam.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/namespace.h"
+#include "executor/executor.h"
+#include "pgstat.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/tuplestore.h"
+
+
+/* functions are identified by their database and their OID */
+typedef struct FunctionStatsKey
+{
+	Oid			dboid;
+	Oid			funcId;
+} FunctionStatsKey;
+
+/* counters of a function since the monitor started */
+typedef struct FunctionStatsEntry
+{
+	FunctionStatsKey key;
+	slock_t		mutex;			/* protects the counters below */
+	int64		calls;
+	int64		errors;
+	double		totalTimeMs;
+	double		maxTimeMs;
+	double		lockWaitTimeMs;
+	int64		queries;
+} FunctionStatsEntry;
+
+/* counters of a kind of write since the monitor started, in all databases */
+typedef struct WriteStatsEntry
+{
+	int64		calls;
+	int64		walCalls;
+	int64		walBytes;
+	int64		sharedBlksHit;
+	int64		sharedBlksRead;
+	int64		sharedBlksDirtied;
+	int64		sharedBlksWritten;
+	int64		tuplesUpdated;
+	int64		tuplesHotUpdated;
+} WriteStatsEntry;
+
+/*
+ * The lock is taken in shared mode to update the counters of a function,
+ * which the entry mutex protects, and in exclusive mode to add a function to
+ * the hash.
+ */
+typedef struct FunctionStatsControlData
+{
+	int				trancheId;
+	char		   *lockTrancheName;
+	LWLock			lock;
+
+	/* protects the write statistics */
+	slock_t			writeStatsMutex;
+	WriteStatsEntry writeStats[WRITE_OPERATION_COUNT];
+} FunctionStatsControlData;
+
+static const char *WriteOperationNames[WRITE_OPERATION_COUNT] = {
+	"report_node_state",
+	"set_node_health_state",
+	"insert_event"
+};
+
+/*
+ * FunctionCall is a call to a function that we track, allocated in the
+ * memory context of the function, so that a set returning function that the
+ * executor calls once per row is counted as a single call.
+ */
+typedef struct FunctionCall
+{
+	bool		tracked;
+	bool		inProgress;
+	instr_time	startTime;
+	double		elapsedMs;
+	double		lockWaitTimeMs;
+	int64		queries;
+	int			openQueries;
+	struct FunctionCall *caller;
+} FunctionCall;
+
+
+static FunctionStatsControlData *FunctionStatsControl = NULL;
+static HTAB *FunctionStatsHash = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static needs_fmgr_hook_type prev_needs_fmgr_hook = NULL;
+static fmgr_hook_type prev_fmgr_hook = NULL;
+static ExecutorStart_hook_type prev_ExecutorStart_hook = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd_hook = NULL;
+
+/* innermost call that we track in this backend, if any */
+static FunctionCall *CurrentFunctionCall = NULL;
+
+/* GUC variables */
+bool TrackWriteUsage = false;
+
+
+static size_t FunctionStatsShmemSize(void);
+static void FunctionStatsShmemInit(void);
+static bool FunctionStatsNeedsFmgrHook(Oid functionId);
+static bool IsTrackedFunction(Oid functionId);
+static void FunctionStatsFmgrHook(FmgrHookEventType event,
+								  FmgrInfo *flinfo, Datum *private);
+static void FunctionStatsExecutorStart(QueryDesc *queryDesc, int eflags);
+static void FunctionStatsExecutorEnd(QueryDesc *queryDesc);
+static void RecordFunctionCall(Oid functionId, FunctionCall *call, bool failed);
+static void GetNodeTableUpdates(int64 *tuplesUpdated, int64 *tuplesHotUpdated);
+
+
+/* SQL-callable function declarations */
+PG_FUNCTION_INFO_V1(function_stats);
+PG_FUNCTION_INFO_V1(write_stats);
+
+
+/*
+ * InitializeFunctionStats, called at server start, requests the shared
+ * memory for the function statistics and installs the hooks that maintain
+ * them.
+ */
+void
+InitializeFunctionStats(void)
+{
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(FunctionStatsShmemSize());
+	}
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = FunctionStatsShmemInit;
+
+	prev_needs_fmgr_hook = needs_fmgr_hook;
+	needs_fmgr_hook = FunctionStatsNeedsFmgrHook;
+
+	prev_fmgr_hook = fmgr_hook;
+	fmgr_hook = FunctionStatsFmgrHook;
+
+	prev_ExecutorStart_hook = ExecutorStart_hook;
+	ExecutorStart_hook = FunctionStatsExecutorStart;
+
+	prev_ExecutorEnd_hook = ExecutorEnd_hook;
+	ExecutorEnd_hook = FunctionStatsExecutorEnd;
+}
+
+
+/*
+ * FunctionStatsShmemSize computes how much shared memory is required.
+ */
+static size_t
+FunctionStatsShmemSize(void)
+{
+	Size size = 0;
+
+	size = add_size(size, sizeof(FunctionStatsControlData));
+	size = add_size(size, hash_estimate_size(MAX_FUNCTION_STATS,
+											 sizeof(FunctionStatsEntry)));
+
+	return size;
+}
+
+
+/*
+ * FunctionStatsShmemInit initializes the shared memory of the function
+ * statistics.
+ */
+static void
+FunctionStatsShmemInit(void)
+{
+	bool alreadyInitialized = false;
+	HASHCTL hashInfo;
+	int hashFlags = 0;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	FunctionStatsControl =
+		(FunctionStatsControlData *)
+		ShmemInitStruct("pg_auto_failover Function Stats",
+						sizeof(FunctionStatsControlData),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		FunctionStatsControl->trancheId = LWLockNewTrancheId();
+		FunctionStatsControl->lockTrancheName = "pg_auto_failover Function Stats";
+		LWLockRegisterTranche(FunctionStatsControl->trancheId,
+							  FunctionStatsControl->lockTrancheName);
+
+		LWLockInitialize(&FunctionStatsControl->lock,
+						 FunctionStatsControl->trancheId);
+
+		SpinLockInit(&FunctionStatsControl->writeStatsMutex);
+		memset(FunctionStatsControl->writeStats, 0,
+			   sizeof(FunctionStatsControl->writeStats));
+	}
+
+	memset(&hashInfo, 0, sizeof(hashInfo));
+	hashInfo.keysize = sizeof(FunctionStatsKey);
+	hashInfo.entrysize = sizeof(FunctionStatsEntry);
+	hashInfo.hash = tag_hash;
+	hashFlags = (HASH_ELEM | HASH_FUNCTION);
+
+	FunctionStatsHash = ShmemInitHash("pg_auto_failover Function Stats Hash",
+									  MAX_FUNCTION_STATS,
+									  MAX_FUNCTION_STATS,
+									  &hashInfo, hashFlags);
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * FunctionStatsNeedsFmgrHook returns whether the function manager should call
+ * FunctionStatsFmgrHook around the given function.
+ */
+static bool
+FunctionStatsNeedsFmgrHook(Oid functionId)
+{
+	if (prev_needs_fmgr_hook != NULL && prev_needs_fmgr_hook(functionId))
+	{
+		return true;
+	}
+
+	return IsTrackedFunction(functionId);
+}
+
+
+/*
+ * IsTrackedFunction returns whether the given function is one of the
+ * pgautofailover schema, which are the functions we keep statistics for.
+ */
+static bool
+IsTrackedFunction(Oid functionId)
+{
+	Oid namespaceId = InvalidOid;
+
+	/* skip the built-in functions early, that's most of the calls */
+	if (functionId < FirstNormalObjectId || FunctionStatsControl == NULL)
+	{
+		return false;
+	}
+
+	namespaceId = get_namespace_oid(AUTO_FAILOVER_SCHEMA_NAME, true);
+
+	return OidIsValid(namespaceId)
+		   && get_func_namespace(functionId) == namespaceId;
+}
+
+
+/*
+ * FunctionStatsFmgrHook times each call to the functions we track, and
+ * records them once they are done.
+ *
+ * A set returning function may be called once per row of its result. We then
+ * consider that the call is done when the queries that it started are done,
+ * which is the case of SQL functions, and otherwise after the first call,
+ * which is the case of our C functions as they materialize their result.
+ */
+static void
+FunctionStatsFmgrHook(FmgrHookEventType event, FmgrInfo *flinfo, Datum *private)
+{
+	FunctionCall *call = (FunctionCall *) DatumGetPointer(*private);
+
+	if (prev_fmgr_hook != NULL)
+	{
+		prev_fmgr_hook(event, flinfo, private);
+	}
+
+	if (call == NULL)
+	{
+		if (event != FHET_START)
+		{
+			return;
+		}
+
+		call = (FunctionCall *) MemoryContextAllocZero(flinfo->fn_mcxt,
+													   sizeof(FunctionCall));
+		call->tracked = IsTrackedFunction(flinfo->fn_oid);
+
+		*private = PointerGetDatum(call);
+	}
+
+	if (!call->tracked)
+	{
+		return;
+	}
+
+	switch (event)
+	{
+		case FHET_START:
+		{
+			if (!call->inProgress)
+			{
+				call->inProgress = true;
+				call->elapsedMs = 0;
+				call->lockWaitTimeMs = 0;
+				call->queries = 0;
+				call->openQueries = 0;
+			}
+
+			call->caller = CurrentFunctionCall;
+			CurrentFunctionCall = call;
+
+			INSTR_TIME_SET_CURRENT(call->startTime);
+			break;
+		}
+
+		case FHET_END:
+		case FHET_ABORT:
+		{
+			instr_time duration;
+			bool failed = event == FHET_ABORT;
+
+			INSTR_TIME_SET_CURRENT(duration);
+			INSTR_TIME_SUBTRACT(duration, call->startTime);
+
+			call->elapsedMs += INSTR_TIME_GET_MILLISEC(duration);
+			CurrentFunctionCall = call->caller;
+
+			if (failed || !flinfo->fn_retset || call->openQueries <= 0)
+			{
+				call->inProgress = false;
+
+				RecordFunctionCall(flinfo->fn_oid, call, failed);
+			}
+			break;
+		}
+
+		default:
+		{
+			/* nothing to do */
+			break;
+		}
+	}
+}
+
+
+/*
+ * FunctionStatsExecutorStart counts the queries that the function we track
+ * runs, through SPI or as the body of a SQL function.
+ */
+static void
+FunctionStatsExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	if (prev_ExecutorStart_hook != NULL)
+	{
+		prev_ExecutorStart_hook(queryDesc, eflags);
+	}
+	else
+	{
+		standard_ExecutorStart(queryDesc, eflags);
+	}
+
+	if (CurrentFunctionCall != NULL && !(eflags & EXEC_FLAG_EXPLAIN_ONLY))
+	{
+		CurrentFunctionCall->queries++;
+		CurrentFunctionCall->openQueries++;
+	}
+}
+
+
+/*
+ * FunctionStatsExecutorEnd follows the queries of the function we track that
+ * are done, see FunctionStatsFmgrHook.
+ */
+static void
+FunctionStatsExecutorEnd(QueryDesc *queryDesc)
+{
+	if (CurrentFunctionCall != NULL)
+	{
+		CurrentFunctionCall->openQueries--;
+	}
+
+	if (prev_ExecutorEnd_hook != NULL)
+	{
+		prev_ExecutorEnd_hook(queryDesc);
+	}
+	else
+	{
+		standard_ExecutorEnd(queryDesc);
+	}
+}
+
+
+/*
+ * FunctionStatsAddLockWait adds the time since startTime to the lock wait
+ * time of the current call, see LockFormation and LockNodeGroup.
+ */
+void
+FunctionStatsAddLockWait(instr_time startTime)
+{
+	instr_time duration;
+
+	if (CurrentFunctionCall == NULL)
+	{
+		return;
+	}
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, startTime);
+
+	CurrentFunctionCall->lockWaitTimeMs += INSTR_TIME_GET_MILLISEC(duration);
+}
+
+
+/*
+ * WriteUsageStart registers the WAL and buffer usage of the current backend
+ * before a write, when pgautofailover.track_write_usage is on.
+ *
+ * Before Postgres 13 there's no per-backend WAL counter, so we use the WAL
+ * insert position instead: the bytes that we count for a write go from the
+ * insert position at its start to the end of the last record that it
+ * inserted, which includes any WAL that concurrent backends inserted in
+ * between.
+ */
+void
+WriteUsageStart(WriteUsage *usage)
+{
+	usage->tracked = TrackWriteUsage && FunctionStatsControl != NULL;
+
+	if (!usage->tracked)
+	{
+		return;
+	}
+
+	usage->bufferUsage = pgBufferUsage;
+	usage->insertLSN = GetXLogInsertRecPtr();
+	usage->lastRecordEnd = XactLastRecEnd;
+
+	GetNodeTableUpdates(&(usage->tuplesUpdated), &(usage->tuplesHotUpdated));
+}
+
+
+/*
+ * WriteUsageEnd adds the usage since WriteUsageStart to the statistics of the
+ * given kind of write.
+ */
+void
+WriteUsageEnd(WriteOperation operation, WriteUsage *usage)
+{
+	WriteStatsEntry *entry = NULL;
+	int64 tuplesUpdated = 0;
+	int64 tuplesHotUpdated = 0;
+	bool wroteWal = false;
+	int64 walBytes = 0;
+
+	if (!usage->tracked)
+	{
+		return;
+	}
+
+	GetNodeTableUpdates(&tuplesUpdated, &tuplesHotUpdated);
+
+	wroteWal = XactLastRecEnd != usage->lastRecordEnd &&
+			   XactLastRecEnd > usage->insertLSN;
+
+	if (wroteWal)
+	{
+		walBytes = (int64) (XactLastRecEnd - usage->insertLSN);
+	}
+
+	entry = &(FunctionStatsControl->writeStats[operation]);
+
+	SpinLockAcquire(&FunctionStatsControl->writeStatsMutex);
+
+	entry->calls++;
+	entry->walCalls += wroteWal ? 1 : 0;
+	entry->walBytes += walBytes;
+	entry->sharedBlksHit +=
+		pgBufferUsage.shared_blks_hit - usage->bufferUsage.shared_blks_hit;
+	entry->sharedBlksRead +=
+		pgBufferUsage.shared_blks_read - usage->bufferUsage.shared_blks_read;
+	entry->sharedBlksDirtied +=
+		pgBufferUsage.shared_blks_dirtied - usage->bufferUsage.shared_blks_dirtied;
+	entry->sharedBlksWritten +=
+		pgBufferUsage.shared_blks_written - usage->bufferUsage.shared_blks_written;
+	entry->tuplesUpdated += tuplesUpdated - usage->tuplesUpdated;
+	entry->tuplesHotUpdated += tuplesHotUpdated - usage->tuplesHotUpdated;
+
+	SpinLockRelease(&FunctionStatsControl->writeStatsMutex);
+}
+
+
+/*
+ * GetNodeTableUpdates returns how many tuples of the node table the current
+ * backend updated, and how many of those were HOT updates, from the counters
+ * that the statistics collector has not been sent yet. Updates are counted
+ * at the level of their (sub)transaction until it commits, HOT updates right
+ * away.
+ */
+static void
+GetNodeTableUpdates(int64 *tuplesUpdated, int64 *tuplesHotUpdated)
+{
+	Oid namespaceId = get_namespace_oid(AUTO_FAILOVER_SCHEMA_NAME, true);
+	Oid nodeTableId = InvalidOid;
+	PgStat_TableStatus *tableStatus = NULL;
+	PgStat_TableXactStatus *xactStatus = NULL;
+
+	*tuplesUpdated = 0;
+	*tuplesHotUpdated = 0;
+
+	if (OidIsValid(namespaceId))
+	{
+		nodeTableId = get_relname_relid(AUTO_FAILOVER_NODE_TABLE_NAME,
+										namespaceId);
+	}
+
+	if (OidIsValid(nodeTableId))
+	{
+		tableStatus = find_tabstat_entry(nodeTableId);
+	}
+
+	if (tableStatus == NULL)
+	{
+		return;
+	}
+
+	*tuplesUpdated = tableStatus->t_counts.t_tuples_updated;
+	*tuplesHotUpdated = tableStatus->t_counts.t_tuples_hot_updated;
+
+	for (xactStatus = tableStatus->trans;
+		 xactStatus != NULL;
+		 xactStatus = xactStatus->upper)
+	{
+		*tuplesUpdated += xactStatus->tuples_updated;
+	}
+}
+
+
+/*
+ * RecordFunctionCall adds the given call to the counters of the function in
+ * shared memory. When there's no room left for a new function, we silently
+ * skip its statistics.
+ */
+static void
+RecordFunctionCall(Oid functionId, FunctionCall *call, bool failed)
+{
+	FunctionStatsKey key;
+	FunctionStatsEntry *entry = NULL;
+	bool found = false;
+
+	memset(&key, 0, sizeof(key));
+	key.dboid = MyDatabaseId;
+	key.funcId = functionId;
+
+	LWLockAcquire(&FunctionStatsControl->lock, LW_SHARED);
+
+	entry = (FunctionStatsEntry *) hash_search(FunctionStatsHash, &key,
+											   HASH_FIND, NULL);
+
+	if (entry == NULL)
+	{
+		LWLockRelease(&FunctionStatsControl->lock);
+		LWLockAcquire(&FunctionStatsControl->lock, LW_EXCLUSIVE);
+
+		entry = (FunctionStatsEntry *) hash_search(FunctionStatsHash, &key,
+												   HASH_ENTER_NULL, &found);
+
+		if (entry == NULL)
+		{
+			LWLockRelease(&FunctionStatsControl->lock);
+			return;
+		}
+
+		if (!found)
+		{
+			memset(((char *) entry) + sizeof(FunctionStatsKey), 0,
+				   sizeof(FunctionStatsEntry) - sizeof(FunctionStatsKey));
+			SpinLockInit(&entry->mutex);
+		}
+	}
+
+	SpinLockAcquire(&entry->mutex);
+
+	if (failed)
+	{
+		entry->errors++;
+	}
+	else
+	{
+		entry->calls++;
+		entry->totalTimeMs += call->elapsedMs;
+		entry->maxTimeMs = Max(entry->maxTimeMs, call->elapsedMs);
+		entry->lockWaitTimeMs += call->lockWaitTimeMs;
+		entry->queries += call->queries;
+	}
+
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(&FunctionStatsControl->lock);
+}
+
+
+/*
+ * function_stats returns the call statistics of the functions of the current
+ * database, by their OID.
+ */
+Datum
+function_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *resultSetInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupleDescriptor = NULL;
+	Tuplestorestate *tupleStore = NULL;
+	MemoryContext perQueryContext = NULL;
+	MemoryContext oldContext = NULL;
+	HASH_SEQ_STATUS status;
+	FunctionStatsEntry *entry = NULL;
+
+	if (resultSetInfo == NULL || !IsA(resultSetInfo, ReturnSetInfo))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	}
+
+	if (!(resultSetInfo->allowedModes & SFRM_Materialize))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		elog(ERROR, "return type must be a row type");
+	}
+
+	perQueryContext = resultSetInfo->econtext->ecxt_per_query_memory;
+	oldContext = MemoryContextSwitchTo(perQueryContext);
+
+	tupleDescriptor = CreateTupleDescCopy(tupleDescriptor);
+	tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultSetInfo->returnMode = SFRM_Materialize;
+	resultSetInfo->setResult = tupleStore;
+	resultSetInfo->setDesc = tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	if (FunctionStatsControl == NULL)
+	{
+		/* pg_auto_failover is not in shared_preload_libraries */
+		tuplestore_donestoring(tupleStore);
+
+		PG_RETURN_VOID();
+	}
+
+	LWLockAcquire(&FunctionStatsControl->lock, LW_SHARED);
+
+	hash_seq_init(&status, FunctionStatsHash);
+
+	while ((entry = (FunctionStatsEntry *) hash_seq_search(&status)) != NULL)
+	{
+		Datum values[FUNCTION_STATS_COLUMNS];
+		bool isNulls[FUNCTION_STATS_COLUMNS];
+		FunctionStatsEntry counters;
+
+		if (entry->key.dboid != MyDatabaseId)
+		{
+			continue;
+		}
+
+		SpinLockAcquire(&entry->mutex);
+		counters = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = ObjectIdGetDatum(counters.key.funcId);
+		values[1] = Int64GetDatum(counters.calls);
+		values[2] = Int64GetDatum(counters.errors);
+		values[3] = Float8GetDatum(counters.totalTimeMs);
+		values[4] = Float8GetDatum(counters.maxTimeMs);
+		values[5] = Float8GetDatum(counters.lockWaitTimeMs);
+		values[6] = Int64GetDatum(counters.queries);
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	LWLockRelease(&FunctionStatsControl->lock);
+
+	tuplestore_donestoring(tupleStore);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * write_stats returns the WAL and buffer usage of the writes of the monitor
+ * since it started, when pgautofailover.track_write_usage is on.
+ */
+Datum
+write_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *resultSetInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupleDescriptor = NULL;
+	Tuplestorestate *tupleStore = NULL;
+	MemoryContext perQueryContext = NULL;
+	MemoryContext oldContext = NULL;
+	WriteStatsEntry writeStats[WRITE_OPERATION_COUNT];
+	int operation = 0;
+
+	if (resultSetInfo == NULL || !IsA(resultSetInfo, ReturnSetInfo))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	}
+
+	if (!(resultSetInfo->allowedModes & SFRM_Materialize))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		elog(ERROR, "return type must be a row type");
+	}
+
+	perQueryContext = resultSetInfo->econtext->ecxt_per_query_memory;
+	oldContext = MemoryContextSwitchTo(perQueryContext);
+
+	tupleDescriptor = CreateTupleDescCopy(tupleDescriptor);
+	tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultSetInfo->returnMode = SFRM_Materialize;
+	resultSetInfo->setResult = tupleStore;
+	resultSetInfo->setDesc = tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	if (FunctionStatsControl == NULL)
+	{
+		/* pg_auto_failover is not in shared_preload_libraries */
+		tuplestore_donestoring(tupleStore);
+
+		PG_RETURN_VOID();
+	}
+
+	SpinLockAcquire(&FunctionStatsControl->writeStatsMutex);
+	memcpy(writeStats, FunctionStatsControl->writeStats, sizeof(writeStats));
+	SpinLockRelease(&FunctionStatsControl->writeStatsMutex);
+
+	for (operation = 0; operation < WRITE_OPERATION_COUNT; operation++)
+	{
+		Datum values[WRITE_STATS_COLUMNS];
+		bool isNulls[WRITE_STATS_COLUMNS];
+		WriteStatsEntry *entry = &(writeStats[operation]);
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = CStringGetTextDatum(WriteOperationNames[operation]);
+		values[1] = Int64GetDatum(entry->calls);
+		values[2] = Int64GetDatum(entry->walCalls);
+		values[3] = Int64GetDatum(entry->walBytes);
+		values[4] = Int64GetDatum(entry->sharedBlksHit);
+		values[5] = Int64GetDatum(entry->sharedBlksRead);
+		values[6] = Int64GetDatum(entry->sharedBlksDirtied);
+		values[7] = Int64GetDatum(entry->sharedBlksWritten);
+		values[8] = Int64GetDatum(entry->tuplesUpdated);
+		values[9] = Int64GetDatum(entry->tuplesHotUpdated);
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	tuplestore_donestoring(tupleStore);
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,62 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/function_stats.h
+ *
+ * Declarations for the call statistics of the pg_auto_failover functions.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "access/xlogdefs.h"
+#include "executor/instrument.h"
+#include "portability/instr_time.h"
+
+
+/* maximum number of functions we keep statistics for, in all databases */
+#define MAX_FUNCTION_STATS 512
+
+/* number of columns returned by pgautofailover.function_stats() */
+#define FUNCTION_STATS_COLUMNS 7
+
+/* number of columns returned by pgautofailover.write_stats() */
+#define WRITE_STATS_COLUMNS 10
+
+
+/* the writes of the monitor that we account for */
+typedef enum
+{
+	WRITE_REPORT_NODE_STATE = 0,
+	WRITE_SET_NODE_HEALTH_STATE,
+	WRITE_INSERT_EVENT,
+	WRITE_OPERATION_COUNT
+} WriteOperation;
+
+/*
+ * WriteUsage is what we know when a write starts, see WriteUsageStart.
+ */
+typedef struct WriteUsage
+{
+	bool		tracked;
+	BufferUsage bufferUsage;
+	XLogRecPtr	insertLSN;
+	XLogRecPtr	lastRecordEnd;
+	int64		tuplesUpdated;
+	int64		tuplesHotUpdated;
+} WriteUsage;
+
+
+/* GUC to enable the accounting of the writes */
+extern bool TrackWriteUsage;
+
+
+void InitializeFunctionStats(void);
+void FunctionStatsAddLockWait(instr_time startTime);
+void WriteUsageStart(WriteUsage *usage);
+void WriteUsageEnd(WriteOperation operation, WriteUsage *usage);
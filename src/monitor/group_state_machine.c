@@ -18,6 +18,7 @@
 
 #include "formation_metadata.h"
 #include "group_state_machine.h"
+#include "health_check.h"
 #include "node_metadata.h"
 #include "notifications.h"
 #include "replication_state.h"
@@ -36,14 +37,43 @@
 
 
 /* private function forward declarations */
+static bool ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode,
+											List *otherNodesList);
+static bool ProceedGroupStateForStandbyNode(AutoFailoverNode *activeNode,
+											AutoFailoverNode *primaryNode,
+											List *otherNodesList);
 static void AssignGoalState(AutoFailoverNode *pgAutoFailoverNode,
 							ReplicationState state, char *description);
+static void AssignStandbyCatchingUp(AutoFailoverNode *primaryNode,
+									AutoFailoverNode *standbyNode,
+									List *otherNodesList, char *reason);
+static void FollowNewPrimary(AutoFailoverNode *newPrimaryNode,
+							 AutoFailoverNode *oldPrimaryNode,
+							 List *otherNodesList, char *description);
+static bool HasJoiningStandby(List *otherNodesList);
 static bool IsDrainTimeExpired(AutoFailoverNode *pgAutoFailoverNode);
 static bool WalDifferenceWithin(AutoFailoverNode *secondaryNode,
 								AutoFailoverNode *primaryNode,
 								int64 delta);
 static bool IsHealthy(AutoFailoverNode *pgAutoFailoverNode);
 static bool IsUnhealthy(AutoFailoverNode *pgAutoFailoverNode);
+static bool ReceivesWalInTime(AutoFailoverNode *secondaryNode,
+							  AutoFailoverNode *primaryNode);
+static bool IsFailoverCandidate(AutoFailoverNode *secondaryNode,
+								AutoFailoverNode *primaryNode);
+static void RecordGroupLagSamples(AutoFailoverNode *activeNode,
+								  AutoFailoverNode *primaryNode,
+								  List *otherNodesList);
+static void RecordStandbyLagSample(AutoFailoverNode *primaryNode,
+								   AutoFailoverNode *secondaryNode);
+static int64 SmoothedWalLag(AutoFailoverNode *secondaryNode,
+							AutoFailoverNode *primaryNode);
+static bool WalLagWithin(AutoFailoverNode *secondaryNode,
+						 AutoFailoverNode *primaryNode, int64 delta);
+static bool IsLagging(AutoFailoverNode *secondaryNode,
+					  AutoFailoverNode *primaryNode);
+static bool IsLaggingForTooLong(AutoFailoverNode *secondaryNode,
+								AutoFailoverNode *primaryNode);
 
 /* GUC variables */
 int EnableSyncXlogThreshold = DEFAULT_XLOG_SEG_SIZE;
@@ -51,21 +81,33 @@ int PromoteXlogThreshold = DEFAULT_XLOG_SEG_SIZE;
 int DrainTimeoutMs = 30 * 1000;
 int UnhealthyTimeoutMs = 20 * 1000;
 int StartupGracePeriodMs = 10 * 1000;
+int SyncStandbyLagThreshold = 0;
+int SyncStandbyLagTimeoutMs = 10 * 1000;
+int WalLagSmoothingWindowMs = 5 * 1000;
 
 
 /*
  * ProceedGroupState proceeds the state machines of the group of which
  * the given node is part.
+ *
+ * A group has a primary node and any number of standby nodes. The primary
+ * node proceeds with each of its standby nodes, and a standby node proceeds
+ * with the primary node only: see ProceedGroupStateForPrimaryNode and
+ * ProceedGroupStateForStandbyNode.
  */
 bool
 ProceedGroupState(AutoFailoverNode *activeNode)
 {
-	AutoFailoverNode *otherNode = NULL;
-	AutoFailoverFormation *formation = GetFormation(activeNode->formationId);
+	AutoFailoverNode *primaryNode = NULL;
+	List *otherNodesList = AutoFailoverOtherNodesList(activeNode);
 
-	otherNode = OtherNodeInGroup(activeNode);
+	primaryNode = GetPrimaryNodeInGroup(activeNode->formationId,
+										activeNode->groupId);
 
-	if (otherNode == NULL
+	/* keep track of the replication lag of the standby nodes, if any */
+	RecordGroupLagSamples(activeNode, primaryNode, otherNodesList);
+
+	if (otherNodesList == NIL
 		&& !IsCurrentState(activeNode, REPLICATION_STATE_SINGLE))
 	{
 		char message[BUFSIZE];
@@ -82,27 +124,220 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 		return true;
 	}
 
-	/* single -> wait_primary when another node wants to become standby */
-	if (IsCurrentState(activeNode, REPLICATION_STATE_SINGLE) &&
-		IsCurrentState(otherNode, REPLICATION_STATE_WAIT_STANDBY))
+	if (primaryNode != NULL && primaryNode->nodeId == activeNode->nodeId)
 	{
-		char message[BUFSIZE];
+		return ProceedGroupStateForPrimaryNode(activeNode, otherNodesList);
+	}
 
-		LogAndNotifyMessage(
-			message, BUFSIZE,
-			"Setting goal state of %s:%d to wait_primary after %s:%d "
-			"joined.", activeNode->nodeName, activeNode->nodePort,
-			otherNode->nodeName, otherNode->nodePort);
+	return ProceedGroupStateForStandbyNode(activeNode, primaryNode,
+										   otherNodesList);
+}
 
-		/* prepare replication slot and pg_hba.conf */
-		AssignGoalState(activeNode, REPLICATION_STATE_WAIT_PRIMARY, message);
 
-		return true;
+/*
+ * ProceedGroupStateForPrimaryNode proceeds the state machine of the group when
+ * the active node is its primary node, which pairs with each of the standby
+ * nodes in turn.
+ */
+static bool
+ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode,
+								List *otherNodesList)
+{
+	ListCell *nodeCell = NULL;
+
+	foreach(nodeCell, otherNodesList)
+	{
+		AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+		/*
+		 * single -> wait_primary when another node wants to become standby,
+		 * or when standby nodes are left without their primary node
+		 */
+		if (IsCurrentState(primaryNode, REPLICATION_STATE_SINGLE) &&
+			(IsCurrentState(otherNode, REPLICATION_STATE_WAIT_STANDBY) ||
+			 IsCurrentState(otherNode, REPLICATION_STATE_CATCHINGUP) ||
+			 IsCurrentState(otherNode, REPLICATION_STATE_SECONDARY)))
+		{
+			char message[BUFSIZE];
+
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of %s:%d to wait_primary after %s:%d "
+				"joined.", primaryNode->nodeName, primaryNode->nodePort,
+				otherNode->nodeName, otherNode->nodePort);
+
+			/* prepare replication slots and pg_hba.conf */
+			AssignGoalState(primaryNode, REPLICATION_STATE_WAIT_PRIMARY,
+							message);
+
+			/* standby nodes that followed another primary catch up with us */
+			FollowNewPrimary(primaryNode, NULL, otherNodesList, message);
+
+			return true;
+		}
+
+		/* primary -> wait_primary when another node wants to become standby */
+		if (IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY) &&
+			IsCurrentState(otherNode, REPLICATION_STATE_WAIT_STANDBY))
+		{
+			char message[BUFSIZE];
+
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of %s:%d to wait_primary after %s:%d "
+				"joined.", primaryNode->nodeName, primaryNode->nodePort,
+				otherNode->nodeName, otherNode->nodePort);
+
+			/* prepare the replication slot and pg_hba.conf of the new node */
+			AssignGoalState(primaryNode, REPLICATION_STATE_WAIT_PRIMARY,
+							message);
+
+			return true;
+		}
+
+		/* secondary -> catchingup when secondary unhealthy */
+		if (IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY) &&
+			IsCurrentState(otherNode, REPLICATION_STATE_SECONDARY) &&
+			IsUnhealthy(otherNode))
+		{
+			AssignStandbyCatchingUp(primaryNode, otherNode, otherNodesList,
+									"became unhealthy");
+
+			return true;
+		}
+
+		/*
+		 * secondary -> catchingup when secondary lags behind for too long, so
+		 * that commits on the primary don't wait for it
+		 */
+		if (IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY) &&
+			IsCurrentState(otherNode, REPLICATION_STATE_SECONDARY) &&
+			IsLaggingForTooLong(otherNode, primaryNode))
+		{
+			char reason[BUFSIZE];
+
+			snprintf(reason, BUFSIZE,
+					 "lagged more than %d bytes behind for %d ms",
+					 SyncStandbyLagThreshold, SyncStandbyLagTimeoutMs);
+
+			AssignStandbyCatchingUp(primaryNode, otherNode, otherNodesList,
+									reason);
+
+			/* the next time the node lags, start counting again */
+			(void) RecordNodeWalLag(otherNode->nodeName, otherNode->nodePort,
+									false, GetCurrentTimestamp());
+
+			return true;
+		}
+
+		/*
+		 * prepare_promotion -> wait_primary + draining -> demoted when the
+		 * primary reports that it has stopped after draining, as in a planned
+		 * switchover: then there is no other primary to wait for.
+		 */
+		if (IsCurrentState(primaryNode, REPLICATION_STATE_DRAINING) &&
+			IsCurrentState(otherNode, REPLICATION_STATE_PREPARE_PROMOTION) &&
+			!primaryNode->pgIsRunning)
+		{
+			char message[BUFSIZE];
+
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of %s:%d to wait_primary and %s:%d to "
+				"demoted after %s:%d stopped once drained.",
+				otherNode->nodeName, otherNode->nodePort,
+				primaryNode->nodeName, primaryNode->nodePort,
+				primaryNode->nodeName, primaryNode->nodePort);
+
+			/* node is now taking writes */
+			AssignGoalState(otherNode, REPLICATION_STATE_WAIT_PRIMARY, message);
+
+			/* done draining, node is stopped */
+			AssignGoalState(primaryNode, REPLICATION_STATE_DEMOTED, message);
+
+			FollowNewPrimary(otherNode, primaryNode, otherNodesList, message);
+
+			return true;
+		}
+	}
+
+	/*
+	 * wait_primary -> primary when a secondary that streams from us can take
+	 * part in synchronous replication again, once no other node is joining
+	 */
+	if (IsCurrentState(primaryNode, REPLICATION_STATE_WAIT_PRIMARY) &&
+		!HasJoiningStandby(otherNodesList))
+	{
+		foreach(nodeCell, otherNodesList)
+		{
+			AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+			if (IsCurrentState(otherNode, REPLICATION_STATE_SECONDARY) &&
+				IsHealthy(otherNode) &&
+				!otherNode->walFromArchive &&
+				GetUpstreamNode(otherNode, primaryNode) == primaryNode &&
+				WalLagWithin(otherNode, primaryNode, EnableSyncXlogThreshold))
+			{
+				char message[BUFSIZE];
+
+				LogAndNotifyMessage(
+					message, BUFSIZE,
+					"Setting goal state of %s:%d to primary as %s:%d is a "
+					"healthy secondary.",
+					primaryNode->nodeName, primaryNode->nodePort,
+					otherNode->nodeName, otherNode->nodePort);
+
+				/* node can enable synchronous commit */
+				AssignGoalState(primaryNode, REPLICATION_STATE_PRIMARY, message);
+
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * ProceedGroupStateForStandbyNode proceeds the state machine of the group when
+ * the active node is one of its standby nodes, which pairs with the primary
+ * node of the group, when there is one.
+ */
+static bool
+ProceedGroupStateForStandbyNode(AutoFailoverNode *activeNode,
+								AutoFailoverNode *primaryNode,
+								List *otherNodesList)
+{
+	AutoFailoverFormation *formation = GetFormation(activeNode->formationId);
+
+	/* secondary -> single when the primary node was removed */
+	if (primaryNode == NULL)
+	{
+		if (IsCurrentState(activeNode, REPLICATION_STATE_SECONDARY) &&
+			IsHealthy(activeNode) &&
+			IsFailoverCandidate(activeNode, NULL))
+		{
+			char message[BUFSIZE];
+
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of %s:%d to single as the group has no "
+				"primary node.",
+				activeNode->nodeName, activeNode->nodePort);
+
+			/* the other standby nodes then follow us, see wait_primary */
+			AssignGoalState(activeNode, REPLICATION_STATE_SINGLE, message);
+
+			return true;
+		}
+
+		return false;
 	}
 
 	/* prepare_standby -> catchingup when other node is ready for replication */
 	if (IsCurrentState(activeNode, REPLICATION_STATE_WAIT_STANDBY) &&
-		IsCurrentState(otherNode, REPLICATION_STATE_WAIT_PRIMARY))
+		IsCurrentState(primaryNode, REPLICATION_STATE_WAIT_PRIMARY))
 	{
 		char message[BUFSIZE];
 
@@ -111,7 +346,7 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 			"Setting goal state of %s:%d to catchingup after %s:%d "
 			"converged to wait_primary.",
 			activeNode->nodeName, activeNode->nodePort,
-			otherNode->nodeName, otherNode->nodePort);
+			primaryNode->nodeName, primaryNode->nodePort);
 
 		/* start replication */
 		AssignGoalState(activeNode, REPLICATION_STATE_CATCHINGUP, message);
@@ -119,61 +354,84 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 		return true;
 	}
 
-	/* catchingup -> secondary + wait_primary -> primary when secondary caught up */
+	/*
+	 * catchingup -> secondary + wait_primary -> primary when secondary caught
+	 * up, and streams: WAL restored from the archive doesn't acknowledge
+	 * synchronous commits
+	 */
 	if (IsCurrentState(activeNode, REPLICATION_STATE_CATCHINGUP) &&
-		IsCurrentState(otherNode, REPLICATION_STATE_WAIT_PRIMARY) &&
+		(IsCurrentState(primaryNode, REPLICATION_STATE_WAIT_PRIMARY) ||
+		 IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY)) &&
 		IsHealthy(activeNode) &&
-		WalDifferenceWithin(activeNode, otherNode, EnableSyncXlogThreshold))
+		!activeNode->walFromArchive &&
+		WalLagWithin(activeNode, primaryNode, EnableSyncXlogThreshold))
 	{
 		char message[BUFSIZE];
 
-		LogAndNotifyMessage(
-			message, BUFSIZE,
-			"Setting goal state of %s:%d to primary and %s:%d to "
-			"secondary after %s:%d caught up.",
-			otherNode->nodeName, otherNode->nodePort,
-			activeNode->nodeName, activeNode->nodePort,
-			activeNode->nodeName, activeNode->nodePort);
+		/*
+		 * another node joining needs the primary to stay in wait_primary, and
+		 * a node that streams from another standby can't be synchronous
+		 */
+		if (IsCurrentState(primaryNode, REPLICATION_STATE_WAIT_PRIMARY) &&
+			!HasJoiningStandby(otherNodesList) &&
+			GetUpstreamNode(activeNode, primaryNode) == primaryNode)
+		{
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of %s:%d to primary and %s:%d to "
+				"secondary after %s:%d caught up.",
+				primaryNode->nodeName, primaryNode->nodePort,
+				activeNode->nodeName, activeNode->nodePort,
+				activeNode->nodeName, activeNode->nodePort);
+
+			/* other node can enable synchronous commit */
+			AssignGoalState(primaryNode, REPLICATION_STATE_PRIMARY, message);
+		}
+		else
+		{
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of %s:%d to secondary after it caught up.",
+				activeNode->nodeName, activeNode->nodePort);
+		}
 
 		/* node is ready for promotion */
 		AssignGoalState(activeNode, REPLICATION_STATE_SECONDARY, message);
 
-		/* other node can enable synchronous commit */
-		AssignGoalState(otherNode, REPLICATION_STATE_PRIMARY, message);
-
 		return true;
 	}
 
-	/* secondary -> catchingup + primary -> wait_primary when secondary unhealthy */
-	if (IsCurrentState(activeNode, REPLICATION_STATE_PRIMARY) &&
-		IsCurrentState(otherNode, REPLICATION_STATE_SECONDARY) &&
-		IsUnhealthy(otherNode))
+	/*
+	 * secondary -> catchingup when secondary lags behind for too long, so
+	 * that commits on the primary don't wait for it
+	 */
+	if (IsCurrentState(activeNode, REPLICATION_STATE_SECONDARY) &&
+		IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY) &&
+		IsLaggingForTooLong(activeNode, primaryNode))
 	{
-		char message[BUFSIZE];
+		char reason[BUFSIZE];
 
-		LogAndNotifyMessage(
-			message, BUFSIZE,
-			"Setting goal state of %s:%d to wait_primary and %s:%d to "
-			"catchingup after %s:%d became unhealthy.",
-			activeNode->nodeName, activeNode->nodePort,
-			otherNode->nodeName, otherNode->nodePort,
-			otherNode->nodeName, otherNode->nodePort);
+		snprintf(reason, BUFSIZE,
+				 "lagged more than %d bytes behind for %d ms",
+				 SyncStandbyLagThreshold, SyncStandbyLagTimeoutMs);
 
-		/* disable synchronous replication to maintain availability */
-		AssignGoalState(activeNode, REPLICATION_STATE_WAIT_PRIMARY, message);
+		AssignStandbyCatchingUp(primaryNode, activeNode, otherNodesList,
+								reason);
 
-		/* other node is behind, no longer eligible for promotion */
-		AssignGoalState(otherNode, REPLICATION_STATE_CATCHINGUP, message);
+		/* the next time the node lags, start counting again */
+		(void) RecordNodeWalLag(activeNode->nodeName, activeNode->nodePort,
+								false, GetCurrentTimestamp());
 
 		return true;
 	}
 
-
 	/* secondary -> prepare_promotion + primary -> draining when primary fails */
 	if (IsCurrentState(activeNode, REPLICATION_STATE_SECONDARY) &&
-		IsCurrentState(otherNode, REPLICATION_STATE_PRIMARY) &&
-		IsUnhealthy(otherNode) && IsHealthy(activeNode) &&
-		WalDifferenceWithin(activeNode, otherNode, PromoteXlogThreshold))
+		IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY) &&
+		IsUnhealthy(primaryNode) && IsHealthy(activeNode) &&
+		WalDifferenceWithin(activeNode, primaryNode, PromoteXlogThreshold) &&
+		ReceivesWalInTime(activeNode, primaryNode) &&
+		IsFailoverCandidate(activeNode, primaryNode))
 	{
 		char message[BUFSIZE];
 
@@ -181,15 +439,15 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 			message, BUFSIZE,
 			"Setting goal state of %s:%d to draining and %s:%d to "
 			"prepare_promotion after %s:%d became unhealthy.",
-			otherNode->nodeName, otherNode->nodePort,
+			primaryNode->nodeName, primaryNode->nodePort,
 			activeNode->nodeName, activeNode->nodePort,
-			otherNode->nodeName, otherNode->nodePort);
+			primaryNode->nodeName, primaryNode->nodePort);
 
 		/* keep reading until no more records are available */
 		AssignGoalState(activeNode, REPLICATION_STATE_PREPARE_PROMOTION, message);
 
 		/* shut down the primary */
-		AssignGoalState(otherNode, REPLICATION_STATE_DRAINING, message);
+		AssignGoalState(primaryNode, REPLICATION_STATE_DRAINING, message);
 
 		return true;
 	}
@@ -205,17 +463,65 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 			"Setting goal state of %s:%d to wait_primary and %s:%d to "
 			"demoted after the coordinator metadata was updated.",
 			activeNode->nodeName, activeNode->nodePort,
-			otherNode->nodeName, otherNode->nodePort);
+			primaryNode->nodeName, primaryNode->nodePort);
 
 		/* node is now taking writes */
 		AssignGoalState(activeNode, REPLICATION_STATE_WAIT_PRIMARY, message);
 
 		/* done draining, node is presumed dead */
-		AssignGoalState(otherNode, REPLICATION_STATE_DEMOTED, message);
+		AssignGoalState(primaryNode, REPLICATION_STATE_DEMOTED, message);
+
+		FollowNewPrimary(activeNode, primaryNode, otherNodesList, message);
+
+		return true;
+	}
+
+	/*
+	 * prepare_promotion -> wait_primary + draining -> demoted when the primary
+	 * reports that it has stopped after draining, as in a planned switchover:
+	 * then there is no other primary to wait for.
+	 */
+	if (IsCurrentState(activeNode, REPLICATION_STATE_PREPARE_PROMOTION) &&
+		IsCurrentState(primaryNode, REPLICATION_STATE_DRAINING) &&
+		!primaryNode->pgIsRunning)
+	{
+		char message[BUFSIZE];
+
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Setting goal state of %s:%d to wait_primary and %s:%d to "
+			"demoted after %s:%d stopped once drained.",
+			activeNode->nodeName, activeNode->nodePort,
+			primaryNode->nodeName, primaryNode->nodePort,
+			primaryNode->nodeName, primaryNode->nodePort);
+
+		/* node is now taking writes */
+		AssignGoalState(activeNode, REPLICATION_STATE_WAIT_PRIMARY, message);
+
+		/* done draining, node is stopped */
+		AssignGoalState(primaryNode, REPLICATION_STATE_DEMOTED, message);
+
+		FollowNewPrimary(activeNode, primaryNode, otherNodesList, message);
 
 		return true;
 	}
 
+	/*
+	 * prepare_promotion: while a healthy primary is still draining, give it
+	 * the demote timeout to report that it stopped, rather than stopping
+	 * replication and waiting for the demote timeout anyway.
+	 */
+	if (IsCurrentState(activeNode, REPLICATION_STATE_PREPARE_PROMOTION) &&
+		primaryNode->goalState == REPLICATION_STATE_DRAINING &&
+		primaryNode->reportedState != REPLICATION_STATE_DRAINING &&
+		IsHealthy(primaryNode) &&
+		!TimestampDifferenceExceeds(primaryNode->stateChangeTime,
+									GetCurrentTimestamp(),
+									DrainTimeoutMs))
+	{
+		return false;
+	}
+
 	/* prepare_promotion -> stop_replication when node is seeing no more writes */
 	if (IsCurrentState(activeNode, REPLICATION_STATE_PREPARE_PROMOTION))
 	{
@@ -226,7 +532,7 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 			"Setting goal state of %s:%d to demote_timeout and %s:%d to "
 			"stop_replication after %s:%d converged to "
 			"prepare_promotion.",
-			otherNode->nodeName, otherNode->nodePort,
+			primaryNode->nodeName, primaryNode->nodePort,
 			activeNode->nodeName, activeNode->nodePort,
 			activeNode->nodeName, activeNode->nodePort);
 
@@ -234,15 +540,15 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 		AssignGoalState(activeNode, REPLICATION_STATE_STOP_REPLICATION, message);
 
 		/* wait for possibly-alive primary to kill itself */
-		AssignGoalState(otherNode, REPLICATION_STATE_DEMOTE_TIMEOUT, message);
+		AssignGoalState(primaryNode, REPLICATION_STATE_DEMOTE_TIMEOUT, message);
 
 		return true;
 	}
 
 	/* draining -> demoted when drain time expires or primary reports it's drained */
 	if (IsCurrentState(activeNode, REPLICATION_STATE_STOP_REPLICATION) &&
-		(IsCurrentState(otherNode, REPLICATION_STATE_DEMOTE_TIMEOUT) ||
-		 IsDrainTimeExpired(otherNode)))
+		(IsCurrentState(primaryNode, REPLICATION_STATE_DEMOTE_TIMEOUT) ||
+		 IsDrainTimeExpired(primaryNode)))
 	{
 		char message[BUFSIZE];
 
@@ -251,13 +557,15 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 			"Setting goal state of %s:%d to wait_primary and %s:%d to "
 			"demoted after the demote timeout expired.",
 			activeNode->nodeName, activeNode->nodePort,
-			otherNode->nodeName, otherNode->nodePort);
+			primaryNode->nodeName, primaryNode->nodePort);
 
 		/* node is now taking writes */
 		AssignGoalState(activeNode, REPLICATION_STATE_WAIT_PRIMARY, message);
 
 		/* done draining, node is presumed dead */
-		AssignGoalState(otherNode, REPLICATION_STATE_DEMOTED, message);
+		AssignGoalState(primaryNode, REPLICATION_STATE_DEMOTED, message);
+
+		FollowNewPrimary(activeNode, primaryNode, otherNodesList, message);
 
 		return true;
 	}
@@ -273,29 +581,33 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 			"Setting goal state of %s:%d to wait_primary and %s:%d to "
 			"demoted after the coordinator metadata was updated.",
 			activeNode->nodeName, activeNode->nodePort,
-			otherNode->nodeName, otherNode->nodePort);
+			primaryNode->nodeName, primaryNode->nodePort);
 
 		/* node is now taking writes */
 		AssignGoalState(activeNode, REPLICATION_STATE_WAIT_PRIMARY, message);
 
 		/* done draining, node is presumed dead */
-		AssignGoalState(otherNode, REPLICATION_STATE_DEMOTED, message);
+		AssignGoalState(primaryNode, REPLICATION_STATE_DEMOTED, message);
+
+		FollowNewPrimary(activeNode, primaryNode, otherNodesList, message);
 
 		return true;
 	}
 
 	/* demoted -> catchingup when a new primary is ready */
 	if (IsCurrentState(activeNode, REPLICATION_STATE_DEMOTED) &&
-		IsCurrentState(otherNode, REPLICATION_STATE_WAIT_PRIMARY))
+		(IsCurrentState(primaryNode, REPLICATION_STATE_WAIT_PRIMARY) ||
+		 IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY)))
 	{
 		char message[BUFSIZE];
 
 		LogAndNotifyMessage(
 			message, BUFSIZE,
 			"Setting goal state of %s:%d to catchingup after it "
-			"converged to demotion and %s:%d converged to wait_primary.",
+			"converged to demotion and %s:%d converged to %s.",
 			activeNode->nodeName, activeNode->nodePort,
-			otherNode->nodeName, otherNode->nodePort);
+			primaryNode->nodeName, primaryNode->nodePort,
+			ReplicationStateGetName(primaryNode->reportedState));
 
 		/* it's safe to rejoin as a secondary */
 		AssignGoalState(activeNode, REPLICATION_STATE_CATCHINGUP, message);
@@ -307,6 +619,77 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 }
 
 
+/*
+ * GroupStateIsStable returns true when ProceedGroupState has nothing to do for
+ * the given node: the node reached a stable state, and the other nodes of the
+ * group that it pairs with are not in a situation that calls for a transition.
+ *
+ * When in doubt we return false, and the caller then runs ProceedGroupState.
+ */
+bool
+GroupStateIsStable(AutoFailoverNode *activeNode)
+{
+	AutoFailoverNode *primaryNode = NULL;
+	List *otherNodesList = NIL;
+	ListCell *nodeCell = NULL;
+
+	if (activeNode->goalState != activeNode->reportedState)
+	{
+		return false;
+	}
+
+	otherNodesList = AutoFailoverOtherNodesList(activeNode);
+
+	switch (activeNode->reportedState)
+	{
+		case REPLICATION_STATE_SINGLE:
+		{
+			return otherNodesList == NIL;
+		}
+
+		case REPLICATION_STATE_PRIMARY:
+		{
+			if (otherNodesList == NIL)
+			{
+				return false;
+			}
+
+			foreach(nodeCell, otherNodesList)
+			{
+				AutoFailoverNode *otherNode =
+					(AutoFailoverNode *) lfirst(nodeCell);
+
+				if (otherNode->goalState != otherNode->reportedState ||
+					IsUnhealthy(otherNode) ||
+					(otherNode->reportedState == REPLICATION_STATE_SECONDARY &&
+					 IsLagging(otherNode, activeNode)))
+				{
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		case REPLICATION_STATE_SECONDARY:
+		{
+			primaryNode = GetPrimaryNodeInGroup(activeNode->formationId,
+												activeNode->groupId);
+
+			return primaryNode != NULL &&
+				   primaryNode->goalState == primaryNode->reportedState &&
+				   !IsUnhealthy(primaryNode) &&
+				   !IsLagging(activeNode, primaryNode);
+		}
+
+		default:
+		{
+			return false;
+		}
+	}
+}
+
+
 /*
  * AssignGoalState assigns a new goal state to a AutoFailover node.
  */
@@ -335,6 +718,150 @@ AssignGoalState(AutoFailoverNode *pgAutoFailoverNode,
 }
 
 
+/*
+ * AssignStandbyCatchingUp assigns the catchingup state to the given secondary
+ * node, which is no longer eligible for promotion, for the given reason. When
+ * no other secondary node is left to take part in synchronous replication, we
+ * also assign the wait_primary state to the primary node, so that commits
+ * don't wait for a standby.
+ */
+static void
+AssignStandbyCatchingUp(AutoFailoverNode *primaryNode,
+						AutoFailoverNode *standbyNode,
+						List *otherNodesList, char *reason)
+{
+	char message[BUFSIZE];
+
+	if (HasOtherSyncStandby(primaryNode, standbyNode, otherNodesList))
+	{
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Setting goal state of %s:%d to catchingup after %s:%d %s.",
+			standbyNode->nodeName, standbyNode->nodePort,
+			standbyNode->nodeName, standbyNode->nodePort,
+			reason);
+	}
+	else
+	{
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Setting goal state of %s:%d to wait_primary and %s:%d to "
+			"catchingup after %s:%d %s.",
+			primaryNode->nodeName, primaryNode->nodePort,
+			standbyNode->nodeName, standbyNode->nodePort,
+			standbyNode->nodeName, standbyNode->nodePort,
+			reason);
+
+		/* disable synchronous replication to maintain availability */
+		AssignGoalState(primaryNode, REPLICATION_STATE_WAIT_PRIMARY, message);
+	}
+
+	/* other node is behind, no longer eligible for promotion */
+	AssignGoalState(standbyNode, REPLICATION_STATE_CATCHINGUP, message);
+}
+
+
+/*
+ * FollowNewPrimary assigns the catchingup state to the secondary nodes of the
+ * group other than the given new and old primary nodes. They followed the old
+ * primary, and are not eligible for promotion until they caught up with the
+ * new primary, which they follow from now on.
+ */
+static void
+FollowNewPrimary(AutoFailoverNode *newPrimaryNode,
+				 AutoFailoverNode *oldPrimaryNode,
+				 List *otherNodesList, char *description)
+{
+	ListCell *nodeCell = NULL;
+
+	foreach(nodeCell, otherNodesList)
+	{
+		AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (otherNode->nodeId == newPrimaryNode->nodeId ||
+			(oldPrimaryNode != NULL &&
+			 otherNode->nodeId == oldPrimaryNode->nodeId))
+		{
+			continue;
+		}
+
+		if (otherNode->goalState == REPLICATION_STATE_SECONDARY)
+		{
+			AssignGoalState(otherNode, REPLICATION_STATE_CATCHINGUP,
+							description);
+		}
+	}
+}
+
+
+/*
+ * HasOtherSyncStandby returns whether a healthy secondary node other than the
+ * given standby node is left in the group of the given primary node, so that
+ * synchronous replication may go on without the standby node.
+ *
+ * A secondary node that streams from another standby node doesn't take part
+ * in synchronous replication, unless it streams from the given standby node:
+ * it then follows the primary node again, see GetUpstreamNode.
+ */
+bool
+HasOtherSyncStandby(AutoFailoverNode *primaryNode,
+					AutoFailoverNode *standbyNode,
+					List *otherNodesList)
+{
+	ListCell *nodeCell = NULL;
+
+	foreach(nodeCell, otherNodesList)
+	{
+		AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (otherNode->nodeId == primaryNode->nodeId ||
+			otherNode->nodeId == standbyNode->nodeId)
+		{
+			continue;
+		}
+
+		if (IsCurrentState(otherNode, REPLICATION_STATE_SECONDARY) &&
+			IsHealthy(otherNode))
+		{
+			AutoFailoverNode *upstreamNode =
+				GetUpstreamNode(otherNode, primaryNode);
+
+			if (upstreamNode->nodeId == primaryNode->nodeId ||
+				upstreamNode->nodeId == standbyNode->nodeId)
+			{
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * HasJoiningStandby returns whether one of the given nodes is joining the
+ * group, and then needs the primary node to be in wait_primary to initialise
+ * from it.
+ */
+static bool
+HasJoiningStandby(List *otherNodesList)
+{
+	ListCell *nodeCell = NULL;
+
+	foreach(nodeCell, otherNodesList)
+	{
+		AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (otherNode->goalState == REPLICATION_STATE_WAIT_STANDBY)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
 /*
  * WalDifferenceWithin returns whether the most recently reported relative log
  * position of the given nodes is within the specified bound. Returns false if
@@ -369,6 +896,151 @@ WalDifferenceWithin(AutoFailoverNode *secondaryNode,
 }
 
 
+/*
+ * RecordGroupLagSamples records a sample of the replication lag of the standby
+ * nodes of the group in their history: all of them when the active node is
+ * the primary node, and otherwise the active node only.
+ */
+static void
+RecordGroupLagSamples(AutoFailoverNode *activeNode,
+					  AutoFailoverNode *primaryNode,
+					  List *otherNodesList)
+{
+	ListCell *nodeCell = NULL;
+
+	if (primaryNode == NULL)
+	{
+		return;
+	}
+
+	if (primaryNode->nodeId != activeNode->nodeId)
+	{
+		RecordStandbyLagSample(primaryNode, activeNode);
+		return;
+	}
+
+	foreach(nodeCell, otherNodesList)
+	{
+		AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+		RecordStandbyLagSample(activeNode, otherNode);
+	}
+}
+
+
+/*
+ * RecordStandbyLagSample records a sample of the replication lag of the given
+ * secondary node behind the given primary node, when both report a position
+ * in a state where the secondary replicates from the primary.
+ */
+static void
+RecordStandbyLagSample(AutoFailoverNode *primaryNode,
+					   AutoFailoverNode *secondaryNode)
+{
+	List *primaryStates = list_make2_int(REPLICATION_STATE_PRIMARY,
+										 REPLICATION_STATE_WAIT_PRIMARY);
+	List *secondaryStates = list_make2_int(REPLICATION_STATE_SECONDARY,
+										   REPLICATION_STATE_CATCHINGUP);
+
+	if (!list_member_int(primaryStates, primaryNode->reportedState) ||
+		!list_member_int(secondaryStates, secondaryNode->reportedState))
+	{
+		return;
+	}
+
+	if (primaryNode->reportedLSN == 0 || secondaryNode->reportedLSN == 0)
+	{
+		return;
+	}
+
+	RecordNodeLagSample(secondaryNode->nodeName, secondaryNode->nodePort,
+						Max(primaryNode->walReportTime,
+							secondaryNode->walReportTime),
+						secondaryNode->reportedLSN,
+						primaryNode->reportedLSN);
+}
+
+
+/*
+ * SmoothedWalLag returns how many bytes the given secondary node lags behind
+ * the given primary node, averaged over the lag samples of the last
+ * WalLagSmoothingWindowMs, so that a single report doesn't switch
+ * synchronous replication on or off. Without recent samples, we use the last
+ * reported LSNs of the nodes.
+ */
+static int64
+SmoothedWalLag(AutoFailoverNode *secondaryNode, AutoFailoverNode *primaryNode)
+{
+	LagSample samples[LAG_HISTORY_SIZE];
+	int sampleCount = 0;
+	int sampleIndex = 0;
+	int recentCount = 0;
+	int64 totalLag = 0;
+	TimestampTz now = GetCurrentTimestamp();
+
+	if (WalLagSmoothingWindowMs > 0)
+	{
+		sampleCount = GetNodeLagSamples(secondaryNode->nodeName,
+										secondaryNode->nodePort,
+										samples);
+	}
+
+	for (sampleIndex = 0; sampleIndex < sampleCount; sampleIndex++)
+	{
+		LagSample *sample = &(samples[sampleIndex]);
+
+		if (TimestampDifferenceExceeds(sample->sampleTime, now,
+									   WalLagSmoothingWindowMs))
+		{
+			continue;
+		}
+
+		if (sample->primaryLSN > sample->reportedLSN)
+		{
+			totalLag += sample->primaryLSN - sample->reportedLSN;
+		}
+
+		++recentCount;
+	}
+
+	if (recentCount > 0)
+	{
+		return totalLag / recentCount;
+	}
+
+	if (primaryNode->reportedLSN > secondaryNode->reportedLSN)
+	{
+		return primaryNode->reportedLSN - secondaryNode->reportedLSN;
+	}
+
+	return 0;
+}
+
+
+/*
+ * WalLagWithin returns whether the smoothed replication lag of the given
+ * secondary node behind the given primary node is within the specified
+ * bound. Returns false if either node has not reported a log position yet.
+ */
+static bool
+WalLagWithin(AutoFailoverNode *secondaryNode, AutoFailoverNode *primaryNode,
+			 int64 delta)
+{
+	if (secondaryNode == NULL || primaryNode == NULL)
+	{
+		return true;
+	}
+
+	if (secondaryNode->reportedLSN == 0 || primaryNode->reportedLSN == 0)
+	{
+		/* we don't have any data yet */
+		return false;
+	}
+
+	return SmoothedWalLag(secondaryNode, primaryNode) <= delta;
+}
+
+
 /*
  * IsHealthy returns whether the given node is heathly, meaning it succeeds the
  * last health check and its PostgreSQL instance is reported as running by the
@@ -460,3 +1132,158 @@ IsDrainTimeExpired(AutoFailoverNode *pgAutoFailoverNode)
 
 	return drainTimeExpired;
 }
+
+
+/*
+ * IsLagging returns whether the most recently reported LSN of the given
+ * secondary node is more than SyncStandbyLagThreshold bytes behind the one of
+ * the given primary node, and keeps track of since when that's the case in
+ * shared memory, see IsLaggingForTooLong.
+ *
+ * In formations where synchronous_commit is remote_apply, secondary nodes
+ * report their replay LSN rather than their received LSN, so that this lag,
+ * and the catching up one, is the one that commits on the primary wait for.
+ */
+static bool
+IsLagging(AutoFailoverNode *secondaryNode, AutoFailoverNode *primaryNode)
+{
+	bool lagging = false;
+
+	if (SyncStandbyLagThreshold == 0)
+	{
+		return false;
+	}
+
+	if (secondaryNode == NULL || primaryNode == NULL)
+	{
+		return false;
+	}
+
+	if (secondaryNode->reportedLSN != 0 && primaryNode->reportedLSN != 0)
+	{
+		lagging = SmoothedWalLag(secondaryNode, primaryNode) >
+				  (int64) SyncStandbyLagThreshold;
+	}
+
+	(void) RecordNodeWalLag(secondaryNode->nodeName, secondaryNode->nodePort,
+							lagging, GetCurrentTimestamp());
+
+	return lagging;
+}
+
+
+/*
+ * IsLaggingForTooLong returns whether the given secondary node has been
+ * lagging behind the given primary node for more than SyncStandbyLagTimeoutMs
+ * without interruption.
+ */
+static bool
+IsLaggingForTooLong(AutoFailoverNode *secondaryNode,
+					AutoFailoverNode *primaryNode)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	TimestampTz walLagStartTime = 0;
+
+	if (!IsLagging(secondaryNode, primaryNode))
+	{
+		return false;
+	}
+
+	walLagStartTime = RecordNodeWalLag(secondaryNode->nodeName,
+									   secondaryNode->nodePort,
+									   true, now);
+
+	return TimestampDifferenceExceeds(walLagStartTime, now,
+									  SyncStandbyLagTimeoutMs);
+}
+
+
+/*
+ * ReceivesWalInTime returns whether the given secondary node gets the WAL of
+ * the given primary node in time to be promoted. A node that streams gets it
+ * as it is written. A node that restores WAL from the archive only gets it
+ * once the archiver of the primary is done with a segment, so we only count
+ * on it when the primary reported an archive lag within PromoteXlogThreshold.
+ */
+static bool
+ReceivesWalInTime(AutoFailoverNode *secondaryNode, AutoFailoverNode *primaryNode)
+{
+	if (!secondaryNode->walFromArchive)
+	{
+		return true;
+	}
+
+	return primaryNode->archiveLag >= 0 &&
+		   primaryNode->archiveLag <= PromoteXlogThreshold;
+}
+
+
+/*
+ * IsFailoverCandidate returns whether the given secondary node is the one to
+ * promote when the given primary node fails, or when the group has no primary
+ * node anymore and primaryNode is NULL. Eligible nodes are the healthy
+ * secondary nodes of the group that have a non-zero candidate priority and,
+ * when there is a primary node, are within PromoteXlogThreshold of it and
+ * receive its WAL in time to be promoted. Among those we pick the preferred
+ * candidate, see IsPreferredCandidate.
+ */
+static bool
+IsFailoverCandidate(AutoFailoverNode *secondaryNode,
+					AutoFailoverNode *primaryNode)
+{
+	AutoFailoverNode *candidateNode = NULL;
+	ListCell *nodeCell = NULL;
+	List *groupNodeList =
+		AutoFailoverNodeGroup(secondaryNode->formationId,
+							  secondaryNode->groupId);
+
+	foreach(nodeCell, groupNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if ((primaryNode != NULL && node->nodeId == primaryNode->nodeId) ||
+			!IsCurrentState(node, REPLICATION_STATE_SECONDARY) ||
+			!IsHealthy(node) ||
+			node->candidatePriority <= 0)
+		{
+			continue;
+		}
+
+		if (primaryNode != NULL &&
+			(!WalDifferenceWithin(node, primaryNode, PromoteXlogThreshold) ||
+			 !ReceivesWalInTime(node, primaryNode)))
+		{
+			continue;
+		}
+
+		if (candidateNode == NULL || IsPreferredCandidate(node, candidateNode))
+		{
+			candidateNode = node;
+		}
+	}
+
+	return candidateNode != NULL && candidateNode->nodeId == secondaryNode->nodeId;
+}
+
+
+/*
+ * IsPreferredCandidate returns whether the given node is preferred over the
+ * given candidate node for promotion: we prefer the highest candidate
+ * priority, then the most advanced LSN, then the lowest node id so that all
+ * callers agree on the same node.
+ */
+bool
+IsPreferredCandidate(AutoFailoverNode *node, AutoFailoverNode *candidateNode)
+{
+	if (node->candidatePriority != candidateNode->candidatePriority)
+	{
+		return node->candidatePriority > candidateNode->candidatePriority;
+	}
+
+	if (node->reportedLSN != candidateNode->reportedLSN)
+	{
+		return node->reportedLSN > candidateNode->reportedLSN;
+	}
+
+	return node->nodeId < candidateNode->nodeId;
+}
@@ -33,6 +33,12 @@ typedef struct AutoFailoverNodeState
 
 /* public function declarations */
 extern bool ProceedGroupState(AutoFailoverNode *activeNode);
+extern bool GroupStateIsStable(AutoFailoverNode *activeNode);
+extern bool IsPreferredCandidate(AutoFailoverNode *node,
+								 AutoFailoverNode *candidateNode);
+extern bool HasOtherSyncStandby(AutoFailoverNode *primaryNode,
+								AutoFailoverNode *standbyNode,
+								List *otherNodesList);
 
 /* GUCs */
 extern int EnableSyncXlogThreshold;
@@ -40,3 +46,6 @@ extern int PromoteXlogThreshold;
 extern int DrainTimeoutMs;
 extern int UnhealthyTimeoutMs;
 extern int StartupGracePeriodMs;
+extern int SyncStandbyLagThreshold;
+extern int SyncStandbyLagTimeoutMs;
+extern int WalLagSmoothingWindowMs;
@@ -17,7 +17,9 @@
 
 #include "access/htup.h"
 #include "access/tupdesc.h"
+#include "access/xlogdefs.h"
 #include "nodes/pg_list.h"
+#include "utils/timestamp.h"
 
 
 /*
@@ -40,22 +42,126 @@ typedef struct NodeHealth
 	char *nodeName;
 	int nodePort;
 	NodeHealthState healthState;
+	TimestampTz reportTime;
 } NodeHealth;
 
 
+/* maximum value of pgautofailover.health_check_workers */
+#define MAX_HEALTH_CHECK_WORKERS 32
+
+/* node names are truncated to this size in shared memory */
+#define MAX_NODE_NAME_SIZE 256
+
+/*
+ * Connection latencies are counted in buckets of increasing sizes: bucket 0
+ * counts latencies under 1ms, bucket i latencies from 2^(i-1) to 2^i ms, and
+ * the last bucket counts all the latencies above that.
+ */
+#define HEALTH_CHECK_LATENCY_BUCKETS 16
+
+/*
+ * NodeReport is what we know about the last report of a keeper, as kept in
+ * shared memory. Reports that don't change the state of the node are only
+ * written to the node table every pgautofailover.node_report_flush_interval,
+ * flushTime is the time of the last report written there.
+ */
+typedef struct NodeReport
+{
+	TimestampTz reportTime;
+	XLogRecPtr reportedLSN;
+	TimestampTz walReportTime;
+	TimestampTz flushTime;
+	TimestampTz walLagStartTime;
+} NodeReport;
+
+/*
+ * HealthCheckStats holds the health check counters of a node since the
+ * monitor started, as exposed by pgautofailover.health_check_stats().
+ */
+typedef struct HealthCheckStats
+{
+	char nodeName[MAX_NODE_NAME_SIZE];
+	int nodePort;
+	int64 checkCount;
+	int64 unhealthyCount;
+	int64 retryCount;
+	int64 timeoutCount;
+	double lastLatencyMs;
+	double maxLatencyMs;
+	double totalLatencyMs;
+	int64 latencyHistogram[HEALTH_CHECK_LATENCY_BUCKETS];
+	TimestampTz lastCheckTime;
+} HealthCheckStats;
+
+
+/* number of replication lag samples kept for each node */
+#define LAG_HISTORY_SIZE 64
+
+/*
+ * LagSample is a sample of the replication lag of a standby node: the LSN it
+ * reported and the LSN of its primary at the time, and the round-trip time of
+ * the last health check of the node, or -1 when we don't know it.
+ */
+typedef struct LagSample
+{
+	TimestampTz sampleTime;
+	XLogRecPtr reportedLSN;
+	XLogRecPtr primaryLSN;
+	double healthCheckRttMs;
+} LagSample;
+
+/*
+ * NodeLagHistory holds the last replication lag samples of a node, oldest
+ * first, as exposed by pgautofailover.lag_history().
+ */
+typedef struct NodeLagHistory
+{
+	char nodeName[MAX_NODE_NAME_SIZE];
+	int nodePort;
+	int sampleCount;
+	LagSample samples[LAG_HISTORY_SIZE];
+} NodeLagHistory;
+
+
 /* GUCs to configure health checks */
 extern bool HealthChecksEnabled;
+extern int EventRetention;
+extern int NodeVacuumInterval;
+extern int NodeVacuumThreshold;
 extern int HealthCheckPeriod;
 extern int HealthCheckTimeout;
 extern int HealthCheckMaxRetries;
 extern int HealthCheckRetryDelay;
+extern bool HealthCheckPersistentConnections;
+extern int HealthCheckWorkers;
+extern double HealthCheckPhiThreshold;
+extern int HealthCheckMaxBackoff;
 
 
 extern void InitializeHealthCheckWorker(void);
 extern void HealthCheckWorkerMain(Datum arg);
 extern void HealthCheckWorkerLauncherMain(Datum arg);
-extern List * LoadNodeHealthList(void);
+extern List * LoadNodeHealthList(int workerIndex, int workerCount);
 extern NodeHealth * TupleToNodeHealth(HeapTuple heapTuple,
 									  TupleDesc tupleDescriptor);
-extern void SetNodeHealthState(char *nodeName, uint16 nodePort, int healthStatus);
+extern void SetNodeHealthStateList(List *nodeHealthList);
+extern void PurgeExpiredEvents(void);
+extern void PurgeTransitionTimings(void);
+extern void VacuumNodeTable(void);
+extern void FlushBufferedEvents(void);
+extern void WakeEventFlusher(Oid databaseId);
 extern void StopHealthCheckWorker(Oid databaseId);
+extern void RegisterNodeRegistryInvalidation(void);
+extern void InvalidateNodeRegistry(Oid databaseId);
+extern void RecordNodeHeartbeat(char *nodeName, int nodePort,
+								TimestampTz reportTime, XLogRecPtr reportedLSN,
+								bool flushed);
+extern bool GetNodeReport(char *nodeName, int nodePort, NodeReport *report);
+extern TimestampTz RecordNodeWalLag(char *nodeName, int nodePort,
+									bool lagging, TimestampTz now);
+extern List * GetHealthCheckStatsList(void);
+extern void RecordNodeLagSample(char *nodeName, int nodePort,
+								TimestampTz sampleTime, XLogRecPtr reportedLSN,
+								XLogRecPtr primaryLSN);
+extern int GetNodeLagSamples(char *nodeName, int nodePort, LagSample *samples);
+extern List * GetLagHistoryList(void);
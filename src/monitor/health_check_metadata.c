@@ -13,42 +13,118 @@
 #include "postgres.h"
 #include "miscadmin.h"
 
+#include "event_buffer.h"
+#include "function_stats.h"
+#include "group_state_machine.h"
 #include "health_check.h"
 #include "metadata.h"
+#include "node_metadata.h"
+#include "wait_events.h"
 
 #include "access/htup.h"
 #include "access/tupdesc.h"
 #include "access/xact.h"
+#include "catalog/pg_type.h"
 #include "commands/extension.h"
+#include "commands/trigger.h"
 #include "executor/spi.h"
+#include "funcapi.h"
 #include "lib/stringinfo.h"
 #include "nodes/pg_list.h"
+#include "nodes/plannodes.h"
+#include "parser/parser.h"
 #include "pgstat.h"
+#include "tcop/dest.h"
+#include "tcop/utility.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/memutils.h"
+#include "utils/pg_lsn.h"
+#include "utils/resowner.h"
 #include "utils/snapmgr.h"
+#include "utils/tuplestore.h"
 
 
 /* human-readable names for addressing columns of health check queries */
 #define TLIST_NUM_NODE_NAME 1
 #define TLIST_NUM_NODE_PORT 2
 #define TLIST_NUM_HEALTH_STATUS 3
+#define TLIST_NUM_REPORT_TIME 4
+
+/* number of columns returned by pgautofailover.health_check_stats() */
+#define HEALTH_CHECK_STATS_COLUMNS 11
+
+/* number of columns returned by pgautofailover.lag_history() */
+#define LAG_HISTORY_COLUMNS 7
+
+/* expired events are deleted by batches, see PurgeExpiredEvents */
+#define EVENT_PURGE_BATCH_SIZE 1000
+#define EVENT_PURGE_MAX_BATCHES 100
+
+/* the monitor keeps at most that many transition timings per node */
+#define TRANSITION_TIMINGS_PER_NODE 100
+
+/* buffered events are inserted by at most that many batches at a time */
+#define EVENT_FLUSH_MAX_BATCHES 100
+
+/* the node table is vacuumed with this command, see VacuumNodeTable */
+#define NODE_TABLE_VACUUM_COMMAND "VACUUM " AUTO_FAILOVER_NODE_TABLE
+
+/* below that share of HOT updates in the node table, we complain */
+#define NODE_TABLE_MIN_HOT_RATIO 0.9
+#define NODE_TABLE_HOT_RATIO_MIN_UPDATES 1000
 
 
 /* GUCs */
 bool HealthChecksEnabled = true;
+int EventRetention = 0;
+int NodeVacuumInterval = 10 * 1000;
+int NodeVacuumThreshold = 100;
+
+/* whether the current transaction changed the list of nodes */
+static bool NodeRegistryInvalidated = false;
+static bool NodeRegistryCallbackRegistered = false;
+
+/* update counters of the node table at the last HOT ratio check */
+static PgStat_Counter NodeTableUpdates = 0;
+static PgStat_Counter NodeTableHotUpdates = 0;
+static bool NodeTableHotRatioLow = false;
+
+
+/* a group with a node which health changed, see SetNodeHealthStateList */
+typedef struct HealthChangedGroup
+{
+	char *formationId;
+	int groupId;
+} HealthChangedGroup;
 
 
 static bool HaMonitorHasBeenLoaded(void);
+static List * AddHealthChangedGroup(List *groupList,
+									char *formationId, int groupId);
+static void ProceedHealthChangedGroups(List *groupList);
 static void StartSPITransaction(void);
 static void EndSPITransaction(void);
+static void NodeRegistryXactCallback(XactEvent event, void *arg);
+static void CheckNodeTableHotRatio(PgStat_StatTabEntry *tabEntry);
+static void ExecuteNodeTableVacuum(void);
+
+
+PG_FUNCTION_INFO_V1(invalidate_node_registry);
+PG_FUNCTION_INFO_V1(health_check_stats);
+PG_FUNCTION_INFO_V1(lag_history);
 
 
 /*
  * LoadNodeHealthList loads a list of nodes of which to check the health.
+ *
+ * When more than one health check worker is running for the monitor database,
+ * each worker only loads its share of the nodes: the nodes are split using a
+ * stable hash of their formation and group, so that all the nodes of a group
+ * are always checked by the same worker.
  */
 List *
-LoadNodeHealthList(void)
+LoadNodeHealthList(int workerIndex, int workerCount)
 {
 	List *nodeHealthList = NIL;
 	int spiStatus PG_USED_FOR_ASSERTS_ONLY = 0;
@@ -67,9 +143,17 @@ LoadNodeHealthList(void)
 	{
 		initStringInfo(&query);
 		appendStringInfo(&query,
-						 "SELECT nodename, nodeport, health "
+						 "SELECT nodename, nodeport, health, reporttime "
 						 "FROM " AUTO_FAILOVER_NODE_TABLE);
 
+		if (workerCount > 1)
+		{
+			appendStringInfo(&query,
+							 " WHERE (hashtext(formationid || ':' || groupid)"
+							 " & 2147483647) %% %d = %d",
+							 workerCount, workerIndex);
+		}
+
 		pgstat_report_activity(STATE_RUNNING, query.data);
 
 		spiStatus = SPI_execute(query.data, false, 0);
@@ -140,6 +224,7 @@ NodeHealth *
 TupleToNodeHealth(HeapTuple heapTuple, TupleDesc tupleDescriptor)
 {
 	NodeHealth *nodeHealth = NULL;
+	NodeReport report;
 	bool isNull = false;
 
 	Datum nodeNameDatum = SPI_getbinval(heapTuple, tupleDescriptor,
@@ -148,25 +233,63 @@ TupleToNodeHealth(HeapTuple heapTuple, TupleDesc tupleDescriptor)
 										TLIST_NUM_NODE_PORT, &isNull);
 	Datum healthStateDatum = SPI_getbinval(heapTuple, tupleDescriptor,
 										   TLIST_NUM_HEALTH_STATUS, &isNull);
+	Datum reportTimeDatum = SPI_getbinval(heapTuple, tupleDescriptor,
+										  TLIST_NUM_REPORT_TIME, &isNull);
 
 	nodeHealth = palloc0(sizeof(NodeHealth));
 	nodeHealth->nodeName = TextDatumGetCString(nodeNameDatum);
 	nodeHealth->nodePort = DatumGetInt32(nodePortDatum);
 	nodeHealth->healthState = DatumGetInt32(healthStateDatum);
+	nodeHealth->reportTime = DatumGetTimestampTz(reportTimeDatum);
+
+	/* the last reports of the keeper might only be known in shared memory */
+	if (GetNodeReport(nodeHealth->nodeName, nodeHealth->nodePort, &report) &&
+		report.reportTime > nodeHealth->reportTime)
+	{
+		nodeHealth->reportTime = report.reportTime;
+	}
 
 	return nodeHealth;
 }
 
 
 /*
- * SetNodeHealthState updates the health state of a node in the metadata.
+ * SetNodeHealthStateList updates the health state of the given nodes in the
+ * metadata, using a single UPDATE statement in a single transaction.
+ *
+ * Rows where the health state did not change are skipped, so that we don't
+ * write tuple versions for nothing, unless the previous health check happened
+ * before the monitor started: the group state machine only trusts health
+ * checks that happened since then.
+ *
+ * Once the new health states are committed, we run the group state machine
+ * of the groups of the updated nodes, so that a failover starts as soon as we
+ * detect that a node failed rather than on the next call to node_active.
+ *
+ * The state machine only considers a failed node to be unhealthy once its
+ * keeper stopped reporting for UnhealthyTimeoutMs, which usually happens after
+ * the health check that found the failure. So we also run the state machine
+ * of the groups that have a failed node which keeper stopped reporting, at
+ * each round until the node is healthy again. A failed node which keeper
+ * still reports is handled by its node_active calls.
  */
 void
-SetNodeHealthState(char *nodeName, uint16 nodePort, int healthState)
+SetNodeHealthStateList(List *nodeHealthList)
 {
 	StringInfoData query;
 	int spiStatus PG_USED_FOR_ASSERTS_ONLY = 0;
 	MemoryContext upperContext = CurrentMemoryContext;
+	ListCell *nodeHealthCell = NULL;
+	bool firstValue = true;
+	List *groupList = NIL;
+	uint64 rowNumber = 0;
+	TimestampTz now = GetCurrentTimestamp();
+	WriteUsage writeUsage;
+
+	if (nodeHealthList == NIL)
+	{
+		return;
+	}
 
 	StartSPITransaction();
 
@@ -174,17 +297,69 @@ SetNodeHealthState(char *nodeName, uint16 nodePort, int healthState)
 	{
 		initStringInfo(&query);
 		appendStringInfo(&query,
-						 "UPDATE " AUTO_FAILOVER_NODE_TABLE
-						 "   SET health = %d, healthchecktime = now() "
-						 " WHERE nodename = %s AND nodeport = %d",
-						 healthState,
-						 quote_literal_cstr(nodeName),
-						 nodePort);
+						 "WITH v(nodename, nodeport, health, silent) AS (VALUES ");
+
+		foreach(nodeHealthCell, nodeHealthList)
+		{
+			NodeHealth *nodeHealth = (NodeHealth *) lfirst(nodeHealthCell);
+			bool silent = TimestampDifferenceExceeds(nodeHealth->reportTime, now,
+													 UnhealthyTimeoutMs);
+
+			appendStringInfo(&query, "%s(%s, %d, %d, %s)",
+							 firstValue ? "" : ", ",
+							 quote_literal_cstr(nodeHealth->nodeName),
+							 nodeHealth->nodePort,
+							 nodeHealth->healthState,
+							 silent ? "true" : "false");
+
+			firstValue = false;
+		}
+
+		appendStringInfo(&query,
+						 "), updated AS ("
+						 "UPDATE " AUTO_FAILOVER_NODE_TABLE " AS node"
+						 "   SET health = v.health, healthchecktime = now() "
+						 "  FROM v"
+						 " WHERE node.nodename = v.nodename"
+						 "   AND node.nodeport = v.nodeport"
+						 "   AND (node.health <> v.health"
+						 "        OR node.healthchecktime < pg_postmaster_start_time())"
+						 " RETURNING node.formationid, node.groupid) "
+						 "SELECT formationid, groupid FROM updated "
+						 " UNION "
+						 "SELECT node.formationid, node.groupid"
+						 "  FROM " AUTO_FAILOVER_NODE_TABLE " AS node"
+						 "  JOIN v ON node.nodename = v.nodename"
+						 "        AND node.nodeport = v.nodeport"
+						 " WHERE v.health = %d AND v.silent",
+						 NODE_HEALTH_BAD);
 
 		pgstat_report_activity(STATE_RUNNING, query.data);
 
+		WriteUsageStart(&writeUsage);
+
 		spiStatus = SPI_execute(query.data, false, 0);
-		Assert(spiStatus == SPI_OK_UPDATE);
+		Assert(spiStatus == SPI_OK_SELECT);
+
+		WriteUsageEnd(WRITE_SET_NODE_HEALTH_STATE, &writeUsage);
+
+		for (rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
+		{
+			HeapTuple heapTuple = SPI_tuptable->vals[rowNumber];
+			TupleDesc tupleDescriptor = SPI_tuptable->tupdesc;
+			bool isNull = false;
+			Datum formationIdDatum =
+				SPI_getbinval(heapTuple, tupleDescriptor, 1, &isNull);
+			Datum groupIdDatum =
+				SPI_getbinval(heapTuple, tupleDescriptor, 2, &isNull);
+			MemoryContext spiContext = MemoryContextSwitchTo(upperContext);
+
+			groupList = AddHealthChangedGroup(groupList,
+											  TextDatumGetCString(formationIdDatum),
+											  DatumGetInt32(groupIdDatum));
+
+			MemoryContextSwitchTo(spiContext);
+		}
 	}
 	else
 	{
@@ -193,10 +368,735 @@ SetNodeHealthState(char *nodeName, uint16 nodePort, int healthState)
 
 	EndSPITransaction();
 
+	ProceedHealthChangedGroups(groupList);
+
 	MemoryContextSwitchTo(upperContext);
 }
 
 
+/*
+ * AddHealthChangedGroup appends the given group to the list, unless it's
+ * already there.
+ */
+static List *
+AddHealthChangedGroup(List *groupList, char *formationId, int groupId)
+{
+	HealthChangedGroup *group = NULL;
+	ListCell *groupCell = NULL;
+
+	foreach(groupCell, groupList)
+	{
+		group = (HealthChangedGroup *) lfirst(groupCell);
+
+		if (group->groupId == groupId && strcmp(group->formationId, formationId) == 0)
+		{
+			return groupList;
+		}
+	}
+
+	group = (HealthChangedGroup *) palloc0(sizeof(HealthChangedGroup));
+	group->formationId = formationId;
+	group->groupId = groupId;
+
+	return lappend(groupList, group);
+}
+
+
+/*
+ * ProceedHealthChangedGroups runs the group state machine for each node of
+ * the given groups, as node_active would do, each group in its own
+ * transaction. We take the same locks as node_active, and only after we
+ * committed the new health states: a node_active call could otherwise hold
+ * the group lock while waiting for our lock on its node row.
+ *
+ * Each group runs in a subtransaction, as in node_active_batch: the health
+ * check worker is not restarted, so when a group fails we roll back its
+ * changes, log the error, and proceed with the next group.
+ */
+static void
+ProceedHealthChangedGroups(List *groupList)
+{
+	ListCell *groupCell = NULL;
+
+	foreach(groupCell, groupList)
+	{
+		HealthChangedGroup *group = (HealthChangedGroup *) lfirst(groupCell);
+
+		StartSPITransaction();
+
+		if (HaMonitorHasBeenLoaded())
+		{
+			MemoryContext groupContext = CurrentMemoryContext;
+			ResourceOwner groupResourceOwner = CurrentResourceOwner;
+
+			pgstat_report_activity(STATE_RUNNING,
+								   "proceeding group state after health change");
+
+			BeginInternalSubTransaction(NULL);
+			MemoryContextSwitchTo(groupContext);
+
+			PG_TRY();
+			{
+				List *nodeList = NIL;
+				ListCell *nodeCell = NULL;
+
+				LockFormation(group->formationId, ShareLock);
+				LockNodeGroup(group->formationId, group->groupId, ExclusiveLock);
+
+				nodeList = AutoFailoverNodeGroup(group->formationId,
+												 group->groupId);
+
+				foreach(nodeCell, nodeList)
+				{
+					AutoFailoverNode *groupNode =
+						(AutoFailoverNode *) lfirst(nodeCell);
+
+					/* read the node again, the previous nodes might have changed it */
+					AutoFailoverNode *pgAutoFailoverNode =
+						GetAutoFailoverNode(groupNode->nodeName,
+											groupNode->nodePort);
+
+					if (pgAutoFailoverNode != NULL)
+					{
+						ProceedGroupState(pgAutoFailoverNode);
+					}
+				}
+
+				ReleaseCurrentSubTransaction();
+				MemoryContextSwitchTo(groupContext);
+				CurrentResourceOwner = groupResourceOwner;
+			}
+			PG_CATCH();
+			{
+				ErrorData *errorData = NULL;
+
+				MemoryContextSwitchTo(groupContext);
+				errorData = CopyErrorData();
+				FlushErrorState();
+
+				RollbackAndReleaseCurrentSubTransaction();
+				MemoryContextSwitchTo(groupContext);
+				CurrentResourceOwner = groupResourceOwner;
+
+				/* the cache might have nodes that we just rolled back */
+				InvalidateNodeCache();
+
+				ereport(LOG,
+						(errmsg("pg_auto_failover monitor failed to proceed "
+								"the state of group %d in formation \"%s\" "
+								"after a health change: %s",
+								group->groupId, group->formationId,
+								errorData->message)));
+
+				FreeErrorData(errorData);
+			}
+			PG_END_TRY();
+		}
+
+		EndSPITransaction();
+	}
+}
+
+
+/*
+ * PurgeExpiredEvents deletes the events that are older than
+ * pgautofailover.event_retention seconds.
+ *
+ * We delete the oldest events in batches of EVENT_PURGE_BATCH_SIZE, each in
+ * its own transaction, so that the purge never holds many row locks or
+ * produces a burst of dead tuples. The batches look at the oldest events by
+ * eventid, which increases with eventtime, so that each batch only reads the
+ * events it deletes through the primary key.
+ */
+void
+PurgeExpiredEvents(void)
+{
+	int batchNumber = 0;
+
+	if (EventRetention <= 0)
+	{
+		return;
+	}
+
+	for (batchNumber = 0; batchNumber < EVENT_PURGE_MAX_BATCHES; batchNumber++)
+	{
+		StringInfoData query;
+		int spiStatus PG_USED_FOR_ASSERTS_ONLY = 0;
+		uint64 deletedCount = 0;
+
+		StartSPITransaction();
+
+		if (HaMonitorHasBeenLoaded())
+		{
+			initStringInfo(&query);
+			appendStringInfo(&query,
+							 "WITH oldest AS ("
+							 " SELECT eventid, eventtime"
+							 "   FROM " AUTO_FAILOVER_EVENT_TABLE
+							 "  ORDER BY eventid LIMIT %d) "
+							 "DELETE FROM " AUTO_FAILOVER_EVENT_TABLE " AS event"
+							 " USING oldest"
+							 " WHERE event.eventid = oldest.eventid"
+							 "   AND oldest.eventtime < now() - %d * interval '1s'",
+							 EVENT_PURGE_BATCH_SIZE, EventRetention);
+
+			pgstat_report_activity(STATE_RUNNING, query.data);
+
+			spiStatus = SPI_execute(query.data, false, 0);
+			Assert(spiStatus == SPI_OK_DELETE);
+
+			deletedCount = SPI_processed;
+		}
+
+		EndSPITransaction();
+
+		if (deletedCount < EVENT_PURGE_BATCH_SIZE)
+		{
+			break;
+		}
+	}
+}
+
+
+/*
+ * PurgeTransitionTimings deletes the transition timings of a node beyond its
+ * last TRANSITION_TIMINGS_PER_NODE ones, and the timings that are older than
+ * pgautofailover.event_retention seconds, when it is set. As for the events,
+ * we delete them in batches, each in its own transaction.
+ */
+void
+PurgeTransitionTimings(void)
+{
+	int batchNumber = 0;
+
+	for (batchNumber = 0; batchNumber < EVENT_PURGE_MAX_BATCHES; batchNumber++)
+	{
+		StringInfoData query;
+		int spiStatus PG_USED_FOR_ASSERTS_ONLY = 0;
+		uint64 deletedCount = 0;
+
+		StartSPITransaction();
+
+		if (HaMonitorHasBeenLoaded())
+		{
+			initStringInfo(&query);
+			appendStringInfo(&query,
+							 "WITH expired AS ("
+							 " SELECT timingid"
+							 "   FROM (SELECT timingid, timingtime,"
+							 "                row_number() OVER"
+							 "                 (PARTITION BY nodeid"
+							 "                      ORDER BY timingid DESC) AS rank"
+							 "           FROM " AUTO_FAILOVER_TRANSITION_TIMING_TABLE
+							 "        ) AS timing"
+							 "  WHERE rank > %d"
+							 "     OR (%d > 0 AND timingtime < now() - %d * interval '1s')"
+							 "  LIMIT %d) "
+							 "DELETE FROM " AUTO_FAILOVER_TRANSITION_TIMING_TABLE
+							 " AS timing"
+							 " USING expired"
+							 " WHERE timing.timingid = expired.timingid",
+							 TRANSITION_TIMINGS_PER_NODE,
+							 EventRetention, EventRetention,
+							 EVENT_PURGE_BATCH_SIZE);
+
+			pgstat_report_activity(STATE_RUNNING, query.data);
+
+			spiStatus = SPI_execute(query.data, false, 0);
+			Assert(spiStatus == SPI_OK_DELETE);
+
+			deletedCount = SPI_processed;
+		}
+
+		EndSPITransaction();
+
+		if (deletedCount < EVENT_PURGE_BATCH_SIZE)
+		{
+			break;
+		}
+	}
+}
+
+
+/*
+ * VacuumNodeTable vacuums the node table once the statistics collector counts
+ * more than pgautofailover.node_vacuum_threshold dead rows in there. Each
+ * node_active call updates the row of its node, so on a busy monitor the
+ * autovacuum workers, that serve the whole instance, are often not quick
+ * enough to keep the node table, and its indexes, at a few pages.
+ *
+ * We also watch the share of HOT updates in the table, since the updates that
+ * are not HOT add index entries that only a VACUUM removes.
+ */
+void
+VacuumNodeTable(void)
+{
+	PgStat_StatTabEntry *tabEntry = NULL;
+	PgStat_Counter deadTuples = 0;
+
+	if (NodeVacuumThreshold <= 0)
+	{
+		return;
+	}
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+
+	if (HaMonitorHasBeenLoaded())
+	{
+		Oid nodeTableId =
+			pgAutoFailoverRelationId(AUTO_FAILOVER_NODE_TABLE_NAME);
+
+		tabEntry = pgstat_fetch_stat_tabentry(nodeTableId);
+	}
+
+	if (tabEntry != NULL)
+	{
+		deadTuples = tabEntry->n_dead_tuples;
+
+		CheckNodeTableHotRatio(tabEntry);
+	}
+
+	if (deadTuples >= NodeVacuumThreshold)
+	{
+		elog(DEBUG1, "vacuuming " AUTO_FAILOVER_NODE_TABLE
+			 " with " INT64_FORMAT " dead rows", (int64) deadTuples);
+
+		pgstat_report_activity(STATE_RUNNING, NODE_TABLE_VACUUM_COMMAND);
+
+		ExecuteNodeTableVacuum();
+
+		pgstat_report_activity(STATE_IDLE, NULL);
+	}
+
+	CommitTransactionCommand();
+}
+
+
+/*
+ * CheckNodeTableHotRatio logs a message when the share of HOT updates in the
+ * node table since the previous check drops below NODE_TABLE_MIN_HOT_RATIO,
+ * and another one when it is back.
+ */
+static void
+CheckNodeTableHotRatio(PgStat_StatTabEntry *tabEntry)
+{
+	PgStat_Counter updates = tabEntry->tuples_updated - NodeTableUpdates;
+	PgStat_Counter hotUpdates =
+		tabEntry->tuples_hot_updated - NodeTableHotUpdates;
+	double hotRatio = 0.0;
+
+	/* the statistics have been reset, start again */
+	if (updates < 0 || hotUpdates < 0)
+	{
+		NodeTableUpdates = tabEntry->tuples_updated;
+		NodeTableHotUpdates = tabEntry->tuples_hot_updated;
+		return;
+	}
+
+	if (updates < NODE_TABLE_HOT_RATIO_MIN_UPDATES)
+	{
+		return;
+	}
+
+	NodeTableUpdates = tabEntry->tuples_updated;
+	NodeTableHotUpdates = tabEntry->tuples_hot_updated;
+
+	hotRatio = (double) hotUpdates / (double) updates;
+
+	if (hotRatio < NODE_TABLE_MIN_HOT_RATIO && !NodeTableHotRatioLow)
+	{
+		ereport(LOG,
+				(errmsg("only %.0f%% of the last " INT64_FORMAT " updates of "
+						AUTO_FAILOVER_NODE_TABLE " were HOT updates",
+						100.0 * hotRatio, (int64) updates),
+				 errhint("Check the fillfactor of the table, and whether new "
+						 "indexes cover columns that node_active updates.")));
+	}
+	else if (hotRatio >= NODE_TABLE_MIN_HOT_RATIO && NodeTableHotRatioLow)
+	{
+		ereport(LOG,
+				(errmsg("%.0f%% of the last " INT64_FORMAT " updates of "
+						AUTO_FAILOVER_NODE_TABLE " were HOT updates",
+						100.0 * hotRatio, (int64) updates)));
+	}
+
+	NodeTableHotRatioLow = hotRatio < NODE_TABLE_MIN_HOT_RATIO;
+}
+
+
+/*
+ * ExecuteNodeTableVacuum runs NODE_TABLE_VACUUM_COMMAND as a top-level
+ * command, the same as a client would. VACUUM commits the transaction that we
+ * started and runs in its own transactions, then starts a new one for us to
+ * commit.
+ */
+static void
+ExecuteNodeTableVacuum(void)
+{
+	List *parseTreeList = raw_parser(NODE_TABLE_VACUUM_COMMAND);
+	RawStmt *rawStmt = linitial_node(RawStmt, parseTreeList);
+	PlannedStmt *plannedStmt = makeNode(PlannedStmt);
+	MemoryContext portalContext =
+		AllocSetContextCreate(TopMemoryContext,
+							  "Node table vacuum",
+							  ALLOCSET_DEFAULT_SIZES);
+
+	plannedStmt->commandType = CMD_UTILITY;
+	plannedStmt->canSetTag = false;
+	plannedStmt->utilityStmt = rawStmt->stmt;
+	plannedStmt->stmt_location = rawStmt->stmt_location;
+	plannedStmt->stmt_len = rawStmt->stmt_len;
+
+	/* VACUUM allocates the memory it needs across transactions in there */
+	PortalContext = portalContext;
+
+	ProcessUtility(plannedStmt, NODE_TABLE_VACUUM_COMMAND,
+				   PROCESS_UTILITY_TOPLEVEL, NULL, NULL,
+				   None_Receiver, NULL);
+
+	PortalContext = NULL;
+	MemoryContextDelete(portalContext);
+}
+
+
+/*
+ * FlushBufferedEvents inserts the events of the current database that are in
+ * the event buffer in the event table, see event_buffer.c. Each batch of
+ * EVENT_FLUSH_BATCH_SIZE events is inserted in its own transaction, and is
+ * removed from the buffer once that transaction committed.
+ */
+void
+FlushBufferedEvents(void)
+{
+	BufferedEvent *events = NULL;
+	int batchNumber = 0;
+
+	if (EventBufferSize <= 0)
+	{
+		return;
+	}
+
+	events = (BufferedEvent *) palloc(EVENT_FLUSH_BATCH_SIZE * sizeof(BufferedEvent));
+
+	for (batchNumber = 0; batchNumber < EVENT_FLUSH_MAX_BATCHES; batchNumber++)
+	{
+		int eventCount = CopyBufferedEvents(events, EVENT_FLUSH_BATCH_SIZE);
+
+		if (eventCount == 0)
+		{
+			break;
+		}
+
+		StartSPITransaction();
+
+		/* events of a dropped extension are dropped too */
+		if (HaMonitorHasBeenLoaded())
+		{
+			pgstat_report_activity(STATE_RUNNING, ACTIVITY_FLUSH_EVENTS);
+
+			InsertBufferedEvents(events, eventCount);
+		}
+
+		EndSPITransaction();
+
+		ReleaseBufferedEvents(events, eventCount);
+
+		if (eventCount < EVENT_FLUSH_BATCH_SIZE)
+		{
+			break;
+		}
+	}
+
+	pfree(events);
+}
+
+
+/*
+ * invalidate_node_registry is a statement level trigger on the node table,
+ * which notifies the health check workers that the list of nodes changed once
+ * the current transaction commits.
+ */
+Datum
+invalidate_node_registry(PG_FUNCTION_ARGS)
+{
+	if (!CALLED_AS_TRIGGER(fcinfo))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("invalidate_node_registry must be called as a trigger")));
+	}
+
+	RegisterNodeRegistryInvalidation();
+
+	PG_RETURN_POINTER(NULL);
+}
+
+
+/*
+ * RegisterNodeRegistryInvalidation arranges for the health check workers of
+ * the current database to reload their list of nodes when the current
+ * transaction commits. Before that, the workers would not see our changes.
+ */
+void
+RegisterNodeRegistryInvalidation(void)
+{
+	if (!NodeRegistryCallbackRegistered)
+	{
+		RegisterXactCallback(NodeRegistryXactCallback, NULL);
+		NodeRegistryCallbackRegistered = true;
+	}
+
+	NodeRegistryInvalidated = true;
+}
+
+
+/*
+ * NodeRegistryXactCallback invalidates the node registry of the current
+ * database at commit time, when the transaction changed the list of nodes.
+ */
+static void
+NodeRegistryXactCallback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		{
+			if (NodeRegistryInvalidated)
+			{
+				NodeRegistryInvalidated = false;
+				InvalidateNodeRegistry(MyDatabaseId);
+			}
+			break;
+		}
+
+		case XACT_EVENT_ABORT:
+		{
+			NodeRegistryInvalidated = false;
+			break;
+		}
+
+		default:
+		{
+			/* nothing to do */
+			break;
+		}
+	}
+}
+
+
+/*
+ * health_check_stats returns the health check statistics of each node that
+ * the health check workers of the current database are checking.
+ */
+Datum
+health_check_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *resultSetInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupleDescriptor = NULL;
+	Tuplestorestate *tupleStore = NULL;
+	MemoryContext perQueryContext = NULL;
+	MemoryContext oldContext = NULL;
+	List *statsList = NIL;
+	ListCell *statsCell = NULL;
+
+	if (resultSetInfo == NULL || !IsA(resultSetInfo, ReturnSetInfo))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	}
+
+	if (!(resultSetInfo->allowedModes & SFRM_Materialize))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		elog(ERROR, "return type must be a row type");
+	}
+
+	perQueryContext = resultSetInfo->econtext->ecxt_per_query_memory;
+	oldContext = MemoryContextSwitchTo(perQueryContext);
+
+	tupleDescriptor = CreateTupleDescCopy(tupleDescriptor);
+	tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultSetInfo->returnMode = SFRM_Materialize;
+	resultSetInfo->setResult = tupleStore;
+	resultSetInfo->setDesc = tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	statsList = GetHealthCheckStatsList();
+
+	foreach(statsCell, statsList)
+	{
+		HealthCheckStats *stats = (HealthCheckStats *) lfirst(statsCell);
+		Datum values[HEALTH_CHECK_STATS_COLUMNS];
+		bool isNulls[HEALTH_CHECK_STATS_COLUMNS];
+		Datum histogramDatums[HEALTH_CHECK_LATENCY_BUCKETS];
+		int64 healthyCount = stats->checkCount - stats->unhealthyCount;
+		ArrayType *histogramArray = NULL;
+		int bucket = 0;
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		for (bucket = 0; bucket < HEALTH_CHECK_LATENCY_BUCKETS; bucket++)
+		{
+			histogramDatums[bucket] = Int64GetDatum(stats->latencyHistogram[bucket]);
+		}
+
+		histogramArray = construct_array(histogramDatums,
+										 HEALTH_CHECK_LATENCY_BUCKETS,
+										 INT8OID, sizeof(int64),
+										 FLOAT8PASSBYVAL, 'd');
+
+		values[0] = CStringGetTextDatum(stats->nodeName);
+		values[1] = Int32GetDatum(stats->nodePort);
+		values[2] = Int64GetDatum(stats->checkCount);
+		values[3] = Int64GetDatum(stats->unhealthyCount);
+		values[4] = Int64GetDatum(stats->retryCount);
+		values[5] = Int64GetDatum(stats->timeoutCount);
+
+		if (healthyCount > 0)
+		{
+			values[6] = Float8GetDatum(stats->lastLatencyMs);
+			values[7] = Float8GetDatum(stats->maxLatencyMs);
+			values[8] = Float8GetDatum(stats->totalLatencyMs / healthyCount);
+		}
+		else
+		{
+			isNulls[6] = true;
+			isNulls[7] = true;
+			isNulls[8] = true;
+		}
+
+		values[9] = PointerGetDatum(histogramArray);
+
+		if (stats->checkCount > 0)
+		{
+			values[10] = TimestampTzGetDatum(stats->lastCheckTime);
+		}
+		else
+		{
+			isNulls[10] = true;
+		}
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	tuplestore_donestoring(tupleStore);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * lag_history returns the last replication lag samples of each standby node
+ * of the current database, oldest first.
+ */
+Datum
+lag_history(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *resultSetInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupleDescriptor = NULL;
+	Tuplestorestate *tupleStore = NULL;
+	MemoryContext perQueryContext = NULL;
+	MemoryContext oldContext = NULL;
+	List *historyList = NIL;
+	ListCell *historyCell = NULL;
+
+	if (resultSetInfo == NULL || !IsA(resultSetInfo, ReturnSetInfo))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	}
+
+	if (!(resultSetInfo->allowedModes & SFRM_Materialize))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		elog(ERROR, "return type must be a row type");
+	}
+
+	perQueryContext = resultSetInfo->econtext->ecxt_per_query_memory;
+	oldContext = MemoryContextSwitchTo(perQueryContext);
+
+	tupleDescriptor = CreateTupleDescCopy(tupleDescriptor);
+	tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultSetInfo->returnMode = SFRM_Materialize;
+	resultSetInfo->setResult = tupleStore;
+	resultSetInfo->setDesc = tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	historyList = GetLagHistoryList();
+
+	foreach(historyCell, historyList)
+	{
+		NodeLagHistory *history = (NodeLagHistory *) lfirst(historyCell);
+		int sampleIndex = 0;
+
+		for (sampleIndex = 0; sampleIndex < history->sampleCount; sampleIndex++)
+		{
+			LagSample *sample = &(history->samples[sampleIndex]);
+			Datum values[LAG_HISTORY_COLUMNS];
+			bool isNulls[LAG_HISTORY_COLUMNS];
+
+			memset(values, 0, sizeof(values));
+			memset(isNulls, false, sizeof(isNulls));
+
+			values[0] = CStringGetTextDatum(history->nodeName);
+			values[1] = Int32GetDatum(history->nodePort);
+			values[2] = TimestampTzGetDatum(sample->sampleTime);
+			values[3] = LSNGetDatum(sample->reportedLSN);
+			values[4] = LSNGetDatum(sample->primaryLSN);
+
+			if (sample->primaryLSN > sample->reportedLSN)
+			{
+				values[5] =
+					Int64GetDatum(sample->primaryLSN - sample->reportedLSN);
+			}
+			else
+			{
+				values[5] = Int64GetDatum(0);
+			}
+
+			if (sample->healthCheckRttMs >= 0)
+			{
+				values[6] = Float8GetDatum(sample->healthCheckRttMs);
+			}
+			else
+			{
+				isNulls[6] = true;
+			}
+
+			tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+		}
+	}
+
+	tuplestore_donestoring(tupleStore);
+
+	PG_RETURN_VOID();
+}
+
+
 /*
  * StartSPITransaction starts a transaction using SPI.
  */
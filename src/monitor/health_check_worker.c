@@ -12,10 +12,13 @@
 
 #include "postgres.h"
 
+#include <math.h>
+
 /* these are internal headers */
 #include "health_check.h"
 #include "metadata.h"
 #include "version_compat.h"
+#include "wait_events.h"
 
 /* these are always necessary for a bgworker */
 #include "access/heapam.h"
@@ -31,16 +34,21 @@
 #include "storage/lmgr.h"
 #include "storage/lwlock.h"
 #include "storage/proc.h"
+#include "storage/procarray.h"
 #include "storage/shmem.h"
 
 /* these headers are used by this particular worker's code */
 #include "fmgr.h"
+#include "lib/binaryheap.h"
 #include "lib/stringinfo.h"
 #include "libpq-fe.h"
 #include "libpq-int.h"
 #include "libpq/pqsignal.h"
 #include "poll.h"
 #include "sys/time.h"
+#ifdef HAVE_SYS_EPOLL_H
+#include "sys/epoll.h"
+#endif
 #include "utils/builtins.h"
 #include "utils/memutils.h"
 #include "tcop/utility.h"
@@ -50,8 +58,36 @@
 	"connect_timeout=%u"
 #define MAX_CONN_INFO_SIZE 1024
 
+/*
+ * Query sent on kept connections to check on the node, which also samples
+ * its current LSN, see RecordNodeLSN.
+ */
+#define HEALTH_CHECK_LSN_QUERY \
+	"SELECT CASE WHEN pg_is_in_recovery()" \
+	" THEN pg_last_wal_receive_lsn() ELSE pg_current_wal_lsn() END"
+
 #define CANNOT_CONNECT_NOW "57P03"
 
+/*
+ * Parameters of the suspicion level computation, see UpdateSuspicionLevel.
+ * Report ages are in milliseconds.
+ */
+#define PHI_SMOOTHING_FACTOR 0.1
+#define PHI_MIN_STDDEV_MS 500.0
+#define PHI_MAX 1000.0
+
+/* maximum number of ready sockets returned by a single epoll_wait() call */
+#define MAX_HEALTH_CHECK_EVENTS 64
+
+/* size of the shared hash of keeper reports, see RecordNodeHeartbeat */
+#define MAX_NODE_HEARTBEATS 1024
+
+/* size of the shared hash of health check counters */
+#define MAX_HEALTH_CHECK_STATS 1024
+
+/* interval between two purges of the expired events, in milliseconds */
+#define EVENT_PURGE_INTERVAL_MS (60 * 1000)
+
 
 typedef enum
 {
@@ -59,11 +95,24 @@ typedef enum
 	HEALTH_CHECK_CONNECTING = 1,
 	HEALTH_CHECK_OK = 2,
 	HEALTH_CHECK_RETRY = 3,
-	HEALTH_CHECK_DEAD = 4
+	HEALTH_CHECK_DEAD = 4,
+	HEALTH_CHECK_PINGING = 5
 } HealthCheckState;
 
+/* events counted in the health check statistics of a node */
+typedef enum
+{
+	HEALTH_CHECK_EVENT_HEALTHY = 0,
+	HEALTH_CHECK_EVENT_UNHEALTHY,
+	HEALTH_CHECK_EVENT_RETRY,
+	HEALTH_CHECK_EVENT_TIMEOUT
+} HealthCheckEvent;
+
 typedef struct HealthCheck
 {
+	/* hash key: "nodename:nodeport" */
+	char nodeKey[MAX_CONN_INFO_SIZE];
+
 	NodeHealth *node;
 	HealthCheckState state;
 	PGconn *connection;
@@ -71,6 +120,35 @@ typedef struct HealthCheck
 	PostgresPollingStatusType pollingStatus;
 	int numTries;
 	struct timeval nextEventTime;
+
+	/* when the current connection attempt or ping started */
+	struct timeval attemptStartTime;
+
+	/* socket and events currently registered in the epoll set, if any */
+	pgsocket registeredSocket;
+	uint32 registeredEvents;
+
+	/* scheduling of the checks, see ScheduleHealthCheck */
+	uint32 scheduleOffset;
+	struct timeval nextCheckTime;
+	bool inProgress;
+	int backoff;
+
+	/*
+	 * Suspicion level (phi) of the node, computed from the age of the last
+	 * report of its keeper each time we load the node list, and the running
+	 * mean and variance of those ages.
+	 */
+	double phi;
+	double reportAgeMean;
+	double reportAgeVariance;
+	bool hasReportAge;
+
+	/* whether we already wrote this node's health state to the table */
+	bool healthStateWritten;
+
+	/* used by ReloadHealthChecks to find nodes that have been removed */
+	bool seen;
 } HealthCheck;
 
 
@@ -87,6 +165,12 @@ typedef struct HealthCheckHelperControlData
 	int				trancheId;
 	char		   *lockTrancheName;
 	LWLock			lock;
+
+	/* lock protecting NodeHeartbeatHash, taken by every node_active call */
+	LWLock			heartbeatLock;
+
+	/* lock protecting HealthCheckStatsHash */
+	LWLock			statsLock;
 } HealthCheckHelperControlData;
 
 /*
@@ -96,10 +180,58 @@ typedef struct HealthCheckHelperDatabase
 {
 	/* hash key: database to run on */
 	Oid			dboid;
-	pid_t		workerPid;
+	pid_t		workerPids[MAX_HEALTH_CHECK_WORKERS];
 	bool isActive;
+
+	/* incremented each time the list of nodes changes in the database */
+	uint64		nodeListVersion;
 } HealthCheckHelperDatabase;
 
+/*
+ * Nodes are identified in shared memory hashes by their database, name and
+ * port.
+ */
+typedef struct SharedNodeKey
+{
+	Oid			dboid;
+	int			nodePort;
+	char		nodeName[MAX_NODE_NAME_SIZE];
+} SharedNodeKey;
+
+/*
+ * Last report of each keeper, as registered by node_active. Health check
+ * workers use it to follow the keepers between two scans of the node table,
+ * and backends to know about the reports not yet written to the table.
+ */
+typedef struct NodeHeartbeat
+{
+	SharedNodeKey key;
+	NodeReport report;
+
+	/* ring buffer of replication lag samples, see RecordNodeLagSample */
+	int lagSampleCount;
+	int nextLagSample;
+	LagSample lagSamples[LAG_HISTORY_SIZE];
+} NodeHeartbeat;
+
+/* health check counters of each node, see RecordHealthCheckEvent */
+typedef struct HealthCheckStatsEntry
+{
+	SharedNodeKey key;
+	HealthCheckStats stats;
+} HealthCheckStatsEntry;
+
+/*
+ * Each health check worker of a database is given its index and the total
+ * number of workers for the database, so that it can pick its share of the
+ * nodes to check. We pass those in the bgw_extra area of the worker.
+ */
+typedef struct HealthCheckWorkerArgs
+{
+	int workerIndex;
+	int workerCount;
+} HealthCheckWorkerArgs;
+
 typedef struct DatabaseListEntry
 {
 	Oid		dboid;
@@ -112,6 +244,8 @@ typedef struct DatabaseListEntry
  * activated, and a lock to protect access to it.
  */
 static HTAB *HealthCheckWorkerDBHash;
+static HTAB *NodeHeartbeatHash;
+static HTAB *HealthCheckStatsHash;
 static HealthCheckHelperControlData *HealthCheckHelperControl = NULL;
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 
@@ -120,18 +254,51 @@ static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 /* private function declarations */
 static void pg_auto_failover_monitor_sigterm(SIGNAL_ARGS);
 static void pg_auto_failover_monitor_sighup(SIGNAL_ARGS);
-static BackgroundWorkerHandle * StartHealthCheckWorker(DatabaseListEntry *db);
+static BackgroundWorkerHandle * StartHealthCheckWorker(DatabaseListEntry *db,
+													   int workerIndex,
+													   int workerCount);
 static List *BuildDatabaseList(void);
 static bool pgAutoFailoverExtensionExists(void);
-static List * CreateHealthChecks(List *nodeHealthList);
-static HealthCheck * CreateHealthCheck(NodeHealth *nodeHealth);
-static void DoHealthChecks(List *healthCheckList);
+static void ReloadHealthChecks(int workerIndex, int workerCount,
+							   struct timeval currentTime);
+static void RefreshHealthChecks(struct timeval currentTime);
+static void CheckSuspiciousNode(HealthCheck *healthCheck, TimestampTz loadTime,
+								struct timeval currentTime);
+static void RebuildHealthCheckSchedule(void);
+static void InitHealthCheck(HealthCheck *healthCheck, NodeHealth *nodeHealth,
+							struct timeval currentTime);
+static void RemoveHealthCheck(HealthCheck *healthCheck);
+static void UpdateSuspicionLevel(HealthCheck *healthCheck, TimestampTz loadTime);
+static void ScheduleHealthCheck(HealthCheck *healthCheck,
+								struct timeval currentTime, bool afterCheck);
+static int CompareHealthCheckTimes(Datum left, Datum right, void *arg);
+static void StartDueHealthChecks(struct timeval currentTime);
+static void DoHealthChecks(struct timeval currentTime);
+static long NextHealthCheckTimeout(struct timeval currentTime,
+								   struct timeval nextReloadTime);
 static void ManageHealthCheck(HealthCheck *healthCheck, struct timeval currentTime);
-static int WaitForEvent(List *healthCheckList);
+static void QueueNodeHealthState(HealthCheck *healthCheck, NodeHealthState healthState);
+static void FlushNodeHealthStates(void);
+static int WaitForEvent(List *healthCheckList, long maxTimeoutMs);
+#ifdef HAVE_SYS_EPOLL_H
+static void InitHealthCheckEvents(void);
+static void UpdateHealthCheckEvents(HealthCheck *healthCheck);
+#endif
 static int CompareTimes(struct timeval *leftTime, struct timeval *rightTime);
 static int SubtractTimes(struct timeval base, struct timeval subtract);
 static struct timeval AddTimeMillis(struct timeval base, uint32 additionalMs);
 static void LatchWait(long timeoutMs);
+static uint64 GetNodeListVersion(Oid databaseId);
+static void MakeSharedNodeKey(SharedNodeKey *key, Oid databaseId,
+								 char *nodeName, int nodePort);
+static void InitNodeHeartbeat(NodeHeartbeat *heartbeat);
+static void ForgetNodeHeartbeat(char *nodeName, int nodePort);
+static int CopyLagSamples(NodeHeartbeat *heartbeat, LagSample *samples);
+static void RecordNodeLSN(char *nodeName, int nodePort, char *lsnString);
+static void RecordHealthCheckEvent(HealthCheck *healthCheck,
+								   HealthCheckEvent event,
+								   struct timeval currentTime);
+static void ForgetHealthCheckStats(char *nodeName, int nodePort);
 static size_t HealthCheckWorkerShmemSize(void);
 static void HealthCheckWorkerShmemInit(void);
 
@@ -141,11 +308,39 @@ static void HealthCheckWorkerShmemInit(void);
 static volatile sig_atomic_t got_sighup = false;
 static volatile sig_atomic_t got_sigterm = false;
 
+#ifdef HAVE_SYS_EPOLL_H
+/* epoll set holding the sockets of the health checks in progress */
+static int HealthCheckEpollFd = -1;
+
+/* waits for our latch, the postmaster, and the epoll set above */
+static WaitEventSet *HealthCheckWaitSet = NULL;
+#endif
+
+/* earliest timeout or retry time of the health checks in progress, if any */
+static struct timeval NextHealthCheckEventTime = { 0, 0 };
+
+/* all the health checks of this worker, by node, in HealthCheckContext */
+static MemoryContext HealthCheckContext = NULL;
+static HTAB *HealthCheckHash = NULL;
+
+/* health checks waiting for their next check time, earliest first */
+static binaryheap *HealthCheckSchedule = NULL;
+
+/* health checks in progress */
+static List *ActiveHealthCheckList = NIL;
+
+/* health check results not written to the node table yet */
+static List *PendingNodeHealthList = NIL;
+
 /* GUC variables */
 int HealthCheckPeriod = 20 * 1000;
 int HealthCheckTimeout = 5 * 1000;
 int HealthCheckMaxRetries = 2;
 int HealthCheckRetryDelay = 2 * 1000;
+bool HealthCheckPersistentConnections = false;
+int HealthCheckWorkers = 1;
+double HealthCheckPhiThreshold = 0.0;
+int HealthCheckMaxBackoff = 2;
 
 
 /*
@@ -248,11 +443,12 @@ HealthCheckWorkerLauncherMain(Datum arg)
 		foreach(databaseListCell, databaseList)
 		{
 			int pid;
-			BackgroundWorkerHandle *handle;
+			BackgroundWorkerHandle *handles[MAX_HEALTH_CHECK_WORKERS];
 			HealthCheckHelperDatabase *dbData;
 			DatabaseListEntry *entry =
 				(DatabaseListEntry *) lfirst(databaseListCell);
 			bool isFound = false;
+			int workerIndex = 0;
 
 			LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
 
@@ -265,29 +461,44 @@ HealthCheckWorkerLauncherMain(Datum arg)
 				continue;
 			}
 
-			/* start a worker for the entry database, in the background */
-			handle = StartHealthCheckWorker(entry);
-			if (handle)
+			/*
+			 * Once started, the Health Check processes will update their
+			 * pid.
+			 */
+			memset(dbData->workerPids, 0, sizeof(dbData->workerPids));
+			dbData->isActive = false;
+
+			if (!isFound)
 			{
-				/*
-				 * Once started, the Health Check process will update its
-				 * pid.
-				 */
-				dbData->workerPid = 0;
-				dbData->isActive = true;
+				dbData->nodeListVersion = 0;
+			}
+
+			/* start the workers for the entry database, in the background */
+			for (workerIndex = 0; workerIndex < HealthCheckWorkers; workerIndex++)
+			{
+				handles[workerIndex] =
+					StartHealthCheckWorker(entry, workerIndex, HealthCheckWorkers);
+
+				if (handles[workerIndex])
+				{
+					dbData->isActive = true;
+				}
 			}
 
 			LWLockRelease(&HealthCheckHelperControl->lock);
 
-			if (handle)
+			/*
+			 * We need to release the lock for the workers to be able to
+			 * complete their startup procedure: each per-database worker
+			 * takes the control lock in SHARED mode to edit its own PID in
+			 * its own entry in HealthCheckWorkerDBHash.
+			 */
+			for (workerIndex = 0; workerIndex < HealthCheckWorkers; workerIndex++)
 			{
-				/*
-				 * We need to release the lock for the worker to be able to
-				 * complete its startup procedure: the per-database worker
-				 * takes the control lock in SHARED mode to edit its own PID in
-				 * its own entry in HealthCheckWorkerDBHash.
-				 */
-				WaitForBackgroundWorkerStartup(handle, &pid);
+				if (handles[workerIndex])
+				{
+					WaitForBackgroundWorkerStartup(handles[workerIndex], &pid);
+				}
 			}
 		}
 
@@ -307,16 +518,21 @@ HealthCheckWorkerLauncherMain(Datum arg)
 /*
  * StartHealthCheckWorker registers a background worker in given target
  * database, and returns the background worker handle so that the caller can
- * wait until it is started.
+ * wait until it is started. The worker is in charge of the share of the nodes
+ * that matches its workerIndex, out of workerCount workers.
  *
  * This is necessary because of locking management, we want to release the main
  * lock from the caller before waiting for the worker's start.
  */
 static BackgroundWorkerHandle *
-StartHealthCheckWorker(DatabaseListEntry *db)
+StartHealthCheckWorker(DatabaseListEntry *db, int workerIndex, int workerCount)
 {
 	BackgroundWorker worker;
 	BackgroundWorkerHandle *handle;
+	HealthCheckWorkerArgs workerArgs = { workerIndex, workerCount };
+
+	StaticAssertStmt(sizeof(HealthCheckWorkerArgs) <= BGW_EXTRALEN,
+					 "HealthCheckWorkerArgs must fit in bgw_extra");
 
 	memset(&worker, 0, sizeof(worker));
 
@@ -329,7 +545,8 @@ StartHealthCheckWorker(DatabaseListEntry *db)
 	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pgautofailover");
 	snprintf(worker.bgw_function_name, BGW_MAXLEN, "HealthCheckWorkerMain");
 	snprintf(worker.bgw_name, BGW_MAXLEN,
-			 "pg_auto_failover monitor worker");
+			 "pg_auto_failover monitor worker %d", workerIndex);
+	memcpy(worker.bgw_extra, &workerArgs, sizeof(HealthCheckWorkerArgs));
 
 	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
 	{
@@ -403,8 +620,17 @@ HealthCheckWorkerMain(Datum arg)
 {
 	Oid dboid = DatumGetObjectId(arg);
 	bool foundPgAutoFailoverExtension = false;
-	MemoryContext healthCheckContext = NULL;
+	MemoryContext loadContext = NULL;
 	HealthCheckHelperDatabase *myDbData;
+	struct timeval nextReloadTime = { 0, 0 };
+	struct timeval nextPurgeTime = { 0, 0 };
+	struct timeval nextVacuumTime = { 0, 0 };
+	struct timeval nextWakeTime = { 0, 0 };
+	HealthCheckWorkerArgs workerArgs;
+	bool nodeListLoaded = false;
+	uint64 nodeListVersion = 0;
+
+	memcpy(&workerArgs, MyBgworkerEntry->bgw_extra, sizeof(HealthCheckWorkerArgs));
 
 	/*
 	 * Look up this worker's configuration.
@@ -426,7 +652,7 @@ HealthCheckWorkerMain(Datum arg)
 	}
 
 	/* from this point, DROP DATABASE will attempt to kill the worker */
-	myDbData->workerPid = MyProcPid;
+	myDbData->workerPids[workerArgs.workerIndex] = MyProcPid;
 
 	/* Establish signal handlers before unblocking signals. */
 	pqsignal(SIGHUP, pg_auto_failover_monitor_sighup);
@@ -449,28 +675,36 @@ HealthCheckWorkerMain(Datum arg)
 	 * Only process given database when the extension has been loaded.
 	 * Otherwise, happily quit.
 	 */
-	healthCheckContext = AllocSetContextCreate(CurrentMemoryContext,
+	HealthCheckContext = AllocSetContextCreate(CurrentMemoryContext,
 											   "Health check context",
 											   ALLOCSET_DEFAULT_MINSIZE,
 											   ALLOCSET_DEFAULT_INITSIZE,
 											   ALLOCSET_DEFAULT_MAXSIZE);
 
-	MemoryContextSwitchTo(healthCheckContext);
+	loadContext = AllocSetContextCreate(HealthCheckContext,
+										"Health check load context",
+										ALLOCSET_DEFAULT_MINSIZE,
+										ALLOCSET_DEFAULT_INITSIZE,
+										ALLOCSET_DEFAULT_MAXSIZE);
+
+	MemoryContextSwitchTo(HealthCheckContext);
+
+#ifdef HAVE_SYS_EPOLL_H
+	InitHealthCheckEvents();
+#endif
 
 	/*
 	 * Main loop: do this until the SIGTERM handler tells us to terminate
+	 *
+	 * Each node is checked once per HealthCheckPeriod, at its own time within
+	 * the period. The list of nodes is only scanned again when it changes, as
+	 * told by the node table triggers, and the suspicion levels are refreshed
+	 * once per period from the keeper reports kept in shared memory.
 	 */
 	while (!got_sigterm)
 	{
 		struct timeval currentTime = { 0, 0 };
-		struct timeval roundEndTime = { 0, 0 };
-		int timeout = 0;
-		List *nodeHealthList = NIL;
-		List *healthCheckList = NIL;
-
-		gettimeofday(&currentTime, NULL);
-		roundEndTime = AddTimeMillis(currentTime, HealthCheckPeriod);
-
+		long timeout = HealthCheckPeriod;
 
 		if (!foundPgAutoFailoverExtension)
 		{
@@ -479,24 +713,108 @@ HealthCheckWorkerMain(Datum arg)
 				foundPgAutoFailoverExtension = true;
 				elog(LOG,
 					 "pg_auto_failover extension found in database %d, "
-					 "starting Health Checks.", dboid);
+					 "starting Health Checks (worker %d of %d).",
+					 dboid, workerArgs.workerIndex + 1, workerArgs.workerCount);
 			}
 		}
 
 		if (foundPgAutoFailoverExtension)
 		{
-			nodeHealthList = LoadNodeHealthList();
-			healthCheckList = CreateHealthChecks(nodeHealthList);
+			uint64 currentVersion = GetNodeListVersion(dboid);
 
-			DoHealthChecks(healthCheckList);
+			gettimeofday(&currentTime, NULL);
 
-			MemoryContextReset(healthCheckContext);
-		}
+			if (!nodeListLoaded || currentVersion != nodeListVersion)
+			{
+				/*
+				 * Read the version before scanning the node table, so that a
+				 * change committed during the scan gets us to scan again.
+				 */
+				nodeListLoaded = true;
+				nodeListVersion = currentVersion;
+
+				MemoryContextSwitchTo(loadContext);
+
+				ReloadHealthChecks(workerArgs.workerIndex,
+								   workerArgs.workerCount,
+								   currentTime);
+
+				MemoryContextSwitchTo(HealthCheckContext);
+				MemoryContextReset(loadContext);
+
+				nextReloadTime = AddTimeMillis(currentTime, HealthCheckPeriod);
+			}
+			else if (CompareTimes(&nextReloadTime, &currentTime) <= 0)
+			{
+				RefreshHealthChecks(currentTime);
+
+				nextReloadTime = AddTimeMillis(currentTime, HealthCheckPeriod);
+			}
+
+			StartDueHealthChecks(currentTime);
+			DoHealthChecks(currentTime);
+			FlushNodeHealthStates();
+
+			/* the first worker of the database inserts the buffered events */
+			if (workerArgs.workerIndex == 0)
+			{
+				MemoryContextSwitchTo(loadContext);
+
+				FlushBufferedEvents();
+
+				MemoryContextSwitchTo(HealthCheckContext);
+				MemoryContextReset(loadContext);
+			}
+
+			/* the first worker also purges expired events and timings */
+			if (workerArgs.workerIndex == 0 &&
+				CompareTimes(&nextPurgeTime, &currentTime) <= 0)
+			{
+				MemoryContextSwitchTo(loadContext);
+
+				PurgeExpiredEvents();
+				PurgeTransitionTimings();
+
+				MemoryContextSwitchTo(HealthCheckContext);
+				MemoryContextReset(loadContext);
+
+				nextPurgeTime = AddTimeMillis(currentTime, EVENT_PURGE_INTERVAL_MS);
+			}
 
-		gettimeofday(&currentTime, NULL);
-		timeout = SubtractTimes(roundEndTime, currentTime);
+			/* and vacuums the node table, that node_active keeps updating */
+			if (workerArgs.workerIndex == 0 &&
+				NodeVacuumInterval > 0 &&
+				CompareTimes(&nextVacuumTime, &currentTime) <= 0)
+			{
+				MemoryContextSwitchTo(loadContext);
+
+				VacuumNodeTable();
+
+				MemoryContextSwitchTo(HealthCheckContext);
+				MemoryContextReset(loadContext);
+
+				nextVacuumTime = AddTimeMillis(currentTime, NodeVacuumInterval);
+			}
+
+			/* wake up in time for the next vacuum of the node table too */
+			nextWakeTime = nextReloadTime;
+
+			if (workerArgs.workerIndex == 0 &&
+				NodeVacuumInterval > 0 &&
+				CompareTimes(&nextVacuumTime, &nextWakeTime) < 0)
+			{
+				nextWakeTime = nextVacuumTime;
+			}
+
+			gettimeofday(&currentTime, NULL);
+			timeout = NextHealthCheckTimeout(currentTime, nextWakeTime);
+		}
 
-		if (timeout >= 0)
+		if (ActiveHealthCheckList != NIL)
+		{
+			WaitForEvent(ActiveHealthCheckList, timeout);
+		}
+		else if (timeout > 0)
 		{
 			LatchWait(timeout);
 		}
@@ -508,6 +826,12 @@ HealthCheckWorkerMain(Datum arg)
 		}
 	}
 
+	/* don't leave events behind in the buffer at shutdown */
+	if (foundPgAutoFailoverExtension && workerArgs.workerIndex == 0)
+	{
+		FlushBufferedEvents();
+	}
+
 	elog(LOG,
 		 "pg_auto_failover monitor exiting for database %d", dboid);
 
@@ -540,581 +864,2199 @@ pgAutoFailoverExtensionExists(void)
 
 
 /*
- * CreateHealthChecks creates a list of health checks from a list of node health
- * descriptions.
+ * ReloadHealthChecks loads the list of nodes to check, creates the health
+ * checks for new nodes and removes the health checks of nodes that we don't
+ * have to check anymore. Health checks of known nodes are kept as-is, with
+ * their schedule.
+ *
+ * The node list is allocated in the current memory context, which the caller
+ * is expected to reset, the health checks are allocated in HealthCheckContext.
  */
-static List *
-CreateHealthChecks(List *nodeHealthList)
+static void
+ReloadHealthChecks(int workerIndex, int workerCount, struct timeval currentTime)
 {
-	List *healthCheckList = NIL;
+	List *nodeHealthList = LoadNodeHealthList(workerIndex, workerCount);
+	TimestampTz loadTime = GetCurrentTimestamp();
 	ListCell *nodeHealthCell = NULL;
+	HASH_SEQ_STATUS status;
+	HealthCheck *healthCheck = NULL;
+	MemoryContext oldContext = MemoryContextSwitchTo(HealthCheckContext);
+
+	if (HealthCheckHash == NULL)
+	{
+		HASHCTL info;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = MAX_CONN_INFO_SIZE;
+		info.entrysize = sizeof(HealthCheck);
+		info.hcxt = HealthCheckContext;
+
+		HealthCheckHash = hash_create("pg_auto_failover health checks",
+									  32, &info, HASH_ELEM | HASH_CONTEXT);
+	}
+
+	hash_seq_init(&status, HealthCheckHash);
+
+	while ((healthCheck = (HealthCheck *) hash_seq_search(&status)) != NULL)
+	{
+		healthCheck->seen = false;
+	}
 
 	foreach(nodeHealthCell, nodeHealthList)
 	{
 		NodeHealth *nodeHealth = (NodeHealth *) lfirst(nodeHealthCell);
-		HealthCheck *healthCheck = CreateHealthCheck(nodeHealth);
-		healthCheckList = lappend(healthCheckList, healthCheck);
+		char nodeKey[MAX_CONN_INFO_SIZE] = { 0 };
+		bool found = false;
+
+		snprintf(nodeKey, MAX_CONN_INFO_SIZE, "%s:%d",
+				 nodeHealth->nodeName, nodeHealth->nodePort);
+
+		healthCheck = (HealthCheck *)
+			hash_search(HealthCheckHash, nodeKey, HASH_ENTER, &found);
+
+		if (!found)
+		{
+			InitHealthCheck(healthCheck, nodeHealth, currentTime);
+		}
+		else
+		{
+			healthCheck->node->healthState = nodeHealth->healthState;
+		}
+
+		healthCheck->node->reportTime = nodeHealth->reportTime;
+		healthCheck->seen = true;
+
+		CheckSuspiciousNode(healthCheck, loadTime, currentTime);
+	}
+
+	hash_seq_init(&status, HealthCheckHash);
+
+	while ((healthCheck = (HealthCheck *) hash_seq_search(&status)) != NULL)
+	{
+		if (!healthCheck->seen)
+		{
+			RemoveHealthCheck(healthCheck);
+		}
 	}
 
-	return healthCheckList;
+	RebuildHealthCheckSchedule();
+
+	MemoryContextSwitchTo(oldContext);
 }
 
 
 /*
- * CreateHealthCheck creates a health check from a health check description.
+ * RefreshHealthChecks updates the suspicion level of the nodes we check from
+ * the keeper reports registered in shared memory, without having to scan the
+ * node table.
  */
-static HealthCheck *
-CreateHealthCheck(NodeHealth *nodeHealth)
+static void
+RefreshHealthChecks(struct timeval currentTime)
 {
+	TimestampTz loadTime = GetCurrentTimestamp();
+	HASH_SEQ_STATUS status;
 	HealthCheck *healthCheck = NULL;
-	struct timeval invalidTime = { 0, 0 };
+	MemoryContext oldContext = NULL;
 
-	healthCheck = palloc0(sizeof(HealthCheck));
-	healthCheck->node = nodeHealth;
-	healthCheck->state = HEALTH_CHECK_INITIAL;
-	healthCheck->connection = NULL;
-	healthCheck->numTries = 0;
-	healthCheck->nextEventTime = invalidTime;
+	if (HealthCheckHash == NULL)
+	{
+		return;
+	}
+
+	oldContext = MemoryContextSwitchTo(HealthCheckContext);
+
+	hash_seq_init(&status, HealthCheckHash);
+
+	while ((healthCheck = (HealthCheck *) hash_seq_search(&status)) != NULL)
+	{
+		NodeReport report;
+
+		if (GetNodeReport(healthCheck->node->nodeName,
+						  healthCheck->node->nodePort,
+						  &report) &&
+			report.reportTime > healthCheck->node->reportTime)
+		{
+			healthCheck->node->reportTime = report.reportTime;
+		}
 
-	return healthCheck;
+		CheckSuspiciousNode(healthCheck, loadTime, currentTime);
+	}
+
+	RebuildHealthCheckSchedule();
+
+	MemoryContextSwitchTo(oldContext);
 }
 
 
 /*
- * DoHealthChecks performs the given health checks.
+ * CheckSuspiciousNode updates the suspicion level of a node. A node that fell
+ * under suspicion is checked as soon as possible, which only takes effect
+ * once the schedule has been rebuilt.
  */
 static void
-DoHealthChecks(List *healthCheckList)
+CheckSuspiciousNode(HealthCheck *healthCheck, TimestampTz loadTime,
+					struct timeval currentTime)
 {
-	while (!got_sigterm)
-	{
-		int pendingCheckCount = 0;
-		struct timeval currentTime = { 0, 0 };
-		ListCell *healthCheckCell = NULL;
-
-		gettimeofday(&currentTime, NULL);
-
-		foreach(healthCheckCell, healthCheckList)
-		{
-			HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
+	UpdateSuspicionLevel(healthCheck, loadTime);
 
-			ManageHealthCheck(healthCheck, currentTime);
+	if (!healthCheck->inProgress &&
+		HealthCheckPhiThreshold > 0 &&
+		healthCheck->phi >= HealthCheckPhiThreshold)
+	{
+		struct timeval fastCheckTime =
+			AddTimeMillis(currentTime, HealthCheckRetryDelay);
 
-			if (healthCheck->state != HEALTH_CHECK_OK &&
-				healthCheck->state != HEALTH_CHECK_DEAD)
-			{
-				pendingCheckCount++;
-			}
-		}
-		if (pendingCheckCount == 0)
+		if (CompareTimes(&fastCheckTime, &healthCheck->nextCheckTime) < 0)
 		{
-			break;
+			healthCheck->nextCheckTime = currentTime;
 		}
-
-		WaitForEvent(healthCheckList);
 	}
 }
 
 
 /*
- * WaitForEvent sleeps until a time-based or I/O event occurs in any of the health
- * checks.
+ * RebuildHealthCheckSchedule rebuilds the schedule heap from the health
+ * checks that are not in progress, in the current memory context.
  */
-static int
-WaitForEvent(List *healthCheckList)
+static void
+RebuildHealthCheckSchedule(void)
 {
-	ListCell *healthCheckCell = NULL;
-	int healthCheckCount = list_length(healthCheckList);
-	struct pollfd *pollFDs = NULL;
-	struct timeval currentTime = { 0, 0 };
-	struct timeval nextEventTime = { 0, 0 };
-	int healthCheckIndex = 0;
-	int pollResult = 0;
-	int pollTimeout = 0;
+	HASH_SEQ_STATUS status;
+	HealthCheck *healthCheck = NULL;
+	long healthCheckCount = 0;
 
-	pollFDs = (struct pollfd *) palloc0(healthCheckCount * sizeof(struct pollfd));
+	if (HealthCheckSchedule != NULL)
+	{
+		binaryheap_free(HealthCheckSchedule);
+	}
 
-	gettimeofday(&currentTime, NULL);
+	healthCheckCount = hash_get_num_entries(HealthCheckHash);
 
-	foreach(healthCheckCell, healthCheckList)
-	{
-		HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
-		struct pollfd *pollFileDescriptor = &pollFDs[healthCheckIndex];
+	HealthCheckSchedule = binaryheap_allocate(Max(healthCheckCount, 1),
+											  CompareHealthCheckTimes, NULL);
 
-		pollFileDescriptor->fd = -1;
-		pollFileDescriptor->events = 0;
-		pollFileDescriptor->revents = 0;
+	hash_seq_init(&status, HealthCheckHash);
 
-		if (healthCheck->state == HEALTH_CHECK_CONNECTING ||
-			healthCheck->state == HEALTH_CHECK_RETRY)
+	while ((healthCheck = (HealthCheck *) hash_seq_search(&status)) != NULL)
+	{
+		if (!healthCheck->inProgress)
 		{
-			bool hasTimeout = healthCheck->nextEventTime.tv_sec != 0;
-
-			if (hasTimeout &&
-				(nextEventTime.tv_sec == 0 ||
-				 CompareTimes(&healthCheck->nextEventTime, &nextEventTime) < 0))
-			{
-				nextEventTime = healthCheck->nextEventTime;
-			}
+			binaryheap_add_unordered(HealthCheckSchedule,
+									 PointerGetDatum(healthCheck));
 		}
+	}
 
-		if (healthCheck->state == HEALTH_CHECK_CONNECTING)
-		{
-			PGconn *connection = healthCheck->connection;
-			int pollEventMask = 0;
+	binaryheap_build(HealthCheckSchedule);
+}
 
-			if (healthCheck->pollingStatus == PGRES_POLLING_READING)
-			{
-				pollEventMask = POLLERR | POLLIN;
-			}
-			else if (healthCheck->pollingStatus == PGRES_POLLING_WRITING)
-			{
-				pollEventMask = POLLERR | POLLOUT;
-			}
 
-			pollFileDescriptor->fd = PQsocket(connection);
-			pollFileDescriptor->events = pollEventMask;
-		}
+/*
+ * InitHealthCheck initializes a health check for the given node, which is
+ * copied in the current memory context, and schedules its first check.
+ */
+static void
+InitHealthCheck(HealthCheck *healthCheck, NodeHealth *nodeHealth,
+				struct timeval currentTime)
+{
+	struct timeval invalidTime = { 0, 0 };
 
-		healthCheckIndex++;
-	}
+	healthCheck->node = (NodeHealth *) palloc0(sizeof(NodeHealth));
+	healthCheck->node->nodeName = pstrdup(nodeHealth->nodeName);
+	healthCheck->node->nodePort = nodeHealth->nodePort;
+	healthCheck->node->healthState = nodeHealth->healthState;
 
-	pollTimeout = SubtractTimes(nextEventTime, currentTime);
-	if (pollTimeout < 0)
-	{
-		pollTimeout = 0;
-	}
-	else if (pollTimeout > HealthCheckRetryDelay)
-	{
-		pollTimeout = HealthCheckRetryDelay;
-	}
+	healthCheck->state = HEALTH_CHECK_INITIAL;
+	healthCheck->connection = NULL;
+	healthCheck->readyToPoll = false;
+	healthCheck->pollingStatus = PGRES_POLLING_FAILED;
+	healthCheck->numTries = 0;
+	healthCheck->nextEventTime = invalidTime;
+	healthCheck->registeredSocket = PGINVALID_SOCKET;
+	healthCheck->registeredEvents = 0;
+	healthCheck->inProgress = false;
+	healthCheck->backoff = 1;
+	healthCheck->phi = 0.0;
+	healthCheck->reportAgeMean = 0.0;
+	healthCheck->reportAgeVariance = 0.0;
+	healthCheck->hasReportAge = false;
+	healthCheck->healthStateWritten = false;
+
+	/* a stable offset spreads the checks of all the nodes over the period */
+	healthCheck->scheduleOffset =
+		string_hash(healthCheck->nodeKey, MAX_CONN_INFO_SIZE);
+
+	ScheduleHealthCheck(healthCheck, currentTime, false);
+}
 
-	pollResult = poll(pollFDs, healthCheckCount, pollTimeout);
 
-	if (pollResult < 0)
+/*
+ * RemoveHealthCheck stops checking a node, closing the connection to it if
+ * needed. Removing a node from the schedule heap is the caller's business.
+ */
+static void
+RemoveHealthCheck(HealthCheck *healthCheck)
+{
+	if (healthCheck->connection != NULL)
 	{
-		return STATUS_ERROR;
+		PQfinish(healthCheck->connection);
+		healthCheck->connection = NULL;
 	}
 
-	healthCheckIndex = 0;
-
-	foreach(healthCheckCell, healthCheckList)
+	if (healthCheck->inProgress)
 	{
-		HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
-		struct pollfd *pollFileDescriptor = &pollFDs[healthCheckIndex];
+		ActiveHealthCheckList =
+			list_delete_ptr(ActiveHealthCheckList, healthCheck);
+	}
 
-		healthCheck->readyToPoll = pollFileDescriptor->revents &
-								   pollFileDescriptor->events;
+	ForgetNodeHeartbeat(healthCheck->node->nodeName,
+						healthCheck->node->nodePort);
+	ForgetHealthCheckStats(healthCheck->node->nodeName,
+						   healthCheck->node->nodePort);
 
-		healthCheckIndex++;
-	}
+	pfree(healthCheck->node->nodeName);
+	pfree(healthCheck->node);
 
-	return 0;
+	hash_search(HealthCheckHash, healthCheck->nodeKey, HASH_REMOVE, NULL);
 }
 
 
 /*
- * LatchWait sleeps on the process latch until a timeout occurs.
+ * UpdateSuspicionLevel computes the suspicion level of a node, in the manner
+ * of a phi-accrual failure detector, using the keeper reports as heartbeats.
+ *
+ * Each time we load the node list, we sample the age of the last report of
+ * the keeper. While the keeper is reporting as usual, those ages follow the
+ * distribution we learn with an exponentially weighted mean and variance.
+ * phi is then -log10 of the probability to observe a report at least this
+ * old: a phi of 1 means a 10% chance that the keeper is fine, a phi of 8 a
+ * chance of one in 10^8.
  */
 static void
-LatchWait(long timeoutMs)
+UpdateSuspicionLevel(HealthCheck *healthCheck, TimestampTz loadTime)
 {
-	int waitResult = 0;
+	double reportAge = (double) (loadTime - healthCheck->node->reportTime) / 1000.0;
+	double stddev = 0.0;
+	double probability = 0.0;
 
-	/*
-	 * Background workers mustn't call usleep() or any direct equivalent:
-	 * instead, they may wait on their process latch, which sleeps as
-	 * necessary, but is awakened if postmaster dies.  That way the
-	 * background process goes away immediately in an emergency.
-	 */
-#if (PG_VERSION_NUM >= 100000)
-	waitResult = WaitLatch(MyLatch,
-						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-						   timeoutMs, WAIT_EVENT_CLIENT_READ);
-#else
-	waitResult = WaitLatch(MyLatch,
-						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-						   timeoutMs);
-#endif
+	if (reportAge < 0)
+	{
+		reportAge = 0;
+	}
 
-	ResetLatch(MyLatch);
+	if (!healthCheck->hasReportAge)
+	{
+		healthCheck->reportAgeMean = reportAge;
+		healthCheck->reportAgeVariance = 0.0;
+		healthCheck->hasReportAge = true;
+		healthCheck->phi = 0.0;
 
-	/* emergency bailout if postmaster has died */
-	if (waitResult & WL_POSTMASTER_DEATH)
+		return;
+	}
+
+	stddev = Max(sqrt(healthCheck->reportAgeVariance), PHI_MIN_STDDEV_MS);
+	probability = 0.5 * erfc((reportAge - healthCheck->reportAgeMean) /
+							 (stddev * sqrt(2.0)));
+
+	if (probability <= pow(10.0, -PHI_MAX))
 	{
-		elog(LOG, "pg_auto_failover monitor exiting");
+		healthCheck->phi = PHI_MAX;
+	}
+	else
+	{
+		healthCheck->phi = -log10(probability);
+	}
 
-		proc_exit(1);
+	/* only learn from the ages of reports when the keeper is not suspicious */
+	if (HealthCheckPhiThreshold == 0 || healthCheck->phi < HealthCheckPhiThreshold)
+	{
+		double difference = reportAge - healthCheck->reportAgeMean;
+
+		healthCheck->reportAgeMean += PHI_SMOOTHING_FACTOR * difference;
+		healthCheck->reportAgeVariance =
+			(1 - PHI_SMOOTHING_FACTOR) *
+			(healthCheck->reportAgeVariance +
+			 PHI_SMOOTHING_FACTOR * difference * difference);
 	}
 }
 
 
 /*
- * ManageHealthCheck proceeds the health check state machine.
+ * ScheduleHealthCheck computes the next check time of the given health
+ * check.
+ *
+ * Each node is checked at the same moment within every HealthCheckPeriod, as
+ * given by its stable scheduleOffset, and nodes are spread evenly over the
+ * period. When afterCheck is true, the node has just been checked, and we
+ * never schedule its next check before the next period.
+ *
+ * When HealthCheckPhiThreshold is set, the cadence adapts to the node: a node
+ * that failed its check, or whose keeper reports are late, is checked again
+ * after HealthCheckRetryDelay. A healthy node with a regular keeper backs off,
+ * skipping up to HealthCheckMaxBackoff - 1 periods: its keeper reports tell
+ * us it's alive in the meantime.
  */
 static void
-ManageHealthCheck(HealthCheck *healthCheck, struct timeval currentTime)
+ScheduleHealthCheck(HealthCheck *healthCheck, struct timeval currentTime,
+					bool afterCheck)
 {
-	HealthCheckState checkState = healthCheck->state;
-	NodeHealth *nodeHealth = healthCheck->node;
+	uint64 currentTimeMs = (uint64) currentTime.tv_sec * 1000 +
+						   currentTime.tv_usec / 1000;
+	uint32 period = (uint32) HealthCheckPeriod;
+	uint32 phase = (uint32) (currentTimeMs % period);
+	uint32 offset = healthCheck->scheduleOffset % period;
+	uint32 delay = (offset + period - phase) % period;
+
+	if (delay == 0 && afterCheck)
+	{
+		delay = period;
+	}
 
-	switch (checkState)
+	if (afterCheck && HealthCheckPhiThreshold > 0)
 	{
-		case HEALTH_CHECK_RETRY:
+		if (healthCheck->state == HEALTH_CHECK_DEAD ||
+			healthCheck->phi >= HealthCheckPhiThreshold)
 		{
-			if (healthCheck->numTries >= HealthCheckMaxRetries + 1)
-			{
-				if (nodeHealth->healthState != NODE_HEALTH_BAD)
-				{
-					elog(LOG, "pg_auto_failover monitor marking node %s:%d as unhealthy",
-						 nodeHealth->nodeName,
-						 nodeHealth->nodePort);
-				}
+			healthCheck->backoff = 1;
+			healthCheck->nextCheckTime =
+				AddTimeMillis(currentTime, HealthCheckRetryDelay);
 
-				SetNodeHealthState(healthCheck->node->nodeName,
-								   healthCheck->node->nodePort,
-								   NODE_HEALTH_BAD);
+			return;
+		}
 
-				healthCheck->state = HEALTH_CHECK_DEAD;
-				break;
+		if (healthCheck->phi < 1.0)
+		{
+			healthCheck->backoff = Min(healthCheck->backoff + 1,
+									   HealthCheckMaxBackoff);
+		}
+		else
+		{
+			healthCheck->backoff = 1;
+		}
+
+		delay += (healthCheck->backoff - 1) * period;
+	}
+
+	healthCheck->nextCheckTime = AddTimeMillis(currentTime, delay);
+}
+
+
+/*
+ * CompareHealthCheckTimes is the binaryheap comparator for the schedule of
+ * health checks. The binaryheap is a max-heap, and we want the health check
+ * with the earliest check time first.
+ */
+static int
+CompareHealthCheckTimes(Datum left, Datum right, void *arg)
+{
+	HealthCheck *leftCheck = (HealthCheck *) DatumGetPointer(left);
+	HealthCheck *rightCheck = (HealthCheck *) DatumGetPointer(right);
+
+	return CompareTimes(&rightCheck->nextCheckTime, &leftCheck->nextCheckTime);
+}
+
+
+/*
+ * StartDueHealthChecks starts the health checks whose check time has come,
+ * moving them from the schedule to the list of health checks in progress.
+ */
+static void
+StartDueHealthChecks(struct timeval currentTime)
+{
+	if (HealthCheckSchedule == NULL)
+	{
+		return;
+	}
+
+	while (!binaryheap_empty(HealthCheckSchedule))
+	{
+		HealthCheck *healthCheck = (HealthCheck *)
+			DatumGetPointer(binaryheap_first(HealthCheckSchedule));
+
+		if (CompareTimes(&healthCheck->nextCheckTime, &currentTime) > 0)
+		{
+			break;
+		}
+
+		(void) binaryheap_remove_first(HealthCheckSchedule);
+
+		/* the setting might have been changed since we kept the connection */
+		if (healthCheck->connection != NULL && !HealthCheckPersistentConnections)
+		{
+			PQfinish(healthCheck->connection);
+			healthCheck->connection = NULL;
+		}
+
+		healthCheck->state = HEALTH_CHECK_INITIAL;
+		healthCheck->readyToPoll = false;
+		healthCheck->numTries = 0;
+		healthCheck->inProgress = true;
+
+		ActiveHealthCheckList = lappend(ActiveHealthCheckList, healthCheck);
+	}
+}
+
+
+/*
+ * DoHealthChecks proceeds the health checks in progress, and schedules the
+ * next check of those that are done.
+ *
+ * While at it, we keep track of the next timeout of the health checks that are
+ * still in progress, and update the epoll registration of those whose socket
+ * or interest changed, so that WaitForEvent doesn't need to walk the list.
+ */
+static void
+DoHealthChecks(struct timeval currentTime)
+{
+	List *activeHealthCheckList = NIL;
+	ListCell *healthCheckCell = NULL;
+
+	NextHealthCheckEventTime.tv_sec = 0;
+	NextHealthCheckEventTime.tv_usec = 0;
+
+	foreach(healthCheckCell, ActiveHealthCheckList)
+	{
+		HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
+#ifdef HAVE_SYS_EPOLL_H
+		HealthCheckState previousState = healthCheck->state;
+		PostgresPollingStatusType previousStatus = healthCheck->pollingStatus;
+		bool polled = healthCheck->readyToPoll;
+#endif
+
+		ManageHealthCheck(healthCheck, currentTime);
+
+		if (healthCheck->state != HEALTH_CHECK_OK &&
+			healthCheck->state != HEALTH_CHECK_DEAD)
+		{
+			bool hasTimeout = healthCheck->nextEventTime.tv_sec != 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+			if (polled ||
+				healthCheck->state != previousState ||
+				healthCheck->pollingStatus != previousStatus)
+			{
+				UpdateHealthCheckEvents(healthCheck);
 			}
+#endif
 
-			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) > 0)
+			if (hasTimeout &&
+				(NextHealthCheckEventTime.tv_sec == 0 ||
+				 CompareTimes(&healthCheck->nextEventTime,
+							  &NextHealthCheckEventTime) < 0))
 			{
-				/* Retry time lies in the future */
-				break;
+				NextHealthCheckEventTime = healthCheck->nextEventTime;
 			}
 
-			/* Fall through to re-connect */
+			activeHealthCheckList = lappend(activeHealthCheckList, healthCheck);
+			continue;
 		}
 
-		/* fallthrough */
-		case HEALTH_CHECK_INITIAL:
+#ifdef HAVE_SYS_EPOLL_H
+		/* a connection kept opened must not wake us up until its next check */
+		UpdateHealthCheckEvents(healthCheck);
+#endif
+
+		healthCheck->inProgress = false;
+
+		ScheduleHealthCheck(healthCheck, currentTime, true);
+		binaryheap_add(HealthCheckSchedule, PointerGetDatum(healthCheck));
+	}
+
+	list_free(ActiveHealthCheckList);
+	ActiveHealthCheckList = activeHealthCheckList;
+}
+
+
+/*
+ * NextHealthCheckTimeout returns how many milliseconds we can wait until the
+ * next health check is due or the node list is to be reloaded.
+ */
+static long
+NextHealthCheckTimeout(struct timeval currentTime, struct timeval nextReloadTime)
+{
+	struct timeval nextEventTime = nextReloadTime;
+	long timeout = 0;
+
+	if (HealthCheckSchedule != NULL && !binaryheap_empty(HealthCheckSchedule))
+	{
+		HealthCheck *healthCheck = (HealthCheck *)
+			DatumGetPointer(binaryheap_first(HealthCheckSchedule));
+
+		if (CompareTimes(&healthCheck->nextCheckTime, &nextEventTime) < 0)
 		{
-			PGconn *connection = NULL;
-			ConnStatusType connStatus = CONNECTION_BAD;
-			char connInfoString[MAX_CONN_INFO_SIZE];
+			nextEventTime = healthCheck->nextCheckTime;
+		}
+	}
 
-			snprintf(connInfoString, MAX_CONN_INFO_SIZE, CONN_INFO_TEMPLATE,
-					 nodeHealth->nodeName, nodeHealth->nodePort, HealthCheckTimeout);
+	timeout = SubtractTimes(nextEventTime, currentTime);
 
-			connection = PQconnectStart(connInfoString);
-			PQsetnonblocking(connection, true);
+	return timeout < 0 ? 0 : timeout;
+}
 
-			connStatus = PQstatus(connection);
-			if (connStatus == CONNECTION_BAD)
-			{
-				struct timeval nextTryTime = { 0, 0 };
 
-				PQfinish(connection);
+#ifdef HAVE_SYS_EPOLL_H
 
-				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+/*
+ * InitHealthCheckEvents creates the epoll set of our health check sockets,
+ * and the wait event set in which WaitForEvent waits for it. Postgres doesn't
+ * expose the file descriptor of a latch, so rather than adding our latch to
+ * the epoll set, we add the epoll set to a wait event set with our latch: an
+ * epoll descriptor is readable when any of its sockets is ready.
+ */
+static void
+InitHealthCheckEvents(void)
+{
+	HealthCheckEpollFd = epoll_create1(EPOLL_CLOEXEC);
 
-				healthCheck->nextEventTime = nextTryTime;
-				healthCheck->connection = NULL;
-				healthCheck->pollingStatus = PGRES_POLLING_FAILED;
-				healthCheck->state = HEALTH_CHECK_RETRY;
-			}
-			else
-			{
-				struct timeval timeoutTime = { 0, 0 };
+	if (HealthCheckEpollFd < 0)
+	{
+		ereport(ERROR,
+				(errcode_for_socket_access(),
+				 errmsg("could not create epoll descriptor: %m")));
+	}
 
-				timeoutTime = AddTimeMillis(currentTime, HealthCheckTimeout);
+	HealthCheckWaitSet = CreateWaitEventSet(TopMemoryContext, 3);
 
-				healthCheck->nextEventTime = timeoutTime;
-				healthCheck->connection = connection;
-				healthCheck->pollingStatus = PGRES_POLLING_WRITING;
-				healthCheck->state = HEALTH_CHECK_CONNECTING;
-			}
+	AddWaitEventToSet(HealthCheckWaitSet, WL_LATCH_SET, PGINVALID_SOCKET,
+					  MyLatch, NULL);
+	AddWaitEventToSet(HealthCheckWaitSet, WL_POSTMASTER_DEATH,
+					  PGINVALID_SOCKET, NULL, NULL);
+	AddWaitEventToSet(HealthCheckWaitSet, WL_SOCKET_READABLE,
+					  HealthCheckEpollFd, NULL, NULL);
+}
 
-			healthCheck->numTries++;
 
-			break;
+/*
+ * WaitForEvent sleeps until a time-based or I/O event occurs in any of the health
+ * checks, or our latch is set, or for at most maxTimeoutMs milliseconds.
+ *
+ * Each health check socket is registered once in our epoll set, and its
+ * interest is only changed by DoHealthChecks when libpq flips between reading
+ * and writing, so that a wakeup doesn't walk the list of health checks at
+ * all: only the health checks whose socket became ready are flagged for
+ * polling.
+ */
+static int
+WaitForEvent(List *healthCheckList, long maxTimeoutMs)
+{
+	struct epoll_event readyEvents[MAX_HEALTH_CHECK_EVENTS];
+	WaitEvent occurredEvents[3];
+	struct timeval currentTime = { 0, 0 };
+	bool socketsReady = false;
+	int eventIndex = 0;
+	int eventCount = 0;
+	int pollTimeout = 0;
+
+	gettimeofday(&currentTime, NULL);
+
+	pollTimeout = SubtractTimes(NextHealthCheckEventTime, currentTime);
+	if (pollTimeout < 0)
+	{
+		pollTimeout = 0;
+	}
+	else if (pollTimeout > HealthCheckRetryDelay)
+	{
+		pollTimeout = HealthCheckRetryDelay;
+	}
+
+	if (pollTimeout > maxTimeoutMs)
+	{
+		pollTimeout = maxTimeoutMs;
+	}
+
+	pgstat_report_activity(STATE_RUNNING, ACTIVITY_HEALTH_CHECK_POLL);
+
+	eventCount = WaitEventSetWait(HealthCheckWaitSet, pollTimeout,
+								  occurredEvents, lengthof(occurredEvents),
+								  WAIT_EVENT_HEALTH_CHECK_POLL);
+
+	for (eventIndex = 0; eventIndex < eventCount; eventIndex++)
+	{
+		uint32 events = occurredEvents[eventIndex].events;
+
+		/* emergency bailout if postmaster has died */
+		if (events & WL_POSTMASTER_DEATH)
+		{
+			elog(LOG, "pg_auto_failover monitor exiting");
+
+			proc_exit(1);
 		}
 
-		case HEALTH_CHECK_CONNECTING:
+		if (events & WL_LATCH_SET)
 		{
-			PGconn *connection = healthCheck->connection;
-			PostgresPollingStatusType pollingStatus = PGRES_POLLING_FAILED;
-			char *sqlstate = NULL;
-			bool receivedSqlstate = false;
-			bool cannotConnectNowSqlstate = false;
+			ResetLatch(MyLatch);
+		}
 
-			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) < 0)
-			{
-				struct timeval nextTryTime = { 0, 0 };
+		if (events & WL_SOCKET_READABLE)
+		{
+			socketsReady = true;
+		}
+	}
 
-				PQfinish(connection);
+	if (!socketsReady)
+	{
+		return 0;
+	}
 
-				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+	eventCount = epoll_wait(HealthCheckEpollFd,
+							readyEvents, MAX_HEALTH_CHECK_EVENTS, 0);
 
-				healthCheck->nextEventTime = nextTryTime;
-				healthCheck->connection = NULL;
-				healthCheck->pollingStatus = pollingStatus;
-				healthCheck->state = HEALTH_CHECK_RETRY;
-				break;
-			}
+	if (eventCount < 0)
+	{
+		return STATUS_ERROR;
+	}
 
-			if (!healthCheck->readyToPoll)
-			{
-				break;
-			}
+	for (eventIndex = 0; eventIndex < eventCount; eventIndex++)
+	{
+		HealthCheck *healthCheck = (HealthCheck *) readyEvents[eventIndex].data.ptr;
 
-			/* This logic is taken from libpq's internal_ping (fe-connect.c) */
-			pollingStatus = PQconnectPoll(connection);
-			sqlstate = connection->last_sqlstate;
-			receivedSqlstate = (sqlstate != NULL && strlen(sqlstate) == 5);
-			cannotConnectNowSqlstate = (receivedSqlstate &&
-										strcmp(sqlstate, CANNOT_CONNECT_NOW) == 0);
+		healthCheck->readyToPoll = true;
+	}
+
+	return 0;
+}
+
+
+/*
+ * UpdateHealthCheckEvents makes the epoll set registration of a health check
+ * match its current connection state.
+ *
+ * A socket is removed from the epoll set by the kernel when libpq closes it,
+ * so we never need to unregister anything explicitly. When the health check
+ * has been polled since the last call, libpq might have moved on to another
+ * address and opened a new socket, which can reuse the same descriptor
+ * number, so in that case we re-sync the registration with the kernel.
+ */
+static void
+UpdateHealthCheckEvents(HealthCheck *healthCheck)
+{
+	struct epoll_event event = { 0 };
+	pgsocket socket = PGINVALID_SOCKET;
+	uint32 events = 0;
+	bool polled = healthCheck->readyToPoll;
+
+	healthCheck->readyToPoll = false;
+
+	if (healthCheck->state == HEALTH_CHECK_CONNECTING ||
+		healthCheck->state == HEALTH_CHECK_PINGING)
+	{
+		socket = PQsocket(healthCheck->connection);
+
+		if (healthCheck->pollingStatus == PGRES_POLLING_READING)
+		{
+			events = EPOLLIN;
+		}
+		else if (healthCheck->pollingStatus == PGRES_POLLING_WRITING)
+		{
+			events = EPOLLOUT;
+		}
+	}
+
+	if (socket == PGINVALID_SOCKET)
+	{
+		/*
+		 * PQfinish() closed the socket, which removed it from the set, unless
+		 * the connection is kept opened for the next check, in which case we
+		 * remove it ourselves: we don't want to hear about it until then.
+		 */
+		if (healthCheck->registeredSocket != PGINVALID_SOCKET &&
+			healthCheck->connection != NULL)
+		{
+			(void) epoll_ctl(HealthCheckEpollFd, EPOLL_CTL_DEL,
+							 PQsocket(healthCheck->connection), &event);
+		}
+
+		healthCheck->registeredSocket = PGINVALID_SOCKET;
+		healthCheck->registeredEvents = 0;
+		return;
+	}
+
+	if (!polled &&
+		socket == healthCheck->registeredSocket &&
+		events == healthCheck->registeredEvents)
+	{
+		return;
+	}
+
+	event.events = events;
+	event.data.ptr = healthCheck;
+
+	if (socket == healthCheck->registeredSocket)
+	{
+		if (epoll_ctl(HealthCheckEpollFd, EPOLL_CTL_MOD, socket, &event) == 0)
+		{
+			healthCheck->registeredEvents = events;
+			return;
+		}
+
+		if (errno != ENOENT)
+		{
+			ereport(LOG,
+					(errcode_for_socket_access(),
+					 errmsg("could not modify health check events for "
+							"node %s:%d: %m",
+							healthCheck->node->nodeName,
+							healthCheck->node->nodePort)));
+			return;
+		}
+
+		/* the socket has been replaced, register the new one */
+	}
+
+	if (epoll_ctl(HealthCheckEpollFd, EPOLL_CTL_ADD, socket, &event) < 0)
+	{
+		ereport(LOG,
+				(errcode_for_socket_access(),
+				 errmsg("could not register health check events for "
+						"node %s:%d: %m",
+						healthCheck->node->nodeName,
+						healthCheck->node->nodePort)));
+
+		healthCheck->registeredSocket = PGINVALID_SOCKET;
+		healthCheck->registeredEvents = 0;
+		return;
+	}
+
+	healthCheck->registeredSocket = socket;
+	healthCheck->registeredEvents = events;
+}
+
+#else
+
+/*
+ * WaitForEvent sleeps until a time-based or I/O event occurs in any of the health
+ * checks, or for at most maxTimeoutMs milliseconds.
+ */
+static int
+WaitForEvent(List *healthCheckList, long maxTimeoutMs)
+{
+	ListCell *healthCheckCell = NULL;
+	int healthCheckCount = list_length(healthCheckList);
+	struct pollfd *pollFDs = NULL;
+	struct timeval currentTime = { 0, 0 };
+	int healthCheckIndex = 0;
+	int pollResult = 0;
+	int pollTimeout = 0;
+
+	pollFDs = (struct pollfd *) palloc0(healthCheckCount * sizeof(struct pollfd));
+
+	gettimeofday(&currentTime, NULL);
+
+	foreach(healthCheckCell, healthCheckList)
+	{
+		HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
+		struct pollfd *pollFileDescriptor = &pollFDs[healthCheckIndex];
+
+		pollFileDescriptor->fd = -1;
+		pollFileDescriptor->events = 0;
+		pollFileDescriptor->revents = 0;
+
+		if (healthCheck->state == HEALTH_CHECK_CONNECTING ||
+			healthCheck->state == HEALTH_CHECK_PINGING)
+		{
+			PGconn *connection = healthCheck->connection;
+			int pollEventMask = 0;
+
+			if (healthCheck->pollingStatus == PGRES_POLLING_READING)
+			{
+				pollEventMask = POLLERR | POLLIN;
+			}
+			else if (healthCheck->pollingStatus == PGRES_POLLING_WRITING)
+			{
+				pollEventMask = POLLERR | POLLOUT;
+			}
+
+			pollFileDescriptor->fd = PQsocket(connection);
+			pollFileDescriptor->events = pollEventMask;
+		}
+
+		healthCheckIndex++;
+	}
+
+	pollTimeout = SubtractTimes(NextHealthCheckEventTime, currentTime);
+	if (pollTimeout < 0)
+	{
+		pollTimeout = 0;
+	}
+	else if (pollTimeout > HealthCheckRetryDelay)
+	{
+		pollTimeout = HealthCheckRetryDelay;
+	}
+
+	if (pollTimeout > maxTimeoutMs)
+	{
+		pollTimeout = maxTimeoutMs;
+	}
+
+	pgstat_report_activity(STATE_RUNNING, ACTIVITY_HEALTH_CHECK_POLL);
+	pgstat_report_wait_start(WAIT_EVENT_HEALTH_CHECK_POLL);
+
+	pollResult = poll(pollFDs, healthCheckCount, pollTimeout);
+
+	pgstat_report_wait_end();
+
+	if (pollResult < 0)
+	{
+		return STATUS_ERROR;
+	}
+
+	healthCheckIndex = 0;
+
+	foreach(healthCheckCell, healthCheckList)
+	{
+		HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
+		struct pollfd *pollFileDescriptor = &pollFDs[healthCheckIndex];
+
+		healthCheck->readyToPoll = pollFileDescriptor->revents &
+								   pollFileDescriptor->events;
+
+		healthCheckIndex++;
+	}
+
+	return 0;
+}
+
+#endif   /* HAVE_SYS_EPOLL_H */
+
+
+/*
+ * LatchWait sleeps on the process latch until a timeout occurs.
+ */
+static void
+LatchWait(long timeoutMs)
+{
+	int waitResult = 0;
+
+	/*
+	 * Background workers mustn't call usleep() or any direct equivalent:
+	 * instead, they may wait on their process latch, which sleeps as
+	 * necessary, but is awakened if postmaster dies.  That way the
+	 * background process goes away immediately in an emergency.
+	 */
+	pgstat_report_activity(STATE_IDLE, ACTIVITY_HEALTH_CHECK_ROUND);
+
+#if (PG_VERSION_NUM >= 100000)
+	waitResult = WaitLatch(MyLatch,
+						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+						   timeoutMs, WAIT_EVENT_HEALTH_CHECK_ROUND);
+#else
+	waitResult = WaitLatch(MyLatch,
+						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+						   timeoutMs);
+#endif
+
+	ResetLatch(MyLatch);
+
+	/* emergency bailout if postmaster has died */
+	if (waitResult & WL_POSTMASTER_DEATH)
+	{
+		elog(LOG, "pg_auto_failover monitor exiting");
+
+		proc_exit(1);
+	}
+}
+
+
+/*
+ * ManageHealthCheck proceeds the health check state machine.
+ */
+static void
+ManageHealthCheck(HealthCheck *healthCheck, struct timeval currentTime)
+{
+	HealthCheckState checkState = healthCheck->state;
+	NodeHealth *nodeHealth = healthCheck->node;
+
+	switch (checkState)
+	{
+		case HEALTH_CHECK_RETRY:
+		{
+			if (healthCheck->numTries >= HealthCheckMaxRetries + 1)
+			{
+				if (nodeHealth->healthState != NODE_HEALTH_BAD)
+				{
+					elog(LOG, "pg_auto_failover monitor marking node %s:%d as unhealthy",
+						 nodeHealth->nodeName,
+						 nodeHealth->nodePort);
+				}
+
+				QueueNodeHealthState(healthCheck, NODE_HEALTH_BAD);
+				RecordHealthCheckEvent(healthCheck, HEALTH_CHECK_EVENT_UNHEALTHY,
+									   currentTime);
+
+				healthCheck->state = HEALTH_CHECK_DEAD;
+				break;
+			}
+
+			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) > 0)
+			{
+				/* Retry time lies in the future */
+				break;
+			}
+
+			RecordHealthCheckEvent(healthCheck, HEALTH_CHECK_EVENT_RETRY,
+								   currentTime);
+
+			/* Fall through to re-connect */
+		}
+
+		/* fallthrough */
+		case HEALTH_CHECK_INITIAL:
+		{
+			PGconn *connection = NULL;
+			ConnStatusType connStatus = CONNECTION_BAD;
+			char connInfoString[MAX_CONN_INFO_SIZE];
+
+			healthCheck->attemptStartTime = currentTime;
+
+			/*
+			 * When we kept a connection from the previous check, make sure
+			 * the node is still alive by sending a query on it, which also
+			 * tells us its current LSN. We only open a new connection when
+			 * that fails.
+			 */
+			if (healthCheck->connection != NULL)
+			{
+				connection = healthCheck->connection;
+
+				if (PQstatus(connection) == CONNECTION_OK &&
+					PQsendQuery(connection, HEALTH_CHECK_LSN_QUERY) == 1)
+				{
+					struct timeval timeoutTime = { 0, 0 };
+
+					timeoutTime = AddTimeMillis(currentTime, HealthCheckTimeout);
+
+					healthCheck->nextEventTime = timeoutTime;
+					healthCheck->pollingStatus = PGRES_POLLING_WRITING;
+					healthCheck->state = HEALTH_CHECK_PINGING;
+					healthCheck->numTries++;
+
+					break;
+				}
+
+				PQfinish(connection);
+				healthCheck->connection = NULL;
+			}
+
+			snprintf(connInfoString, MAX_CONN_INFO_SIZE, CONN_INFO_TEMPLATE,
+					 nodeHealth->nodeName, nodeHealth->nodePort, HealthCheckTimeout);
+
+			connection = PQconnectStart(connInfoString);
+			PQsetnonblocking(connection, true);
+
+			connStatus = PQstatus(connection);
+			if (connStatus == CONNECTION_BAD)
+			{
+				struct timeval nextTryTime = { 0, 0 };
+
+				PQfinish(connection);
+
+				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+
+				healthCheck->nextEventTime = nextTryTime;
+				healthCheck->connection = NULL;
+				healthCheck->pollingStatus = PGRES_POLLING_FAILED;
+				healthCheck->state = HEALTH_CHECK_RETRY;
+			}
+			else
+			{
+				struct timeval timeoutTime = { 0, 0 };
+
+				timeoutTime = AddTimeMillis(currentTime, HealthCheckTimeout);
+
+				healthCheck->nextEventTime = timeoutTime;
+				healthCheck->connection = connection;
+				healthCheck->pollingStatus = PGRES_POLLING_WRITING;
+				healthCheck->state = HEALTH_CHECK_CONNECTING;
+			}
+
+			healthCheck->numTries++;
+
+			break;
+		}
+
+		case HEALTH_CHECK_CONNECTING:
+		{
+			PGconn *connection = healthCheck->connection;
+			PostgresPollingStatusType pollingStatus = PGRES_POLLING_FAILED;
+			char *sqlstate = NULL;
+			bool receivedSqlstate = false;
+			bool cannotConnectNowSqlstate = false;
+
+			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) < 0)
+			{
+				struct timeval nextTryTime = { 0, 0 };
+
+				RecordHealthCheckEvent(healthCheck, HEALTH_CHECK_EVENT_TIMEOUT,
+									   currentTime);
+
+				PQfinish(connection);
+
+				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+
+				healthCheck->nextEventTime = nextTryTime;
+				healthCheck->connection = NULL;
+				healthCheck->pollingStatus = pollingStatus;
+				healthCheck->state = HEALTH_CHECK_RETRY;
+				break;
+			}
+
+			if (!healthCheck->readyToPoll)
+			{
+				break;
+			}
+
+			/* This logic is taken from libpq's internal_ping (fe-connect.c) */
+			pollingStatus = PQconnectPoll(connection);
+			sqlstate = connection->last_sqlstate;
+			receivedSqlstate = (sqlstate != NULL && strlen(sqlstate) == 5);
+			cannotConnectNowSqlstate = (receivedSqlstate &&
+										strcmp(sqlstate, CANNOT_CONNECT_NOW) == 0);
+
+			if (pollingStatus == PGRES_POLLING_OK ||
+
+			    /* an auth request means pg is running */
+				connection->auth_req_received ||
+
+			    /* any error but CANNOT_CONNECT means the db is accepting connections */
+				(receivedSqlstate && !cannotConnectNowSqlstate))
+			{
+				/*
+				 * Only a fully established connection can be re-used in the
+				 * next health check.
+				 */
+				if (HealthCheckPersistentConnections &&
+					pollingStatus == PGRES_POLLING_OK)
+				{
+					healthCheck->connection = connection;
+				}
+				else
+				{
+					PQfinish(connection);
+					healthCheck->connection = NULL;
+				}
+
+				if (nodeHealth->healthState != NODE_HEALTH_GOOD)
+				{
+					elog(LOG, "pg_auto_failover monitor marking node %s:%d as healthy",
+						 nodeHealth->nodeName,
+						 nodeHealth->nodePort);
+				}
+
+				QueueNodeHealthState(healthCheck, NODE_HEALTH_GOOD);
+				RecordHealthCheckEvent(healthCheck, HEALTH_CHECK_EVENT_HEALTHY,
+									   currentTime);
+
+				healthCheck->numTries = 0;
+				healthCheck->state = HEALTH_CHECK_OK;
+			}
+			else if (pollingStatus == PGRES_POLLING_FAILED)
+			{
+				struct timeval nextTryTime = { 0, 0 };
+
+				PQfinish(connection);
+
+				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+
+				healthCheck->nextEventTime = nextTryTime;
+				healthCheck->connection = NULL;
+				healthCheck->state = HEALTH_CHECK_RETRY;
+			}
+			else
+			{
+				/* Health check is still connecting */
+			}
+
+			healthCheck->pollingStatus = pollingStatus;
+
+			break;
+		}
+
+		case HEALTH_CHECK_PINGING:
+		{
+			PGconn *connection = healthCheck->connection;
+			bool pingFailed = false;
+			bool pingDone = false;
+
+			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) < 0)
+			{
+				RecordHealthCheckEvent(healthCheck, HEALTH_CHECK_EVENT_TIMEOUT,
+									   currentTime);
+				pingFailed = true;
+			}
+			else if (!healthCheck->readyToPoll)
+			{
+				break;
+			}
+			else if (healthCheck->pollingStatus == PGRES_POLLING_WRITING)
+			{
+				int flushResult = PQflush(connection);
+
+				if (flushResult < 0)
+				{
+					pingFailed = true;
+				}
+				else if (flushResult == 0)
+				{
+					/* the query has been sent, now wait for its result */
+					healthCheck->pollingStatus = PGRES_POLLING_READING;
+				}
+			}
+			else if (PQconsumeInput(connection) == 0)
+			{
+				pingFailed = true;
+			}
+			else
+			{
+				while (!PQisBusy(connection))
+				{
+					PGresult *result = PQgetResult(connection);
+
+					if (result == NULL)
+					{
+						pingDone = true;
+						break;
+					}
+
+					/*
+					 * Any answer means the node is alive, even an error, as
+					 * when our user may not call the LSN functions.
+					 */
+					if (PQresultStatus(result) == PGRES_TUPLES_OK &&
+						PQntuples(result) == 1 && !PQgetisnull(result, 0, 0))
+					{
+						RecordNodeLSN(healthCheck->node->nodeName,
+									  healthCheck->node->nodePort,
+									  PQgetvalue(result, 0, 0));
+					}
+
+					PQclear(result);
+				}
+			}
+
+			if (pingFailed)
+			{
+				struct timeval nextTryTime = { 0, 0 };
+
+				PQfinish(connection);
+
+				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+
+				healthCheck->nextEventTime = nextTryTime;
+				healthCheck->connection = NULL;
+				healthCheck->pollingStatus = PGRES_POLLING_FAILED;
+				healthCheck->state = HEALTH_CHECK_RETRY;
+			}
+			else if (pingDone)
+			{
+				if (nodeHealth->healthState != NODE_HEALTH_GOOD)
+				{
+					elog(LOG, "pg_auto_failover monitor marking node %s:%d as healthy",
+						 nodeHealth->nodeName,
+						 nodeHealth->nodePort);
+				}
+
+				QueueNodeHealthState(healthCheck, NODE_HEALTH_GOOD);
+				RecordHealthCheckEvent(healthCheck, HEALTH_CHECK_EVENT_HEALTHY,
+									   currentTime);
+
+				healthCheck->numTries = 0;
+				healthCheck->state = HEALTH_CHECK_OK;
+			}
+
+			break;
+		}
+
+		case HEALTH_CHECK_DEAD:
+		case HEALTH_CHECK_OK:
+		default:
+		{
+			/* Health check is done */
+		}
+	}
+}
+
+
+/*
+ * QueueNodeHealthState registers the result of a health check, to be written
+ * to the node table with the other results by FlushNodeHealthStates.
+ *
+ * We queue a failed node at each round even when its health didn't change:
+ * SetNodeHealthStateList then skips the write, and runs the group state
+ * machine again once its keeper has been silent for long enough.
+ */
+static void
+QueueNodeHealthState(HealthCheck *healthCheck, NodeHealthState healthState)
+{
+	NodeHealth *nodeHealth = NULL;
+	NodeReport report;
+
+	/* we only write a node's health when it changed, once it's been written */
+	if (healthCheck->healthStateWritten &&
+		healthCheck->node->healthState == healthState &&
+		healthState != NODE_HEALTH_BAD)
+	{
+		return;
+	}
+
+	healthCheck->node->healthState = healthState;
+	healthCheck->healthStateWritten = true;
+
+	/* the keeper might have reported since we refreshed the health checks */
+	if (GetNodeReport(healthCheck->node->nodeName,
+					  healthCheck->node->nodePort,
+					  &report) &&
+		report.reportTime > healthCheck->node->reportTime)
+	{
+		healthCheck->node->reportTime = report.reportTime;
+	}
+
+	nodeHealth = (NodeHealth *) palloc0(sizeof(NodeHealth));
+
+	nodeHealth->nodeName = healthCheck->node->nodeName;
+	nodeHealth->nodePort = healthCheck->node->nodePort;
+	nodeHealth->healthState = healthState;
+	nodeHealth->reportTime = healthCheck->node->reportTime;
+
+	PendingNodeHealthList = lappend(PendingNodeHealthList, nodeHealth);
+}
+
+
+/*
+ * FlushNodeHealthStates writes the pending health check results to the node
+ * table in a single statement.
+ */
+static void
+FlushNodeHealthStates(void)
+{
+	if (PendingNodeHealthList == NIL)
+	{
+		return;
+	}
+
+	SetNodeHealthStateList(PendingNodeHealthList);
+
+	list_free_deep(PendingNodeHealthList);
+	PendingNodeHealthList = NIL;
+}
+
+
+/*
+ * CompareTime compares two timeval structs.
+ *
+ * If leftTime < rightTime, return -1
+ * If leftTime > rightTime, return 1
+ * else, return 0
+ */
+static int
+CompareTimes(struct timeval *leftTime, struct timeval *rightTime)
+{
+	int compareResult = 0;
+
+	if (leftTime->tv_sec < rightTime->tv_sec)
+	{
+		compareResult = -1;
+	}
+	else if (leftTime->tv_sec > rightTime->tv_sec)
+	{
+		compareResult = 1;
+	}
+	else if (leftTime->tv_usec < rightTime->tv_usec)
+	{
+		compareResult = -1;
+	}
+	else if (leftTime->tv_usec > rightTime->tv_usec)
+	{
+		compareResult = 1;
+	}
+	else
+	{
+		compareResult = 0;
+	}
+
+	return compareResult;
+}
+
+
+/*
+ * SubtractTimes subtract the ‘struct timeval’ values y from x,
+ * returning the result.
+ *
+ * From:
+ * http://www.gnu.org/software/libc/manual/html_node/Elapsed-Time.html
+ */
+static int
+SubtractTimes(struct timeval x, struct timeval y)
+{
+	int differenceMs = 0;
+
+	/* Perform the carry for the later subtraction by updating y. */
+	if (x.tv_usec < y.tv_usec)
+	{
+		int nsec = (y.tv_usec - x.tv_usec) / 1000000 + 1;
+		y.tv_usec -= 1000000 * nsec;
+		y.tv_sec += nsec;
+	}
+
+	if (x.tv_usec - y.tv_usec > 1000000)
+	{
+		int nsec = (x.tv_usec - y.tv_usec) / 1000000;
+		y.tv_usec += 1000000 * nsec;
+		y.tv_sec -= nsec;
+	}
+
+	differenceMs += 1000 * (x.tv_sec - y.tv_sec);
+	differenceMs += (x.tv_usec - y.tv_usec) / 1000;
+
+	return differenceMs;
+}
+
+
+/*
+ * AddTimeMillis adds additionalMs milliseconds to a timeval.
+ */
+static struct timeval
+AddTimeMillis(struct timeval base, uint32 additionalMs)
+{
+	struct timeval result = { 0, 0 };
+
+	result.tv_sec = base.tv_sec + additionalMs / 1000;
+	result.tv_usec = base.tv_usec + (additionalMs % 1000) * 1000;
+
+	return result;
+}
+
+
+/*
+ * HealthCheckWorkerShmemSize computes how much shared memory is required.
+ */
+static size_t
+HealthCheckWorkerShmemSize(void)
+{
+	Size size = 0;
+	Size hashSize = 0;
+
+	size = add_size(size, sizeof(HealthCheckHelperDatabase));
+
+	/*
+	 * We request enough shared memory to have one hash-table entry for each
+	 * worker process. We couldn't start more anyway, so there's little point
+	 * in allocating more.
+	 */
+	hashSize = hash_estimate_size(max_worker_processes,
+								  sizeof(HealthCheckHelperDatabase));
+	size = add_size(size, hashSize);
+
+	hashSize = hash_estimate_size(MAX_NODE_HEARTBEATS, sizeof(NodeHeartbeat));
+	size = add_size(size, hashSize);
+
+	hashSize = hash_estimate_size(MAX_HEALTH_CHECK_STATS,
+								  sizeof(HealthCheckStatsEntry));
+	size = add_size(size, hashSize);
+
+	return size;
+}
+
+
+/*
+ * HealthCheckWorkerShmemInit initializes the requested shared memory for the
+ * maintenance daemon.
+ */
+static void
+HealthCheckWorkerShmemInit(void)
+{
+	bool alreadyInitialized = false;
+	HASHCTL hashInfo;
+	int hashFlags = 0;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	HealthCheckHelperControl =
+		(HealthCheckHelperControlData *)
+		ShmemInitStruct("pg_auto_failover Health Check Helper Daemon",
+						HealthCheckWorkerShmemSize(),
+						&alreadyInitialized);
+
+	/*
+	 * Might already be initialized on EXEC_BACKEND type platforms that call
+	 * shared library initialization functions in every backend.
+	 */
+	if (!alreadyInitialized)
+	{
+		HealthCheckHelperControl->trancheId = LWLockNewTrancheId();
+		HealthCheckHelperControl->lockTrancheName =
+			"pg_auto_failover Health Check Daemon";
+		LWLockRegisterTranche(HealthCheckHelperControl->trancheId,
+							  HealthCheckHelperControl->lockTrancheName);
+
+		LWLockInitialize(&HealthCheckHelperControl->lock,
+						 HealthCheckHelperControl->trancheId);
+		LWLockInitialize(&HealthCheckHelperControl->heartbeatLock,
+						 HealthCheckHelperControl->trancheId);
+		LWLockInitialize(&HealthCheckHelperControl->statsLock,
+						 HealthCheckHelperControl->trancheId);
+	}
+
+	memset(&hashInfo, 0, sizeof(hashInfo));
+	hashInfo.keysize = sizeof(Oid);
+	hashInfo.entrysize = sizeof(HealthCheckHelperDatabase);
+	hashInfo.hash = tag_hash;
+	hashFlags = (HASH_ELEM | HASH_FUNCTION);
+
+	HealthCheckWorkerDBHash = ShmemInitHash("pg_auto_failover Database Hash",
+											max_worker_processes,
+											max_worker_processes,
+											&hashInfo, hashFlags);
+
+	memset(&hashInfo, 0, sizeof(hashInfo));
+	hashInfo.keysize = sizeof(SharedNodeKey);
+	hashInfo.entrysize = sizeof(NodeHeartbeat);
+	hashInfo.hash = tag_hash;
+	hashFlags = (HASH_ELEM | HASH_FUNCTION);
+
+	NodeHeartbeatHash = ShmemInitHash("pg_auto_failover Node Heartbeat Hash",
+									  MAX_NODE_HEARTBEATS,
+									  MAX_NODE_HEARTBEATS,
+									  &hashInfo, hashFlags);
+
+	memset(&hashInfo, 0, sizeof(hashInfo));
+	hashInfo.keysize = sizeof(SharedNodeKey);
+	hashInfo.entrysize = sizeof(HealthCheckStatsEntry);
+	hashInfo.hash = tag_hash;
+	hashFlags = (HASH_ELEM | HASH_FUNCTION);
+
+	HealthCheckStatsHash = ShmemInitHash("pg_auto_failover Health Check Stats Hash",
+										 MAX_HEALTH_CHECK_STATS,
+										 MAX_HEALTH_CHECK_STATS,
+										 &hashInfo, hashFlags);
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * StopHealthCheckWorker stops the maintenance daemons for the given database
+ * and removes it from the Health Check Launcher control hash.
+ */
+void
+StopHealthCheckWorker(Oid databaseId)
+{
+	bool found = false;
+	HealthCheckHelperDatabase *dbData = NULL;
+	pid_t workerPids[MAX_HEALTH_CHECK_WORKERS] = { 0 };
+	int workerIndex = 0;
+
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
+
+	dbData = (HealthCheckHelperDatabase *)
+		hash_search(HealthCheckWorkerDBHash,
+					&databaseId, HASH_REMOVE, &found);
+
+	if (found)
+	{
+		memcpy(workerPids, dbData->workerPids, sizeof(workerPids));
+	}
+
+	LWLockRelease(&HealthCheckHelperControl->lock);
+
+	for (workerIndex = 0; workerIndex < MAX_HEALTH_CHECK_WORKERS; workerIndex++)
+	{
+		if (workerPids[workerIndex] > 0)
+		{
+			kill(workerPids[workerIndex], SIGTERM);
+		}
+	}
+}
+
+
+/*
+ * InvalidateNodeRegistry tells the health check workers of the given database
+ * that the list of nodes has changed, and wakes them up so that they scan the
+ * node table again.
+ */
+void
+InvalidateNodeRegistry(Oid databaseId)
+{
+	HealthCheckHelperDatabase *dbData = NULL;
+	pid_t workerPids[MAX_HEALTH_CHECK_WORKERS] = { 0 };
+	int workerIndex = 0;
+
+	if (HealthCheckHelperControl == NULL)
+	{
+		/* pg_auto_failover is not in shared_preload_libraries */
+		return;
+	}
+
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
+
+	dbData = (HealthCheckHelperDatabase *)
+		hash_search(HealthCheckWorkerDBHash,
+					&databaseId, HASH_FIND, NULL);
+
+	if (dbData != NULL)
+	{
+		dbData->nodeListVersion++;
+		memcpy(workerPids, dbData->workerPids, sizeof(workerPids));
+	}
+
+	LWLockRelease(&HealthCheckHelperControl->lock);
+
+	for (workerIndex = 0; workerIndex < MAX_HEALTH_CHECK_WORKERS; workerIndex++)
+	{
+		if (workerPids[workerIndex] > 0)
+		{
+			PGPROC *proc = BackendPidGetProc(workerPids[workerIndex]);
+
+			if (proc != NULL)
+			{
+				SetLatch(&proc->procLatch);
+			}
+		}
+	}
+}
+
+
+/*
+ * WakeEventFlusher wakes up the first health check worker of the given
+ * database, which inserts the events that were committed to the event buffer.
+ */
+void
+WakeEventFlusher(Oid databaseId)
+{
+	HealthCheckHelperDatabase *dbData = NULL;
+	pid_t flusherPid = 0;
+
+	if (HealthCheckHelperControl == NULL)
+	{
+		return;
+	}
+
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_SHARED);
+
+	dbData = (HealthCheckHelperDatabase *)
+		hash_search(HealthCheckWorkerDBHash,
+					&databaseId, HASH_FIND, NULL);
+
+	if (dbData != NULL)
+	{
+		flusherPid = dbData->workerPids[0];
+	}
+
+	LWLockRelease(&HealthCheckHelperControl->lock);
+
+	if (flusherPid > 0)
+	{
+		PGPROC *proc = BackendPidGetProc(flusherPid);
+
+		if (proc != NULL)
+		{
+			SetLatch(&proc->procLatch);
+		}
+	}
+}
+
+
+/*
+ * GetNodeListVersion returns the current version of the list of nodes of the
+ * given database, see InvalidateNodeRegistry.
+ */
+static uint64
+GetNodeListVersion(Oid databaseId)
+{
+	HealthCheckHelperDatabase *dbData = NULL;
+	uint64 nodeListVersion = 0;
+
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_SHARED);
+
+	dbData = (HealthCheckHelperDatabase *)
+		hash_search(HealthCheckWorkerDBHash,
+					&databaseId, HASH_FIND, NULL);
+
+	if (dbData != NULL)
+	{
+		nodeListVersion = dbData->nodeListVersion;
+	}
+
+	LWLockRelease(&HealthCheckHelperControl->lock);
+
+	return nodeListVersion;
+}
+
+
+/*
+ * MakeSharedNodeKey prepares a NodeHeartbeatHash key, which is compared as
+ * a whole and must then be zeroed first.
+ */
+static void
+MakeSharedNodeKey(SharedNodeKey *key, Oid databaseId,
+					 char *nodeName, int nodePort)
+{
+	memset(key, 0, sizeof(SharedNodeKey));
+
+	key->dboid = databaseId;
+	key->nodePort = nodePort;
+	strlcpy(key->nodeName, nodeName, MAX_NODE_NAME_SIZE);
+}
+
+
+/*
+ * InitNodeHeartbeat zeroes a new entry of the NodeHeartbeatHash, but its key.
+ */
+static void
+InitNodeHeartbeat(NodeHeartbeat *heartbeat)
+{
+	memset(((char *) heartbeat) + sizeof(SharedNodeKey), 0,
+		   sizeof(NodeHeartbeat) - sizeof(SharedNodeKey));
+}
+
+
+/*
+ * RecordNodeHeartbeat registers the last report of a keeper in shared memory,
+ * for the health check workers and the other backends to use. The LSN is only
+ * registered when the keeper reported one, and flushed tells whether this
+ * report has been written to the node table too. When the hash is full we
+ * skip the registration, callers then rely on the node table.
+ */
+void
+RecordNodeHeartbeat(char *nodeName, int nodePort, TimestampTz reportTime,
+					XLogRecPtr reportedLSN, bool flushed)
+{
+	SharedNodeKey key;
+	NodeHeartbeat *heartbeat = NULL;
+	bool found = false;
+
+	if (HealthCheckHelperControl == NULL)
+	{
+		/* pg_auto_failover is not in shared_preload_libraries */
+		return;
+	}
+
+	MakeSharedNodeKey(&key, MyDatabaseId, nodeName, nodePort);
+
+	LWLockAcquire(&HealthCheckHelperControl->heartbeatLock, LW_EXCLUSIVE);
+
+	heartbeat = (NodeHeartbeat *)
+		hash_search(NodeHeartbeatHash, &key, HASH_ENTER_NULL, &found);
+
+	if (heartbeat != NULL)
+	{
+		NodeReport *report = &(heartbeat->report);
+
+		if (!found)
+		{
+			InitNodeHeartbeat(heartbeat);
+		}
+
+		if (report->reportTime < reportTime)
+		{
+			report->reportTime = reportTime;
+		}
+
+		if (reportedLSN != InvalidXLogRecPtr && report->walReportTime < reportTime)
+		{
+			report->reportedLSN = reportedLSN;
+			report->walReportTime = reportTime;
+		}
+
+		if (flushed && report->flushTime < reportTime)
+		{
+			report->flushTime = reportTime;
+		}
+	}
+
+	LWLockRelease(&HealthCheckHelperControl->heartbeatLock);
+}
+
+
+/*
+ * RecordNodeWalLag records in shared memory whether the given standby node is
+ * lagging behind its primary, and returns since when it has been lagging
+ * without interruption, or 0 when it's not lagging. When pg_auto_failover is
+ * not in shared_preload_libraries we always return now.
+ */
+TimestampTz
+RecordNodeWalLag(char *nodeName, int nodePort, bool lagging, TimestampTz now)
+{
+	SharedNodeKey key;
+	NodeHeartbeat *heartbeat = NULL;
+	TimestampTz walLagStartTime = lagging ? now : 0;
+	bool found = false;
+
+	if (HealthCheckHelperControl == NULL)
+	{
+		/* pg_auto_failover is not in shared_preload_libraries */
+		return walLagStartTime;
+	}
+
+	MakeSharedNodeKey(&key, MyDatabaseId, nodeName, nodePort);
+
+	LWLockAcquire(&HealthCheckHelperControl->heartbeatLock, LW_EXCLUSIVE);
+
+	heartbeat = (NodeHeartbeat *)
+		hash_search(NodeHeartbeatHash, &key, HASH_ENTER_NULL, &found);
+
+	if (heartbeat != NULL)
+	{
+		NodeReport *report = &(heartbeat->report);
+
+		if (!found)
+		{
+			InitNodeHeartbeat(heartbeat);
+		}
+
+		if (!lagging)
+		{
+			report->walLagStartTime = 0;
+		}
+		else if (report->walLagStartTime == 0)
+		{
+			report->walLagStartTime = now;
+		}
+
+		walLagStartTime = report->walLagStartTime;
+	}
+
+	LWLockRelease(&HealthCheckHelperControl->heartbeatLock);
+
+	return walLagStartTime;
+}
+
+
+/*
+ * GetNodeReport looks up the last report of a keeper in shared memory, and
+ * returns false when we don't know about it.
+ */
+bool
+GetNodeReport(char *nodeName, int nodePort, NodeReport *report)
+{
+	SharedNodeKey key;
+	NodeHeartbeat *heartbeat = NULL;
+
+	if (HealthCheckHelperControl == NULL)
+	{
+		/* pg_auto_failover is not in shared_preload_libraries */
+		return false;
+	}
 
-			if (pollingStatus == PGRES_POLLING_OK ||
+	MakeSharedNodeKey(&key, MyDatabaseId, nodeName, nodePort);
 
-			    /* an auth request means pg is running */
-				connection->auth_req_received ||
+	LWLockAcquire(&HealthCheckHelperControl->heartbeatLock, LW_SHARED);
 
-			    /* any error but CANNOT_CONNECT means the db is accepting connections */
-				(receivedSqlstate && !cannotConnectNowSqlstate))
-			{
-				PQfinish(connection);
+	heartbeat = (NodeHeartbeat *)
+		hash_search(NodeHeartbeatHash, &key, HASH_FIND, NULL);
 
-				if (nodeHealth->healthState != NODE_HEALTH_GOOD)
-				{
-					elog(LOG, "pg_auto_failover monitor marking node %s:%d as healthy",
-						 nodeHealth->nodeName,
-						 nodeHealth->nodePort);
-				}
+	if (heartbeat != NULL)
+	{
+		*report = heartbeat->report;
+	}
 
-				SetNodeHealthState(healthCheck->node->nodeName,
-								   healthCheck->node->nodePort,
-								   NODE_HEALTH_GOOD);
+	LWLockRelease(&HealthCheckHelperControl->heartbeatLock);
 
-				healthCheck->connection = NULL;
-				healthCheck->numTries = 0;
-				healthCheck->state = HEALTH_CHECK_OK;
-			}
-			else if (pollingStatus == PGRES_POLLING_FAILED)
-			{
-				struct timeval nextTryTime = { 0, 0 };
+	return heartbeat != NULL;
+}
 
-				PQfinish(connection);
 
-				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+/*
+ * RecordNodeLSN registers the LSN that a health check read on a node in
+ * shared memory, as if the keeper had reported it. The group state machine
+ * then uses the most recent of the LSNs reported by the keeper and sampled
+ * by the health checks.
+ */
+static void
+RecordNodeLSN(char *nodeName, int nodePort, char *lsnString)
+{
+	SharedNodeKey key;
+	NodeHeartbeat *heartbeat = NULL;
+	bool found = false;
+	uint32 lsnHigh = 0;
+	uint32 lsnLow = 0;
+	TimestampTz sampleTime = GetCurrentTimestamp();
 
-				healthCheck->nextEventTime = nextTryTime;
-				healthCheck->connection = NULL;
-				healthCheck->state = HEALTH_CHECK_RETRY;
-			}
-			else
-			{
-				/* Health check is still connecting */
-			}
+	if (sscanf(lsnString, "%X/%X", &lsnHigh, &lsnLow) != 2)
+	{
+		return;
+	}
 
-			healthCheck->pollingStatus = pollingStatus;
+	MakeSharedNodeKey(&key, MyDatabaseId, nodeName, nodePort);
 
-			break;
+	LWLockAcquire(&HealthCheckHelperControl->heartbeatLock, LW_EXCLUSIVE);
+
+	heartbeat = (NodeHeartbeat *)
+		hash_search(NodeHeartbeatHash, &key, HASH_ENTER_NULL, &found);
+
+	if (heartbeat != NULL)
+	{
+		NodeReport *report = &(heartbeat->report);
+
+		if (!found)
+		{
+			InitNodeHeartbeat(heartbeat);
 		}
 
-		case HEALTH_CHECK_DEAD:
-		case HEALTH_CHECK_OK:
-		default:
+		if (report->walReportTime < sampleTime)
 		{
-			/* Health check is done */
+			report->reportedLSN = ((uint64) lsnHigh) << 32 | lsnLow;
+			report->walReportTime = sampleTime;
 		}
 	}
+
+	LWLockRelease(&HealthCheckHelperControl->heartbeatLock);
 }
 
 
 /*
- * CompareTime compares two timeval structs.
- *
- * If leftTime < rightTime, return -1
- * If leftTime > rightTime, return 1
- * else, return 0
+ * RecordNodeLagSample adds a sample of the replication lag of a standby node
+ * to its history in shared memory: the LSN it reported, the LSN of its
+ * primary, and the round-trip time of the last health check of the node. As
+ * the group state machine runs at each report of both nodes, we skip the
+ * samples that aren't more recent than the last one we have.
  */
-static int
-CompareTimes(struct timeval *leftTime, struct timeval *rightTime)
+void
+RecordNodeLagSample(char *nodeName, int nodePort, TimestampTz sampleTime,
+					XLogRecPtr reportedLSN, XLogRecPtr primaryLSN)
 {
-	int compareResult = 0;
+	SharedNodeKey key;
+	NodeHeartbeat *heartbeat = NULL;
+	HealthCheckStatsEntry *statsEntry = NULL;
+	double healthCheckRttMs = -1;
+	bool found = false;
 
-	if (leftTime->tv_sec < rightTime->tv_sec)
-	{
-		compareResult = -1;
-	}
-	else if (leftTime->tv_sec > rightTime->tv_sec)
+	if (HealthCheckHelperControl == NULL)
 	{
-		compareResult = 1;
+		/* pg_auto_failover is not in shared_preload_libraries */
+		return;
 	}
-	else if (leftTime->tv_usec < rightTime->tv_usec)
+
+	MakeSharedNodeKey(&key, MyDatabaseId, nodeName, nodePort);
+
+	LWLockAcquire(&HealthCheckHelperControl->statsLock, LW_SHARED);
+
+	statsEntry = (HealthCheckStatsEntry *)
+		hash_search(HealthCheckStatsHash, &key, HASH_FIND, NULL);
+
+	if (statsEntry != NULL &&
+		statsEntry->stats.checkCount > statsEntry->stats.unhealthyCount)
 	{
-		compareResult = -1;
+		healthCheckRttMs = statsEntry->stats.lastLatencyMs;
 	}
-	else if (leftTime->tv_usec > rightTime->tv_usec)
+
+	LWLockRelease(&HealthCheckHelperControl->statsLock);
+
+	LWLockAcquire(&HealthCheckHelperControl->heartbeatLock, LW_EXCLUSIVE);
+
+	heartbeat = (NodeHeartbeat *)
+		hash_search(NodeHeartbeatHash, &key, HASH_ENTER_NULL, &found);
+
+	if (heartbeat != NULL)
 	{
-		compareResult = 1;
+		int lastSample = 0;
+
+		if (!found)
+		{
+			InitNodeHeartbeat(heartbeat);
+		}
+
+		lastSample = (heartbeat->nextLagSample + LAG_HISTORY_SIZE - 1)
+					 % LAG_HISTORY_SIZE;
+
+		if (heartbeat->lagSampleCount == 0 ||
+			heartbeat->lagSamples[lastSample].sampleTime < sampleTime)
+		{
+			LagSample *sample =
+				&(heartbeat->lagSamples[heartbeat->nextLagSample]);
+
+			sample->sampleTime = sampleTime;
+			sample->reportedLSN = reportedLSN;
+			sample->primaryLSN = primaryLSN;
+			sample->healthCheckRttMs = healthCheckRttMs;
+
+			heartbeat->nextLagSample =
+				(heartbeat->nextLagSample + 1) % LAG_HISTORY_SIZE;
+
+			if (heartbeat->lagSampleCount < LAG_HISTORY_SIZE)
+			{
+				heartbeat->lagSampleCount++;
+			}
+		}
 	}
-	else
+
+	LWLockRelease(&HealthCheckHelperControl->heartbeatLock);
+}
+
+
+/*
+ * CopyLagSamples copies the lag samples of the given heartbeat entry to the
+ * given array, oldest first, and returns how many there are.
+ */
+static int
+CopyLagSamples(NodeHeartbeat *heartbeat, LagSample *samples)
+{
+	int firstSample = (heartbeat->nextLagSample + LAG_HISTORY_SIZE
+					   - heartbeat->lagSampleCount) % LAG_HISTORY_SIZE;
+	int sampleIndex = 0;
+
+	for (sampleIndex = 0; sampleIndex < heartbeat->lagSampleCount; sampleIndex++)
 	{
-		compareResult = 0;
+		samples[sampleIndex] =
+			heartbeat->lagSamples[(firstSample + sampleIndex) % LAG_HISTORY_SIZE];
 	}
 
-	return compareResult;
+	return heartbeat->lagSampleCount;
 }
 
 
 /*
- * SubtractTimes subtract the ‘struct timeval’ values y from x,
- * returning the result.
- *
- * From:
- * http://www.gnu.org/software/libc/manual/html_node/Elapsed-Time.html
+ * GetNodeLagSamples copies the replication lag samples of the given node to
+ * the given array of LAG_HISTORY_SIZE samples, oldest first, and returns how
+ * many there are.
  */
-static int
-SubtractTimes(struct timeval x, struct timeval y)
+int
+GetNodeLagSamples(char *nodeName, int nodePort, LagSample *samples)
 {
-	int differenceMs = 0;
+	SharedNodeKey key;
+	NodeHeartbeat *heartbeat = NULL;
+	int sampleCount = 0;
 
-	/* Perform the carry for the later subtraction by updating y. */
-	if (x.tv_usec < y.tv_usec)
+	if (HealthCheckHelperControl == NULL)
 	{
-		int nsec = (y.tv_usec - x.tv_usec) / 1000000 + 1;
-		y.tv_usec -= 1000000 * nsec;
-		y.tv_sec += nsec;
+		/* pg_auto_failover is not in shared_preload_libraries */
+		return 0;
 	}
 
-	if (x.tv_usec - y.tv_usec > 1000000)
+	MakeSharedNodeKey(&key, MyDatabaseId, nodeName, nodePort);
+
+	LWLockAcquire(&HealthCheckHelperControl->heartbeatLock, LW_SHARED);
+
+	heartbeat = (NodeHeartbeat *)
+		hash_search(NodeHeartbeatHash, &key, HASH_FIND, NULL);
+
+	if (heartbeat != NULL)
 	{
-		int nsec = (x.tv_usec - y.tv_usec) / 1000000;
-		y.tv_usec += 1000000 * nsec;
-		y.tv_sec -= nsec;
+		sampleCount = CopyLagSamples(heartbeat, samples);
 	}
 
-	differenceMs += 1000 * (x.tv_sec - y.tv_sec);
-	differenceMs += (x.tv_usec - y.tv_usec) / 1000;
+	LWLockRelease(&HealthCheckHelperControl->heartbeatLock);
 
-	return differenceMs;
+	return sampleCount;
 }
 
 
 /*
- * AddTimeMillis adds additionalMs milliseconds to a timeval.
+ * GetLagHistoryList returns a copy of the replication lag history of the
+ * nodes of the current database, in the current memory context.
  */
-static struct timeval
-AddTimeMillis(struct timeval base, uint32 additionalMs)
+List *
+GetLagHistoryList(void)
 {
-	struct timeval result = { 0, 0 };
+	List *historyList = NIL;
+	HASH_SEQ_STATUS status;
+	NodeHeartbeat *heartbeat = NULL;
 
-	result.tv_sec = base.tv_sec + additionalMs / 1000;
-	result.tv_usec = base.tv_usec + (additionalMs % 1000) * 1000;
+	if (HealthCheckHelperControl == NULL)
+	{
+		/* pg_auto_failover is not in shared_preload_libraries */
+		return NIL;
+	}
 
-	return result;
+	LWLockAcquire(&HealthCheckHelperControl->heartbeatLock, LW_SHARED);
+
+	hash_seq_init(&status, NodeHeartbeatHash);
+
+	while ((heartbeat = (NodeHeartbeat *) hash_seq_search(&status)) != NULL)
+	{
+		NodeLagHistory *history = NULL;
+
+		if (heartbeat->key.dboid != MyDatabaseId ||
+			heartbeat->lagSampleCount == 0)
+		{
+			continue;
+		}
+
+		history = (NodeLagHistory *) palloc(sizeof(NodeLagHistory));
+
+		strlcpy(history->nodeName, heartbeat->key.nodeName, MAX_NODE_NAME_SIZE);
+		history->nodePort = heartbeat->key.nodePort;
+		history->sampleCount = CopyLagSamples(heartbeat, history->samples);
+
+		historyList = lappend(historyList, history);
+	}
+
+	LWLockRelease(&HealthCheckHelperControl->heartbeatLock);
+
+	return historyList;
 }
 
 
 /*
- * HealthCheckWorkerShmemSize computes how much shared memory is required.
+ * ForgetNodeHeartbeat removes a keeper from the shared memory hash, once we
+ * stop checking its node.
  */
-static size_t
-HealthCheckWorkerShmemSize(void)
+static void
+ForgetNodeHeartbeat(char *nodeName, int nodePort)
 {
-	Size size = 0;
-	Size hashSize = 0;
+	SharedNodeKey key;
 
-	size = add_size(size, sizeof(HealthCheckHelperDatabase));
+	MakeSharedNodeKey(&key, MyDatabaseId, nodeName, nodePort);
 
-	/*
-	 * We request enough shared memory to have one hash-table entry for each
-	 * worker process. We couldn't start more anyway, so there's little point
-	 * in allocating more.
-	 */
-	hashSize = hash_estimate_size(max_worker_processes,
-								  sizeof(HealthCheckHelperDatabase));
-	size = add_size(size, hashSize);
+	LWLockAcquire(&HealthCheckHelperControl->heartbeatLock, LW_EXCLUSIVE);
 
-	return size;
+	hash_search(NodeHeartbeatHash, &key, HASH_REMOVE, NULL);
+
+	LWLockRelease(&HealthCheckHelperControl->heartbeatLock);
 }
 
 
 /*
- * HealthCheckWorkerShmemInit initializes the requested shared memory for the
- * maintenance daemon.
+ * RecordHealthCheckEvent counts a health check event in the statistics of the
+ * node in shared memory. When the node becomes healthy, we also record how
+ * long the connection attempt or ping took.
  */
 static void
-HealthCheckWorkerShmemInit(void)
+RecordHealthCheckEvent(HealthCheck *healthCheck, HealthCheckEvent event,
+					   struct timeval currentTime)
 {
-	bool alreadyInitialized = false;
-	HASHCTL hashInfo;
-	int hashFlags = 0;
+	SharedNodeKey key;
+	HealthCheckStatsEntry *entry = NULL;
+	HealthCheckStats *stats = NULL;
+	bool found = false;
 
-	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	MakeSharedNodeKey(&key, MyDatabaseId,
+					  healthCheck->node->nodeName,
+					  healthCheck->node->nodePort);
 
-	HealthCheckHelperControl =
-		(HealthCheckHelperControlData *)
-		ShmemInitStruct("pg_auto_failover Health Check Helper Daemon",
-						HealthCheckWorkerShmemSize(),
-						&alreadyInitialized);
+	LWLockAcquire(&HealthCheckHelperControl->statsLock, LW_EXCLUSIVE);
 
-	/*
-	 * Might already be initialized on EXEC_BACKEND type platforms that call
-	 * shared library initialization functions in every backend.
-	 */
-	if (!alreadyInitialized)
+	entry = (HealthCheckStatsEntry *)
+		hash_search(HealthCheckStatsHash, &key, HASH_ENTER_NULL, &found);
+
+	if (entry == NULL)
 	{
-		HealthCheckHelperControl->trancheId = LWLockNewTrancheId();
-		HealthCheckHelperControl->lockTrancheName =
-			"pg_auto_failover Health Check Daemon";
-		LWLockRegisterTranche(HealthCheckHelperControl->trancheId,
-							  HealthCheckHelperControl->lockTrancheName);
+		/* the hash is full, we don't keep statistics for this node */
+		LWLockRelease(&HealthCheckHelperControl->statsLock);
+		return;
+	}
 
-		LWLockInitialize(&HealthCheckHelperControl->lock,
-						 HealthCheckHelperControl->trancheId);
+	stats = &(entry->stats);
+
+	if (!found)
+	{
+		memset(stats, 0, sizeof(HealthCheckStats));
+		strlcpy(stats->nodeName, key.nodeName, MAX_NODE_NAME_SIZE);
+		stats->nodePort = key.nodePort;
 	}
 
-	memset(&hashInfo, 0, sizeof(hashInfo));
-	hashInfo.keysize = sizeof(Oid);
-	hashInfo.entrysize = sizeof(HealthCheckHelperDatabase);
-	hashInfo.hash = tag_hash;
-	hashFlags = (HASH_ELEM | HASH_FUNCTION);
+	switch (event)
+	{
+		case HEALTH_CHECK_EVENT_HEALTHY:
+		{
+			double latencyMs =
+				(double) (currentTime.tv_sec -
+						  healthCheck->attemptStartTime.tv_sec) * 1000.0 +
+				(double) (currentTime.tv_usec -
+						  healthCheck->attemptStartTime.tv_usec) / 1000.0;
+			int bucket = 0;
 
-	HealthCheckWorkerDBHash = ShmemInitHash("pg_auto_failover Database Hash",
-											max_worker_processes,
-											max_worker_processes,
-											&hashInfo, hashFlags);
+			latencyMs = Max(latencyMs, 0.0);
 
-	LWLockRelease(AddinShmemInitLock);
+			while (bucket < HEALTH_CHECK_LATENCY_BUCKETS - 1 &&
+				   latencyMs >= (double) (1 << bucket))
+			{
+				bucket++;
+			}
 
-	if (prev_shmem_startup_hook != NULL)
-	{
-		prev_shmem_startup_hook();
+			stats->checkCount++;
+			stats->lastLatencyMs = latencyMs;
+			stats->maxLatencyMs = Max(stats->maxLatencyMs, latencyMs);
+			stats->totalLatencyMs += latencyMs;
+			stats->latencyHistogram[bucket]++;
+			stats->lastCheckTime = GetCurrentTimestamp();
+			break;
+		}
+
+		case HEALTH_CHECK_EVENT_UNHEALTHY:
+		{
+			stats->checkCount++;
+			stats->unhealthyCount++;
+			stats->lastCheckTime = GetCurrentTimestamp();
+			break;
+		}
+
+		case HEALTH_CHECK_EVENT_RETRY:
+		{
+			stats->retryCount++;
+			break;
+		}
+
+		case HEALTH_CHECK_EVENT_TIMEOUT:
+		{
+			stats->timeoutCount++;
+			break;
+		}
 	}
+
+	LWLockRelease(&HealthCheckHelperControl->statsLock);
 }
 
 
 /*
- * StopHealthCheckWorker stops the maintenance daemon for the given database
- * and removes it from the Health Check Launcher control hash.
+ * ForgetHealthCheckStats removes the statistics of a node from shared memory,
+ * once we stop checking it.
  */
-void
-StopHealthCheckWorker(Oid databaseId)
+static void
+ForgetHealthCheckStats(char *nodeName, int nodePort)
 {
-	bool found = false;
-	HealthCheckHelperDatabase *dbData = NULL;
-	pid_t workerPid = 0;
+	SharedNodeKey key;
 
-	LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
+	MakeSharedNodeKey(&key, MyDatabaseId, nodeName, nodePort);
 
-	dbData = (HealthCheckHelperDatabase *)
-		hash_search(HealthCheckWorkerDBHash,
-					&databaseId, HASH_REMOVE, &found);
+	LWLockAcquire(&HealthCheckHelperControl->statsLock, LW_EXCLUSIVE);
 
-	if (found)
+	hash_search(HealthCheckStatsHash, &key, HASH_REMOVE, NULL);
+
+	LWLockRelease(&HealthCheckHelperControl->statsLock);
+}
+
+
+/*
+ * GetHealthCheckStatsList returns a copy of the health check statistics of the
+ * nodes of the current database, in the current memory context.
+ */
+List *
+GetHealthCheckStatsList(void)
+{
+	List *statsList = NIL;
+	HASH_SEQ_STATUS status;
+	HealthCheckStatsEntry *entry = NULL;
+
+	if (HealthCheckHelperControl == NULL)
 	{
-		workerPid = dbData->workerPid;
+		/* pg_auto_failover is not in shared_preload_libraries */
+		return NIL;
 	}
 
-	LWLockRelease(&HealthCheckHelperControl->lock);
+	LWLockAcquire(&HealthCheckHelperControl->statsLock, LW_SHARED);
 
-	if (workerPid > 0)
+	hash_seq_init(&status, HealthCheckStatsHash);
+
+	while ((entry = (HealthCheckStatsEntry *) hash_seq_search(&status)) != NULL)
 	{
-		kill(workerPid, SIGTERM);
+		HealthCheckStats *stats = NULL;
+
+		if (entry->key.dboid != MyDatabaseId)
+		{
+			continue;
+		}
+
+		stats = (HealthCheckStats *) palloc(sizeof(HealthCheckStats));
+		memcpy(stats, &(entry->stats), sizeof(HealthCheckStats));
+
+		statsList = lappend(statsList, stats);
 	}
+
+	LWLockRelease(&HealthCheckHelperControl->statsLock);
+
+	return statsList;
 }
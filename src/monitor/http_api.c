@@ -0,0 +1,614 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/http_api.c
+ *
+ * Implementation of the HTTP API worker of the monitor.
+ *
+ * When pgautofailover.http_api_port is set, a background worker serves the
+ * state of every formation and node of the monitor database as a JSON
+ * document at /state, so that dashboards don't need a SQL connection to the
+ * monitor, which keepers use for their heartbeats.
+ *
+ * The worker keeps the document in its own memory. It only reads the node
+ * table again when a state change has been committed since, as counted in
+ * the shared memory of the state change notifications, or after
+ * HTTP_API_REFRESH_INTERVAL_MS for the report times and LSNs. Responses have
+ * a weak ETag computed from the states of the nodes, so that clients polling
+ * with If-None-Match get a 304 Not Modified until one of them changed.
+ *
+ * The worker also runs on a hot standby of the monitor, so that dashboards
+ * can be pointed there and leave the primary monitor to the keepers.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* these are internal headers */
+#include "http_api.h"
+#include "metadata.h"
+#include "notifications.h"
+#include "version_compat.h"
+#include "wait_events.h"
+
+/* these are always necessary for a bgworker */
+#include "access/hash.h"
+#include "access/xact.h"
+#include "commands/extension.h"
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "libpq/pqsignal.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+
+/*
+ * The whole document is built by Postgres, which takes care of the JSON
+ * escaping of formation and node names.
+ *
+ * The report times, health check times and LSNs of the nodes change at every
+ * heartbeat, so the ETag is computed from a second version of the document
+ * that leaves them out: it only changes with the formations, the nodes, and
+ * their states and health.
+ */
+#define HTTP_API_NODE_STATE_FIELDS \
+	"    'node_id', n.nodeid, 'group_id', n.groupid," \
+	"    'name', n.nodename, 'port', n.nodeport," \
+	"    'reported_state', n.reportedstate, 'goal_state', n.goalstate," \
+	"    'pg_is_running', n.reportedpgisrunning," \
+	"    'sync_state', n.reportedrepstate, 'health', n.health," \
+	"    'state_change_time', n.statechangetime," \
+	"    'candidate_priority', n.candidatepriority"
+
+#define HTTP_API_NODE_PROGRESS_FIELDS \
+	"    'reported_lsn', n.reportedlsn, 'report_time', n.reporttime," \
+	"    'health_check_time', n.healthchecktime"
+
+#define HTTP_API_FORMATIONS(nodeFields) \
+	"json_build_object('formations', coalesce(json_agg(" \
+	" json_build_object('formation', f.formationid, 'kind', f.kind," \
+	"  'dbname', f.dbname, 'opt_secondary', f.opt_secondary," \
+	"  'nodes', (SELECT coalesce(json_agg(json_build_object(" \
+	nodeFields ")" \
+	"   ORDER BY n.groupid, n.nodeid), '[]')" \
+	"   FROM " AUTO_FAILOVER_NODE_TABLE " n" \
+	"   WHERE n.formationid = f.formationid))" \
+	" ORDER BY f.formationid), '[]'))::text"
+
+#define HTTP_API_STATE_QUERY \
+	"SELECT " \
+	HTTP_API_FORMATIONS(HTTP_API_NODE_STATE_FIELDS "," \
+						HTTP_API_NODE_PROGRESS_FIELDS) ", " \
+	HTTP_API_FORMATIONS(HTTP_API_NODE_STATE_FIELDS) \
+	" FROM " AUTO_FAILOVER_FORMATION_TABLE " f"
+
+
+/* flags set by signal handlers */
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+/* the last state document we built, in HttpApiContext */
+static MemoryContext HttpApiContext = NULL;
+static char *StateDocument = NULL;
+static char StateDocumentETag[32] = { 0 };
+static uint64 StateDocumentVersion = 0;
+static TimestampTz StateDocumentTime = 0;
+
+/* GUC variables */
+int HttpApiPort = 0;
+char *HttpApiListenAddress = NULL;
+char *HttpApiDatabase = NULL;
+
+
+static int HttpApiListen(void);
+static void HttpApiHandleRequest(int clientFd);
+static bool HttpApiRefreshStateDocument(void);
+static bool HttpApiReadRequest(int clientFd, StringInfo request);
+static char * HttpApiGetHeader(char *request, const char *name);
+static void HttpApiSendResponse(int clientFd, const char *status,
+								const char *etag, const char *body,
+								bool withBody);
+
+
+/*
+ * Signal handler for SIGTERM
+ *		Set a flag to let the main loop to terminate, and set our latch to wake
+ *		it up.
+ */
+static void
+pg_auto_failover_http_api_sigterm(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+
+/*
+ * Signal handler for SIGHUP
+ *		Set a flag to tell the main loop to reread the config file, and set
+ *		our latch to wake it up.
+ */
+static void
+pg_auto_failover_http_api_sighup(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+
+/*
+ * RegisterHttpApiWorker registers the HTTP API worker at server start, when
+ * pgautofailover.http_api_port is set.
+ */
+void
+RegisterHttpApiWorker(void)
+{
+	BackgroundWorker worker;
+
+	if (HttpApiPort == 0)
+	{
+		return;
+	}
+
+	memset(&worker, 0, sizeof(worker));
+
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	/*
+	 * Also serve the replicated state on a standby of the monitor, where no
+	 * state change is ever counted: the document is then refreshed every
+	 * HTTP_API_REFRESH_INTERVAL_MS only.
+	 */
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = 10;
+	worker.bgw_main_arg = Int32GetDatum(0);
+	worker.bgw_notify_pid = 0;
+	sprintf(worker.bgw_library_name, "pgautofailover");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_auto_failover http api");
+	sprintf(worker.bgw_function_name, "HttpApiWorkerMain");
+
+	RegisterBackgroundWorker(&worker);
+}
+
+
+/*
+ * HttpApiWorkerMain is the main entry point of the HTTP API worker. We answer
+ * one request at a time: they are small and answered from memory.
+ */
+void
+HttpApiWorkerMain(Datum arg)
+{
+	int listenFd = -1;
+
+	/* Establish signal handlers before unblocking signals. */
+	pqsignal(SIGHUP, pg_auto_failover_http_api_sighup);
+	pqsignal(SIGINT, SIG_IGN);
+	pqsignal(SIGTERM, pg_auto_failover_http_api_sigterm);
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+
+	/* Connect to the monitor database */
+	BackgroundWorkerInitializeConnection(HttpApiDatabase, NULL, 0);
+
+	/* Make background worker recognisable in pg_stat_activity */
+	pgstat_report_appname("pg_auto_failover http api");
+
+	HttpApiContext = AllocSetContextCreate(TopMemoryContext,
+										   "HTTP API context",
+										   ALLOCSET_DEFAULT_MINSIZE,
+										   ALLOCSET_DEFAULT_INITSIZE,
+										   ALLOCSET_DEFAULT_MAXSIZE);
+
+	listenFd = HttpApiListen();
+
+	elog(LOG, "pg_auto_failover http api listening on %s:%d",
+		 HttpApiListenAddress, HttpApiPort);
+
+	while (!got_sigterm)
+	{
+		int waitResult = 0;
+
+		waitResult = WaitLatchOrSocket(MyLatch,
+									   WL_LATCH_SET | WL_SOCKET_READABLE |
+									   WL_TIMEOUT | WL_POSTMASTER_DEATH,
+									   listenFd, 1000,
+									   WAIT_EVENT_HTTP_API_ACCEPT);
+
+		ResetLatch(MyLatch);
+
+		/* emergency bailout if postmaster has died */
+		if (waitResult & WL_POSTMASTER_DEATH)
+		{
+			elog(LOG, "pg_auto_failover http api exiting");
+
+			proc_exit(1);
+		}
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (waitResult & WL_SOCKET_READABLE)
+		{
+			int clientFd = accept(listenFd, NULL, NULL);
+
+			if (clientFd >= 0)
+			{
+				HttpApiHandleRequest(clientFd);
+				close(clientFd);
+			}
+		}
+	}
+
+	close(listenFd);
+
+	elog(LOG, "pg_auto_failover http api exiting");
+
+	proc_exit(0);
+}
+
+
+/*
+ * HttpApiListen opens the socket of the HTTP API and returns it.
+ */
+static int
+HttpApiListen(void)
+{
+	struct addrinfo hints;
+	struct addrinfo *addresses = NULL;
+	char service[NI_MAXSERV];
+	int listenFd = -1;
+	int enable = 1;
+	int error = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	snprintf(service, sizeof(service), "%d", HttpApiPort);
+
+	error = getaddrinfo(HttpApiListenAddress, service, &hints, &addresses);
+
+	if (error != 0)
+	{
+		ereport(ERROR,
+				(errmsg("could not resolve pgautofailover.http_api_listen_address "
+						"\"%s\": %s", HttpApiListenAddress, gai_strerror(error))));
+	}
+
+	listenFd = socket(addresses->ai_family, addresses->ai_socktype,
+					  addresses->ai_protocol);
+
+	if (listenFd < 0)
+	{
+		freeaddrinfo(addresses);
+		ereport(ERROR,
+				(errcode_for_socket_access(),
+				 errmsg("could not create the http api socket: %m")));
+	}
+
+	(void) setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR,
+					  &enable, sizeof(enable));
+
+	if (bind(listenFd, addresses->ai_addr, addresses->ai_addrlen) != 0 ||
+		listen(listenFd, SOMAXCONN) != 0)
+	{
+		int save_errno = errno;
+
+		close(listenFd);
+		freeaddrinfo(addresses);
+
+		errno = save_errno;
+		ereport(ERROR,
+				(errcode_for_socket_access(),
+				 errmsg("could not listen on %s:%d for the http api: %m",
+						HttpApiListenAddress, HttpApiPort)));
+	}
+
+	freeaddrinfo(addresses);
+
+	return listenFd;
+}
+
+
+/*
+ * HttpApiHandleRequest reads a request from the given client socket and
+ * answers it. Only GET and HEAD requests for /state are supported.
+ */
+static void
+HttpApiHandleRequest(int clientFd)
+{
+	StringInfoData request;
+	struct timeval timeout = { 1, 0 };
+	char *method = NULL;
+	char *path = NULL;
+	char *ifNoneMatch = NULL;
+	bool isHead = false;
+
+	/* don't let a slow client hold the worker */
+	(void) setsockopt(clientFd, SOL_SOCKET, SO_RCVTIMEO,
+					  &timeout, sizeof(timeout));
+	(void) setsockopt(clientFd, SOL_SOCKET, SO_SNDTIMEO,
+					  &timeout, sizeof(timeout));
+
+	initStringInfo(&request);
+
+	if (!HttpApiReadRequest(clientFd, &request))
+	{
+		HttpApiSendResponse(clientFd, "400 Bad Request", NULL,
+							"{\"error\": \"bad request\"}\n", true);
+		pfree(request.data);
+		return;
+	}
+
+	/* the request line is "METHOD path HTTP/x.y" */
+	method = request.data;
+	path = strchr(method, ' ');
+
+	if (path == NULL)
+	{
+		HttpApiSendResponse(clientFd, "400 Bad Request", NULL,
+							"{\"error\": \"bad request\"}\n", true);
+		pfree(request.data);
+		return;
+	}
+
+	*path++ = '\0';
+	isHead = strcmp(method, "HEAD") == 0;
+
+	ifNoneMatch = HttpApiGetHeader(path, "If-None-Match");
+	path[strcspn(path, " ?\r")] = '\0';
+
+	if (strcmp(method, "GET") != 0 && !isHead)
+	{
+		HttpApiSendResponse(clientFd, "405 Method Not Allowed", NULL,
+							"{\"error\": \"method not allowed\"}\n", true);
+	}
+	else if (strcmp(path, "/state") != 0)
+	{
+		HttpApiSendResponse(clientFd, "404 Not Found", NULL,
+							"{\"error\": \"not found\"}\n", !isHead);
+	}
+	else if (!HttpApiRefreshStateDocument())
+	{
+		HttpApiSendResponse(clientFd, "503 Service Unavailable", NULL,
+							"{\"error\": \"the pgautofailover extension "
+							"does not exist in this database\"}\n", !isHead);
+	}
+	else if (ifNoneMatch != NULL && strstr(ifNoneMatch, StateDocumentETag) != NULL)
+	{
+		HttpApiSendResponse(clientFd, "304 Not Modified", StateDocumentETag,
+							"", false);
+	}
+	else
+	{
+		HttpApiSendResponse(clientFd, "200 OK", StateDocumentETag,
+							StateDocument, !isHead);
+	}
+
+	pfree(request.data);
+}
+
+
+/*
+ * HttpApiRefreshStateDocument builds the state document again, unless the
+ * one we have is recent and no state change was committed since. It returns
+ * false when the pgautofailover extension does not exist.
+ */
+static bool
+HttpApiRefreshStateDocument(void)
+{
+	/* read the version first, so that a concurrent change is read again */
+	uint64 currentVersion = GetStateChangeVersion();
+	TimestampTz now = GetCurrentTimestamp();
+	MemoryContext originalContext = CurrentMemoryContext;
+	char *document = NULL;
+	char *stateDocument = NULL;
+	uint32 documentHash = 0;
+	int spiStatus = 0;
+
+	if (StateDocument != NULL &&
+		currentVersion == StateDocumentVersion &&
+		!TimestampDifferenceExceeds(StateDocumentTime, now,
+									HTTP_API_REFRESH_INTERVAL_MS))
+	{
+		return true;
+	}
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+
+	if (get_extension_oid(AUTO_FAILOVER_EXTENSION_NAME, true) == InvalidOid)
+	{
+		CommitTransactionCommand();
+		MemoryContextSwitchTo(originalContext);
+
+		return false;
+	}
+
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "pg_auto_failover http api");
+
+	spiStatus = SPI_execute(HTTP_API_STATE_QUERY, true, 1);
+
+	if (spiStatus != SPI_OK_SELECT || SPI_processed != 1)
+	{
+		elog(ERROR, "could not read the state of the pg_auto_failover nodes");
+	}
+
+	document = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+	stateDocument =
+		SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2);
+
+	MemoryContextReset(HttpApiContext);
+	StateDocument = MemoryContextStrdup(HttpApiContext, document);
+	StateDocumentVersion = currentVersion;
+	StateDocumentTime = now;
+
+	/* a weak ETag, as the report times and LSNs may have changed */
+	documentHash = DatumGetUInt32(hash_any((unsigned char *) stateDocument,
+										   strlen(stateDocument)));
+
+	snprintf(StateDocumentETag, sizeof(StateDocumentETag), "W/\"%08x-%zx\"",
+			 documentHash, strlen(stateDocument));
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	/* CommitTransactionCommand resets the memory context to TopMemoryContext */
+	MemoryContextSwitchTo(originalContext);
+
+	return true;
+}
+
+
+/*
+ * HttpApiReadRequest reads the request line and headers of a request from
+ * the given socket. We don't expect a body.
+ */
+static bool
+HttpApiReadRequest(int clientFd, StringInfo request)
+{
+	char buffer[1024];
+
+	while (strstr(request->data, "\r\n\r\n") == NULL)
+	{
+		ssize_t bytes = 0;
+
+		if (request->len >= HTTP_API_REQUEST_MAXLEN)
+		{
+			return false;
+		}
+
+		bytes = recv(clientFd, buffer, sizeof(buffer), 0);
+
+		if (bytes < 0 && errno == EINTR)
+		{
+			CHECK_FOR_INTERRUPTS();
+			continue;
+		}
+
+		if (bytes <= 0)
+		{
+			return false;
+		}
+
+		appendBinaryStringInfo(request, buffer, bytes);
+	}
+
+	return true;
+}
+
+
+/*
+ * HttpApiGetHeader returns the value of the given header in the request, or
+ * NULL when the request doesn't have it. The value is terminated in place.
+ */
+static char *
+HttpApiGetHeader(char *request, const char *name)
+{
+	int nameLength = strlen(name);
+	char *line = strstr(request, "\r\n");
+
+	while (line != NULL && strncmp(line, "\r\n\r\n", 4) != 0)
+	{
+		line += 2;
+
+		if (pg_strncasecmp(line, name, nameLength) == 0 &&
+			line[nameLength] == ':')
+		{
+			char *value = line + nameLength + 1;
+
+			value += strspn(value, " \t");
+			value[strcspn(value, "\r")] = '\0';
+
+			return value;
+		}
+
+		line = strstr(line, "\r\n");
+	}
+
+	return NULL;
+}
+
+
+/*
+ * HttpApiSendResponse sends a response to the client, unless it's gone or
+ * too slow.
+ */
+static void
+HttpApiSendResponse(int clientFd, const char *status, const char *etag,
+					const char *body, bool withBody)
+{
+	StringInfoData response;
+	int sent = 0;
+
+	initStringInfo(&response);
+
+	appendStringInfo(&response,
+					 "HTTP/1.1 %s\r\n"
+					 "Content-Type: application/json\r\n"
+					 "Cache-Control: no-cache\r\n",
+					 status);
+
+	if (etag != NULL)
+	{
+		appendStringInfo(&response, "ETag: %s\r\n", etag);
+	}
+
+	appendStringInfo(&response,
+					 "Content-Length: %zu\r\n"
+					 "Connection: close\r\n"
+					 "\r\n"
+					 "%s",
+					 strlen(body), withBody ? body : "");
+
+	while (sent < response.len)
+	{
+		ssize_t bytes = send(clientFd, response.data + sent,
+							 response.len - sent, MSG_NOSIGNAL);
+
+		if (bytes < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (bytes <= 0)
+		{
+			break;
+		}
+
+		sent += bytes;
+	}
+
+	pfree(response.data);
+}
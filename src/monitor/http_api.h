@@ -0,0 +1,33 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/http_api.h
+ *
+ * Declarations for the HTTP API worker of the monitor, which serves the
+ * state of the formations and nodes as JSON.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+
+/* requests larger than this, headers included, are refused */
+#define HTTP_API_REQUEST_MAXLEN 8192
+
+/* the state document is read again at most this often when unchanged */
+#define HTTP_API_REFRESH_INTERVAL_MS 1000
+
+
+/* GUCs to configure the HTTP API */
+extern int HttpApiPort;
+extern char *HttpApiListenAddress;
+extern char *HttpApiDatabase;
+
+
+extern void RegisterHttpApiWorker(void);
+extern void HttpApiWorkerMain(Datum arg);
@@ -14,7 +14,10 @@
 #include "miscadmin.h"
 #include "fmgr.h"
 
+#include "function_stats.h"
 #include "metadata.h"
+#include "node_metadata.h"
+#include "wait_events.h"
 
 #include "access/genam.h"
 #include "access/heapam.h"
@@ -30,14 +33,17 @@
 #include "executor/spi.h"
 #include "lib/stringinfo.h"
 #include "nodes/pg_list.h"
+#include "tcop/tcopprot.h"
 #include "utils/builtins.h"
 #include "utils/fmgroids.h"
 #include "utils/lsyscache.h"
 #include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/rel.h"
 #include "utils/relcache.h"
 
 bool EnableVersionChecks = true; /* version checks are enabled */
+int NodeActiveMaxConcurrency = 0; /* no admission control */
 
 /*
  * pgAutoFailoverRelationId returns the OID of a given relation in the
@@ -131,43 +137,132 @@ pgAutoFailoverExtensionOwner(void)
 }
 
 
+/*
+ * AcquireMonitorLock takes the given lock, and when another transaction
+ * holds it already, reports what we are waiting for as our activity in
+ * pg_stat_activity until we get it. The wait itself is reported by Postgres
+ * as an advisory lock wait, which doesn't tell formations and groups apart.
+ */
+static void
+AcquireMonitorLock(LOCKTAG *tag, LOCKMODE lockMode, const char *description)
+{
+	const bool sessionLock = false;
+	instr_time startTime;
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	if (LockAcquire(tag, lockMode, sessionLock, true) == LOCKACQUIRE_NOT_AVAIL)
+	{
+		char *activity = psprintf("waiting for the lock of %s", description);
+
+		pgstat_report_activity(STATE_RUNNING, activity);
+
+		(void) LockAcquire(tag, lockMode, sessionLock, false);
+
+		/* background workers have no query text to go back to */
+		pgstat_report_activity(STATE_RUNNING,
+							   debug_query_string ? debug_query_string : "");
+
+		pfree(activity);
+	}
+
+	FunctionStatsAddLockWait(startTime);
+}
+
+
 /*
  * LockFormation takes a lock on a formation to prevent concurrent
  * membership changes.
+ *
+ * Once we have the lock, the transaction that had it before us might have
+ * changed the formation or its nodes, so we forget about our cached metadata.
  */
 void
 LockFormation(char *formationId, LOCKMODE lockMode)
 {
 	LOCKTAG tag;
-	const bool sessionLock = false;
-	const bool dontWait = false;
+	char description[NAMEDATALEN + 32];
 
 	uint32 formationIdHash = string_hash(formationId, NAMEDATALEN);
 
 	SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, 0, formationIdHash,
 						 ADV_LOCKTAG_CLASS_AUTO_FAILOVER_FORMATION);
 
-	(void) LockAcquire(&tag, lockMode, sessionLock, dontWait);
+	snprintf(description, sizeof(description),
+			 "formation \"%s\"", formationId);
+
+	AcquireMonitorLock(&tag, lockMode, description);
+
+	AcceptInvalidationMessages();
+	InvalidateNodeCache();
 }
 
 
 /*
  * LockNodeGroup takes a lock on a particular group in a formation to
- * prevent concurrent state changes.
+ * prevent concurrent state changes, and then forgets about the nodes we have
+ * cached, as in LockFormation.
  */
 void
 LockNodeGroup(char *formationId, int groupId, LOCKMODE lockMode)
 {
 	LOCKTAG tag;
-	const bool sessionLock = false;
-	const bool dontWait = false;
+	char description[NAMEDATALEN + 64];
 
 	uint32 formationIdHash = string_hash(formationId, NAMEDATALEN);
 
 	SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, formationIdHash, (uint32) groupId,
 						 ADV_LOCKTAG_CLASS_AUTO_FAILOVER_NODE_GROUP);
 
-	(void) LockAcquire(&tag, lockMode, sessionLock, dontWait);
+	snprintf(description, sizeof(description),
+			 "group %d of formation \"%s\"", groupId, formationId);
+
+	AcquireMonitorLock(&tag, lockMode, description);
+
+	InvalidateNodeCache();
+}
+
+
+/*
+ * TryLockNodeActiveSlot takes one of the NodeActiveMaxConcurrency slots that
+ * node_active calls need before they run the group state machine, without
+ * waiting. It returns false when all the slots are taken already, in which
+ * case the caller should let the node try again later rather than queue on
+ * the group lock.
+ *
+ * Slots are transaction level advisory locks, so they are released at the
+ * end of the node_active call.
+ */
+bool
+TryLockNodeActiveSlot(void)
+{
+	const bool sessionLock = false;
+	const bool dontWait = true;
+	int slot = 0;
+
+	if (NodeActiveMaxConcurrency <= 0)
+	{
+		return true;
+	}
+
+	/* start from a slot that depends on our pid, not all from slot 0 */
+	for (slot = 0; slot < NodeActiveMaxConcurrency; slot++)
+	{
+		LOCKTAG tag;
+		uint32 slotNumber =
+			(uint32) ((MyProcPid + slot) % NodeActiveMaxConcurrency);
+
+		SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, 0, slotNumber,
+							 ADV_LOCKTAG_CLASS_AUTO_FAILOVER_NODE_ACTIVE_SLOT);
+
+		if (LockAcquire(&tag, ExclusiveLock, sessionLock, dontWait)
+			!= LOCKACQUIRE_NOT_AVAIL)
+		{
+			return true;
+		}
+	}
+
+	return false;
 }
 
 
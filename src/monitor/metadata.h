@@ -15,12 +15,13 @@
 
 #include "storage/lockdefs.h"
 
-#define AUTO_FAILOVER_EXTENSION_VERSION "1.0"
+#define AUTO_FAILOVER_EXTENSION_VERSION "1.1"
 #define AUTO_FAILOVER_EXTENSION_NAME "pgautofailover"
 #define AUTO_FAILOVER_SCHEMA_NAME "pgautofailover"
 #define AUTO_FAILOVER_FORMATION_TABLE "pgautofailover.formation"
 #define AUTO_FAILOVER_NODE_TABLE "pgautofailover.node"
 #define AUTO_FAILOVER_EVENT_TABLE "pgautofailover.event"
+#define AUTO_FAILOVER_TRANSITION_TIMING_TABLE "pgautofailover.transition_timing"
 #define REPLICATION_STATE_TYPE_NAME "replication_state"
 
 
@@ -32,16 +33,21 @@
 typedef enum AutoFailoverHALocktagClass
 {
 	ADV_LOCKTAG_CLASS_AUTO_FAILOVER_FORMATION = 10,
-	ADV_LOCKTAG_CLASS_AUTO_FAILOVER_NODE_GROUP = 11
+	ADV_LOCKTAG_CLASS_AUTO_FAILOVER_NODE_GROUP = 11,
+	ADV_LOCKTAG_CLASS_AUTO_FAILOVER_NODE_ACTIVE_SLOT = 12
 } AutoFailoverHALocktagClass;
 
 /* GUC variable for version checks, true by default */
 extern bool EnableVersionChecks;
 
+/* GUC variable for node_active admission control, 0 disables it */
+extern int NodeActiveMaxConcurrency;
+
 /* public function declarations */
 extern Oid pgAutoFailoverRelationId(const char *relname);
 extern Oid pgAutoFailoverSchemaId(void);
 extern Oid pgAutoFailoverExtensionOwner(void);
 extern void LockFormation(char *formationId, LOCKMODE lockMode);
 extern void LockNodeGroup(char *formationId, int groupId, LOCKMODE lockMode);
+extern bool TryLockNodeActiveSlot(void);
 extern bool checkPgAutoFailoverVersion(void);
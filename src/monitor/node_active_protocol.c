@@ -22,20 +22,84 @@
 #include "node_metadata.h"
 #include "notifications.h"
 #include "replication_state.h"
+#include "wait_events.h"
 
 #include "access/htup_details.h"
+#include "access/xact.h"
 #include "access/xlogdefs.h"
 #include "catalog/pg_enum.h"
+#include "executor/executor.h"
+#include "lib/stringinfo.h"
 #include "nodes/makefuncs.h"
 #include "nodes/parsenodes.h"
 #include "parser/parse_type.h"
+#include "pgstat.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/lockdefs.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/lsyscache.h"
 #include "utils/pg_lsn.h"
+#include "utils/resowner.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+
+/*
+ * When node_active_wait can't register to be woken up on state changes, it
+ * polls the node table at this interval instead.
+ */
+#define NODE_ACTIVE_WAIT_POLL_INTERVAL_MS 100
+
+/* the retry hint of node_active calls turned away by admission control */
+#define NODE_ACTIVE_RETRY_AFTER_MS 1000
+
+/* number of attributes of the pgautofailover.node_report type */
+#define NODE_REPORT_ATTRIBUTES 9
+
+/* number of columns returned by node_active_batch */
+#define NODE_ACTIVE_BATCH_COLUMNS 6
+
+/* number of columns returned by node_active_peers */
+#define NODE_ACTIVE_PEERS_COLUMNS 14
+
+/*
+ * The keeper of a standby node connects to its upstream node with the
+ * application_name made of this prefix and its node id, see
+ * keeper_config_standby_application_name.
+ */
+#define STANDBY_APPLICATION_NAME_PREFIX "pgautofailover_standby"
+
+
+/* a node report given to node_active_batch */
+typedef struct NodeActiveBatchReport
+{
+	char *formationId;
+	char *nodeName;
+	int32 nodePort;
+	AutoFailoverNodeState currentNodeState;
+
+	/* the group that NodeActive locks for this report, see node_active_batch */
+	char *lockFormationId;
+	int32 lockGroupId;
+} NodeActiveBatchReport;
 
 
 /* private function forward declarations */
+static Datum NodeActiveFunction(FunctionCallInfo fcinfo, int32 timeoutMs,
+								 bool withPeers);
+static NodeActiveBatchReport * DeconstructNodeReports(ArrayType *reportArray,
+													  int *reportCount);
+static int CompareNodeActiveBatchReports(const void *left, const void *right);
+static void WaitForNodeStateChange(char *nodeName, int32 nodePort,
+								   AutoFailoverNodeState *currentNodeState,
+								   int32 timeoutMs);
+static bool NodeHasNewsFor(AutoFailoverNode *pgAutoFailoverNode,
+						   AutoFailoverNodeState *currentNodeState);
+static bool IsHeartbeatOnly(AutoFailoverNode *pgAutoFailoverNode,
+							AutoFailoverNodeState *currentNodeState);
 static AutoFailoverNodeState * NodeActive(char *formationId,
 										  char *nodeName, int32 nodePort,
 										  AutoFailoverNodeState *currentNodeState);
@@ -47,19 +111,37 @@ static int AssignGroupId(AutoFailoverFormation *formation,
 						 ReplicationState *initialState);
 
 static AutoFailoverNode * GetWritableNode(char *formationId, int32 groupId);
+static char * SynchronousStandbyNames(AutoFailoverFormation *formation,
+									  int32 groupId);
 static bool CanTakeWritesInState(ReplicationState state);
 static bool IsStateIn(ReplicationState state, List *allowedStates);
+static void FindPromotionNodes(char *formationId, int32 groupId,
+							   char *operation,
+							   List *primaryStates, List *secondaryStates,
+							   AutoFailoverNode **primaryNode,
+							   AutoFailoverNode **secondaryNode);
+static void StartPromotion(AutoFailoverNode *primaryNode,
+						   AutoFailoverNode *secondaryNode,
+						   char *message);
 
 
 /* SQL-callable function declarations */
 PG_FUNCTION_INFO_V1(register_node);
 PG_FUNCTION_INFO_V1(node_active);
+PG_FUNCTION_INFO_V1(node_active_wait);
+PG_FUNCTION_INFO_V1(node_active_peers);
+PG_FUNCTION_INFO_V1(node_active_batch);
 PG_FUNCTION_INFO_V1(get_primary);
 PG_FUNCTION_INFO_V1(get_other_node);
 PG_FUNCTION_INFO_V1(remove_node);
 PG_FUNCTION_INFO_V1(perform_failover);
+PG_FUNCTION_INFO_V1(perform_switchover);
 PG_FUNCTION_INFO_V1(start_maintenance);
 PG_FUNCTION_INFO_V1(stop_maintenance);
+PG_FUNCTION_INFO_V1(set_node_candidate_priority);
+PG_FUNCTION_INFO_V1(set_node_zone);
+PG_FUNCTION_INFO_V1(release_standby_slot);
+PG_FUNCTION_INFO_V1(synchronous_standby_names);
 
 /*
  * register_node adds a node to a given formation
@@ -233,6 +315,56 @@ register_node(PG_FUNCTION_ARGS)
  */
 Datum
 node_active(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_DATUM(NodeActiveFunction(fcinfo, 0, false));
+}
+
+
+/*
+ * node_active_wait is a variant of node_active that first waits for up to
+ * timeout milliseconds until there is something new for the node: either the
+ * monitor assigned it a new goal state, or the node itself is reporting a new
+ * state. Keepers that have nothing to do can then call it in a loop and learn
+ * about their new goal state as soon as it is assigned.
+ */
+Datum
+node_active_wait(PG_FUNCTION_ARGS)
+{
+	int32 timeoutMs = PG_GETARG_INT32(9);
+
+	PG_RETURN_DATUM(NodeActiveFunction(fcinfo, timeoutMs, false));
+}
+
+
+/*
+ * node_active_peers is node_active_wait that also returns what the keeper
+ * needs to know about the other nodes of its group to reach its new goal
+ * state: the other node, with its last reported LSN, its health and its node
+ * id, and the node that currently takes writes. Those are the answers of get_other_node
+ * and get_primary, and are NULL when these functions would raise an error.
+ * Transitions such as prepare_replication and init_standby then don't need
+ * another call to the monitor.
+ *
+ * A standby node also gets the upstream node that it should stream from,
+ * which is either the node that takes writes or another standby node of its
+ * zone, see GetUpstreamNode.
+ */
+Datum
+node_active_peers(PG_FUNCTION_ARGS)
+{
+	int32 timeoutMs = PG_GETARG_INT32(9);
+
+	PG_RETURN_DATUM(NodeActiveFunction(fcinfo, timeoutMs, true));
+}
+
+
+/*
+ * NodeActiveFunction implements node_active, node_active_wait and
+ * node_active_peers, which share their first arguments and the first columns
+ * of their result.
+ */
+static Datum
+NodeActiveFunction(FunctionCallInfo fcinfo, int32 timeoutMs, bool withPeers)
 {
 	text *formationIdText = PG_GETARG_TEXT_P(0);
 	char *formationId = text_to_cstring(formationIdText);
@@ -257,8 +389,8 @@ node_active(PG_FUNCTION_ARGS)
 	TypeFuncClass resultTypeClass = 0;
 	Datum resultDatum = 0;
 	HeapTuple resultTuple = NULL;
-	Datum values[3];
-	bool isNulls[3];
+	Datum values[NODE_ACTIVE_PEERS_COLUMNS];
+	bool isNulls[NODE_ACTIVE_PEERS_COLUMNS];
 
 	checkPgAutoFailoverVersion();
 
@@ -270,6 +402,11 @@ node_active(PG_FUNCTION_ARGS)
 	currentNodeState.pgsrSyncState = SyncStateFromString(currentPgsrSyncState);
 	currentNodeState.pgIsRunning = currentPgIsRunning;
 
+	if (timeoutMs > 0)
+	{
+		WaitForNodeStateChange(nodeName, nodePort, &currentNodeState, timeoutMs);
+	}
+
 	assignedNodeState =
 		NodeActive(formationId, nodeName, nodePort, &currentNodeState);
 
@@ -283,6 +420,85 @@ node_active(PG_FUNCTION_ARGS)
 	values[1] = Int32GetDatum(assignedNodeState->groupId);
 	values[2] = ObjectIdGetDatum(newReplicationStateOid);
 
+	if (withPeers)
+	{
+		AutoFailoverNode *activeNode = GetAutoFailoverNode(nodeName, nodePort);
+		AutoFailoverNode *otherNode = NULL;
+		AutoFailoverNode *primaryNode = NULL;
+		AutoFailoverNode *upstreamNode = NULL;
+		AutoFailoverFormation *formation = NULL;
+
+		if (activeNode != NULL)
+		{
+			otherNode = OtherNodeInGroup(activeNode);
+			primaryNode = GetWritableNode(activeNode->formationId,
+										  activeNode->groupId);
+			formation = GetFormation(activeNode->formationId);
+		}
+
+		if (primaryNode != NULL && primaryNode->nodeId != activeNode->nodeId)
+		{
+			upstreamNode = GetUpstreamNode(activeNode, primaryNode);
+		}
+
+		if (otherNode != NULL)
+		{
+			values[3] = CStringGetTextDatum(otherNode->nodeName);
+			values[4] = Int32GetDatum(otherNode->nodePort);
+			values[5] = LSNGetDatum(otherNode->reportedLSN);
+			values[6] = Int32GetDatum(otherNode->health);
+			values[10] = Int32GetDatum(otherNode->nodeId);
+		}
+		else
+		{
+			isNulls[3] = isNulls[4] = isNulls[5] = isNulls[6] = true;
+			isNulls[10] = true;
+		}
+
+		if (primaryNode != NULL)
+		{
+			values[7] = CStringGetTextDatum(primaryNode->nodeName);
+			values[8] = Int32GetDatum(primaryNode->nodePort);
+		}
+		else
+		{
+			isNulls[7] = isNulls[8] = true;
+		}
+
+		if (formation != NULL)
+		{
+			values[9] = CStringGetTextDatum(formation->synchronousCommit);
+		}
+		else
+		{
+			isNulls[9] = true;
+		}
+
+		if (upstreamNode != NULL)
+		{
+			values[11] = CStringGetTextDatum(upstreamNode->nodeName);
+			values[12] = Int32GetDatum(upstreamNode->nodePort);
+		}
+		else
+		{
+			isNulls[11] = isNulls[12] = true;
+		}
+
+		/* only the primary node applies synchronous_standby_names */
+		if (formation != NULL && primaryNode != NULL &&
+			primaryNode->nodeId == activeNode->nodeId)
+		{
+			char *standbyNames =
+				SynchronousStandbyNames(formation, activeNode->groupId);
+
+			values[13] = CStringGetTextDatum(standbyNames);
+		}
+		else
+		{
+			isNulls[13] = true;
+		}
+	}
+
 	resultTypeClass = get_call_result_type(fcinfo, NULL, &resultDescriptor);
 	if (resultTypeClass != TYPEFUNC_COMPOSITE)
 	{
@@ -292,7 +508,377 @@ node_active(PG_FUNCTION_ARGS)
 	resultTuple = heap_form_tuple(resultDescriptor, values, isNulls);
 	resultDatum = HeapTupleGetDatum(resultTuple);
 
-	PG_RETURN_DATUM(resultDatum);
+	return resultDatum;
+}
+
+
+/*
+ * node_active_batch is a variant of node_active that processes the reports of
+ * many nodes in a single transaction, for agents that report for several
+ * nodes at once. It returns the assigned state of each node.
+ *
+ * We process the reports ordered by the formation and group that the monitor
+ * has for their node, which are the ones NodeActive locks, so that concurrent
+ * batches take the group locks in the same order. Once taken, a group lock is
+ * kept until the end of the transaction, so that the next reports for the
+ * same group find it in the local lock table.
+ *
+ * Each report is processed in its own subtransaction: when a report fails,
+ * such as for a node that has been removed, we roll back its changes and
+ * return its error message in the error column, and process the next one.
+ */
+Datum
+node_active_batch(PG_FUNCTION_ARGS)
+{
+	ArrayType *reportArray = PG_GETARG_ARRAYTYPE_P(0);
+	ReturnSetInfo *resultSetInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupleDescriptor = NULL;
+	Tuplestorestate *tupleStore = NULL;
+	MemoryContext perQueryContext = NULL;
+	MemoryContext oldContext = NULL;
+	NodeActiveBatchReport *reports = NULL;
+	int reportCount = 0;
+	int reportIndex = 0;
+
+	checkPgAutoFailoverVersion();
+
+	if (resultSetInfo == NULL || !IsA(resultSetInfo, ReturnSetInfo))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context "
+						"that cannot accept a set")));
+	}
+
+	if (!(resultSetInfo->allowedModes & SFRM_Materialize))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not "
+						"allowed in this context")));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		elog(ERROR, "return type must be a row type");
+	}
+
+	perQueryContext = resultSetInfo->econtext->ecxt_per_query_memory;
+	oldContext = MemoryContextSwitchTo(perQueryContext);
+
+	tupleDescriptor = CreateTupleDescCopy(tupleDescriptor);
+	tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultSetInfo->returnMode = SFRM_Materialize;
+	resultSetInfo->setResult = tupleStore;
+	resultSetInfo->setDesc = tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	reports = DeconstructNodeReports(reportArray, &reportCount);
+
+	for (reportIndex = 0; reportIndex < reportCount; reportIndex++)
+	{
+		NodeActiveBatchReport *report = &(reports[reportIndex]);
+		AutoFailoverNode *pgAutoFailoverNode =
+			GetAutoFailoverNode(report->nodeName, report->nodePort);
+
+		/* NodeActive rejects the reports of unknown nodes before locking */
+		if (pgAutoFailoverNode != NULL)
+		{
+			report->lockFormationId = pgAutoFailoverNode->formationId;
+			report->lockGroupId = pgAutoFailoverNode->groupId;
+		}
+		else
+		{
+			report->lockFormationId = report->formationId;
+			report->lockGroupId = report->currentNodeState.groupId;
+		}
+	}
+
+	qsort(reports, reportCount, sizeof(NodeActiveBatchReport),
+		  CompareNodeActiveBatchReports);
+
+	for (reportIndex = 0; reportIndex < reportCount; reportIndex++)
+	{
+		NodeActiveBatchReport *report = &(reports[reportIndex]);
+		AutoFailoverNodeState *assignedNodeState = NULL;
+		char *errorMessage = NULL;
+		MemoryContext reportContext = CurrentMemoryContext;
+		ResourceOwner reportResourceOwner = CurrentResourceOwner;
+		Datum values[NODE_ACTIVE_BATCH_COLUMNS];
+		bool isNulls[NODE_ACTIVE_BATCH_COLUMNS];
+
+		CHECK_FOR_INTERRUPTS();
+
+		BeginInternalSubTransaction(NULL);
+		MemoryContextSwitchTo(reportContext);
+
+		PG_TRY();
+		{
+			assignedNodeState = NodeActive(report->formationId,
+										   report->nodeName, report->nodePort,
+										   &(report->currentNodeState));
+
+			ReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(reportContext);
+			CurrentResourceOwner = reportResourceOwner;
+		}
+		PG_CATCH();
+		{
+			ErrorData *errorData = NULL;
+
+			MemoryContextSwitchTo(reportContext);
+			errorData = CopyErrorData();
+			FlushErrorState();
+
+			RollbackAndReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(reportContext);
+			CurrentResourceOwner = reportResourceOwner;
+
+			/* the cache might have nodes that we just rolled back */
+			InvalidateNodeCache();
+
+			errorMessage = errorData->message;
+			assignedNodeState = NULL;
+		}
+		PG_END_TRY();
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = CStringGetTextDatum(report->nodeName);
+		values[1] = Int32GetDatum(report->nodePort);
+
+		if (assignedNodeState != NULL)
+		{
+			values[2] = Int32GetDatum(assignedNodeState->nodeId);
+			values[3] = Int32GetDatum(assignedNodeState->groupId);
+			values[4] = ObjectIdGetDatum(
+				ReplicationStateGetEnum(assignedNodeState->replicationState));
+			isNulls[5] = true;
+		}
+		else
+		{
+			isNulls[2] = isNulls[3] = isNulls[4] = true;
+			values[5] = CStringGetTextDatum(errorMessage);
+		}
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	tuplestore_donestoring(tupleStore);
+
+	return (Datum) 0;
+}
+
+
+/*
+ * DeconstructNodeReports reads the pgautofailover.node_report values of the
+ * given array. NULL attributes get the same defaults as the arguments of
+ * node_active, except for the formation, node name and port which we need.
+ */
+static NodeActiveBatchReport *
+DeconstructNodeReports(ArrayType *reportArray, int *reportCount)
+{
+	NodeActiveBatchReport *reports = NULL;
+	Oid elementTypeId = ARR_ELEMTYPE(reportArray);
+	Datum *reportDatums = NULL;
+	bool *reportNulls = NULL;
+	int16 typeLength = 0;
+	bool typeByValue = false;
+	char typeAlignment = 0;
+	int reportIndex = 0;
+
+	get_typlenbyvalalign(elementTypeId, &typeLength, &typeByValue, &typeAlignment);
+
+	deconstruct_array(reportArray, elementTypeId, typeLength, typeByValue,
+					  typeAlignment, &reportDatums, &reportNulls, reportCount);
+
+	reports = (NodeActiveBatchReport *)
+		palloc0(Max(*reportCount, 1) * sizeof(NodeActiveBatchReport));
+
+	for (reportIndex = 0; reportIndex < *reportCount; reportIndex++)
+	{
+		NodeActiveBatchReport *report = &(reports[reportIndex]);
+		AutoFailoverNodeState *currentNodeState = &(report->currentNodeState);
+		HeapTupleHeader reportTuple = NULL;
+		Datum values[NODE_REPORT_ATTRIBUTES];
+		bool isNulls[NODE_REPORT_ATTRIBUTES];
+		int attributeIndex = 0;
+
+		if (reportNulls[reportIndex])
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("node reports must not be NULL")));
+		}
+
+		reportTuple = DatumGetHeapTupleHeader(reportDatums[reportIndex]);
+
+		for (attributeIndex = 0; attributeIndex < NODE_REPORT_ATTRIBUTES;
+			 attributeIndex++)
+		{
+			values[attributeIndex] = GetAttributeByNum(reportTuple,
+													   attributeIndex + 1,
+													   &isNulls[attributeIndex]);
+		}
+
+		if (isNulls[0] || isNulls[1] || isNulls[2])
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("node reports must have a formation_id, "
+							"a node_name and a node_port")));
+		}
+
+		report->formationId = TextDatumGetCString(values[0]);
+		report->nodeName = TextDatumGetCString(values[1]);
+		report->nodePort = DatumGetInt32(values[2]);
+
+		currentNodeState->nodeId = isNulls[3] ? -1 : DatumGetInt32(values[3]);
+		currentNodeState->groupId = isNulls[4] ? -1 : DatumGetInt32(values[4]);
+		currentNodeState->replicationState =
+			isNulls[5]
+			? REPLICATION_STATE_INITIAL
+			: EnumGetReplicationState(DatumGetObjectId(values[5]));
+		currentNodeState->pgIsRunning = isNulls[6] ? true : DatumGetBool(values[6]);
+		currentNodeState->reportedLSN = isNulls[7] ? 0 : DatumGetLSN(values[7]);
+		currentNodeState->pgsrSyncState =
+			SyncStateFromString(isNulls[8] ? "" : TextDatumGetCString(values[8]));
+	}
+
+	return reports;
+}
+
+
+/*
+ * CompareNodeActiveBatchReports sorts node reports by the formation and group
+ * that NodeActive locks for them, then by node name and port.
+ */
+static int
+CompareNodeActiveBatchReports(const void *left, const void *right)
+{
+	const NodeActiveBatchReport *leftReport = (const NodeActiveBatchReport *) left;
+	const NodeActiveBatchReport *rightReport = (const NodeActiveBatchReport *) right;
+	int result = strcmp(leftReport->lockFormationId, rightReport->lockFormationId);
+
+	if (result != 0)
+	{
+		return result;
+	}
+
+	if (leftReport->lockGroupId != rightReport->lockGroupId)
+	{
+		return leftReport->lockGroupId < rightReport->lockGroupId ? -1 : 1;
+	}
+
+	result = strcmp(leftReport->nodeName, rightReport->nodeName);
+
+	if (result != 0)
+	{
+		return result;
+	}
+
+	return leftReport->nodePort - rightReport->nodePort;
+}
+
+
+/*
+ * WaitForNodeStateChange waits until the given node has something new to
+ * report or to learn, or until timeoutMs milliseconds have passed.
+ *
+ * We must not hold any lock while waiting, so this happens before NodeActive
+ * reports the node state. The backends notifying a state change wake us up
+ * when they commit, and we then read the node again.
+ *
+ * The snapshot of the calling statement is still held while we wait, which
+ * holds back the removal of dead rows by vacuum: pg_autoctl keepers call
+ * node_active_peers without a timeout, and wait for the notifications of the
+ * monitor on their own connection instead.
+ */
+static void
+WaitForNodeStateChange(char *nodeName, int32 nodePort,
+					   AutoFailoverNodeState *currentNodeState,
+					   int32 timeoutMs)
+{
+	TimestampTz deadline =
+		TimestampTzPlusMilliseconds(GetCurrentTimestamp(), timeoutMs);
+	bool registered = RegisterStateChangeWaiter();
+
+	PG_TRY();
+	{
+		for (;;)
+		{
+			AutoFailoverNode *pgAutoFailoverNode = NULL;
+			long remainingSecs = 0;
+			int remainingUsecs = 0;
+			long remainingMs = 0;
+			int waitResult = 0;
+
+			/* reset the latch before looking, so that we don't miss a wakeup */
+			ResetLatch(MyLatch);
+
+			CHECK_FOR_INTERRUPTS();
+
+			/* we are waiting for other backends to change the node */
+			InvalidateNodeCache();
+			pgAutoFailoverNode = GetAutoFailoverNode(nodeName, nodePort);
+
+			if (pgAutoFailoverNode == NULL ||
+				NodeHasNewsFor(pgAutoFailoverNode, currentNodeState))
+			{
+				break;
+			}
+
+			TimestampDifference(GetCurrentTimestamp(), deadline,
+								&remainingSecs, &remainingUsecs);
+
+			remainingMs = remainingSecs * 1000 + remainingUsecs / 1000;
+
+			if (remainingMs <= 0)
+			{
+				break;
+			}
+
+			if (!registered)
+			{
+				remainingMs = Min(remainingMs, NODE_ACTIVE_WAIT_POLL_INTERVAL_MS);
+			}
+
+			waitResult = WaitLatch(MyLatch,
+								   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+								   remainingMs, WAIT_EVENT_NODE_ACTIVE_WAIT);
+
+			if (waitResult & WL_POSTMASTER_DEATH)
+			{
+				proc_exit(1);
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		UnregisterStateChangeWaiter();
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	UnregisterStateChangeWaiter();
+}
+
+
+/*
+ * NodeHasNewsFor returns true when the node as registered on the monitor
+ * differs from the state that its keeper is reporting: either the monitor
+ * assigned a new goal state, or the keeper has a new state to report.
+ */
+static bool
+NodeHasNewsFor(AutoFailoverNode *pgAutoFailoverNode,
+			   AutoFailoverNodeState *currentNodeState)
+{
+	return pgAutoFailoverNode->goalState != currentNodeState->replicationState ||
+		   pgAutoFailoverNode->reportedState != currentNodeState->replicationState ||
+		   pgAutoFailoverNode->pgIsRunning != currentNodeState->pgIsRunning;
 }
 
 
@@ -367,9 +953,49 @@ NodeActive(char *formationId, char *nodeName, int32 nodePort,
 									currentNodeState->pgIsRunning,
 									currentNodeState->pgsrSyncState,
 									currentNodeState->reportedLSN);
+
+		/*
+		 * Most calls are just heartbeats from nodes in a stable state. Then
+		 * the state machine has nothing to do, and we return without taking
+		 * the group lock, which would serialize the calls of the group.
+		 */
+		if (IsHeartbeatOnly(pgAutoFailoverNode, currentNodeState))
+		{
+			assignedNodeState =
+				(AutoFailoverNodeState *) palloc0(sizeof(AutoFailoverNodeState));
+			assignedNodeState->nodeId = pgAutoFailoverNode->nodeId;
+			assignedNodeState->groupId = pgAutoFailoverNode->groupId;
+			assignedNodeState->replicationState = pgAutoFailoverNode->goalState;
+
+			return assignedNodeState;
+		}
 	}
 
-	LockNodeGroup(formationId, currentNodeState->groupId, ExclusiveLock);
+	/*
+	 * When too many node_active calls are running the state machine already,
+	 * we don't queue behind them on the group lock. The node's report has
+	 * been recorded above, and the state machine runs again at the next call.
+	 */
+	if (!TryLockNodeActiveSlot())
+	{
+		ereport(NOTICE,
+				(errmsg("the monitor is busy, node %s:%d keeps goal state %s",
+						pgAutoFailoverNode->nodeName,
+						pgAutoFailoverNode->nodePort,
+						ReplicationStateGetName(pgAutoFailoverNode->goalState)),
+				 errhint("Retry after %d ms.", NODE_ACTIVE_RETRY_AFTER_MS)));
+
+		assignedNodeState =
+			(AutoFailoverNodeState *) palloc0(sizeof(AutoFailoverNodeState));
+		assignedNodeState->nodeId = pgAutoFailoverNode->nodeId;
+		assignedNodeState->groupId = pgAutoFailoverNode->groupId;
+		assignedNodeState->replicationState = pgAutoFailoverNode->goalState;
+
+		return assignedNodeState;
+	}
+
+	/* lock the group the monitor has for the node, not the reported one */
+	LockNodeGroup(formationId, pgAutoFailoverNode->groupId, ExclusiveLock);
 
 	pgAutoFailoverNode = GetAutoFailoverNode(nodeName, nodePort);
 
@@ -385,6 +1011,26 @@ NodeActive(char *formationId, char *nodeName, int32 nodePort,
 }
 
 
+/*
+ * IsHeartbeatOnly returns true when a node_active call reports nothing new
+ * about a node that is in a stable state, so that there is nothing for the
+ * state machine to do. Only the reported LSN may have changed, which matters
+ * to the state machine only in the transitions that GroupStateIsStable has
+ * already ruled out.
+ */
+static bool
+IsHeartbeatOnly(AutoFailoverNode *pgAutoFailoverNode,
+				AutoFailoverNodeState *currentNodeState)
+{
+	return pgAutoFailoverNode->reportedState == currentNodeState->replicationState &&
+		   pgAutoFailoverNode->pgIsRunning == currentNodeState->pgIsRunning &&
+		   pgAutoFailoverNode->pgsrSyncState == currentNodeState->pgsrSyncState &&
+		   (currentNodeState->groupId == -1 ||
+			pgAutoFailoverNode->groupId == currentNodeState->groupId) &&
+		   GroupStateIsStable(pgAutoFailoverNode);
+}
+
+
 /*
  * JoinAutoFailoverFormation adds a new node to a AutoFailover formation.
  */
@@ -408,7 +1054,7 @@ JoinAutoFailoverFormation(AutoFailoverFormation *formation,
 		{
 			initialState = REPLICATION_STATE_SINGLE;
 		}
-		else if (formation->opt_secondary && list_length(groupNodeList) == 1)
+		else if (formation->opt_secondary)
 		{
 			initialState = REPLICATION_STATE_WAIT_STANDBY;
 		}
@@ -432,6 +1078,11 @@ JoinAutoFailoverFormation(AutoFailoverFormation *formation,
 
 /*
  * AssignGroupId assigns a group ID to a new node and returns it.
+ *
+ * In a pgsql formation, all the nodes join group 0, where any number of
+ * standby nodes follow the primary node. In a Citus formation, new nodes fill
+ * the groups with a primary and a standby node, and then start a new group:
+ * more standby nodes join a worker group by asking for it.
  */
 static int
 AssignGroupId(AutoFailoverFormation *formation, char *nodeName, int nodePort,
@@ -455,7 +1106,9 @@ AssignGroupId(AutoFailoverFormation *formation, char *nodeName, int nodePort,
 			groupId = candidateGroupId;
 			*initialState = REPLICATION_STATE_SINGLE;
 		}
-		else if (formation->opt_secondary && list_length(groupNodeList) == 1)
+		else if (formation->opt_secondary &&
+				 (list_length(groupNodeList) == 1 ||
+				  formation->kind != FORMATION_KIND_CITUS))
 		{
 			groupId = candidateGroupId;
 			*initialState = REPLICATION_STATE_WAIT_STANDBY;
@@ -543,6 +1196,87 @@ GetWritableNode(char *formationId, int32 groupId)
 }
 
 
+/*
+ * SynchronousStandbyNames returns the synchronous_standby_names setting for
+ * the primary node of the given group: a quorum of number_sync_standbys of
+ * the healthy secondary nodes that stream from the primary node, listed by
+ * their application_name, and at least one of them. Secondary nodes that
+ * cascade from another standby don't acknowledge commits on the primary, so
+ * we don't count them. Without any such node, we accept any standby.
+ */
+static char *
+SynchronousStandbyNames(AutoFailoverFormation *formation, int32 groupId)
+{
+	AutoFailoverNode *primaryNode = NULL;
+	List *otherNodesList = NIL;
+	ListCell *nodeCell = NULL;
+	StringInfoData standbyList;
+	int standbyCount = 0;
+	int numberSyncStandbys = 0;
+
+	primaryNode = GetWritableNode(formation->formationId, groupId);
+	if (primaryNode == NULL)
+	{
+		return "ANY 1 (*)";
+	}
+
+	initStringInfo(&standbyList);
+	otherNodesList = AutoFailoverOtherNodesList(primaryNode);
+
+	foreach(nodeCell, otherNodesList)
+	{
+		AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (otherNode->goalState != REPLICATION_STATE_SECONDARY ||
+			otherNode->health == NODE_HEALTH_BAD ||
+			GetUpstreamNode(otherNode, primaryNode) != primaryNode)
+		{
+			continue;
+		}
+
+		appendStringInfo(&standbyList, "%s%s_%d",
+						 standbyCount == 0 ? "" : ", ",
+						 STANDBY_APPLICATION_NAME_PREFIX, otherNode->nodeId);
+		standbyCount++;
+	}
+
+	if (standbyCount == 0)
+	{
+		return "ANY 1 (*)";
+	}
+
+	numberSyncStandbys = Max(1, Min(formation->numberSyncStandbys, standbyCount));
+
+	return psprintf("ANY %d (%s)", numberSyncStandbys, standbyList.data);
+}
+
+
+/*
+ * synchronous_standby_names returns the synchronous_standby_names setting for
+ * the primary node of the given group, see SynchronousStandbyNames.
+ */
+Datum
+synchronous_standby_names(PG_FUNCTION_ARGS)
+{
+	text *formationIdText = PG_GETARG_TEXT_P(0);
+	char *formationId = text_to_cstring(formationIdText);
+	int32 groupId = PG_GETARG_INT32(1);
+
+	AutoFailoverFormation *formation = NULL;
+
+	checkPgAutoFailoverVersion();
+
+	formation = GetFormation(formationId);
+	if (formation == NULL)
+	{
+		PG_RETURN_NULL();
+	}
+
+	PG_RETURN_TEXT_P(cstring_to_text(SynchronousStandbyNames(formation,
+															 groupId)));
+}
+
+
 /*
  * CanTakeWritesInState returns whether a node can take writes when in
  * the given state.
@@ -622,7 +1356,8 @@ remove_node(PG_FUNCTION_ARGS)
 	int32 nodePort = PG_GETARG_INT32(1);
 
 	AutoFailoverNode *currentNode = NULL;
-	AutoFailoverNode *otherNode = NULL;
+	List *otherNodesList = NIL;
+	ListCell *nodeCell = NULL;
 
 	checkPgAutoFailoverVersion();
 
@@ -634,13 +1369,22 @@ remove_node(PG_FUNCTION_ARGS)
 
 	LockFormation(currentNode->formationId, ExclusiveLock);
 
-	otherNode = OtherNodeInGroup(currentNode);
+	otherNodesList = AutoFailoverOtherNodesList(currentNode);
 
 	RemoveAutoFailoverNode(nodeName, nodePort);
 
-	if (otherNode != NULL)
+	/* the nodes left in the group proceed with the new group */
+	foreach(nodeCell, otherNodesList)
 	{
-		ProceedGroupState(otherNode);
+		AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+		otherNode = GetAutoFailoverNode(otherNode->nodeName,
+										otherNode->nodePort);
+
+		if (otherNode != NULL)
+		{
+			ProceedGroupState(otherNode);
+		}
 	}
 
 	PG_RETURN_BOOL(true);
@@ -676,11 +1420,6 @@ perform_failover(PG_FUNCTION_ARGS)
 	char *formationId = text_to_cstring(formationIdText);
 	int32 groupId = PG_GETARG_INT32(1);
 
-	List *groupNodeList = NULL;
-
-	AutoFailoverNode *firstNode = NULL;
-	AutoFailoverNode *secondNode = NULL;
-
 	AutoFailoverNode *primaryNode = NULL;
 	AutoFailoverNode *secondaryNode = NULL;
 
@@ -696,52 +1435,156 @@ perform_failover(PG_FUNCTION_ARGS)
 	LockFormation(formationId, ShareLock);
 	LockNodeGroup(formationId, groupId, ExclusiveLock);
 
-	groupNodeList = AutoFailoverNodeGroup(formationId, groupId);
-	if (list_length(groupNodeList) != 2)
-	{
-		ereport(ERROR, (errmsg("cannot fail over: group does not have 2 nodes")));
-	}
+	FindPromotionNodes(formationId, groupId, "fail over",
+					   primaryStates, secondaryStates,
+					   &primaryNode, &secondaryNode);
+
+	LogAndNotifyMessage(
+		message, BUFSIZE,
+		"Setting goal state of %s:%d to draining and %s:%d to"
+		"prepare_promotion after a user-initiated failover.",
+		primaryNode->nodeName, primaryNode->nodePort,
+		secondaryNode->nodeName, secondaryNode->nodePort);
+
+	StartPromotion(primaryNode, secondaryNode, message);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * perform_switchover promotes the secondary in the given group in a planned
+ * switchover, where both nodes are healthy and replication is synchronous.
+ *
+ * The goal states are the same as in perform_failover, but then the primary
+ * sets itself read-only and waits until the secondary has replayed its
+ * current LSN before stopping, and the monitor promotes the secondary as
+ * soon as the primary reports it's done draining, without waiting for the
+ * demote timeout. Writes are then only unavailable for the time it takes to
+ * replay the last transactions and promote the secondary.
+ */
+Datum
+perform_switchover(PG_FUNCTION_ARGS)
+{
+	text *formationIdText = PG_GETARG_TEXT_P(0);
+	char *formationId = text_to_cstring(formationIdText);
+	int32 groupId = PG_GETARG_INT32(1);
+
+	AutoFailoverNode *primaryNode = NULL;
+	AutoFailoverNode *secondaryNode = NULL;
+
+	List *primaryStates = list_make1_int(REPLICATION_STATE_PRIMARY);
+	List *secondaryStates = list_make1_int(REPLICATION_STATE_SECONDARY);
+
+	char message[BUFSIZE];
 
-	firstNode = linitial(groupNodeList);
-	secondNode = lsecond(groupNodeList);
+	checkPgAutoFailoverVersion();
 
-	if (IsStateIn(firstNode->goalState, primaryStates) &&
-		IsStateIn(firstNode->reportedState, primaryStates))
+	LockFormation(formationId, ShareLock);
+	LockNodeGroup(formationId, groupId, ExclusiveLock);
+
+	FindPromotionNodes(formationId, groupId, "switch over",
+					   primaryStates, secondaryStates,
+					   &primaryNode, &secondaryNode);
+
+	if (primaryNode->health != NODE_HEALTH_GOOD || !primaryNode->pgIsRunning)
 	{
-		primaryNode = firstNode;
+		ereport(ERROR,
+				(errmsg("cannot switch over: primary node %s:%d is not healthy",
+						primaryNode->nodeName, primaryNode->nodePort),
+				 errhint("Use perform_failover instead.")));
 	}
-	else if (IsStateIn(secondNode->reportedState, primaryStates) &&
-			 IsStateIn(secondNode->goalState, primaryStates))
+
+	if (secondaryNode->health != NODE_HEALTH_GOOD ||
+		!secondaryNode->pgIsRunning)
 	{
-		primaryNode = secondNode;
+		ereport(ERROR,
+				(errmsg("cannot switch over: secondary node %s:%d is not "
+						"healthy",
+						secondaryNode->nodeName, secondaryNode->nodePort)));
 	}
-	else
+
+	LogAndNotifyMessage(
+		message, BUFSIZE,
+		"Setting goal state of %s:%d to draining and %s:%d to "
+		"prepare_promotion after a user-initiated switchover.",
+		primaryNode->nodeName, primaryNode->nodePort,
+		secondaryNode->nodeName, secondaryNode->nodePort);
+
+	StartPromotion(primaryNode, secondaryNode, message);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * FindPromotionNodes finds the primary node and the secondary node to promote
+ * in the given group, which must have at least 2 nodes. Both the reported and
+ * the goal state of the primary must be in primaryStates. Among the nodes
+ * where those are in secondaryStates, we promote the preferred candidate,
+ * see IsPreferredCandidate. Errors out otherwise, using operation in the
+ * message.
+ */
+static void
+FindPromotionNodes(char *formationId, int32 groupId, char *operation,
+				   List *primaryStates, List *secondaryStates,
+				   AutoFailoverNode **primaryNode,
+				   AutoFailoverNode **secondaryNode)
+{
+	List *groupNodeList = NULL;
+	ListCell *nodeCell = NULL;
+
+	*primaryNode = NULL;
+	*secondaryNode = NULL;
+
+	groupNodeList = AutoFailoverNodeGroup(formationId, groupId);
+	if (list_length(groupNodeList) < 2)
 	{
-		ereport(ERROR, (errmsg("cannot fail over: there is no primary node")));
+		ereport(ERROR, (errmsg("cannot %s: group does not have 2 nodes",
+							   operation)));
 	}
 
-	if (IsStateIn(firstNode->reportedState, secondaryStates) &&
-		IsStateIn(firstNode->goalState, secondaryStates))
+	foreach(nodeCell, groupNodeList)
 	{
-		secondaryNode = firstNode;
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (IsStateIn(node->goalState, primaryStates) &&
+			IsStateIn(node->reportedState, primaryStates))
+		{
+			*primaryNode = node;
+		}
+		else if (IsStateIn(node->reportedState, secondaryStates) &&
+				 IsStateIn(node->goalState, secondaryStates) &&
+				 (*secondaryNode == NULL ||
+				  IsPreferredCandidate(node, *secondaryNode)))
+		{
+			*secondaryNode = node;
+		}
 	}
-	else if (IsStateIn(secondNode->reportedState, secondaryStates) &&
-			 IsStateIn(secondNode->goalState, secondaryStates))
+
+	if (*primaryNode == NULL)
 	{
-		secondaryNode = secondNode;
+		ereport(ERROR, (errmsg("cannot %s: there is no primary node",
+							   operation)));
 	}
-	else
+
+	if (*secondaryNode == NULL)
 	{
-		ereport(ERROR, (errmsg("cannot fail over: there is no secondary node")));
+		ereport(ERROR, (errmsg("cannot %s: there is no secondary node",
+							   operation)));
 	}
+}
 
-	LogAndNotifyMessage(
-		message, BUFSIZE,
-		"Setting goal state of %s:%d to draining and %s:%d to"
-		"prepare_promotion after a user-initiated failover.",
-		primaryNode->nodeName, primaryNode->nodePort,
-		secondaryNode->nodeName, secondaryNode->nodePort);
 
+/*
+ * StartPromotion assigns the draining goal state to the primary node and the
+ * prepare_promotion goal state to the secondary node, which then drive the
+ * promotion of the secondary through the group state machine.
+ */
+static void
+StartPromotion(AutoFailoverNode *primaryNode, AutoFailoverNode *secondaryNode,
+			   char *message)
+{
 	SetNodeGoalState(primaryNode->nodeName, primaryNode->nodePort,
 					 REPLICATION_STATE_DRAINING);
 
@@ -769,8 +1612,6 @@ perform_failover(PG_FUNCTION_ARGS)
 					  secondaryNode->pgsrSyncState,
 					  secondaryNode->reportedLSN,
 					  message);
-
-	PG_RETURN_VOID();
 }
 
 
@@ -851,26 +1692,39 @@ start_maintenance(PG_FUNCTION_ARGS)
 						ReplicationStateGetName(currentNode->goalState))));
 	}
 
-	LogAndNotifyMessage(
-		message, BUFSIZE,
-		"Setting goal state of %s:%d to wait_primary and %s:%d to"
-		"maintenance after a user-initiated start_maintenance call.",
-		otherNode->nodeName, otherNode->nodePort,
-		currentNode->nodeName, currentNode->nodePort);
-
-	SetNodeGoalState(otherNode->nodeName, otherNode->nodePort,
-					 REPLICATION_STATE_WAIT_PRIMARY);
-
-	NotifyStateChange(otherNode->reportedState,
-					  REPLICATION_STATE_WAIT_PRIMARY,
-					  otherNode->formationId,
-					  otherNode->groupId,
-					  otherNode->nodeId,
-					  otherNode->nodeName,
-					  otherNode->nodePort,
-					  otherNode->pgsrSyncState,
-					  otherNode->reportedLSN,
-					  message);
+	/* the primary keeps synchronous replication with its other secondary */
+	if (HasOtherSyncStandby(otherNode, currentNode,
+							AutoFailoverOtherNodesList(otherNode)))
+	{
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Setting goal state of %s:%d to "
+			"maintenance after a user-initiated start_maintenance call.",
+			currentNode->nodeName, currentNode->nodePort);
+	}
+	else
+	{
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Setting goal state of %s:%d to wait_primary and %s:%d to"
+			"maintenance after a user-initiated start_maintenance call.",
+			otherNode->nodeName, otherNode->nodePort,
+			currentNode->nodeName, currentNode->nodePort);
+
+		SetNodeGoalState(otherNode->nodeName, otherNode->nodePort,
+						 REPLICATION_STATE_WAIT_PRIMARY);
+
+		NotifyStateChange(otherNode->reportedState,
+						  REPLICATION_STATE_WAIT_PRIMARY,
+						  otherNode->formationId,
+						  otherNode->groupId,
+						  otherNode->nodeId,
+						  otherNode->nodeName,
+						  otherNode->nodePort,
+						  otherNode->pgsrSyncState,
+						  otherNode->reportedLSN,
+						  message);
+	}
 
 	SetNodeGoalState(currentNode->nodeName, currentNode->nodePort,
 					 REPLICATION_STATE_MAINTENANCE);
@@ -937,7 +1791,8 @@ stop_maintenance(PG_FUNCTION_ARGS)
 						currentNode->nodeName, currentNode->nodePort)));
 	}
 
-	if (!IsCurrentState(otherNode, REPLICATION_STATE_WAIT_PRIMARY))
+	if (!IsCurrentState(otherNode, REPLICATION_STATE_WAIT_PRIMARY) &&
+		!IsCurrentState(otherNode, REPLICATION_STATE_PRIMARY))
 	{
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
@@ -969,3 +1824,179 @@ stop_maintenance(PG_FUNCTION_ARGS)
 
 	PG_RETURN_BOOL(true);
 }
+
+
+/*
+ * set_node_candidate_priority sets the candidate priority of the given node,
+ * used to pick the standby to promote when the primary fails. A priority of
+ * zero prevents the node from being promoted automatically.
+ */
+Datum
+set_node_candidate_priority(PG_FUNCTION_ARGS)
+{
+	text *nodeNameText = PG_GETARG_TEXT_P(0);
+	char *nodeName = text_to_cstring(nodeNameText);
+	int32 nodePort = PG_GETARG_INT32(1);
+	int32 candidatePriority = PG_GETARG_INT32(2);
+
+	AutoFailoverNode *currentNode = NULL;
+
+	checkPgAutoFailoverVersion();
+
+	if (candidatePriority < 0 || candidatePriority > 100)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid candidate priority %d", candidatePriority),
+				 errhint("Candidate priority must be between 0 and 100.")));
+	}
+
+	currentNode = GetAutoFailoverNode(nodeName, nodePort);
+	if (currentNode == NULL)
+	{
+		PG_RETURN_BOOL(false);
+	}
+
+	LockFormation(currentNode->formationId, ShareLock);
+	LockNodeGroup(currentNode->formationId, currentNode->groupId, ExclusiveLock);
+
+	SetNodeCandidatePriority(nodeName, nodePort, candidatePriority);
+
+	PG_RETURN_BOOL(true);
+}
+
+
+/*
+ * set_node_zone sets the zone of the given node, such as a datacenter or an
+ * availability zone. Standby nodes then stream from the first secondary node
+ * of their zone rather than from a primary node in another zone, see
+ * GetUpstreamNode. An empty zone means that the node isn't in any zone.
+ */
+Datum
+set_node_zone(PG_FUNCTION_ARGS)
+{
+	text *nodeNameText = PG_GETARG_TEXT_P(0);
+	char *nodeName = text_to_cstring(nodeNameText);
+	int32 nodePort = PG_GETARG_INT32(1);
+	text *zoneText = PG_GETARG_TEXT_P(2);
+	char *zone = text_to_cstring(zoneText);
+
+	AutoFailoverNode *currentNode = NULL;
+
+	checkPgAutoFailoverVersion();
+
+	currentNode = GetAutoFailoverNode(nodeName, nodePort);
+	if (currentNode == NULL)
+	{
+		PG_RETURN_BOOL(false);
+	}
+
+	LockFormation(currentNode->formationId, ShareLock);
+	LockNodeGroup(currentNode->formationId, currentNode->groupId, ExclusiveLock);
+
+	SetNodeZone(nodeName, nodePort, zone[0] == '\0' ? NULL : zone);
+
+	PG_RETURN_BOOL(true);
+}
+
+
+/*
+ * release_standby_slot is called by a primary node once it has released
+ * the WAL that its replication slot retained for a standby that was away for
+ * too long. The standby can't stream from where it stopped anymore, so we
+ * have it initialise again from the primary, by way of wait_standby.
+ *
+ * The keeper gives the node id of the standby whose slot it released, or -1
+ * to mean the other node of the group. It calls us again until we return
+ * true, so we also do that when the standby is already on its way.
+ */
+Datum
+release_standby_slot(PG_FUNCTION_ARGS)
+{
+	text *nodeNameText = PG_GETARG_TEXT_P(0);
+	char *nodeName = text_to_cstring(nodeNameText);
+	int32 nodePort = PG_GETARG_INT32(1);
+	int64 retainedWALBytes = PG_GETARG_INT64(2);
+	int32 standbyNodeId = PG_GETARG_INT32(3);
+
+	AutoFailoverNode *primaryNode = NULL;
+	AutoFailoverNode *standbyNode = NULL;
+
+	char message[BUFSIZE];
+
+	List *standbyStates = list_make2_int(REPLICATION_STATE_SECONDARY,
+										 REPLICATION_STATE_CATCHINGUP);
+
+	checkPgAutoFailoverVersion();
+
+	primaryNode = GetAutoFailoverNode(nodeName, nodePort);
+	if (primaryNode == NULL)
+	{
+		PG_RETURN_BOOL(false);
+	}
+
+	LockFormation(primaryNode->formationId, ShareLock);
+	LockNodeGroup(primaryNode->formationId, primaryNode->groupId, ExclusiveLock);
+
+	if (standbyNodeId == -1)
+	{
+		standbyNode = OtherNodeInGroup(primaryNode);
+	}
+	else
+	{
+		List *otherNodesList = AutoFailoverOtherNodesList(primaryNode);
+		ListCell *nodeCell = NULL;
+
+		foreach(nodeCell, otherNodesList)
+		{
+			AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+			if (otherNode->nodeId == standbyNodeId)
+			{
+				standbyNode = otherNode;
+				break;
+			}
+		}
+	}
+
+	if (standbyNode == NULL
+		|| (primaryNode->reportedState != REPLICATION_STATE_WAIT_PRIMARY
+			&& primaryNode->reportedState != REPLICATION_STATE_PRIMARY))
+	{
+		PG_RETURN_BOOL(false);
+	}
+
+	if (standbyNode->goalState == REPLICATION_STATE_WAIT_STANDBY)
+	{
+		PG_RETURN_BOOL(true);
+	}
+
+	if (!IsStateIn(standbyNode->goalState, standbyStates))
+	{
+		PG_RETURN_BOOL(false);
+	}
+
+	LogAndNotifyMessage(
+		message, BUFSIZE,
+		"Setting goal state of %s:%d to wait_standby after %s:%d released "
+		"its replication slot, that retained " INT64_FORMAT " bytes of WAL.",
+		standbyNode->nodeName, standbyNode->nodePort,
+		primaryNode->nodeName, primaryNode->nodePort,
+		retainedWALBytes);
+
+	SetNodeGoalState(standbyNode->nodeName, standbyNode->nodePort,
+					 REPLICATION_STATE_WAIT_STANDBY);
+
+	NotifyStateChange(standbyNode->reportedState,
+					  REPLICATION_STATE_WAIT_STANDBY,
+					  standbyNode->formationId,
+					  standbyNode->groupId,
+					  standbyNode->nodeId,
+					  standbyNode->nodeName,
+					  standbyNode->nodePort,
+					  standbyNode->pgsrSyncState,
+					  standbyNode->reportedLSN,
+					  message);
+
+	PG_RETURN_BOOL(true);
+}
@@ -15,6 +15,7 @@
 #include "miscadmin.h"
 #include "fmgr.h"
 
+#include "function_stats.h"
 #include "health_check.h"
 #include "metadata.h"
 #include "node_metadata.h"
@@ -34,15 +35,79 @@
 #include "executor/spi.h"
 #include "lib/stringinfo.h"
 #include "nodes/pg_list.h"
+#include "storage/proc.h"
 #include "utils/builtins.h"
 #include "utils/fmgroids.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/pg_lsn.h"
 #include "utils/rel.h"
 #include "utils/relcache.h"
 #include "utils/syscache.h"
 
 
+/*
+ * We keep a backend-local cache of the nodes we read from pgautofailover.node,
+ * by (nodename, nodeport) and by (formationid, groupid), so that the several
+ * lookups done in a single node_active call only query the table once.
+ *
+ * Every node_active call updates the node table, so the cache is only valid
+ * for the current command of the current transaction. We also reset it when
+ * we write to the table, when taking a formation or group lock, and when the
+ * relation itself is invalidated.
+ */
+typedef struct NodeCacheKey
+{
+	char nodeName[MAX_NODE_NAME_SIZE];
+	int nodePort;
+} NodeCacheKey;
+
+typedef struct NodeCacheEntry
+{
+	NodeCacheKey key;
+	AutoFailoverNode *node;
+} NodeCacheEntry;
+
+typedef struct NodeGroupCacheKey
+{
+	char formationId[NAMEDATALEN];
+	int groupId;
+} NodeGroupCacheKey;
+
+typedef struct NodeGroupCacheEntry
+{
+	NodeGroupCacheKey key;
+	List *nodeList;
+} NodeGroupCacheEntry;
+
+static MemoryContext NodeCacheContext = NULL;
+static HTAB *NodeCacheHash = NULL;
+static HTAB *NodeGroupCacheHash = NULL;
+static LocalTransactionId NodeCacheTransactionId = InvalidLocalTransactionId;
+static CommandId NodeCacheCommandId = InvalidCommandId;
+static Oid NodeCacheRelationId = InvalidOid;
+static bool NodeCacheCallbackRegistered = false;
+
+/* GUC variable, see ReportAutoFailoverNodeState */
+int NodeReportFlushInterval = 10 * 1000;
+
+static bool NodeCacheIsValid(void);
+static void PrepareNodeCache(void);
+static void NodeCacheRelcacheCallback(Datum argument, Oid relationId);
+static bool MakeNodeCacheKey(NodeCacheKey *key, char *nodeName, int nodePort);
+static bool MakeNodeGroupCacheKey(NodeGroupCacheKey *key,
+								  char *formationId, int groupId);
+static AutoFailoverNode * LookupNodeCache(char *nodeName, int nodePort);
+static void StoreNodeCache(AutoFailoverNode *pgAutoFailoverNode);
+static bool LookupNodeGroupCache(char *formationId, int groupId,
+								 List **nodeList);
+static void StoreNodeGroupCache(char *formationId, int groupId, List *nodeList);
+static AutoFailoverNode * CopyAutoFailoverNode(AutoFailoverNode *pgAutoFailoverNode);
+static List * CopyAutoFailoverNodeList(List *nodeList);
+
+
 /*
  * AllAutoFailoverNodes returns all AutoFailover nodes in a formation as a
  * list.
@@ -103,6 +168,7 @@ AutoFailoverNode *
 TupleToAutoFailoverNode(TupleDesc tupleDescriptor, HeapTuple heapTuple)
 {
 	AutoFailoverNode *pgAutoFailoverNode = NULL;
+	NodeReport report;
 	bool isNull = false;
 
 	Datum formationId = heap_getattr(heapTuple,
@@ -142,6 +208,18 @@ TupleToAutoFailoverNode(TupleDesc tupleDescriptor, HeapTuple heapTuple)
 	Datum stateChangeTime = heap_getattr(heapTuple,
 										 Anum_pgautofailover_node_statechangetime,
 										 tupleDescriptor, &isNull);
+	Datum candidatePriority = heap_getattr(heapTuple,
+										   Anum_pgautofailover_node_candidatepriority,
+										   tupleDescriptor, &isNull);
+	bool walSourceIsNull = false;
+	Datum walSource = heap_getattr(heapTuple, Anum_pgautofailover_node_walsource,
+								   tupleDescriptor, &walSourceIsNull);
+	bool archiveLagIsNull = false;
+	Datum archiveLag = heap_getattr(heapTuple, Anum_pgautofailover_node_archivelag,
+									tupleDescriptor, &archiveLagIsNull);
+	bool zoneIsNull = false;
+	Datum zone = heap_getattr(heapTuple, Anum_pgautofailover_node_zone,
+							  tupleDescriptor, &zoneIsNull);
 
 	Oid goalStateOid = DatumGetObjectId(goalState);
 	Oid reportedStateOid = DatumGetObjectId(reportedState);
@@ -163,6 +241,30 @@ TupleToAutoFailoverNode(TupleDesc tupleDescriptor, HeapTuple heapTuple)
 	pgAutoFailoverNode->health = DatumGetInt32(health);
 	pgAutoFailoverNode->healthCheckTime = DatumGetTimestampTz(healthCheckTime);
 	pgAutoFailoverNode->stateChangeTime = DatumGetTimestampTz(stateChangeTime);
+	pgAutoFailoverNode->candidatePriority = DatumGetInt32(candidatePriority);
+	pgAutoFailoverNode->walFromArchive =
+		!walSourceIsNull &&
+		strcmp(TextDatumGetCString(walSource), "archive") == 0;
+	pgAutoFailoverNode->archiveLag =
+		archiveLagIsNull ? -1 : DatumGetInt64(archiveLag);
+	pgAutoFailoverNode->zone =
+		zoneIsNull ? NULL : TextDatumGetCString(zone);
+
+	/* the last reports of the keeper might only be known in shared memory */
+	if (GetNodeReport(pgAutoFailoverNode->nodeName, pgAutoFailoverNode->nodePort,
+					  &report))
+	{
+		if (report.reportTime > pgAutoFailoverNode->reportTime)
+		{
+			pgAutoFailoverNode->reportTime = report.reportTime;
+		}
+
+		if (report.walReportTime > pgAutoFailoverNode->walReportTime)
+		{
+			pgAutoFailoverNode->reportedLSN = report.reportedLSN;
+			pgAutoFailoverNode->walReportTime = report.walReportTime;
+		}
+	}
 
 	return pgAutoFailoverNode;
 }
@@ -194,7 +296,13 @@ AutoFailoverNodeGroup(char *formationId, int groupId)
 
 	const char *selectQuery =
 		"SELECT * FROM " AUTO_FAILOVER_NODE_TABLE
-		" WHERE formationid = $1 AND groupid = $2";
+		" WHERE formationid = $1 AND groupid = $2"
+		" ORDER BY nodeid";
+
+	if (LookupNodeGroupCache(formationId, groupId, &nodeList))
+	{
+		return nodeList;
+	}
 
 	SPI_connect();
 
@@ -220,6 +328,8 @@ AutoFailoverNodeGroup(char *formationId, int groupId)
 
 	SPI_finish();
 
+	StoreNodeGroupCache(formationId, groupId, nodeList);
+
 	return nodeList;
 }
 
@@ -249,6 +359,12 @@ GetAutoFailoverNode(char *nodeName, int nodePort)
 		"SELECT * FROM " AUTO_FAILOVER_NODE_TABLE
 		" WHERE nodename = $1 AND nodeport = $2";
 
+	pgAutoFailoverNode = LookupNodeCache(nodeName, nodePort);
+	if (pgAutoFailoverNode != NULL)
+	{
+		return pgAutoFailoverNode;
+	}
+
 	SPI_connect();
 
 	spiStatus = SPI_execute_with_args(selectQuery, argCount, argTypes, argValues,
@@ -272,17 +388,65 @@ GetAutoFailoverNode(char *nodeName, int nodePort)
 
 	SPI_finish();
 
+	if (pgAutoFailoverNode != NULL)
+	{
+		StoreNodeCache(pgAutoFailoverNode);
+	}
+
 	return pgAutoFailoverNode;
 }
 
 
 /*
- * OtherNodeInGroup returns the other node in a primary-secondary group, or
- * NULL if the group consists of 1 node.
+ * OtherNodeInGroup returns the node that the given node pairs with in its
+ * group, or NULL if the group consists of 1 node. For a standby that's the
+ * primary of the group. For the primary, that's the standby being promoted
+ * during a failover, and otherwise its first standby in the group.
  */
 AutoFailoverNode *
 OtherNodeInGroup(AutoFailoverNode *pgAutoFailoverNode)
 {
+	AutoFailoverNode *primaryNode = NULL;
+	AutoFailoverNode *firstNode = NULL;
+	ListCell *nodeCell = NULL;
+	List *otherNodesList = AutoFailoverOtherNodesList(pgAutoFailoverNode);
+
+	primaryNode = GetPrimaryNodeInGroup(pgAutoFailoverNode->formationId,
+										pgAutoFailoverNode->groupId);
+
+	if (primaryNode != NULL && primaryNode->nodeId != pgAutoFailoverNode->nodeId)
+	{
+		return primaryNode;
+	}
+
+	foreach(nodeCell, otherNodesList)
+	{
+		AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (otherNode->goalState == REPLICATION_STATE_PREPARE_PROMOTION ||
+			otherNode->goalState == REPLICATION_STATE_STOP_REPLICATION)
+		{
+			return otherNode;
+		}
+
+		if (firstNode == NULL)
+		{
+			firstNode = otherNode;
+		}
+	}
+
+	return firstNode;
+}
+
+
+/*
+ * AutoFailoverOtherNodesList returns the other nodes of the group of the given
+ * node, ordered by node id.
+ */
+List *
+AutoFailoverOtherNodesList(AutoFailoverNode *pgAutoFailoverNode)
+{
+	List *otherNodesList = NIL;
 	ListCell *nodeCell = NULL;
 	List *groupNodeList =
 		AutoFailoverNodeGroup(pgAutoFailoverNode->formationId,
@@ -294,7 +458,33 @@ OtherNodeInGroup(AutoFailoverNode *pgAutoFailoverNode)
 
 		if (otherNode->nodeId != pgAutoFailoverNode->nodeId)
 		{
-			return otherNode;
+			otherNodesList = lappend(otherNodesList, otherNode);
+		}
+	}
+
+	return otherNodesList;
+}
+
+
+/*
+ * GetPrimaryNodeInGroup returns the primary node of the given group: the node
+ * that is assigned a state where it is the primary, or used to be until the
+ * end of a failover. There is at most one such node in a group, and there is
+ * none when the primary has been removed.
+ */
+AutoFailoverNode *
+GetPrimaryNodeInGroup(char *formationId, int groupId)
+{
+	ListCell *nodeCell = NULL;
+	List *groupNodeList = AutoFailoverNodeGroup(formationId, groupId);
+
+	foreach(nodeCell, groupNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (IsPrimaryState(node->goalState))
+		{
+			return node;
 		}
 	}
 
@@ -302,6 +492,67 @@ OtherNodeInGroup(AutoFailoverNode *pgAutoFailoverNode)
 }
 
 
+/*
+ * IsPrimaryState returns whether the given state is one that the primary node
+ * of a group is assigned: the states where it takes writes, and the states
+ * where it is being demoted during a failover.
+ */
+bool
+IsPrimaryState(ReplicationState state)
+{
+	return state == REPLICATION_STATE_SINGLE ||
+		   state == REPLICATION_STATE_WAIT_PRIMARY ||
+		   state == REPLICATION_STATE_PRIMARY ||
+		   state == REPLICATION_STATE_DRAINING ||
+		   state == REPLICATION_STATE_DEMOTE_TIMEOUT;
+}
+
+
+/*
+ * GetUpstreamNode returns the node that the given standby node streams from:
+ * the first secondary node of its zone, when the primary node is in another
+ * zone, or otherwise the primary node itself. The first secondary node of a
+ * zone follows the primary node, so that cascading is one level deep, and a
+ * standby goes back to the primary node as soon as its relay isn't a healthy
+ * secondary anymore.
+ */
+AutoFailoverNode *
+GetUpstreamNode(AutoFailoverNode *standbyNode, AutoFailoverNode *primaryNode)
+{
+	ListCell *nodeCell = NULL;
+	List *groupNodeList = NIL;
+
+	if (primaryNode == NULL || standbyNode->zone == NULL ||
+		(primaryNode->zone != NULL &&
+		 strcmp(primaryNode->zone, standbyNode->zone) == 0))
+	{
+		return primaryNode;
+	}
+
+	groupNodeList = AutoFailoverNodeGroup(standbyNode->formationId,
+										  standbyNode->groupId);
+
+	foreach(nodeCell, groupNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (node->zone == NULL || strcmp(node->zone, standbyNode->zone) != 0)
+		{
+			continue;
+		}
+
+		if (IsCurrentState(node, REPLICATION_STATE_SECONDARY) &&
+			node->health == NODE_HEALTH_GOOD && node->pgIsRunning)
+		{
+			/* the first secondary of the zone follows the primary */
+			return node->nodeId == standbyNode->nodeId ? primaryNode : node;
+		}
+	}
+
+	return primaryNode;
+}
+
+
 /*
  * AddAutoFailoverNode adds a new AutoFailoverNode to pgautofailover.node with
  * the given properties.
@@ -368,6 +619,8 @@ AddAutoFailoverNode(char *formationId, int groupId, char *nodeName, int nodePort
 
 	SPI_finish();
 
+	InvalidateNodeCache();
+
 	return nodeId;
 }
 
@@ -411,13 +664,108 @@ SetNodeGoalState(char *nodeName, int nodePort, ReplicationState goalState)
 	}
 
 	SPI_finish();
+
+	InvalidateNodeCache();
 }
 
 
+/*
+ * SetNodeCandidatePriority updates the candidate priority of a node, which
+ * the group state machine uses to pick a standby to promote on failover. A
+ * node with priority zero is never promoted automatically.
+ */
+void
+SetNodeCandidatePriority(char *nodeName, int nodePort, int candidatePriority)
+{
+	Oid argTypes[] = {
+		INT4OID, /* candidatepriority */
+		TEXTOID, /* nodename */
+		INT4OID  /* nodeport */
+	};
+
+	Datum argValues[] = {
+		Int32GetDatum(candidatePriority),     /* candidatepriority */
+		CStringGetTextDatum(nodeName),        /* nodename */
+		Int32GetDatum(nodePort)               /* nodeport */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+	int spiStatus = 0;
+
+	const char *updateQuery =
+		"UPDATE " AUTO_FAILOVER_NODE_TABLE
+		" SET candidatepriority = $1 "
+		"WHERE nodename = $2 AND nodeport = $3";
+
+	SPI_connect();
+
+	spiStatus = SPI_execute_with_args(updateQuery,
+									  argCount, argTypes, argValues,
+									  NULL, false, 0);
+	if (spiStatus != SPI_OK_UPDATE)
+	{
+		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_TABLE);
+	}
+
+	SPI_finish();
+
+	InvalidateNodeCache();
+}
+
+/*
+ * SetNodeZone updates the zone of a node, which GetUpstreamNode uses to have
+ * standby nodes in the same zone stream from one another. A NULL zone means
+ * that the node isn't in any zone.
+ */
+void
+SetNodeZone(char *nodeName, int nodePort, char *zone)
+{
+	Oid argTypes[] = {
+		TEXTOID, /* zone */
+		TEXTOID, /* nodename */
+		INT4OID  /* nodeport */
+	};
+
+	Datum argValues[] = {
+		zone == NULL ? (Datum) 0 : CStringGetTextDatum(zone), /* zone */
+		CStringGetTextDatum(nodeName),        /* nodename */
+		Int32GetDatum(nodePort)               /* nodeport */
+	};
+	const char argNulls[] = {
+		zone == NULL ? 'n' : ' ', ' ', ' '
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+	int spiStatus = 0;
+
+	const char *updateQuery =
+		"UPDATE " AUTO_FAILOVER_NODE_TABLE
+		" SET zone = $1 "
+		"WHERE nodename = $2 AND nodeport = $3";
+
+	SPI_connect();
+
+	spiStatus = SPI_execute_with_args(updateQuery,
+									  argCount, argTypes, argValues,
+									  argNulls, false, 0);
+	if (spiStatus != SPI_OK_UPDATE)
+	{
+		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_TABLE);
+	}
+
+	SPI_finish();
+
+	InvalidateNodeCache();
+}
+
 /*
  * ReportAutoFailoverNodeState persists the reported state and nodes version of
  * a node.
  *
+ * Most reports come from nodes in a stable state and only tell us that the
+ * keeper is still alive, and its current LSN. We keep those in shared memory,
+ * where TupleToAutoFailoverNode finds them, and only write them to the node
+ * table every NodeReportFlushInterval milliseconds, which saves a tuple
+ * version and its WAL on most calls.
+ *
  * We use SPI to automatically handle triggers, function calls, etc.
  */
 void
@@ -426,6 +774,10 @@ ReportAutoFailoverNodeState(char *nodeName, int nodePort,
 							bool pgIsRunning, SyncState pgSyncState,
 							XLogRecPtr reportedLSN)
 {
+	TimestampTz reportTime = GetCurrentTransactionStartTimestamp();
+	AutoFailoverNode *pgAutoFailoverNode = GetAutoFailoverNode(nodeName, nodePort);
+	NodeReport report;
+
 	Oid reportedStateOid = ReplicationStateGetEnum(reportedState);
 	Oid replicationStateTypeOid = ReplicationStateTypeOid();
 
@@ -448,6 +800,7 @@ ReportAutoFailoverNodeState(char *nodeName, int nodePort,
 	};
 	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
 	int spiStatus = 0;
+	WriteUsage writeUsage;
 
 	const char *updateQuery =
 		"UPDATE " AUTO_FAILOVER_NODE_TABLE
@@ -457,6 +810,25 @@ ReportAutoFailoverNodeState(char *nodeName, int nodePort,
 		"walreporttime = CASE $4 WHEN '0/0'::pg_lsn THEN walreporttime ELSE now() END, "
 		"statechangetime = now() WHERE nodename = $5 AND nodeport = $6";
 
+	WriteUsageStart(&writeUsage);
+
+	if (pgAutoFailoverNode != NULL &&
+		pgAutoFailoverNode->goalState == pgAutoFailoverNode->reportedState &&
+		pgAutoFailoverNode->reportedState == reportedState &&
+		pgAutoFailoverNode->pgIsRunning == pgIsRunning &&
+		pgAutoFailoverNode->pgsrSyncState == pgSyncState &&
+		GetNodeReport(nodeName, nodePort, &report) &&
+		!TimestampDifferenceExceeds(report.flushTime, reportTime,
+									NodeReportFlushInterval))
+	{
+		RecordNodeHeartbeat(nodeName, nodePort, reportTime, reportedLSN, false);
+		InvalidateNodeCache();
+
+		WriteUsageEnd(WRITE_REPORT_NODE_STATE, &writeUsage);
+
+		return;
+	}
+
 	SPI_connect();
 
 	spiStatus = SPI_execute_with_args(updateQuery,
@@ -468,7 +840,14 @@ ReportAutoFailoverNodeState(char *nodeName, int nodePort,
 		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_TABLE);
 	}
 
+	/* let the health check worker know about this report right away */
+	RecordNodeHeartbeat(nodeName, nodePort, reportTime, reportedLSN, true);
+
 	SPI_finish();
+
+	InvalidateNodeCache();
+
+	WriteUsageEnd(WRITE_REPORT_NODE_STATE, &writeUsage);
 }
 
 
@@ -519,6 +898,8 @@ ReportAutoFailoverNodeHealth(char *nodeName, int nodePort,
 	}
 
 	SPI_finish();
+
+	InvalidateNodeCache();
 }
 
 
@@ -558,6 +939,8 @@ RemoveAutoFailoverNode(char *nodeName, int nodePort)
 	}
 
 	SPI_finish();
+
+	InvalidateNodeCache();
 }
 
 
@@ -641,3 +1024,292 @@ IsCurrentState(AutoFailoverNode *pgAutoFailoverNode, ReplicationState state)
 		&& pgAutoFailoverNode->goalState == pgAutoFailoverNode->reportedState
 		&& pgAutoFailoverNode->goalState == state;
 }
+
+
+/*
+ * InvalidateNodeCache forgets about all the nodes we have cached, so that the
+ * next lookups read pgautofailover.node again.
+ */
+void
+InvalidateNodeCache(void)
+{
+	if (NodeCacheContext != NULL)
+	{
+		MemoryContextReset(NodeCacheContext);
+	}
+
+	NodeCacheHash = NULL;
+	NodeGroupCacheHash = NULL;
+	NodeCacheTransactionId = InvalidLocalTransactionId;
+	NodeCacheCommandId = InvalidCommandId;
+}
+
+
+/*
+ * NodeCacheIsValid returns true when the cached nodes have been read in the
+ * current command of the current transaction.
+ */
+static bool
+NodeCacheIsValid(void)
+{
+	return NodeCacheHash != NULL
+		&& NodeCacheTransactionId == MyProc->lxid
+		&& NodeCacheCommandId == GetCurrentCommandId(false);
+}
+
+
+/*
+ * PrepareNodeCache makes sure that the cache hash tables exist and are valid
+ * for the current command, before we add entries to them.
+ */
+static void
+PrepareNodeCache(void)
+{
+	HASHCTL info;
+
+	if (NodeCacheIsValid())
+	{
+		return;
+	}
+
+	InvalidateNodeCache();
+
+	if (!NodeCacheCallbackRegistered)
+	{
+		CacheRegisterRelcacheCallback(NodeCacheRelcacheCallback, (Datum) 0);
+		NodeCacheCallbackRegistered = true;
+	}
+
+	if (NodeCacheContext == NULL)
+	{
+		NodeCacheContext = AllocSetContextCreate(CacheMemoryContext,
+												 "pg_auto_failover node cache",
+												 ALLOCSET_DEFAULT_SIZES);
+	}
+
+	NodeCacheRelationId =
+		pgAutoFailoverRelationId(AUTO_FAILOVER_NODE_TABLE_NAME);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(NodeCacheKey);
+	info.entrysize = sizeof(NodeCacheEntry);
+	info.hcxt = NodeCacheContext;
+
+	NodeCacheHash = hash_create("pg_auto_failover nodes", 32, &info,
+								HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(NodeGroupCacheKey);
+	info.entrysize = sizeof(NodeGroupCacheEntry);
+	info.hcxt = NodeCacheContext;
+
+	NodeGroupCacheHash = hash_create("pg_auto_failover node groups", 32, &info,
+									 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	NodeCacheTransactionId = MyProc->lxid;
+	NodeCacheCommandId = GetCurrentCommandId(false);
+}
+
+
+/*
+ * NodeCacheRelcacheCallback resets the cache when pgautofailover.node is
+ * invalidated, or when all the relations are.
+ */
+static void
+NodeCacheRelcacheCallback(Datum argument, Oid relationId)
+{
+	if (relationId == InvalidOid || relationId == NodeCacheRelationId)
+	{
+		InvalidateNodeCache();
+	}
+}
+
+
+/*
+ * MakeNodeCacheKey fills in a cache key for the given node, and returns false
+ * when the node name is too long to be cached.
+ */
+static bool
+MakeNodeCacheKey(NodeCacheKey *key, char *nodeName, int nodePort)
+{
+	if (strlen(nodeName) >= MAX_NODE_NAME_SIZE)
+	{
+		return false;
+	}
+
+	memset(key, 0, sizeof(NodeCacheKey));
+	strlcpy(key->nodeName, nodeName, MAX_NODE_NAME_SIZE);
+	key->nodePort = nodePort;
+
+	return true;
+}
+
+
+/*
+ * MakeNodeGroupCacheKey fills in a cache key for the given group, and returns
+ * false when the formation name is too long to be cached.
+ */
+static bool
+MakeNodeGroupCacheKey(NodeGroupCacheKey *key, char *formationId, int groupId)
+{
+	if (strlen(formationId) >= NAMEDATALEN)
+	{
+		return false;
+	}
+
+	memset(key, 0, sizeof(NodeGroupCacheKey));
+	strlcpy(key->formationId, formationId, NAMEDATALEN);
+	key->groupId = groupId;
+
+	return true;
+}
+
+
+/*
+ * LookupNodeCache returns a copy of the cached node with the given name and
+ * port, or NULL when we don't have it.
+ */
+static AutoFailoverNode *
+LookupNodeCache(char *nodeName, int nodePort)
+{
+	NodeCacheKey key;
+	NodeCacheEntry *entry = NULL;
+
+	if (!NodeCacheIsValid() || !MakeNodeCacheKey(&key, nodeName, nodePort))
+	{
+		return NULL;
+	}
+
+	entry = (NodeCacheEntry *) hash_search(NodeCacheHash, &key, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		return NULL;
+	}
+
+	return CopyAutoFailoverNode(entry->node);
+}
+
+
+/*
+ * StoreNodeCache adds a copy of the given node to the cache.
+ */
+static void
+StoreNodeCache(AutoFailoverNode *pgAutoFailoverNode)
+{
+	NodeCacheKey key;
+	NodeCacheEntry *entry = NULL;
+	MemoryContext oldContext = NULL;
+
+	if (!MakeNodeCacheKey(&key, pgAutoFailoverNode->nodeName,
+						  pgAutoFailoverNode->nodePort))
+	{
+		return;
+	}
+
+	PrepareNodeCache();
+
+	entry = (NodeCacheEntry *) hash_search(NodeCacheHash, &key, HASH_ENTER, NULL);
+
+	oldContext = MemoryContextSwitchTo(NodeCacheContext);
+	entry->node = CopyAutoFailoverNode(pgAutoFailoverNode);
+	MemoryContextSwitchTo(oldContext);
+}
+
+
+/*
+ * LookupNodeGroupCache sets nodeList to a copy of the cached nodes of the
+ * given group and returns true, or returns false when we don't have them.
+ */
+static bool
+LookupNodeGroupCache(char *formationId, int groupId, List **nodeList)
+{
+	NodeGroupCacheKey key;
+	NodeGroupCacheEntry *entry = NULL;
+
+	if (!NodeCacheIsValid() || !MakeNodeGroupCacheKey(&key, formationId, groupId))
+	{
+		return false;
+	}
+
+	entry = (NodeGroupCacheEntry *) hash_search(NodeGroupCacheHash, &key,
+												 HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		return false;
+	}
+
+	*nodeList = CopyAutoFailoverNodeList(entry->nodeList);
+
+	return true;
+}
+
+
+/*
+ * StoreNodeGroupCache adds a copy of the nodes of the given group to the
+ * cache, and also caches each of the nodes by name and port.
+ */
+static void
+StoreNodeGroupCache(char *formationId, int groupId, List *nodeList)
+{
+	NodeGroupCacheKey key;
+	NodeGroupCacheEntry *entry = NULL;
+	MemoryContext oldContext = NULL;
+	ListCell *nodeCell = NULL;
+
+	if (!MakeNodeGroupCacheKey(&key, formationId, groupId))
+	{
+		return;
+	}
+
+	PrepareNodeCache();
+
+	entry = (NodeGroupCacheEntry *) hash_search(NodeGroupCacheHash, &key,
+												 HASH_ENTER, NULL);
+
+	oldContext = MemoryContextSwitchTo(NodeCacheContext);
+	entry->nodeList = CopyAutoFailoverNodeList(nodeList);
+	MemoryContextSwitchTo(oldContext);
+
+	foreach(nodeCell, nodeList)
+	{
+		StoreNodeCache((AutoFailoverNode *) lfirst(nodeCell));
+	}
+}
+
+
+/*
+ * CopyAutoFailoverNode returns a copy of the given node, allocated in the
+ * current memory context. Callers are free to modify nodes returned by the
+ * lookup functions, so we never hand out the cached entries themselves.
+ */
+static AutoFailoverNode *
+CopyAutoFailoverNode(AutoFailoverNode *pgAutoFailoverNode)
+{
+	AutoFailoverNode *copy = (AutoFailoverNode *) palloc(sizeof(AutoFailoverNode));
+
+	*copy = *pgAutoFailoverNode;
+	copy->formationId = pstrdup(pgAutoFailoverNode->formationId);
+	copy->nodeName = pstrdup(pgAutoFailoverNode->nodeName);
+
+	return copy;
+}
+
+
+/*
+ * CopyAutoFailoverNodeList returns a list of copies of the given nodes.
+ */
+static List *
+CopyAutoFailoverNodeList(List *nodeList)
+{
+	List *copyList = NIL;
+	ListCell *nodeCell = NULL;
+
+	foreach(nodeCell, nodeList)
+	{
+		AutoFailoverNode *pgAutoFailoverNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+		copyList = lappend(copyList, CopyAutoFailoverNode(pgAutoFailoverNode));
+	}
+
+	return copyList;
+}
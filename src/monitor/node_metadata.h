@@ -21,7 +21,7 @@
 #define AUTO_FAILOVER_NODE_TABLE_NAME "node"
 
 /* column indexes for pgautofailover.node */
-#define Natts_pgautofailover_node 15
+#define Natts_pgautofailover_node 20
 #define Anum_pgautofailover_node_formationid 1
 #define Anum_pgautofailover_node_nodeid 2
 #define Anum_pgautofailover_node_groupid 3
@@ -37,6 +37,11 @@
 #define Anum_pgautofailover_node_health 13
 #define Anum_pgautofailover_node_healthchecktime 14
 #define Anum_pgautofailover_node_statechangetime 15
+#define Anum_pgautofailover_node_candidatepriority 16
+#define Anum_pgautofailover_node_slotretainedwal 17
+#define Anum_pgautofailover_node_walsource 18
+#define Anum_pgautofailover_node_archivelag 19
+#define Anum_pgautofailover_node_zone 20
 
 
 /* pg_stat_replication.sync_state: "sync", "async", "quorum", "potential" */
@@ -71,14 +76,26 @@ typedef struct AutoFailoverNode
 	NodeHealthState health;
 	TimestampTz healthCheckTime;
 	TimestampTz stateChangeTime;
+	int candidatePriority;
+	bool walFromArchive;        /* walsource = 'archive' */
+	int64 archiveLag;           /* -1 when unknown */
+	char *zone;                 /* NULL when unknown */
 } AutoFailoverNode;
 
 
+/* GUC variable */
+extern int NodeReportFlushInterval;
+
 /* public function declarations */
 extern List * AllAutoFailoverNodes(char *formationId);
 extern List * AutoFailoverNodeGroup(char *formationId, int groupId);
 extern AutoFailoverNode * GetAutoFailoverNode(char *nodeName, int nodePort);
 extern AutoFailoverNode * OtherNodeInGroup(AutoFailoverNode *pgAutoFailoverNode);
+extern List * AutoFailoverOtherNodesList(AutoFailoverNode *pgAutoFailoverNode);
+extern AutoFailoverNode * GetPrimaryNodeInGroup(char *formationId, int groupId);
+extern bool IsPrimaryState(ReplicationState state);
+extern AutoFailoverNode * GetUpstreamNode(AutoFailoverNode *standbyNode,
+										  AutoFailoverNode *primaryNode);
 extern AutoFailoverNode * TupleToAutoFailoverNode(TupleDesc tupleDescriptor,
 												  HeapTuple heapTuple);
 extern int AddAutoFailoverNode(char *formationId, int groupId,
@@ -95,7 +112,11 @@ extern void ReportAutoFailoverNodeState(char *nodeName, int nodePort,
 extern void ReportAutoFailoverNodeHealth(char *nodeName, int nodePort,
 										 ReplicationState goalState,
 										 NodeHealthState health);
+extern void SetNodeCandidatePriority(char *nodeName, int nodePort,
+									 int candidatePriority);
+extern void SetNodeZone(char *nodeName, int nodePort, char *zone);
 extern void RemoveAutoFailoverNode(char *nodeName, int nodePort);
+extern void InvalidateNodeCache(void);
 
 extern SyncState SyncStateFromString(const char *pgsrSyncState);
 extern char *SyncStateToString(SyncState pgsrSyncState);
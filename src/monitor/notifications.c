@@ -12,19 +12,145 @@
  */
 
 #include "postgres.h"
+#include "miscadmin.h"
 
+#include "event_buffer.h"
+#include "function_stats.h"
 #include "metadata.h"
 #include "notifications.h"
 #include "replication_state.h"
 
+#include "access/xact.h"
 #include "catalog/pg_type.h"
 #include "commands/async.h"
+#include "commands/sequence.h"
 #include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
 #include "utils/builtins.h"
 #include "utils/fmgroids.h"
+#include "utils/memutils.h"
 #include "utils/pg_lsn.h"
 
 
+/* maximum number of backends waiting in node_active_wait at the same time */
+#define MAX_STATE_CHANGE_WAITERS 256
+
+/* number of transactions in progress that events_since keeps track of */
+#define MAX_EVENT_WRITERS 256
+
+
+/*
+ * StateChangeWaiter is a backend waiting for a state change to be notified,
+ * see RegisterStateChangeWaiter.
+ */
+typedef struct StateChangeWaiter
+{
+	pid_t		pid;
+	Oid			dboid;
+	Latch	   *latch;
+} StateChangeWaiter;
+
+typedef struct StateChangeWaiterControlData
+{
+	int				trancheId;
+	char		   *lockTrancheName;
+	LWLock			lock;
+	StateChangeWaiter waiters[MAX_STATE_CHANGE_WAITERS];
+
+	/* incremented each time a state change is committed */
+	pg_atomic_uint64 stateChangeVersion;
+} StateChangeWaiterControlData;
+
+
+/*
+ * EventWriter is a transaction in progress that took an eventid, and the
+ * lowest eventid that it may have taken, see NextEventId.
+ */
+typedef struct EventWriter
+{
+	pid_t		pid;
+	Oid			dboid;
+	int64		lowestEventId;
+} EventWriter;
+
+typedef struct EventWriterControlData
+{
+	int				trancheId;
+	char		   *lockTrancheName;
+	LWLock			lock;
+	EventWriter		writers[MAX_EVENT_WRITERS];
+
+	/* the highest eventid that was taken since the monitor started */
+	int64			lastEventId;
+
+	/* writers that found no free slot, and the lowest eventid they took */
+	int				overflowCount;
+	int64			overflowEventId;
+} EventWriterControlData;
+
+
+static StateChangeWaiterControlData *StateChangeWaiterControl = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/* whether the current transaction notified a state change */
+static bool StateChangeNotified = false;
+static bool StateChangeCallbackRegistered = false;
+
+/* state changes of the current transaction not notified yet */
+static StringInfo PendingStateNotification = NULL;
+
+/*
+ * PendingSubXactNotification is the state changes that were not notified yet
+ * when a subtransaction started, which we go back to when it is rolled back.
+ */
+typedef struct PendingSubXactNotification
+{
+	SubTransactionId subXactId;
+	char *pendingData;			/* NULL when there was none */
+} PendingSubXactNotification;
+
+static List *PendingSubXactNotifications = NIL;
+
+/* slot of this backend in StateChangeWaiterControl, if any */
+static int MyStateChangeWaiterSlot = -1;
+static bool StateChangeWaiterExitRegistered = false;
+
+static EventWriterControlData *EventWriterControl = NULL;
+static shmem_startup_hook_type prev_event_writer_shmem_startup_hook = NULL;
+
+/* slot of the current transaction in EventWriterControl, if any */
+static int MyEventWriterSlot = -1;
+static bool MyEventWriterOverflow = false;
+static bool EventWriterCallbacksRegistered = false;
+
+
+static void StateChangeWaiterShmemInit(void);
+static void StateChangeXactCallback(XactEvent event, void *arg);
+static void StateChangeSubXactCallback(SubXactEvent event,
+									   SubTransactionId mySubid,
+									   SubTransactionId parentSubid,
+									   void *arg);
+static void FlushStateNotification(void);
+static void WakeStateChangeWaiters(Oid databaseId);
+static void StateChangeWaiterExit(int code, Datum arg);
+static void EventWriterShmemInit(void);
+static void RegisterEventWriter(void);
+static void ReleaseEventWriter(void);
+static void EventWriterXactCallback(XactEvent event, void *arg);
+static void EventWriterExit(int code, Datum arg);
+static int64 LastEventIdOfSequence(void);
+
+
+PG_FUNCTION_INFO_V1(next_eventid);
+PG_FUNCTION_INFO_V1(event_horizon);
+
+
 /*
  * LogAndNotifyMessage emits the given message both as a log entry and also as
  * a notification on the CHANNEL_LOG channel.
@@ -55,7 +181,8 @@ LogAndNotifyMessage(char *message, size_t size, const char *fmt, ...)
 /*
  * NotifyStateChange emits a notification message on the CHANNEL_STATE channel
  * about a state change decided by the monitor. This state change is encoded so
- * as to be easy to parse by a machine.
+ * as to be easy to parse by a machine, and the state changes of a transaction
+ * are coalesced in a single notification, see STATE_NOTIFICATION_VERSION.
  */
 int64
 NotifyStateChange(ReplicationState reportedState,
@@ -70,7 +197,8 @@ NotifyStateChange(ReplicationState reportedState,
 				  char *description)
 {
 	int64 eventid;
-	char payload[BUFSIZE];
+	char entry[BUFSIZE];
+	MemoryContext oldContext = NULL;
 
 	/*
 	 * Insert the event in our events table.
@@ -84,24 +212,790 @@ NotifyStateChange(ReplicationState reportedState,
 	 * provided strings formationId and nodeName, we include the length of the
 	 * string in the message. Parsing is then easier on the receiving side too.
 	 */
-	sprintf(payload,
-			"S:%s:%s:%lu.%s:%d:%ld:%lu.%s:%d",
-			ReplicationStateGetName(reportedState),
-			ReplicationStateGetName(goalState),
-			strlen(formationId),
-			formationId,
-			groupId,
-			nodeId,
-			strlen(nodeName),
-			nodeName,
-			nodePort);
-
-	Async_Notify(CHANNEL_STATE, payload);
+	snprintf(entry, sizeof(entry),
+			 "%ld:%s:%s:%lu.%s:%d:%ld:%lu.%s:%d",
+			 eventid,
+			 ReplicationStateGetName(reportedState),
+			 ReplicationStateGetName(goalState),
+			 strlen(formationId),
+			 formationId,
+			 groupId,
+			 nodeId,
+			 strlen(nodeName),
+			 nodeName,
+			 nodePort);
+
+	/* the notification is sent at commit, and wakes up node_active_wait */
+	if (!StateChangeCallbackRegistered)
+	{
+		RegisterXactCallback(StateChangeXactCallback, NULL);
+		RegisterSubXactCallback(StateChangeSubXactCallback, NULL);
+		StateChangeCallbackRegistered = true;
+	}
+
+	StateChangeNotified = true;
+
+	if (PendingStateNotification != NULL &&
+		PendingStateNotification->len + strlen(entry) + 1 >
+		STATE_NOTIFICATION_MAXLEN)
+	{
+		FlushStateNotification();
+	}
+
+	if (PendingStateNotification == NULL)
+	{
+		oldContext = MemoryContextSwitchTo(TopTransactionContext);
+
+		PendingStateNotification = makeStringInfo();
+		appendStringInfo(PendingStateNotification, "%d",
+						 STATE_NOTIFICATION_VERSION);
+
+		MemoryContextSwitchTo(oldContext);
+	}
+
+	appendStringInfo(PendingStateNotification, ";%s", entry);
 
 	return eventid;
 }
 
 
+/*
+ * FlushStateNotification sends the state changes of the current transaction
+ * that have not been sent yet. Postgres only delivers the notification when
+ * the transaction commits.
+ */
+static void
+FlushStateNotification(void)
+{
+	if (PendingStateNotification == NULL)
+	{
+		return;
+	}
+
+	Async_Notify(CHANNEL_STATE, PendingStateNotification->data);
+
+	pfree(PendingStateNotification->data);
+	pfree(PendingStateNotification);
+	PendingStateNotification = NULL;
+}
+
+
+/*
+ * StateChangeXactCallback sends the state changes of the transaction before
+ * it commits, and wakes up the backends waiting for a state change in the
+ * current database when the current transaction notified one. We do that at
+ * commit time only, so that the waiters can see the change.
+ */
+static void
+StateChangeXactCallback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+		{
+			/* Postgres queues the notifications right after this callback */
+			FlushStateNotification();
+			break;
+		}
+
+		case XACT_EVENT_COMMIT:
+		{
+			if (StateChangeNotified)
+			{
+				StateChangeNotified = false;
+				WakeStateChangeWaiters(MyDatabaseId);
+			}
+			PendingSubXactNotifications = NIL;
+			break;
+		}
+
+		case XACT_EVENT_ABORT:
+		{
+			/* the memory is gone with the transaction */
+			StateChangeNotified = false;
+			PendingStateNotification = NULL;
+			PendingSubXactNotifications = NIL;
+			break;
+		}
+
+		default:
+		{
+			/* nothing to do */
+			break;
+		}
+	}
+}
+
+
+/*
+ * StateChangeSubXactCallback makes sure that we don't notify the state changes
+ * of a subtransaction that is rolled back, such as a failed report in
+ * node_active_batch. When a subtransaction starts we keep a copy of the state
+ * changes that are still to be notified, and we go back to that copy when it
+ * is rolled back. Postgres forgets the notifications that we sent in the
+ * meantime, which were sent from the subtransaction.
+ */
+static void
+StateChangeSubXactCallback(SubXactEvent event, SubTransactionId mySubid,
+						   SubTransactionId parentSubid, void *arg)
+{
+	PendingSubXactNotification *pending = NULL;
+	MemoryContext oldContext = NULL;
+
+	switch (event)
+	{
+		case SUBXACT_EVENT_START_SUB:
+		{
+			oldContext = MemoryContextSwitchTo(TopTransactionContext);
+
+			pending = (PendingSubXactNotification *)
+				palloc0(sizeof(PendingSubXactNotification));
+			pending->subXactId = mySubid;
+
+			if (PendingStateNotification != NULL)
+			{
+				pending->pendingData = pstrdup(PendingStateNotification->data);
+			}
+
+			PendingSubXactNotifications =
+				lcons(pending, PendingSubXactNotifications);
+
+			MemoryContextSwitchTo(oldContext);
+			break;
+		}
+
+		case SUBXACT_EVENT_COMMIT_SUB:
+		case SUBXACT_EVENT_ABORT_SUB:
+		{
+			/* the subtransactions started within this one have ended */
+			while (PendingSubXactNotifications != NIL)
+			{
+				pending = (PendingSubXactNotification *)
+					linitial(PendingSubXactNotifications);
+
+				if (pending->subXactId < mySubid)
+				{
+					/* this subtransaction started before we registered */
+					pending = NULL;
+					break;
+				}
+
+				PendingSubXactNotifications =
+					list_delete_first(PendingSubXactNotifications);
+
+				if (pending->subXactId == mySubid)
+				{
+					break;
+				}
+
+				pending = NULL;
+			}
+
+			if (event == SUBXACT_EVENT_ABORT_SUB)
+			{
+				oldContext = MemoryContextSwitchTo(TopTransactionContext);
+
+				/* without a copy, all the pending state changes are ours */
+				PendingStateNotification = NULL;
+
+				if (pending != NULL && pending->pendingData != NULL)
+				{
+					PendingStateNotification = makeStringInfo();
+					appendStringInfoString(PendingStateNotification,
+										   pending->pendingData);
+				}
+
+				MemoryContextSwitchTo(oldContext);
+			}
+			break;
+		}
+
+		default:
+		{
+			/* nothing to do */
+			break;
+		}
+	}
+}
+
+
+/*
+ * InitializeStateChangeWaiters, called at server start, requests the shared
+ * memory used to wake up the backends waiting in node_active_wait.
+ */
+void
+InitializeStateChangeWaiters(void)
+{
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(sizeof(StateChangeWaiterControlData));
+	}
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = StateChangeWaiterShmemInit;
+}
+
+
+/*
+ * StateChangeWaiterShmemInit initializes the shared memory used to wake up
+ * the backends waiting in node_active_wait.
+ */
+static void
+StateChangeWaiterShmemInit(void)
+{
+	bool alreadyInitialized = false;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	StateChangeWaiterControl =
+		(StateChangeWaiterControlData *)
+		ShmemInitStruct("pg_auto_failover State Change Waiters",
+						sizeof(StateChangeWaiterControlData),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		memset(StateChangeWaiterControl, 0, sizeof(StateChangeWaiterControlData));
+
+		StateChangeWaiterControl->trancheId = LWLockNewTrancheId();
+		StateChangeWaiterControl->lockTrancheName =
+			"pg_auto_failover State Change Waiters";
+		LWLockRegisterTranche(StateChangeWaiterControl->trancheId,
+							  StateChangeWaiterControl->lockTrancheName);
+
+		LWLockInitialize(&StateChangeWaiterControl->lock,
+						 StateChangeWaiterControl->trancheId);
+
+		pg_atomic_init_u64(&StateChangeWaiterControl->stateChangeVersion, 0);
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * RegisterStateChangeWaiter registers the current backend as waiting for a
+ * state change in the current database, so that we set its latch when one is
+ * committed. It returns false when the backend could not be registered, in
+ * which case the caller should poll instead.
+ */
+bool
+RegisterStateChangeWaiter(void)
+{
+	int slot = 0;
+
+	if (StateChangeWaiterControl == NULL)
+	{
+		/* pg_auto_failover is not in shared_preload_libraries */
+		return false;
+	}
+
+	if (MyStateChangeWaiterSlot >= 0)
+	{
+		return true;
+	}
+
+	if (!StateChangeWaiterExitRegistered)
+	{
+		/* make sure we release our slot when the backend exits */
+		on_shmem_exit(StateChangeWaiterExit, (Datum) 0);
+		StateChangeWaiterExitRegistered = true;
+	}
+
+	LWLockAcquire(&StateChangeWaiterControl->lock, LW_EXCLUSIVE);
+
+	for (slot = 0; slot < MAX_STATE_CHANGE_WAITERS; slot++)
+	{
+		StateChangeWaiter *waiter = &(StateChangeWaiterControl->waiters[slot]);
+
+		if (waiter->pid == 0)
+		{
+			waiter->pid = MyProcPid;
+			waiter->dboid = MyDatabaseId;
+			waiter->latch = &(MyProc->procLatch);
+
+			MyStateChangeWaiterSlot = slot;
+			break;
+		}
+	}
+
+	LWLockRelease(&StateChangeWaiterControl->lock);
+
+	return MyStateChangeWaiterSlot >= 0;
+}
+
+
+/*
+ * UnregisterStateChangeWaiter releases the slot of the current backend, if
+ * any.
+ */
+void
+UnregisterStateChangeWaiter(void)
+{
+	StateChangeWaiter *waiter = NULL;
+
+	if (StateChangeWaiterControl == NULL || MyStateChangeWaiterSlot < 0)
+	{
+		return;
+	}
+
+	LWLockAcquire(&StateChangeWaiterControl->lock, LW_EXCLUSIVE);
+
+	waiter = &(StateChangeWaiterControl->waiters[MyStateChangeWaiterSlot]);
+	memset(waiter, 0, sizeof(StateChangeWaiter));
+
+	LWLockRelease(&StateChangeWaiterControl->lock);
+
+	MyStateChangeWaiterSlot = -1;
+}
+
+
+/*
+ * StateChangeWaiterExit is an on_shmem_exit callback that releases the slot
+ * of a backend that exits while waiting.
+ */
+static void
+StateChangeWaiterExit(int code, Datum arg)
+{
+	UnregisterStateChangeWaiter();
+}
+
+
+/*
+ * GetStateChangeVersion returns how many transactions that changed the state
+ * of a node have been committed since the monitor started, in any database,
+ * which tells readers of the node table whether their copy is up to date.
+ */
+uint64
+GetStateChangeVersion(void)
+{
+	if (StateChangeWaiterControl == NULL)
+	{
+		return 0;
+	}
+
+	return pg_atomic_read_u64(&StateChangeWaiterControl->stateChangeVersion);
+}
+
+
+/*
+ * WakeStateChangeWaiters sets the latch of all the backends waiting for a
+ * state change in the given database.
+ */
+static void
+WakeStateChangeWaiters(Oid databaseId)
+{
+	int slot = 0;
+
+	if (StateChangeWaiterControl == NULL)
+	{
+		return;
+	}
+
+	pg_atomic_fetch_add_u64(&StateChangeWaiterControl->stateChangeVersion, 1);
+
+	LWLockAcquire(&StateChangeWaiterControl->lock, LW_SHARED);
+
+	for (slot = 0; slot < MAX_STATE_CHANGE_WAITERS; slot++)
+	{
+		StateChangeWaiter *waiter = &(StateChangeWaiterControl->waiters[slot]);
+
+		if (waiter->pid != 0 && waiter->dboid == databaseId)
+		{
+			SetLatch(waiter->latch);
+		}
+	}
+
+	LWLockRelease(&StateChangeWaiterControl->lock);
+}
+
+
+/*
+ * InitializeEventWriters, called at server start, requests the shared memory
+ * used to keep track of the transactions that insert events, see
+ * EventHorizon.
+ */
+void
+InitializeEventWriters(void)
+{
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(sizeof(EventWriterControlData));
+	}
+
+	prev_event_writer_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = EventWriterShmemInit;
+}
+
+
+/*
+ * EventWriterShmemInit initializes the shared memory used to keep track of
+ * the transactions that insert events.
+ */
+static void
+EventWriterShmemInit(void)
+{
+	bool alreadyInitialized = false;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	EventWriterControl =
+		(EventWriterControlData *)
+		ShmemInitStruct("pg_auto_failover Event Writers",
+						sizeof(EventWriterControlData),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		memset(EventWriterControl, 0, sizeof(EventWriterControlData));
+
+		EventWriterControl->trancheId = LWLockNewTrancheId();
+		EventWriterControl->lockTrancheName = "pg_auto_failover Event Writers";
+		LWLockRegisterTranche(EventWriterControl->trancheId,
+							  EventWriterControl->lockTrancheName);
+
+		LWLockInitialize(&EventWriterControl->lock,
+						 EventWriterControl->trancheId);
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_event_writer_shmem_startup_hook != NULL)
+	{
+		prev_event_writer_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * next_eventid is the default value of the eventid column of the event
+ * table, see NextEventId.
+ */
+Datum
+next_eventid(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT64(NextEventId());
+}
+
+
+/*
+ * NextEventId takes the next eventid from the sequence of the event table.
+ *
+ * Transactions commit in a different order than they take their eventid, so
+ * a reader of the event table may see the event 12 before the event 11 is
+ * committed. Before taking an eventid, the current transaction registers the
+ * lowest eventid that it may take, so that EventHorizon can tell readers
+ * which events might still be committed, until the transaction ends.
+ */
+int64
+NextEventId(void)
+{
+	Oid sequenceId = pgAutoFailoverRelationId("event_eventid_seq");
+	int64 eventId = 0;
+
+	RegisterEventWriter();
+
+	eventId = nextval_internal(sequenceId, true);
+
+	if (EventWriterControl != NULL)
+	{
+		LWLockAcquire(&EventWriterControl->lock, LW_EXCLUSIVE);
+
+		if (eventId > EventWriterControl->lastEventId)
+		{
+			EventWriterControl->lastEventId = eventId;
+		}
+
+		LWLockRelease(&EventWriterControl->lock);
+	}
+
+	return eventId;
+}
+
+
+/*
+ * RegisterEventWriter registers the current transaction as taking an eventid,
+ * unless it did already. The sequence gives a higher eventid than the ones it
+ * gave before, so the transaction may only take an eventid above the highest
+ * one taken so far. When all the slots are used, the transaction is counted
+ * with the other ones that found no slot.
+ */
+static void
+RegisterEventWriter(void)
+{
+	int slot = 0;
+	int64 lowestEventId = 0;
+
+	if (EventWriterControl == NULL)
+	{
+		/* pg_auto_failover is not in shared_preload_libraries */
+		return;
+	}
+
+	if (MyEventWriterSlot >= 0 || MyEventWriterOverflow)
+	{
+		return;
+	}
+
+	if (!EventWriterCallbacksRegistered)
+	{
+		RegisterXactCallback(EventWriterXactCallback, NULL);
+
+		/* make sure we release our slot when the backend exits */
+		on_shmem_exit(EventWriterExit, (Datum) 0);
+
+		EventWriterCallbacksRegistered = true;
+	}
+
+	LWLockAcquire(&EventWriterControl->lock, LW_EXCLUSIVE);
+
+	lowestEventId = EventWriterControl->lastEventId + 1;
+
+	for (slot = 0; slot < MAX_EVENT_WRITERS; slot++)
+	{
+		EventWriter *writer = &(EventWriterControl->writers[slot]);
+
+		if (writer->pid == 0)
+		{
+			writer->pid = MyProcPid;
+			writer->dboid = MyDatabaseId;
+			writer->lowestEventId = lowestEventId;
+
+			MyEventWriterSlot = slot;
+			break;
+		}
+	}
+
+	if (MyEventWriterSlot < 0)
+	{
+		if (EventWriterControl->overflowCount == 0 ||
+			lowestEventId < EventWriterControl->overflowEventId)
+		{
+			EventWriterControl->overflowEventId = lowestEventId;
+		}
+
+		EventWriterControl->overflowCount++;
+		MyEventWriterOverflow = true;
+	}
+
+	LWLockRelease(&EventWriterControl->lock);
+}
+
+
+/*
+ * ReleaseEventWriter releases the slot of the current transaction, if any.
+ */
+static void
+ReleaseEventWriter(void)
+{
+	if (EventWriterControl == NULL ||
+		(MyEventWriterSlot < 0 && !MyEventWriterOverflow))
+	{
+		return;
+	}
+
+	LWLockAcquire(&EventWriterControl->lock, LW_EXCLUSIVE);
+
+	if (MyEventWriterSlot >= 0)
+	{
+		EventWriter *writer = &(EventWriterControl->writers[MyEventWriterSlot]);
+
+		memset(writer, 0, sizeof(EventWriter));
+	}
+	else if (--EventWriterControl->overflowCount == 0)
+	{
+		EventWriterControl->overflowEventId = 0;
+	}
+
+	LWLockRelease(&EventWriterControl->lock);
+
+	MyEventWriterSlot = -1;
+	MyEventWriterOverflow = false;
+}
+
+
+/*
+ * EventWriterXactCallback releases the slot of the current transaction when
+ * it ends. Postgres calls us once the transaction is visible as committed, so
+ * that a reader that sees the slot released also sees the events, or finds
+ * them in the event buffer.
+ */
+static void
+EventWriterXactCallback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_PREPARE:
+		{
+			if (MyEventWriterSlot >= 0 || MyEventWriterOverflow)
+			{
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot prepare a transaction that has "
+								"inserted pg_auto_failover events")));
+			}
+			break;
+		}
+
+		case XACT_EVENT_COMMIT:
+		{
+			CommitBufferedEvents();
+			ReleaseEventWriter();
+			break;
+		}
+
+		case XACT_EVENT_ABORT:
+		{
+			ReleaseEventWriter();
+			break;
+		}
+
+		default:
+		{
+			/* nothing to do */
+			break;
+		}
+	}
+}
+
+
+/*
+ * EventWriterExit is an on_shmem_exit callback that releases the slot of a
+ * backend that exits in the middle of a transaction.
+ */
+static void
+EventWriterExit(int code, Datum arg)
+{
+	ReleaseEventWriter();
+}
+
+
+/*
+ * event_horizon returns the eventid below which readers of the event table
+ * see all the events that will ever be committed, see EventHorizon.
+ */
+Datum
+event_horizon(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT64(EventHorizon());
+}
+
+
+/*
+ * EventHorizon returns the lowest eventid that a transaction in progress in
+ * the current database may have taken, or that the event buffer still has to
+ * insert. Otherwise, that's the eventid after the last one the sequence gave,
+ * which the transactions that register later are above of.
+ *
+ * The caller must take its snapshot after we return: the events below the
+ * horizon are then either visible or rolled back. A reader that keeps its
+ * snapshot for the whole transaction can't use the horizon.
+ */
+int64
+EventHorizon(void)
+{
+	int64 horizon = 0;
+	int64 oldestBufferedEventId = 0;
+	int slot = 0;
+
+	if (IsolationUsesXactSnapshot())
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot read the events after a given eventid "
+						"in a transaction using REPEATABLE READ or "
+						"SERIALIZABLE"),
+				 errhint("Use the READ COMMITTED isolation level.")));
+	}
+
+	if (EventWriterControl == NULL)
+	{
+		/* pg_auto_failover is not in shared_preload_libraries */
+		return PG_INT64_MAX;
+	}
+
+	/* read the sequence first, the eventids taken later are higher */
+	horizon = LastEventIdOfSequence() + 1;
+
+	LWLockAcquire(&EventWriterControl->lock, LW_SHARED);
+
+	for (slot = 0; slot < MAX_EVENT_WRITERS; slot++)
+	{
+		EventWriter *writer = &(EventWriterControl->writers[slot]);
+
+		if (writer->pid != 0 && writer->dboid == MyDatabaseId &&
+			writer->lowestEventId < horizon)
+		{
+			horizon = writer->lowestEventId;
+		}
+	}
+
+	/* we don't know the database of the writers that have no slot */
+	if (EventWriterControl->overflowCount > 0 &&
+		EventWriterControl->overflowEventId < horizon)
+	{
+		horizon = EventWriterControl->overflowEventId;
+	}
+
+	LWLockRelease(&EventWriterControl->lock);
+
+	/* a committed writer copies its events to the buffer before it leaves */
+	oldestBufferedEventId = OldestBufferedEventId();
+
+	if (oldestBufferedEventId < horizon)
+	{
+		horizon = oldestBufferedEventId;
+	}
+
+	return horizon;
+}
+
+
+/*
+ * LastEventIdOfSequence returns the last eventid that the sequence of the
+ * event table gave, or the one before its first value when it gave none.
+ */
+static int64
+LastEventIdOfSequence(void)
+{
+	const char *selectQuery =
+		"SELECT CASE WHEN is_called THEN last_value ELSE last_value - 1 END "
+		"  FROM " AUTO_FAILOVER_EVENT_TABLE "_eventid_seq";
+
+	int spiStatus = 0;
+	int64 lastEventId = 0;
+
+	SPI_connect();
+
+	spiStatus = SPI_execute(selectQuery, true, 1);
+
+	if (spiStatus == SPI_OK_SELECT && SPI_processed > 0)
+	{
+		bool isNull = false;
+		Datum lastEventIdDatum = SPI_getbinval(SPI_tuptable->vals[0],
+											   SPI_tuptable->tupdesc,
+											   1,
+											   &isNull);
+
+		lastEventId = DatumGetInt64(lastEventIdDatum);
+	}
+	else
+	{
+		elog(ERROR, "could not read the sequence of "
+			 AUTO_FAILOVER_EVENT_TABLE);
+	}
+
+	SPI_finish();
+
+	return lastEventId;
+}
+
+
 /*
  * InsertEvent populates the monitor's pgautofailover.event table with a new
  * entry, and returns the id of the new event.
@@ -148,6 +1042,7 @@ InsertEvent(const char *formationId, int groupId, int64 nodeId,
 	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
 	int spiStatus = 0;
 	int64 eventId = 0;
+	WriteUsage writeUsage;
 
 	const char *insertQuery =
 		"INSERT INTO " AUTO_FAILOVER_EVENT_TABLE
@@ -155,11 +1050,23 @@ InsertEvent(const char *formationId, int groupId, int64 nodeId,
 		" reportedstate, goalstate, reportedrepstate, reportedlsn, description) "
 		"VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10) RETURNING eventid";
 
+	/* the health check worker inserts the buffered events later */
+	if (BufferEvent(formationId, groupId, nodeId, nodeName, nodePort,
+					reportedState, goalState, pgsrSyncState, reportedLSN,
+					description, &eventId))
+	{
+		return eventId;
+	}
+
 	SPI_connect();
 
+	WriteUsageStart(&writeUsage);
+
 	spiStatus = SPI_execute_with_args(insertQuery, argCount, argTypes,
 									  argValues, NULL, false, 0);
 
+	WriteUsageEnd(WRITE_INSERT_EVENT, &writeUsage);
+
 	if (spiStatus == SPI_OK_INSERT_RETURNING && SPI_processed > 0)
 	{
 		bool isNull = false;
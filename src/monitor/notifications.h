@@ -35,6 +35,22 @@
 #define CHANNEL_LOG			"log"
 #define BUFSIZE				8192
 
+/*
+ * The state changes of a transaction are sent in a single notification at
+ * commit, which payload is the version of its format followed by an entry per
+ * state change, separated by semicolons:
+ *
+ *   2;<eventid>:<reported>:<goal>:<len>.<formation>:<group>:<nodeid>:<len>.<nodename>:<port>;...
+ *
+ * Strings are prefixed with their length, so that they need no escaping. A
+ * transaction with more state changes than fit in a notification payload
+ * sends several notifications.
+ */
+#define STATE_NOTIFICATION_VERSION 2
+
+/* Postgres limits notification payloads to a little less than 8000 bytes */
+#define STATE_NOTIFICATION_MAXLEN 7900
+
 
 void LogAndNotifyMessage(char *message, size_t size, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
 
@@ -57,3 +73,12 @@ int64 InsertEvent(const char *formationId, int groupId, int64 nodeId,
 				  SyncState pgsrSyncState,
 				  XLogRecPtr reportedLSN,
 				  char *description);
+
+void InitializeStateChangeWaiters(void);
+bool RegisterStateChangeWaiter(void);
+void UnregisterStateChangeWaiter(void);
+uint64 GetStateChangeVersion(void);
+
+void InitializeEventWriters(void);
+int64 NextEventId(void);
+int64 EventHorizon(void);
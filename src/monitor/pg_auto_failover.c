@@ -13,9 +13,14 @@
 #include "postgres.h"
 
 /* these are internal headers */
+#include "event_buffer.h"
+#include "function_stats.h"
 #include "health_check.h"
+#include "http_api.h"
 #include "group_state_machine.h"
 #include "metadata.h"
+#include "node_metadata.h"
+#include "notifications.h"
 #include "version_compat.h"
 
 /* these are always necessary for a bgworker */
@@ -106,6 +111,29 @@ StartMonitorNode(void)
 							NULL, &HealthCheckRetryDelay, 2 * 1000, 1, INT_MAX,
 							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
 
+	DefineCustomBoolVariable("pgautofailover.health_check_persistent_connections",
+							 "Keep health check connections opened between checks.",
+							 NULL, &HealthCheckPersistentConnections, false,
+							 PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.health_check_workers",
+							"Number of health check workers per monitor database.",
+							NULL, &HealthCheckWorkers, 1, 1, MAX_HEALTH_CHECK_WORKERS,
+							PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomRealVariable("pgautofailover.health_check_phi_threshold",
+							 "Check nodes at a faster pace when the suspicion "
+							 "level of their keeper reports reaches this value, "
+							 "0 disables adaptive health checks.",
+							 NULL, &HealthCheckPhiThreshold, 0.0, 0.0, 1000.0,
+							 PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.health_check_max_backoff",
+							"Maximum number of health check periods between "
+							"two checks of a healthy node.",
+							NULL, &HealthCheckMaxBackoff, 2, 1, 100,
+							PGC_SIGHUP, 0, NULL, NULL, NULL);
+
 	DefineCustomIntVariable("pgautofailover.enable_sync_wal_log_threshold",
 							"Don't enable synchronous replication until secondary xlog"
 							" is within this many bytes of the primary's",
@@ -118,6 +146,26 @@ StartMonitorNode(void)
 							NULL, &PromoteXlogThreshold, DEFAULT_XLOG_SEG_SIZE, 1,
 							INT_MAX, PGC_SIGHUP, 0, NULL, NULL, NULL);
 
+	DefineCustomIntVariable("pgautofailover.sync_standby_lag_threshold",
+							"Disable synchronous replication when secondary xlog"
+							" stays behind the primary's by more than this many"
+							" bytes, 0 disables",
+							NULL, &SyncStandbyLagThreshold, 0, 0,
+							INT_MAX, PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.sync_standby_lag_timeout",
+							"Disable synchronous replication when secondary xlog"
+							" lags for this long",
+							NULL, &SyncStandbyLagTimeoutMs, 10 * 1000, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.wal_lag_smoothing_window",
+							"Average the replication lag of secondary nodes over"
+							" this long when deciding about synchronous"
+							" replication, 0 disables",
+							NULL, &WalLagSmoothingWindowMs, 5 * 1000, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
 	DefineCustomIntVariable("pgautofailover.primary_demote_timeout",
 							"Give the primary this long to drain before promoting the secondary",
 							NULL, &DrainTimeoutMs, 30 * 1000, 1, INT_MAX,
@@ -128,16 +176,80 @@ StartMonitorNode(void)
 							NULL, &UnhealthyTimeoutMs, 20 * 1000, 1, INT_MAX,
 							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
 
+	DefineCustomIntVariable("pgautofailover.event_retention",
+							"Delete the events older than this, 0 keeps all the events.",
+							NULL, &EventRetention, 0, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_S, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.event_buffer_size",
+							"Number of events kept in shared memory until the "
+							"health check worker inserts them, 0 inserts the "
+							"events at once.",
+							NULL, &EventBufferSize, 0, 0, 1024 * 1024,
+							PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.node_vacuum_interval",
+							"Check the dead rows of the node table this often, "
+							"0 disables.",
+							NULL, &NodeVacuumInterval, 10 * 1000, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.node_vacuum_threshold",
+							"Vacuum the node table once it has that many dead "
+							"rows, 0 leaves it to autovacuum.",
+							NULL, &NodeVacuumThreshold, 100, 0, INT_MAX,
+							PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.node_report_flush_interval",
+							"Write the reports of nodes in a stable state to the "
+							"node table at most this often.",
+							NULL, &NodeReportFlushInterval, 10 * 1000, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.node_active_max_concurrency",
+							"Maximum number of node_active calls that run the "
+							"group state machine at the same time, 0 means "
+							"no limit.",
+							NULL, &NodeActiveMaxConcurrency, 0, 0, INT_MAX,
+							PGC_SIGHUP, 0, NULL, NULL, NULL);
+
 	DefineCustomIntVariable("pgautofailover.startup_grace_period",
 							"Wait for at least this much time after startup before "
 							"initiating a failover.",
 							NULL, &StartupGracePeriodMs, 10 * 1000, 1, INT_MAX,
 							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
 
+	DefineCustomBoolVariable("pgautofailover.track_write_usage",
+							 "Account for the WAL and buffers that the writes "
+							 "of the monitor use.",
+							 NULL, &TrackWriteUsage, false, PGC_SUSET,
+							 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.http_api_port",
+							"Serve the state of the nodes as JSON over HTTP on "
+							"this port, 0 disables.",
+							NULL, &HttpApiPort, 0, 0, 65535,
+							PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("pgautofailover.http_api_listen_address",
+							   "Address the HTTP API listens on.",
+							   NULL, &HttpApiListenAddress, "127.0.0.1",
+							   PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("pgautofailover.http_api_database",
+							   "Database of the monitor that the HTTP API "
+							   "serves the state of.",
+							   NULL, &HttpApiDatabase, "pg_auto_failover",
+							   PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
 	PreviousProcessUtility_hook = ProcessUtility_hook;
 	ProcessUtility_hook = pgautofailover_ProcessUtility;
 
 	InitializeHealthCheckWorker();
+	InitializeStateChangeWaiters();
+	InitializeEventWriters();
+	InitializeFunctionStats();
+	InitializeEventBuffer();
 
 	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
 	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
@@ -149,6 +261,8 @@ StartMonitorNode(void)
 	sprintf(worker.bgw_function_name, "HealthCheckWorkerLauncherMain");
 
 	RegisterBackgroundWorker(&worker);
+
+	RegisterHttpApiWorker();
 }
 
 
@@ -184,6 +298,12 @@ pgautofailover_ProcessUtility(PlannedStmt *pstmt,
 			StopHealthCheckWorker(databaseOid);
 		}
 	}
+	else if (IsA(parsetree, DropStmt) &&
+			 ((DropStmt *) parsetree)->removeType == OBJECT_EXTENSION)
+	{
+		/* the nodes of a dropped pgautofailover extension are gone too */
+		RegisterNodeRegistryInvalidation();
+	}
 
 	if (PreviousProcessUtility_hook)
 	{
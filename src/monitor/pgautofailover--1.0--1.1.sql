@@ -0,0 +1,1289 @@
+--
+-- extension update file from 1.0 to 1.1
+--
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pgautofailover UPDATE TO 1.1" to load this file. \quit
+
+CREATE FUNCTION pgautofailover.invalidate_node_registry()
+  RETURNS trigger
+  LANGUAGE C
+AS 'MODULE_PATHNAME', $$invalidate_node_registry$$;
+
+comment on function pgautofailover.invalidate_node_registry()
+        is 'notifies the health check workers that the list of nodes has changed';
+
+CREATE TRIGGER invalidate_node_registry
+	AFTER INSERT OR DELETE OR UPDATE OF formationid, groupid, nodename, nodeport
+	ON pgautofailover.node
+	FOR EACH STATEMENT
+	EXECUTE PROCEDURE pgautofailover.invalidate_node_registry();
+
+CREATE TRIGGER invalidate_node_registry_truncate
+	AFTER TRUNCATE
+	ON pgautofailover.node
+	FOR EACH STATEMENT
+	EXECUTE PROCEDURE pgautofailover.invalidate_node_registry();
+
+
+CREATE FUNCTION pgautofailover.health_check_stats
+ (
+   OUT nodename           text,
+   OUT nodeport           int,
+   OUT checks             bigint,
+   OUT unhealthy_checks   bigint,
+   OUT retries            bigint,
+   OUT timeouts           bigint,
+   OUT last_latency_ms    double precision,
+   OUT max_latency_ms     double precision,
+   OUT mean_latency_ms    double precision,
+   OUT latency_histogram  bigint[],
+   OUT last_check_time    timestamptz
+ )
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$health_check_stats$$;
+
+comment on function pgautofailover.health_check_stats()
+        is 'health check counters and connection latencies of each node';
+
+grant execute on function pgautofailover.health_check_stats()
+   to autoctl_node;
+
+
+CREATE FUNCTION pgautofailover.node_active_wait
+ (
+    IN formation_id           text,
+    IN node_name              text,
+    IN node_port              int,
+    IN current_node_id        int default -1,
+    IN current_group_id       int default -1,
+    IN current_group_role     pgautofailover.replication_state default 'init',
+    IN current_pg_is_running  bool default true,
+    IN current_lsn            pg_lsn default '0/0',
+    IN current_rep_state      text default '',
+    IN timeout                int default 5000,
+   OUT assigned_node_id       int,
+   OUT assigned_group_id      int,
+   OUT assigned_group_state   pgautofailover.replication_state
+ )
+RETURNS record LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$node_active_wait$$;
+
+comment on function pgautofailover.node_active_wait(text,text,int,int,int,
+                          pgautofailover.replication_state,bool,pg_lsn,text,int)
+        is 'waits for up to timeout ms for a new goal state, then calls node_active';
+
+grant execute on function
+      pgautofailover.node_active_wait(text,text,int,int,int,
+                          pgautofailover.replication_state,bool,pg_lsn,text,int)
+   to autoctl_node;
+
+
+CREATE FUNCTION pgautofailover.node_active_peers
+ (
+    IN formation_id           text,
+    IN node_name              text,
+    IN node_port              int,
+    IN current_node_id        int default -1,
+    IN current_group_id       int default -1,
+    IN current_group_role     pgautofailover.replication_state default 'init',
+    IN current_pg_is_running  bool default true,
+    IN current_lsn            pg_lsn default '0/0',
+    IN current_rep_state      text default '',
+    IN timeout                int default 0,
+   OUT assigned_node_id       int,
+   OUT assigned_group_id      int,
+   OUT assigned_group_state   pgautofailover.replication_state,
+   OUT other_node_name        text,
+   OUT other_node_port        int,
+   OUT other_node_lsn         pg_lsn,
+   OUT other_node_health      int,
+   OUT primary_node_name      text,
+   OUT primary_node_port      int,
+   OUT synchronous_commit     text,
+   OUT other_node_id          int,
+   OUT upstream_node_name     text,
+   OUT upstream_node_port     int,
+   OUT synchronous_standby_names text
+ )
+RETURNS record LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$node_active_peers$$;
+
+comment on function pgautofailover.node_active_peers(text,text,int,int,int,
+                          pgautofailover.replication_state,bool,pg_lsn,text,int)
+        is 'node_active_wait, and then the other node, the primary, the commit level of the group, the upstream node and the synchronous standbys';
+
+grant execute on function
+      pgautofailover.node_active_peers(text,text,int,int,int,
+                          pgautofailover.replication_state,bool,pg_lsn,text,int)
+   to autoctl_node;
+
+
+CREATE FUNCTION pgautofailover.invalidate_formation_cache()
+  RETURNS trigger
+  LANGUAGE C
+AS 'MODULE_PATHNAME', $$invalidate_formation_cache$$;
+
+comment on function pgautofailover.invalidate_formation_cache()
+        is 'resets the formation cache of the monitor backends';
+
+CREATE TRIGGER invalidate_formation_cache
+	AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE
+	ON pgautofailover.formation
+	FOR EACH STATEMENT
+	EXECUTE PROCEDURE pgautofailover.invalidate_formation_cache();
+
+
+CREATE TYPE pgautofailover.node_report AS
+ (
+    formation_id           text,
+    node_name              text,
+    node_port              int,
+    current_node_id        int,
+    current_group_id       int,
+    current_group_role     pgautofailover.replication_state,
+    current_pg_is_running  bool,
+    current_lsn            pg_lsn,
+    current_rep_state      text
+ );
+
+comment on type pgautofailover.node_report
+        is 'the arguments of a node_active call, for node_active_batch';
+
+CREATE FUNCTION pgautofailover.node_active_batch
+ (
+    IN node_reports           pgautofailover.node_report[],
+   OUT node_name              text,
+   OUT node_port              int,
+   OUT assigned_node_id       int,
+   OUT assigned_group_id      int,
+   OUT assigned_group_state   pgautofailover.replication_state,
+   OUT error                  text
+ )
+RETURNS SETOF record LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$node_active_batch$$;
+
+comment on function pgautofailover.node_active_batch(pgautofailover.node_report[])
+        is 'calls node_active for each of the given node reports, and returns the error of the reports that failed';
+
+grant execute on function
+      pgautofailover.node_active_batch(pgautofailover.node_report[])
+   to autoctl_node;
+
+CREATE INDEX event_formationid_groupid_eventid_idx
+          ON pgautofailover.event (formationid, groupid, eventid);
+
+CREATE INDEX event_formationid_eventid_idx
+          ON pgautofailover.event (formationid, eventid);
+
+CREATE INDEX node_formationid_groupid_nodeid_idx
+          ON pgautofailover.node (formationid, groupid, nodeid);
+
+CREATE FUNCTION pgautofailover.next_eventid()
+RETURNS bigint LANGUAGE C
+AS 'MODULE_PATHNAME', $$next_eventid$$;
+
+comment on function pgautofailover.next_eventid()
+        is 'take the next eventid, and keep track of it until the transaction ends';
+
+ALTER TABLE pgautofailover.event
+      ALTER COLUMN eventid SET DEFAULT pgautofailover.next_eventid();
+
+GRANT SELECT ON pgautofailover.event_eventid_seq TO autoctl_node;
+
+CREATE FUNCTION pgautofailover.event_horizon()
+RETURNS bigint LANGUAGE C
+AS 'MODULE_PATHNAME', $$event_horizon$$;
+
+comment on function pgautofailover.event_horizon()
+        is 'get the lowest eventid that a transaction in progress may still commit';
+
+CREATE FUNCTION pgautofailover.last_events_since
+ (
+  formation_id  text,
+  group_id      int,
+  after_eventid bigint,
+  count         int default 10
+ )
+RETURNS SETOF pgautofailover.event LANGUAGE plpgsql STRICT
+AS $$
+declare
+    horizon bigint;
+begin
+    -- the events from the horizon on are returned by a later call, once the
+    -- transactions that may commit events before them are done
+    horizon := pgautofailover.event_horizon();
+
+    return query
+        select eventid, eventtime, formationid,
+               nodeid, groupid, nodename, nodeport,
+               reportedstate, goalstate,
+               reportedrepstate, reportedlsn, description
+          from pgautofailover.event
+         where formationid = formation_id
+           and groupid = group_id
+           and eventid > after_eventid
+           and eventid < horizon
+      order by eventid
+         limit count;
+end;
+$$;
+
+comment on function pgautofailover.last_events_since(text,int,bigint,int)
+        is 'retrieve up to COUNT events of given formation and group after given eventid';
+
+ALTER TABLE pgautofailover.node
+  ADD COLUMN candidatepriority int not null default 100
+             check (candidatepriority between 0 and 100);
+
+CREATE FUNCTION pgautofailover.set_node_candidate_priority
+ (
+   node_name          text,
+   node_port          int,
+   candidate_priority int
+ )
+RETURNS bool LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$set_node_candidate_priority$$;
+
+comment on function pgautofailover.set_node_candidate_priority(text,int,int)
+        is 'set the failover candidate priority of a node, 0 means never promote';
+
+CREATE FUNCTION pgautofailover.perform_switchover
+ (
+  formation_id text default 'default',
+  group_id     int  default 0
+ )
+RETURNS void LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$perform_switchover$$;
+
+comment on function pgautofailover.perform_switchover(text,int)
+        is 'switchover from a healthy primary to its secondary with minimal downtime';
+
+CREATE TABLE pgautofailover.transition_timing
+ (
+    timingid         bigserial not null,
+    timingtime       timestamptz not null default now(),
+    formationid      text not null,
+    nodeid           bigint not null,
+    groupid          int not null,
+    nodename         text not null,
+    nodeport         integer not null,
+    fromstate        pgautofailover.replication_state not null,
+    tostate          pgautofailover.replication_state not null,
+    succeeded        bool not null,
+    durationms       float8 not null,
+    spans            text,
+
+    PRIMARY KEY (timingid)
+ );
+
+CREATE INDEX transition_timing_nodeid_timingid_idx
+          ON pgautofailover.transition_timing (nodeid, timingid);
+
+GRANT SELECT ON pgautofailover.transition_timing TO autoctl_node;
+
+CREATE FUNCTION pgautofailover.report_transition_timings
+ (
+    IN node_name    text,
+    IN node_port    int,
+    IN from_state   pgautofailover.replication_state,
+    IN to_state     pgautofailover.replication_state,
+    IN succeeded    bool,
+    IN duration_ms  float8,
+    IN spans        text
+ )
+RETURNS bool LANGUAGE SQL STRICT SECURITY DEFINER
+SET search_path = pg_catalog, pgautofailover, pg_temp
+AS $$
+  with timing as
+  (
+    insert into pgautofailover.transition_timing
+           (formationid, nodeid, groupid, nodename, nodeport,
+            fromstate, tostate, succeeded, durationms, spans)
+    select formationid, nodeid, groupid, nodename, nodeport,
+           from_state, to_state, succeeded, duration_ms, spans
+      from pgautofailover.node
+     where nodename = node_name
+       and nodeport = node_port
+ returning timingid
+  )
+  select count(*) > 0 from timing;
+$$;
+
+comment on function pgautofailover.report_transition_timings(text,int,pgautofailover.replication_state,pgautofailover.replication_state,bool,float8,text)
+        is 'record how long the steps of a state transition of a node took';
+
+grant execute on function
+      pgautofailover.report_transition_timings(text,int,pgautofailover.replication_state,pgautofailover.replication_state,bool,float8,text)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.function_stats
+ (
+   OUT funcid             oid,
+   OUT calls              bigint,
+   OUT errors             bigint,
+   OUT total_time_ms      double precision,
+   OUT max_time_ms        double precision,
+   OUT lock_wait_time_ms  double precision,
+   OUT queries            bigint
+ )
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$function_stats$$;
+
+comment on function pgautofailover.function_stats()
+        is 'call counts and durations of the pgautofailover functions';
+
+grant execute on function pgautofailover.function_stats()
+   to autoctl_node;
+
+CREATE VIEW pgautofailover.stat_functions AS
+  SELECT stats.funcid,
+         stats.funcid::regprocedure AS funcname,
+         stats.calls,
+         stats.errors,
+         stats.total_time_ms,
+         stats.total_time_ms / nullif(stats.calls, 0) AS mean_time_ms,
+         stats.max_time_ms,
+         stats.lock_wait_time_ms,
+         stats.queries
+    FROM pgautofailover.function_stats() AS stats
+    JOIN pg_catalog.pg_proc ON pg_proc.oid = stats.funcid;
+
+comment on view pgautofailover.stat_functions
+        is 'call counts and durations of the pgautofailover functions';
+
+GRANT SELECT ON pgautofailover.stat_functions TO autoctl_node;
+
+CREATE FUNCTION pgautofailover.lag_history
+ (
+   OUT nodename             text,
+   OUT nodeport             int,
+   OUT sample_time          timestamptz,
+   OUT reported_lsn         pg_lsn,
+   OUT primary_lsn          pg_lsn,
+   OUT lag_bytes            bigint,
+   OUT health_check_rtt_ms  double precision
+ )
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$lag_history$$;
+
+comment on function pgautofailover.lag_history()
+        is 'last replication lag samples of each standby node';
+
+grant execute on function pgautofailover.lag_history()
+   to autoctl_node;
+
+CREATE VIEW pgautofailover.stat_catchup AS
+  WITH samples AS
+  (
+    SELECT h.nodename, h.nodeport, h.sample_time, h.reported_lsn, h.lag_bytes,
+           first_value(h.sample_time) OVER w AS first_sample_time,
+           first_value(h.reported_lsn) OVER w AS first_reported_lsn,
+           first_value(h.lag_bytes) OVER w AS first_lag_bytes,
+           row_number() OVER w_desc AS latest
+      FROM pgautofailover.lag_history() AS h
+    WINDOW w AS (PARTITION BY h.nodename, h.nodeport ORDER BY h.sample_time),
+           w_desc AS (PARTITION BY h.nodename, h.nodeport
+                          ORDER BY h.sample_time DESC)
+  ),
+  progress AS
+  (
+    SELECT samples.*,
+           nullif(extract(epoch FROM sample_time - first_sample_time), 0)
+             AS window_seconds
+      FROM samples
+     WHERE latest = 1
+  )
+  SELECT node.formationid,
+         node.groupid,
+         node.nodeid,
+         node.nodename,
+         node.nodeport,
+         progress.lag_bytes,
+         progress.window_seconds,
+         (progress.reported_lsn - progress.first_reported_lsn)
+           / progress.window_seconds AS replay_bytes_per_second,
+         (progress.first_lag_bytes - progress.lag_bytes)
+           / progress.window_seconds AS catchup_bytes_per_second,
+         CASE WHEN progress.first_lag_bytes > progress.lag_bytes
+              THEN greatest(progress.lag_bytes
+                            - current_setting('pgautofailover.enable_sync_wal_log_threshold')::bigint,
+                            0)
+                   / ((progress.first_lag_bytes - progress.lag_bytes)
+                      / progress.window_seconds)
+          END AS seconds_to_secondary
+    FROM progress
+    JOIN pgautofailover.node
+   USING (nodename, nodeport)
+   WHERE node.reportedstate = 'catchingup';
+
+comment on view pgautofailover.stat_catchup
+        is 'how fast the catchingup standby nodes catch up with their primary';
+
+GRANT SELECT ON pgautofailover.stat_catchup TO autoctl_node;
+
+CREATE FUNCTION pgautofailover.write_stats
+ (
+   OUT operation            text,
+   OUT calls                bigint,
+   OUT wal_calls            bigint,
+   OUT wal_bytes            bigint,
+   OUT shared_blks_hit      bigint,
+   OUT shared_blks_read     bigint,
+   OUT shared_blks_dirtied  bigint,
+   OUT shared_blks_written  bigint,
+   OUT tuples_updated       bigint,
+   OUT tuples_hot_updated   bigint
+ )
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$write_stats$$;
+
+comment on function pgautofailover.write_stats()
+        is 'WAL and buffer usage of the writes of the monitor';
+
+grant execute on function pgautofailover.write_stats()
+   to autoctl_node;
+
+CREATE VIEW pgautofailover.stat_writes AS
+  SELECT stats.operation,
+         stats.calls,
+         stats.wal_calls,
+         stats.wal_bytes,
+         stats.wal_bytes / nullif(stats.wal_calls, 0) AS mean_wal_bytes,
+         stats.shared_blks_hit,
+         stats.shared_blks_read,
+         stats.shared_blks_dirtied,
+         stats.shared_blks_written,
+         stats.tuples_updated,
+         stats.tuples_hot_updated,
+         stats.tuples_updated - stats.tuples_hot_updated
+           AS tuples_non_hot_updated
+    FROM pgautofailover.write_stats() AS stats;
+
+comment on view pgautofailover.stat_writes
+        is 'WAL and buffer usage of the writes of the monitor';
+
+GRANT SELECT ON pgautofailover.stat_writes TO autoctl_node;
+
+CREATE FUNCTION pgautofailover.events_since
+ (
+  event_id bigint,
+  count    int default 1000
+ )
+RETURNS SETOF pgautofailover.event LANGUAGE plpgsql STRICT
+AS $$
+declare
+    horizon bigint;
+begin
+    -- see last_events_since, the horizon must be read before our snapshot
+    horizon := pgautofailover.event_horizon();
+
+    return query
+        select eventid, eventtime, formationid,
+               nodeid, groupid, nodename, nodeport,
+               reportedstate, goalstate,
+               reportedrepstate, reportedlsn, description
+          from pgautofailover.event
+         where eventid > event_id
+           and eventid < horizon
+      order by eventid
+         limit count;
+end;
+$$;
+
+comment on function pgautofailover.events_since(bigint,int)
+        is 'retrieve the first COUNT events after the given event id';
+
+grant execute on function pgautofailover.events_since(bigint,int)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.formation_uri
+ (
+    IN formation_id         text,
+    IN role                 text,
+    IN max_lag              bigint DEFAULT NULL,
+    IN load_balance_hosts   bool DEFAULT true
+ )
+RETURNS text LANGUAGE plpgsql STRICT
+AS $$
+declare
+    uri_hosts      text;
+    uri_host_count int;
+    uri_dbname     name;
+    uri_params     text[] := '{}';
+begin
+    if role not in ('read-write', 'read-only', 'prefer-standby', 'any')
+    then
+        raise exception invalid_parameter_value
+          using
+            message = format('unknown role "%s"', role),
+               hint = 'role is one of read-write, read-only, '
+                      'prefer-standby or any';
+    end if;
+
+    -- a standby qualifies when it is a streaming secondary that the monitor
+    -- does not know to be unhealthy, and that is not lagging more than
+    -- max_lag bytes behind the writable node of its group
+      with nodes as
+      (
+        select node.nodename, node.nodeport, formation.dbname,
+               node.reportedstate in ('single', 'wait_primary', 'primary')
+           and node.goalstate in ('single', 'wait_primary', 'primary')
+               as writable,
+               node.reportedstate = 'secondary'
+           and node.goalstate = 'secondary'
+           and node.reportedpgisrunning
+           and node.health <> 0
+           and (max_lag is null
+                or pg_wal_lsn_diff(writer.reportedlsn,
+                                   node.reportedlsn) <= max_lag)
+               as standby
+          from pgautofailover.node as node
+               join pgautofailover.formation
+                 on formation.formationid = node.formationid
+               left join lateral
+               (
+                 select primarynode.reportedlsn
+                   from pgautofailover.node as primarynode
+                  where primarynode.formationid = node.formationid
+                    and primarynode.groupid = node.groupid
+                    and primarynode.goalstate
+                        in ('single', 'wait_primary', 'primary')
+                  limit 1
+               ) as writer on true
+         where node.formationid = formation_id
+           and node.groupid = 0
+      )
+    select string_agg(format('%s:%s', nodename, nodeport), ','
+                      order by not writable, nodename, nodeport),
+           count(*),
+           -- as we join formation on node we get the same dbname for all
+           -- entries, pick one.
+           min(dbname)
+      into uri_hosts, uri_host_count, uri_dbname
+      from nodes
+     where case role
+           when 'read-write' then true
+           when 'read-only' then standby
+           else writable or standby
+            end;
+
+    if uri_hosts is null
+    then
+        return null;
+    end if;
+
+    if role in ('read-write', 'prefer-standby')
+    then
+        uri_params := uri_params || format('target_session_attrs=%s', role);
+    end if;
+
+    if load_balance_hosts and uri_host_count > 1
+    then
+        uri_params := uri_params || 'load_balance_hosts=random'::text;
+    end if;
+
+    return format('postgres://%s/%s%s',
+                  uri_hosts,
+                  uri_dbname,
+                  case when cardinality(uri_params) > 0
+                       then '?' || array_to_string(uri_params, '&')
+                       else ''
+                   end);
+end;
+$$;
+
+comment on function pgautofailover.formation_uri(text,text,bigint,bool)
+        is 'get a connection string to the nodes of a formation that fit a role';
+
+CREATE FUNCTION pgautofailover.report_hook_result
+ (
+    IN node_name    text,
+    IN node_port    int,
+    IN hook_name    text,
+    IN from_state   pgautofailover.replication_state,
+    IN to_state     pgautofailover.replication_state,
+    IN succeeded    bool,
+    IN duration_ms  float8,
+    IN detail       text
+ )
+RETURNS bool LANGUAGE SQL STRICT SECURITY DEFINER
+SET search_path = pg_catalog, pgautofailover, pg_temp
+AS $$
+  with hook_event as
+  (
+    insert into pgautofailover.event
+           (formationid, nodeid, groupid, nodename, nodeport,
+            reportedstate, goalstate, reportedrepstate, reportedlsn,
+            description)
+    select formationid, nodeid, groupid, nodename, nodeport,
+           reportedstate, goalstate, reportedrepstate, reportedlsn,
+           format('The %s hook of the transition from "%s" to "%s" %s '
+                  'after %s ms: %s',
+                  hook_name, from_state, to_state,
+                  case when succeeded then 'succeeded' else 'failed' end,
+                  round(duration_ms::numeric, 3), detail)
+      from pgautofailover.node
+     where nodename = node_name
+       and nodeport = node_port
+ returning eventid
+  )
+  select count(*) > 0 from hook_event;
+$$;
+
+comment on function pgautofailover.report_hook_result(text,int,text,pgautofailover.replication_state,pgautofailover.replication_state,bool,float8,text)
+        is 'record the result of a hook that a node ran around a state transition';
+
+grant execute on function
+      pgautofailover.report_hook_result(text,int,text,pgautofailover.replication_state,pgautofailover.replication_state,bool,float8,text)
+   to autoctl_node;
+
+ALTER TABLE pgautofailover.node
+  ADD COLUMN slotretainedwal bigint;
+
+ALTER TABLE pgautofailover.node
+  ADD COLUMN walsource text check (walsource in ('stream', 'archive')),
+  ADD COLUMN archivelag bigint;
+
+CREATE FUNCTION pgautofailover.report_retained_wal
+ (
+    IN node_name          text,
+    IN node_port          int,
+    IN retained_wal_bytes bigint
+ )
+RETURNS bool LANGUAGE plpgsql SECURITY DEFINER
+SET search_path = pg_catalog, pgautofailover, pg_temp
+AS $$
+begin
+    update pgautofailover.node
+       set slotretainedwal = retained_wal_bytes
+     where nodename = node_name
+       and nodeport = node_port;
+
+    if not found
+    then
+        raise exception undefined_object
+              using message = format('node %s:%s is not registered',
+                                     node_name, node_port);
+    end if;
+
+    return true;
+end;
+$$;
+
+comment on function pgautofailover.report_retained_wal(text,int,bigint)
+        is 'record how much WAL the replication slot of a primary retains';
+
+grant execute on function pgautofailover.report_retained_wal(text,int,bigint)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.report_wal_source
+ (
+    IN node_name          text,
+    IN node_port          int,
+    IN wal_source         text,
+    IN archive_lag_bytes  bigint
+ )
+RETURNS bool LANGUAGE plpgsql SECURITY DEFINER
+SET search_path = pg_catalog, pgautofailover, pg_temp
+AS $$
+begin
+    update pgautofailover.node
+       set walsource = wal_source,
+           archivelag = archive_lag_bytes
+     where nodename = node_name
+       and nodeport = node_port;
+
+    if not found
+    then
+        raise exception undefined_object
+              using message = format('node %s:%s is not registered',
+                                     node_name, node_port);
+    end if;
+
+    return true;
+end;
+$$;
+
+comment on function pgautofailover.report_wal_source(text,int,text,bigint)
+        is 'record whether a standby streams or restores WAL, and the archive lag of a primary';
+
+grant execute on function pgautofailover.report_wal_source(text,int,text,bigint)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.get_other_nodes
+ (
+    IN node_name      text,
+    IN node_port      int,
+   OUT node_id        int,
+   OUT secondary_name text,
+   OUT secondary_port int,
+   OUT reported_lsn   pg_lsn
+ )
+RETURNS SETOF record LANGUAGE SQL STRICT
+AS $$
+  select other.nodeid, other.nodename, other.nodeport, other.reportedlsn
+    from pgautofailover.node as this
+         join pgautofailover.node as other
+           on other.formationid = this.formationid
+          and other.groupid = this.groupid
+          and other.nodeid <> this.nodeid
+   where this.nodename = node_name
+     and this.nodeport = node_port
+order by other.nodeid;
+$$;
+
+comment on function pgautofailover.get_other_nodes(text,int)
+        is 'get the other nodes in a group';
+
+grant execute on function pgautofailover.get_other_nodes(text,int)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.release_standby_slot
+ (
+    IN node_name          text,
+    IN node_port          int,
+    IN retained_wal_bytes bigint,
+    IN standby_node_id    int default -1
+ )
+RETURNS bool LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$release_standby_slot$$;
+
+comment on function pgautofailover.release_standby_slot(text,int,bigint,int)
+        is 'initialise a standby again after its primary released the WAL it retained';
+
+grant execute on function pgautofailover.release_standby_slot(text,int,bigint,int)
+   to autoctl_node;
+
+CREATE TABLE pgautofailover.delegated_formation
+ (
+    formationid      text not null,
+    monitoruri       text not null,
+    delegatedtime    timestamptz not null default now(),
+
+    PRIMARY KEY (formationid)
+ );
+
+GRANT SELECT ON pgautofailover.delegated_formation TO autoctl_node;
+
+CREATE FUNCTION pgautofailover.delegate_formation
+ (
+    IN formation_id text,
+    IN monitor_uri  text
+ )
+RETURNS void LANGUAGE plpgsql STRICT
+AS $$
+begin
+    if exists (select 1
+                 from pgautofailover.node
+                where formationid = formation_id)
+    then
+        raise exception object_in_use
+              using message = format('formation "%s" has nodes registered '
+                                     'on this monitor', formation_id),
+                    hint = 'Drop the nodes of the formation first, and '
+                           'create them again with the other monitor';
+    end if;
+
+    insert into pgautofailover.delegated_formation (formationid, monitoruri)
+         values (formation_id, monitor_uri)
+    on conflict (formationid)
+      do update set monitoruri = excluded.monitoruri,
+                    delegatedtime = now();
+end;
+$$;
+
+comment on function pgautofailover.delegate_formation(text,text)
+        is 'have the nodes of a formation register with another monitor';
+
+CREATE FUNCTION pgautofailover.undelegate_formation
+ (
+    IN formation_id text
+ )
+RETURNS bool LANGUAGE SQL STRICT
+AS $$
+  with deleted as
+  (
+    delete from pgautofailover.delegated_formation
+          where formationid = formation_id
+      returning formationid
+  )
+  select count(*) > 0 from deleted;
+$$;
+
+comment on function pgautofailover.undelegate_formation(text)
+        is 'have the nodes of a formation register with this monitor again';
+
+CREATE FUNCTION pgautofailover.formation_monitor
+ (
+    IN formation_id text
+ )
+RETURNS text LANGUAGE SQL STRICT
+AS $$
+  select monitoruri
+    from pgautofailover.delegated_formation
+   where formationid = formation_id;
+$$;
+
+comment on function pgautofailover.formation_monitor(text)
+        is 'get the URI of the monitor that a formation is delegated to';
+
+grant execute on function pgautofailover.formation_monitor(text)
+   to autoctl_node;
+
+CREATE TABLE pgautofailover.rolling_operation
+ (
+    operationid      bigserial not null,
+    formationid      text not null,
+    operation        text not null,
+    maxparallel      int not null,
+    starttime        timestamptz not null default now(),
+    endtime          timestamptz,
+
+    PRIMARY KEY (operationid),
+    CHECK (operation IN ('switchover', 'failover', 'maintenance')),
+    CHECK (maxparallel > 0)
+ );
+
+CREATE TABLE pgautofailover.rolling_operation_group
+ (
+    operationid      bigint not null,
+    groupid          int not null,
+    state            text not null default 'pending',
+    nodeid           bigint,
+    starttime        timestamptz,
+    endtime          timestamptz,
+    detail           text,
+
+    PRIMARY KEY (operationid, groupid),
+    FOREIGN KEY (operationid)
+     REFERENCES pgautofailover.rolling_operation(operationid)
+      ON DELETE CASCADE,
+    CHECK (state IN ('pending', 'running', 'ready', 'releasing',
+                     'done', 'failed'))
+ );
+
+GRANT SELECT ON pgautofailover.rolling_operation TO autoctl_node;
+GRANT SELECT ON pgautofailover.rolling_operation_group TO autoctl_node;
+
+CREATE FUNCTION pgautofailover.rolling_operation
+ (
+    IN formation_id text,
+    IN op           text,
+    IN max_parallel int default 1
+ )
+RETURNS bigint LANGUAGE plpgsql STRICT SECURITY DEFINER
+SET search_path = pg_catalog, pgautofailover, pg_temp
+AS $$
+declare
+    operation_id bigint;
+    group_count  int;
+begin
+    if op not in ('switchover', 'failover', 'maintenance')
+    then
+        raise exception invalid_parameter_value
+              using message = format('unknown rolling operation "%s"', op),
+                    hint = 'operation is one of switchover, failover '
+                           'or maintenance';
+    end if;
+
+    if max_parallel < 1
+    then
+        raise exception invalid_parameter_value
+              using message = 'max_parallel must be at least 1';
+    end if;
+
+    perform 1
+       from pgautofailover.rolling_operation
+      where formationid = formation_id
+        and endtime is null
+        for update;
+
+    if found
+    then
+        raise exception object_in_use
+              using message = format('formation "%s" already has a rolling '
+                                     'operation in progress', formation_id);
+    end if;
+
+    insert into pgautofailover.rolling_operation
+                (formationid, operation, maxparallel)
+         values (formation_id, op, max_parallel)
+      returning operationid into operation_id;
+
+    -- only the groups with a secondary node can switchover or failover
+    insert into pgautofailover.rolling_operation_group (operationid, groupid)
+         select operation_id, groupid
+           from pgautofailover.node
+          where formationid = formation_id
+       group by groupid
+         having count(*) = 2;
+
+    get diagnostics group_count = row_count;
+
+    if group_count = 0
+    then
+        raise exception object_not_in_prerequisite_state
+              using message = format('formation "%s" has no group with a '
+                                     'secondary node', formation_id);
+    end if;
+
+    perform pgautofailover.rolling_operation_step(operation_id);
+
+    return operation_id;
+end;
+$$;
+
+comment on function pgautofailover.rolling_operation(text,text,int)
+        is 'start an operation on every group of a formation, a few at a time';
+
+grant execute on function pgautofailover.rolling_operation(text,text,int)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.rolling_operation_step
+ (
+    IN  operation_id bigint,
+    OUT group_id     int,
+    OUT group_state  text,
+    OUT node_name    text,
+    OUT node_port    int,
+    OUT group_detail text
+ )
+RETURNS SETOF record LANGUAGE plpgsql STRICT SECURITY DEFINER
+SET search_path = pg_catalog, pgautofailover, pg_temp
+AS $$
+declare
+    op       pgautofailover.rolling_operation;
+    g        pgautofailover.rolling_operation_group;
+    target   pgautofailover.node;
+    inflight int;
+    newstate text;
+begin
+    select * into op
+      from pgautofailover.rolling_operation
+     where operationid = operation_id
+       for update;
+
+    if not found
+    then
+        raise exception undefined_object
+              using message = format('rolling operation %s does not exist',
+                                     operation_id);
+    end if;
+
+    if op.endtime is null
+    then
+        -- first, move the groups that converged to their next state
+        for g in
+            select *
+              from pgautofailover.rolling_operation_group rog
+             where rog.operationid = operation_id
+               and rog.state in ('running', 'releasing')
+        loop
+            select case
+                   when op.operation = 'maintenance' and g.state = 'running'
+                    and count(*) filter (where nodeid = g.nodeid
+                                           and reportedstate = 'maintenance'
+                                           and goalstate = 'maintenance') = 1
+                   then 'ready'
+
+                   when op.operation = 'maintenance' and g.state = 'releasing'
+                    and count(*) filter (where nodeid = g.nodeid
+                                           and reportedstate = 'secondary'
+                                           and goalstate = 'secondary') = 1
+                    and count(*) filter (where reportedstate = 'primary'
+                                           and goalstate = 'primary') = 1
+                   then 'done'
+
+                   when op.operation <> 'maintenance'
+                    and count(*) filter (where nodeid <> g.nodeid
+                                           and reportedstate = 'primary'
+                                           and goalstate = 'primary') = 1
+                    and count(*) filter (where reportedstate = 'secondary'
+                                           and goalstate = 'secondary') = 1
+                   then 'done'
+                    end
+              into newstate
+              from pgautofailover.node
+             where formationid = op.formationid
+               and groupid = g.groupid;
+
+            if newstate is not null
+            then
+                update pgautofailover.rolling_operation_group rog
+                   set state = newstate,
+                       endtime = case when newstate = 'done' then now() end
+                 where rog.operationid = operation_id
+                   and rog.groupid = g.groupid;
+            end if;
+        end loop;
+
+        select count(*) into inflight
+          from pgautofailover.rolling_operation_group rog
+         where rog.operationid = operation_id
+           and rog.state in ('running', 'ready', 'releasing');
+
+        -- then start pending groups, unless a group failed already
+        perform 1
+           from pgautofailover.rolling_operation_group rog
+          where rog.operationid = operation_id
+            and rog.state = 'failed';
+
+        if not found
+        then
+            for g in
+                select *
+                  from pgautofailover.rolling_operation_group rog
+                 where rog.operationid = operation_id
+                   and rog.state = 'pending'
+              order by rog.groupid
+                 limit greatest(op.maxparallel - inflight, 0)
+            loop
+                begin
+                    select * into target
+                      from pgautofailover.node
+                     where formationid = op.formationid
+                       and groupid = g.groupid
+                       and goalstate = case when op.operation = 'maintenance'
+                                            then 'secondary'::pgautofailover.replication_state
+                                            else 'primary'::pgautofailover.replication_state
+                                        end;
+
+                    if not found
+                    then
+                        raise exception object_not_in_prerequisite_state
+                              using message =
+                                    format('group %s has no node to %s',
+                                           g.groupid, op.operation);
+                    end if;
+
+                    if op.operation = 'maintenance'
+                    then
+                        perform pgautofailover.start_maintenance(target.nodename,
+                                                                 target.nodeport);
+                    elsif op.operation = 'switchover'
+                    then
+                        perform pgautofailover.perform_switchover(op.formationid,
+                                                                  g.groupid);
+                    else
+                        perform pgautofailover.perform_failover(op.formationid,
+                                                                g.groupid);
+                    end if;
+
+                    update pgautofailover.rolling_operation_group rog
+                       set state = 'running',
+                           nodeid = target.nodeid,
+                           starttime = now()
+                     where rog.operationid = operation_id
+                       and rog.groupid = g.groupid;
+
+                exception when others then
+                    update pgautofailover.rolling_operation_group rog
+                       set state = 'failed',
+                           endtime = now(),
+                           detail = sqlerrm
+                     where rog.operationid = operation_id
+                       and rog.groupid = g.groupid;
+
+                    exit;
+                end;
+            end loop;
+        end if;
+
+        -- the operation is over when nothing is in flight anymore
+        perform 1
+           from pgautofailover.rolling_operation_group rog
+          where rog.operationid = operation_id
+            and (rog.state in ('running', 'ready', 'releasing')
+                 or (rog.state = 'pending'
+                     and not exists
+                         (select 1
+                            from pgautofailover.rolling_operation_group f
+                           where f.operationid = operation_id
+                             and f.state = 'failed')));
+
+        if not found
+        then
+            update pgautofailover.rolling_operation ro
+               set endtime = now()
+             where ro.operationid = operation_id;
+        end if;
+    end if;
+
+    return query
+        select rog.groupid, rog.state, node.nodename, node.nodeport,
+               rog.detail
+          from pgautofailover.rolling_operation_group rog
+               left join pgautofailover.node on node.nodeid = rog.nodeid
+         where rog.operationid = operation_id
+      order by rog.groupid;
+end;
+$$;
+
+comment on function pgautofailover.rolling_operation_step(bigint)
+        is 'advance a rolling operation, and report the state of its groups';
+
+grant execute on function pgautofailover.rolling_operation_step(bigint)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.rolling_operation_release
+ (
+    IN operation_id bigint,
+    IN group_id     int
+ )
+RETURNS bool LANGUAGE plpgsql STRICT SECURITY DEFINER
+SET search_path = pg_catalog, pgautofailover, pg_temp
+AS $$
+declare
+    g      pgautofailover.rolling_operation_group;
+    target pgautofailover.node;
+begin
+    select * into g
+      from pgautofailover.rolling_operation_group rog
+     where rog.operationid = operation_id
+       and rog.groupid = group_id
+       for update;
+
+    if not found or g.state <> 'ready'
+    then
+        raise exception object_not_in_prerequisite_state
+              using message = format('group %s of rolling operation %s is '
+                                     'not in maintenance', group_id,
+                                     operation_id);
+    end if;
+
+    select * into target
+      from pgautofailover.node
+     where nodeid = g.nodeid;
+
+    perform pgautofailover.stop_maintenance(target.nodename, target.nodeport);
+
+    update pgautofailover.rolling_operation_group rog
+       set state = 'releasing'
+     where rog.operationid = operation_id
+       and rog.groupid = group_id;
+
+    return true;
+end;
+$$;
+
+comment on function pgautofailover.rolling_operation_release(bigint,int)
+        is 'have a node of a rolling maintenance leave the maintenance state';
+
+grant execute on function pgautofailover.rolling_operation_release(bigint,int)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.rolling_operation_cancel
+ (
+    IN operation_id bigint
+ )
+RETURNS bool LANGUAGE SQL STRICT SECURITY DEFINER
+SET search_path = pg_catalog, pgautofailover, pg_temp
+AS $$
+  with cancelled as
+  (
+    update pgautofailover.rolling_operation
+       set endtime = now()
+     where operationid = operation_id
+       and endtime is null
+ returning operationid
+  )
+  select count(*) > 0 from cancelled;
+$$;
+
+comment on function pgautofailover.rolling_operation_cancel(bigint)
+        is 'stop a rolling operation from starting any other group';
+
+grant execute on function pgautofailover.rolling_operation_cancel(bigint)
+   to autoctl_node;
+
+ALTER TABLE pgautofailover.formation
+  ADD COLUMN number_sync_standbys int not null default 1
+             check (number_sync_standbys >= 1);
+
+CREATE FUNCTION pgautofailover.set_formation_number_sync_standbys
+ (
+    IN formation_id          text,
+    IN number_sync_standbys  int
+ )
+RETURNS bool LANGUAGE SQL STRICT SECURITY DEFINER
+SET search_path = pg_catalog, pgautofailover, pg_temp
+AS $$
+  with updated as
+  (
+    update pgautofailover.formation
+       set number_sync_standbys = $2
+     where formationid = $1
+ returning formationid
+  )
+  select count(*) > 0 from updated;
+$$;
+
+comment on function pgautofailover.set_formation_number_sync_standbys(text,int)
+        is 'set how many standbys must confirm a commit in the groups of a formation';
+
+CREATE FUNCTION pgautofailover.synchronous_standby_names
+ (
+    IN formation_id  text default 'default',
+    IN group_id      int default 0
+ )
+RETURNS text LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$synchronous_standby_names$$;
+
+comment on function pgautofailover.synchronous_standby_names(text,int)
+        is 'the synchronous_standby_names setting for the primary of a group';
+
+grant execute on function pgautofailover.synchronous_standby_names(text,int)
+   to autoctl_node;
+
+ALTER TABLE pgautofailover.formation
+  ADD COLUMN synchronous_commit text not null default 'on'
+             check (synchronous_commit in ('remote_write', 'on',
+                                           'remote_apply'));
+
+CREATE FUNCTION pgautofailover.set_formation_synchronous_commit
+ (
+    IN formation_id        text,
+    IN synchronous_commit  text
+ )
+RETURNS bool LANGUAGE SQL STRICT SECURITY DEFINER
+SET search_path = pg_catalog, pgautofailover, pg_temp
+AS $$
+  with updated as
+  (
+    update pgautofailover.formation
+       set synchronous_commit = $2
+     where formationid = $1
+ returning formationid
+  )
+  select count(*) > 0 from updated;
+$$;
+
+comment on function pgautofailover.set_formation_synchronous_commit(text,text)
+        is 'set the synchronous_commit level of the primary nodes of a formation';
+
+ALTER TABLE pgautofailover.node
+  SET (fillfactor = 25,
+       autovacuum_vacuum_scale_factor = 0,
+       autovacuum_vacuum_threshold = 100,
+       autovacuum_analyze_scale_factor = 0,
+       autovacuum_analyze_threshold = 100,
+       autovacuum_vacuum_cost_delay = 0);
+
+ALTER TABLE pgautofailover.event
+  SET (autovacuum_vacuum_scale_factor = 0.01,
+       autovacuum_analyze_scale_factor = 0.01);
+
+ALTER TABLE pgautofailover.node
+  ADD COLUMN zone text;
+
+CREATE FUNCTION pgautofailover.set_node_zone
+ (
+   node_name          text,
+   node_port          int,
+   zone               text
+ )
+RETURNS bool LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$set_node_zone$$;
+
+comment on function pgautofailover.set_node_zone(text,int,text)
+        is 'set the zone of a node, an empty zone means none';
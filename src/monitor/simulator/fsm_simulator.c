@@ -0,0 +1,1881 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/simulator/fsm_simulator.c
+ *
+ * Deterministic simulator for the group state machine of the monitor.
+ *
+ * The simulator links the monitor's group_state_machine.c, unchanged, with
+ * an in-memory implementation of the node store, the notifications and the
+ * shared memory lag history that it uses, and runs it on a virtual clock.
+ * Around it we model the keepers, which call node_active at a fixed
+ * interval and take some time to reach their goal states, the health checks
+ * of the monitor, and the WAL of the group.
+ *
+ * A scenario is a script of settings and timed faults, see README.md, and
+ * the simulation can also replay the reports of a recorded history of
+ * pgautofailover.event, to compare the decisions of the state machine with
+ * the recorded ones under other settings. At the end, we report how long
+ * each goal state took to be reached, and for how long the group had no
+ * writable node.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "formation_metadata.h"
+#include "group_state_machine.h"
+#include "health_check.h"
+#include "node_metadata.h"
+#include "notifications.h"
+#include "replication_state.h"
+
+#include "nodes/pg_list.h"
+#include "utils/timestamp.h"
+
+
+#define SIM_MAX_NODES 8
+#define SIM_MAX_ACTIONS 4096
+#define SIM_MAX_TRANSITIONS 4096
+
+/* the virtual clock advances by that many milliseconds at a time */
+#define SIM_TICK_MS 10
+
+/* where the WAL of the group starts, 0/0 means "no data yet" */
+#define SIM_INITIAL_LSN ((XLogRecPtr) 0x3000000)
+
+#define MS_TO_TIMESTAMP(ms) ((TimestampTz) (ms) * INT64CONST(1000))
+#define TIMESTAMP_TO_SECS(ts) ((double) (ts) / 1000000.0)
+
+
+/* GUC variables of the health checks, that group_state_machine.c uses */
+int HealthCheckPeriod = 20 * 1000;
+int HealthCheckTimeout = 5 * 1000;
+int HealthCheckMaxRetries = 2;
+int HealthCheckRetryDelay = 2 * 1000;
+
+/* the keepers, as modelled by the simulation */
+static int KeeperIntervalMs = 5 * 1000;
+static int KeeperPartitionTimeoutMs = 20 * 1000;
+static int KeeperTransitionMs[REPLICATION_STATE_UNKNOWN + 1];
+
+/* bytes of WAL per second written on the writable node */
+static int64 WalRate = 1024 * 1024;
+
+/* the virtual clock */
+TimestampTz PgStartTime = 0;
+static TimestampTz SimulatedNow = 0;
+
+typedef enum SimActionKind
+{
+	SIM_ACTION_CRASH,
+	SIM_ACTION_RESTART,
+	SIM_ACTION_PARTITION,
+	SIM_ACTION_HEAL,
+	SIM_ACTION_STOP,
+	SIM_ACTION_START,
+	SIM_ACTION_LAG,
+	SIM_ACTION_FAILOVER,
+	SIM_ACTION_SWITCHOVER,
+	SIM_ACTION_REPORT
+} SimActionKind;
+
+typedef struct SimAction
+{
+	TimestampTz time;
+	int sequence;                 /* order of the action in the input */
+	SimActionKind kind;
+	int nodeIndex;
+	int64 bytes;                  /* lag, or reported LSN when replaying */
+	ReplicationState state;       /* reported state, when replaying */
+	ReplicationState goalState;   /* recorded goal state, when replaying */
+	bool done;
+} SimAction;
+
+/*
+ * SimNode is a node of the simulated group: what the monitor knows about it
+ * in the AutoFailoverNode, and the state of its keeper and Postgres.
+ */
+typedef struct SimNode
+{
+	AutoFailoverNode node;
+	char name[NAMEDATALEN];
+	char nodeName[NAMEDATALEN];
+
+	bool keeperUp;
+	bool pgUp;
+	bool partitioned;
+	TimestampTz partitionTime;
+
+	ReplicationState keeperState;
+	TimestampTz transitionEndTime;    /* when the keeper reaches its goal */
+	ReplicationState transitionGoal;
+	TimestampTz nextReportTime;
+
+	XLogRecPtr lsn;
+	int64 lagBytes;
+
+	/* the health checks of the monitor */
+	TimestampTz nextHealthCheckTime;
+	TimestampTz healthCheckEndTime;
+
+	/* the lag history that the monitor keeps in shared memory */
+	LagSample lagSamples[LAG_HISTORY_SIZE];
+	int lagSampleCount;
+	int nextLagSample;
+	TimestampTz walLagStartTime;
+} SimNode;
+
+/* a goal state assigned to a node, and when the node reached it */
+typedef struct SimTransition
+{
+	int nodeIndex;
+	ReplicationState fromState;
+	ReplicationState goalState;
+	TimestampTz assignedTime;
+	TimestampTz reachedTime;
+} SimTransition;
+
+static SimNode Nodes[SIM_MAX_NODES];
+static int NodeCount = 0;
+static List *GroupNodeList = NIL;
+
+static AutoFailoverFormation Formation = {
+	"default", FORMATION_KIND_PGSQL, "postgres", true
+};
+static int GroupId = 0;
+
+static SimAction Actions[SIM_MAX_ACTIONS];
+static int ActionCount = 0;
+
+static SimTransition Transitions[SIM_MAX_TRANSITIONS];
+static int TransitionCount = 0;
+
+static TimestampTz RunDuration = 0;
+static int64 EventId = 0;
+static bool Replaying = false;
+static bool Verbose = true;
+static int Divergences = 0;
+
+/* time without a writable node */
+static TimestampTz UnavailableSince = 0;
+static TimestampTz UnavailableTotal = 0;
+static TimestampTz UnavailableLongest = 0;
+
+
+static void usage(const char *progname);
+static bool parse_script(const char *filename);
+static bool parse_events(const char *filename);
+static bool parse_setting(char *name, char *value, const char *filename,
+						  int lineNumber);
+static bool parse_duration(const char *text, TimestampTz *duration);
+static bool parse_bytes(const char *text, int64 *bytes);
+static int find_node(const char *name);
+static int add_node(const char *name, ReplicationState state,
+					int candidatePriority);
+static ReplicationState state_from_name(const char *name);
+static int compare_actions(const void *left, const void *right);
+static SimNode * sim_node_by_name(char *nodeName, int nodePort);
+
+static void simulate(void);
+static void run_actions(void);
+static void run_action(SimAction *action);
+static void start_promotion(bool switchover);
+static void advance_wal(void);
+static void run_keepers(void);
+static void node_active(SimNode *simNode);
+static void run_health_checks(void);
+static void track_availability(void);
+static bool is_writable(SimNode *simNode);
+static bool is_replicating(SimNode *simNode);
+static void print_report(void);
+static void sim_log(SimNode *simNode, const char *fmt, ...)
+__attribute__((format(printf, 2, 3)));
+
+
+int
+main(int argc, char **argv)
+{
+	const char *script = NULL;
+	const char *events = NULL;
+
+	for (int argIndex = 1; argIndex < argc; argIndex++)
+	{
+		if (strcmp(argv[argIndex], "--events") == 0 && argIndex + 1 < argc)
+		{
+			events = argv[++argIndex];
+		}
+		else if (strcmp(argv[argIndex], "--quiet") == 0)
+		{
+			Verbose = false;
+		}
+		else if (strcmp(argv[argIndex], "--help") == 0)
+		{
+			usage(argv[0]);
+			return 0;
+		}
+		else if (argv[argIndex][0] != '-' && script == NULL)
+		{
+			script = argv[argIndex];
+		}
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (script == NULL && events == NULL)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (int state = 0; state <= REPLICATION_STATE_UNKNOWN; state++)
+	{
+		KeeperTransitionMs[state] = 1000;
+	}
+
+	/* replaying a history also reads settings and faults from the script */
+	if (script != NULL && !parse_script(script))
+	{
+		return 1;
+	}
+
+	if (events != NULL && !parse_events(events))
+	{
+		return 1;
+	}
+
+	if (NodeCount == 0)
+	{
+		fprintf(stderr, "no nodes to simulate, see --help\n");
+		return 1;
+	}
+
+	qsort(Actions, ActionCount, sizeof(SimAction), compare_actions);
+
+	simulate();
+	print_report();
+
+	return Divergences > 0 ? 2 : 0;
+}
+
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr,
+			"%s: simulate the group state machine of the monitor\n"
+			"usage: %s [ --quiet ] [ --events history.csv ] [ script.sim ]\n"
+			"\n"
+			"  --quiet    only print the report at the end\n"
+			"  --events   replay the reports of a recorded event history\n",
+			progname, progname);
+}
+
+
+/*
+ * parse_script reads a scenario, made of the following lines:
+ *
+ *   set <setting> <value>
+ *   node <name> <state> [ <candidate priority> ]
+ *   at <time> crash|restart|partition|heal|stop|start <name>
+ *   at <time> lag <name> <bytes>
+ *   at <time> failover|switchover
+ *   run <time>
+ */
+static bool
+parse_script(const char *filename)
+{
+	FILE *file = fopen(filename, "r");
+	char line[BUFSIZE];
+	int lineNumber = 0;
+
+	if (file == NULL)
+	{
+		fprintf(stderr, "failed to open \"%s\": %s\n", filename, strerror(errno));
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		char *words[8] = { 0 };
+		int wordCount = 0;
+		char *comment = strchr(line, '#');
+		char *saveptr = NULL;
+
+		lineNumber++;
+
+		if (comment != NULL)
+		{
+			*comment = '\0';
+		}
+
+		for (char *word = strtok_r(line, " \t\r\n", &saveptr);
+			 word != NULL && wordCount < 8;
+			 word = strtok_r(NULL, " \t\r\n", &saveptr))
+		{
+			words[wordCount++] = word;
+		}
+
+		if (wordCount == 0)
+		{
+			continue;
+		}
+
+		if (strcmp(words[0], "set") == 0 && wordCount == 3)
+		{
+			if (!parse_setting(words[1], words[2], filename, lineNumber))
+			{
+				fclose(file);
+				return false;
+			}
+		}
+		else if (strcmp(words[0], "set") == 0 && wordCount == 4 &&
+				 strcmp(words[1], "keeper.transition") == 0)
+		{
+			ReplicationState state = state_from_name(words[2]);
+			TimestampTz duration = 0;
+
+			if (state == REPLICATION_STATE_UNKNOWN ||
+				!parse_duration(words[3], &duration))
+			{
+				fprintf(stderr, "%s:%d: invalid keeper.transition\n",
+						filename, lineNumber);
+				fclose(file);
+				return false;
+			}
+
+			KeeperTransitionMs[state] = (int) (duration / 1000);
+		}
+		else if (strcmp(words[0], "node") == 0 &&
+				 (wordCount == 3 || wordCount == 4))
+		{
+			ReplicationState state = state_from_name(words[2]);
+			int priority = wordCount == 4 ? atoi(words[3]) : 100;
+
+			if (state == REPLICATION_STATE_UNKNOWN ||
+				add_node(words[1], state, priority) < 0)
+			{
+				fprintf(stderr, "%s:%d: invalid node\n", filename, lineNumber);
+				fclose(file);
+				return false;
+			}
+		}
+		else if (strcmp(words[0], "run") == 0 && wordCount == 2)
+		{
+			if (!parse_duration(words[1], &RunDuration))
+			{
+				fprintf(stderr, "%s:%d: invalid duration \"%s\"\n",
+						filename, lineNumber, words[1]);
+				fclose(file);
+				return false;
+			}
+		}
+		else if (strcmp(words[0], "at") == 0 && wordCount >= 3 &&
+				 ActionCount < SIM_MAX_ACTIONS)
+		{
+			SimAction *action = &(Actions[ActionCount]);
+			const char *what = words[2];
+			bool nodeAction = true;
+
+			memset(action, 0, sizeof(SimAction));
+			action->sequence = ActionCount;
+
+			if (!parse_duration(words[1], &action->time))
+			{
+				fprintf(stderr, "%s:%d: invalid time \"%s\"\n",
+						filename, lineNumber, words[1]);
+				fclose(file);
+				return false;
+			}
+
+			if (strcmp(what, "crash") == 0)
+			{
+				action->kind = SIM_ACTION_CRASH;
+			}
+			else if (strcmp(what, "restart") == 0)
+			{
+				action->kind = SIM_ACTION_RESTART;
+			}
+			else if (strcmp(what, "partition") == 0)
+			{
+				action->kind = SIM_ACTION_PARTITION;
+			}
+			else if (strcmp(what, "heal") == 0)
+			{
+				action->kind = SIM_ACTION_HEAL;
+			}
+			else if (strcmp(what, "stop") == 0)
+			{
+				action->kind = SIM_ACTION_STOP;
+			}
+			else if (strcmp(what, "start") == 0)
+			{
+				action->kind = SIM_ACTION_START;
+			}
+			else if (strcmp(what, "lag") == 0 && wordCount == 5)
+			{
+				action->kind = SIM_ACTION_LAG;
+
+				if (!parse_bytes(words[4], &action->bytes))
+				{
+					fprintf(stderr, "%s:%d: invalid size \"%s\"\n",
+							filename, lineNumber, words[4]);
+					fclose(file);
+					return false;
+				}
+			}
+			else if (strcmp(what, "failover") == 0 && wordCount == 3)
+			{
+				action->kind = SIM_ACTION_FAILOVER;
+				nodeAction = false;
+			}
+			else if (strcmp(what, "switchover") == 0 && wordCount == 3)
+			{
+				action->kind = SIM_ACTION_SWITCHOVER;
+				nodeAction = false;
+			}
+			else
+			{
+				fprintf(stderr, "%s:%d: unknown action \"%s\"\n",
+						filename, lineNumber, what);
+				fclose(file);
+				return false;
+			}
+
+			if (nodeAction)
+			{
+				if (wordCount < 4 || (action->nodeIndex = find_node(words[3])) < 0)
+				{
+					fprintf(stderr, "%s:%d: unknown node\n", filename, lineNumber);
+					fclose(file);
+					return false;
+				}
+			}
+
+			ActionCount++;
+		}
+		else
+		{
+			fprintf(stderr, "%s:%d: syntax error\n", filename, lineNumber);
+			fclose(file);
+			return false;
+		}
+	}
+
+	fclose(file);
+
+	return true;
+}
+
+
+/*
+ * parse_setting sets one of the monitor GUCs that the state machine and the
+ * health checks use, or one of the settings of the simulated keepers.
+ */
+static bool
+parse_setting(char *name, char *value, const char *filename, int lineNumber)
+{
+	struct
+	{
+		const char *name;
+		int *variable;
+		bool isDuration;
+	} settings[] = {
+		{ "pgautofailover.primary_demote_timeout", &DrainTimeoutMs, true },
+		{ "pgautofailover.node_considered_unhealthy_timeout",
+		  &UnhealthyTimeoutMs, true },
+		{ "pgautofailover.startup_grace_period", &StartupGracePeriodMs, true },
+		{ "pgautofailover.enable_sync_wal_log_threshold",
+		  &EnableSyncXlogThreshold, false },
+		{ "pgautofailover.promote_wal_log_threshold",
+		  &PromoteXlogThreshold, false },
+		{ "pgautofailover.sync_standby_lag_threshold",
+		  &SyncStandbyLagThreshold, false },
+		{ "pgautofailover.sync_standby_lag_timeout",
+		  &SyncStandbyLagTimeoutMs, true },
+		{ "pgautofailover.wal_lag_smoothing_window",
+		  &WalLagSmoothingWindowMs, true },
+		{ "pgautofailover.health_check_period", &HealthCheckPeriod, true },
+		{ "pgautofailover.health_check_timeout", &HealthCheckTimeout, true },
+		{ "pgautofailover.health_check_max_retries",
+		  &HealthCheckMaxRetries, false },
+		{ "pgautofailover.health_check_retry_delay",
+		  &HealthCheckRetryDelay, true },
+		{ "keeper.interval", &KeeperIntervalMs, true },
+		{ "keeper.partition_timeout", &KeeperPartitionTimeoutMs, true },
+		{ NULL, NULL, false }
+	};
+
+	if (strcmp(name, "wal.rate") == 0)
+	{
+		if (!parse_bytes(value, &WalRate))
+		{
+			fprintf(stderr, "%s:%d: invalid size \"%s\"\n",
+					filename, lineNumber, value);
+			return false;
+		}
+		return true;
+	}
+
+	if (strcmp(name, "formation.kind") == 0)
+	{
+		Formation.kind = FormationKindFromString(value);
+
+		if (Formation.kind == FORMATION_KIND_UNKNOWN)
+		{
+			fprintf(stderr, "%s:%d: unknown formation kind \"%s\"\n",
+					filename, lineNumber, value);
+			return false;
+		}
+		return true;
+	}
+
+	if (strcmp(name, "group") == 0)
+	{
+		GroupId = atoi(value);
+
+		for (int nodeIndex = 0; nodeIndex < NodeCount; nodeIndex++)
+		{
+			Nodes[nodeIndex].node.groupId = GroupId;
+		}
+		return true;
+	}
+
+	for (int settingIndex = 0; settings[settingIndex].name != NULL; settingIndex++)
+	{
+		if (strcmp(settings[settingIndex].name, name) == 0)
+		{
+			if (settings[settingIndex].isDuration)
+			{
+				TimestampTz duration = 0;
+
+				if (!parse_duration(value, &duration))
+				{
+					fprintf(stderr, "%s:%d: invalid duration \"%s\"\n",
+							filename, lineNumber, value);
+					return false;
+				}
+
+				*(settings[settingIndex].variable) = (int) (duration / 1000);
+			}
+			else
+			{
+				int64 bytes = 0;
+
+				if (!parse_bytes(value, &bytes))
+				{
+					fprintf(stderr, "%s:%d: invalid value \"%s\"\n",
+							filename, lineNumber, value);
+					return false;
+				}
+
+				*(settings[settingIndex].variable) = (int) bytes;
+			}
+
+			return true;
+		}
+	}
+
+	fprintf(stderr, "%s:%d: unknown setting \"%s\"\n", filename, lineNumber, name);
+
+	return false;
+}
+
+
+/*
+ * parse_events reads a history of pgautofailover.event of a single group, as
+ * exported with:
+ *
+ *   \copy (select extract(epoch from eventtime), nodeid, nodename, nodeport,
+ *                 reportedstate, goalstate, reportedlsn
+ *            from pgautofailover.event
+ *           where formationid = 'default' and groupid = 0
+ *        order by eventid) to 'history.csv' with csv
+ *
+ * Each new reported state of a node becomes a report of its keeper at the
+ * same time relative to the first event, and we check that the state machine
+ * then assigns the goal state that was recorded.
+ */
+static bool
+parse_events(const char *filename)
+{
+	FILE *file = fopen(filename, "r");
+	char line[BUFSIZE];
+	int lineNumber = 0;
+	double firstTime = -1;
+	ReplicationState lastReported[SIM_MAX_NODES];
+	double lastTime = 0;
+
+	if (file == NULL)
+	{
+		fprintf(stderr, "failed to open \"%s\": %s\n", filename, strerror(errno));
+		return false;
+	}
+
+	Replaying = true;
+
+	for (int nodeIndex = 0; nodeIndex < SIM_MAX_NODES; nodeIndex++)
+	{
+		lastReported[nodeIndex] = Nodes[nodeIndex].node.reportedState;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		double eventTime = 0;
+		int nodeId = 0;
+		char nodeName[NAMEDATALEN] = { 0 };
+		int nodePort = 0;
+		char reported[NAMEDATALEN] = { 0 };
+		char goal[NAMEDATALEN] = { 0 };
+		unsigned int lsnHi = 0, lsnLo = 0;
+		char name[NAMEDATALEN * 2];
+		int nodeIndex = 0;
+		SimAction *action = NULL;
+
+		lineNumber++;
+
+		if (sscanf(line, "%lf,%d,%63[^,],%d,%63[^,],%63[^,],%X/%X",
+				   &eventTime, &nodeId, nodeName, &nodePort,
+				   reported, goal, &lsnHi, &lsnLo) != 8)
+		{
+			fprintf(stderr, "%s:%d: expected epoch,nodeid,nodename,nodeport,"
+							"reportedstate,goalstate,reportedlsn\n",
+					filename, lineNumber);
+			fclose(file);
+			return false;
+		}
+
+		if (firstTime < 0)
+		{
+			firstTime = eventTime;
+		}
+
+		snprintf(name, sizeof(name), "%s:%d", nodeName, nodePort);
+		nodeIndex = find_node(name);
+
+		if (nodeIndex < 0)
+		{
+			nodeIndex = add_node(name, state_from_name(reported), 100);
+
+			if (nodeIndex < 0)
+			{
+				fprintf(stderr, "%s:%d: too many nodes\n", filename, lineNumber);
+				fclose(file);
+				return false;
+			}
+
+			strlcpy(Nodes[nodeIndex].nodeName, nodeName, NAMEDATALEN);
+			Nodes[nodeIndex].node.nodeId = nodeId;
+			Nodes[nodeIndex].node.nodePort = nodePort;
+			Nodes[nodeIndex].node.goalState = state_from_name(goal);
+			Nodes[nodeIndex].lsn = ((XLogRecPtr) lsnHi << 32) | lsnLo;
+			lastReported[nodeIndex] = state_from_name(reported);
+			continue;
+		}
+
+		if (state_from_name(reported) == lastReported[nodeIndex] ||
+			ActionCount >= SIM_MAX_ACTIONS)
+		{
+			continue;
+		}
+
+		action = &(Actions[ActionCount]);
+		memset(action, 0, sizeof(SimAction));
+		action->sequence = ActionCount++;
+
+		action->time = MS_TO_TIMESTAMP((eventTime - firstTime) * 1000.0);
+		action->kind = SIM_ACTION_REPORT;
+		action->nodeIndex = nodeIndex;
+		action->state = state_from_name(reported);
+		action->goalState = state_from_name(goal);
+		action->bytes = (int64) (((XLogRecPtr) lsnHi << 32) | lsnLo);
+
+		lastReported[nodeIndex] = action->state;
+		lastTime = eventTime - firstTime;
+	}
+
+	fclose(file);
+
+	/* leave the state machine some time after the last recorded report */
+	if (RunDuration < MS_TO_TIMESTAMP((lastTime + 60.0) * 1000.0))
+	{
+		RunDuration = MS_TO_TIMESTAMP((lastTime + 60.0) * 1000.0);
+	}
+
+	return true;
+}
+
+
+/*
+ * parse_duration parses a duration in ms, s, or min, defaulting to ms.
+ */
+static bool
+parse_duration(const char *text, TimestampTz *duration)
+{
+	char *unit = NULL;
+	double value = strtod(text, &unit);
+
+	if (unit == text || value < 0)
+	{
+		return false;
+	}
+
+	if (*unit == '\0' || strcmp(unit, "ms") == 0)
+	{
+		*duration = MS_TO_TIMESTAMP(value);
+	}
+	else if (strcmp(unit, "s") == 0)
+	{
+		*duration = MS_TO_TIMESTAMP(value * 1000.0);
+	}
+	else if (strcmp(unit, "min") == 0)
+	{
+		*duration = MS_TO_TIMESTAMP(value * 60.0 * 1000.0);
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * parse_bytes parses a number of bytes, with an optional kB, MB, or GB unit.
+ */
+static bool
+parse_bytes(const char *text, int64 *bytes)
+{
+	char *unit = NULL;
+	double value = strtod(text, &unit);
+
+	if (unit == text || value < 0)
+	{
+		return false;
+	}
+
+	if (*unit == '\0')
+	{
+		*bytes = (int64) value;
+	}
+	else if (strcmp(unit, "kB") == 0)
+	{
+		*bytes = (int64) (value * 1024);
+	}
+	else if (strcmp(unit, "MB") == 0)
+	{
+		*bytes = (int64) (value * 1024 * 1024);
+	}
+	else if (strcmp(unit, "GB") == 0)
+	{
+		*bytes = (int64) (value * 1024 * 1024 * 1024);
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
+static int
+find_node(const char *name)
+{
+	for (int nodeIndex = 0; nodeIndex < NodeCount; nodeIndex++)
+	{
+		if (strcmp(Nodes[nodeIndex].name, name) == 0)
+		{
+			return nodeIndex;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * add_node adds a node to the simulated group, that has converged to the
+ * given state, with its keeper and Postgres running.
+ */
+static int
+add_node(const char *name, ReplicationState state, int candidatePriority)
+{
+	SimNode *simNode = NULL;
+	AutoFailoverNode *node = NULL;
+
+	if (NodeCount >= SIM_MAX_NODES || find_node(name) >= 0)
+	{
+		return -1;
+	}
+
+	simNode = &(Nodes[NodeCount]);
+	node = &(simNode->node);
+
+	memset(simNode, 0, sizeof(SimNode));
+	strlcpy(simNode->name, name, NAMEDATALEN);
+	strlcpy(simNode->nodeName, name, NAMEDATALEN);
+
+	node->formationId = Formation.formationId;
+	node->nodeId = NodeCount + 1;
+	node->groupId = GroupId;
+	node->nodeName = simNode->nodeName;
+	node->nodePort = 5432;
+	node->goalState = state;
+	node->reportedState = state;
+	node->pgIsRunning = true;
+	node->pgsrSyncState = SYNC_STATE_UNKNOWN;
+	node->health = NODE_HEALTH_GOOD;
+	node->candidatePriority = candidatePriority;
+	node->archiveLag = -1;
+
+	simNode->keeperUp = true;
+	simNode->pgUp = true;
+	simNode->keeperState = state;
+	simNode->lsn = SIM_INITIAL_LSN;
+
+	return NodeCount++;
+}
+
+
+static ReplicationState
+state_from_name(const char *name)
+{
+	for (int state = 0; state < REPLICATION_STATE_UNKNOWN; state++)
+	{
+		if (strcmp(ReplicationStateGetName(state), name) == 0)
+		{
+			return (ReplicationState) state;
+		}
+	}
+
+	return REPLICATION_STATE_UNKNOWN;
+}
+
+
+static int
+compare_actions(const void *left, const void *right)
+{
+	const SimAction *leftAction = (const SimAction *) left;
+	const SimAction *rightAction = (const SimAction *) right;
+
+	if (leftAction->time != rightAction->time)
+	{
+		return leftAction->time < rightAction->time ? -1 : 1;
+	}
+
+	/* keep the order of the input for actions at the same time */
+	return leftAction->sequence - rightAction->sequence;
+}
+
+
+/*
+ * simulate runs the simulation until RunDuration, one tick at a time. The
+ * monitor started long enough ago for the startup grace period to be over.
+ */
+static void
+simulate(void)
+{
+	TimestampTz endTime = 0;
+
+	PgStartTime = MS_TO_TIMESTAMP(1000);
+	SimulatedNow = PgStartTime + MS_TO_TIMESTAMP(StartupGracePeriodMs);
+	endTime = SimulatedNow + (RunDuration > 0 ? RunDuration
+							  : MS_TO_TIMESTAMP(120 * 1000));
+
+	for (int nodeIndex = 0; nodeIndex < NodeCount; nodeIndex++)
+	{
+		SimNode *simNode = &(Nodes[nodeIndex]);
+
+		GroupNodeList = lappend(GroupNodeList, &(simNode->node));
+
+		simNode->node.reportTime = SimulatedNow;
+		simNode->node.walReportTime = SimulatedNow;
+		simNode->node.healthCheckTime = SimulatedNow;
+		simNode->node.stateChangeTime = SimulatedNow;
+		simNode->node.reportedLSN = simNode->lsn;
+
+		/* spread the keepers and the health checks over their interval */
+		simNode->nextReportTime = SimulatedNow +
+			MS_TO_TIMESTAMP(nodeIndex * KeeperIntervalMs / NodeCount);
+		simNode->nextHealthCheckTime = SimulatedNow +
+			MS_TO_TIMESTAMP(nodeIndex * HealthCheckPeriod / NodeCount);
+	}
+
+	/* actions are relative to the start of the simulation */
+	for (int actionIndex = 0; actionIndex < ActionCount; actionIndex++)
+	{
+		Actions[actionIndex].time += SimulatedNow;
+	}
+
+	RunDuration = endTime - SimulatedNow;
+
+	while (SimulatedNow < endTime)
+	{
+		run_actions();
+		advance_wal();
+		run_health_checks();
+		run_keepers();
+		track_availability();
+
+		SimulatedNow += MS_TO_TIMESTAMP(SIM_TICK_MS);
+	}
+
+	/* a group that is still unavailable at the end counts until then */
+	if (UnavailableSince > 0)
+	{
+		TimestampTz unavailable = SimulatedNow - UnavailableSince;
+
+		UnavailableTotal += unavailable;
+		UnavailableLongest = Max(UnavailableLongest, unavailable);
+	}
+}
+
+
+static void
+run_actions(void)
+{
+	for (int actionIndex = 0; actionIndex < ActionCount; actionIndex++)
+	{
+		SimAction *action = &(Actions[actionIndex]);
+
+		if (!action->done && action->time <= SimulatedNow)
+		{
+			action->done = true;
+			run_action(action);
+		}
+	}
+}
+
+
+static void
+run_action(SimAction *action)
+{
+	SimNode *simNode = &(Nodes[action->nodeIndex]);
+
+	switch (action->kind)
+	{
+		case SIM_ACTION_CRASH:
+		{
+			sim_log(simNode, "crash: keeper and Postgres are down");
+			simNode->keeperUp = false;
+			simNode->pgUp = false;
+			simNode->transitionEndTime = 0;
+			break;
+		}
+
+		case SIM_ACTION_RESTART:
+		{
+			sim_log(simNode, "restart: keeper and Postgres are up");
+			simNode->keeperUp = true;
+			simNode->pgUp = true;
+			simNode->nextReportTime = SimulatedNow;
+			break;
+		}
+
+		case SIM_ACTION_PARTITION:
+		{
+			sim_log(simNode, "partition: node is unreachable");
+			simNode->partitioned = true;
+			simNode->partitionTime = SimulatedNow;
+			break;
+		}
+
+		case SIM_ACTION_HEAL:
+		{
+			sim_log(simNode, "heal: node is reachable again");
+			simNode->partitioned = false;
+			simNode->nextReportTime = SimulatedNow;
+			break;
+		}
+
+		case SIM_ACTION_STOP:
+		{
+			sim_log(simNode, "stop: Postgres is down, the keeper runs");
+			simNode->pgUp = false;
+			break;
+		}
+
+		case SIM_ACTION_START:
+		{
+			sim_log(simNode, "start: Postgres is up");
+			simNode->pgUp = true;
+			break;
+		}
+
+		case SIM_ACTION_LAG:
+		{
+			sim_log(simNode, "lag: " INT64_FORMAT " bytes behind", action->bytes);
+			simNode->lagBytes = action->bytes;
+			break;
+		}
+
+		case SIM_ACTION_FAILOVER:
+		case SIM_ACTION_SWITCHOVER:
+		{
+			start_promotion(action->kind == SIM_ACTION_SWITCHOVER);
+			break;
+		}
+
+		case SIM_ACTION_REPORT:
+		{
+			AutoFailoverNode *node = &(simNode->node);
+
+			/* the recorded keeper reached that state */
+			simNode->keeperState = action->state;
+			simNode->transitionEndTime = 0;
+			simNode->lsn = (XLogRecPtr) action->bytes;
+			node_active(simNode);
+
+			if (node->goalState != action->goalState)
+			{
+				++Divergences;
+				sim_log(simNode, "diverges: recorded goal state %s, "
+								 "simulated goal state %s",
+						ReplicationStateGetName(action->goalState),
+						ReplicationStateGetName(node->goalState));
+			}
+			break;
+		}
+	}
+}
+
+
+/*
+ * start_promotion does what pgautofailover.perform_failover and
+ * pgautofailover.perform_switchover do, on the first primary and secondary
+ * nodes of the group.
+ */
+static void
+start_promotion(bool switchover)
+{
+	AutoFailoverNode *primaryNode = NULL;
+	AutoFailoverNode *secondaryNode = NULL;
+	char message[BUFSIZE];
+
+	for (int nodeIndex = 0; nodeIndex < NodeCount; nodeIndex++)
+	{
+		AutoFailoverNode *node = &(Nodes[nodeIndex].node);
+
+		if (primaryNode == NULL &&
+			(IsCurrentState(node, REPLICATION_STATE_PRIMARY) ||
+			 (!switchover && IsCurrentState(node, REPLICATION_STATE_WAIT_PRIMARY))))
+		{
+			primaryNode = node;
+		}
+		else if (secondaryNode == NULL &&
+				 (IsCurrentState(node, REPLICATION_STATE_SECONDARY) ||
+				  (!switchover &&
+				   IsCurrentState(node, REPLICATION_STATE_CATCHINGUP))))
+		{
+			secondaryNode = node;
+		}
+	}
+
+	if (primaryNode == NULL || secondaryNode == NULL)
+	{
+		sim_log(NULL, "cannot %s: the group has no primary and secondary",
+				switchover ? "switch over" : "fail over");
+		return;
+	}
+
+	LogAndNotifyMessage(
+		message, BUFSIZE,
+		"Setting goal state of %s:%d to draining and %s:%d to "
+		"prepare_promotion after a user-initiated %s.",
+		primaryNode->nodeName, primaryNode->nodePort,
+		secondaryNode->nodeName, secondaryNode->nodePort,
+		switchover ? "switchover" : "failover");
+
+	SetNodeGoalState(primaryNode->nodeName, primaryNode->nodePort,
+					 REPLICATION_STATE_DRAINING);
+	NotifyStateChange(primaryNode->reportedState, REPLICATION_STATE_DRAINING,
+					  primaryNode->formationId, primaryNode->groupId,
+					  primaryNode->nodeId, primaryNode->nodeName,
+					  primaryNode->nodePort, primaryNode->pgsrSyncState,
+					  primaryNode->reportedLSN, message);
+
+	SetNodeGoalState(secondaryNode->nodeName, secondaryNode->nodePort,
+					 REPLICATION_STATE_PREPARE_PROMOTION);
+	NotifyStateChange(secondaryNode->reportedState,
+					  REPLICATION_STATE_PREPARE_PROMOTION,
+					  secondaryNode->formationId, secondaryNode->groupId,
+					  secondaryNode->nodeId, secondaryNode->nodeName,
+					  secondaryNode->nodePort, secondaryNode->pgsrSyncState,
+					  secondaryNode->reportedLSN, message);
+}
+
+
+/*
+ * advance_wal writes WAL on the writable node, and has the nodes that
+ * replicate from it follow, up to their configured lag.
+ */
+static void
+advance_wal(void)
+{
+	SimNode *writer = NULL;
+
+	if (Replaying)
+	{
+		/* the LSNs come from the recording */
+		return;
+	}
+
+	for (int nodeIndex = 0; nodeIndex < NodeCount; nodeIndex++)
+	{
+		if (is_writable(&(Nodes[nodeIndex])))
+		{
+			writer = &(Nodes[nodeIndex]);
+			writer->lsn += WalRate * SIM_TICK_MS / 1000;
+			break;
+		}
+	}
+
+	if (writer == NULL || writer->partitioned)
+	{
+		return;
+	}
+
+	for (int nodeIndex = 0; nodeIndex < NodeCount; nodeIndex++)
+	{
+		SimNode *simNode = &(Nodes[nodeIndex]);
+		XLogRecPtr target = 0;
+
+		if (simNode == writer || !is_replicating(simNode) || simNode->partitioned)
+		{
+			continue;
+		}
+
+		target = writer->lsn > simNode->lagBytes
+				 ? writer->lsn - simNode->lagBytes
+				 : 0;
+
+		if (target > simNode->lsn)
+		{
+			simNode->lsn = target;
+		}
+	}
+}
+
+
+/*
+ * run_keepers has each keeper make progress towards its goal state, and call
+ * node_active when it's time to report. A keeper reports at its interval, and
+ * right after reaching a new state.
+ */
+static void
+run_keepers(void)
+{
+	for (int nodeIndex = 0; nodeIndex < NodeCount; nodeIndex++)
+	{
+		SimNode *simNode = &(Nodes[nodeIndex]);
+
+		if (!simNode->keeperUp)
+		{
+			continue;
+		}
+
+		/* a primary that can't reach anyone demotes itself */
+		if (simNode->partitioned && simNode->pgUp &&
+			(simNode->keeperState == REPLICATION_STATE_PRIMARY ||
+			 simNode->keeperState == REPLICATION_STATE_WAIT_PRIMARY) &&
+			SimulatedNow - simNode->partitionTime >=
+			MS_TO_TIMESTAMP(KeeperPartitionTimeoutMs))
+		{
+			sim_log(simNode, "keeper demotes Postgres after a network "
+							 "partition of %d ms", KeeperPartitionTimeoutMs);
+			simNode->pgUp = false;
+			simNode->keeperState = REPLICATION_STATE_DEMOTE_TIMEOUT;
+		}
+
+		if (simNode->transitionEndTime > 0 &&
+			simNode->transitionEndTime <= SimulatedNow)
+		{
+			simNode->keeperState = simNode->transitionGoal;
+			simNode->transitionEndTime = 0;
+
+			switch (simNode->keeperState)
+			{
+				case REPLICATION_STATE_DRAINING:
+				case REPLICATION_STATE_DEMOTE_TIMEOUT:
+				case REPLICATION_STATE_DEMOTED:
+				{
+					simNode->pgUp = false;
+					break;
+				}
+
+				case REPLICATION_STATE_MAINTENANCE:
+				{
+					break;
+				}
+
+				default:
+				{
+					simNode->pgUp = true;
+					break;
+				}
+			}
+
+			simNode->nextReportTime = SimulatedNow;
+		}
+
+		if (simNode->partitioned || simNode->nextReportTime > SimulatedNow)
+		{
+			continue;
+		}
+
+		node_active(simNode);
+
+		simNode->nextReportTime = SimulatedNow + MS_TO_TIMESTAMP(KeeperIntervalMs);
+
+		/* recorded keepers only change state as recorded */
+		if (!Replaying &&
+			simNode->node.goalState != simNode->keeperState &&
+			simNode->transitionEndTime == 0)
+		{
+			simNode->transitionGoal = simNode->node.goalState;
+			simNode->transitionEndTime = SimulatedNow +
+				MS_TO_TIMESTAMP(KeeperTransitionMs[simNode->transitionGoal]);
+		}
+	}
+}
+
+
+/*
+ * node_active does what the node_active protocol of the monitor does with a
+ * report from the keeper of the given node.
+ */
+static void
+node_active(SimNode *simNode)
+{
+	AutoFailoverNode *node = &(simNode->node);
+	bool heartbeatOnly = false;
+
+	if (node->reportedState != simNode->keeperState)
+	{
+		char message[BUFSIZE];
+
+		LogAndNotifyMessage(message, BUFSIZE,
+							"Node %s:%d reported new state %s",
+							node->nodeName, node->nodePort,
+							ReplicationStateGetName(simNode->keeperState));
+
+		NotifyStateChange(simNode->keeperState, node->goalState,
+						  node->formationId, node->groupId, node->nodeId,
+						  node->nodeName, node->nodePort,
+						  node->pgsrSyncState, simNode->lsn, message);
+	}
+
+	heartbeatOnly = node->reportedState == simNode->keeperState &&
+					node->pgIsRunning == simNode->pgUp &&
+					node->goalState == node->reportedState;
+
+	/* only full reports change the state change time of the node */
+	if (!heartbeatOnly)
+	{
+		node->stateChangeTime = SimulatedNow;
+	}
+
+	node->reportedState = simNode->keeperState;
+	node->pgIsRunning = simNode->pgUp;
+	node->reportTime = SimulatedNow;
+
+	if (simNode->lsn != 0)
+	{
+		node->reportedLSN = simNode->lsn;
+		node->walReportTime = SimulatedNow;
+	}
+
+	/* record when the nodes reach their goal states */
+	for (int transitionIndex = 0; transitionIndex < TransitionCount; transitionIndex++)
+	{
+		SimTransition *transition = &(Transitions[transitionIndex]);
+
+		if (transition->nodeIndex == (simNode - Nodes) &&
+			transition->reachedTime == 0 &&
+			transition->goalState == node->reportedState)
+		{
+			transition->reachedTime = SimulatedNow;
+		}
+	}
+
+	if (heartbeatOnly && GroupStateIsStable(node))
+	{
+		return;
+	}
+
+	ProceedGroupState(node);
+}
+
+
+/*
+ * run_health_checks checks each node once per health check period. A node
+ * that does not answer is marked unhealthy once all the retries have timed
+ * out, and the state machine then runs for the nodes of the group, as in
+ * SetNodeHealthStateList.
+ */
+static void
+run_health_checks(void)
+{
+	for (int nodeIndex = 0; nodeIndex < NodeCount; nodeIndex++)
+	{
+		SimNode *simNode = &(Nodes[nodeIndex]);
+		AutoFailoverNode *node = &(simNode->node);
+		NodeHealthState health = NODE_HEALTH_UNKNOWN;
+		bool reachable = simNode->pgUp && !simNode->partitioned;
+
+		if (simNode->healthCheckEndTime == 0)
+		{
+			if (simNode->nextHealthCheckTime > SimulatedNow)
+			{
+				continue;
+			}
+
+			simNode->nextHealthCheckTime =
+				SimulatedNow + MS_TO_TIMESTAMP(HealthCheckPeriod);
+
+			if (reachable)
+			{
+				health = NODE_HEALTH_GOOD;
+			}
+			else
+			{
+				/* all the tries time out, with a delay in between */
+				simNode->healthCheckEndTime = SimulatedNow +
+					MS_TO_TIMESTAMP((HealthCheckMaxRetries + 1) *
+									HealthCheckTimeout +
+									HealthCheckMaxRetries *
+									HealthCheckRetryDelay);
+				continue;
+			}
+		}
+		else if (simNode->healthCheckEndTime <= SimulatedNow)
+		{
+			simNode->healthCheckEndTime = 0;
+			health = reachable ? NODE_HEALTH_GOOD : NODE_HEALTH_BAD;
+		}
+		else
+		{
+			/* a retry of the check succeeds as soon as the node is back */
+			if (!reachable)
+			{
+				continue;
+			}
+
+			simNode->healthCheckEndTime = 0;
+			health = NODE_HEALTH_GOOD;
+		}
+
+		if (health == node->health)
+		{
+			continue;
+		}
+
+		sim_log(simNode, "health check marks the node %s",
+				health == NODE_HEALTH_GOOD ? "healthy" : "unhealthy");
+
+		node->health = health;
+		node->healthCheckTime = SimulatedNow;
+
+		for (int otherIndex = 0; otherIndex < NodeCount; otherIndex++)
+		{
+			ProceedGroupState(&(Nodes[otherIndex].node));
+		}
+	}
+}
+
+
+/*
+ * track_availability keeps track of the time the group has no node that
+ * takes writes.
+ */
+static void
+track_availability(void)
+{
+	bool writable = false;
+
+	for (int nodeIndex = 0; nodeIndex < NodeCount; nodeIndex++)
+	{
+		if (is_writable(&(Nodes[nodeIndex])) && !Nodes[nodeIndex].partitioned)
+		{
+			writable = true;
+			break;
+		}
+	}
+
+	if (!writable && UnavailableSince == 0)
+	{
+		UnavailableSince = SimulatedNow;
+	}
+	else if (writable && UnavailableSince > 0)
+	{
+		TimestampTz unavailable = SimulatedNow - UnavailableSince;
+
+		UnavailableTotal += unavailable;
+		UnavailableLongest = Max(UnavailableLongest, unavailable);
+		UnavailableSince = 0;
+	}
+}
+
+
+static bool
+is_writable(SimNode *simNode)
+{
+	return simNode->pgUp &&
+		   (simNode->keeperState == REPLICATION_STATE_SINGLE ||
+			simNode->keeperState == REPLICATION_STATE_WAIT_PRIMARY ||
+			simNode->keeperState == REPLICATION_STATE_PRIMARY);
+}
+
+
+static bool
+is_replicating(SimNode *simNode)
+{
+	return simNode->pgUp &&
+		   (simNode->keeperState == REPLICATION_STATE_CATCHINGUP ||
+			simNode->keeperState == REPLICATION_STATE_SECONDARY ||
+			simNode->keeperState == REPLICATION_STATE_PREPARE_PROMOTION);
+}
+
+
+/*
+ * print_report prints how long each goal state took to be reached, and the
+ * time without a writable node.
+ */
+static void
+print_report(void)
+{
+	printf("\n%10s  %-16s  %-36s  %12s\n",
+		   "assigned", "node", "transition", "converged in");
+
+	for (int transitionIndex = 0; transitionIndex < TransitionCount; transitionIndex++)
+	{
+		SimTransition *transition = &(Transitions[transitionIndex]);
+		char name[BUFSIZE];
+		char converged[NAMEDATALEN];
+
+		snprintf(name, sizeof(name), "%s -> %s",
+				 ReplicationStateGetName(transition->fromState),
+				 ReplicationStateGetName(transition->goalState));
+
+		if (transition->reachedTime > 0)
+		{
+			snprintf(converged, sizeof(converged), "%.3fs",
+					 TIMESTAMP_TO_SECS(transition->reachedTime -
+									   transition->assignedTime));
+		}
+		else
+		{
+			strlcpy(converged, "-", sizeof(converged));
+		}
+
+		printf("%9.3fs  %-16s  %-36s  %12s\n",
+			   TIMESTAMP_TO_SECS(transition->assignedTime - PgStartTime -
+								 MS_TO_TIMESTAMP(StartupGracePeriodMs)),
+			   Nodes[transition->nodeIndex].name, name, converged);
+	}
+
+	printf("\nwrites unavailable: %.3fs in total, %.3fs at most, "
+		   "over %.3fs simulated\n",
+		   TIMESTAMP_TO_SECS(UnavailableTotal),
+		   TIMESTAMP_TO_SECS(UnavailableLongest),
+		   TIMESTAMP_TO_SECS(RunDuration));
+
+	if (Replaying)
+	{
+		printf("goal states that diverge from the recording: %d\n", Divergences);
+	}
+}
+
+
+static void
+sim_log(SimNode *simNode, const char *fmt, ...)
+{
+	char message[BUFSIZE];
+	va_list args;
+
+	if (!Verbose)
+	{
+		return;
+	}
+
+	va_start(args, fmt);
+	vsnprintf(message, sizeof(message), fmt, args);
+	va_end(args);
+
+	printf("%9.3fs  %-16s  %s\n",
+		   TIMESTAMP_TO_SECS(SimulatedNow - PgStartTime -
+							 MS_TO_TIMESTAMP(StartupGracePeriodMs)),
+		   simNode != NULL ? simNode->name : "", message);
+}
+
+
+/*
+ * What follows replaces the parts of the monitor that group_state_machine.c
+ * uses, with an in-memory node store, and the virtual clock.
+ */
+
+TimestampTz
+GetCurrentTimestamp(void)
+{
+	return SimulatedNow;
+}
+
+
+bool
+TimestampDifferenceExceeds(TimestampTz start_time, TimestampTz stop_time,
+						   int msec)
+{
+	TimestampTz diff = stop_time - start_time;
+
+	return (diff >= msec * INT64CONST(1000));
+}
+
+
+AutoFailoverFormation *
+GetFormation(const char *formationId)
+{
+	return &Formation;
+}
+
+
+bool
+IsCitusFormation(AutoFailoverFormation *formation)
+{
+	return formation->kind == FORMATION_KIND_CITUS;
+}
+
+
+FormationKind
+FormationKindFromString(const char *kind)
+{
+	if (strcmp(kind, "pgsql") == 0)
+	{
+		return FORMATION_KIND_PGSQL;
+	}
+	else if (strcmp(kind, "citus") == 0)
+	{
+		return FORMATION_KIND_CITUS;
+	}
+
+	return FORMATION_KIND_UNKNOWN;
+}
+
+
+List *
+AutoFailoverNodeGroup(char *formationId, int groupId)
+{
+	return GroupNodeList;
+}
+
+
+AutoFailoverNode *
+OtherNodeInGroup(AutoFailoverNode *pgAutoFailoverNode)
+{
+	ListCell *nodeCell = NULL;
+
+	foreach(nodeCell, GroupNodeList)
+	{
+		AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (otherNode->nodeId != pgAutoFailoverNode->nodeId)
+		{
+			return otherNode;
+		}
+	}
+
+	return NULL;
+}
+
+
+bool
+IsCurrentState(AutoFailoverNode *pgAutoFailoverNode, ReplicationState state)
+{
+	return pgAutoFailoverNode != NULL
+		&& pgAutoFailoverNode->goalState == pgAutoFailoverNode->reportedState
+		&& pgAutoFailoverNode->goalState == state;
+}
+
+
+void
+SetNodeGoalState(char *nodeName, int nodePort, ReplicationState goalState)
+{
+	for (int nodeIndex = 0; nodeIndex < NodeCount; nodeIndex++)
+	{
+		AutoFailoverNode *node = &(Nodes[nodeIndex].node);
+
+		if (strcmp(node->nodeName, nodeName) == 0 && node->nodePort == nodePort)
+		{
+			node->goalState = goalState;
+			node->stateChangeTime = SimulatedNow;
+
+			if (TransitionCount < SIM_MAX_TRANSITIONS)
+			{
+				SimTransition *transition = &(Transitions[TransitionCount++]);
+
+				transition->nodeIndex = nodeIndex;
+				transition->fromState = node->reportedState;
+				transition->goalState = goalState;
+				transition->assignedTime = SimulatedNow;
+				transition->reachedTime =
+					node->reportedState == goalState ? SimulatedNow : 0;
+			}
+			return;
+		}
+	}
+}
+
+
+void
+LogAndNotifyMessage(char *message, size_t size, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(message, size, fmt, args);
+	va_end(args);
+}
+
+
+int64
+NotifyStateChange(ReplicationState reportedState,
+				  ReplicationState goalState,
+				  const char *formationId,
+				  int groupId,
+				  int64 nodeId,
+				  const char *nodeName,
+				  int nodePort,
+				  SyncState pgsrSyncState,
+				  XLogRecPtr reportedLSN,
+				  char *description)
+{
+	SimNode *simNode = sim_node_by_name((char *) nodeName, nodePort);
+
+	sim_log(simNode, "%s/%s: %s",
+			ReplicationStateGetName(reportedState),
+			ReplicationStateGetName(goalState),
+			description);
+
+	return ++EventId;
+}
+
+
+static SimNode *
+sim_node_by_name(char *nodeName, int nodePort)
+{
+	for (int nodeIndex = 0; nodeIndex < NodeCount; nodeIndex++)
+	{
+		if (strcmp(Nodes[nodeIndex].node.nodeName, nodeName) == 0 &&
+			Nodes[nodeIndex].node.nodePort == nodePort)
+		{
+			return &(Nodes[nodeIndex]);
+		}
+	}
+
+	return NULL;
+}
+
+
+void
+RecordNodeLagSample(char *nodeName, int nodePort, TimestampTz sampleTime,
+					XLogRecPtr reportedLSN, XLogRecPtr primaryLSN)
+{
+	SimNode *simNode = sim_node_by_name(nodeName, nodePort);
+	int lastSample = 0;
+
+	if (simNode == NULL)
+	{
+		return;
+	}
+
+	lastSample = (simNode->nextLagSample + LAG_HISTORY_SIZE - 1)
+				 % LAG_HISTORY_SIZE;
+
+	if (simNode->lagSampleCount == 0 ||
+		simNode->lagSamples[lastSample].sampleTime < sampleTime)
+	{
+		LagSample *sample = &(simNode->lagSamples[simNode->nextLagSample]);
+
+		sample->sampleTime = sampleTime;
+		sample->reportedLSN = reportedLSN;
+		sample->primaryLSN = primaryLSN;
+		sample->healthCheckRttMs = -1;
+
+		simNode->nextLagSample = (simNode->nextLagSample + 1) % LAG_HISTORY_SIZE;
+
+		if (simNode->lagSampleCount < LAG_HISTORY_SIZE)
+		{
+			simNode->lagSampleCount++;
+		}
+	}
+}
+
+
+int
+GetNodeLagSamples(char *nodeName, int nodePort, LagSample *samples)
+{
+	SimNode *simNode = sim_node_by_name(nodeName, nodePort);
+	int firstSample = 0;
+
+	if (simNode == NULL)
+	{
+		return 0;
+	}
+
+	firstSample = (simNode->nextLagSample + LAG_HISTORY_SIZE
+				   - simNode->lagSampleCount) % LAG_HISTORY_SIZE;
+
+	for (int sampleIndex = 0; sampleIndex < simNode->lagSampleCount; sampleIndex++)
+	{
+		samples[sampleIndex] =
+			simNode->lagSamples[(firstSample + sampleIndex) % LAG_HISTORY_SIZE];
+	}
+
+	return simNode->lagSampleCount;
+}
+
+
+TimestampTz
+RecordNodeWalLag(char *nodeName, int nodePort, bool lagging, TimestampTz now)
+{
+	SimNode *simNode = sim_node_by_name(nodeName, nodePort);
+
+	if (simNode == NULL)
+	{
+		return lagging ? now : 0;
+	}
+
+	if (!lagging)
+	{
+		simNode->walLagStartTime = 0;
+	}
+	else if (simNode->walLagStartTime == 0)
+	{
+		simNode->walLagStartTime = now;
+	}
+
+	return simNode->walLagStartTime;
+}
+
+
+const char *
+ReplicationStateGetName(ReplicationState replicationState)
+{
+	static const char *names[] = {
+		"init", "single", "wait_primary", "primary", "draining",
+		"demote_timeout", "demoted", "catchingup", "secondary",
+		"prepare_promotion", "stop_replication", "wait_standby",
+		"maintenance"
+	};
+
+	if (replicationState >= 0 && replicationState < REPLICATION_STATE_UNKNOWN)
+	{
+		return names[replicationState];
+	}
+
+	return "unknown";
+}
+
+
+/*
+ * The List functions of Postgres 10 to 12 that the state machine uses. The
+ * simulation doesn't free memory, so we use malloc.
+ */
+
+static List *
+new_list(NodeTag type, ListCell *cell)
+{
+	List *list = (List *) malloc(sizeof(List));
+
+	list->type = type;
+	list->length = 1;
+	list->head = cell;
+	list->tail = cell;
+
+	return list;
+}
+
+
+List *
+lappend(List *list, void *datum)
+{
+	ListCell *cell = (ListCell *) malloc(sizeof(ListCell));
+
+	cell->data.ptr_value = datum;
+	cell->next = NULL;
+
+	if (list == NIL)
+	{
+		return new_list(T_List, cell);
+	}
+
+	list->tail->next = cell;
+	list->tail = cell;
+	list->length++;
+
+	return list;
+}
+
+
+List *
+lcons_int(int datum, List *list)
+{
+	ListCell *cell = (ListCell *) malloc(sizeof(ListCell));
+
+	cell->data.int_value = datum;
+
+	if (list == NIL)
+	{
+		cell->next = NULL;
+		return new_list(T_IntList, cell);
+	}
+
+	cell->next = list->head;
+	list->head = cell;
+	list->length++;
+
+	return list;
+}
+
+
+bool
+list_member_int(const List *list, int datum)
+{
+	const ListCell *cell = NULL;
+
+	foreach(cell, list)
+	{
+		if (lfirst_int(cell) == datum)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+#ifdef USE_ASSERT_CHECKING
+void
+ExceptionalCondition(const char *conditionName, const char *errorType,
+					 const char *fileName, int lineNumber)
+{
+	fprintf(stderr, "TRAP: %s(\"%s\", File: \"%s\", Line: %d)\n",
+			errorType, conditionName, fileName, lineNumber);
+	abort();
+}
+#endif
@@ -23,6 +23,14 @@ select * from pgautofailover.get_primary();
 select * from pgautofailover.get_primary('default', 0);
 select * from pgautofailover.get_other_node('localhost', 9876);
 
+-- node_active can also return the other node and the primary of the group
+select assigned_group_state, other_node_name, other_node_port, other_node_lsn,
+       primary_node_name, primary_node_port, synchronous_commit
+  from pgautofailover.node_active_peers('default', 'localhost', 9876);
+
+-- the primary of a group waits for a quorum of its healthy standbys
+select pgautofailover.synchronous_standby_names('default', 0);
+
 select pgautofailover.remove_node('localhost', 9876);
 
 table pgautofailover.formation;
@@ -36,3 +44,126 @@ select * from pgautofailover.node_active('default', 'localhost', 9876);
 
 -- should fail as there's no primary at this point
 select pgautofailover.perform_failover();
+select pgautofailover.perform_switchover();
+
+-- the keeper of a node reports the timings of its last state transition
+select pgautofailover.report_transition_timings('localhost', 9877,
+       'init', 'single', true, 12.5, '  pg_ctl start 1 x 12.000 ms');
+
+select nodename, nodeport, fromstate, tostate, succeeded, durationms
+  from pgautofailover.transition_timing;
+
+-- clients that missed notifications catch up from the last event they saw
+select count(*) = (select count(*) from pgautofailover.event) as all_events
+  from pgautofailover.events_since(0);
+
+select count(*) as new_events
+  from pgautofailover.events_since((select max(eventid)
+                                      from pgautofailover.event));
+
+-- connection strings that only target the nodes fit for a role
+select pgautofailover.formation_uri('default', 'read-write');
+select pgautofailover.formation_uri('default', 'read-only');
+select pgautofailover.formation_uri('default', 'primary');
+
+-- keepers report the results of the hooks they ran around a transition
+select pgautofailover.report_hook_result('localhost', 9877, 'post_transition',
+       'init', 'single', true, 120.5, 'exit code 0');
+select description
+  from pgautofailover.event
+ order by eventid desc
+ limit 1;
+
+-- a root monitor has the nodes of a formation register with another monitor
+select pgautofailover.delegate_formation('default', 'postgres://eu-monitor:5432/pg_auto_failover');
+select pgautofailover.delegate_formation('eu', 'postgres://eu-monitor:5432/pg_auto_failover');
+select pgautofailover.formation_monitor('eu');
+select pgautofailover.undelegate_formation('eu');
+select pgautofailover.formation_monitor('eu');
+
+-- rolling operations only know about switchover, failover and maintenance
+select pgautofailover.rolling_operation('default', 'reboot');
+
+-- the catch-up progress of the catchingup standby nodes
+select count(*) as catching_up from pgautofailover.stat_catchup;
+
+-- primaries report the WAL that their replication slot retains
+select pgautofailover.report_retained_wal('unknown', 5432, 16777216);
+select pgautofailover.release_standby_slot('unknown', 5432, 16777216);
+
+-- standbys report whether they stream or restore WAL from the archive
+select pgautofailover.report_wal_source('unknown', 5432, 'archive', 16777216);
+
+-- the node and event tables have their own autovacuum settings
+select relname, reloptions
+  from pg_class
+ where oid in ('pgautofailover.node'::regclass, 'pgautofailover.event'::regclass)
+ order by relname;
+
+-- a batch of node reports runs each report on its own, and returns its error
+select node_name, node_port, assigned_group_state, error
+  from pgautofailover.node_active_batch(array[
+         row('default', 'localhost', 9876, 1, 0, 'single'::pgautofailover.replication_state,
+             true, '0/0'::pg_lsn, 'unknown')::pgautofailover.node_report,
+         row('default', 'localhost', 9877, 2, 0, 'single'::pgautofailover.replication_state,
+             true, '0/0'::pg_lsn, 'unknown')::pgautofailover.node_report])
+ order by node_port;
+
+-- a group has any number of standby nodes, that the primary waits for
+select * from pgautofailover.register_node('default', 'localhost', 9878, 'postgres');
+select * from pgautofailover.register_node('default', 'localhost', 9879, 'postgres');
+
+select * from pgautofailover.node_active('default', 'localhost', 9878, 3, 0, 'wait_standby');
+select * from pgautofailover.node_active('default', 'localhost', 9877, 2, 0, 'single');
+
+select * from pgautofailover.get_other_nodes('localhost', 9877);
+
+-- the primary stays in wait_primary until no other node is joining
+select * from pgautofailover.node_active('default', 'localhost', 9877, 2, 0, 'wait_primary');
+select * from pgautofailover.node_active('default', 'localhost', 9878, 3, 0, 'wait_standby');
+
+-- failover promotes the standby with the highest candidate priority
+select pgautofailover.set_node_candidate_priority('localhost', 9878, 50);
+select pgautofailover.set_node_candidate_priority('localhost', 9878, 101);
+select pgautofailover.set_node_candidate_priority('unknown', 5432, 50);
+
+select nodeport, candidatepriority
+  from pgautofailover.node
+ order by nodeid;
+
+-- standby nodes stream from the first secondary node of their zone
+select pgautofailover.set_node_zone('localhost', 9878, 'eu');
+select pgautofailover.set_node_zone('localhost', 9879, 'eu');
+select pgautofailover.set_node_zone('unknown', 5432, 'eu');
+
+-- the health checks would find node 3 to be a healthy secondary by now
+update pgautofailover.node
+   set goalstate = 'secondary', reportedstate = 'secondary', health = 1
+ where nodeport = 9878;
+
+select assigned_group_state, primary_node_port,
+       upstream_node_name, upstream_node_port
+  from pgautofailover.node_active_peers('default', 'localhost', 9879, 4, 0, 'wait_standby');
+select assigned_group_state, upstream_node_port
+  from pgautofailover.node_active_peers('default', 'localhost', 9878, 3, 0, 'secondary');
+
+-- the primary waits for the healthy secondary nodes that stream from it
+select pgautofailover.synchronous_standby_names('default', 0);
+
+-- node 4 streams from node 3, so the primary doesn't wait for it
+update pgautofailover.node
+   set goalstate = 'secondary', reportedstate = 'secondary', health = 1
+ where nodeport = 9879;
+
+select pgautofailover.synchronous_standby_names('default', 0);
+
+select pgautofailover.set_node_zone('localhost', 9879, '');
+select pgautofailover.synchronous_standby_names('default', 0);
+
+-- the quorum is number_sync_standbys, up to the number of standby nodes
+select pgautofailover.set_formation_number_sync_standbys('default', 2);
+select pgautofailover.synchronous_standby_names('default', 0);
+
+select pgautofailover.set_formation_number_sync_standbys('default', 3);
+select synchronous_standby_names
+  from pgautofailover.node_active_peers('default', 'localhost', 9877, 2, 0, 'wait_primary');
@@ -0,0 +1,39 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/wait_events.h
+ *	  Wait events reported by the pg_auto_failover monitor.
+ *
+ * Postgres 10 to 12 have no API for an extension to name its wait events,
+ * so pg_stat_activity shows all of them as wait_event "Extension". The
+ * monitor then also reports the phase it is in as the activity text, which
+ * shows up in pg_stat_activity.query.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "pgstat.h"
+
+
+/* the health check worker waits for the sockets of its health checks */
+#define WAIT_EVENT_HEALTH_CHECK_POLL (PG_WAIT_EXTENSION | 1)
+
+/* a monitor worker sleeps until its next round */
+#define WAIT_EVENT_HEALTH_CHECK_ROUND (PG_WAIT_EXTENSION | 2)
+
+/* node_active waits for the group state to change */
+#define WAIT_EVENT_NODE_ACTIVE_WAIT (PG_WAIT_EXTENSION | 3)
+
+/* the http api worker waits for a client connection */
+#define WAIT_EVENT_HTTP_API_ACCEPT (PG_WAIT_EXTENSION | 4)
+
+/* activity texts for the phases of the monitor workers */
+#define ACTIVITY_HEALTH_CHECK_POLL "poll health checks"
+#define ACTIVITY_HEALTH_CHECK_ROUND "wait for the next round"
+#define ACTIVITY_FLUSH_EVENTS "flush buffered events"
@@ -0,0 +1,203 @@
+import json
+import os
+import os.path
+import select
+import threading
+import time
+import psycopg2
+import psycopg2.extensions
+
+"""
+Failover latency harness: a write workload runs against the formation URI
+while a failover scenario plays out, and we then compute how long it took
+the monitor to detect the failure, how long it took to promote the standby,
+and how long the clients could not write.
+
+The monitor and the nodes run on the same host, in network namespaces, so
+the monitor event times and the client times come from the same clock.
+"""
+
+# the workload writes that often, which bounds the precision of the write gap
+WRITE_INTERVAL = 0.01
+
+# a write that takes longer than that is considered failed, which is needed
+# when the primary is partitioned away and our packets are silently dropped
+WRITE_TIMEOUT = 1.0
+
+class WriteWorkload:
+    """
+    Inserts a row every WRITE_INTERVAL seconds through the given URI, in a
+    background thread, reconnecting as needed, and records the time of the
+    writes that succeeded.
+    """
+    def __init__(self, uri, username, table="failover_bench"):
+        self.uri = uri
+        self.username = username
+        self.table = table
+        self.successes = []
+        self.failures = 0
+        self.lock = threading.Lock()
+        self.stopping = threading.Event()
+        self.thread = None
+        self.conn = None
+
+    def start(self):
+        """
+        Creates the table when needed and starts writing.
+        """
+        self._execute("CREATE TABLE IF NOT EXISTS %s"
+                      "(id bigserial primary key, ts timestamptz default now())"
+                      % self.table)
+        self.thread = threading.Thread(target=self._run, daemon=True)
+        self.thread.start()
+
+    def stop(self):
+        """
+        Stops writing, and returns the times of the successful writes.
+        """
+        self.stopping.set()
+        if self.thread:
+            self.thread.join()
+        self._close()
+        return self.successes
+
+    def write_gap(self, since, until):
+        """
+        Returns the longest time between two successful writes in the given
+        time range, and the time of the first write that succeeded after it,
+        or None when no write succeeded after it.
+        """
+        with self.lock:
+            writes = [since] + [t for t in self.successes
+                                if since < t <= until]
+
+        gap, resumed = 0.0, None
+        for previous, current in zip(writes, writes[1:]):
+            if current - previous > gap:
+                gap, resumed = current - previous, current
+
+        # writes that did not resume at all are a gap until the end
+        if until - writes[-1] > gap:
+            gap, resumed = until - writes[-1], None
+        return gap, resumed
+
+    def last_write(self):
+        with self.lock:
+            return self.successes[-1] if self.successes else None
+
+    def _run(self):
+        while not self.stopping.is_set():
+            try:
+                self._execute("INSERT INTO %s DEFAULT VALUES" % self.table)
+                with self.lock:
+                    self.successes.append(time.time())
+            except (psycopg2.Error, TimeoutError):
+                # the next write reconnects using the formation URI, which
+                # finds the new primary with target_session_attrs
+                self.failures += 1
+                self._close()
+            time.sleep(WRITE_INTERVAL)
+
+    def _execute(self, query):
+        if self.conn is None:
+            self.conn = psycopg2.connect(self.uri, user=self.username,
+                                         connect_timeout=1, async_=1)
+            _wait(self.conn, WRITE_TIMEOUT)
+        cur = self.conn.cursor()
+        cur.execute(query)
+        _wait(self.conn, WRITE_TIMEOUT)
+
+    def _close(self):
+        if self.conn is not None:
+            try:
+                self.conn.close()
+            except psycopg2.Error:
+                pass
+            self.conn = None
+
+def _wait(conn, timeout):
+    """
+    Waits until the asynchronous operation of the connection is done, or
+    raises TimeoutError.
+    """
+    deadline = time.time() + timeout
+    while True:
+        state = conn.poll()
+        if state == psycopg2.extensions.POLL_OK:
+            return
+        remaining = deadline - time.time()
+        if remaining <= 0:
+            raise TimeoutError("no answer from Postgres after %gs" % timeout)
+        if state == psycopg2.extensions.POLL_READ:
+            select.select([conn.fileno()], [], [], remaining)
+        elif state == psycopg2.extensions.POLL_WRITE:
+            select.select([], [conn.fileno()], [], remaining)
+        else:
+            raise psycopg2.OperationalError("bad state from poll: %s" % state)
+
+def event_time(monitor, nodeid, since, reportedstates=None, goalstates=None):
+    """
+    Returns the time of the first monitor event after since about the given
+    node, and that has one of the given reported or goal states.
+    """
+    results = monitor.run_sql_query(
+        """
+SELECT extract(epoch from eventtime)::float8
+  FROM pgautofailover.event
+ WHERE nodeid = %s
+   AND eventtime > to_timestamp(%s)
+   AND (reportedstate::text = ANY(%s) OR goalstate::text = ANY(%s))
+ ORDER BY eventid
+ LIMIT 1
+""",
+        nodeid, since, reportedstates or [], goalstates or [])
+    return results[0][0] if results else None
+
+class FailoverReport:
+    """
+    Collects the measurements of the failover scenarios, and writes them as
+    JSON to the file named in PG_AUTOCTL_FAILOVER_REPORT, or to the given
+    default path.
+    """
+    def __init__(self, path):
+        self.path = os.getenv("PG_AUTOCTL_FAILOVER_REPORT", path)
+        self.scenarios = []
+
+    def measure(self, name, monitor, workload, candidate, started, ended):
+        """
+        Computes the measurements of a scenario that started at started and
+        where candidate is expected to have been promoted before ended.
+
+         - time_to_detect: the monitor assigns prepare_promotion to candidate
+         - time_to_promote: candidate reports wait_primary or primary
+         - write_gap: the longest time without a successful client write
+        """
+        detected = event_time(monitor, candidate.nodeid, started,
+                              goalstates=["prepare_promotion"])
+        promoted = event_time(monitor, candidate.nodeid, started,
+                              reportedstates=["wait_primary", "primary"])
+        gap, resumed = workload.write_gap(started, ended)
+
+        scenario = {
+            "scenario": name,
+            "time_to_detect": _elapsed(started, detected),
+            "time_to_promote": _elapsed(started, promoted),
+            "write_gap": round(gap, 3),
+            "writes_resumed": _elapsed(started, resumed),
+            "failed_writes": workload.failures,
+        }
+        workload.failures = 0
+
+        print("failover latency: %s" % json.dumps(scenario))
+        self.scenarios.append(scenario)
+        return scenario
+
+    def write(self):
+        os.makedirs(os.path.dirname(self.path), exist_ok=True)
+        with open(self.path, "w") as f:
+            json.dump({"write_interval": WRITE_INTERVAL,
+                       "scenarios": self.scenarios}, f, indent=2)
+        print("failover latency report written to %s" % self.path)
+
+def _elapsed(started, t):
+    return round(t - started, 3) if t is not None else None
@@ -0,0 +1,179 @@
+import argparse
+import asyncio
+import os
+import resource
+import signal
+import struct
+
+"""
+Health check scale harness: many simulated endpoints for the health check
+workers of a monitor, each of which accepts, refuses or black-holes the
+health check connections.
+
+All the endpoints live in a single process that runs in the network namespace
+of the monitor, where the whole of 127.0.0.0/8 is local: endpoint i is at the
+address endpoint_address(i), so that one listening socket serves all of the
+accepting and black-holing endpoints, and tells them apart by the address the
+connection was made to. Refusing endpoints use the next port, where nothing
+listens.
+
+Run as a script, this module is the endpoint server:
+
+  python3 health_check_bench.py --port 6000 --blackhole-pct 10 --latency-ms 50
+"""
+
+ACCEPT = "accept"
+REFUSE = "refuse"
+BLACKHOLE = "blackhole"
+
+# the health check worker asks for SSL or GSS encryption before the startup
+SSL_REQUEST_CODE = 80877103
+GSSENC_REQUEST_CODE = 80877104
+
+def endpoint_address(index):
+    """
+    Returns the loopback address of the given endpoint.
+    """
+    return "127.%d.%d.%d" % (1 + index // 62500,
+                             (index // 250) % 250 + 1,
+                             index % 250 + 1)
+
+def endpoint_index(address):
+    """
+    Returns the index of the endpoint at the given loopback address.
+    """
+    a, b, c, d = [int(x) for x in address.split(".")]
+    return (b - 1) * 62500 + (c - 1) * 250 + (d - 1)
+
+def endpoint_behaviour(index, blackhole_pct, refuse_pct):
+    """
+    Returns how the given endpoint answers the health checks. The behaviours
+    are spread evenly over the endpoints.
+    """
+    r = index % 100
+    if r < blackhole_pct:
+        return BLACKHOLE
+    if r < blackhole_pct + refuse_pct:
+        return REFUSE
+    return ACCEPT
+
+def endpoint_sql(count, port, blackhole_pct, refuse_pct):
+    """
+    Returns a SQL script that registers count endpoints in the "scale"
+    formation of the monitor, each in its own group as a single node so that
+    the state machine has nothing to do when their health changes.
+    """
+    # keep in sync with endpoint_address and endpoint_behaviour
+    return """
+INSERT INTO pgautofailover.formation(formationid, kind, dbname, opt_secondary)
+     VALUES ('scale', 'pgsql', 'postgres', false)
+ON CONFLICT DO NOTHING;
+
+INSERT INTO pgautofailover.node(formationid, groupid, nodename, nodeport,
+                                goalstate, reportedstate)
+     SELECT 'scale', i,
+            format('127.%%s.%%s.%%s', 1 + i / 62500, (i / 250) %% 250 + 1,
+                   i %% 250 + 1),
+            case when i %% 100 >= %d and i %% 100 < %d
+                 then %d else %d end,
+            'single', 'single'
+       FROM generate_series(0, %d) AS i;
+""" % (blackhole_pct, blackhole_pct + refuse_pct, port + 1, port, count - 1)
+
+def error_response(sqlstate, message):
+    """
+    Returns a Postgres protocol ErrorResponse message. Any SQLSTATE but
+    cannot_connect_now tells the health check that Postgres is running.
+    """
+    fields = b"SFATAL\0" + \
+        b"C" + sqlstate.encode() + b"\0" + \
+        b"M" + message.encode() + b"\0" + b"\0"
+    return b"E" + struct.pack("!I", len(fields) + 4) + fields
+
+class EndpointServer:
+    def __init__(self, latency_ms, blackhole_pct, refuse_pct):
+        self.latency = latency_ms / 1000.0
+        self.blackhole_pct = blackhole_pct
+        self.refuse_pct = refuse_pct
+        self.connections = {ACCEPT: 0, BLACKHOLE: 0, REFUSE: 0}
+
+    async def handle(self, reader, writer):
+        address = writer.get_extra_info("sockname")[0]
+        behaviour = endpoint_behaviour(endpoint_index(address),
+                                       self.blackhole_pct, self.refuse_pct)
+        self.connections[behaviour] += 1
+
+        try:
+            if behaviour == BLACKHOLE:
+                # read and never answer, until the health check times out
+                while await reader.read(1024):
+                    pass
+                return
+
+            await asyncio.sleep(self.latency)
+
+            while True:
+                length, = struct.unpack("!I", await reader.readexactly(4))
+                payload = await reader.readexactly(length - 4)
+                code, = struct.unpack("!I", payload[:4])
+
+                if code in (SSL_REQUEST_CODE, GSSENC_REQUEST_CODE):
+                    writer.write(b"N")
+                    continue
+                break
+
+            writer.write(error_response("28000", "simulated endpoint"))
+            await writer.drain()
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        finally:
+            writer.close()
+
+def serve(port, latency_ms, blackhole_pct, refuse_pct):
+    # black-holed connections stay open until the health check times out
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+
+    server = EndpointServer(latency_ms, blackhole_pct, refuse_pct)
+    loop = asyncio.get_event_loop()
+    listener = loop.run_until_complete(
+        asyncio.start_server(server.handle, "0.0.0.0", port, backlog=4096))
+
+    loop.add_signal_handler(signal.SIGTERM, loop.stop)
+    print("serving endpoints on port %d" % port, flush=True)
+
+    try:
+        loop.run_forever()
+    finally:
+        listener.close()
+        print("connections: %s" % server.connections, flush=True)
+
+def percentile(values, pct):
+    if not values:
+        return None
+    values = sorted(values)
+    return values[int(pct / 100.0 * (len(values) - 1))]
+
+def worker_cpu_seconds(pids):
+    """
+    Returns the CPU time used so far by the given processes, in seconds.
+    """
+    ticks = os.sysconf("SC_CLK_TCK")
+    total = 0
+    for pid in pids:
+        with open("/proc/%d/stat" % pid) as f:
+            # the command name may contain spaces, skip past it
+            fields = f.read().rsplit(")", 1)[1].split()
+        # utime and stime are the 14th and 15th fields of the whole line
+        total += int(fields[11]) + int(fields[12])
+    return total / ticks
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="simulated endpoints")
+    parser.add_argument("--port", type=int, required=True)
+    parser.add_argument("--latency-ms", type=int, default=0)
+    parser.add_argument("--blackhole-pct", type=int, default=0)
+    parser.add_argument("--refuse-pct", type=int, default=0)
+    args = parser.parse_args()
+
+    serve(args.port, args.latency_ms, args.blackhole_pct, args.refuse_pct)
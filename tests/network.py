@@ -120,6 +120,22 @@ class VirtualNode:
             # Namespace doesn't exist. Return silently.
             pass
 
+    def disconnect(self):
+        """
+        Partitions the node away from the virtual network, by bringing down
+        its end of the veth pair on the bridge. Packets are then silently
+        dropped rather than refused, as with a real network failure.
+        """
+        with IPRoute() as ipr:
+            ipr.link('set', ifname=self.vethPeer, state='down')
+
+    def reconnect(self):
+        """
+        Connects the node to the virtual network again after disconnect().
+        """
+        with IPRoute() as ipr:
+            ipr.link('set', ifname=self.vethPeer, state='up')
+
     def run(self, command, user=os.getenv("USER")):
         """
         Executes a command under the given user from this virtual node. Returns
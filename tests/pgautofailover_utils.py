@@ -55,12 +55,15 @@ class Cluster:
     # TODO group should auto sense for normal operations and passed to the
     # create cli as an argument when explicitly set by the test
     def create_datanode(self, datadir, port=5432, group=0,
-                        listen_flag=False, role=Role.Postgres, formation=None, authMethod=None):
+                        listen_flag=False, role=Role.Postgres, formation=None, authMethod=None,
+                        vnode=None):
         """
         Initializes a data node and returns an instance of DataNode. This will
-        do the "keeper init" and "pg_autoctl run" commands.
+        do the "keeper init" and "pg_autoctl run" commands. Data nodes that
+        share the given vnode run on the same host, on different ports.
         """
-        vnode = self.vlan.create_node()
+        if vnode is None:
+            vnode = self.vlan.create_node()
         nodeid = len(self.datanodes) + 1
         datanode = DataNode(datadir, vnode, port, os.getenv("USER"), authMethod, "postgres",
                             self.monitor, nodeid, group, listen_flag,
@@ -68,6 +71,21 @@ class Cluster:
         self.datanodes.append(datanode)
         return datanode
 
+    def supervise(self, datanodes):
+        """
+        Runs "pg_autoctl supervise" for the given data nodes, which must share
+        the same vnode, and returns the supervisor process. Only the first data
+        node stops the supervisor in stop_pg_autoctl.
+        """
+        vnode = datanodes[0].vnode
+        supervise_command = [shutil.which('pg_autoctl'), 'supervise'] + \
+            [datanode.datadir for datanode in datanodes]
+        proc = vnode.run(supervise_command)
+        for datanode in datanodes:
+            datanode.pg_autoctl_run_proc = None
+        datanodes[0].pg_autoctl_run_proc = proc
+        return proc
+
     def destroy(self):
         """
         Cleanup whatever was created for this Cluster.
@@ -140,6 +158,19 @@ class PGNode:
                          timeout=COMMAND_TIMEOUT)
         self.authenticatedUsers[username] = password
     
+    def run_psql(self, command, name="psql"):
+        """
+        Runs the given SQL command with psql from this node, as the owner of
+        the Postgres instance, which bypasses the privileges of the user used
+        in run_sql_query.
+        """
+        psql_command = [shutil.which('psql'), '-d', self.database,
+                        '-v', 'ON_ERROR_STOP=1', '-c', command]
+        psql_proc = self.vnode.run(psql_command)
+        return wait_or_timeout_proc(psql_proc,
+                                    name=name,
+                                    timeout=COMMAND_TIMEOUT)
+
     def stop_pg_autoctl(self):
         """
         Kills the keeper by sending a SIGTERM to keeper's process group.
@@ -250,6 +281,21 @@ class PGNode:
                             pgdata,
                             "pg_autoctl.cfg")
 
+    def pid_file_path(self):
+        """
+        Returns the path of the pid file for this data node.
+        """
+        # Pid file is located at:
+        # ${XDG_RUNTIME_DIR:-/tmp}/pg_autoctl/${PGDATA}/pg_autoctl.pid
+        runtime = os.getenv("XDG_RUNTIME_DIR")
+        if runtime is None or not os.path.isdir(runtime):
+            runtime = "/tmp"
+        pgdata = os.path.abspath(self.datadir)[1:] # Remove the starting '/'
+        return os.path.join(runtime,
+                            "pg_autoctl",
+                            pgdata,
+                            "pg_autoctl.pid")
+
     def state_file_path(self):
         """
         Returns the path of the state file for this data node.
@@ -483,6 +529,15 @@ class MonitorNode(PGNode):
                              name="disable feature",
                              timeout=COMMAND_TIMEOUT)
 
+    def formation_uri(self, formation='default'):
+        """
+        Returns the connection string that clients use to connect to the
+        primary of the given formation.
+        """
+        results = self.run_sql_query(
+            "SELECT pgautofailover.formation_uri(%s)", formation)
+        return results[0][0]
+
     def failover(self, formation='default', group=0):
         """
         performs manual failover for given formation and group id
@@ -494,6 +549,17 @@ class MonitorNode(PGNode):
                          name="manual failover",
                          timeout=COMMAND_TIMEOUT)
 
+    def switchover(self, formation='default', group=0):
+        """
+        performs a switchover for given formation and group id
+        """
+        switchover_command_text = "select * from pgautofailover.perform_switchover('%s', %s)" %(formation, group)
+        switchover_command = [shutil.which('psql'), '-d', self.database, '-c', switchover_command_text]
+        switchover_proc = self.vnode.run(switchover_command)
+        wait_or_timeout_proc(switchover_proc,
+                         name="switchover",
+                         timeout=COMMAND_TIMEOUT)
+
 
 
 def wait_or_timeout_proc(proc, name, timeout):
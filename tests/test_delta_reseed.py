@@ -0,0 +1,74 @@
+import os
+import re
+import shutil
+
+import pgautofailover_utils as pgautofailover
+from nose.tools import *
+
+cluster = None
+node1 = None
+node2 = None
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster()
+
+def teardown_module():
+    cluster.destroy()
+
+def run_pg_ctl(node, *args):
+    pg_ctl_command = [shutil.which('pg_ctl'), '-D', node.datadir] + list(args)
+    pg_ctl_proc = node.vnode.run(pg_ctl_command)
+    pgautofailover.wait_or_timeout_proc(pg_ctl_proc,
+                                        name="pg_ctl %s" % args[0],
+                                        timeout=pgautofailover.COMMAND_TIMEOUT)
+
+def test_000_create_monitor():
+    cluster.create_monitor("/tmp/delta/monitor")
+
+def test_001_init_primary():
+    global node1
+    node1 = cluster.create_datanode("/tmp/delta/node1")
+    node1.create()
+    node1.run()
+    assert node1.wait_until_state(target_state="single")
+
+def test_002_create_t1():
+    node1.run_sql_query("CREATE TABLE t1(a int)")
+    node1.run_sql_query("INSERT INTO t1 VALUES (1), (2)")
+
+def test_003_init_secondary():
+    global node2
+    node2 = cluster.create_datanode("/tmp/delta/node2")
+    node2.create()
+    node2.run()
+    assert node2.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+def test_004_fail_primary():
+    node1.fail()
+    assert node2.wait_until_state(target_state="wait_primary")
+    node2.run_sql_query("INSERT INTO t1 VALUES (3)")
+
+def test_005_diverge_old_primary():
+    # the old primary accepts a write that the new primary never sees
+    run_pg_ctl(node1, 'start', '--wait',
+               '-o', "-p %d -c listen_addresses='*'" % node1.port)
+    node1.run_sql_query("INSERT INTO t1 VALUES (42)")
+    run_pg_ctl(node1, 'stop', '--wait', '--mode', 'fast')
+
+    # without its WAL, pg_rewind can't rewind the old primary, so the keeper
+    # re-seeds it from a delta of the new primary
+    waldir = os.path.join(node1.datadir, "pg_wal")
+    for name in os.listdir(waldir):
+        if re.match("^[0-9A-F]{24}$", name):
+            os.remove(os.path.join(waldir, name))
+
+def test_006_reseed_old_primary():
+    node1.run()
+    assert node2.wait_until_state(target_state="primary")
+    assert node1.wait_until_state(target_state="secondary")
+
+def test_007_read_from_reseeded_secondary():
+    results = node1.run_sql_query("SELECT * FROM t1 ORDER BY a")
+    assert results == [(1,), (2,), (3,)]
@@ -0,0 +1,102 @@
+import time
+import failover_bench
+import pgautofailover_utils as pgautofailover
+from nose.tools import *
+
+cluster = None
+monitor = None
+node1 = None
+node2 = None
+workload = None
+report = None
+
+def setup_module():
+    global cluster, report
+    cluster = pgautofailover.Cluster()
+    report = failover_bench.FailoverReport("/tmp/failover/report.json")
+
+def teardown_module():
+    if workload:
+        workload.stop()
+    cluster.destroy()
+
+def wait_for_writes(since, timeout=pgautofailover.STATE_CHANGE_TIMEOUT):
+    """
+    Waits until a client write succeeds after the given time.
+    """
+    for i in range(timeout * 10):
+        last = workload.last_write()
+        if last is not None and last > since:
+            return True
+        time.sleep(0.1)
+    print("no client write succeeded after %d seconds" % timeout)
+    return False
+
+def measure(name, candidate, started):
+    scenario = report.measure(name, monitor, workload, candidate,
+                              started, time.time())
+    assert scenario["time_to_detect"] is not None
+    assert scenario["time_to_promote"] is not None
+    assert scenario["writes_resumed"] is not None
+
+def test_000_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/failover/monitor")
+
+def test_001_init_primary():
+    global node1
+    node1 = cluster.create_datanode("/tmp/failover/node1")
+    node1.create()
+    node1.run()
+    assert node1.wait_until_state(target_state="single")
+
+def test_002_init_secondary():
+    global node2
+    node2 = cluster.create_datanode("/tmp/failover/node2")
+    node2.create()
+    node2.run()
+    assert node2.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+def test_003_start_workload():
+    global workload
+    workload = failover_bench.WriteWorkload(monitor.formation_uri(),
+                                            node1.username)
+    workload.start()
+    assert wait_for_writes(time.time())
+
+def test_004_perform_failover():
+    started = time.time()
+    monitor.failover()
+    assert node2.wait_until_state(target_state="primary")
+    assert wait_for_writes(started)
+    measure("perform_failover", node2, started)
+    assert node1.wait_until_state(target_state="secondary")
+
+def test_005_crash_primary():
+    started = time.time()
+    node2.fail()
+    assert node1.wait_until_state(target_state="wait_primary")
+    assert wait_for_writes(started)
+    measure("crash", node1, started)
+
+    node2.run()
+    assert node2.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+def test_006_partition_primary():
+    started = time.time()
+    node1.vnode.disconnect()
+    assert node2.wait_until_state(target_state="wait_primary")
+    assert wait_for_writes(started)
+    measure("network_partition", node2, started)
+
+    node1.vnode.reconnect()
+    assert node1.wait_until_state(target_state="secondary")
+    assert node2.wait_until_state(target_state="primary")
+
+def test_007_write_report():
+    global workload
+    workload.stop()
+    workload = None
+    report.write()
@@ -0,0 +1,188 @@
+import json
+import os
+import os.path
+import signal
+import time
+import health_check_bench as bench
+import pgautofailover_utils as pgautofailover
+from nose.tools import *
+
+# the load profile, that the environment can change to run at a larger scale
+NODES = int(os.getenv("PG_AUTOCTL_HEALTH_CHECK_NODES", "1000"))
+BLACKHOLE_PCT = int(os.getenv("PG_AUTOCTL_HEALTH_CHECK_BLACKHOLE_PCT", "10"))
+REFUSE_PCT = int(os.getenv("PG_AUTOCTL_HEALTH_CHECK_REFUSE_PCT", "5"))
+LATENCY_MS = int(os.getenv("PG_AUTOCTL_HEALTH_CHECK_LATENCY_MS", "50"))
+REPORT = os.getenv("PG_AUTOCTL_HEALTH_CHECK_REPORT",
+                   "/tmp/healthcheck/report.json")
+
+ENDPOINT_PORT = 6000
+
+# shorter than the defaults, to keep the test duration reasonable
+HEALTH_CHECK_SETTINGS = {
+    "pgautofailover.health_check_period": 10000,
+    "pgautofailover.health_check_timeout": 2000,
+    "pgautofailover.health_check_retry_delay": 1000,
+    "pgautofailover.health_check_max_retries": 2,
+    "pgautofailover.health_check_max_backoff": 1,
+}
+
+cluster = None
+monitor = None
+endpoints = None
+registered = None
+worker_pids = []
+cpu_at_start = 0.0
+report = {}
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster()
+
+def teardown_module():
+    if endpoints:
+        os.killpg(os.getpgid(endpoints.pid), signal.SIGTERM)
+    cluster.destroy()
+
+def expected_behaviours():
+    return dict(((bench.endpoint_address(i),
+                  bench.endpoint_behaviour(i, BLACKHOLE_PCT, REFUSE_PCT))
+                 for i in range(NODES)))
+
+def node_health():
+    """
+    Returns the health of the simulated endpoints, by address.
+    """
+    results = monitor.run_sql_query(
+        "SELECT nodename, health FROM pgautofailover.node "
+        " WHERE formationid = 'scale'")
+    return dict(results)
+
+def health_checks():
+    """
+    Returns how many times each simulated endpoint has been checked.
+    """
+    results = monitor.run_sql_query(
+        "SELECT nodename, checks FROM pgautofailover.health_check_stats()")
+    return dict(results)
+
+def test_000_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/healthcheck/monitor")
+
+    for name, value in HEALTH_CHECK_SETTINGS.items():
+        monitor.run_psql("ALTER SYSTEM SET %s TO %d" % (name, value))
+    monitor.run_psql("SELECT pg_reload_conf()")
+
+def test_001_start_endpoints():
+    global endpoints
+    server = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                          "health_check_bench.py")
+    endpoints = monitor.vnode.run(["python3", server,
+                                   "--port", str(ENDPOINT_PORT),
+                                   "--latency-ms", str(LATENCY_MS),
+                                   "--blackhole-pct", str(BLACKHOLE_PCT),
+                                   "--refuse-pct", str(REFUSE_PCT)])
+    assert endpoints.stdout.readline().startswith("serving endpoints")
+
+def test_002_register_endpoints():
+    global registered, worker_pids, cpu_at_start
+    results = monitor.run_sql_query(
+        "SELECT pid FROM pg_stat_activity "
+        " WHERE application_name = 'pg_auto_failover health check worker'")
+    worker_pids = [pid for pid, in results]
+    assert len(worker_pids) > 0
+
+    cpu_at_start = bench.worker_cpu_seconds(worker_pids)
+    registered = time.time()
+    monitor.run_psql(bench.endpoint_sql(NODES, ENDPOINT_PORT,
+                                        BLACKHOLE_PCT, REFUSE_PCT),
+                     name="register endpoints")
+
+def test_003_mark_unreachable_nodes():
+    """
+    Waits until all the unreachable endpoints have been marked bad, and
+    measures how long each of them took.
+    """
+    behaviours = expected_behaviours()
+    unreachable = set(address for address, behaviour in behaviours.items()
+                      if behaviour != bench.ACCEPT)
+    detected = {}
+
+    # the first check of a node happens within a period of its registration,
+    # and then all of the retries have to time out
+    period = HEALTH_CHECK_SETTINGS["pgautofailover.health_check_period"]
+    timeout = HEALTH_CHECK_SETTINGS["pgautofailover.health_check_timeout"]
+    delay = HEALTH_CHECK_SETTINGS["pgautofailover.health_check_retry_delay"]
+    retries = HEALTH_CHECK_SETTINGS["pgautofailover.health_check_max_retries"]
+    expected = (period + (retries + 1) * timeout + retries * delay) / 1000.0
+    deadline = registered + 2 * expected + 10
+
+    while time.time() < deadline and len(detected) < len(unreachable):
+        now = time.time()
+        for address, health in node_health().items():
+            if health == 0 and address in unreachable and \
+               address not in detected:
+                detected[address] = now - registered
+        time.sleep(1)
+
+    delays = list(detected.values())
+    report["unreachable_nodes"] = len(unreachable)
+    report["expected_detection_s"] = expected
+    report["detection_p50_s"] = bench.percentile(delays, 50)
+    report["detection_p99_s"] = bench.percentile(delays, 99)
+    report["detection_max_s"] = bench.percentile(delays, 100)
+
+    assert len(detected) == len(unreachable)
+
+def test_004_round_duration():
+    """
+    Measures how long the workers take to check every node once, when they
+    have no new node to schedule.
+    """
+    before = health_checks()
+    started = time.time()
+    deadline = started + pgautofailover.STATE_CHANGE_TIMEOUT
+    pending = set(bench.endpoint_address(i) for i in range(NODES))
+
+    while pending and time.time() < deadline:
+        time.sleep(0.5)
+        after = health_checks()
+        pending = set(address for address in pending
+                      if after.get(address, 0) <= before.get(address, 0))
+
+    report["round_duration_s"] = round(time.time() - started, 3)
+    report["health_check_period_s"] = \
+        HEALTH_CHECK_SETTINGS["pgautofailover.health_check_period"] / 1000.0
+
+    assert len(pending) == 0
+
+def test_005_accuracy():
+    behaviours = expected_behaviours()
+    health = node_health()
+    elapsed = time.time() - registered
+    cpu = bench.worker_cpu_seconds(worker_pids) - cpu_at_start
+
+    report["nodes"] = NODES
+    report["blackhole_pct"] = BLACKHOLE_PCT
+    report["refuse_pct"] = REFUSE_PCT
+    report["latency_ms"] = LATENCY_MS
+    report["workers"] = len(worker_pids)
+    report["worker_cpu_s"] = round(cpu, 3)
+    report["worker_cpu_pct"] = round(100.0 * cpu / elapsed, 2)
+    report["healthy_marked_bad"] = \
+        sum(1 for address, behaviour in behaviours.items()
+            if behaviour == bench.ACCEPT and health.get(address) == 0)
+    report["unreachable_not_marked_bad"] = \
+        sum(1 for address, behaviour in behaviours.items()
+            if behaviour != bench.ACCEPT and health.get(address) != 0)
+    report["health_unknown"] = \
+        sum(1 for address in behaviours if health.get(address) == -1)
+
+    os.makedirs(os.path.dirname(REPORT), exist_ok=True)
+    with open(REPORT, "w") as f:
+        json.dump(report, f, indent=2)
+    print("health check scale: %s" % json.dumps(report))
+
+    assert report["healthy_marked_bad"] == 0
+    assert report["unreachable_not_marked_bad"] == 0
+    assert report["health_unknown"] == 0
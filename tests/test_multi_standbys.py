@@ -0,0 +1,127 @@
+import time
+
+import pgautofailover_utils as pgautofailover
+from nose.tools import *
+
+cluster = None
+monitor = None
+node1 = None
+node2 = None
+node3 = None
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster()
+
+def teardown_module():
+    cluster.destroy()
+
+def wait_until_query_result(node, query, expected,
+                            timeout=pgautofailover.STATE_CHANGE_TIMEOUT):
+    for i in range(timeout):
+        if node.run_sql_query(query) == expected:
+            return True
+        time.sleep(1)
+    return False
+
+def test_000_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/multi/monitor")
+
+def test_001_init_primary():
+    global node1
+    node1 = cluster.create_datanode("/tmp/multi/node1")
+    node1.create()
+    node1.run()
+    assert node1.wait_until_state(target_state="single")
+
+def test_002_create_t1():
+    node1.run_sql_query("CREATE TABLE t1(a int)")
+    node1.run_sql_query("INSERT INTO t1 VALUES (1), (2)")
+
+def test_003_init_secondaries():
+    global node2, node3
+    node2 = cluster.create_datanode("/tmp/multi/node2")
+    node2.create()
+    node2.run()
+    assert node2.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+    node3 = cluster.create_datanode("/tmp/multi/node3")
+    node3.create()
+    node3.run()
+    assert node3.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+def test_004_slot_per_standby():
+    results = node1.run_sql_query(
+        "SELECT slot_name FROM pg_replication_slots ORDER BY slot_name")
+    assert results == [('pgautofailover_standby_2',),
+                       ('pgautofailover_standby_3',)]
+
+def test_005_read_from_secondaries():
+    assert node2.run_sql_query("SELECT * FROM t1 ORDER BY a") == [(1,), (2,)]
+    assert node3.run_sql_query("SELECT * FROM t1 ORDER BY a") == [(1,), (2,)]
+
+def test_006_node3_is_not_a_candidate():
+    monitor.run_sql_query(
+        """
+SELECT pgautofailover.set_node_candidate_priority(nodename, nodeport, 0)
+  FROM pgautofailover.node
+ WHERE nodeid = %s
+""",
+        node3.nodeid)
+
+def test_007_fail_primary():
+    node1.fail()
+
+    # node3 follows the new primary, which then has a synchronous standby
+    assert node2.wait_until_state(target_state="primary")
+    assert node3.wait_until_state(target_state="secondary")
+
+def test_008_writes_to_node2_reach_node3():
+    node2.run_sql_query("INSERT INTO t1 VALUES (3)")
+    results = node3.run_sql_query("SELECT * FROM t1 ORDER BY a")
+    assert results == [(1,), (2,), (3,)]
+
+def test_009_start_node1_again():
+    node1.run()
+    assert node1.wait_until_state(target_state="secondary")
+    assert node2.wait_until_state(target_state="primary")
+
+def test_010_slots_on_new_primary():
+    results = node2.run_sql_query(
+        "SELECT slot_name FROM pg_replication_slots ORDER BY slot_name")
+    assert results == [('pgautofailover_standby_1',),
+                       ('pgautofailover_standby_3',)]
+
+def test_011_cascade_within_zone():
+    for node in (node1, node3):
+        monitor.run_sql_query(
+            """
+SELECT pgautofailover.set_node_zone(nodename, nodeport, 'zone-b')
+  FROM pgautofailover.node
+ WHERE nodeid = %s
+""",
+            node.nodeid)
+
+    # node1 is the first secondary of the zone, and node3 streams from it
+    assert wait_until_query_result(
+        node1, "SELECT count(*) FROM pg_stat_replication", [(1,)])
+    assert node3.wait_until_state(target_state="secondary")
+    assert node2.wait_until_state(target_state="primary")
+
+def test_012_writes_to_node2_reach_node3_through_node1():
+    node2.run_sql_query("INSERT INTO t1 VALUES (4)")
+    assert wait_until_query_result(
+        node3, "SELECT * FROM t1 ORDER BY a", [(1,), (2,), (3,), (4,)])
+
+def test_013_primary_waits_for_node1_only():
+    # node3 streams from node1, and node2 lists standbys by application_name
+    assert wait_until_query_result(
+        node2, "SHOW synchronous_standby_names",
+        [('ANY 1 (pgautofailover_standby_1)',)])
+
+    results = node2.run_sql_query(
+        "SELECT application_name FROM pg_stat_replication")
+    assert results == [('pgautofailover_standby_1',)]
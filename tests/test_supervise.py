@@ -0,0 +1,73 @@
+import os
+import time
+
+import pgautofailover_utils as pgautofailover
+from nose.tools import *
+
+cluster = None
+node1 = None
+node2 = None
+supervisor = None
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster()
+
+def teardown_module():
+    cluster.destroy()
+
+def test_000_create_monitor():
+    cluster.create_monitor("/tmp/supervise/monitor")
+
+def test_001_init_primary():
+    global node1
+    node1 = cluster.create_datanode("/tmp/supervise/node1")
+    node1.create()
+    node1.run()
+    assert node1.wait_until_state(target_state="single")
+
+def test_002_init_secondary():
+    global node2
+    node2 = cluster.create_datanode("/tmp/supervise/node2", port=5433,
+                                    vnode=node1.vnode)
+    node2.create()
+    node2.run()
+    assert node2.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+def test_003_supervise_both_nodes():
+    global supervisor
+    for node in [node1, node2]:
+        proc = node.pg_autoctl_run_proc
+        node.stop_pg_autoctl()
+        proc.wait(timeout=pgautofailover.COMMAND_TIMEOUT)
+
+    supervisor = cluster.supervise([node1, node2])
+
+    assert node1.wait_until_state(target_state="primary")
+    assert node2.wait_until_state(target_state="secondary")
+    assert supervisor.poll() is None
+
+def test_004_failover_with_supervisor():
+    cluster.monitor.failover()
+    assert node2.wait_until_state(target_state="primary")
+    assert node1.wait_until_state(target_state="secondary")
+
+def test_005_pid_file_mismatch_stops_one_keeper():
+    # another process of the same user now claims the pid file of node1
+    with open(os.path.join(node1.datadir, "postmaster.pid"), "r") as p:
+        otherpid = int(p.readline())
+
+    with open(node1.pid_file_path(), "w") as pidfile:
+        pidfile.write("%d\n" % otherpid)
+
+    # the supervisor keeps running the keeper of node2
+    time.sleep(10)
+    assert supervisor.poll() is None
+    assert node2.get_state() == "primary"
+
+    # and leaves the pid file of node1 alone
+    with open(node1.pid_file_path(), "r") as pidfile:
+        assert int(pidfile.readline()) == otherpid
+
+    os.remove(node1.pid_file_path())
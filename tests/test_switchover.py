@@ -0,0 +1,54 @@
+import pgautofailover_utils as pgautofailover
+from nose.tools import *
+
+cluster = None
+monitor = None
+node1 = None
+node2 = None
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster()
+
+def teardown_module():
+    cluster.destroy()
+
+def test_000_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/switchover/monitor")
+
+def test_001_init_primary():
+    global node1
+    node1 = cluster.create_datanode("/tmp/switchover/node1")
+    node1.create()
+    node1.run()
+    assert node1.wait_until_state(target_state="single")
+
+def test_002_create_t1():
+    node1.run_sql_query("CREATE TABLE t1(a int)")
+    node1.run_sql_query("INSERT INTO t1 VALUES (1), (2)")
+
+def test_003_init_secondary():
+    global node2
+    node2 = cluster.create_datanode("/tmp/switchover/node2")
+    node2.create()
+    node2.run()
+    assert node2.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+def test_004_switchover():
+    # the promotion goes through prepare_promotion -> wait_primary, which
+    # has no coordinator metadata to update in a pgsql formation
+    monitor.switchover()
+    assert node2.wait_until_state(target_state="primary")
+    assert node1.wait_until_state(target_state="secondary")
+
+def test_005_writes_to_node2_succeed():
+    node2.run_sql_query("INSERT INTO t1 VALUES (3)")
+    results = node2.run_sql_query("SELECT * FROM t1 ORDER BY a")
+    assert results == [(1,), (2,), (3,)]
+
+def test_006_switchover_back():
+    monitor.switchover()
+    assert node1.wait_until_state(target_state="primary")
+    assert node2.wait_until_state(target_state="secondary")